@@ -0,0 +1,31 @@
+# - Try to find nvJPEG, the CUDA JPEG codec library (CUDA 10 and later)
+#
+# The following variables are optionally searched for defaults
+#  NVJPEG_ROOT_DIR:    Base directory where all nvJPEG components are found
+#
+# The following are set after configuration is done:
+#  NVJPEG_FOUND
+#  NVJPEG_INCLUDE_DIRS
+#  NVJPEG_LIBRARIES
+
+include(FindPackageHandleStandardArgs)
+
+set(NVJPEG_ROOT_DIR "/usr/local/cuda" CACHE PATH "Folder contains nvJPEG")
+
+if (NOT "$ENV{NvJpeg_DIR}" STREQUAL "")
+  set(NVJPEG_ROOT_DIR $ENV{NvJpeg_DIR})
+endif()
+
+find_path(NVJPEG_INCLUDE_DIR nvjpeg.h
+  PATHS ${NVJPEG_ROOT_DIR}/include)
+
+find_library(NVJPEG_LIBRARY nvjpeg
+  PATHS ${NVJPEG_ROOT_DIR}/lib64 ${NVJPEG_ROOT_DIR}/lib)
+
+find_package_handle_standard_args(NVJPEG DEFAULT_MSG
+    NVJPEG_INCLUDE_DIR NVJPEG_LIBRARY)
+
+if(NVJPEG_FOUND)
+    set(NVJPEG_INCLUDE_DIRS ${NVJPEG_INCLUDE_DIR})
+    set(NVJPEG_LIBRARIES ${NVJPEG_LIBRARY})
+endif()
@@ -0,0 +1,32 @@
+# - Try to find TensorRT
+#
+# The following variables are optionally searched for defaults
+#  TENSORRT_ROOT_DIR:    Base directory where all TensorRT components are found
+#
+# The following are set after configuration is done:
+#  TENSORRT_FOUND
+#  TENSORRT_INCLUDE_DIRS
+#  TENSORRT_LIBRARIES
+
+include(FindPackageHandleStandardArgs)
+
+set(TENSORRT_ROOT_DIR "" CACHE PATH "Folder contains TensorRT")
+
+if (NOT "$ENV{TensorRT_DIR}" STREQUAL "")
+  set(TENSORRT_ROOT_DIR $ENV{TensorRT_DIR})
+endif()
+
+find_path(TENSORRT_INCLUDE_DIR NvInfer.h
+  PATHS ${TENSORRT_ROOT_DIR}/include)
+
+find_library(TENSORRT_LIBRARY nvinfer PATHS ${TENSORRT_ROOT_DIR}/lib)
+find_library(TENSORRT_CAFFE_PARSER_LIBRARY nvcaffe_parser
+  PATHS ${TENSORRT_ROOT_DIR}/lib)
+
+find_package_handle_standard_args(TENSORRT DEFAULT_MSG
+    TENSORRT_INCLUDE_DIR TENSORRT_LIBRARY TENSORRT_CAFFE_PARSER_LIBRARY)
+
+if(TENSORRT_FOUND)
+    set(TENSORRT_INCLUDE_DIRS ${TENSORRT_INCLUDE_DIR})
+    set(TENSORRT_LIBRARIES ${TENSORRT_LIBRARY} ${TENSORRT_CAFFE_PARSER_LIBRARY})
+endif()
@@ -8,8 +8,14 @@ class PoseDrawKernel(scannerpy.Kernel):
     def close(self):
         pass
 
-    def execute(self, input_columns):
+    def output_frame_shapes(self, input_columns):
         frame = input_columns[0]
+        return [(frame.shape, frame.dtype)]
+
+    def execute(self, input_columns, outputs):
+        # Input frames are read-only, so draw on the output frame
+        frame = outputs[0]
+        frame[:] = input_columns[0]
         frame_poses = input_columns[1]
         for pose in parsers.poses(frame_poses, self.protobufs):
             for i in range(18):
@@ -1,12 +1,16 @@
 from scannerpy import Database, DeviceType
-from scannerpy.stdlib import NetDescriptor, parsers, bboxes
+from scannerpy.stdlib import NetDescriptor, parsers, bboxes, ivfpq
 import numpy as np
-import faiss
 import cv2
 import sys
 import random
 
 STATIC_DIR = 'examples/reverse_image_search/static'
+# Vectors sampled to train the index, and its shape
+TRAIN_SAMPLES = 50000
+NUM_LISTS = 1024
+NUM_SUBQUANTIZERS = 64
+NPROBE = 16
 
 db = Database(debug=True)
 
@@ -49,20 +53,27 @@ def build_index():
     output_table = db.table('example_frcnn')
     # bboxes.draw(example, output_table, 'example_bboxes.mkv')
 
-    fvec_index = faiss.IndexFlatL2(4096)
-    bbox_index = []
-    for (frame, bboxes), (_, vec) in \
-        zip(output_table.load([0], parsers.bboxes),
-            output_table.load([1], parse_fvec)):
-        # TODO(wcrichto): fix this frame*24 hack
-        if len(vec) > 0:
-            fvec_index.add(np.array(vec))
-            for bbox in bboxes:
-                bbox_index.append((frame*24, bbox))
-
-    return fvec_index, bbox_index
-
-def query(path, fvec_index, bbox_index):
+    # The index is trained on a sample of the features, then every feature
+    # is encoded by a Scanner job into a table sharded like any other
+    sample = []
+    for _, vec in output_table.load([1], parse_fvec):
+        sample.extend(vec)
+        if len(sample) >= TRAIN_SAMPLES:
+            break
+    index_args = ivfpq.train(db.protobufs, np.array(sample), NUM_LISTS,
+                             NUM_SUBQUANTIZERS)
+
+    if not db.has_table('example_ivfpq'):
+        print('Encoding features...')
+        features = db.ops.Input(["features"])
+        codes = db.ops.IVFPQEncode(inputs=[(features, ["features"])],
+                                   args=index_args)
+        db.run(db.sampler().all([('example_frcnn', 'example_ivfpq')]),
+               codes, force=True)
+
+    return index_args
+
+def query(path, index_args):
     print('Running query with image {}'.format(path))
     with open(path) as f:
         t = f.read()
@@ -83,8 +94,27 @@ def query(path, fvec_index, bbox_index):
         print('Error: could not find an object in query image.')
         return []
 
-    _, neighbors = fvec_index.search(np.array(qvecs[:1]), 50)
-    return [bbox_index[i] for i in neighbors[0]]
+    # Each worker scores only the probed lists of its rows
+    search_args = ivfpq.search_args(db.protobufs, index_args, qvecs[:1],
+                                    nprobe=NPROBE, k=50)
+    codes = db.ops.Input(["codes"])
+    neighbors = db.ops.IVFPQSearch(inputs=[(codes, ["codes"])],
+                                   args=search_args)
+    [neighbors_table] = db.run(
+        db.sampler().all([('example_ivfpq', 'query_neighbors')]),
+        neighbors, force=True)
+    [nearest] = ivfpq.merge(
+        db.table('query_neighbors').column('neighbors').load(
+            ivfpq.neighbors), 50)
+
+    output_table = db.table('example_frcnn')
+    results = []
+    for _, row, index in nearest:
+        _, row_bboxes = next(output_table.load([0], parsers.bboxes,
+                                               rows=[row]))
+        # TODO(wcrichto): fix this frame*24 hack
+        results.append((row * 24, row_bboxes[index]))
+    return results
 
 def visualize(results):
     example = db.table('example')
@@ -112,8 +142,8 @@ def visualize(results):
 
 def main():
     path = sys.argv[1] if len(sys.argv) > 1 else '{}/query.jpg'.format(STATIC_DIR)
-    fvec_index, bbox_index = build_index()
-    results = query(path, fvec_index, bbox_index)
+    index_args = build_index()
+    results = query(path, index_args)
     visualize(results)
 
 if __name__ == "__main__":
@@ -40,7 +40,8 @@ class Kernel(pykernel.TensorFlowKernel):
 
     def execute(self, cols):
         print 'Execute'
-        image = cols[0]
+        # Input frames are read-only views
+        image = cols[0].copy()
         image_tensor = self.graph.get_tensor_by_name('image_tensor:0')
         boxes = self.graph.get_tensor_by_name('detection_boxes:0')
         scores = self.graph.get_tensor_by_name('detection_scores:0')
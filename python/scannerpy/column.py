@@ -9,6 +9,52 @@ from subprocess import Popen, PIPE
 import tempfile
 import os
 
+
+def _keyframe_index_entries(vd):
+    """
+    Keyframe positions and timestamps of a VideoDescriptor's compact
+    keyframe index.
+    """
+    data = bytearray(vd.keyframe_index)
+    positions = []
+    timestamps = []
+    pos = 0
+    k = 0
+    position = 0
+    timestamp = 0
+    while pos < len(data):
+        if k % vd.keyframe_index_block_size == 0:
+            position = 0
+            timestamp = 0
+        # Position, timestamp and byte offset as zigzag varints
+        values = []
+        for _ in range(3):
+            v = 0
+            shift = 0
+            while True:
+                byte = data[pos]
+                pos += 1
+                v |= (byte & 0x7f) << shift
+                shift += 7
+                if not byte & 0x80:
+                    break
+            values.append((v >> 1) ^ -(v & 1))
+        position += values[0]
+        timestamp += values[1]
+        positions.append(position)
+        timestamps.append(timestamp)
+        k += 1
+    return positions, timestamps
+
+# Rows read from storage per request when loading a column
+LOAD_CHUNK_ROWS = 10000
+
+# Frames decoded per native read when loading a video column
+LOAD_CHUNK_FRAMES = 256
+
+# Indexed by the FrameType enum of metadata.proto
+FRAME_DTYPES = [np.uint8, np.float32, np.float64, np.float16]
+
 class Column:
     """
     A column of a Table.
@@ -32,6 +78,19 @@ class Column:
             self._descriptor = descriptor
             self._video_descriptor = video_descriptor
 
+    def _item_video_descriptors(self):
+        # Tables extended with append_videos have a descriptor per item
+        self._load_meta()
+        num_items = len(self._table._descriptor.end_rows)
+        descriptors = [self._video_descriptor]
+        for item_id in range(1, num_items):
+            descriptors.append(self._db._load_descriptor(
+                self._db.protobufs.VideoDescriptor,
+                'tables/{:d}/{:d}_{:d}_video_metadata.bin'.format(
+                    self._table._descriptor.id, self._descriptor.id,
+                    item_id)))
+        return descriptors
+
     def name(self):
         return self._name
 
@@ -43,80 +102,130 @@ class Column:
         self._load_meta()
         return self._descriptor.id
 
-    def _load_output_file(self, item_id, rows, fn=None):
-        assert len(rows) > 0
+    def keyframes(self):
+        """
+        Rows of the keyframes of a video column, in increasing order.
+        """
+        keyframes = []
+        for _, _, positions, _, _ in self._keyframe_segments():
+            keyframes.extend(positions)
+        return keyframes
 
+    def keyframe_times(self):
+        """
+        Presentation time in seconds of each keyframe returned by keyframes().
+        Encoded videos appended after the first continue from where the
+        previous one ended, so times increase over the whole column.
+        """
+        times = []
+        time_offset = 0.0
+        for frame_offset, frames, positions, timestamps, vd in \
+                self._keyframe_segments():
+            seconds = self.frame_duration(vd)
+            segment = [time_offset + (t - timestamps[0]) * seconds
+                       for t in timestamps]
+            times.extend(segment)
+            # Estimate where the segment ends from its average frame rate
+            duration = seconds
+            if len(positions) > 1 and positions[-1] > positions[0]:
+                duration = ((segment[-1] - segment[0]) /
+                            (positions[-1] - positions[0]))
+            time_offset = (segment[-1] +
+                           (frame_offset + frames - positions[-1]) *
+                           duration)
+        return times
+
+    def frame_duration(self, vd=None):
+        """Seconds per tick of the video's time base."""
+        self._load_meta()
+        vd = vd or self._video_descriptor
+        if vd.time_base_num <= 0 or vd.time_base_denom <= 0:
+            return 1.0 / 25
+        return vd.time_base_num / float(vd.time_base_denom)
+
+    def _keyframe_segments(self):
+        # Yields (first row, frames, keyframe rows, keyframe timestamps,
+        # descriptor) of each encoded video of the column that has keyframes
+        self._load_meta()
+        if (self._descriptor.type != self._db.protobufs.Video or
+            self._video_descriptor.codec_type ==
+            self._db.protobufs.VideoDescriptor.RAW):
+            raise ScannerException(
+                'Column {} is not an encoded video'.format(self._name))
+        frame_offset = 0
+        for vd in self._item_video_descriptors():
+            if vd.keyframe_index_block_size > 0:
+                # Compact index positions are relative to the whole item
+                positions, timestamps = _keyframe_index_entries(vd)
+                if len(positions) > 0:
+                    yield (frame_offset, vd.frames,
+                           [p + frame_offset for p in positions],
+                           timestamps, vd)
+                frame_offset += vd.frames
+                continue
+            keyframe_offset = 0
+            for v in range(vd.num_encoded_videos):
+                k = vd.keyframes_per_video[v]
+                if k > 0:
+                    yield (frame_offset, vd.frames_per_video[v],
+                           [p + frame_offset for p in
+                            vd.keyframe_positions[keyframe_offset:
+                                                  keyframe_offset + k]],
+                           list(vd.keyframe_timestamps[keyframe_offset:
+                                                       keyframe_offset + k]),
+                           vd)
+                frame_offset += vd.frames_per_video[v]
+                keyframe_offset += k
+
+    def _load_item_elements(self, item_id, rows):
+        # Returns the requested rows of an item packed into one uint8 array,
+        # along with the offset of each row in it
+        if (self._table._descriptor.packed_items and
+                self._descriptor.type != self._db.protobufs.Video):
+            path = '{}/tables/{}/{}_packed.bin'.format(
+                self._db_path, self._table._descriptor.id, item_id)
+            return self._db._bindings.load_packed_item_elements(
+                self._db.config.storage_config, path, self._descriptor.id,
+                list(rows), self._descriptor.codec)
         metadata_path = '{}/tables/{}/{}_{}_metadata.bin'.format(
             self._db_path, self._table._descriptor.id,
             self._descriptor.id, item_id)
-        try:
-            metadata_contents = self._storage.read(metadata_path)
-        except UserWarning:
-            raise ScannerException('Path {} does not exist'.format(
-                metadata_path))
-
         path = '{}/tables/{}/{}_{}.bin'.format(
             self._db_path, self._table._descriptor.id,
             self._descriptor.id, item_id)
-        try:
-            contents = self._storage.read(path)
-        except UserWarning:
-            raise ScannerException('Path {} does not exist'.format(path))
+        return self._db._bindings.load_item_elements(
+            self._db.config.storage_config, metadata_path, path, list(rows),
+            self._descriptor.codec)
 
-        lens = []
-        total_rows = 0
-        i = 0
-        while i < len(metadata_contents):
-            (num_rows,) = struct.unpack("=Q", metadata_contents[i:i+8])
-            total_rows += num_rows
-            i += 8
-            for fi in range(num_rows):
-                (buf_len,) = struct.unpack("=Q", metadata_contents[i:i+8])
-                lens.append(buf_len)
-                i += 8
-
-        start_pos = None
-        pos = 0
-        rows = rows if len(rows) > 0 else range(total_rows)
-        for fi in range(total_rows):
-            old_pos = pos
-            pos += lens[fi]
-            if start_pos is None:
-                start_pos = old_pos
+    def _load_output_file(self, item_id, rows, fn=None):
+        assert len(rows) > 0
 
-        rows_idx = 0
-        i = start_pos
-        for j, buf_len in enumerate(lens):
-            if rows_idx < len(rows) and j == rows[rows_idx]:
-                buf = contents[i:i+buf_len]
-                # len(buf) == 0 when element is null
-                if len(buf) == 0:
+        # Rows are read natively in chunks, so only one chunk of a large
+        # item is held in memory at a time
+        for start in range(0, len(rows), LOAD_CHUNK_ROWS):
+            data, offsets = self._load_item_elements(
+                item_id, rows[start:start + LOAD_CHUNK_ROWS])
+            for i in range(len(offsets) - 1):
+                # Empty when element is null
+                if offsets[i] == offsets[i + 1]:
                     yield None
-                elif fn is not None:
+                    continue
+                buf = data[offsets[i]:offsets[i + 1]].tobytes()
+                if fn is not None:
                     yield fn(buf, self._db.protobufs)
                 else:
                     yield buf
-                rows_idx += 1
-            i += buf_len
 
-    def _load(self, fn=None, rows=None):
+    def _item_rows(self, rows):
+        # Splits table rows into (item id, rows within the item) pairs
         table_descriptor = self._table._descriptor
         total_rows = table_descriptor.end_rows[-1]
-
-        # Integer divide, round up
-        num_items = len(table_descriptor.end_rows)
-        bufs = []
-        input_rows = list(range(self._table.num_rows()))
-        assert len(input_rows) == total_rows
-        i = 0
-        rows_so_far = 0
-        rows_idx = 0
         rows = range(total_rows) if rows is None else rows
+        rows_idx = 0
         prev = 0
-        for item_id in range(num_items):
+        for item_id in range(len(table_descriptor.end_rows)):
             start_row = prev
             end_row = table_descriptor.end_rows[item_id]
-            item_rows = end_row - start_row
             prev = end_row
             select_rows = []
             while rows_idx < len(rows):
@@ -127,10 +236,137 @@ class Column:
                 else:
                     break
             if select_rows:
-                for output in self._load_output_file(item_id, select_rows, fn):
-                    yield (input_rows[i], output)
-                    i += 1
-            rows_so_far += item_rows
+                if item_id in table_descriptor.failed_items:
+                    raise ScannerException(
+                        ('Rows {:d} to {:d} of table {:s} failed to compute, '
+                         'see Table.failed_rows').format(
+                             start_row, end_row, self._table.name()))
+                yield item_id, select_rows
+
+    def _load(self, fn=None, rows=None):
+        input_rows = list(range(self._table.num_rows()))
+        assert len(input_rows) == self._table._descriptor.end_rows[-1]
+        i = 0
+        for item_id, select_rows in self._item_rows(rows):
+            for output in self._load_output_file(item_id, select_rows, fn):
+                yield (input_rows[i], output)
+                i += 1
+
+    def load_array(self, dtype=np.uint8, rows=None):
+        """
+        Loads a column whose elements all have the same size as one numpy
+        array, with an element per row. Rows are not copied individually,
+        unlike load.
+
+        Kwargs:
+            dtype: Type the elements are made of. Ignored for raw frame
+                   columns, whose frames give the type and shape.
+            rows: Optional list of rows to load, in increasing order.
+
+        Returns:
+            Array of shape (rows, element size / dtype size), or (rows,
+            height, width, channels) for raw frame columns.
+        """
+        self._load_meta()
+        shape = None
+        if self._descriptor.type == self._db.protobufs.Video:
+            if (self._video_descriptor.codec_type !=
+                self._db.protobufs.VideoDescriptor.RAW):
+                raise ScannerException(
+                    'Column {} is an encoded video'.format(self._name))
+            dtype = FRAME_DTYPES[self._video_descriptor.frame_type]
+            shape = (self._video_descriptor.height,
+                     self._video_descriptor.width,
+                     self._video_descriptor.channels)
+
+        arrays = []
+        for item_id, select_rows in self._item_rows(rows):
+            data, offsets = self._load_item_elements(item_id, select_rows)
+            sizes = np.diff(offsets)
+            if len(sizes) > 0 and (sizes.min() != sizes.max() or
+                                   sizes[0] == 0):
+                raise ScannerException(
+                    'Column {} has elements of differing sizes or null '
+                    'elements'.format(self._name))
+            arrays.append(data.view(dtype).reshape(
+                (len(select_rows),) + (shape or (-1,))))
+        if not arrays:
+            return np.empty((0,) + (shape or (0,)), dtype=dtype)
+        return arrays[0] if len(arrays) == 1 else np.concatenate(arrays)
+
+    def to_arrow(self, rows=None):
+        """
+        Loads the column as an Arrow array, with a chunk per table item. The
+        loaded element data and row offsets become the Arrow buffers as they
+        are, without copying rows: columns whose elements all have the same
+        size, like raw frame columns, are fixed size binary, and the others
+        large binary indexed by the row offsets. Empty elements are null.
+
+        Kwargs:
+            rows: Optional list of rows to load, in increasing order.
+
+        Returns:
+            pyarrow.ChunkedArray with an element per row.
+        """
+        import pyarrow as pa
+
+        self._load_meta()
+        if (self._descriptor.type == self._db.protobufs.Video and
+            self._video_descriptor.codec_type !=
+            self._db.protobufs.VideoDescriptor.RAW):
+            raise ScannerException(
+                'Column {} is an encoded video, whose frames can not be '
+                'exported without decoding them'.format(self._name))
+
+        items = [self._load_item_elements(item_id, select_rows)
+                 for item_id, select_rows in self._item_rows(rows)]
+        sizes = [np.diff(offsets) for _, offsets in items]
+        all_sizes = np.concatenate(sizes) if sizes else np.empty(0)
+        fixed_size = (len(all_sizes) > 0 and all_sizes.min() > 0 and
+                      all_sizes.min() == all_sizes.max())
+
+        chunks = []
+        for (data, offsets), item_sizes in zip(items, sizes):
+            num_rows = len(item_sizes)
+            if fixed_size:
+                chunks.append(pa.Array.from_buffers(
+                    pa.binary(int(all_sizes[0])), num_rows,
+                    [None, pa.py_buffer(data)]))
+                continue
+            valid = item_sizes > 0
+            validity = (None if valid.all() else
+                        pa.array(valid, type=pa.bool_()).buffers()[1])
+            chunks.append(pa.Array.from_buffers(
+                pa.large_binary(), num_rows,
+                [validity, pa.py_buffer(offsets.astype(np.int64, copy=False)),
+                 pa.py_buffer(data)]))
+        value_type = (pa.binary(int(all_sizes[0])) if fixed_size else
+                      pa.large_binary())
+        return pa.chunked_array(chunks, type=value_type)
+
+    def load_frames(self, rows=None):
+        """
+        Reads the frames of a video column in this process, decoding encoded
+        video natively instead of running a job.
+
+        Kwargs:
+            rows: Optional list of rows to load, in increasing order.
+
+        Returns:
+            Generator of (row, frame) pairs. Frames of encoded video are RGB.
+        """
+        self._load_meta()
+        if self._descriptor.type != self._db.protobufs.Video:
+            raise ScannerException(
+                'Column {} is not a video column'.format(self._name))
+        rows = list(range(self._table.num_rows())) if rows is None else rows
+        reader = self._db._table_reader()
+        for start in range(0, len(rows), LOAD_CHUNK_FRAMES):
+            chunk = rows[start:start + LOAD_CHUNK_FRAMES]
+            frames = reader.read(self._table._descriptor.id,
+                                 self._descriptor.id, chunk)
+            for row, frame in zip(chunk, frames):
+                yield (row, frame)
 
     # TODO(wcrichto): don't show progress bar when running decode png
     def load(self, fn=None, rows=None):
@@ -151,8 +387,8 @@ class Column:
         # If the column is a video, then dump the requested frames to disk as
         # PNGs and return the decoded PNGs
         if (self._descriptor.type == self._db.protobufs.Video and
-            self._video_descriptor.codec_type ==
-            self._db.protobufs.VideoDescriptor.H264):
+            self._video_descriptor.codec_type !=
+            self._db.protobufs.VideoDescriptor.RAW):
             png_table_name = self._db._png_dump_prefix.format(self._table.name())
             if self._db.has_table(png_table_name):
                 png_table = self._db.table(png_table_name)
@@ -178,13 +414,7 @@ class Column:
             [out_tbl] = self._db.run(bulk_job, force=True, show_progress=False)
             return out_tbl.load(['img'], parsers.image)
         elif self._descriptor.type == self._db.protobufs.Video:
-            frame_type = self._video_descriptor.frame_type
-            if frame_type == self._db.protobufs.U8:
-                dtype = np.uint8
-            elif frame_type == self._db.protobufs.F32:
-                dtype = np.float32
-            elif frame_type == self._db.protobufs.F64:
-                dtype = np.float64
+            dtype = FRAME_DTYPES[self._video_descriptor.frame_type]
             parser_fn = parsers.raw_frame_gen(self._video_descriptor.height,
                                               self._video_descriptor.width,
                                               self._video_descriptor.channels,
@@ -193,21 +423,53 @@ class Column:
         else:
             return self._load(fn, rows=rows)
 
-    def save_mp4(self, output_name, fps=None, scale=None):
+    def save_mp4(self, output_name, fps=None, scale=None, rows=None):
+        """
+        Saves an encoded video column as output_name.mp4.
+
+        H.264 columns are remuxed natively without decoding, unless fps or
+        scale are given, in which case ffmpeg re-encodes the whole column.
+
+        Kwargs:
+            rows: Optional (start, end) range of rows to save. The range is
+                  widened to whole keyframe intervals since nothing is
+                  re-encoded.
+        """
         self._load_meta()
         if not (self._descriptor.type == self._db.protobufs.Video and
-                self._video_descriptor.codec_type ==
-                self._db.protobufs.VideoDescriptor.H264):
-            raise ScannerException('Attempted to save a non-h264-compressed '
+                self._video_descriptor.codec_type !=
+                self._db.protobufs.VideoDescriptor.RAW):
+            raise ScannerException('Attempted to save a non-compressed '
                                    'column as an mp4. Try compressing the '
                                    'column first by saving the output as '
                                    'an RGB24 frame')
+        if fps is None and scale is None:
+            start, end = rows or (0, self._table.num_rows())
+            error = self._db._bindings.export_mp4(
+                self._db.config.storage_config, str(self._db_path),
+                self._table._descriptor.id, self._descriptor.id, start, end,
+                '{}.mp4'.format(output_name))
+            if not error:
+                return
+            if rows is not None:
+                raise ScannerException(
+                    'Could not save rows of {}: {}'.format(self._name, error))
+        elif rows is not None:
+            raise ScannerException(
+                'Row ranges can not be saved with fps or scale')
         num_items = len(self._table._descriptor.end_rows)
 
-        paths = ['{}/tables/{:d}/{:d}_{:d}.bin'.format(
-            self._db._db_path,
-            self._table._descriptor.id, self._descriptor.id, item_id)
-                          for item_id in range(num_items)]
+        paths = []
+        for item_id, vd in enumerate(self._item_video_descriptors()):
+            if vd.source_path:
+                # Ingested in place, so the original video holds the
+                # bitstream
+                paths.append(vd.source_path)
+            else:
+                paths.append('{}/tables/{:d}/{:d}_{:d}.bin'.format(
+                    self._db._db_path,
+                    self._table._descriptor.id, self._descriptor.id,
+                    item_id))
         temp_paths = []
         for _ in range(len(paths)):
             fd, p = tempfile.mkstemp()
@@ -36,3 +36,54 @@ class ColumnType(enum.Enum):
             return protobufs.Video
         else:
             raise ScannerException('Invalid column type')
+
+
+def fill_gather_rows(args, rows):
+    """
+    Fills the rows of a gather protobuf (GatherSamplerArgs or a
+    GatherPartitionerArgs group), encoding each run of consecutive rows as a
+    [start, end) range so the job description grows with the number of runs
+    rather than rows.
+    """
+    starts = []
+    ends = []
+    for r in rows:
+        if ends and ends[-1] == r:
+            ends[-1] = r + 1
+        else:
+            starts.append(r)
+            ends.append(r + 1)
+    args.range_starts[:] = starts
+    args.range_ends[:] = ends
+
+
+def fill_adaptive_args(args, scores, threshold, min_gap, max_gap):
+    """
+    Fills the scores and thresholds of an AdaptiveSamplerArgs or
+    AdaptivePartitionerArgs. scores is either a sequence with a change score
+    per row or a Column of equally sized elements, such as the output of
+    FrameDifference, in which case each row's score is the mean of its
+    element.
+    """
+    if hasattr(scores, 'load_array'):
+        values = scores.load_array(np.float32)
+        scores = values.reshape(len(values), -1).mean(axis=1)
+    args.scores[:] = [float(s) for s in scores]
+    args.threshold = threshold
+    args.min_gap = min_gap
+    args.max_gap = max_gap if max_gap is not None else 0
+
+
+def fill_time_args(args, column, stride, ranges):
+    """
+    Fills a TimeSamplerArgs from a video column's keyframe times, so rows
+    are resolved from times by the workers.
+    """
+    args.clock.keyframe_positions[:] = column.keyframes()
+    args.clock.keyframe_times[:] = column.keyframe_times()
+    args.clock.num_rows = column._table.num_rows()
+    args.clock.frame_duration = column.frame_duration()
+    args.stride = stride
+    for start, end in (ranges or []):
+        args.starts.append(start)
+        args.ends.append(end)
@@ -44,9 +44,24 @@ class Config(object):
                 self.db_path = str(storage['db_path'])
             storage_config = self._make_storage_config(config)
 
+            # Local directory that workers keep blocks of remote table files
+            # in, up to cache_size bytes, evicting by cache_eviction (lru or
+            # lfu). Unset disables the disk cache.
+            storage = config['storage']
+            self.disk_cache_path = str(storage.get('cache_path', ''))
+            self.disk_cache_size = int(storage.get('cache_size', 0))
+            self.disk_cache_eviction = str(storage.get('cache_eviction', 'lru'))
+            if self.disk_cache_eviction not in ('lru', 'lfu'):
+                raise ScannerException(
+                    'cache_eviction must be lru or lfu, not {}'.format(
+                        self.disk_cache_eviction))
+
             self.master_address = 'localhost'
             self.master_port = '5001'
             self.worker_port = '5002'
+            # Ports Prometheus metrics are served on, 0 to not serve them
+            self.metrics_port = 0
+            self.worker_metrics_port = 0
             if 'network' in config:
                 network = config['network']
                 if 'master' in network:
@@ -55,6 +70,11 @@ class Config(object):
                     self.master_port = network['master_port'].encode('ascii', 'ignore')
                 if 'worker_port' in network:
                     self.worker_port = network['worker_port'].encode('ascii', 'ignore')
+                if 'metrics_port' in network:
+                    self.metrics_port = int(network['metrics_port'])
+                if 'worker_metrics_port' in network:
+                    self.worker_metrics_port = int(
+                        network['worker_metrics_port'])
 
         except KeyError as key:
             raise ScannerException('Scanner config missing key: {}'.format(key))
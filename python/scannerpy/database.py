@@ -10,7 +10,10 @@ import pickle
 import struct
 import signal
 import copy
+import getpass
+import tempfile
 import collections
+import warnings
 
 from timeit import default_timer as now
 from multiprocessing import Process, Queue
@@ -28,6 +31,7 @@ from sampler import Sampler
 from partitioner import TaskPartitioner
 from collection import Collection
 from table import Table
+from result_cache import ResultCache
 from column import Column
 from protobuf_generator import ProtobufGenerator
 
@@ -35,7 +39,11 @@ from storehousepy import StorageConfig, StorageBackend
 from job import Job
 from bulk_job import BulkJob
 
-def start_master(port=None, config=None, config_path=None, block=False, watchdog=True):
+# Must match DatabaseMetadata::DEFAULT_NUM_TABLE_SHARDS
+DEFAULT_NUM_TABLE_SHARDS = 1024
+
+def start_master(port=None, config=None, config_path=None, block=False,
+                 watchdog=True, metrics_port=None):
     """
     Start a master server instance on this node.
 
@@ -47,12 +55,17 @@ def start_master(port=None, config=None, config_path=None, block=False, watchdog
         block: If true, will wait until the server is shutdown. Server
                will not shutdown currently unless wait_For_server_shutdown
                is eventually called.
+        metrics_port: Port to serve Prometheus metrics on over HTTP, by
+                      default the config's metrics_port. 0 does not serve
+                      them.
 
     Returns:
         A cpp database instance.
     """
     config = config or Config(config_path)
     port = port or config.master_port
+    if metrics_port is None:
+        metrics_port = config.metrics_port
 
     # Load all protobuf types
     import libscanner as bindings
@@ -60,7 +73,7 @@ def start_master(port=None, config=None, config_path=None, block=False, watchdog
         config.storage_config,
         config.db_path,
         config.master_address + ':' + port)
-    result = bindings.start_master(db, port, watchdog)
+    result = bindings.start_master(db, port, watchdog, metrics_port)
     if not result.success:
         raise ScannerException('Failed to start master: {}'.format(result.msg))
     if block:
@@ -68,8 +81,22 @@ def start_master(port=None, config=None, config_path=None, block=False, watchdog
     return db
 
 
+def _worker_machine_params(bindings, config, machine_params=None):
+    # Adds the disk cache settings of the config to the machine parameters
+    import scanner.metadata_pb2 as metadata_types
+    params = metadata_types.MachineParameters()
+    params.ParseFromString(machine_params or
+                           bindings.default_machine_params())
+    if config.disk_cache_path and not params.disk_cache_path:
+        params.disk_cache_path = config.disk_cache_path
+        params.disk_cache_bytes = config.disk_cache_size
+        params.disk_cache_lfu = config.disk_cache_eviction == 'lfu'
+    return params.SerializeToString()
+
+
 def start_worker(master_address, machine_params=None, port=None, config=None,
-                 config_path=None, block=False, watchdog=True):
+                 config_path=None, block=False, watchdog=True,
+                 metrics_port=None):
     """
     Start a worker instance on this node.
 
@@ -85,12 +112,17 @@ def start_worker(master_address, machine_params=None, port=None, config=None,
         block: If true, will wait until the server is shutdown. Server
                will not shutdown currently unless wait_ror_server_shutdown
                is eventually called.
+        metrics_port: Port to serve Prometheus metrics on over HTTP, by
+                      default the config's worker_metrics_port. 0 does not
+                      serve them.
 
     Returns:
         A cpp database instance.
     """
     config = config or Config(config_path)
     port = port or config.worker_port
+    if metrics_port is None:
+        metrics_port = config.worker_metrics_port
 
     # Load all protobuf types
     import libscanner as bindings
@@ -99,8 +131,9 @@ def start_worker(master_address, machine_params=None, port=None, config=None,
         #storage_config,
         config.db_path,
         master_address)
-    machine_params = machine_params or bindings.default_machine_params()
-    result = bindings.start_worker(db, machine_params, str(port), watchdog)
+    machine_params = _worker_machine_params(bindings, config, machine_params)
+    result = bindings.start_worker(db, machine_params, str(port), watchdog,
+                                   metrics_port)
     if not result.success:
         raise ScannerException('Failed to start worker: {}'.format(result.msg))
     if block:
@@ -156,6 +189,7 @@ class Database:
         self._storage = self.config.storage
         self._cached_db_metadata = None
         self._png_dump_prefix = '__png_dump_{:s}'
+        self._reader = None
 
         self.ops = OpGenerator(self)
         self.sampler = Sampler(self)
@@ -193,19 +227,19 @@ class Database:
 
     def summarize(self):
         summary = ''
-        db_meta = self._load_db_metadata()
-        if len(db_meta.tables) == 0:
+        all_tables = self._all_tables()
+        if len(all_tables) == 0:
             return 'Your database is empty!'
 
         tables = [
             ('TABLES', [
-                ('Name', [t.name for t in db_meta.tables]),
+                ('Name', [name for (id, name) in all_tables]),
                 ('# rows', [
-                    str(self.table(t.id).num_rows()) for t in db_meta.tables
+                    str(self.table(id).num_rows()) for (id, name) in all_tables
                 ]),
                 ('Columns', [
-                    ', '.join(self.table(t.id).column_names())
-                    for t in db_meta.tables
+                    ', '.join(self.table(id).column_names())
+                    for (id, name) in all_tables
                 ]),
             ]),
         ]
@@ -239,6 +273,13 @@ class Database:
                 summary += row_fmt.format(*[c[i] for _, c in cols]) + '\n'
         return summary
 
+    def _table_reader(self):
+        # Created on first use, since it sets up a memory pool and caches
+        if self._reader is None:
+            self._reader = self._bindings.TableReader(
+                self.config.storage_config, str(self._db_path))
+        return self._reader
+
     def _load_descriptor(self, descriptor, path):
         d = descriptor()
         d.ParseFromString(
@@ -256,17 +297,74 @@ class Database:
                 self.protobufs.DatabaseDescriptor,
                 'db_metadata.bin')
             self._cached_db_metadata = desc
-            # table id cache
-            self._table_id = {}
-            self._table_name = {}
-            for i, table in enumerate(self._cached_db_metadata.tables):
-                if table.name in self._table_name:
-                    raise ScannerException(
-                        'Internal error: multiple tables with same name: {}'.format(name))
-                self._table_id[table.id] = i
-                self._table_name[table.name] = i
+            # Shards of the table index read so far, as dicts from table id
+            # to name keyed by ('name' or 'id', shard)
+            self._table_shards = {}
+            self._all_table_shards_loaded = desc.num_table_shards == 0
+            if desc.num_table_shards == 0:
+                # Database without a table index, its tables are listed in
+                # the descriptor
+                self._num_table_shards = DEFAULT_NUM_TABLE_SHARDS
+                for table in desc.tables:
+                    if self._table_id_for_name(table.name) is not None:
+                        raise ScannerException(
+                            'Internal error: multiple tables with same name: {}'
+                            .format(table.name))
+                    self._table_shard('name', self._name_shard(table.name))[
+                        table.id] = table.name
+                    self._table_shard(
+                        'id', table.id % self._num_table_shards)[
+                            table.id] = table.name
+            else:
+                self._num_table_shards = desc.num_table_shards
         return self._cached_db_metadata
 
+    def _name_shard(self, name):
+        # FNV-1a, as computed by DatabaseMetadata
+        data = name if isinstance(name, bytes) else name.encode('utf-8')
+        h = 2166136261
+        for c in bytearray(data):
+            h = ((h ^ c) * 16777619) & 0xffffffff
+        return h % self._num_table_shards
+
+    def _table_shard_path(self, kind, shard):
+        return 'table_index/{}_{}.bin'.format(kind, shard)
+
+    def _table_shard(self, kind, shard):
+        key = (kind, shard)
+        if key not in self._table_shards:
+            tables = {}
+            path = self._table_shard_path(kind, shard)
+            info = self._storage.get_file_info(
+                '{}/{}'.format(self._db_path, path))
+            if not self._all_table_shards_loaded and info.file_exists:
+                desc = self._load_descriptor(
+                    self.protobufs.TableIndexShard, path)
+                for table in desc.tables:
+                    tables[table.id] = table.name
+            self._table_shards[key] = tables
+        return self._table_shards[key]
+
+    def _table_id_for_name(self, name):
+        self._load_db_metadata()
+        for (id, table_name) in self._table_shard(
+                'name', self._name_shard(name)).items():
+            if table_name == name:
+                return id
+        return None
+
+    def _table_name_for_id(self, id):
+        self._load_db_metadata()
+        return self._table_shard('id', id % self._num_table_shards).get(id)
+
+    def _all_tables(self):
+        """(id, name) of every table in the database, ordered by id."""
+        self._load_db_metadata()
+        tables = {}
+        for shard in range(self._num_table_shards):
+            tables.update(self._table_shard('id', shard))
+        return sorted(tables.items())
+
     def _connect_to_worker(self, address):
         channel = grpc.insecure_channel(
             address,
@@ -371,9 +469,11 @@ class Database:
             if self._debug:
                 self._master_conn = None
                 self._worker_conns = None
-                machine_params = self._bindings.default_machine_params()
+                machine_params = _worker_machine_params(self._bindings,
+                                                        self.config)
                 res = self._bindings.start_master(
-                    self._db, self.config.master_port, True).success
+                    self._db, self.config.master_port, True,
+                    self.config.metrics_port).success
                 assert res
                 res = self._connect_to_master()
                 assert res
@@ -381,9 +481,12 @@ class Database:
                 self._start_heartbeat()
 
                 for i in range(len(self._worker_addresses)):
+                    worker_metrics_port = self.config.worker_metrics_port
                     res = self._bindings.start_worker(
                         self._db, machine_params,
-                        str(int(self.config.worker_port) + i), True).success
+                        str(int(self.config.worker_port) + i), True,
+                        worker_metrics_port + i if worker_metrics_port else 0
+                    ).success
                     assert res
             else:
                 master_port = self._master_address.partition(':')[2]
@@ -420,17 +523,29 @@ class Database:
                 # Start up heartbeat to keep master alive
                 self._start_heartbeat()
 
-                # Start workers now that master is ready
-                self._worker_conns = [
-                    self._run_remote_cmd(w, worker_cmd.format(
+                # Start workers now that master is ready. Resolving each
+                # host and opening its ssh session is a round trip, so they
+                # are all started at once.
+                def start_remote_worker(w):
+                    return self._run_remote_cmd(w, worker_cmd.format(
                         master=self._master_address,
                         config=pickled_config,
                         worker_port=w.partition(':')[2]))
-                    for w in self._worker_addresses]
+                pool = ThreadPool(min(len(self._worker_addresses), 64))
+                self._worker_conns = pool.map(start_remote_worker,
+                                              self._worker_addresses)
+                pool.close()
                 slept_so_far = 0
                 # Has to be this long for GCS
                 sleep_time = 60
                 while slept_so_far < sleep_time:
+                    # A worker whose ssh session ended will never register
+                    failed = [w for w, wc in zip(self._worker_addresses,
+                                                 self._worker_conns)
+                              if wc.poll() is not None]
+                    if failed:
+                        slept_so_far = sleep_time
+                        break
                     active_workers = self._master.ActiveWorkers(self.protobufs.Empty())
                     if (len(active_workers.workers) > len(self._worker_addresses)):
                         raise ScannerException(
@@ -444,9 +559,14 @@ class Database:
                 if slept_so_far >= sleep_time:
                     self._master_conn.kill()
                     for wc in self._worker_conns:
-                        wc.kill()
+                        if wc.poll() is None:
+                            wc.kill()
                     self._master_conn = None
                     self._worker_conns = None
+                    if failed:
+                        raise ScannerException(
+                            'Workers exited before connecting to master: ' +
+                            ', '.join(failed))
                     raise ScannerException(
                         'Timed out waiting for workers to connect to master')
         else:
@@ -488,6 +608,26 @@ class Database:
                    wc.kill()
                self._worker_conns = None
 
+    def drain_worker(self, address, deadline=60.0):
+        """
+        Drains the worker at address, e.g. when its node is about to be
+        preempted. The worker stops taking tasks, keeps running the ones it
+        has for up to deadline seconds, hands back the rest to the master to
+        run elsewhere and shuts down.
+
+        Args:
+          address: host:port of the worker.
+
+        Kwargs:
+          deadline: Seconds the worker may keep running its tasks.
+        """
+        channel = grpc.insecure_channel(
+            address,
+            options=[('grpc.max_message_length', 24499183 * 2)])
+        worker = self.protobufs.WorkerStub(channel)
+        self._try_rpc(lambda: worker.Drain(self.protobufs.DrainParameters(
+            deadline_ms=int(deadline * 1000))))
+
     def _try_rpc(self, fn):
         try:
             result = fn()
@@ -500,6 +640,19 @@ class Database:
 
         return result
 
+    def _task_events(self, ticket):
+        """
+        Yields the TaskEvents of a queued or running bulk job until it
+        finishes.
+        """
+        events = self._master.WatchJob(
+            self.protobufs.JobTicket(ticket=ticket))
+        try:
+            for event in events:
+                yield event
+        except grpc.RpcError as e:
+            raise ScannerException(e)
+
     def load_op(self, so_path, proto_path=None):
         """
         Loads a custom op into the Scanner runtime.
@@ -553,7 +706,17 @@ class Database:
             self.protobufs.add_module(proto_path)
         self._try_rpc(lambda: self._master.RegisterOp(op_registration))
 
-    def register_python_kernel(self, op_name, device_type, kernel_path):
+    def register_python_kernel(self, op_name, device_type, kernel_path,
+                               multiprocess=False):
+        """
+        Registers the kernel defined in the Python file at kernel_path.
+
+        Args:
+            multiprocess: If True, every instance of the kernel runs in its
+                own Python process and exchanges rows with the worker through
+                shared memory, so instances execute in parallel instead of
+                taking turns on the worker's GIL.
+        """
         with open(kernel_path, 'r') as f:
             kernel_str = f.read()
         py_registration = self.protobufs.PythonKernelRegistration()
@@ -562,6 +725,7 @@ class Database:
                                                           device_type)
         py_registration.kernel_str = kernel_str
         py_registration.pickled_config = pickle.dumps(self.config)
+        py_registration.multiprocess = multiprocess
         self._try_rpc(
             lambda: self._master.RegisterPythonKernel(py_registration))
 
@@ -621,7 +785,8 @@ class Database:
 
         return self.collection(collection_name)
 
-    def ingest_videos(self, videos, force=False):
+    def ingest_videos(self, videos, force=False, distributed=False,
+                      inplace=False, proxy_height=0):
         """
         Creates a Table from a video.
 
@@ -631,6 +796,18 @@ class Database:
 
         Kwargs:
             force: TODO(wcrichto)
+            distributed: Parse the videos on the workers of the cluster
+                         instead of only on the master. A failed worker's
+                         videos are parsed by the master.
+            inplace: Only index mp4 videos and read their bitstreams from
+                     the original files instead of copying them into the
+                     database. The files must stay in place and be
+                     readable by every worker. Other videos are copied.
+            proxy_height: If above zero, also store each video re-encoded
+                          with H.264 at this height in a 'frame_proxy'
+                          column. Jobs whose Resize of the 'frame' column
+                          can be done while decoding read the proxy instead
+                          when it is at least the resized size.
 
         Returns:
             (list of created Tables, list of (path, reason) failures to ingest)
@@ -653,6 +830,9 @@ class Database:
         ingest_params = self.protobufs.IngestParameters()
         ingest_params.table_names.extend(table_names)
         ingest_params.video_paths.extend(paths)
+        ingest_params.distributed = distributed
+        ingest_params.inplace = inplace
+        ingest_params.proxy_height = proxy_height
         ingest_result = self._try_rpc(
             lambda: self._master.IngestVideos(ingest_params))
         if not ingest_result.result.success:
@@ -664,7 +844,99 @@ class Database:
                 if p not in ingest_result.failed_paths],
                 failures)
 
-    def ingest_video_collection(self, collection_name, videos, force=False):
+    def append_videos(self, videos, inplace=False):
+        """
+        Extends ingested tables with newly recorded video segments.
+
+        Each segment becomes the next rows of its table, so a job can process
+        only the new footage with
+        `db.sampler.range(rows_before, table.num_rows())`.
+
+        Args:
+            videos: List of (table name, video path) tuples. Segments for the
+                    same table are appended in the order given and must match
+                    the resolution of the table.
+
+        Kwargs:
+            inplace: As in ingest_videos.
+
+        Returns:
+            (list of extended Tables, list of (path, reason) failures to
+             append)
+        """
+
+        if len(videos) == 0:
+            raise ScannerException('Must append at least one video.')
+
+        [table_names, paths] = zip(*videos)
+        for table_name in table_names:
+            if not self.has_table(table_name):
+                raise ScannerException(
+                    'Attempted to append to missing table {}'
+                    .format(table_name))
+        ingest_params = self.protobufs.IngestParameters()
+        ingest_params.table_names.extend(table_names)
+        ingest_params.video_paths.extend(paths)
+        ingest_params.inplace = inplace
+        ingest_params.append = True
+        ingest_result = self._try_rpc(
+            lambda: self._master.IngestVideos(ingest_params))
+        if not ingest_result.result.success:
+            raise ScannerException(ingest_result.result.msg)
+        failures = zip(ingest_result.failed_paths, ingest_result.failed_messages)
+
+        self._cached_db_metadata = None
+        appended = []
+        for t in table_names:
+            if t not in appended:
+                appended.append(t)
+        return ([self.table(t) for t in appended], failures)
+
+    def ingest_images(self, table_name, images, force=False):
+        """
+        Creates a Table from a list of still images.
+
+        The images are read in parallel batches and stored undecoded in the
+        'img' column, ready for the ImageDecoder op. Rows are grouped by
+        format, so the 'index' column holds the position in images of the
+        image of each row.
+
+        Args:
+            table_name: Name of the table to create.
+            images: List of JPEG or PNG image paths.
+
+        Kwargs:
+            force: Replace an existing table of the same name.
+
+        Returns:
+            (created Table, list of (path, reason) failures to ingest)
+        """
+
+        if len(images) == 0:
+            raise ScannerException('Must ingest at least one image.')
+
+        if self.has_table(table_name):
+            if force is True:
+                self.delete_tables([table_name])
+            else:
+                raise ScannerException(
+                    'Attempted to ingest over existing table {}'
+                    .format(table_name))
+        ingest_params = self.protobufs.IngestImagesParameters()
+        ingest_params.table_name = table_name
+        ingest_params.image_paths.extend(images)
+        ingest_result = self._try_rpc(
+            lambda: self._master.IngestImages(ingest_params))
+        if not ingest_result.result.success:
+            raise ScannerException(ingest_result.result.msg)
+        failures = zip(ingest_result.failed_paths, ingest_result.failed_messages)
+
+        self._cached_db_metadata = None
+        return (self.table(table_name), failures)
+
+    def ingest_video_collection(self, collection_name, videos, force=False,
+                                distributed=False, inplace=False,
+                                proxy_height=0):
         """
         Creates a Collection from a list of videos.
 
@@ -680,7 +952,9 @@ class Database:
         """
         table_names = ['{}:{:03d}'.format(collection_name, i)
                        for i in range(len(videos))]
-        tables, failures = self.ingest_videos(zip(table_names, videos), force)
+        tables, failures = self.ingest_videos(zip(table_names, videos), force,
+                                              distributed, inplace,
+                                              proxy_height)
         collection = self.new_collection(
             collection_name, tables, force)
         return collection, failures
@@ -700,20 +974,37 @@ class Database:
         return Collection(self, name, collection)
 
     def has_table(self, name):
-        db_meta = self._load_db_metadata()
-        if name in self._table_name:
-            return True
-        return False
+        return self._table_id_for_name(name) is not None
+
+    def _interrupted_bulk_job(self, table_name):
+        return self.table(table_name)._interrupted()
 
     def delete_tables(self, names):
         db_meta = self._load_db_metadata()
-        idxs_to_delete = []
+        if self._all_table_shards_loaded:
+            # Convert a database without a table index, as the C++ side does
+            # the next time it writes one
+            changed = set(self._table_shards.keys())
+        else:
+            changed = set()
         for name in names:
-            assert name in self._table_name
-            idxs_to_delete.append(self._table_name[name])
-        idxs_to_delete.sort()
-        for idx in reversed(idxs_to_delete):
-            del db_meta.tables[idx]
+            id = self._table_id_for_name(name)
+            assert id is not None
+            name_key = ('name', self._name_shard(name))
+            id_key = ('id', id % self._num_table_shards)
+            del self._table_shards[name_key][id]
+            del self._table_shards[id_key][id]
+            changed.add(name_key)
+            changed.add(id_key)
+        for (kind, shard) in changed:
+            desc = self.protobufs.TableIndexShard()
+            for (id, name) in sorted(self._table_shards[(kind, shard)].items()):
+                table = desc.tables.add()
+                table.id = id
+                table.name = name
+            self._save_descriptor(desc, self._table_shard_path(kind, shard))
+        del db_meta.tables[:]
+        db_meta.num_table_shards = self._num_table_shards
         self._save_descriptor(db_meta, 'db_metadata.bin')
         self._cached_db_metadata = None
         self._load_db_metadata()
@@ -721,6 +1012,109 @@ class Database:
     def delete_table(self, name):
         self.delete_tables([name])
 
+    def compact_table(self, name, item_bytes=64 * 1024 * 1024):
+        """
+        Merges the items of a table into fewer, larger ones.
+
+        Tables written with a small io_packet_size are split into many small
+        files, which are slow to list and open. This rewrites runs of
+        consecutive items into items of at least item_bytes. Readers see the
+        old items until the new ones are all written. The table keeps its
+        name but gets a new id. Tables with video columns are not supported.
+
+        Args:
+            name: String name of the table to compact
+
+        Kwargs:
+            item_bytes: Bytes of data in each compacted item
+        """
+        result = self._bindings.compact_table(self._db, name, item_bytes)
+        self._cached_db_metadata = None
+        if not result.success():
+            raise ScannerException(result.msg())
+        return self.table(name)
+
+    def new_synthetic_table(self, name, columns, num_rows, rows_per_item=1000,
+                            element_bytes=64):
+        """
+        Creates a table of pseudo-random elements for scale testing.
+
+        The elements are written directly in the item format, so tables of
+        billions of rows can be made without running a job. Elements of at
+        least 8 bytes start with their row number as an int64.
+
+        Args:
+            name: String name of the table to create
+            columns: List of names of table columns
+            num_rows: Number of rows in the table
+
+        Kwargs:
+            rows_per_item: Rows in each item file of the table
+            element_bytes: Size of every element of every column
+
+        Returns:
+            The new Table object.
+        """
+        result = self._bindings.new_synthetic_table(
+            self._db, name, columns, num_rows, rows_per_item, element_bytes)
+        self._cached_db_metadata = None
+        if not result.success():
+            raise ScannerException(result.msg())
+        return self.table(name)
+
+    def synthetic_videos(self, names, width=640, height=480, fps=30, gop=30,
+                         bframes=0, duration=60, codec='libx264',
+                         template=None):
+        """
+        Creates video tables of any length for scale testing.
+
+        A single GOP of an ffmpeg test pattern is encoded with the given
+        resolution and GOP structure, and each table's video repeats its
+        packets until it is duration seconds long. The repeated stream is
+        indexed like an ingested one, so the tables decode normally but take
+        no encoding time to make.
+
+        Args:
+            names: List of names of the tables to create
+
+        Kwargs:
+            width, height: Resolution of the videos
+            fps: Frame rate of the videos
+            gop: Frames in each GOP, all starting with a keyframe
+            bframes: Maximum consecutive B-frames in a GOP
+            duration: Length of each video in seconds
+            codec: ffmpeg encoder of the template, libx264 or libx265
+            template: Path of a video, readable from the database's storage,
+                      to repeat instead of encoding a test pattern
+
+        Returns:
+            List of the new Table objects.
+        """
+        temp_path = None
+        if template is None:
+            fd, temp_path = tempfile.mkstemp(suffix='.mp4')
+            os.close(fd)
+            cmd = ('ffmpeg -y -loglevel error '
+                   '-f lavfi -i testsrc=size={w:d}x{h:d}:rate={fps:d} '
+                   '-frames:v {gop:d} -c:v {codec:s} -pix_fmt yuv420p '
+                   '-g {gop:d} -bf {bf:d} -sc_threshold 0 {path:s}'.format(
+                       w=width, h=height, fps=fps, gop=gop, codec=codec,
+                       bf=bframes, path=temp_path))
+            if Popen(cmd, shell=True).wait() != 0:
+                os.remove(temp_path)
+                raise ScannerException('Failed to encode template video')
+            template = temp_path
+        try:
+            result = self._bindings.ingest_synthetic_videos(
+                self._db, names, template, int(duration * fps))
+        finally:
+            if temp_path is not None:
+                os.remove(temp_path)
+        self._cached_db_metadata = None
+        if not result.success():
+            raise ScannerException(result.msg())
+        return [self.table(name) for name in names]
+
     def new_table(self, name, columns, rows, fn=None, force=False):
         """
         Creates a new table from a list of rows.
@@ -756,21 +1150,96 @@ class Database:
         self._cached_db_metadata = None
         return self.table(name)
 
-    def table(self, name):
-        db_meta = self._load_db_metadata()
+    def new_columnar_table(self, name, columns, data, item_size=None,
+                           num_threads=None, force=False):
+        """
+        Creates a new table from columnar buffers, writing its items in
+        parallel from native code. Much faster than new_table for tables
+        with many rows.
+
+        Args:
+            name: String name of the table to create
+            columns: List of names of table columns
+            data: List with one entry per column, either a list of strings
+                  of serialized elements, or a pair of a uint8 array of the
+                  elements stored back to back and an array of their sizes.
+                  Every column must have the same number of rows.
+
+        Kwargs:
+            item_size: Rows per item of the table. Defaults to a single item,
+                       like new_table.
+            num_threads: Threads writing items. Defaults to one per core.
+            force: Delete an existing table with the same name first.
+
+        Returns:
+            The new table object.
+        """
+
+        if self.has_table(name):
+            if force:
+                self.delete_table(name)
+            else:
+                raise ScannerException(
+                    'Attempted to create table with existing name {}'.format(
+                        name))
+        if len(data) != len(columns):
+            raise ScannerException(
+                'Expected data for {} columns, got {}'.format(
+                    len(columns), len(data)))
+
+        buffers = []
+        sizes = []
+        for column in data:
+            if isinstance(column, tuple):
+                (buf, lengths) = column
+                buf = np.frombuffer(buf, dtype=np.uint8) \
+                    if isinstance(buf, bytes) else \
+                    np.ascontiguousarray(buf).view(np.uint8).reshape(-1)
+            else:
+                buf = np.frombuffer(b''.join(column), dtype=np.uint8)
+                lengths = [len(element) for element in column]
+            buffers.append(buf)
+            sizes.append(np.ascontiguousarray(lengths, dtype=np.int64))
+        num_rows = len(sizes[0]) if len(sizes) > 0 else 0
+        for (column, buf, lengths) in zip(columns, buffers, sizes):
+            if len(lengths) != num_rows:
+                raise ScannerException(
+                    'Column {} has {} rows, expected {}'.format(
+                        column, len(lengths), num_rows))
+            if lengths.sum() != len(buf):
+                raise ScannerException(
+                    'Sizes of column {} do not add up to its data'.format(
+                        column))
+
+        # The index column new_table prepends, built in one go
+        cols = ['index'] + list(columns)
+        buffers.insert(0, np.arange(num_rows, dtype='=u8').view(np.uint8))
+        sizes.insert(0, np.full(num_rows, 8, dtype=np.int64))
+
+        if num_threads is None:
+            num_threads = os.sysconf('SC_NPROCESSORS_ONLN')
+        result = self._bindings.new_columnar_table(
+            self._db, name, cols, buffers, sizes, num_rows,
+            item_size if item_size is not None else max(num_rows, 1),
+            num_threads)
+        if not result.success():
+            raise ScannerException(result.msg())
+        self._cached_db_metadata = None
+        return self.table(name)
 
+    def table(self, name):
         table_name = None
         table_id = None
         if isinstance(name, basestring):
-            if name in self._table_name:
+            table_id = self._table_id_for_name(name)
+            if table_id is not None:
                 table_name = name
-                table_id = db_meta.tables[self._table_name[name]].id
             if table_id is None:
                 raise ScannerException('Table with name {} not found'.format(name))
         elif isinstance(name, int):
-            if name in self._table_id:
+            table_name = self._table_name_for_id(name)
+            if table_name is not None:
                 table_id = name
-                table_name = db_meta.tables[self._table_id[name]].name
             if table_id is None:
                 raise ScannerException('Table with id {} not found'.format(name))
         else:
@@ -878,6 +1347,66 @@ class Database:
             sampling_slicing_ops, \
             output_ops
 
+    def _fold_decode_resizes(self, ops):
+        # Marks input columns that are only ever resized to one fixed size so
+        # the decoder produces frames at that size. The Resize Ops stay in
+        # place and pass such frames through untouched.
+        if not hasattr(self.protobufs, 'ResizeArgs'):
+            return
+        consumers = defaultdict(list)
+        for op in ops:
+            for inp in op.inputs:
+                if inp.op_index >= 0:
+                    consumers[inp.op_index].append(op)
+        for i, op in enumerate(ops):
+            if op.name != 'Input' or len(consumers[i]) == 0:
+                continue
+            sizes = set()
+            for c in consumers[i]:
+                if c.name != 'Resize':
+                    sizes = None
+                    break
+                args = self.protobufs.ResizeArgs()
+                args.ParseFromString(c.kernel_args)
+                if args.min or args.preserve_aspect:
+                    sizes = None
+                    break
+                sizes.add((args.width, args.height))
+            if sizes is None or len(sizes) != 1:
+                continue
+            (width, height) = sizes.pop()
+            # Hardware decoders can only scale to even sizes
+            if width <= 0 or height <= 0 or width % 2 != 0 or height % 2 != 0:
+                continue
+            op.inputs[0].decode_width = width
+            op.inputs[0].decode_height = height
+
+    def _choose_decode_formats(self, ops):
+        # Input columns whose every reader accepts NV12 frames are decoded to
+        # NV12, skipping the conversion to RGB
+        builtin = ['Input', 'OutputTable', 'Sample', 'Space', 'Slice',
+                   'Unslice']
+        nv12 = self.protobufs.NV12
+        accepts = defaultdict(lambda: True)
+        has_reader = set()
+        for op in ops:
+            for j, inp in enumerate(op.inputs):
+                if inp.op_index < 0:
+                    continue
+                has_reader.add(inp.op_index)
+                if op.name in builtin:
+                    accepts[inp.op_index] = False
+                    continue
+                info = self._get_op_info(op.name)
+                if info.variadic_inputs or j >= len(info.input_columns):
+                    accepts[inp.op_index] = False
+                    continue
+                if nv12 not in info.input_columns[j].pixel_formats:
+                    accepts[inp.op_index] = False
+        for i, op in enumerate(ops):
+            if op.name == 'Input' and i in has_reader and accepts[i]:
+                op.inputs[0].decode_format = nv12
+
     def _parse_size_string(self, s):
         (prefix, suffix) = (s[:-1], s[-1])
         mults = {
@@ -890,17 +1419,157 @@ class Database:
             raise ScannerException('Invalid size suffix in "{}"'.format(s))
         return int(prefix) * mults[suffix]
 
+    def stream(self, url, output, batch=1, max_latency=1.0,
+               max_buffered=16, gpu_decode=False, gpu=0, timeout=1.0):
+        """
+        Runs a pipeline of ops on a live video stream.
+
+        Frames are decoded as they arrive from the source and each one goes
+        through the ops as soon as a batch of them is ready, without tables,
+        tasks or work packets. Frames that are more than max_latency seconds
+        old when they are decoded are skipped, and so are results that are
+        not taken in time, so a slow pipeline drops frames instead of
+        falling further and further behind the source.
+
+        The pipeline must be a chain of ops with one input each, starting at
+        db.ops.FrameInput(). Ops with stencils are not supported. Ops run in
+        this process, so the database must run its own master and worker.
+
+        Args:
+            url: Anything ffmpeg can open live, such as an RTSP url or an
+                 HLS playlist
+            output: Column of the last op of the pipeline, or the
+                    FrameInput column to get the decoded frames
+
+        Kwargs:
+            batch: Frames evaluated together
+            max_latency: Seconds a frame may wait before it is skipped
+            max_buffered: Results kept before the oldest ones are dropped
+            gpu_decode: Decode on the GPU when possible
+            gpu: GPU of GPU ops and the GPU decoder
+            timeout: Seconds to wait for a result before checking that the
+                     stream is still running
+
+        Returns:
+            A generator of (frame number, latency in seconds, outputs)
+            tuples, with one output per column of the last op.
+        """
+        if not self._debug:
+            raise ScannerException(
+                'Streams run in this process and need a database that '
+                'started its own master and worker')
+        ops = []
+        op = output._op
+        while op is not None and op._name != 'Input':
+            if len(op._inputs) != 1:
+                raise ScannerException(
+                    'Stream op {} must have exactly one input'.format(
+                        op._name))
+            ops.append(op)
+            op = op._inputs[0]._op
+        if op is None:
+            raise ScannerException('Stream pipelines must start at FrameInput')
+        ops.reverse()
+        indices = {o: i for i, o in enumerate(ops)}
+        indices[op] = -1
+        op_protos = [o.to_proto(indices).SerializeToString() for o in ops]
+
+        runner = self._bindings.StreamRunner(
+            url, op_protos, gpu_decode, gpu, batch, int(max_latency * 1000),
+            max_buffered)
+        result = runner.start()
+        if not result.success():
+            raise ScannerException(result.msg())
+        try:
+            while True:
+                item = runner.next(int(timeout * 1000))
+                if item is not None:
+                    yield item
+                elif runner.finished():
+                    break
+            error = runner.error()
+            if not error.success():
+                raise ScannerException(error.msg())
+        finally:
+            runner.stop()
+
+    def _run_cached(self, run_args):
+        cache = ResultCache(self)
+        run_args['cache_results'] = False
+        bulk_job = run_args['bulk_job']
+        if run_args['materialize']:
+            def run_cache_job(b):
+                args = dict(run_args, bulk_job=b, force=True,
+                            materialize=None, cache_results=True)
+                self.run(**args)
+            cache.materialize(bulk_job, run_args['materialize'],
+                              run_cache_job)
+        run_args['materialize'] = None
+
+        fingerprints = cache.output_fingerprints(bulk_job)
+        rewritten, reused = cache.rewrite(bulk_job)
+        if rewritten is None:
+            return reused
+        tables = self.run(**dict(run_args, bulk_job=rewritten))
+        cache.record(rewritten,
+                     [f for (f, r) in zip(fingerprints, reused) if r is None],
+                     tables)
+        tables = iter(tables)
+        return [r if r is not None else next(tables) for r in reused]
+
     def run(self, bulk_job,
             force=False,
             work_packet_size=250,
             io_packet_size=-1,
             cpu_pool=None,
             gpu_pool=None,
+            pool_allocator='linear',
+            thread_cache_size=None,
+            pool_exhaustion='fail',
+            frame_cache_size=None,
+            numa_aware=False,
             pipeline_instances_per_node=None,
             show_progress=True,
             profiling=False,
             load_sparsity_threshold=8,
-            tasks_in_queue_per_pu=4):
+            tasks_in_queue_per_pu=4,
+            lock_free_queues=False,
+            work_stealing=True,
+            autotune=False,
+            keep_kernels_warm=False,
+            task_scheduling='in_order',
+            speculative_execution=False,
+            weighted_scheduling=False,
+            priority=0,
+            resume=False,
+            device_placement='manual',
+            batch_deadline_ms=0,
+            gpu_resident=False,
+            replicate_gpu_kernels=False,
+            save_buffer_size=8 * 1024 * 1024,
+            resize_on_decode=False,
+            decoder_threads=0,
+            encode_segments=1,
+            trace_stream_interval_ms=0,
+            perf_counters=False,
+            profile_sampling=None,
+            autotune_batch_sizes=False,
+            ephemeral_outputs=False,
+            intermediate_memory_bytes=0,
+            max_task_failures=3,
+            packed_outputs=False,
+            gpu_memory_budget=0,
+            on_task_event=None,
+            qsv_async_depth=0,
+            nvdec_sessions_per_gpu=0,
+            decoded_frame_cache_size=0,
+            cpu_huge_pages=None,
+            gpu_direct_storage=False,
+            gpu_stream_priorities=None,
+            interval_decoders=0,
+            replay_bundle=None,
+            cache_results=False,
+            materialize=None):
         """
         Runs a computation over a set of inputs.
 
@@ -918,15 +1587,218 @@ class Database:
             force: TODO(wcrichto)
             work_item_size: TODO(wcrichto)
             io_item_size: TODO(wcrichto)
-            cpu_pool: TODO(wcrichto)
+            cpu_pool: Size string of CPU memory left outside of the CPU
+                      pool, which takes the rest. A leading 'p' (e.g.
+                      'p4G') registers the pool with CUDA so its buffers
+                      transfer to and from GPUs without staging.
             gpu_pool: TODO(wcrichto)
+            pool_allocator: Allocation strategy used inside the CPU and GPU
+                            memory pools, either 'linear' or 'free_list'.
+            thread_cache_size: Size string (e.g. '256M') of recently freed
+                               buffers each thread keeps for reuse before
+                               returning them to the shared allocator.
+            pool_exhaustion: What to do when a memory pool is full: 'fail'
+                             aborts, 'wait' blocks until buffers are freed
+                             and 'spill' allocates outside of the pool.
+            frame_cache_size: Size string (e.g. '1G') of released frames
+                              kept for reuse by later frames of the same
+                              shape, per device type.
+            numa_aware: Split the CPU pool across NUMA nodes and pin each
+                        pipeline instance to a single node.
             pipeline_instances_per_node: TODO(wcrichto)
             show_progress: TODO(wcrichto)
+            lock_free_queues: Connect pipeline stages with lock-free ring
+                              buffers instead of mutex-guarded queues.
+            work_stealing: Let a pipeline instance that has run out of work
+                           take whole queued tasks from the other instances
+                           on the same node. Ignored with lock_free_queues.
+            autotune: Measure how fast each pipeline stage runs over the
+                      first tasks and pick better values for
+                      pipeline_instances_per_node, io_packet_size,
+                      work_packet_size and tasks_in_queue_per_pu. The queue
+                      depth is adjusted for the rest of this run; the rest
+                      are returned by Profiler.tuned_parameters() for reuse:
+                      db.run(job, **table.profiler().tuned_parameters()).
+            keep_kernels_warm: Let each worker reuse the kernels of the
+                               previous job, skipping their setup, when the
+                               op, devices and arguments are the same.
+            task_scheduling: 'in_order' grants tasks in the order they are
+                             generated. 'locality' prefers tasks adjacent to,
+                             or reading the same tables as, the tasks a
+                             worker was recently granted, so workers reuse
+                             their cached item files and boundary GOPs.
+                             'longest_first' grants the most expensive
+                             tasks first, judged by their rows, the keyframe
+                             spacing of their videos and observed task
+                             times, to shorten the tail of the job.
+            speculative_execution: Once every task has been granted, run a
+                                   second copy of any task taking several
+                                   times longer than the median on an idle
+                                   worker and keep whichever finishes first.
+            weighted_scheduling: Grant tasks to each worker in proportion to
+                                 its GPUs or cores and, once measured, its
+                                 task throughput, and leave the last tasks
+                                 of a job to the faster workers.
+            priority: The cluster runs one bulk job at a time. Bulk jobs
+                      submitted while another is running wait in a queue.
+                      Higher priorities run first, and equal ones are
+                      shared fairly between the users submitting them.
+            resume: If the output tables were left by an identical bulk
+                    job that was interrupted, write into them and only run
+                    the tasks it did not finish.
+            device_placement: 'manual' runs every op on the device it was
+                              given. 'profile' moves ops that have both CPU
+                              and GPU kernels to whichever device the op
+                              profiles of recent bulk jobs show to be
+                              faster, counting the copies between devices.
+            batch_deadline_ms: Milliseconds that the partial last batch of
+                               a task may wait to be filled with rows from
+                               the next task of the same job, so that
+                               batched GPU kernels see fewer small batches.
+                               Only stateless kernels without a stencil that
+                               run alone on their device are held back. 0
+                               disables this.
+            gpu_resident: Keep output columns computed on a GPU in device
+                          memory until they are saved rather than copying
+                          them to the host as soon as they are produced,
+                          while the GPU memory pool has room for them.
+            replicate_gpu_kernels: Run a copy of every stateless single-GPU
+                                   kernel on each GPU of a node and split
+                                   its batches between them, so that the
+                                   load, decode and CPU stages are not
+                                   duplicated once per GPU. The default
+                                   pipeline_instances_per_node becomes 1.
+            save_buffer_size: Bytes of output elements each save worker
+                              gathers in memory before writing them out, so
+                              that columns of many small elements are saved
+                              with a few large writes.
+            resize_on_decode: When every Op reading an input video column is
+                              a Resize to the same fixed size, decode the
+                              frames at that size directly instead of
+                              decoding full frames and resizing them.
+                              The decoder scales with swscale's bicubic
+                              filter rather than the Resize Op's
+                              interpolation, so the output pixels can
+                              differ slightly from an unfolded run.
+            decoder_threads: Threads each CPU video decoder uses. 0 divides
+                             the cores available for decoding between the
+                             pipeline instances.
+            encode_segments: Split each work packet of a software encoded
+                             output video column into up to this many
+                             segments, each starting on a keyframe, and
+                             encode them in parallel.
+            trace_stream_interval_ms: How often each worker writes the trace
+                                      events recorded since its last write
+                                      while the job runs, so they can be
+                                      read with Profiler.write_live_trace.
+                                      0 only writes traces at the end.
+            perf_counters: Count cycles, instructions and last level cache
+                           misses of every kernel, of decoding and of
+                           loading with the hardware performance counters.
+                           Reported by Profiler.hardware_counters where
+                           the workers may open them.
+            profile_sampling: Fraction of the profiled intervals to keep in
+                              the job's profile, e.g. 0.01 for long
+                              production jobs. Each worker then also keeps
+                              the count, total and a histogram of every
+                              interval by key, in bounded memory, which
+                              Profiler.interval_aggregates reports. 0 only
+                              keeps the aggregates. None keeps every
+                              interval.
+            autotune_batch_sizes: Try batch sizes from 1 to 128 for every
+                                  op with a batched kernel over the first
+                                  work packets, then keep the fastest one
+                                  that leaves room in the device memory
+                                  pool. Ops fused with others and ops with
+                                  batch_deadline_ms set keep their batch.
+                                  The choices are reported by
+                                  Profiler.tuned_batch_sizes for later runs.
+            ephemeral_outputs: Keep the output columns on the workers that
+                               computed them instead of writing them to
+                               storage. Later jobs read them from those
+                               workers over the network, so this suits
+                               intermediate tables of multi-stage
+                               pipelines. The tables can only be read while
+                               the workers that wrote them are running.
+            intermediate_memory_bytes: Bytes of ephemeral table data each
+                                       worker keeps in memory before
+                                       spilling to local disk. 0 uses 1GB.
+            max_task_failures: Workers that may die while running a task
+                               before it is given up on, e.g. because of a
+                               corrupt input. The job then finishes without
+                               it and Table.failed_rows reports its rows.
+                               0 retries tasks indefinitely.
+            packed_outputs: Write the non-video output columns of each task
+                            to one file, indexed by a footer, instead of
+                            two files per column. Suits tables of many
+                            small columns. Ignored with ephemeral_outputs.
+            gpu_memory_budget: Bytes of each GPU that the device memory GPU
+                               kernels declare with device_memory may take
+                               over all pipeline instances sharing it.
+                               Workers run fewer pipeline instances, and
+                               then smaller batches, to stay within it. 0
+                               uses the memory each GPU has free and a
+                               negative value disables the limit.
+            on_task_event: Called with a TaskEvent protobuf as each task
+                           of the bulk job finishes or is given up on,
+                           with its rows, duration and worker, streamed
+                           by the master while the job runs.
+            qsv_async_depth: Decode videos for CPU ops on the Quick Sync
+                             engine of an Intel GPU, with this many frames
+                             in flight per decoder. Needs Scanner built
+                             with Intel Media SDK support. 0 decodes in
+                             software.
+            nvdec_sessions_per_gpu: NVDEC sessions the video decoders of
+                                    all pipeline instances on a GPU share.
+                                    Streams take turns on them between
+                                    segments. 0 opens one per decoder.
+            decoded_frame_cache_size: Bytes of decoded frames each worker
+                                      keeps of video columns that several
+                                      jobs read, so that their tasks
+                                      decode shared rows once. Works best
+                                      with task_scheduling='locality',
+                                      which runs those tasks close
+                                      together. 0 disables it.
+            cpu_huge_pages: Size string of the huge pages backing the CPU
+                            pool, '2M' or '1G'. Transparent huge pages are
+                            used if none of that size are reserved.
+            gpu_direct_storage: Read uncompressed columns of tables on
+                                local storage straight into the memory of
+                                the GPU each pipeline instance runs on,
+                                with GPUDirect Storage when Scanner was
+                                built with BUILD_GDS.
+            gpu_stream_priorities: Priority of the CUDA streams of each
+                                   pipeline instance of a worker, from 0
+                                   (the default) up. Where instances
+                                   share a GPU, kernels of higher ones
+                                   are scheduled ahead of the others.
+            interval_decoders: Decoders each pipeline instance splits the
+                               keyframe intervals of a task's video
+                               columns between, to decode them in
+                               parallel. Helps sparse sampling of long
+                               tasks. 0 decodes them in order.
+            replay_bundle: Name to record the bulk job under, with the
+                           op libraries and the shape of the input tables
+                           it uses, so that replay can run it again.
+            cache_results: Reuse the outputs of op subgraphs that earlier
+                           runs with cache_results computed on the same
+                           inputs with the same args. Jobs whose whole
+                           output is cached are skipped and return the
+                           cached table instead of one with the requested
+                           name, and the rest read cached columns instead
+                           of recomputing them.
+            materialize: With cache_results, op columns to compute and
+                         cache first, in bulk jobs of their own, so this
+                         and later runs that share them reuse them.
 
         Returns:
             Either the output Collection if output_collection is specified
             or a list of Table objects.
         """
+        run_args = dict(locals())
+        del run_args['self']
+        if cache_results:
+            return self._run_cached(run_args)
         assert isinstance(bulk_job, BulkJob)
         assert isinstance(bulk_job.output(), Op)
 
@@ -936,7 +1808,7 @@ class Database:
         for out_col in output_op.inputs():
             opts = self.protobufs.OutputColumnCompression()
             opts.codec = 'default'
-            if out_col._type == self.protobufs.Video:
+            if out_col._encode_options is not None:
                 for k, v in out_col._encode_options.iteritems():
                     if k == 'codec':
                         opts.codec = v
@@ -946,14 +1818,21 @@ class Database:
 
         sorted_ops, input_ops, sampling_slicing_ops, output_ops = (
             self._toposort(bulk_job.output()))
+        if resize_on_decode:
+            self._fold_decode_resizes(sorted_ops)
+        self._choose_decode_formats(sorted_ops)
 
         job_params = self.protobufs.BulkJobParameters()
         job_name = ''.join(choice(ascii_uppercase) for _ in range(12))
         job_params.job_name = job_name
         job_params.ops.extend(sorted_ops)
         job_output_table_names = []
+        # Bindings of each job, as (op index, column name, table name) per
+        # input and (op index, sampling args) per sampling op
+        job_bindings = []
         for job in bulk_job.jobs():
-            j = job_params.jobs.add()
+            inputs = []
+            samplings = []
             output_table_name = None
             for op_col, args in job.op_args().iteritems():
                 if isinstance(op_col, Op):
@@ -961,22 +1840,13 @@ class Database:
                 else:
                     op = op_col._op
                 if op in input_ops:
-                    op_idx = input_ops[op]
-                    col_input = j.inputs.add()
-                    col_input.op_index = op_idx
-                    col_input.table_name = args._table.name()
-                    col_input.column_name = args.name()
+                    inputs.append(
+                        (input_ops[op], args.name(), args._table.name()))
                 elif op in sampling_slicing_ops:
-                    op_idx = sampling_slicing_ops[op]
-                    saa = j.sampling_args_assignment.add()
-                    saa.op_index = op_idx
                     if not isinstance(args, list):
                         args = [args]
-                    for arg in args:
-                        sa = saa.sampling_args.add()
-                        sa.CopyFrom(arg)
+                    samplings.append((sampling_slicing_ops[op], args))
                 elif op in output_ops:
-                    op_idx = output_ops[op]
                     assert isinstance(args, basestring)
                     output_table_name = args
                     job_output_table_names.append(args)
@@ -989,7 +1859,51 @@ class Database:
                 raise ScannerException(
                     'Did not specify the output table name by binding a '
                     'string to the output Op.')
-            j.output_table_name = output_table_name
+            inputs.sort()
+            samplings.sort(key=lambda sampling: sampling[0])
+            job_bindings.append((inputs, samplings, output_table_name))
+
+        def binding_key(inputs, samplings):
+            return (tuple((op_idx, column) for (op_idx, column, _) in inputs),
+                    tuple((op_idx, tuple(arg.SerializeToString()
+                                         for arg in args))
+                          for (op_idx, args) in samplings))
+
+        # Collections of many tables usually bind the same columns and
+        # sampling args in every job, which are then sent once in a group
+        # that the master expands
+        keys = set(binding_key(inputs, samplings)
+                   for (inputs, samplings, _) in job_bindings)
+        if len(job_bindings) > 1 and len(keys) == 1:
+            (inputs, samplings, _) = job_bindings[0]
+            group = job_params.job_groups.add()
+            for (op_idx, column, _) in inputs:
+                col_input = group.inputs.add()
+                col_input.op_index = op_idx
+                col_input.column_name = column
+            for (op_idx, args) in samplings:
+                saa = group.sampling_args_assignment.add()
+                saa.op_index = op_idx
+                saa.sampling_args.extend(args)
+            group.input_table_names.extend(
+                table for (inputs, _, _) in job_bindings
+                for (_, _, table) in inputs)
+            group.output_table_names.extend(job_output_table_names)
+        else:
+            for (inputs, samplings, output_table_name) in job_bindings:
+                j = job_params.jobs.add()
+                for (op_idx, column, table) in inputs:
+                    col_input = j.inputs.add()
+                    col_input.op_index = op_idx
+                    col_input.table_name = table
+                    col_input.column_name = column
+                for (op_idx, args) in samplings:
+                    saa = j.sampling_args_assignment.add()
+                    saa.op_index = op_idx
+                    for arg in args:
+                        sa = saa.sampling_args.add()
+                        sa.CopyFrom(arg)
+                j.output_table_name = output_table_name
 
         # Delete tables if they exist and force was specified
         to_delete = []
@@ -997,10 +1911,15 @@ class Database:
             if self.has_table(name):
                 if force:
                     to_delete.append(name)
-                else:
+                elif not self._interrupted_bulk_job(name):
                     raise ScannerException(
                         'Job would overwrite existing table {}'
                         .format(name))
+                elif not resume:
+                    raise ScannerException(
+                        'Table {} was left by a bulk job that did not '
+                        'finish. Pass resume=True to finish it or '
+                        'force=True to overwrite it.'.format(name))
         self.delete_tables(to_delete)
 
         job_params.compression.extend(compression_options)
@@ -1011,10 +1930,100 @@ class Database:
         job_params.show_progress = show_progress
         job_params.profiling = profiling
         job_params.tasks_in_queue_per_pu = tasks_in_queue_per_pu
+        job_params.lock_free_queues = lock_free_queues
+        job_params.work_stealing = work_stealing
+        job_params.autotune = autotune
+        job_params.keep_kernels_warm = keep_kernels_warm
+        scheduling_types = {
+            'in_order': self.protobufs.BulkJobParameters.IN_ORDER,
+            'locality': self.protobufs.BulkJobParameters.LOCALITY,
+            'longest_first': self.protobufs.BulkJobParameters.LONGEST_FIRST,
+        }
+        if task_scheduling not in scheduling_types:
+            raise ScannerException(
+                'Invalid task scheduling "{}"'.format(task_scheduling))
+        job_params.task_scheduling = scheduling_types[task_scheduling]
+        job_params.speculative_execution = speculative_execution
+        job_params.weighted_scheduling = weighted_scheduling
+        job_params.priority = priority
+        job_params.submitter = getpass.getuser()
+        job_params.resume = resume
+        placement_types = {
+            'manual': self.protobufs.BulkJobParameters.MANUAL,
+            'profile': self.protobufs.BulkJobParameters.PROFILE_GUIDED,
+        }
+        if device_placement not in placement_types:
+            raise ScannerException(
+                'Invalid device placement "{}"'.format(device_placement))
+        job_params.device_placement = placement_types[device_placement]
+        job_params.batch_deadline_ms = batch_deadline_ms
+        job_params.gpu_resident = gpu_resident
+        job_params.replicate_gpu_kernels = replicate_gpu_kernels
+        job_params.save_buffer_size = save_buffer_size
+        job_params.decoder_threads = decoder_threads
+        job_params.encode_segments = encode_segments
+        job_params.trace_stream_interval_ms = trace_stream_interval_ms
+        job_params.perf_counters = perf_counters
+        if profile_sampling is not None:
+            if not 0 <= profile_sampling <= 1:
+                raise ScannerException(
+                    'profile_sampling must be between 0 and 1')
+            job_params.profile_sample_period = (
+                int(round(1.0 / profile_sampling))
+                if profile_sampling > 0 else -1)
+        job_params.autotune_batch_sizes = autotune_batch_sizes
+        job_params.ephemeral_outputs = ephemeral_outputs
+        job_params.intermediate_memory_bytes = intermediate_memory_bytes
+        job_params.max_task_failures = max_task_failures
+        job_params.packed_outputs = packed_outputs
+        job_params.gpu_memory_budget = gpu_memory_budget
+        job_params.qsv_async_depth = qsv_async_depth
+        job_params.nvdec_sessions_per_gpu = nvdec_sessions_per_gpu
+        job_params.decoded_frame_cache_size = decoded_frame_cache_size
+        job_params.gpu_direct_storage = gpu_direct_storage
+        if gpu_stream_priorities is not None:
+            job_params.gpu_stream_priorities.extend(gpu_stream_priorities)
+        job_params.interval_decoders = interval_decoders
         job_params.load_sparsity_threshold = load_sparsity_threshold
         job_params.boundary_condition = (
             self.protobufs.BulkJobParameters.REPEAT_EDGE)
 
+        allocator_types = {
+            'linear': self.protobufs.MemoryPoolConfig.LINEAR,
+            'free_list': self.protobufs.MemoryPoolConfig.FREE_LIST,
+        }
+        if pool_allocator not in allocator_types:
+            raise ScannerException(
+                'Invalid pool allocator "{}"'.format(pool_allocator))
+        job_params.memory_pool_config.cpu.allocator = (
+            allocator_types[pool_allocator])
+        job_params.memory_pool_config.gpu.allocator = (
+            allocator_types[pool_allocator])
+
+        exhaustion_policies = {
+            'fail': self.protobufs.MemoryPoolConfig.FAIL,
+            'wait': self.protobufs.MemoryPoolConfig.WAIT,
+            'spill': self.protobufs.MemoryPoolConfig.SPILL,
+        }
+        if pool_exhaustion not in exhaustion_policies:
+            raise ScannerException(
+                'Invalid pool exhaustion policy "{}"'.format(pool_exhaustion))
+        job_params.memory_pool_config.cpu.exhaustion = (
+            exhaustion_policies[pool_exhaustion])
+        job_params.memory_pool_config.gpu.exhaustion = (
+            exhaustion_policies[pool_exhaustion])
+
+        if frame_cache_size is not None:
+            size = self._parse_size_string(frame_cache_size)
+            job_params.memory_pool_config.cpu.frame_cache_size = size
+            job_params.memory_pool_config.gpu.frame_cache_size = size
+
+        if thread_cache_size is not None:
+            size = self._parse_size_string(thread_cache_size)
+            job_params.memory_pool_config.cpu.thread_cache_size = size
+            job_params.memory_pool_config.gpu.thread_cache_size = size
+
+        job_params.memory_pool_config.numa_aware = numa_aware
         job_params.memory_pool_config.pinned_cpu = False
         if cpu_pool is not None:
             job_params.memory_pool_config.cpu.use_pool = True
@@ -1023,24 +2032,43 @@ class Database:
                 cpu_pool = cpu_pool[1:]
             size = self._parse_size_string(cpu_pool)
             job_params.memory_pool_config.cpu.free_space = size
+        if cpu_huge_pages is not None:
+            job_params.memory_pool_config.cpu_huge_page_size = (
+                self._parse_size_string(cpu_huge_pages))
 
         if gpu_pool is not None:
             job_params.memory_pool_config.gpu.use_pool = True
             size = self._parse_size_string(gpu_pool)
             job_params.memory_pool_config.gpu.free_space = size
 
-        # Run the job
-        self._try_rpc(lambda: self._master.NewJob(job_params))
+        if replay_bundle is not None:
+            job_params.replay_bundle = replay_bundle
+
+        return self._run_bulk_job(job_params, job_output_table_names,
+                                  on_task_event)
+
+    def _run_bulk_job(self, job_params, job_output_table_names,
+                      on_task_event=None):
+        # Submits the bulk job and waits for it to finish
+        job_name = job_params.job_name
+        reply = self._try_rpc(lambda: self._master.NewJob(job_params))
+        if not reply.result.success:
+            raise ScannerException(reply.result.msg)
+        # The master holds each IsJobDone call until the job finishes or the
+        # wait runs out, so small jobs return as soon as they are done
+        ticket = self.protobufs.JobTicket(ticket=reply.ticket, wait_ms=1000)
+
+        if on_task_event is not None:
+            for event in self._task_events(reply.ticket):
+                on_task_event(event)
 
         while True:
             try:
-                result = self._master.IsJobDone(self.protobufs.Empty())
+                result = self._master.IsJobDone(ticket)
             except grpc.RpcError as e:
                 raise ScannerException(e)
             if result.finished:
                 break
-            else:
-                time.sleep(1.0)
 
         if not result.result.success:
             raise ScannerException(result.result.msg)
@@ -1056,4 +2084,89 @@ class Database:
         if job_id is None:
             raise ScannerException('Internal error: job id not found after run')
 
+        # Tasks given up on after max_task_failures leave rows missing
+        descriptor = self._load_descriptor(
+            self.protobufs.BulkJobDescriptor,
+            'jobs/{}/descriptor.bin'.format(job_id))
+        if len(descriptor.failed_tasks) > 0:
+            missing = ['{}: rows {} to {}'.format(
+                job_output_table_names[task.job_id], task.start_row,
+                task.end_row) for task in descriptor.failed_tasks]
+            warnings.warn(
+                'Bulk job {} gave up on {} tasks that took down the workers '
+                'running them, so their rows are missing ({}). See '
+                'Table.failed_rows.'.format(job_name, len(missing),
+                                            ', '.join(missing)))
+
         return [self.table(t) for t in job_output_table_names]
+
+    def replay(self, bundle, synthetic_inputs=False, suffix='_replay',
+               show_progress=True):
+        """
+        Runs a bulk job recorded with replay_bundle again, with the
+        parameters, ops and op libraries it ran with.
+
+        Args:
+            bundle: Name the bulk job was recorded under
+
+        Kwargs:
+            synthetic_inputs: Read tables of random rows with the row counts,
+                              items and row sizes of the recorded input
+                              tables instead of the tables themselves.
+                              Video columns cannot be synthesized, so tables
+                              with them are still read.
+            suffix: Appended to the names of the output tables, which are
+                    overwritten if they exist.
+            show_progress: Print a progress bar while the job runs.
+
+        Returns:
+            The output tables.
+        """
+        recorded = self._load_descriptor(
+            self.protobufs.ReplayBundle, 'replays/{}.bin'.format(bundle))
+        job_params = self.protobufs.BulkJobParameters()
+        job_params.CopyFrom(recorded.params)
+        # The master adds the libraries it loaded to the job again
+        for so_path in job_params.op_libraries:
+            self.load_op(so_path)
+        del job_params.op_libraries[:]
+
+        input_names = {}
+        for replay_table in recorded.input_tables:
+            descriptor = replay_table.table
+            name = descriptor.name
+            has_video = any(c.type == self.protobufs.Video
+                            for c in descriptor.columns)
+            if not synthetic_inputs or has_video:
+                input_names[name] = name
+                continue
+            num_rows = descriptor.end_rows[-1] if descriptor.end_rows else 0
+            columns = []
+            data = []
+            for (column, row_bytes) in zip(descriptor.columns,
+                                            replay_table.row_bytes):
+                if column.name == 'index':
+                    continue
+                columns.append(column.name)
+                buf = np.random.randint(0, 256, size=num_rows * row_bytes,
+                                        dtype=np.uint8)
+                data.append((buf, np.full(num_rows, row_bytes,
+                                          dtype=np.int64)))
+            input_names[name] = name + suffix + '_input'
+            item_size = descriptor.end_rows[0] if descriptor.end_rows \
+                else None
+            self.new_columnar_table(input_names[name], columns, data,
+                                    item_size=item_size, force=True)
+
+        job_output_table_names = []
+        for job in job_params.jobs:
+            for column_input in job.inputs:
+                column_input.table_name = input_names[column_input.table_name]
+            job.output_table_name += suffix
+            job_output_table_names.append(job.output_table_name)
+            if self.has_table(job.output_table_name):
+                self.delete_table(job.output_table_name)
+        job_params.job_name = ''.join(
+            choice(ascii_uppercase) for _ in range(12))
+        job_params.show_progress = show_progress
+        return self._run_bulk_job(job_params, job_output_table_names)
@@ -5,5 +5,10 @@ class Kernel(object):
     def close(self):
         pass
 
+    # Kernels may define output_frame_shapes(self, input_columns) to return,
+    # per output column, a (shape, dtype) pair or None for non-frame columns.
+    # execute is then called as execute(input_columns, outputs) with arrays
+    # of those shapes wrapping the output frames; returning them unchanged
+    # avoids copying the results. Input frames are read-only views.
     def execute(self, input_columns):
         pass
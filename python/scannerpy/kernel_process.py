@@ -0,0 +1,191 @@
+"""
+Child end of a multiprocess Python kernel (see
+scanner/engine/python_kernel_process.h). The worker writes the rows of a
+batch into a shared memory segment and sends their layout over a pipe; the
+outputs come back the same way through a second segment owned by this side.
+"""
+
+import mmap
+import os
+import pickle
+import struct
+import sys
+import traceback
+
+import numpy as np
+
+EXECUTE = 1
+KIND, OFFSET, SIZE, HEIGHT, WIDTH, CHANNELS, TYPE, ROW_STRIDE = range(8)
+RECORD_FIELDS = 8
+BYTES, FRAME = 0, 1
+SEGMENT_ALIGNMENT = 64
+
+# Indexed by the FrameType enum of metadata.proto
+DTYPES = [np.uint8, np.float32, np.float64, np.float16]
+
+
+def read_all(fd, size):
+    chunks = []
+    while size > 0:
+        chunk = os.read(fd, size)
+        if not chunk:
+            sys.exit(0)
+        chunks.append(chunk)
+        size -= len(chunk)
+    return b''.join(chunks)
+
+
+def write_all(fd, data):
+    while data:
+        data = data[os.write(fd, data):]
+
+
+def read_i64s(fd, count):
+    return struct.unpack('={}q'.format(count), read_all(fd, 8 * count))
+
+
+def write_i64s(fd, values):
+    write_all(fd, struct.pack('={}q'.format(len(values)), *values))
+
+
+def read_string(fd):
+    length, = read_i64s(fd, 1)
+    return read_all(fd, length)
+
+
+def align_up(size):
+    return (size + SEGMENT_ALIGNMENT - 1) // SEGMENT_ALIGNMENT * \
+        SEGMENT_ALIGNMENT
+
+
+class Segment(object):
+    def __init__(self, name):
+        self.file = open('/dev/shm' + name, 'r+b')
+        self.map = None
+        self.size = 0
+
+    def remap(self, size, resize=False):
+        # Arrays handed out earlier may still reference the old mapping, so
+        # it is left for the garbage collector instead of being closed
+        if resize:
+            os.ftruncate(self.file.fileno(), size)
+        self.map = mmap.mmap(self.file.fileno(), size) if size > 0 else None
+        self.size = size
+
+
+def load_kernel(in_fd):
+    kernel_str = read_string(in_fd)
+    args = read_string(in_fd)
+    config_str = read_string(in_fd)
+
+    from scannerpy import Config
+    from scannerpy.protobuf_generator import ProtobufGenerator
+    config = pickle.loads(config_str)
+    protobufs = ProtobufGenerator(config)
+    namespace = {}
+    exec(kernel_str, namespace)
+    return namespace['KERNEL'](args, protobufs)
+
+
+def unpack_inputs(segment, records, rows, cols):
+    batch = []
+    for i in range(rows):
+        row = []
+        for j in range(cols):
+            record = records[(i * cols + j) * RECORD_FIELDS:]
+            offset, size = record[OFFSET], record[SIZE]
+            if record[KIND] == FRAME:
+                dtype = DTYPES[record[TYPE]]
+                frame = np.frombuffer(
+                    segment.map, dtype=dtype,
+                    count=size // np.dtype(dtype).itemsize,
+                    offset=offset).reshape(
+                        (record[HEIGHT], record[WIDTH], record[CHANNELS]))
+                frame.setflags(write=False)
+                row.append(frame)
+            else:
+                row.append(segment.map[offset:offset + size])
+        batch.append(row)
+    return batch
+
+
+def pack_outputs(segment, outputs):
+    records = []
+    values = []
+    total_size = 0
+    for row in outputs:
+        for value in row:
+            record = [0] * RECORD_FIELDS
+            if isinstance(value, np.ndarray):
+                value = np.ascontiguousarray(value)
+                if value.ndim != 3:
+                    raise ValueError('Output frames must have 3 dimensions')
+                record[KIND] = FRAME
+                record[HEIGHT], record[WIDTH], record[CHANNELS] = value.shape
+                record[TYPE] = DTYPES.index(value.dtype.type)
+                record[ROW_STRIDE] = value.strides[0]
+                size = value.nbytes
+            else:
+                record[KIND] = BYTES
+                size = len(value)
+            record[OFFSET] = total_size
+            record[SIZE] = size
+            total_size = align_up(total_size + size)
+            records.extend(record)
+            values.append(value)
+
+    if total_size > segment.size:
+        segment.remap(align_up(total_size + total_size // 4), resize=True)
+    for i, value in enumerate(values):
+        offset = records[i * RECORD_FIELDS + OFFSET]
+        size = records[i * RECORD_FIELDS + SIZE]
+        if isinstance(value, np.ndarray):
+            np.frombuffer(segment.map, dtype=np.uint8, count=size,
+                          offset=offset)[:] = value.view(np.uint8).ravel()
+        else:
+            segment.map[offset:offset + size] = value
+    return records
+
+
+def main(in_fd, out_fd, in_name, out_name):
+    try:
+        kernel = load_kernel(in_fd)
+    except Exception:
+        traceback.print_exc()
+        write_i64s(out_fd, [1])
+        return
+    write_i64s(out_fd, [0])
+
+    inputs = Segment(in_name)
+    outputs = Segment(out_name)
+    while True:
+        command, = read_i64s(in_fd, 1)
+        if command != EXECUTE:
+            kernel.close()
+            return
+        in_size, rows, cols, out_cols = read_i64s(in_fd, 4)
+        records = read_i64s(in_fd, rows * cols * RECORD_FIELDS)
+        if in_size != inputs.size:
+            inputs.remap(in_size)
+
+        try:
+            results = []
+            for row in unpack_inputs(inputs, records, rows, cols):
+                result = kernel.execute(row)
+                if len(result) != out_cols:
+                    raise ValueError(
+                        'Incorrect number of output columns. Expected {}'
+                        .format(out_cols))
+                results.append(result)
+            out_records = pack_outputs(outputs, results)
+        except Exception:
+            message = traceback.format_exc().encode('utf-8')
+            write_i64s(out_fd, [1, len(message)])
+            write_all(out_fd, message)
+            continue
+        write_i64s(out_fd, [0, outputs.size])
+        write_i64s(out_fd, out_records)
+
+
+if __name__ == '__main__':
+    main(int(sys.argv[1]), int(sys.argv[2]), sys.argv[3], sys.argv[4])
@@ -25,24 +25,36 @@ class OpColumn:
         return self._db.ops.Unslice(col=self)
 
     def compress(self, codec = 'video', **kwargs):
-        self._assert_is_video()
         codecs = {'video': self.compress_video,
                   'default': self.compress_default,
-                  'raw': self.lossless}
+                  'raw': self.lossless,
+                  'zlib': self.compress_zlib}
         if codec in codecs:
-            return codecs[codec](self, **kwargs)
+            return codecs[codec](**kwargs)
         else:
             raise ScannerException('Compression codec {} not currently '
                                    'supported. Available codecs are: {}.'
-                                   .format(' '.join(codecs.keys())))
-
-    def compress_video(self, quality = -1, bitrate = -1, keyframe_distance = -1):
+                                   .format(codec, ' '.join(codecs.keys())))
+
+    def compress_video(self, quality = -1, bitrate = -1, keyframe_distance = -1,
+                       encoder = 'software'):
+        """
+        Saves the column as h264 video. encoder is either 'software' (x264)
+        or 'nvidia', which encodes frames produced on a GPU with NVENC without
+        copying them to the host first. Workers without NVENC fall back to the
+        software encoder.
+        """
         self._assert_is_video()
+        if encoder not in ('software', 'nvidia'):
+            raise ScannerException(
+                'Video encoder {} not supported. Available encoders are: '
+                'software nvidia.'.format(encoder))
         encode_options = {
             'codec': 'h264',
             'quality': quality,
             'bitrate': bitrate,
-            'keyframe_distance': keyframe_distance
+            'keyframe_distance': keyframe_distance,
+            'encoder': encoder
         }
         return self._new_compressed_column(encode_options)
 
@@ -56,6 +68,18 @@ class OpColumn:
         encode_options = {'codec': 'default'}
         return self._new_compressed_column(encode_options)
 
+    def compress_zlib(self, level = -1):
+        """
+        Compresses each element of a non-video column with zlib when it is
+        saved. Loading the column decompresses the elements again.
+        """
+        if self._type == self._db.protobufs.Video:
+            raise ScannerException(
+                'zlib compression is only supported for non-video columns. '
+                'Use compress_video for column {}.'.format(self._col))
+        encode_options = {'codec': 'zlib', 'level': level}
+        return self._new_compressed_column(encode_options)
+
     def _assert_is_video(self):
         if self._type != self._db.protobufs.Video:
             raise ScannerException(
@@ -23,6 +23,28 @@ class TaskPartitioner:
         sampling_args.sampling_args = args.SerializeToString()
         return sampling_args
 
+    def keyframes(self, column, group_size=DEFAULT_GROUP_SIZE, tolerance=None):
+        """
+        Partitions a video column into groups of roughly group_size rows
+        whose boundaries fall on keyframes, so neighboring tasks do not both
+        decode the GOP a boundary would otherwise split.
+
+        Args:
+            column: The video Column being partitioned.
+            group_size: Nominal number of rows per group.
+            tolerance: How many rows a boundary may move to reach a keyframe.
+                Defaults to a quarter of group_size.
+        """
+        args = self._db.protobufs.KeyframePartitionerArgs()
+        args.keyframes[:] = column.keyframes()
+        args.group_size = group_size
+        args.tolerance = (tolerance if tolerance is not None
+                          else group_size // 4)
+        sampling_args = self._db.protobufs.SamplingArgs()
+        sampling_args.sampling_function = 'Keyframe'
+        sampling_args.sampling_args = args.SerializeToString()
+        return sampling_args
+
     def range(self, start, end):
         return self.ranges([(start, end)])
 
@@ -30,14 +52,42 @@ class TaskPartitioner:
         return self.strided_ranges(intervals, 1)
 
     def gather(self, groups):
-        args = self._db.protobufs.GatherSamplerArgs()
+        args = self._db.protobufs.GatherPartitionerArgs()
         for rows in groups:
-            gather_group = args.groups_add()
-            gather_group.rows[:] = rows
+            fill_gather_rows(args.groups.add(), rows)
+        sampling_args = self._db.protobufs.SamplingArgs()
         sampling_args.sampling_function = 'Gather'
         sampling_args.sampling_args = args.SerializeToString()
         return sampling_args
 
+    def adaptive(self, scores, threshold, min_gap=1, max_gap=None,
+                 group_size=DEFAULT_GROUP_SIZE):
+        """
+        Partitions the rows Sampler.adaptive would pick for the same
+        arguments into groups of group_size picked rows.
+        """
+        args = self._db.protobufs.AdaptivePartitionerArgs()
+        fill_adaptive_args(args, scores, threshold, min_gap, max_gap)
+        args.group_size = group_size
+        sampling_args = self._db.protobufs.SamplingArgs()
+        sampling_args.sampling_function = 'Adaptive'
+        sampling_args.sampling_args = args.SerializeToString()
+        return sampling_args
+
+    def time(self, column, group_duration, stride=0, ranges=None):
+        """
+        Partitions the rows Sampler.time_strided picks for the same
+        arguments into groups of about group_duration seconds, each starting
+        at a keyframe.
+        """
+        args = self._db.protobufs.TimePartitionerArgs()
+        fill_time_args(args.sampling, column, stride, ranges)
+        args.group_duration = group_duration
+        sampling_args = self._db.protobufs.SamplingArgs()
+        sampling_args.sampling_function = 'Time'
+        sampling_args.sampling_args = args.SerializeToString()
+        return sampling_args
+
     def strided_range(self, start, end, stride):
         return self.strided_ranges([(start, end)], stride)
 
@@ -1,5 +1,6 @@
 import struct
 import json
+import math
 from common import *
 
 
@@ -26,9 +27,13 @@ class Profiler:
 
     def __init__(self, db, job_id):
         self._storage = db._storage
+        self._db_path = db._db_path
+        self._job_id = job_id
         job = db._load_descriptor(
             db.protobufs.BulkJobDescriptor,
             'jobs/{}/descriptor.bin'.format(job_id))
+        self._job = job
+        self._device_type_names = db.protobufs.DeviceType.Name
 
         self._profilers = {}
         for n in range(job.num_nodes):
@@ -90,6 +95,51 @@ class Profiler:
         with open(path, 'w') as f:
             f.write(json.dumps(traces))
 
+    def write_native_trace(self, path):
+        """
+        Writes the traces the workers exported themselves as one trace in
+        Chrome format, which Perfetto also loads. Unlike write_trace, the
+        events are timed from the epoch, so the nodes of a job line up.
+
+        Args:
+            path: Output path to write the trace.
+        """
+        traces = []
+        for n in range(self._job.num_nodes):
+            traces.extend(json.loads(self._storage.read(
+                '{}/jobs/{}/trace_{}.json'.format(
+                    self._db_path, self._job_id, n))))
+        with open(path, 'w') as f:
+            f.write(json.dumps(traces))
+
+    @staticmethod
+    def write_live_trace(db, job_id, path):
+        """
+        Writes the trace chunks the workers of a running job have streamed
+        so far (see trace_stream_interval_ms of Database.run) as one trace
+        in Chrome format.
+
+        Args:
+            db: Database the job runs in.
+            job_id: Id of the bulk job.
+            path: Output path to write the trace.
+        """
+        job = db._load_descriptor(
+            db.protobufs.BulkJobDescriptor,
+            'jobs/{}/descriptor.bin'.format(job_id))
+        traces = []
+        for n in range(job.num_nodes):
+            chunk = 0
+            while True:
+                chunk_path = '{}/jobs/{}/trace_{}_{}.json'.format(
+                    db._db_path, job_id, n, chunk)
+                if not db._storage.get_file_info(chunk_path).file_exists:
+                    break
+                traces.extend(json.loads(db._storage.read(chunk_path)))
+                chunk += 1
+        with open(path, 'w') as f:
+            f.write(json.dumps(traces))
+
     def _convert_time(self, d):
         def convert(t):
             if isinstance(t, float):
@@ -109,7 +159,16 @@ class Profiler:
                 if kind not in totals:
                     totals[kind] = {}
                 for thread in profiler[kind]:
+                    # Sampled profiles only hold some of the intervals, while
+                    # the aggregates cover all of them
+                    aggregates = thread.get('aggregates', {})
+                    for (key, aggregate) in aggregates.iteritems():
+                        if key not in totals[kind]:
+                            totals[kind][key] = 0.0
+                        totals[kind][key] += float(aggregate['total_ns'])
                     for (key, start, end) in thread['intervals']:
+                        if key in aggregates:
+                            continue
                         if key not in totals[kind]:
                             totals[kind][key] = 0.0
                         totals[kind][key] += end-start
@@ -122,6 +181,297 @@ class Profiler:
         readable_totals = self._convert_time(totals)
         return readable_totals
 
+    def interval_aggregates(self):
+        """
+        Returns the count, total and percentiles of the durations of every
+        interval by key, from jobs run with profile_sampling set.
+
+        Returns:
+            A dict from worker type ('load', 'eval', 'save') to a dict from
+            interval key to count, total_ns, mean_ns, p50_ns, p90_ns and
+            p99_ns. Percentiles are accurate to within a quarter of their
+            power of two.
+        """
+        merged = defaultdict(lambda: defaultdict(
+            lambda: {'count': 0, 'total_ns': 0, 'buckets': defaultdict(int)}))
+        for _, profiler in self._profilers.values():
+            for kind in ['load', 'eval', 'save']:
+                for thread in profiler.get(kind, []):
+                    for key, a in thread.get('aggregates', {}).iteritems():
+                        m = merged[kind][key]
+                        m['count'] += a['count']
+                        m['total_ns'] += a['total_ns']
+                        for bucket, n in a['buckets'].iteritems():
+                            m['buckets'][bucket] += n
+
+        def bucket_start(bucket):
+            if bucket < 4:
+                return bucket
+            return (4 + bucket % 4) << (bucket // 4 - 1)
+
+        def percentile(m, p):
+            rank = math.ceil(p * m['count'])
+            seen = 0
+            for bucket in sorted(m['buckets']):
+                seen += m['buckets'][bucket]
+                if seen >= rank:
+                    return bucket_start(bucket + 1) - 1
+            return 0
+
+        stats = {}
+        for kind, keys in merged.iteritems():
+            stats[kind] = {}
+            for key, m in keys.iteritems():
+                if m['count'] == 0:
+                    continue
+                stats[kind][key] = {
+                    'count': m['count'],
+                    'total_ns': m['total_ns'],
+                    'mean_ns': float(m['total_ns']) / m['count'],
+                    'p50_ns': percentile(m, 0.5),
+                    'p90_ns': percentile(m, 0.9),
+                    'p99_ns': percentile(m, 0.99),
+                }
+        return stats
+
+    def bottleneck(self):
+        """
+        Identifies the pipeline stage that limits throughput.
+
+        Every stage records how long its threads waited on an empty input
+        queue and on a full output queue. Stages upstream of the bottleneck
+        block on full outputs and stages downstream starve on empty inputs,
+        so the limiting stage is the one that spent the smallest share of
+        the job waiting.
+
+        Returns:
+            A tuple of the limiting stage name and a dict from each stage
+            ('load', 'pre', 'eval', 'post', 'save') to its average
+            input_wait and output_wait as fractions of the job's duration
+            and its average sampled input_queue_depth.
+        """
+        totals = defaultdict(lambda: defaultdict(float))
+        for (start, end), profiler in self._profilers.values():
+            duration = float(end - start)
+            for kind in ['load', 'eval', 'save']:
+                for thread in profiler.get(kind, []):
+                    stage = thread['worker_tag'] if kind == 'eval' else kind
+                    counters = thread['counters']
+                    if 'input_queue_samples' not in counters:
+                        continue
+                    t = totals[stage]
+                    t['threads'] += 1
+                    t['input_wait'] += (
+                        counters.get('input_wait_ns', 0) / duration)
+                    t['output_wait'] += (
+                        counters.get('output_wait_ns', 0) / duration)
+                    t['input_queue_depth'] += (
+                        float(counters.get('input_queue_depth', 0)) /
+                        max(counters['input_queue_samples'], 1))
+
+        stages = {}
+        for stage, t in totals.iteritems():
+            n = t['threads']
+            stages[stage] = {
+                'input_wait': t['input_wait'] / n,
+                'output_wait': t['output_wait'] / n,
+                'input_queue_depth': t['input_queue_depth'] / n,
+            }
+        if not stages:
+            return None, stages
+        limiting = min(
+            stages,
+            key=lambda s: stages[s]['input_wait'] + stages[s]['output_wait'])
+        return limiting, stages
+
+    def device_times(self):
+        """
+        Returns how long each op spent on its device next to its host time.
+
+        GPU kernels and the copies of their inputs are timed with CUDA
+        events on the streams they run on, so the device times leave out
+        the time spent waiting to synchronize.
+
+        Returns:
+            A dict from each 'op:device' to rows, eval_ns and transfer_ns,
+            measured on the host, and device_ns and transfer_device_ns.
+        """
+        names = ['rows', 'eval_ns', 'transfer_ns', 'device_ns',
+                 'transfer_device_ns']
+        totals = defaultdict(lambda: {n: 0 for n in names})
+        for _, profiler in self._profilers.values():
+            for thread in profiler.get('eval', []):
+                for (name, value) in thread['counters'].iteritems():
+                    prefix, _, key = name.partition(':')
+                    if prefix.startswith('op_') and prefix[3:] in names:
+                        totals[key][prefix[3:]] += value
+        return dict(totals)
+
+    def hardware_counters(self):
+        """
+        Returns the hardware performance counters of a job run with
+        perf_counters enabled.
+
+        Memory bandwidth is estimated from last level cache misses, each of
+        which moved one 64 byte cache line, over the time counted.
+
+        Returns:
+            A dict from each 'op:device' and from 'load' and 'decode' to
+            cycles, instructions, llc_misses, ipc, memory_bytes_per_sec and,
+            for ops, rows, cycles_per_row and llc_misses_per_row.
+        """
+        totals = defaultdict(lambda: defaultdict(int))
+        for _, profiler in self._profilers.values():
+            for kind in profiler:
+                for thread in profiler[kind]:
+                    for (name, value) in thread['counters'].iteritems():
+                        prefix, _, key = name.partition(':')
+                        if prefix.startswith('op_'):
+                            totals[key][prefix[3:]] += value
+                        elif prefix.startswith('perf_'):
+                            totals[key][prefix[5:]] += value
+
+        counters = {}
+        for key, t in totals.iteritems():
+            if t['cycles'] == 0:
+                continue
+            c = {
+                'cycles': t['cycles'],
+                'instructions': t['instructions'],
+                'llc_misses': t['llc_misses'],
+                'ipc': float(t['instructions']) / t['cycles'],
+            }
+            if t['counted_ns'] > 0:
+                c['memory_bytes_per_sec'] = (
+                    t['llc_misses'] * 64 * 1.0e9 / t['counted_ns'])
+            if t['rows'] > 0:
+                c['rows'] = t['rows']
+                c['cycles_per_row'] = float(t['cycles']) / t['rows']
+                c['llc_misses_per_row'] = float(t['llc_misses']) / t['rows']
+            counters[key] = c
+        return counters
+
+    def memory_statistics(self):
+        """
+        Returns memory pool telemetry recorded at the end of the job.
+
+        Returns:
+            A dict from node id to a dict from device ('cpu', 'gpu0', ...) to
+            counters: pool_size, pool_bytes_in_use, pool_peak_bytes,
+            largest_free_extent, system_bytes_in_use, system_peak_bytes,
+            system_live_buffers, live_blocks, recycled_bytes and
+            pool_exhausted. GPUs also have the bytes and device time of
+            copies to, from and within them: h2d_bytes, h2d_ns, d2h_bytes,
+            d2h_ns, d2d_bytes and d2d_ns.
+        """
+        stats = {}
+        for node, (_, profiler) in self._profilers.iteritems():
+            devices = defaultdict(dict)
+            for thread in profiler.get('memory', []):
+                for (name, value) in thread['counters'].iteritems():
+                    device, counter = name.split(':', 1)
+                    devices[device][counter] = value
+            stats[node] = dict(devices)
+        return stats
+
+    def tuned_parameters(self):
+        """
+        Returns the pipeline parameters chosen for a job run with autotune.
+
+        Returns:
+            A dict of Database.run() kwargs (pipeline_instances_per_node,
+            io_packet_size, work_packet_size and tasks_in_queue_per_pu), or
+            None if the job was not autotuned.
+        """
+        if not self._job.HasField('tuned_parameters'):
+            return None
+        tuned = self._job.tuned_parameters
+        return {
+            'pipeline_instances_per_node': tuned.pipeline_instances_per_node,
+            'io_packet_size': tuned.io_packet_size,
+            'work_packet_size': tuned.work_packet_size,
+            'tasks_in_queue_per_pu': tuned.tasks_in_queue_per_pu,
+        }
+
+    def tuned_batch_sizes(self):
+        """
+        Returns the batch sizes chosen for a job run with
+        autotune_batch_sizes.
+
+        Returns:
+            A dict from each tuned op's 'op:device' to its batch size, to
+            pass as the batch of that op in later runs.
+        """
+        sizes = {}
+        for profile in self._job.op_profiles:
+            if profile.tuned_batch_size > 0:
+                key = '{}:{}'.format(
+                    profile.name,
+                    self._device_type_names(profile.device_type))
+                sizes[key] = profile.tuned_batch_size
+        return sizes
+
+    def summary(self):
+        """
+        Returns the parts of the profile that compare_profiles aligns, as a
+        dict of plain values that can be saved as JSON and compared with
+        profiles of later runs.
+
+        Returns:
+            A dict of total_ns, the job's duration, and of stages, a dict
+            from worker type ('load', 'eval', 'save') to the total_ns of
+            each interval key, its counters and the p50_ns, p90_ns and
+            p99_ns of its task durations, and of ops, a dict from each
+            'op:device' to its rows and eval_ns.
+        """
+        stages = {}
+        interval_aggregates = self.interval_aggregates()
+        for kind in ['load', 'eval', 'save']:
+            totals = defaultdict(float)
+            counters = defaultdict(int)
+            tasks = []
+            for _, profiler in self._profilers.values():
+                for thread in profiler.get(kind, []):
+                    aggregates = thread.get('aggregates', {})
+                    for (key, aggregate) in aggregates.iteritems():
+                        totals[key] += float(aggregate['total_ns'])
+                    for (key, start, end) in thread['intervals']:
+                        if key == 'task':
+                            tasks.append(end - start)
+                        if key not in aggregates:
+                            totals[key] += end - start
+                    for (name, value) in thread['counters'].iteritems():
+                        counters[name] += value
+            stage = {'intervals': dict(totals), 'counters': dict(counters)}
+            aggregate = interval_aggregates.get(kind, {}).get('task')
+            if aggregate is not None:
+                # Sampled profiles only hold some of the task intervals
+                for p in ['p50_ns', 'p90_ns', 'p99_ns']:
+                    stage[p] = aggregate[p]
+            elif len(tasks) > 0:
+                tasks.sort()
+                for (p, q) in [('p50_ns', 0.5), ('p90_ns', 0.9),
+                               ('p99_ns', 0.99)]:
+                    stage[p] = tasks[min(len(tasks) - 1,
+                                         int(q * len(tasks)))]
+            stages[kind] = stage
+        start, end = self.total_time_interval()
+        ops = dict((op, {'rows': t['rows'], 'eval_ns': t['eval_ns']})
+                   for (op, t) in self.device_times().iteritems())
+        return {'total_ns': end - start, 'stages': stages, 'ops': ops}
+
+    def compare(self, baseline, threshold=0.1):
+        """
+        Compares this job's profile with one of an earlier run of the same
+        workload. See compare_profiles.
+
+        Args:
+            baseline: Profiler of the earlier run, or its summary()
+        """
+        if isinstance(baseline, Profiler):
+            baseline = baseline.summary()
+        return compare_profiles(baseline, self.summary(), threshold)
+
     def _parse_profiler_output(self, bytes_buffer, offset):
         # Node
         t, offset = read_advance('q', bytes_buffer, offset)
@@ -174,9 +524,30 @@ class Profiler:
             'worker_tag': worker_tag,
             'worker_num': worker_num,
             'intervals': intervals,
-            'counters': counters
+            'counters': counters,
+            'aggregates': {}
         }, offset
 
+    def _parse_profiler_aggregates(self, bytes_buffer, offset):
+        t, offset = read_advance('q', bytes_buffer, offset)
+        num_aggregates = t[0]
+        aggregates = {}
+        for i in range(num_aggregates):
+            key, offset = unpack_string(bytes_buffer, offset)
+            (count, total_ns, num_buckets), offset = read_advance(
+                'qqq', bytes_buffer, offset)
+            buckets = {}
+            for b in range(num_buckets):
+                (bucket, bucket_count), offset = read_advance(
+                    '=Bq', bytes_buffer, offset)
+                buckets[bucket] = bucket_count
+            aggregates[key] = {
+                'count': count,
+                'total_ns': total_ns,
+                'buckets': buckets
+            }
+        return aggregates, offset
+
     def _parse_profiler_file(self, profiler_path):
         bytes_buffer = self._storage.read(profiler_path)
         offset = 0
@@ -208,4 +579,110 @@ class Profiler:
         for i in range(num_save_workers):
             prof, offset = self._parse_profiler_output(bytes_buffer, offset)
             profilers[prof['worker_type']].append(prof)
+        # Memory telemetry (absent in profiles from older workers)
+        if offset < len(bytes_buffer):
+            t, offset = read_advance('B', bytes_buffer, offset)
+            num_memory_profilers = t[0]
+            for i in range(num_memory_profilers):
+                prof, offset = self._parse_profiler_output(
+                    bytes_buffer, offset)
+                profilers[prof['worker_type']].append(prof)
+        # Interval aggregates of every profiler in the order written (absent
+        # in profiles from older workers)
+        if offset < len(bytes_buffer):
+            for kind in ['load', 'eval', 'save', 'memory']:
+                for prof in profilers[kind]:
+                    prof['aggregates'], offset = (
+                        self._parse_profiler_aggregates(bytes_buffer, offset))
         return (start_time, end_time), profilers
+
+
+# Counters where an increase is a regression, next to the added time
+REGRESSING_COUNTERS = ['io_read', 'frames_decoded', 'block_cache_misses',
+                       'video_index_cache_misses', 'decoder_waits']
+
+
+def compare_profiles(baseline, current, threshold=0.1):
+    """
+    Aligns two profile summaries of the same workload by op and stage.
+
+    Args:
+        baseline: Profiler.summary() of the earlier run
+        current: Profiler.summary() of the run to check
+
+    Kwargs:
+        threshold: Relative change past which a slowdown, or an increase of
+                   a counter in REGRESSING_COUNTERS, is a regression
+
+    Returns:
+        A dict of:
+          total: the job's duration
+          ops: each op's rows per second
+          stages: the total of each interval key, by worker type
+          tasks: the p50, p90 and p99 task durations, by worker type
+          counters: every counter, and decode_efficiency, frames_used
+                    over frames_decoded, by worker type
+        where each value is a dict of baseline, current and change, the
+        relative change from the baseline, along with regressions, a list
+        of descriptions of the changes past the threshold.
+    """
+    regressions = []
+
+    def delta(b, c):
+        change = (float(c) - b) / b if b else (0.0 if not c else float('inf'))
+        return {'baseline': b, 'current': c, 'change': change}
+
+    def check(name, d, higher_is_worse=True):
+        change = d['change'] if higher_is_worse else -d['change']
+        if change > threshold:
+            regressions.append('{} went from {} to {} ({:+.1%})'.format(
+                name, d['baseline'], d['current'], d['change']))
+
+    result = {'total': delta(baseline['total_ns'], current['total_ns'])}
+    check('total_ns', result['total'])
+
+    result['ops'] = {}
+    for (op, c) in current['ops'].iteritems():
+        b = baseline['ops'].get(op)
+        if b is None or b['eval_ns'] == 0 or c['eval_ns'] == 0:
+            continue
+        d = delta(b['rows'] * 1e9 / b['eval_ns'],
+                  c['rows'] * 1e9 / c['eval_ns'])
+        result['ops'][op] = d
+        check('{} rows/s'.format(op), d, higher_is_worse=False)
+
+    result['stages'] = {}
+    result['tasks'] = {}
+    result['counters'] = {}
+    for (kind, c) in current['stages'].iteritems():
+        b = baseline['stages'].get(kind)
+        if b is None:
+            continue
+        result['stages'][kind] = dict(
+            (key, delta(b['intervals'][key], value))
+            for (key, value) in c['intervals'].iteritems()
+            if key in b['intervals'])
+        result['tasks'][kind] = {}
+        for p in ['p50_ns', 'p90_ns', 'p99_ns']:
+            if p in b and p in c:
+                d = delta(b[p], c[p])
+                result['tasks'][kind][p] = d
+                check('{} task {}'.format(kind, p), d)
+        counters = dict((name, delta(b['counters'].get(name, 0), value))
+                        for (name, value) in c['counters'].iteritems())
+        for name in REGRESSING_COUNTERS:
+            if name in counters:
+                check('{} {}'.format(kind, name), counters[name])
+        if (c['counters'].get('frames_decoded') and
+                b['counters'].get('frames_decoded')):
+            counters['decode_efficiency'] = delta(
+                float(b['counters'].get('frames_used', 0)) /
+                b['counters']['frames_decoded'],
+                float(c['counters'].get('frames_used', 0)) /
+                c['counters']['frames_decoded'])
+            check('{} decode_efficiency'.format(kind),
+                  counters['decode_efficiency'], higher_is_worse=False)
+        result['counters'][kind] = counters
+
+    result['regressions'] = regressions
+    return result
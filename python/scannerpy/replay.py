@@ -0,0 +1,33 @@
+"""
+Runs a bulk job recorded with Database.run(replay_bundle=...) again, to
+investigate its performance away from the pipeline that submitted it:
+
+    python -m scannerpy.replay <bundle> [--synthetic-inputs]
+"""
+
+from database import Database
+from config import Config
+import argparse
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description='Run a bulk job recorded in a replay bundle again')
+    parser.add_argument('bundle', help='Name the bulk job was recorded under')
+    parser.add_argument('--config-path', default=None,
+                        help='Scanner configuration to run with')
+    parser.add_argument('--synthetic-inputs', action='store_true',
+                        help='Read random rows shaped like the inputs')
+    parser.add_argument('--suffix', default='_replay',
+                        help='Appended to the output table names')
+    args = parser.parse_args()
+
+    db = Database(config=Config(args.config_path))
+    tables = db.replay(args.bundle, synthetic_inputs=args.synthetic_inputs,
+                       suffix=args.suffix)
+    for table in tables:
+        print(table.name())
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,261 @@
+from common import *
+from op import Op
+from job import Job
+from bulk_job import BulkJob
+import collections
+import copy
+import hashlib
+
+CACHE_TABLE_PREFIX = '_result_cache_'
+
+
+class ResultCache:
+    """
+    Reuses the outputs of op subgraphs that earlier bulk jobs computed.
+
+    The fingerprint of an op column covers the name, device, stencil and
+    kernel args of every op it depends on, the sampling args each job binds
+    to its Sample, Space and Slice ops, and the id, timestamp and column of
+    each table its Input ops read. It is computed per job. Columns that a
+    bulk job run with cache_results writes are recorded under their
+    fingerprints in pydb/result_cache.bin.
+    """
+
+    def __init__(self, db):
+        self._db = db
+        self._entries = None
+
+    def _load(self):
+        if self._entries is None:
+            self._entries = collections.defaultdict(list)
+            path = 'pydb/result_cache.bin'
+            info = self._db._storage.get_file_info(
+                '{}/{}'.format(self._db._db_path, path))
+            desc = self._db.protobufs.ResultCacheDescriptor()
+            if info.file_exists:
+                desc = self._db._load_descriptor(
+                    self._db.protobufs.ResultCacheDescriptor, path)
+            self._desc = desc
+            for e in desc.entries:
+                self._entries[e.fingerprint].append((e.table_id, e.column))
+
+    def lookup(self, fingerprint):
+        """(table id, column name) holding a fingerprint, or None."""
+        self._load()
+        for (table_id, column) in self._entries.get(fingerprint, []):
+            # Deleted, overwritten or compacted tables are gone from the
+            # table index
+            if self._db._table_name_for_id(table_id) is not None:
+                return (table_id, column)
+        return None
+
+    def record(self, bulk_job, fingerprints, tables):
+        """Records the output columns of the tables a bulk job wrote."""
+        self._load()
+        output_cols = bulk_job.output().inputs()
+        for (job_fps, table) in zip(fingerprints, tables):
+            table._need_descriptor()
+            desc = table._descriptor
+            if desc.ephemeral or len(desc.failed_items) > 0:
+                continue
+            for (i, (col, fp)) in enumerate(zip(output_cols, job_fps)):
+                # Lossy video encodes are not the op's exact output
+                if (fp is None or col._encode_options is not None and
+                        col._encode_options.get('codec') == 'h264'):
+                    continue
+                column = desc.columns[i].name
+                entry = self._desc.entries.add()
+                entry.fingerprint = fp
+                entry.table_id = table.id()
+                entry.column = column
+                self._entries[fp].append((table.id(), column))
+        self._db._save_descriptor(self._desc, 'pydb/result_cache.bin')
+
+    def fingerprint(self, col, job_args, memo):
+        """
+        Fingerprint of an op column for the args a job binds, or None if it
+        is computed inside a slice and has no rows of its own.
+        """
+        op = col._op
+        if op not in memo:
+            h = hashlib.sha1()
+            h.update(op._name)
+            fp = None
+            if op._name == 'Input':
+                args = job_args[op]
+                args._table._need_descriptor()
+                h.update('{}:{}:{}'.format(
+                    args._table.id(), args._table._descriptor.timestamp,
+                    args.name()))
+                fp = h.hexdigest()
+            elif op._name != 'Slice':
+                args = job_args.get(op, [])
+                if not isinstance(args, list):
+                    args = [args]
+                for arg in args:
+                    h.update(arg.SerializeToString())
+                e = op.to_proto(collections.defaultdict(lambda: -1))
+                h.update('{}:{}'.format(e.device_type, list(e.stencil)))
+                h.update(e.kernel_args)
+                fp = h.hexdigest()
+                for i in op._inputs:
+                    input_fp = self.fingerprint(i, job_args, memo)
+                    if input_fp is None:
+                        fp = None
+                        break
+                    h.update(input_fp)
+                    fp = h.hexdigest()
+            memo[op] = fp
+        if memo[op] is None:
+            return None
+        return hashlib.sha1(memo[op] + col._col).hexdigest()
+
+    def output_fingerprints(self, bulk_job):
+        """Fingerprints of the output columns of each job."""
+        fps = []
+        for job in bulk_job.jobs():
+            args = _op_keyed(job.op_args())
+            memo = {}
+            fps.append([self.fingerprint(c, args, memo)
+                        for c in bulk_job.output().inputs()])
+        return fps
+
+    def materialize(self, bulk_job, columns, run):
+        """
+        Runs the subgraphs of columns, for each job that has no cached
+        output of them, as bulk jobs of their own that write cache tables.
+        """
+        for col in columns:
+            output = self._db.ops.Output(columns=[col])
+            reachable = _reachable(output)
+            jobs = []
+            for job in bulk_job.jobs():
+                args = _op_keyed(job.op_args())
+                fp = self.fingerprint(col, args, {})
+                if fp is None:
+                    raise ScannerException(
+                        'Column {} is inside a slice and can not be '
+                        'materialized'.format(col._col))
+                if self.lookup(fp) is not None:
+                    continue
+                job_args = dict((op, a) for (op, a) in args.iteritems()
+                                if op in reachable)
+                job_args[output] = CACHE_TABLE_PREFIX + fp
+                jobs.append(Job(op_args=job_args))
+            if len(jobs) > 0:
+                run(BulkJob(output=output, jobs=jobs))
+
+    def rewrite(self, bulk_job):
+        """
+        Returns the bulk job with every op column whose output is cached for
+        all of its jobs read from the cache tables instead, along with the
+        cached table of each job whose whole output is cached (None for the
+        rest, which are left in the bulk job).
+        """
+        output_cols = bulk_job.output().inputs()
+        reused = []
+        remaining = []
+        for job in bulk_job.jobs():
+            args = _op_keyed(job.op_args())
+            memo = {}
+            hits = []
+            for c in output_cols:
+                fp = self.fingerprint(c, args, memo)
+                hits.append(self.lookup(fp) if fp is not None else None)
+            table_ids = set(h[0] for h in hits if h is not None)
+            if len(output_cols) > 0 and None not in hits and \
+               len(table_ids) == 1:
+                table = self._db.table(table_ids.pop())
+                if table.column_names() == [h[1] for h in hits]:
+                    reused.append(table)
+                    continue
+            reused.append(None)
+            remaining.append((args, memo))
+        if len(remaining) == 0:
+            return None, reused
+
+        clones = {}
+        bindings = collections.defaultdict(list)
+
+        def resolve(col):
+            op = col._op
+            if op._name == 'Input':
+                return col
+            # Whether cached for every remaining job
+            hits = []
+            for (args, memo) in remaining:
+                fp = self.fingerprint(col, args, memo)
+                hits.append(self.lookup(fp) if fp is not None else None)
+            if None not in hits:
+                key = (op, col._col)
+                if key not in clones:
+                    if col._type == self._db.protobufs.Video:
+                        inp = Op.frame_input(self._db)
+                    else:
+                        inp = Op.input(self._db)
+                    clones[key] = inp
+                    bindings[inp] = [
+                        self._db.table(table_id).column(column)
+                        for (table_id, column) in hits]
+                new_col = copy.copy(clones[key]._outputs[0])
+                new_col._encode_options = col._encode_options
+                return new_col
+            if op not in clones:
+                inputs = [resolve(i) for i in op._inputs]
+                if all(a is b for (a, b) in zip(inputs, op._inputs)):
+                    clones[op] = op
+                else:
+                    clone = copy.copy(op)
+                    clone._inputs = inputs
+                    clone._outputs = []
+                    for c in op._outputs:
+                        c = copy.copy(c)
+                        c._op = clone
+                        clone._outputs.append(c)
+                    clones[op] = clone
+            if clones[op] is op:
+                return col
+            new_col = copy.copy(col)
+            new_col._op = clones[op]
+            return new_col
+
+        output = bulk_job.output()
+        inputs = [resolve(c) for c in output._inputs]
+        if not all(a is b for (a, b) in zip(inputs, output._inputs)):
+            clone = copy.copy(output)
+            clone._inputs = inputs
+            clones[output] = clone
+            output = clone
+        reachable = _reachable(output)
+
+        jobs = []
+        for (i, (args, _)) in enumerate(remaining):
+            job_args = {}
+            for (op, a) in args.iteritems():
+                op = clones.get(op, op)
+                if op in reachable:
+                    job_args[op] = a
+            for (inp, columns) in bindings.iteritems():
+                if inp in reachable:
+                    job_args[inp] = columns[i]
+            jobs.append(Job(op_args=job_args))
+        return BulkJob(output=output, jobs=jobs), reused
+
+
+def _op_keyed(op_args):
+    return dict((k if isinstance(k, Op) else k._op, v)
+                for (k, v) in op_args.iteritems())
+
+
+def _reachable(output):
+    ops = set()
+    stack = [output]
+    while len(stack) > 0:
+        op = stack.pop()
+        if op in ops:
+            continue
+        ops.add(op)
+        for i in op._inputs:
+            if i._op is not None:
+                stack.append(i._op)
+    return ops
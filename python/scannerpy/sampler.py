@@ -1,3 +1,4 @@
+import bisect
 from common import *
 
 DEFAULT_TASK_SIZE = 250
@@ -32,12 +33,74 @@ class Sampler:
 
     def gather(self, rows):
         args = self._db.protobufs.GatherSamplerArgs()
-        args.rows[:] = rows
+        fill_gather_rows(args, rows)
         sampling_args = self._db.protobufs.SamplingArgs()
         sampling_args.sampling_function = 'Gather'
         sampling_args.sampling_args = args.SerializeToString()
         return sampling_args
 
+    def keyframes(self, column, rows=None):
+        """
+        Samples only keyframes of a video column. Each requested row is
+        snapped to the keyframe at or before it, so only keyframes need to be
+        decoded and the cost scales with the number of keyframes rather than
+        frames.
+
+        Args:
+            column: The video Column to sample.
+            rows: Rows to snap to keyframes. All keyframes when not specified.
+        """
+        keyframes = column.keyframes()
+        if rows is None:
+            return self.gather(keyframes)
+        snapped = []
+        for row in sorted(rows):
+            k = keyframes[bisect.bisect_right(keyframes, row) - 1]
+            if len(snapped) == 0 or snapped[-1] != k:
+                snapped.append(k)
+        return self.gather(snapped)
+
+    def adaptive(self, scores, threshold, min_gap=1, max_gap=None):
+        """
+        Samples only rows where the content changed, judged by cheap
+        precomputed change scores, so expensive ops skip static stretches.
+
+        Args:
+            scores: Change score of every row of the sampled domain, or a
+                Column of them (e.g. FrameDifference run on downscaled
+                frames), reduced to its per-row mean.
+            threshold: How much accumulated change picks the next row.
+            min_gap: Fewest rows between two picked rows.
+            max_gap: Most rows between two picked rows, unbounded if None.
+        """
+        args = self._db.protobufs.AdaptiveSamplerArgs()
+        fill_adaptive_args(args, scores, threshold, min_gap, max_gap)
+        sampling_args = self._db.protobufs.SamplingArgs()
+        sampling_args.sampling_function = "Adaptive"
+        sampling_args.sampling_args = args.SerializeToString()
+        return sampling_args
+
+    def time_strided(self, column, stride, ranges=None):
+        """
+        Samples a row every stride seconds of a video column, e.g. one frame
+        per second with stride=1, by presentation time rather than by frame
+        count.
+
+        Args:
+            column: The video Column being sampled.
+            stride: Seconds between sampled rows, or 0 for every row.
+            ranges: Optional list of (start, end) times in seconds.
+        """
+        args = self._db.protobufs.TimeSamplerArgs()
+        fill_time_args(args, column, stride, ranges)
+        sampling_args = self._db.protobufs.SamplingArgs()
+        sampling_args.sampling_function = "Time"
+        sampling_args.sampling_args = args.SerializeToString()
+        return sampling_args
+
+    def time_ranges(self, column, ranges):
+        return self.time_strided(column, 0, ranges)
+
     def strided_range(self, start, end, stride):
         return self.strided_ranges([(start, end)], stride)
 
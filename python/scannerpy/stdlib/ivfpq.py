@@ -0,0 +1,106 @@
+import numpy as np
+import heapq
+import struct
+
+CODEWORDS = 256
+
+
+def assign(vectors, centroids):
+    """Index of the nearest centroid of each vector."""
+    dists = ((vectors ** 2).sum(axis=1)[:, None] -
+             2 * vectors.dot(centroids.T) +
+             (centroids ** 2).sum(axis=1)[None, :])
+    return dists.argmin(axis=1)
+
+
+def kmeans(vectors, k, iterations=20, seed=0):
+    """Lloyd's k-means. Returns k x d centroids."""
+    rng = np.random.RandomState(seed)
+    vectors = np.asarray(vectors, dtype=np.float32)
+    if len(vectors) < k:
+        raise ValueError('k-means needs at least {} vectors, got {}'.format(
+            k, len(vectors)))
+    centroids = vectors[rng.choice(len(vectors), k, replace=False)].copy()
+    for _ in range(iterations):
+        assignment = assign(vectors, centroids)
+        for c in range(k):
+            members = vectors[assignment == c]
+            if len(members) > 0:
+                centroids[c] = members.mean(axis=0)
+            else:
+                # Reseed empty clusters from a random vector
+                centroids[c] = vectors[rng.randint(len(vectors))]
+    return centroids
+
+
+def train(protobufs, vectors, num_lists, num_subquantizers, iterations=20):
+    """
+    Trains IVFPQArgs for the IVFPQEncode and IVFPQSearch ops from a sample of
+    the vectors to index, given as an n x d array.
+    """
+    vectors = np.asarray(vectors, dtype=np.float32)
+    d = vectors.shape[1]
+    if d % num_subquantizers != 0:
+        raise ValueError('num_subquantizers must divide the dimensions')
+    centroids = kmeans(vectors, num_lists, iterations)
+
+    residuals = vectors - centroids[assign(vectors, centroids)]
+    sub = d // num_subquantizers
+    codebooks = [
+        kmeans(residuals[:, s * sub:(s + 1) * sub], CODEWORDS, iterations)
+        for s in range(num_subquantizers)]
+
+    args = protobufs.IVFPQArgs()
+    args.dimensions = d
+    args.centroids.extend(centroids.flatten().tolist())
+    args.num_subquantizers = num_subquantizers
+    args.codebooks.extend(np.concatenate(codebooks).flatten().tolist())
+    return args
+
+
+def search_args(protobufs, index_args, queries, nprobe=8, k=10):
+    args = protobufs.IVFPQSearchArgs()
+    args.index.CopyFrom(index_args)
+    args.queries.extend(
+        np.asarray(queries, dtype=np.float32).flatten().tolist())
+    args.nprobe = nprobe
+    args.k = k
+    return args
+
+
+def neighbors(buf, protobufs):
+    """
+    Parses an IVFPQSearch row into a list with, for each query, the row's
+    (squared distance, index in row) pairs, nearest first.
+    """
+    num_queries, k = struct.unpack('=ii', buf[:8])
+    results = np.frombuffer(buf[8:], dtype=np.dtype([('distance', np.float32),
+                                                     ('index', np.int32)]))
+    results = results.reshape((num_queries, k))
+    return [[(float(r['distance']), int(r['index'])) for r in row
+             if r['index'] >= 0] for row in results]
+
+
+def merge(rows, k):
+    """
+    Merges (row, neighbors) pairs, as loaded from an IVFPQSearch column
+    with the neighbors parser, into the k nearest (squared distance, row,
+    index in row) of each query over the whole table.
+    """
+    best = None
+    for row, per_query in rows:
+        if per_query is None:
+            continue
+        if best is None:
+            best = [[] for _ in per_query]
+        for q, results in enumerate(per_query):
+            for dist, index in results:
+                # Max heap on distance through negation
+                entry = (-dist, row, index)
+                if len(best[q]) < k:
+                    heapq.heappush(best[q], entry)
+                elif entry > best[q][0]:
+                    heapq.heapreplace(best[q], entry)
+    if best is None:
+        return []
+    return [sorted((-d, row, index) for d, row, index in q) for q in best]
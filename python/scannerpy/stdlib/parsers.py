@@ -2,7 +2,60 @@ import numpy as np
 import cv2
 import struct
 
+# Fixed layout elements, see scanner/util/serialize.h
+FLAT_BBOX_MAGIC = 0x31584253
+FLAT_FEATURES_MAGIC = 0x31564653
+FLAT_BBOX_DTYPE = np.dtype([
+    ('x1', '<f4'), ('y1', '<f4'), ('x2', '<f4'), ('y2', '<f4'),
+    ('score', '<f4'), ('track_id', '<i4'), ('track_score', '<f8'),
+    ('label', '<i4'), ('padding', '<i4')])
+
+
+def _flat_count(buf, magic):
+    # Record count of a flat element, or None if buf is not one
+    if len(buf) < 8:
+        return None
+    found, count = struct.unpack("=II", buf[:8])
+    return count if found == magic else None
+
+
+def bbox_array(buf, protobufs):
+    """
+    Box list as a structured numpy array with a record per box. Flat
+    elements are viewed in place, without copying.
+    """
+    count = _flat_count(buf, FLAT_BBOX_MAGIC)
+    if count is not None:
+        return np.frombuffer(buf, dtype=FLAT_BBOX_DTYPE, count=count,
+                             offset=8)
+    boxes = _proto_bboxes(buf, protobufs)
+    array = np.zeros(len(boxes), dtype=FLAT_BBOX_DTYPE)
+    for i, box in enumerate(boxes):
+        array[i] = (box.x1, box.y1, box.x2, box.y2, box.score, box.track_id,
+                    box.track_score, box.label, 0)
+    return array
+
+
 def bboxes(buf, protobufs):
+    if _flat_count(buf, FLAT_BBOX_MAGIC) is None:
+        return _proto_bboxes(buf, protobufs)
+    bboxes = []
+    for record in bbox_array(buf, protobufs):
+        box = protobufs.BoundingBox()
+        box.x1 = float(record['x1'])
+        box.y1 = float(record['y1'])
+        box.x2 = float(record['x2'])
+        box.y2 = float(record['y2'])
+        box.score = float(record['score'])
+        box.track_id = int(record['track_id'])
+        box.track_score = float(record['track_score'])
+        box.label = int(record['label'])
+        bboxes.append(box)
+    return bboxes
+
+
+def _proto_bboxes(buf, protobufs):
+    # Length prefixed protobuf lists, written before the flat format
     (num_bboxes,) = struct.unpack("=Q", buf[:8])
     buf = buf[8:]
     bboxes = []
@@ -16,6 +69,19 @@ def bboxes(buf, protobufs):
     return bboxes
 
 
+def features(buf, protobufs):
+    """
+    Feature vectors as a (count, dims) float32 array viewing the element.
+    Elements without a header are a single vector of raw float32 values.
+    """
+    count = _flat_count(buf, FLAT_FEATURES_MAGIC)
+    if count is None:
+        return np.frombuffer(buf, dtype=np.float32).reshape(1, -1)
+    (dims,) = struct.unpack("=I", buf[8:12])
+    return np.frombuffer(buf, dtype=np.float32, count=count * dims,
+                         offset=16).reshape(count, dims)
+
+
 def poses(buf, protobufs):
     (num_bodies,) = struct.unpack("=Q", buf[:8])
     buf = buf[8:]
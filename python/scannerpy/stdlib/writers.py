@@ -1,12 +1,29 @@
+import numpy as np
 import struct
+from scannerpy.stdlib.parsers import (FLAT_BBOX_MAGIC, FLAT_FEATURES_MAGIC,
+                                      FLAT_BBOX_DTYPE)
 
 def bboxes(bufs, protobufs):
-    s = struct.pack('=Q', len(bufs[0]))
-    for bbox in bufs[0]:
-        bs = bbox.SerializeToString()
-        s += struct.pack('=Q', len(bs))
-        s += bs
-    return [s]
+    """
+    Writes BoundingBox protobufs, or a bbox_array, as a flat box list.
+    """
+    boxes = bufs[0]
+    if not isinstance(boxes, np.ndarray):
+        array = np.zeros(len(boxes), dtype=FLAT_BBOX_DTYPE)
+        for i, b in enumerate(boxes):
+            array[i] = (b.x1, b.y1, b.x2, b.y2, b.score, b.track_id,
+                        b.track_score, b.label, 0)
+        boxes = array
+    boxes = np.ascontiguousarray(boxes, dtype=FLAT_BBOX_DTYPE)
+    return [struct.pack('=II', FLAT_BBOX_MAGIC, len(boxes)) +
+            boxes.tobytes()]
+
+def features(bufs, protobufs):
+    """Writes a (count, dims) array as flat feature vectors."""
+    array = np.ascontiguousarray(bufs[0], dtype=np.float32)
+    array = array.reshape(len(array), -1)
+    return [struct.pack('=IIII', FLAT_FEATURES_MAGIC, array.shape[0],
+                        array.shape[1], 0) + array.tobytes()]
 
 def poses(bufs, protobufs):
     s = struct.pack("=Q", len(bufs[0]))
@@ -30,9 +30,24 @@ class Table:
                 self._db.protobufs.TableDescriptor,
                 'tables/{}/descriptor.bin'.format(self._id))
 
+    def _interrupted(self):
+        # Whether the bulk job writing the table stopped before finishing
+        self._need_descriptor()
+        if self._descriptor.job_id == -1:
+            return False
+        descriptor = self._db._load_descriptor(
+            self._db.protobufs.BulkJobDescriptor,
+            'jobs/{}/descriptor.bin'.format(self._descriptor.job_id))
+        return descriptor.interrupted
+
     def _load_column(self, name):
         self._need_descriptor()
         if self._video_descriptors is None:
+            if self._interrupted():
+                raise ScannerException(
+                    'Table {} was written by a bulk job that did not '
+                    'finish, so it is missing rows. Run the bulk job again '
+                    'with resume=True before reading it.'.format(self._name))
             self._video_descriptors = []
             for c in self._descriptor.columns:
                 video_descriptor = None
@@ -78,6 +93,19 @@ class Table:
         self._need_descriptor()
         return self._descriptor.end_rows[-1]
 
+    def failed_rows(self):
+        """
+        Returns the (start, end) row ranges of the tasks the bulk job gave
+        up on after they took down too many workers. They have no data, and
+        loading them raises an exception.
+        """
+        self._need_descriptor()
+        ranges = []
+        for item in self._descriptor.failed_items:
+            start = self._descriptor.end_rows[item - 1] if item > 0 else 0
+            ranges.append((start, self._descriptor.end_rows[item]))
+        return ranges
+
     def _parse_index(self, bufs, db):
         return struct.unpack("=Q", bufs[0])[0]
 
@@ -95,6 +123,53 @@ class Table:
         else:
             raise ScannerException('Ingested videos do not have profile data')
 
+    def to_arrow(self, columns=None, rows=None):
+        """
+        Exports columns of the table as an Arrow table, whose record batches
+        are the table items. See Column.to_arrow for how elements map to
+        Arrow arrays.
+
+        Kwargs:
+            columns: Names of the columns to export, all of them by default.
+            rows: Optional list of rows to export, in increasing order.
+
+        Returns:
+            pyarrow.Table with a column per exported column.
+        """
+        import pyarrow as pa
+
+        columns = self.column_names() if columns is None else columns
+        arrays = [self.column(c).to_arrow(rows=rows) for c in columns]
+        return pa.Table.from_arrays(arrays, names=columns)
+
+    def to_parquet(self, path, columns=None, rows=None, **kwargs):
+        """
+        Writes columns of the table to a Parquet file, with a row group per
+        table item. Extra keyword arguments go to pyarrow.parquet.ParquetWriter.
+
+        Args:
+            path: Parquet file to write.
+
+        Kwargs:
+            columns: Names of the columns to export, all of them by default.
+            rows: Optional list of rows to export, in increasing order.
+        """
+        import pyarrow as pa
+        import pyarrow.parquet as pq
+
+        table = self.to_arrow(columns=columns, rows=rows)
+        writer = pq.ParquetWriter(path, table.schema, **kwargs)
+        try:
+            # Each record batch is one item, so it is written on its own
+            for batch in table.to_batches():
+                if batch.num_rows == 0:
+                    continue
+                writer.write_table(
+                    pa.Table.from_batches([batch], schema=table.schema),
+                    row_group_size=batch.num_rows)
+        finally:
+            writer.close()
+
     def load(self, columns, fn=None, rows=None):
         cols = [self.column(c).load(rows=rows) for c in columns]
         for tup in izip(*cols):
@@ -17,6 +17,7 @@
 #include "scanner/engine/ingest.h"
 #include "scanner/engine/master.h"
 #include "scanner/engine/metadata.h"
+#include "scanner/engine/packed_item.h"
 #include "scanner/engine/rpc.grpc.pb.h"
 #include "scanner/engine/rpc.pb.h"
 #include "scanner/engine/runtime.h"
@@ -31,6 +32,10 @@
 #include <grpc++/server_builder.h>
 #include <grpc/support/log.h>
 
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <random>
 #include <thread>
 
 namespace scanner {
@@ -57,8 +62,45 @@ internal::DatabaseParameters machine_params_to_db_params(
   db.num_load_workers = params.num_load_workers;
   db.num_save_workers = params.num_save_workers;
   db.gpu_ids = params.gpu_ids;
+  db.partition_cores = params.partition_cores;
+  db.num_io_cores = params.num_io_cores;
+  db.disk_cache_path = params.disk_cache_path;
+  db.disk_cache_bytes = params.disk_cache_bytes;
+  db.disk_cache_lfu = params.disk_cache_lfu;
   return db;
 }
+
+// Offset of every element of a column of an item in its data file, followed
+// by the end of the last one
+std::vector<u64> item_element_offsets(storehouse::StorageBackend* storage,
+                                      const internal::TableMetadata& table,
+                                      i32 column_id, i32 item_id) {
+  std::unique_ptr<storehouse::RandomReadFile> file;
+  if (internal::is_packed_column(table, column_id)) {
+    BACKOFF_FAIL(storehouse::make_unique_random_read_file(
+        storage, internal::table_item_packed_path(table.id(), item_id),
+        file));
+    return internal::read_packed_item_offsets(file.get()).at(column_id);
+  }
+  BACKOFF_FAIL(storehouse::make_unique_random_read_file(
+      storage,
+      internal::table_item_metadata_path(table.id(), column_id, item_id),
+      file));
+  u64 file_size = 0;
+  BACKOFF_FAIL(file->get_size(file_size));
+  std::vector<u64> offsets(1, 0);
+  u64 pos = 0;
+  while (pos < file_size) {
+    u64 num_elements = s_read<u64>(file.get(), pos);
+    for (u64 i = 0; i < num_elements; ++i) {
+      offsets.push_back(offsets.back() + s_read<u64>(file.get(), pos));
+    }
+  }
+  return offsets;
+}
+
+// Bytes copied from an old item file to a compacted one per read
+const u64 COMPACT_COPY_SIZE = 16 * 1024 * 1024;
 }
 
 MachineParameters default_machine_params() {
@@ -66,6 +108,10 @@ MachineParameters default_machine_params() {
   machine_params.num_cpus = std::thread::hardware_concurrency();
   machine_params.num_load_workers = 8;
   machine_params.num_save_workers = 2;
+  machine_params.partition_cores = false;
+  machine_params.num_io_cores = 0;
+  machine_params.disk_cache_bytes = 0;
+  machine_params.disk_cache_lfu = false;
 #ifdef HAVE_CUDA
   i32 gpu_count;
   CU_CHECK(cudaGetDeviceCount(&gpu_count));
@@ -94,7 +140,7 @@ Database::Database(storehouse::StorageConfig* storage_config,
 
 Result Database::start_master(const MachineParameters& machine_params,
                               const std::string& port,
-                              bool watchdog) {
+                              bool watchdog, i32 metrics_port) {
   if (master_state_ != nullptr) {
     LOG(WARNING) << "Master already started";
     Result result;
@@ -112,6 +158,10 @@ Result Database::start_master(const MachineParameters& machine_params,
   // Setup watchdog
   master_service->start_watchdog(master_state_->server.get(), watchdog);
 
+  if (metrics_port > 0) {
+    master_service->start_metrics_server(metrics_port);
+  }
+
   Result result;
   result.set_success(true);
   return result;
@@ -119,7 +169,7 @@ Result Database::start_master(const MachineParameters& machine_params,
 
 Result Database::start_worker(const MachineParameters& machine_params,
                               const std::string& port,
-                              bool watchdog) {
+                              bool watchdog, i32 metrics_port) {
   internal::DatabaseParameters params =
       machine_params_to_db_params(machine_params, storage_config_, db_path_);
   ServerState* s = new ServerState;
@@ -133,6 +183,10 @@ Result Database::start_worker(const MachineParameters& machine_params,
   // Setup watchdog
   worker_service->start_watchdog(state.server.get(), watchdog);
 
+  if (metrics_port > 0) {
+    worker_service->start_metrics_server(metrics_port);
+  }
+
   worker_service->register_with_master();
 
   Result result;
@@ -144,7 +198,7 @@ Result Database::ingest_videos(const std::vector<std::string>& table_names,
                                const std::vector<std::string>& paths,
                                std::vector<FailedVideo>& failed_videos) {
   internal::ingest_videos(storage_config_, db_path_, table_names, paths,
-                          failed_videos);
+                          false, 0, failed_videos);
   Result result;
   result.set_success(true);
   return result;
@@ -240,6 +294,206 @@ Result Database::new_table(const std::string& table_name,
   return result;
 }
 
+Result Database::new_columnar_table(const std::string& table_name,
+                                    const std::vector<std::string>& columns,
+                                    const std::vector<const u8*>& column_data,
+                                    const std::vector<const i64*>& column_sizes,
+                                    i64 num_rows, i64 rows_per_item,
+                                    i32 num_threads) {
+  Result result;
+  if (columns.size() != column_data.size() ||
+      columns.size() != column_sizes.size()) {
+    RESULT_ERROR(&result, "Expected data and sizes for each of %lu columns",
+                 columns.size());
+    return result;
+  }
+  if (num_rows <= 0 || rows_per_item <= 0) {
+    RESULT_ERROR(&result, "Columnar tables need positive row and item counts");
+    return result;
+  }
+  internal::DatabaseMetadata meta = internal::read_database_metadata(
+      storage_.get(), internal::DatabaseMetadata::descriptor_path());
+
+  i32 table_id = meta.add_table(table_name);
+  if (table_id == -1) {
+    RESULT_ERROR(&result, "Table %s already exists", table_name.c_str());
+    return result;
+  }
+  proto::TableDescriptor table_desc;
+  table_desc.set_id(table_id);
+  table_desc.set_name(table_name);
+  table_desc.set_timestamp(
+      std::chrono::duration_cast<std::chrono::seconds>(now().time_since_epoch())
+          .count());
+  table_desc.set_job_id(-1);
+  for (size_t i = 0; i < columns.size(); ++i) {
+    proto::Column* col = table_desc.add_columns();
+    col->set_id(i);
+    col->set_name(columns[i]);
+    col->set_type(proto::ColumnType::Other);
+  }
+
+  // Byte offset of every row in its column's buffer
+  std::vector<std::vector<i64>> offsets(columns.size());
+  for (size_t j = 0; j < columns.size(); ++j) {
+    offsets[j].resize(num_rows + 1);
+    offsets[j][0] = 0;
+    for (i64 r = 0; r < num_rows; ++r) {
+      if (column_sizes[j][r] < 0) {
+        RESULT_ERROR(&result, "Row %ld of column %s has a negative size", r,
+                     columns[j].c_str());
+        return result;
+      }
+      offsets[j][r + 1] = offsets[j][r] + column_sizes[j][r];
+    }
+  }
+
+  i64 num_items = (num_rows + rows_per_item - 1) / rows_per_item;
+  for (i64 item = 0; item < num_items; ++item) {
+    table_desc.add_end_rows(std::min((item + 1) * rows_per_item, num_rows));
+  }
+
+  // Items of every column are handed out to the writers one at a time. An
+  // item's rows are contiguous in its column's buffer, so its data is
+  // written with a single call.
+  std::atomic<i64> next_work(0);
+  i64 total_work = num_items * columns.size();
+  auto write_items = [&]() {
+    std::vector<u64> item_metadata;
+    for (i64 w = next_work++; w < total_work; w = next_work++) {
+      i32 j = w % columns.size();
+      i64 item = w / columns.size();
+      i64 start = item * rows_per_item;
+      i64 end = std::min(start + rows_per_item, num_rows);
+
+      std::unique_ptr<storehouse::WriteFile> output_file;
+      BACKOFF_FAIL(storehouse::make_unique_write_file(
+          storage_.get(), internal::table_item_output_path(table_id, j, item),
+          output_file));
+      std::unique_ptr<storehouse::WriteFile> output_metadata_file;
+      BACKOFF_FAIL(storehouse::make_unique_write_file(
+          storage_.get(),
+          internal::table_item_metadata_path(table_id, j, item),
+          output_metadata_file));
+
+      item_metadata.assign(1, (u64)(end - start));
+      item_metadata.insert(item_metadata.end(), column_sizes[j] + start,
+                           column_sizes[j] + end);
+      s_write(output_metadata_file.get(), (const u8*)item_metadata.data(),
+              item_metadata.size() * sizeof(u64));
+      s_write(output_file.get(), column_data[j] + offsets[j][start],
+              offsets[j][end] - offsets[j][start]);
+      BACKOFF_FAIL(output_file->save());
+      BACKOFF_FAIL(output_metadata_file->save());
+    }
+  };
+  num_threads = std::max(1, std::min(num_threads, (i32)total_work));
+  std::vector<std::thread> writers;
+  for (i32 t = 1; t < num_threads; ++t) {
+    writers.emplace_back(write_items);
+  }
+  write_items();
+  for (std::thread& writer : writers) {
+    writer.join();
+  }
+
+  // Saved last so a failure part way does not leave a table with missing items
+  internal::write_table_metadata(storage_.get(),
+                                 internal::TableMetadata(table_desc));
+  internal::write_database_metadata(storage_.get(), meta);
+  result.set_success(true);
+  return result;
+}
+
+Result Database::new_synthetic_table(const std::string& table_name,
+                                     const std::vector<std::string>& columns,
+                                     i64 num_rows, i64 rows_per_item,
+                                     i64 element_bytes) {
+  Result result;
+  if (num_rows <= 0 || rows_per_item <= 0 || element_bytes < 0) {
+    RESULT_ERROR(&result,
+                 "Synthetic tables need positive row counts and element "
+                 "sizes");
+    return result;
+  }
+  internal::DatabaseMetadata meta = internal::read_database_metadata(
+      storage_.get(), internal::DatabaseMetadata::descriptor_path());
+
+  i32 table_id = meta.add_table(table_name);
+  if (table_id == -1) {
+    RESULT_ERROR(&result, "Table %s already exists", table_name.c_str());
+    return result;
+  }
+  proto::TableDescriptor table_desc;
+  table_desc.set_id(table_id);
+  table_desc.set_name(table_name);
+  table_desc.set_timestamp(
+      std::chrono::duration_cast<std::chrono::seconds>(now().time_since_epoch())
+          .count());
+  table_desc.set_job_id(-1);
+  for (size_t i = 0; i < columns.size(); ++i) {
+    proto::Column* col = table_desc.add_columns();
+    col->set_id(i);
+    col->set_name(columns[i]);
+    col->set_type(proto::ColumnType::Other);
+  }
+
+  // Elements start with their row number when they are large enough, so
+  // readers can check they got the rows they asked for
+  std::mt19937_64 rng(table_id);
+  std::vector<u8> element(element_bytes);
+  i32 item_id = 0;
+  for (i64 start = 0; start < num_rows; start += rows_per_item, ++item_id) {
+    i64 end = std::min(start + rows_per_item, num_rows);
+    for (size_t j = 0; j < columns.size(); ++j) {
+      std::unique_ptr<storehouse::WriteFile> output_file;
+      BACKOFF_FAIL(storehouse::make_unique_write_file(
+          storage_.get(),
+          internal::table_item_output_path(table_id, j, item_id),
+          output_file));
+      std::unique_ptr<storehouse::WriteFile> output_metadata_file;
+      BACKOFF_FAIL(storehouse::make_unique_write_file(
+          storage_.get(),
+          internal::table_item_metadata_path(table_id, j, item_id),
+          output_metadata_file));
+
+      s_write(output_metadata_file.get(), (u64)(end - start));
+      for (i64 r = start; r < end; ++r) {
+        s_write(output_metadata_file.get(), (u64)element_bytes);
+      }
+      for (i64 r = start; r < end; ++r) {
+        for (i64 b = 0; b < element_bytes; b += sizeof(u64)) {
+          u64 v = rng();
+          std::memcpy(element.data() + b, &v,
+                      std::min((i64)sizeof(u64), element_bytes - b));
+        }
+        if (element_bytes >= (i64)sizeof(i64)) {
+          std::memcpy(element.data(), &r, sizeof(i64));
+        }
+        s_write(output_file.get(), element.data(), element_bytes);
+      }
+      BACKOFF_FAIL(output_file->save());
+      BACKOFF_FAIL(output_metadata_file->save());
+    }
+    table_desc.add_end_rows(end);
+  }
+
+  // Saved last so a failure part way does not leave a table with missing items
+  internal::write_table_metadata(storage_.get(),
+                                 internal::TableMetadata(table_desc));
+  internal::write_database_metadata(storage_.get(), meta);
+  result.set_success(true);
+  return result;
+}
+
+Result Database::ingest_synthetic_videos(
+    const std::vector<std::string>& table_names,
+    const std::string& template_path, i64 frames_per_video) {
+  return internal::ingest_synthetic_videos(storage_config_, db_path_,
+                                           table_names, template_path,
+                                           frames_per_video);
+}
+
 Result Database::delete_table(const std::string& table_name) {
   Result result;
   internal::DatabaseMetadata meta = internal::read_database_metadata(
@@ -258,6 +512,118 @@ Result Database::delete_table(const std::string& table_name) {
       storage_.get(), internal::TableMetadata::descriptor_path(id));
 }
 
+Result Database::compact_table(const std::string& table_name,
+                               i64 target_item_bytes) {
+  Result result;
+  internal::DatabaseMetadata meta = internal::read_database_metadata(
+      storage_.get(), internal::DatabaseMetadata::descriptor_path());
+
+  i32 id = meta.get_table_id(table_name);
+  if (id == -1) {
+    RESULT_ERROR(&result, "Table %s does not exist", table_name.c_str());
+    return result;
+  }
+  internal::TableMetadata table = internal::read_table_metadata(
+      storage_.get(), internal::TableMetadata::descriptor_path(id));
+  const proto::TableDescriptor& old_desc = table.get_descriptor();
+  for (const proto::Column& column : table.columns()) {
+    if (column.type() == proto::ColumnType::Video) {
+      RESULT_ERROR(&result,
+                   "Table %s has video column %s, whose streams can not be "
+                   "concatenated",
+                   table_name.c_str(), column.name().c_str());
+      return result;
+    }
+  }
+  if (old_desc.ephemeral() || old_desc.failed_items_size() > 0) {
+    RESULT_ERROR(&result, "Table %s has items that are not in storage",
+                 table_name.c_str());
+    return result;
+  }
+
+  // Merge runs of consecutive items until they hold target_item_bytes
+  i32 num_columns = table.columns().size();
+  i32 num_items = old_desc.end_rows_size();
+  std::vector<std::vector<std::vector<u64>>> offsets(num_items);
+  std::vector<std::vector<i32>> groups;
+  u64 group_bytes = 0;
+  for (i32 item = 0; item < num_items; ++item) {
+    if (groups.empty() || group_bytes >= (u64)target_item_bytes) {
+      groups.emplace_back();
+      group_bytes = 0;
+    }
+    groups.back().push_back(item);
+    for (i32 c = 0; c < num_columns; ++c) {
+      offsets[item].push_back(
+          item_element_offsets(storage_.get(), table, c, item));
+      group_bytes += offsets[item][c].back() - offsets[item][c].front();
+    }
+  }
+  if ((i32)groups.size() == num_items) {
+    result.set_success(true);
+    return result;
+  }
+
+  // The compacted items are written as a new table, which takes the name
+  // of the old one when the database metadata is written, so readers see
+  // either all of the old items or all of the new ones. Like deleted
+  // tables, the old table's files are left in storage.
+  meta.remove_table(id);
+  i32 new_id = meta.add_table(table_name);
+  proto::TableDescriptor new_desc = old_desc;
+  new_desc.set_id(new_id);
+  new_desc.set_timestamp(
+      std::chrono::duration_cast<std::chrono::seconds>(now().time_since_epoch())
+          .count());
+  new_desc.set_packed_items(false);
+  new_desc.clear_end_rows();
+  new_desc.clear_item_addresses();
+
+  std::vector<u8> buffer;
+  for (i32 g = 0; g < (i32)groups.size(); ++g) {
+    for (i32 c = 0; c < num_columns; ++c) {
+      std::unique_ptr<storehouse::WriteFile> data_file;
+      BACKOFF_FAIL(storehouse::make_unique_write_file(
+          storage_.get(), internal::table_item_output_path(new_id, c, g),
+          data_file));
+      std::unique_ptr<storehouse::WriteFile> metadata_file;
+      BACKOFF_FAIL(storehouse::make_unique_write_file(
+          storage_.get(), internal::table_item_metadata_path(new_id, c, g),
+          metadata_file));
+      for (i32 item : groups[g]) {
+        const std::vector<u64>& item_offsets = offsets[item][c];
+        u64 num_elements = item_offsets.size() - 1;
+        s_write(metadata_file.get(), num_elements);
+        for (u64 i = 0; i < num_elements; ++i) {
+          s_write(metadata_file.get(), item_offsets[i + 1] - item_offsets[i]);
+        }
+
+        std::unique_ptr<storehouse::RandomReadFile> old_file;
+        BACKOFF_FAIL(storehouse::make_unique_random_read_file(
+            storage_.get(), internal::item_data_path(table, c, item),
+            old_file));
+        u64 pos = item_offsets.front();
+        while (pos < item_offsets.back()) {
+          u64 size = std::min(item_offsets.back() - pos, COMPACT_COPY_SIZE);
+          buffer.resize(size);
+          s_read(old_file.get(), buffer.data(), size, pos);
+          s_write(data_file.get(), buffer.data(), size);
+        }
+      }
+      BACKOFF_FAIL(data_file->save());
+      BACKOFF_FAIL(metadata_file->save());
+    }
+    new_desc.add_end_rows(old_desc.end_rows(groups[g].back()));
+  }
+
+  internal::write_table_metadata(storage_.get(),
+                                 internal::TableMetadata(new_desc));
+  internal::write_database_metadata(storage_.get(), meta);
+
+  result.set_success(true);
+  return result;
+}
+
 Result Database::shutdown_master() {
   LOG(FATAL) << "Not implemented yet!";
 
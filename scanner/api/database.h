@@ -33,6 +33,14 @@ struct MachineParameters {
   i32 num_save_workers;
   std::vector<i32>
       gpu_ids;  //!< List of CUDA device IDs that Scanner should use.
+  bool partition_cores;  //!< Pin load/decode/save and kernel groups to
+                         //!< disjoint sets of cores.
+  i32 num_io_cores;  //!< Cores for load/decode/save, 0 for a quarter of them.
+  std::string disk_cache_path;  //!< Local directory caching remote table
+                                //!< blocks, empty for none.
+  i64 disk_cache_bytes;  //!< Capacity of the disk cache.
+  bool disk_cache_lfu;  //!< Evict least often instead of least recently
+                        //!< used blocks.
 };
 
 //! Pick smart defaults for the current machine.
@@ -50,11 +58,12 @@ class Database {
   Database(storehouse::StorageConfig* storage_config,
            const std::string& db_path, const std::string& master_address);
 
+  //! A nonzero metrics_port also serves Prometheus metrics over HTTP on it
   Result start_master(const MachineParameters& params, const std::string& port,
-                      bool watchdog = true);
+                      bool watchdog = true, i32 metrics_port = 0);
 
   Result start_worker(const MachineParameters& params, const std::string& port,
-                      bool watchdog = true);
+                      bool watchdog = true, i32 metrics_port = 0);
 
   Result ingest_videos(const std::vector<std::string>& table_names,
                        const std::vector<std::string>& paths,
@@ -64,8 +73,39 @@ class Database {
                    const std::vector<std::string>& columns,
                    const std::vector<std::vector<std::string>>& rows);
 
+  //! Creates a table from columnar buffers. Column j has num_rows elements
+  //! stored back to back at column_data[j], of the byte sizes given by
+  //! column_sizes[j]. The rows are split into items of rows_per_item rows
+  //! whose item and metadata files are written by num_threads threads.
+  Result new_columnar_table(const std::string& table_name,
+                            const std::vector<std::string>& columns,
+                            const std::vector<const u8*>& column_data,
+                            const std::vector<const i64*>& column_sizes,
+                            i64 num_rows, i64 rows_per_item,
+                            i32 num_threads);
+
+  //! Creates a table of num_rows rows of pseudo-random elements of
+  //! element_bytes in each column, split into items of rows_per_item rows.
+  //! The bytes are written straight in the item format, so large tables can
+  //! be made quickly to stress the scheduler, metadata and loaders.
+  Result new_synthetic_table(const std::string& table_name,
+                             const std::vector<std::string>& columns,
+                             i64 num_rows, i64 rows_per_item,
+                             i64 element_bytes);
+
+  //! Adds a table per name with a video of frames_per_video frames repeating
+  //! the packets of the video at template_path, without encoding anything
+  Result ingest_synthetic_videos(const std::vector<std::string>& table_names,
+                                 const std::string& template_path,
+                                 i64 frames_per_video);
+
   Result delete_table(const std::string& table_name);
 
+  //! Merges consecutive items of a table into items of at least
+  //! target_item_bytes, so tables written with small io packets are read
+  //! from a few large files. The table keeps its name but gets a new id.
+  Result compact_table(const std::string& table_name, i64 target_item_bytes);
+
   Result shutdown_master();
 
   Result shutdown_worker();
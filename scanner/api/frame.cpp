@@ -30,6 +30,9 @@ size_t size_of_frame_type(FrameType type) {
     case FrameType::F64:
       s = sizeof(f64);
       break;
+    case FrameType::F16:
+      s = sizeof(u16);
+      break;
   }
   return s;
 }
@@ -82,9 +85,17 @@ int FrameInfo::height() const { return shape[0]; }
 //! Only valid when the dimensions are (height, width, channels)
 int FrameInfo::channels() const { return shape[2]; }
 
-Frame::Frame(FrameInfo info, u8* b) : data(b) {
+FrameInfo frame_info_for_format(int height, int width, PixelFormat format) {
+  if (format == PixelFormat::NV12) {
+    return FrameInfo(height * 3 / 2, width, 1, FrameType::U8);
+  }
+  return FrameInfo(height, width, 3, FrameType::U8);
+}
+
+Frame::Frame(FrameInfo info, u8* b, size_t stride) : data(b) {
   memcpy(shape, info.shape, sizeof(int) * FRAME_DIMS);
   type = info.type;
+  row_stride = stride == 0 ? row_size() : stride;
 }
 
 FrameInfo Frame::as_frame_info() const {
@@ -93,6 +104,19 @@ FrameInfo Frame::as_frame_info() const {
 
 size_t Frame::size() const { return as_frame_info().size(); }
 
+size_t Frame::span_size() const {
+  if (shape[0] == 0) {
+    return 0;
+  }
+  return (shape[0] - 1) * row_stride + row_size();
+}
+
+size_t Frame::row_size() const {
+  return size_of_frame_type(type) * shape[1] * shape[2];
+}
+
+bool Frame::is_contiguous() const { return row_stride == row_size(); }
+
 int Frame::width() const { return as_frame_info().width(); }
 
 int Frame::height() const { return as_frame_info().height(); }
@@ -101,16 +125,49 @@ int Frame::height() const { return as_frame_info().height(); }
 int Frame::channels() const { return as_frame_info().channels(); }
 
 Frame* new_frame(DeviceHandle device, FrameInfo info) {
-  u8* buffer = new_buffer(device, info.size());
+  u8* buffer = new_recycled_block_buffer(device, info.size(), 1);
   return new Frame(info, buffer);
 }
 
 std::vector<Frame*> new_frames(DeviceHandle device, FrameInfo info, i32 num) {
-  u8* buffer = new_block_buffer(device, info.size() * num, num);
+  u8* buffer = new_recycled_block_buffer(device, info.size() * num, num);
   std::vector<Frame*> frames;
   for (i32 i = 0; i < num; ++i) {
     frames.push_back(new Frame(info, buffer + i * info.size()));
   }
   return frames;
 }
+
+Frame* new_frame_view(DeviceHandle device, const Frame* parent, int row,
+                      int col, int height, int width) {
+  LOG_IF(FATAL, row < 0 || col < 0 || row + height > parent->height() ||
+                    col + width > parent->width())
+      << "Frame view (" << row << ", " << col << ", " << height << ", "
+      << width << ") is outside of its " << parent->height() << "x"
+      << parent->width() << " parent";
+  add_buffer_ref(device, parent->data);
+  size_t pixel_size = size_of_frame_type(parent->type) * parent->channels();
+  u8* data = parent->data + row * parent->row_stride + col * pixel_size;
+  return new Frame(FrameInfo(height, width, parent->channels(), parent->type),
+                   data, parent->row_stride);
+}
+
+void make_frame_contiguous(DeviceHandle device, Frame* frame) {
+  if (frame->is_contiguous()) {
+    return;
+  }
+  i32 rows = frame->height();
+  u8* buffer = new_block_buffer(device, frame->size(), 1);
+  std::vector<u8*> dest_rows(rows);
+  std::vector<u8*> src_rows(rows);
+  std::vector<size_t> sizes(rows, frame->row_size());
+  for (i32 r = 0; r < rows; ++r) {
+    dest_rows[r] = buffer + r * frame->row_size();
+    src_rows[r] = frame->data + r * frame->row_stride;
+  }
+  memcpy_vec(dest_rows, device, src_rows, device, sizes);
+  delete_buffer(device, frame->data);
+  frame->data = buffer;
+  frame->row_stride = frame->row_size();
+}
 }
@@ -24,6 +24,7 @@
 namespace scanner {
 
 using proto::FrameType;
+using proto::PixelFormat;
 
 size_t size_of_frame_type(FrameType type);
 
@@ -60,12 +61,23 @@ struct FrameInfo {
 //! Frame
 class Frame {
  public:
-  Frame(FrameInfo info, u8* buffer);
+  //! A row_stride of 0 means the rows are packed one after another
+  Frame(FrameInfo info, u8* buffer, size_t row_stride = 0);
 
   FrameInfo as_frame_info() const;
 
+  //! Bytes of pixel data, not counting the padding between strided rows
   size_t size() const;
 
+  //! Bytes from data to the end of the last row, which is what has to be
+  //! copied to move the frame without losing its layout
+  size_t span_size() const;
+
+  //! Bytes in one row of pixels
+  size_t row_size() const;
+
+  bool is_contiguous() const;
+
   //! Only valid when the dimensions are (height, width, channels)
   int width() const;
 
@@ -78,11 +90,27 @@ class Frame {
   int shape[FRAME_DIMS];
   FrameType type;
   u8* data;
+  //! Bytes between the starts of consecutive rows. Larger than row_size()
+  //! for views into a region of a wider parent frame.
+  size_t row_stride;
 };
 
+//! Shape of a U8 frame of the given size and pixel format
+FrameInfo frame_info_for_format(int height, int width, PixelFormat format);
+
 Frame* new_frame(DeviceHandle device, FrameInfo info);
 
 void delete_frame(DeviceHandle device, u8* buffer);
 
 std::vector<Frame*> new_frames(DeviceHandle device, FrameInfo info, i32 num);
+
+//! Frame viewing the (height, width) region of parent at (row, col) without
+//! copying it. The view holds its own reference on the parent's buffer, so
+//! it is deleted like any other frame and outlives the parent if needed.
+Frame* new_frame_view(DeviceHandle device, const Frame* parent, int row,
+                      int col, int height, int width);
+
+//! Replaces the data of a strided view with a packed copy of its rows and
+//! drops the view's reference on its parent. Packed frames are left as is.
+void make_frame_contiguous(DeviceHandle device, Frame* frame);
 }
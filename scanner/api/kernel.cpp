@@ -26,8 +26,37 @@ Element::Element(u8* _buffer, size_t _size)
 Element::Element(Frame* frame)
   : buffer((u8*)frame), size(sizeof(Frame)), is_frame(true) {}
 
+bool is_tensor_batch(const ElementList& column, i32 start, i32 count) {
+  if (count <= 0 || start + count > (i32)column.size() ||
+      !column[start].is_frame) {
+    return false;
+  }
+  const Frame* first = column[start].as_const_frame();
+  if (!first->is_contiguous()) {
+    return false;
+  }
+  FrameInfo info = first->as_frame_info();
+  for (i32 i = 1; i < count; ++i) {
+    const Frame* frame = column[start + i].as_const_frame();
+    if (frame->as_frame_info() != info || !frame->is_contiguous() ||
+        frame->data != first->data + i * info.size()) {
+      return false;
+    }
+  }
+  return true;
+}
+
 BaseKernel::BaseKernel(const KernelConfig& config) {}
 
+std::future<void> BaseKernel::execute_kernel_async(
+    const StenciledBatchedColumns& input_columns,
+    BatchedColumns& output_columns) {
+  execute_kernel(input_columns, output_columns);
+  std::promise<void> done;
+  done.set_value();
+  return done.get_future();
+}
+
 StenciledBatchedKernel::StenciledBatchedKernel(const KernelConfig& config)
     : BaseKernel(config) {}
 
@@ -43,36 +72,62 @@ StenciledKernel::StenciledKernel(const KernelConfig& config)
 void StenciledKernel::execute_kernel(
     const StenciledBatchedColumns& input_columns,
     BatchedColumns& output_columns) {
-  StenciledColumns in;
-  for (auto& col : input_columns) {
-    in.emplace_back();
-    std::vector<Element>& b = in.back();
-    b = col[0];
+  in_scratch_.resize(input_columns.size());
+  for (size_t i = 0; i < input_columns.size(); ++i) {
+    const ElementList& stencil = input_columns[i][0];
+    in_scratch_[i].assign(stencil.begin(), stencil.end());
   }
 
-  Columns out_cols(output_columns.size());
-  execute(in, out_cols);
-  for (size_t i = 0; i < out_cols.size(); ++i) {
-    output_columns[i].push_back(out_cols[i]);
+  out_scratch_.assign(output_columns.size(), Element());
+  execute(in_scratch_, out_scratch_);
+  for (size_t i = 0; i < out_scratch_.size(); ++i) {
+    output_columns[i].push_back(out_scratch_[i]);
   }
 }
 
-BatchedKernel::BatchedKernel(const KernelConfig& config)
+AsyncBatchedKernel::AsyncBatchedKernel(const KernelConfig& config)
     : BaseKernel(config) {}
 
-void BatchedKernel::execute_kernel(
+void AsyncBatchedKernel::execute_kernel(
     const StenciledBatchedColumns& input_columns,
     BatchedColumns& output_columns) {
-  BatchedColumns in;
+  execute_kernel_async(input_columns, output_columns).wait();
+}
+
+std::future<void> AsyncBatchedKernel::execute_kernel_async(
+    const StenciledBatchedColumns& input_columns,
+    BatchedColumns& output_columns) {
+  auto in = std::make_shared<BatchedColumns>();
   for (auto& col : input_columns) {
-    in.emplace_back();
-    std::vector<Element>& b = in.back();
+    in->emplace_back();
+    std::vector<Element>& b = in->back();
     for (auto& stencil : col) {
       b.push_back(stencil[0]);
     }
   }
+  // The unstenciled inputs are kept until the batch is done
+  std::shared_future<void> issued =
+      execute_async(*in, output_columns).share();
+  return std::async(std::launch::deferred,
+                    [in, issued]() { issued.get(); });
+}
+
+BatchedKernel::BatchedKernel(const KernelConfig& config)
+    : BaseKernel(config) {}
 
-  execute(in, output_columns);
+void BatchedKernel::execute_kernel(
+    const StenciledBatchedColumns& input_columns,
+    BatchedColumns& output_columns) {
+  in_scratch_.resize(input_columns.size());
+  for (size_t i = 0; i < input_columns.size(); ++i) {
+    ElementList& b = in_scratch_[i];
+    b.clear();
+    for (auto& stencil : input_columns[i]) {
+      b.push_back(stencil[0]);
+    }
+  }
+
+  execute(in_scratch_, output_columns);
 }
 
 Kernel::Kernel(const KernelConfig& config)
@@ -81,16 +136,15 @@ Kernel::Kernel(const KernelConfig& config)
 void Kernel::execute_kernel(
     const StenciledBatchedColumns& input_columns,
     BatchedColumns& output_columns) {
-
-  Columns in_cols;
+  in_scratch_.clear();
   for (auto& col : input_columns) {
-    in_cols.push_back(col[0][0]);
+    in_scratch_.push_back(col[0][0]);
   }
 
-  Columns out_cols(output_columns.size());
-  execute(in_cols, out_cols);
-  for (size_t i = 0; i < out_cols.size(); ++i) {
-    output_columns[i].push_back(out_cols[i]);
+  out_scratch_.assign(output_columns.size(), Element());
+  execute(in_scratch_, out_scratch_);
+  for (size_t i = 0; i < out_scratch_.size(); ++i) {
+    output_columns[i].push_back(out_scratch_[i]);
   }
 }
 
@@ -110,9 +164,14 @@ void VideoKernel::check_frame(const DeviceHandle& device,
 
 void VideoKernel::check_frame_info(const DeviceHandle& device,
                                    const Element& element) {
-  // Assume that all the FrameInfos in the same batch are the same
-  u8* buffer = new_buffer(CPU_DEVICE, element.size);
-  memcpy_buffer((u8*)buffer, CPU_DEVICE, element.buffer, device, element.size);
+  // Assume that all the FrameInfos in the same batch are the same. Only
+  // frame infos on other devices are copied to be compared.
+  u8* buffer = element.buffer;
+  if (device.type != DeviceType::CPU) {
+    buffer = new_buffer(CPU_DEVICE, element.size);
+    memcpy_buffer((u8*)buffer, CPU_DEVICE, element.buffer, device,
+                  element.size);
+  }
   FrameInfo* frame_info = reinterpret_cast<FrameInfo*>(buffer);
 
   bool same = (frame_info->type == frame_info_.type);
@@ -124,7 +183,9 @@ void VideoKernel::check_frame_info(const DeviceHandle& device,
     frame_info_.type = frame_info->type;
     new_frame_info();
   }
-  delete_buffer(CPU_DEVICE, buffer);
+  if (buffer != element.buffer) {
+    delete_buffer(CPU_DEVICE, buffer);
+  }
 }
 
 namespace internal {
@@ -134,9 +195,17 @@ KernelRegistration::KernelRegistration(const KernelBuilder& builder) {
   i32 num_devices = builder.num_devices_;
   bool can_batch = builder.can_batch_;
   i32 preferred_batch = builder.preferred_batch_size_;
+  bool can_fuse = builder.can_fuse_;
+  bool can_update_in_place = builder.can_update_in_place_;
+  bool can_serialize_state = builder.can_serialize_state_;
+  bool can_reduce = builder.can_reduce_;
+  i64 device_memory_bytes = builder.device_memory_bytes_;
+  i64 device_memory_per_row = builder.device_memory_per_row_;
   KernelConstructor constructor = builder.constructor_;
   internal::KernelFactory* factory = new internal::KernelFactory(
-      name, type, num_devices, can_batch, preferred_batch, constructor);
+      name, type, num_devices, can_batch, preferred_batch, constructor,
+      can_fuse, can_update_in_place, can_serialize_state,
+      device_memory_bytes, device_memory_per_row, can_reduce);
   internal::KernelRegistry* registry = internal::get_kernel_registry();
   registry->add_kernel(name, factory);
 }
@@ -20,6 +20,7 @@
 #include "scanner/util/memory.h"
 #include "scanner/util/profiler.h"
 
+#include <future>
 #include <vector>
 
 namespace scanner {
@@ -50,6 +51,10 @@ struct Element {
   bool is_frame;
   // @brief the index of the element in the input domain
   i64 index;
+  // @brief set on inputs of in_place() kernels that hold the only reference
+  // to their buffer. The kernel may write into such an input and insert it,
+  // unchanged, as the matching output instead of allocating a new one.
+  bool writable = false;
 };
 
 using ElementList = std::vector<Element>;
@@ -65,6 +70,12 @@ using Columns = std::vector<Element>;
 
 inline size_t num_rows(const ElementList& column) { return column.size(); }
 
+//! True if rows [start, start + count) of the column are packed frames of one
+//! shape laid out back to back, like the frames returned by new_frames, so
+//! the range can be handed on as a single (count, shape...) tensor without
+//! copying it
+bool is_tensor_batch(const ElementList& column, i32 start, i32 count);
+
 inline void insert_element(ElementList& column, u8* buffer, size_t size) {
   column.push_back(::scanner::Element{buffer, size});
 }
@@ -81,21 +92,48 @@ inline void insert_frame(Element& element, Frame* frame) {
   element = ::scanner::Element{frame};
 }
 
-inline Element add_element_ref(DeviceHandle device, Element& element) {
+inline Element add_element_ref(DeviceHandle device, const Element& element) {
   Element ele;
   if (element.is_frame) {
-    Frame* frame = element.as_frame();
+    const Frame* frame = element.as_const_frame();
     add_buffer_ref(device, frame->data);
     // Copy frame because Frame is not referenced counted
-    ele = ::scanner::Element{new Frame(frame->as_frame_info(), frame->data)};
+    ele = ::scanner::Element{
+        new Frame(frame->as_frame_info(), frame->data, frame->row_stride)};
   } else {
     add_buffer_ref(device, element.buffer);
     ele = element;
+    ele.writable = false;
   }
   ele.index = element.index;
   return ele;
 }
 
+// Appends count references to element to elements, taking the buffer
+// references with one allocator update instead of one per copy
+inline void add_element_refs(DeviceHandle device, const Element& element,
+                             i32 count, ElementList& elements) {
+  if (count <= 0) {
+    return;
+  }
+  if (element.is_frame) {
+    const Frame* frame = element.as_const_frame();
+    add_buffer_refs(device, frame->data, count);
+    for (i32 i = 0; i < count; ++i) {
+      // Copy frame because Frame is not referenced counted
+      Element ele = ::scanner::Element{
+          new Frame(frame->as_frame_info(), frame->data, frame->row_stride)};
+      ele.index = element.index;
+      elements.push_back(ele);
+    }
+  } else {
+    add_buffer_refs(device, element.buffer, count);
+    Element ele = element;
+    ele.writable = false;
+    elements.insert(elements.end(), count, ele);
+  }
+}
+
 inline void delete_element(DeviceHandle device, Element& element) {
   if (element.is_frame) {
     Frame* frame = element.as_frame();
@@ -115,6 +153,11 @@ struct KernelConfig {
   std::vector<std::string> output_columns;
   std::vector<u8> args;  //! Byte-string of proto args if given.
   i32 node_id;
+  //! For GPU kernels, the stream (a cudaStream_t) from the process's
+  //! CUDAStreamPool the kernel first runs on, so that constructors can bind
+  //! state such as cv::cuda::Stream objects to it. A kernel kept for later
+  //! jobs may be moved to another stream with set_stream.
+  void* stream = nullptr;
 };
 
 /**
@@ -152,22 +195,80 @@ class BaseKernel {
    */
   virtual void reset(){};
 
+  /**
+   * @brief Writes the logical state built up from the inputs seen so far,
+   *        for kernels registered with serializable_state().
+   *
+   * Called once the kernel has been given the last row of a task, so that
+   * the next task of the same stream can pick up from that row instead of
+   * replaying the stream from its start.
+   */
+  virtual void serialize_state(std::vector<u8>& state){};
+
+  /**
+   * @brief Restores a state written by serialize_state, possibly of another
+   *        instance on another node.
+   *
+   * Called after reset, before the kernel is given the rows that follow the
+   * ones the state covers.
+   */
+  virtual void deserialize_state(const std::vector<u8>& state){};
+
+  /**
+   * @brief Folds a partial result written by serialize_state, possibly of
+   *        another instance on another node, into the state, for kernels
+   *        registered with reduce().
+   */
+  virtual void combine_state(const std::vector<u8>& partial){};
+
   /**
    * @brief For internal use
    **/
   virtual void execute_kernel(const StenciledBatchedColumns& input_columns,
                               BatchedColumns& output_columns) = 0;
 
+  /**
+   * @brief For internal use
+   *
+   * Batches the runtime may keep outstanding with execute_kernel_async, 0
+   * for kernels that finish each batch in execute_kernel.
+   **/
+  virtual i32 max_batches_in_flight() { return 0; }
+
+  /**
+   * @brief For internal use
+   *
+   * Issues a batch and returns a future that is ready once output_columns
+   * hold its outputs. Both columns must stay alive until then.
+   **/
+  virtual std::future<void> execute_kernel_async(
+      const StenciledBatchedColumns& input_columns,
+      BatchedColumns& output_columns);
+
   /**
    * @brief For internal use
    **/
   virtual void set_profiler(Profiler* profiler) { profiler_ = profiler; }
 
+  /**
+   * @brief For internal use
+   **/
+  virtual void set_stream(void* stream) { stream_ = stream; }
+
   /**
    * The profiler allows an op to save profiling data for later
    * visualization. It is not guaranteed to be non-null, so check before use.
    */
   Profiler* profiler_ = nullptr;
+
+  /**
+   * For GPU kernels, the CUDA stream (a cudaStream_t) owned by the runtime
+   * for this kernel, and nullptr otherwise. Work issued on it does not have
+   * to be finished when execute returns: the runtime keeps a few batches in
+   * flight and waits on the stream before the outputs are read or the
+   * inputs are freed.
+   */
+  void* stream_ = nullptr;
 };
 
 
@@ -288,6 +389,71 @@ class BatchedKernel : public BaseKernel {
    */
   virtual void execute(const BatchedColumns& input_columns,
                        BatchedColumns& output_columns) = 0;
+
+ private:
+  // Unstenciled inputs, kept across calls so their storage is reused
+  BatchedColumns in_scratch_;
+};
+
+/**
+ * @brief Interface for a batched kernel whose batches complete
+ *        asynchronously, e.g. requests to a remote inference service or
+ *        work submitted to an accelerator queue.
+ *
+ * Instead of blocking the pipeline thread until a batch is done, the
+ * runtime issues up to max_batches_in_flight batches before waiting on the
+ * oldest, and consumes their outputs in the order they were issued.
+ */
+class AsyncBatchedKernel : public BaseKernel {
+ public:
+  static const i32 DEFAULT_BATCHES_IN_FLIGHT = 4;
+
+  AsyncBatchedKernel(const KernelConfig& config);
+
+  virtual ~AsyncBatchedKernel(){};
+
+  /**
+   * @brief For internal use
+   *
+   * Waits for the batch, for the places the runtime can not keep batches
+   * outstanding.
+   **/
+  virtual void execute_kernel(const StenciledBatchedColumns& input_columns,
+                              BatchedColumns& output_columns) override;
+
+  /**
+   * @brief For internal use
+   **/
+  virtual std::future<void> execute_kernel_async(
+      const StenciledBatchedColumns& input_columns,
+      BatchedColumns& output_columns) override;
+
+  /**
+   * @brief Most batches issued and not yet complete.
+   *
+   * Override to match the concurrency of the service the kernel calls.
+   */
+  virtual i32 max_batches_in_flight() override {
+    return DEFAULT_BATCHES_IN_FLIGHT;
+  }
+
+ protected:
+  /**
+   * @brief Issues the op on a batch of input elements and returns a future
+   *        that is ready once the output elements are in output_columns.
+   *
+   * @param input_columns
+   *        vector of columns, where each column is a vector of inputs
+   * @param output_columns
+   *        op output, each column must have same length as the number of
+   *        input elements once the future is ready
+   *
+   * input_columns and output_columns stay alive and untouched by the runtime
+   * until the future is ready. Several batches may be outstanding at once,
+   * and they may complete in any order.
+   */
+  virtual std::future<void> execute_async(const BatchedColumns& input_columns,
+                                          BatchedColumns& output_columns) = 0;
 };
 
 class StenciledKernel : public BaseKernel {
@@ -323,6 +489,11 @@ class StenciledKernel : public BaseKernel {
    */
   virtual void execute(const StenciledColumns& input_columns,
                        Columns& output_columns) = 0;
+
+ private:
+  // Per-row inputs and outputs, kept across calls so their storage is reused
+  StenciledColumns in_scratch_;
+  Columns out_scratch_;
 };
 
 class Kernel : public BaseKernel {
@@ -356,6 +527,11 @@ class Kernel : public BaseKernel {
    */
   virtual void execute(const Columns& input_columns,
                        Columns& output_columns) = 0;
+
+ private:
+  // Per-row inputs and outputs, kept across calls so their storage is reused
+  Columns in_scratch_;
+  Columns out_scratch_;
 };
 
 //! Kernel with support for frame and frame_info columns.
@@ -402,7 +578,13 @@ class KernelBuilder {
       device_type_(DeviceType::CPU),
       num_devices_(1),
       can_batch_(false),
-      preferred_batch_size_(1) {}
+      preferred_batch_size_(1),
+      can_fuse_(false),
+      can_update_in_place_(false),
+      can_serialize_state_(false),
+      can_reduce_(false),
+      device_memory_bytes_(0),
+      device_memory_per_row_(0) {}
 
   KernelBuilder& device(DeviceType device_type) {
     device_type_ = device_type;
@@ -420,6 +602,56 @@ class KernelBuilder {
     return *this;
   }
 
+  //! Lets the kernel run in the same batch loop as the CPU kernel feeding
+  //! it, reading that kernel's outputs directly instead of through
+  //! materialized columns. The kernel must not hold on to its input
+  //! elements after execute returns.
+  KernelBuilder& fusable() {
+    can_fuse_ = true;
+    return *this;
+  }
+
+  //! Lets the kernel reuse the buffers of its first input column for its
+  //! first output column. When the column is not read after the op, its
+  //! inputs that nothing else references are marked writable, and the
+  //! kernel may write into them and insert them as outputs as they are.
+  //! Only applies to kernels with a single element stencil.
+  KernelBuilder& in_place() {
+    can_update_in_place_ = true;
+    return *this;
+  }
+
+  //! Declares that the kernel implements serialize_state and
+  //! deserialize_state. Streams through an op with unbounded state are then
+  //! evaluated as a chain of tasks that each hand their state to the next,
+  //! rather than tasks that each replay the stream from its start.
+  KernelBuilder& serializable_state() {
+    can_serialize_state_ = true;
+    return *this;
+  }
+
+  //! Declares that the kernel reduces all rows of a job to one result, and
+  //! implements serialize_state and combine_state. Each task starts from
+  //! reset, and its state after its last row is a partial result that the
+  //! master folds into the others with combine_state, in any order, on an
+  //! instance of the op's CPU kernel. The output table of the job then holds
+  //! a single row, the final state, and the per row outputs of execute,
+  //! which may be placeholders, are not saved.
+  KernelBuilder& reduce() {
+    can_reduce_ = true;
+    return *this;
+  }
+
+  //! Declares the device memory a kernel instance allocates outside the
+  //! memory pool: a fixed amount plus an amount per row of its batch.
+  //! Workers cap the pipeline instances sharing each GPU, and shrink batch
+  //! sizes if necessary, so that the declared memory fits on the device.
+  KernelBuilder& device_memory(i64 bytes, i64 bytes_per_row = 0) {
+    device_memory_bytes_ = bytes;
+    device_memory_per_row_ = bytes_per_row;
+    return *this;
+  }
+
  private:
   std::string name_;
   KernelConstructor constructor_;
@@ -427,6 +659,12 @@ class KernelBuilder {
   i32 num_devices_;
   bool can_batch_;
   i32 preferred_batch_size_;
+  bool can_fuse_;
+  bool can_update_in_place_;
+  bool can_serialize_state_;
+  bool can_reduce_;
+  i64 device_memory_bytes_;
+  i64 device_memory_per_row_;
 };
 }
 
@@ -30,6 +30,12 @@ OpRegistration::OpRegistration(const OpBuilder& builder) {
     col.set_id(i++);
     col.set_name(std::get<0>(name_type));
     col.set_type(std::get<1>(name_type));
+    auto it = builder.input_pixel_formats_.find(col.name());
+    if (it != builder.input_pixel_formats_.end()) {
+      for (proto::PixelFormat format : it->second) {
+        col.add_pixel_formats(format);
+      }
+    }
     input_columns.push_back(col);
   }
   std::vector<Column> output_columns;
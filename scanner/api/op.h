@@ -18,6 +18,7 @@
 #include "scanner/util/common.h"
 #include "scanner/util/profiler.h"
 
+#include <map>
 #include <vector>
 
 namespace scanner {
@@ -60,7 +61,11 @@ class OpBuilder {
     return *this;
   }
 
-  OpBuilder& frame_input(const std::string& name) {
+  //! formats lists the pixel formats besides RGB24 the Op can take frames
+  //  in, so the decoder may skip converting to RGB for it
+  OpBuilder& frame_input(const std::string& name,
+                         const std::vector<proto::PixelFormat>& formats = {}) {
+    input_pixel_formats_[name] = formats;
     return input(name, ColumnType::Video);
   }
 
@@ -105,6 +110,7 @@ class OpBuilder {
   std::string name_;
   bool variadic_inputs_;
   std::vector<std::tuple<std::string, ColumnType>> input_columns_;
+  std::map<std::string, std::vector<proto::PixelFormat>> input_pixel_formats_;
   std::vector<std::tuple<std::string, ColumnType>> output_columns_;
   bool can_stencil_;
   std::vector<int> preferred_stencil_ = {0};
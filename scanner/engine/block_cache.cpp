@@ -0,0 +1,367 @@
+/* Copyright 2017 Carnegie Mellon University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "scanner/engine/block_cache.h"
+#include "scanner/engine/metadata.h"
+#include "scanner/util/fs.h"
+
+#include <glog/logging.h>
+
+#include <dirent.h>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <sstream>
+
+namespace scanner {
+namespace internal {
+
+namespace {
+
+const u32 DISK_BLOCK_MAGIC = 0x4b4c4253;
+
+// Precedes the file path and data of every block file
+struct DiskHeader {
+  u32 magic;
+  u32 path_size;
+  u64 block_index;
+  i64 timestamp;
+  u64 data_size;
+};
+
+bool read_disk_header(FILE* fp, DiskHeader& header, std::string& path) {
+  if (std::fread(&header, sizeof(header), 1, fp) != 1 ||
+      header.magic != DISK_BLOCK_MAGIC) {
+    return false;
+  }
+  path.resize(header.path_size);
+  return header.path_size == 0 ||
+         std::fread(&path[0], 1, header.path_size, fp) == header.path_size;
+}
+}
+
+BlockCache::BlockCache(size_t max_bytes, u64 block_size)
+  : max_bytes_(max_bytes), block_size_(block_size) {}
+
+BlockCache::Block BlockCache::get(const std::string& path, u64 block_index) {
+  Key key = std::make_tuple(path, block_index);
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    auto it = entries_.find(key);
+    if (it != entries_.end()) {
+      lru_.splice(lru_.begin(), lru_, it->second.lru_position);
+      return it->second.block;
+    }
+    if (disk_dir_.empty()) {
+      return nullptr;
+    }
+  }
+  Block block = read_disk(key);
+  if (block == nullptr) {
+    return nullptr;
+  }
+  std::unique_lock<std::mutex> lock(mutex_);
+  if (entries_.count(key) == 0 && block->size() <= max_bytes_) {
+    while (bytes_ + block->size() > max_bytes_) {
+      erase(entries_.find(lru_.back()));
+    }
+    lru_.push_front(key);
+    entries_[key] = Entry{block, lru_.begin()};
+    bytes_ += block->size();
+  }
+  return block;
+}
+
+void BlockCache::put(const std::string& path, u64 block_index, Block block) {
+  size_t bytes = block->size();
+  Key key = std::make_tuple(path, block_index);
+  bool disk = false;
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    disk = !disk_dir_.empty();
+    if (bytes <= max_bytes_) {
+      auto it = entries_.find(key);
+      if (it != entries_.end()) {
+        // Another reader fetched the same block concurrently
+        erase(it);
+      }
+      while (bytes_ + bytes > max_bytes_) {
+        erase(entries_.find(lru_.back()));
+      }
+      lru_.push_front(key);
+      entries_[key] = Entry{block, lru_.begin()};
+      bytes_ += bytes;
+    }
+  }
+  if (disk) {
+    write_disk(key, block);
+  }
+}
+
+bool BlockCache::file_size(const std::string& path, u64& size) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  auto it = file_sizes_.find(path);
+  if (it == file_sizes_.end()) {
+    return false;
+  }
+  size = it->second;
+  return true;
+}
+
+void BlockCache::put_file_size(const std::string& path, u64 size) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  file_sizes_[path] = size;
+}
+
+void BlockCache::set_disk_tier(const std::string& dir, u64 max_bytes,
+                               Eviction eviction) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  disk_entries_.clear();
+  disk_order_.clear();
+  disk_bytes_ = 0;
+  disk_dir_ = dir;
+  disk_max_bytes_ = max_bytes;
+  disk_eviction_ = eviction;
+  if (disk_dir_.empty()) {
+    return;
+  }
+  mkdir_p(disk_dir_.c_str(), S_IRWXU);
+  scan_disk();
+}
+
+void BlockCache::validate_table(i32 table_id, i64 timestamp) {
+  std::string prefix = table_directory(table_id) + "/";
+  std::unique_lock<std::mutex> lock(mutex_);
+  auto ts = table_timestamps_.find(table_id);
+  bool changed = ts == table_timestamps_.end() || ts->second != timestamp;
+  table_timestamps_[table_id] = timestamp;
+  if (!changed) {
+    return;
+  }
+  auto starts_with_prefix = [&prefix](const std::string& path) {
+    return path.compare(0, prefix.size(), prefix) == 0;
+  };
+  for (auto it = entries_.lower_bound(std::make_tuple(prefix, (u64)0));
+       it != entries_.end() && starts_with_prefix(std::get<0>(it->first));) {
+    auto next = std::next(it);
+    erase(it);
+    it = next;
+  }
+  for (auto it = file_sizes_.lower_bound(prefix);
+       it != file_sizes_.end() && starts_with_prefix(it->first);) {
+    it = file_sizes_.erase(it);
+  }
+  for (auto it = disk_entries_.lower_bound(std::make_tuple(prefix, (u64)0));
+       it != disk_entries_.end();) {
+    if (!starts_with_prefix(std::get<0>(it->first))) {
+      break;
+    }
+    auto next = std::next(it);
+    if (it->second.timestamp != timestamp) {
+      erase_disk(it);
+    }
+    it = next;
+  }
+}
+
+void BlockCache::clear() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  entries_.clear();
+  lru_.clear();
+  bytes_ = 0;
+  file_sizes_.clear();
+}
+
+void BlockCache::erase(std::map<Key, Entry>::iterator it) {
+  bytes_ -= it->second.block->size();
+  lru_.erase(it->second.lru_position);
+  entries_.erase(it);
+}
+
+BlockCache::DiskRank BlockCache::disk_rank(const Key& key,
+                                           const DiskEntry& entry) const {
+  if (disk_eviction_ == Eviction::LFU) {
+    return std::make_tuple(entry.uses, entry.last_use, key);
+  }
+  return std::make_tuple(entry.last_use, (u64)0, key);
+}
+
+std::string BlockCache::disk_path(const Key& key) const {
+  std::stringstream name;
+  name << disk_dir_ << "/" << std::hex
+       << std::hash<std::string>()(std::get<0>(key)) << std::dec << "_"
+       << std::get<1>(key) << ".blk";
+  return name.str();
+}
+
+BlockCache::Block BlockCache::read_disk(const Key& key) {
+  std::string path;
+  u64 size;
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    auto it = disk_entries_.find(key);
+    if (it == disk_entries_.end()) {
+      return nullptr;
+    }
+    DiskEntry& entry = it->second;
+    disk_order_.erase(disk_rank(key, entry));
+    entry.uses++;
+    entry.last_use = disk_clock_++;
+    disk_order_.insert(disk_rank(key, entry));
+    path = disk_path(key);
+    size = entry.size;
+  }
+
+  FILE* fp = std::fopen(path.c_str(), "rb");
+  DiskHeader header;
+  std::string file_path;
+  std::shared_ptr<std::vector<u8>> block;
+  if (fp != nullptr && read_disk_header(fp, header, file_path) &&
+      file_path == std::get<0>(key) && header.block_index == std::get<1>(key) &&
+      header.data_size == size) {
+    block = std::make_shared<std::vector<u8>>(size);
+    if (std::fread(block->data(), 1, size, fp) != size) {
+      block.reset();
+    }
+  }
+  if (fp != nullptr) {
+    std::fclose(fp);
+  }
+  if (block == nullptr) {
+    // Overwritten by a block whose name collides, or removed underneath us
+    std::unique_lock<std::mutex> lock(mutex_);
+    auto it = disk_entries_.find(key);
+    if (it != disk_entries_.end()) {
+      disk_bytes_ -= it->second.size;
+      disk_order_.erase(disk_rank(key, it->second));
+      disk_entries_.erase(it);
+    }
+  }
+  return block;
+}
+
+void BlockCache::write_disk(const Key& key, const Block& block) {
+  u64 size = block->size();
+  std::string path;
+  DiskHeader header;
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (size > disk_max_bytes_ || disk_entries_.count(key) > 0) {
+      return;
+    }
+    while (disk_bytes_ + size > disk_max_bytes_) {
+      erase_disk(disk_entries_.find(std::get<2>(*disk_order_.begin())));
+    }
+    path = disk_path(key);
+    header.timestamp = path_timestamp(std::get<0>(key));
+  }
+  header.magic = DISK_BLOCK_MAGIC;
+  header.path_size = std::get<0>(key).size();
+  header.block_index = std::get<1>(key);
+  header.data_size = size;
+
+  // Written aside and renamed, so a crash never leaves a partial block
+  std::string temp_path = path + ".tmp" + std::to_string(std::rand());
+  FILE* fp = std::fopen(temp_path.c_str(), "wb");
+  if (fp == nullptr) {
+    LOG(WARNING) << "Could not write cache block " << temp_path;
+    return;
+  }
+  bool ok = std::fwrite(&header, sizeof(header), 1, fp) == 1 &&
+            std::fwrite(std::get<0>(key).data(), 1, header.path_size, fp) ==
+                header.path_size &&
+            std::fwrite(block->data(), 1, size, fp) == size;
+  ok = std::fclose(fp) == 0 && ok;
+  if (!ok || std::rename(temp_path.c_str(), path.c_str()) != 0) {
+    LOG(WARNING) << "Could not write cache block " << path;
+    std::remove(temp_path.c_str());
+    return;
+  }
+
+  std::unique_lock<std::mutex> lock(mutex_);
+  if (disk_entries_.count(key) > 0) {
+    return;
+  }
+  DiskEntry entry{size, header.timestamp, 1, disk_clock_++};
+  disk_entries_[key] = entry;
+  disk_order_.insert(disk_rank(key, entry));
+  disk_bytes_ += size;
+}
+
+void BlockCache::erase_disk(std::map<Key, DiskEntry>::iterator it) {
+  std::remove(disk_path(it->first).c_str());
+  disk_bytes_ -= it->second.size;
+  disk_order_.erase(disk_rank(it->first, it->second));
+  disk_entries_.erase(it);
+}
+
+void BlockCache::scan_disk() {
+  DIR* dir = opendir(disk_dir_.c_str());
+  if (dir == nullptr) {
+    LOG(WARNING) << "Could not open block cache directory " << disk_dir_;
+    disk_dir_.clear();
+    return;
+  }
+  std::vector<std::string> stale;
+  while (struct dirent* ent = readdir(dir)) {
+    std::string name = ent->d_name;
+    if (name.size() < 4 || name.compare(name.size() - 4, 4, ".blk") != 0) {
+      if (name.find(".tmp") != std::string::npos) {
+        stale.push_back(disk_dir_ + "/" + name);
+      }
+      continue;
+    }
+    std::string path = disk_dir_ + "/" + name;
+    FILE* fp = std::fopen(path.c_str(), "rb");
+    if (fp == nullptr) {
+      continue;
+    }
+    DiskHeader header;
+    std::string file_path;
+    bool ok = read_disk_header(fp, header, file_path);
+    std::fclose(fp);
+    Key key = std::make_tuple(file_path, header.block_index);
+    if (!ok || disk_path(key) != path || disk_entries_.count(key) > 0) {
+      stale.push_back(path);
+      continue;
+    }
+    DiskEntry entry{header.data_size, header.timestamp, 0, disk_clock_++};
+    disk_entries_[key] = entry;
+    disk_order_.insert(disk_rank(key, entry));
+    disk_bytes_ += entry.size;
+  }
+  closedir(dir);
+  for (const std::string& path : stale) {
+    std::remove(path.c_str());
+  }
+  // The capacity may have shrunk since the blocks were written
+  while (disk_bytes_ > disk_max_bytes_) {
+    erase_disk(disk_entries_.find(std::get<2>(*disk_order_.begin())));
+  }
+  VLOG(1) << "Block cache found " << disk_entries_.size() << " blocks ("
+          << disk_bytes_ << " bytes) in " << disk_dir_;
+}
+
+i64 BlockCache::path_timestamp(const std::string& path) const {
+  std::string tables = get_database_path() + "tables/";
+  if (path.compare(0, tables.size(), tables) != 0) {
+    return -1;
+  }
+  i32 table_id = std::atoi(path.c_str() + tables.size());
+  auto it = table_timestamps_.find(table_id);
+  return it != table_timestamps_.end() ? it->second : -1;
+}
+}
+}
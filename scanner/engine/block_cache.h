@@ -0,0 +1,145 @@
+/* Copyright 2017 Carnegie Mellon University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include "scanner/util/common.h"
+
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <tuple>
+#include <vector>
+
+namespace scanner {
+namespace internal {
+
+// Fixed size blocks of database files, shared by every load worker of a
+// node and kept across jobs. Jobs over the same source tables, and tasks
+// whose stencil or warmup windows overlap, read the same byte ranges again;
+// with the cache only the first read goes to storage. Table files are never
+// modified once written, so blocks are keyed by file path alone. Least
+// recently used blocks are evicted once the cache exceeds its byte budget.
+//
+// Given a disk tier, every block put is also written to a directory on
+// local disk, typically an SSD, and blocks missing from memory are read back
+// from there. The directory is indexed again when a worker starts, so the
+// blocks outlive the process and repeated jobs over the same tables skip
+// remote storage altogether. A table id can be reused for a new table once
+// the old one is deleted, so blocks record the timestamp of their table and
+// are dropped when validate_table sees a different one.
+class BlockCache {
+ public:
+  using Block = std::shared_ptr<const std::vector<u8>>;
+
+  enum class Eviction {
+    // Least recently used blocks go first
+    LRU,
+    // Least often used blocks go first, then least recently used
+    LFU,
+  };
+
+  BlockCache(size_t max_bytes = DEFAULT_MAX_BYTES,
+             u64 block_size = DEFAULT_BLOCK_SIZE);
+
+  u64 block_size() const { return block_size_; }
+
+  //! Returns the block_index'th block of the file, or nullptr if it is not
+  //! cached
+  Block get(const std::string& path, u64 block_index);
+
+  //! Blocks hold block_size bytes, except for the last block of a file
+  void put(const std::string& path, u64 block_index, Block block);
+
+  //! Looks up the size of a file recorded with put_file_size
+  bool file_size(const std::string& path, u64& size);
+
+  void put_file_size(const std::string& path, u64 size);
+
+  //! Keeps blocks in files under dir, up to max_bytes of them, and indexes
+  //! the blocks earlier processes left there
+  void set_disk_tier(const std::string& dir, u64 max_bytes,
+                     Eviction eviction = Eviction::LRU);
+
+  //! Drops the blocks of the table's files if they were cached for a table
+  //! with a different timestamp
+  void validate_table(i32 table_id, i64 timestamp);
+
+  void clear();
+
+  static const size_t DEFAULT_MAX_BYTES = 512 * 1024 * 1024;
+  static const u64 DEFAULT_BLOCK_SIZE = 1024 * 1024;
+
+ private:
+  using Key = std::tuple<std::string, u64>;
+
+  struct Entry {
+    Block block;
+    std::list<Key>::iterator lru_position;
+  };
+
+  struct DiskEntry {
+    u64 size;
+    i64 timestamp;
+    u64 uses;
+    u64 last_use;
+  };
+  // Eviction rank followed by the key, lowest evicted first
+  using DiskRank = std::tuple<u64, u64, Key>;
+
+  void erase(std::map<Key, Entry>::iterator it);
+
+  DiskRank disk_rank(const Key& key, const DiskEntry& entry) const;
+
+  std::string disk_path(const Key& key) const;
+
+  //! Reads a block from the disk tier, nullptr if it is not there
+  Block read_disk(const Key& key);
+
+  void write_disk(const Key& key, const Block& block);
+
+  //! Must hold mutex_
+  void erase_disk(std::map<Key, DiskEntry>::iterator it);
+
+  //! Indexes the block files in the disk directory. Must hold mutex_.
+  void scan_disk();
+
+  //! Timestamp of the table a path belongs to, -1 for other files. Must hold
+  //! mutex_.
+  i64 path_timestamp(const std::string& path) const;
+
+  const size_t max_bytes_;
+  const u64 block_size_;
+  std::mutex mutex_;
+  std::map<Key, Entry> entries_;
+  // Most recently used first
+  std::list<Key> lru_;
+  size_t bytes_ = 0;
+  std::map<std::string, u64> file_sizes_;
+
+  std::string disk_dir_;
+  u64 disk_max_bytes_ = 0;
+  Eviction disk_eviction_ = Eviction::LRU;
+  std::map<Key, DiskEntry> disk_entries_;
+  std::set<DiskRank> disk_order_;
+  u64 disk_bytes_ = 0;
+  u64 disk_clock_ = 0;
+  std::map<i32, i64> table_timestamps_;
+};
+}
+}
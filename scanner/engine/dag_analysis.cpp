@@ -18,6 +18,9 @@
 #include "scanner/api/op.h"
 #include "scanner/api/kernel.h"
 
+#include <algorithm>
+#include <set>
+
 namespace scanner {
 namespace internal {
 
@@ -30,6 +33,94 @@ bool is_builtin_op(const std::string& name) {
   return false;
 }
 
+i32 eliminate_common_subexpressions(std::vector<proto::Op>& ops,
+                                    std::vector<proto::Job>& jobs) {
+  // Sampling args for an Op serialized across all jobs, so that sampling Ops
+  // are only merged when they sample identically everywhere
+  auto job_sampling_key = [&](i64 op_idx) {
+    std::string key;
+    for (const proto::Job& job : jobs) {
+      for (const auto& saa : job.sampling_args_assignment()) {
+        if (saa.op_index() == op_idx) {
+          key += saa.SerializeAsString();
+        }
+      }
+      key += "|";
+    }
+    return key;
+  };
+
+  std::vector<proto::Op> new_ops;
+  // Old Op index -> new Op index
+  std::vector<i64> new_index(ops.size(), -1);
+  std::map<std::string, i64> seen_ops;
+  for (size_t i = 0; i < ops.size(); ++i) {
+    proto::Op op = ops[i];
+    bool valid_inputs = true;
+    for (auto& input : *op.mutable_inputs()) {
+      i64 parent = input.op_index();
+      if (parent < 0 || parent >= (i64)i) {
+        // Leave malformed edges for validate_jobs_and_ops to report
+        valid_inputs = false;
+        continue;
+      }
+      input.set_op_index(new_index[parent]);
+    }
+    // Input Ops are bound to job columns by index and OutputTable is unique,
+    // so only regular and sampling kernels are candidates
+    bool candidate = valid_inputs && op.name() != INPUT_OP_NAME &&
+                     op.name() != OUTPUT_OP_NAME &&
+                     op.name() != SLICE_OP_NAME &&
+                     op.name() != UNSLICE_OP_NAME;
+    if (candidate) {
+      std::string key = op.SerializeAsString() + job_sampling_key(i);
+      auto it = seen_ops.find(key);
+      if (it != seen_ops.end()) {
+        new_index[i] = it->second;
+        continue;
+      }
+      seen_ops[key] = new_ops.size();
+    }
+    new_index[i] = new_ops.size();
+    new_ops.push_back(op);
+  }
+
+  i32 removed = ops.size() - new_ops.size();
+  if (removed == 0) {
+    return 0;
+  }
+  for (proto::Job& job : jobs) {
+    for (auto& ci : *job.mutable_inputs()) {
+      if (ci.op_index() >= 0 && ci.op_index() < (i64)ops.size()) {
+        ci.set_op_index(new_index[ci.op_index()]);
+      }
+    }
+    // Drop the sampling args of merged Ops, which are identical to the ones
+    // of the Op they were merged into
+    std::vector<proto::SamplingArgsAssignment> kept;
+    std::set<i64> assigned;
+    for (auto& saa : job.sampling_args_assignment()) {
+      if (saa.op_index() < 0 || saa.op_index() >= (i64)ops.size()) {
+        kept.push_back(saa);
+        continue;
+      }
+      i64 op_idx = new_index[saa.op_index()];
+      if (assigned.count(op_idx) > 0) {
+        continue;
+      }
+      assigned.insert(op_idx);
+      kept.push_back(saa);
+      kept.back().set_op_index(op_idx);
+    }
+    job.clear_sampling_args_assignment();
+    for (auto& saa : kept) {
+      job.add_sampling_args_assignment()->CopyFrom(saa);
+    }
+  }
+  ops.swap(new_ops);
+  return removed;
+}
+
 Result validate_jobs_and_ops(
     DatabaseMetadata& meta, TableMetaCache& table_metas,
     const std::vector<proto::Job>& jobs,
@@ -56,6 +147,7 @@ Result validate_jobs_and_ops(
     // Slices are currently restricted to not nest and there to only exist
     // a single slice grouping from start to finish currently.
     std::vector<std::string> op_names;
+    std::set<i64> reduce_ops;
     for (auto& op : ops) {
       op_names.push_back(op.name());
 
@@ -264,6 +356,36 @@ Result validate_jobs_and_ops(
               op.name().c_str(), op_idx);
           return result;
         }
+        // Every row must reach a reduce kernel exactly once, so warmup rows
+        // and rows replayed from the start of the job are ruled out
+        if (factory->can_reduce()) {
+          bool stencils_row =
+              op.stencil_size() > 0
+                  ? !(op.stencil_size() == 1 && op.stencil(0) == 0)
+                  : info->preferred_stencil() != std::vector<i32>{0};
+          bool video_output = false;
+          for (auto& col : info->output_columns()) {
+            video_output |= col.type() == ColumnType::Video;
+          }
+          if (info->has_bounded_state() || info->has_unbounded_state() ||
+              stencils_row || video_output) {
+            RESULT_ERROR(&result,
+                         "Op %s at index %d reduces its rows, so it can not "
+                         "declare bounded or unbounded state, stencil, or "
+                         "output video columns.",
+                         op.name().c_str(), op_idx);
+            return result;
+          }
+          if (!kernel_registry->has_kernel(op.name(), DeviceType::CPU)) {
+            RESULT_ERROR(&result,
+                         "Op %s at index %d reduces its rows but has no CPU "
+                         "kernel for the master to combine its partial "
+                         "results with.",
+                         op.name().c_str(), op_idx);
+            return result;
+          }
+          reduce_ops.insert(op_idx);
+        }
       }
       op_idx++;
     }
@@ -282,6 +404,40 @@ Result validate_jobs_and_ops(
         return result;
       }
     }
+    // A reduced job outputs a single row, so all of its output columns must
+    // be reduced, and reduced results can not be processed further
+    if (!reduce_ops.empty()) {
+      i64 output_op = (i64)ops.size() - 1;
+      if (!slice_ops.empty()) {
+        RESULT_ERROR(&result, "Reduce Ops can not be used with slices.");
+        return result;
+      }
+      for (i64 reduce_op : reduce_ops) {
+        auto children_it = op_children.find(reduce_op);
+        if (children_it == op_children.end()) {
+          continue;
+        }
+        for (i64 child : children_it->second) {
+          if (child != output_op) {
+            RESULT_ERROR(&result,
+                         "Op %s at index %d reduces its rows, so only the "
+                         "Output Op can consume its results.",
+                         op_names.at(reduce_op).c_str(), reduce_op);
+            return result;
+          }
+        }
+      }
+      for (auto& input : ops.back().inputs()) {
+        if (reduce_ops.count(input.op_index()) == 0) {
+          RESULT_ERROR(&result,
+                       "Output column %s is not reduced, but other output "
+                       "columns are. Reduced and per row columns can not be "
+                       "output by the same bulk job.",
+                       input.column().c_str());
+          return result;
+        }
+      }
+    }
   }
 
   // Validate table tasks
@@ -764,6 +920,8 @@ void populate_analysis_info(const std::vector<proto::Op>& ops,
   std::map<i64, std::vector<i64>>& op_children = info.op_children;
   std::map<i64, bool>& bounded_state_ops = info.bounded_state_ops;
   std::map<i64, bool>& unbounded_state_ops = info.unbounded_state_ops;
+  std::set<i64>& state_handoff_ops = info.state_handoff_ops;
+  std::set<i64>& reduce_ops = info.reduce_ops;
 
   std::map<i64, i32>& warmup_sizes = info.warmup_sizes;
   std::map<i64, i32>& batch_sizes = info.batch_sizes;
@@ -881,10 +1039,78 @@ void populate_analysis_info(const std::vector<proto::Op>& ops,
       }
       else if (info->has_unbounded_state()) {
         unbounded_state_ops[op_idx] = true;
+        if (factory->can_serialize_state()) {
+          state_handoff_ops.insert(op_idx);
+        }
+      }
+      if (factory->can_reduce()) {
+        reduce_ops.insert(op_idx);
       }
     }
     op_idx++;
   }
+  if (!slice_ops.empty()) {
+    state_handoff_ops.clear();
+  }
+}
+
+void export_row_analysis(const DAGAnalysisInfo& info,
+                         std::vector<proto::JobRowAnalysis>& jobs) {
+  auto export_counts =
+      [](const std::map<i64, std::vector<i64>>& counts,
+         google::protobuf::Map<i64, proto::RowCounts>* out) {
+        for (auto& kv : counts) {
+          proto::RowCounts& rows = (*out)[kv.first];
+          for (i64 r : kv.second) {
+            rows.add_rows(r);
+          }
+        }
+      };
+  jobs.clear();
+  for (size_t i = 0; i < info.total_output_rows.size(); ++i) {
+    jobs.emplace_back();
+    proto::JobRowAnalysis& job = jobs.back();
+    for (auto& kv : info.slice_input_rows.at(i)) {
+      (*job.mutable_slice_input_rows())[kv.first] = kv.second;
+    }
+    export_counts(info.slice_output_rows.at(i),
+                  job.mutable_slice_output_rows());
+    export_counts(info.unslice_input_rows.at(i),
+                  job.mutable_unslice_input_rows());
+    export_counts(info.total_rows_per_op.at(i),
+                  job.mutable_total_rows_per_op());
+    job.set_total_output_rows(info.total_output_rows.at(i));
+  }
+}
+
+void import_row_analysis(const std::vector<proto::JobRowAnalysis>& jobs,
+                         DAGAnalysisInfo& info) {
+  auto import_counts =
+      [](const google::protobuf::Map<i64, proto::RowCounts>& counts,
+         std::map<i64, std::vector<i64>>& out) {
+        for (auto& kv : counts) {
+          out[kv.first] =
+              std::vector<i64>(kv.second.rows().begin(), kv.second.rows().end());
+        }
+      };
+  info.slice_input_rows.clear();
+  info.slice_output_rows.clear();
+  info.unslice_input_rows.clear();
+  info.total_rows_per_op.clear();
+  info.total_output_rows.clear();
+  for (const proto::JobRowAnalysis& job : jobs) {
+    info.slice_input_rows.emplace_back();
+    for (auto& kv : job.slice_input_rows()) {
+      info.slice_input_rows.back()[kv.first] = kv.second;
+    }
+    info.slice_output_rows.emplace_back();
+    import_counts(job.slice_output_rows(), info.slice_output_rows.back());
+    info.unslice_input_rows.emplace_back();
+    import_counts(job.unslice_input_rows(), info.unslice_input_rows.back());
+    info.total_rows_per_op.emplace_back();
+    import_counts(job.total_rows_per_op(), info.total_rows_per_op.back());
+    info.total_output_rows.push_back(job.total_output_rows());
+  }
 }
 
 void remap_input_op_edges(std::vector<proto::Op>& ops,
@@ -908,6 +1134,7 @@ void remap_input_op_edges(std::vector<proto::Op>& ops,
       std::string new_column_name =
           rename_col(op_idx, op.inputs(0).column());
       proto::OpInput* new_input = ops.at(0).add_inputs();
+      new_input->CopyFrom(op.inputs(0));
       new_input->set_op_index(-1);
       new_input->set_column(new_column_name);
 
@@ -997,6 +1224,24 @@ void perform_liveness_analysis(const std::vector<proto::Op>& ops,
     }
   }
 
+  // Input columns no Op reads can be left out of the load entirely
+  results.unread_input_columns.clear();
+  {
+    std::set<std::string> read_columns;
+    for (size_t i = 1; i < ops.size(); ++i) {
+      for (auto& eval_input : ops.at(i).inputs()) {
+        if (eval_input.op_index() == 0) {
+          read_columns.insert(eval_input.column());
+        }
+      }
+    }
+    for (i32 c = 0; c < ops.at(0).inputs_size(); ++c) {
+      if (read_columns.count(ops.at(0).inputs(c).column()) == 0) {
+        results.unread_input_columns.insert(c);
+      }
+    }
+  }
+
   // The live columns at each op index
   live_columns.resize(ops.size());
   for (size_t i = 0; i < ops.size(); ++i) {
@@ -1097,6 +1342,83 @@ void perform_liveness_analysis(const std::vector<proto::Op>& ops,
   }
 }
 
+void perform_fusion_analysis(const std::vector<proto::Op>& ops,
+                             DAGAnalysisInfo& results) {
+  OpRegistry* op_registry = get_op_registry();
+  KernelRegistry* kernel_registry = get_kernel_registry();
+
+  auto can_fuse = [&](i64 op_idx) {
+    auto& op = ops.at(op_idx);
+    if (is_builtin_op(op.name()) || op.device_type() != DeviceType::CPU) {
+      return false;
+    }
+    KernelFactory* factory =
+        kernel_registry->get_kernel(op.name(), op.device_type());
+    if (!factory->can_fuse()) {
+      return false;
+    }
+    // Stateful kernels depend on seeing their own warmup and reset cycle,
+    // and reduce kernels on serializing their own partial results
+    if (results.bounded_state_ops.count(op_idx) > 0 ||
+        results.unbounded_state_ops.count(op_idx) > 0 ||
+        results.reduce_ops.count(op_idx) > 0) {
+      return false;
+    }
+    return results.stencils.at(op_idx) == std::vector<i32>{0};
+  };
+
+  // The first and last Ops are always the builtin input and output Ops
+  for (size_t i = 2; i + 1 < ops.size(); ++i) {
+    i64 prev = i - 1;
+    auto& op = ops.at(i);
+    if (!can_fuse(prev) || !can_fuse(i) ||
+        results.batch_sizes.at(prev) != results.batch_sizes.at(i) ||
+        op.inputs_size() == 0) {
+      continue;
+    }
+    // The previous Op's outputs must feed only this Op so that they never
+    // need to be materialized in the side columns
+    bool sole_consumer = true;
+    for (i64 child : results.op_children.at(prev)) {
+      if (child != (i64)i) {
+        sole_consumer = false;
+        break;
+      }
+    }
+    if (!sole_consumer) {
+      continue;
+    }
+    // Map each input onto the previous Op's outputs, skipping the ones that
+    // are discarded right after it executes
+    const std::vector<Column>& prev_cols =
+        op_registry->get_op_info(ops.at(prev).name())->output_columns();
+    const std::vector<i32>& prev_unused = results.unused_outputs.at(prev);
+    std::vector<i32> mapping;
+    for (auto& input : op.inputs()) {
+      if (input.op_index() != prev) {
+        break;
+      }
+      i32 kept_idx = 0;
+      for (size_t c = 0; c < prev_cols.size(); ++c) {
+        if (std::find(prev_unused.begin(), prev_unused.end(), (i32)c) !=
+            prev_unused.end()) {
+          continue;
+        }
+        if (prev_cols[c].name() == input.column()) {
+          mapping.push_back(kept_idx);
+          break;
+        }
+        kept_idx++;
+      }
+    }
+    if (mapping.size() != (size_t)op.inputs_size()) {
+      continue;
+    }
+    results.fused_ops[i] = true;
+    results.fused_input_mapping[i] = mapping;
+  }
+}
+
 Result derive_stencil_requirements(
     const DatabaseMetadata& meta, const TableMetaCache& table_meta,
     const proto::Job& job, const std::vector<proto::Op>& ops,
@@ -1104,7 +1426,8 @@ Result derive_stencil_requirements(
     proto::BulkJobParameters::BoundaryCondition boundary_condition,
     i64 table_id, i64 job_idx, i64 task_idx,
     const std::vector<i64>& output_rows, LoadWorkEntry& output_entry,
-    std::deque<TaskStream>& task_streams) {
+    std::deque<TaskStream>& task_streams,
+    const std::map<i64, i64>& state_start_rows) {
   const std::map<i64, std::vector<i32>>& stencils = analysis_results.stencils;
   const std::vector<std::vector<std::tuple<i32, std::string>>>& live_columns =
       analysis_results.live_columns;
@@ -1206,6 +1529,8 @@ Result derive_stencil_requirements(
   };
   // Walk up the Ops to derive upstream rows
   i32 slice_group = 0;
+  // Ops that continue from a handed off state instead of replaying
+  std::map<i64, bool> resume_states;
   {
     // Initialize output rows
     required_output_rows_at_op.at(num_ops - 1) =
@@ -1336,6 +1661,7 @@ Result derive_stencil_requirements(
         assert(!is_builtin_op(op.name()));
         std::unordered_set<i64> current_rows;
         current_rows.reserve(downstream_rows.size());
+        bool resume_state = false;
         // If bounded state, we need to handle warmup
         if (bounded_state_ops.count(op_idx) > 0) {
           i32 warmup = warmup_sizes.at(op_idx);
@@ -1350,10 +1676,19 @@ Result derive_stencil_requirements(
             }
           }
         }
-        // If unbounded state, we need all upstream inputs from 0
+        // If unbounded state, we need all upstream inputs from 0, or from
+        // the row the state handed off by the previous task stopped at
         else if (unbounded_state_ops.count(op_idx) > 0) {
-          i32 max_required_row = downstream_rows.back();
-          for (i64 i = 0; i <= max_required_row; ++i) {
+          i64 first_row = 0;
+          auto start_it = state_start_rows.find(op_idx);
+          if (start_it != state_start_rows.end() && !downstream_rows.empty() &&
+              downstream_rows.front() >= start_it->second) {
+            first_row = start_it->second;
+            resume_state = true;
+          }
+          i64 max_required_row =
+              downstream_rows.empty() ? -1 : downstream_rows.back();
+          for (i64 i = first_row; i <= max_required_row; ++i) {
             current_rows.insert(i);
           }
         } else {
@@ -1373,6 +1708,7 @@ Result derive_stencil_requirements(
         }
         new_rows = std::vector<i64>(stencil_rows.begin(), stencil_rows.end());
         std::sort(new_rows.begin(), new_rows.end());
+        resume_states.insert(std::make_pair(op_idx, resume_state));
       }
 
       required_input_rows_at_op.at(op_idx) = new_rows;
@@ -1408,6 +1744,8 @@ Result derive_stencil_requirements(
       s.valid_input_rows = new_rows;
       s.compute_input_rows = compute_rows;
       s.valid_output_rows = downstream_rows;
+      s.resume_state = resume_states.count(op_idx) > 0 &&
+                       resume_states.at(op_idx);
       task_streams.push_front(s);
     }
   }
@@ -1419,6 +1757,14 @@ Result derive_stencil_requirements(
     auto out_sample = output_entry.add_samples();
     out_sample->set_table_id(table_ids[i]);
     out_sample->set_column_id(column_ids[i]);
+    out_sample->set_decode_width(ops.at(0).inputs(i).decode_width());
+    out_sample->set_decode_height(ops.at(0).inputs(i).decode_height());
+    out_sample->set_decode_format(ops.at(0).inputs(i).decode_format());
+    // Keep the column's slot so column indices line up, but request no rows
+    // so the load and decode stages skip it
+    if (analysis_results.unread_input_columns.count(i) > 0) {
+      continue;
+    }
     google::protobuf::RepeatedField<i64> input_data(
         required_input_op_input_rows.at(i).begin(),
         required_input_op_input_rows.at(i).end());
@@ -18,6 +18,7 @@
 #include "scanner/engine/runtime.h"
 
 #include <deque>
+#include <set>
 
 namespace scanner {
 namespace internal {
@@ -63,6 +64,13 @@ struct DAGAnalysisInfo {
 
   std::map<i64, bool> bounded_state_ops;
   std::map<i64, bool> unbounded_state_ops;
+  // Unbounded state Ops whose kernels can serialize their state, so the
+  // tasks of a job run in order and each hands its state to the next. Empty
+  // for bulk jobs with slices, whose state restarts with every group.
+  std::set<i64> state_handoff_ops;
+  // Ops whose kernels reduce all rows of a job to one result, combined by
+  // the master from the partial result of every task
+  std::set<i64> reduce_ops;
   std::map<i64, i32> warmup_sizes;
   std::map<i64, i32> batch_sizes;
   std::map<i64, std::vector<i32>> stencils;
@@ -75,9 +83,24 @@ struct DAGAnalysisInfo {
   std::vector<std::vector<i32>> dead_columns;
   std::vector<std::vector<i32>> unused_outputs;
   std::vector<std::vector<i32>> column_mapping;
+  // Columns of the first Op that no other Op reads. They are not loaded.
+  std::set<i32> unread_input_columns;
+
+  // Filled in by perform_fusion_analysis
+  // Op -> whether it runs inside the batch loop of the Op before it
+  std::map<i64, bool> fused_ops;
+  // Op -> for each input, index into the previous Op's kept outputs
+  std::map<i64, std::vector<i32>> fused_input_mapping;
 };
 
 
+// Merge Ops which compute the same thing (same kernel, arguments, parameters
+// and inputs in every job) so that they are evaluated once and their output
+// columns are shared by all downstream Ops. Rewrites the Op indices in ops and
+// in each job's sampling args. Returns the number of Ops removed.
+i32 eliminate_common_subexpressions(std::vector<proto::Op>& ops,
+                                    std::vector<proto::Job>& jobs);
+
 Result validate_jobs_and_ops(
     DatabaseMetadata& meta, TableMetaCache& table_metas,
     const std::vector<proto::Job>& jobs,
@@ -101,6 +124,14 @@ Result derive_slice_final_output_rows(
 void populate_analysis_info(const std::vector<proto::Op>& ops,
                             DAGAnalysisInfo& info);
 
+// Copy the per job row counts from determine_input_rows_to_slices to and
+// from their wire form, so that workers can reuse the master's results
+void export_row_analysis(const DAGAnalysisInfo& info,
+                         std::vector<proto::JobRowAnalysis>& jobs);
+
+void import_row_analysis(const std::vector<proto::JobRowAnalysis>& jobs,
+                         DAGAnalysisInfo& info);
+
 // Change all edges from input Ops to instead come from the first Op.
 // We currently only implement IO at the start and end of a pipeline.
 void remap_input_op_edges(std::vector<proto::Op>& ops,
@@ -109,6 +140,12 @@ void remap_input_op_edges(std::vector<proto::Op>& ops,
 void perform_liveness_analysis(const std::vector<proto::Op>& ops,
                                DAGAnalysisInfo& info);
 
+// Find chains of adjacent CPU kernels that can run back to back on each
+// batch without materializing the intermediate columns. Must be called after
+// perform_liveness_analysis.
+void perform_fusion_analysis(const std::vector<proto::Op>& ops,
+                             DAGAnalysisInfo& info);
+
 Result derive_stencil_requirements(
     const DatabaseMetadata& meta, const TableMetaCache& table_meta,
     const proto::Job& job, const std::vector<proto::Op>& ops,
@@ -116,7 +153,8 @@ Result derive_stencil_requirements(
     proto::BulkJobParameters::BoundaryCondition boundary_condition,
     i64 table_id, i64 job_idx, i64 task_idx,
     const std::vector<i64>& output_rows, LoadWorkEntry& output_entry,
-    std::deque<TaskStream>& task_streams);
+    std::deque<TaskStream>& task_streams,
+    const std::map<i64, i64>& state_start_rows = std::map<i64, i64>());
 
 // Result derive_input_rows_from_output_rows(
 //     const std::vector<proto::Job>& jobs,
@@ -0,0 +1,77 @@
+/* Copyright 2017 Carnegie Mellon University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "scanner/engine/decoded_frame_cache.h"
+#include "scanner/util/memory.h"
+
+#include <iterator>
+
+namespace scanner {
+namespace internal {
+
+DecodedFrameCache::~DecodedFrameCache() { clear(); }
+
+bool DecodedFrameCache::contains(const Key& key) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return entries_.count(key) > 0;
+}
+
+Frame* DecodedFrameCache::acquire(const Key& key) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = entries_.find(key);
+  if (it == entries_.end()) {
+    return nullptr;
+  }
+  add_buffer_ref(it->second.device, it->second.buffer);
+  return new Frame(it->second.info, it->second.buffer);
+}
+
+void DecodedFrameCache::insert(const Key& key, const Frame* frame) {
+  i64 size = frame->size();
+  if (size > capacity_) {
+    return;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (entries_.count(key) > 0) {
+    return;
+  }
+  while (size_ + size > capacity_ && !order_.empty()) {
+    evict_oldest();
+  }
+  DeviceHandle device{(DeviceType)std::get<6>(key), std::get<7>(key)};
+  add_buffer_ref(device, frame->data);
+  order_.push_back(key);
+  entries_[key] = Entry{frame->as_frame_info(), device, frame->data,
+                        std::prev(order_.end())};
+  size_ += size;
+}
+
+void DecodedFrameCache::clear() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  while (!order_.empty()) {
+    evict_oldest();
+  }
+}
+
+void DecodedFrameCache::evict_oldest() {
+  auto it = entries_.find(order_.front());
+  delete_buffer(it->second.device, it->second.buffer);
+  size_ -= it->second.info.size();
+  entries_.erase(it);
+  order_.pop_front();
+}
+}
+}
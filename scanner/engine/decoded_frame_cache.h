@@ -0,0 +1,92 @@
+/* Copyright 2017 Carnegie Mellon University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#pragma once
+
+#include "scanner/api/frame.h"
+#include "scanner/util/common.h"
+
+#include <list>
+#include <map>
+#include <mutex>
+#include <set>
+#include <tuple>
+
+namespace scanner {
+namespace internal {
+
+// Decoded frames of the video columns that several jobs of a bulk job read,
+// shared by the pipeline instances of a worker. When jobs with different
+// samplers or downstream ops read the same rows of a video, the first task
+// to decode a row leaves it here and the tasks of the other jobs take a
+// reference to it instead of decoding it again. Frames are evicted in the
+// order they were decoded once the cache holds more than its capacity.
+class DecodedFrameCache {
+ public:
+  // Table, column and row of the frame, then the size and pixel format it
+  // was decoded to and the type and id of the device holding it
+  using Key = std::tuple<i32, i32, i64, i32, i32, i32, i32, i32>;
+
+  static Key make_key(i32 table_id, i32 column_id, i64 row,
+                      const FrameInfo& info, i32 format, DeviceHandle device) {
+    return std::make_tuple(table_id, column_id, row, info.width(),
+                           info.height(), format, (i32)device.type,
+                           device.id);
+  }
+
+  explicit DecodedFrameCache(i64 capacity) : capacity_(capacity) {}
+
+  ~DecodedFrameCache();
+
+  //! Columns read by more than one job, the only ones worth caching. Set
+  //! before the pipeline instances start.
+  void set_shared_columns(const std::set<std::tuple<i32, i32>>& columns) {
+    shared_columns_ = columns;
+  }
+
+  bool is_shared(i32 table_id, i32 column_id) const {
+    return shared_columns_.count(std::make_tuple(table_id, column_id)) > 0;
+  }
+
+  bool contains(const Key& key);
+
+  //! Returns a new frame referencing the cached frame, or nullptr
+  Frame* acquire(const Key& key);
+
+  //! Keeps a reference to the frame's buffer
+  void insert(const Key& key, const Frame* frame);
+
+  void clear();
+
+ private:
+  struct Entry {
+    FrameInfo info;
+    DeviceHandle device;
+    u8* buffer;
+    std::list<Key>::iterator position;
+  };
+
+  void evict_oldest();
+
+  std::set<std::tuple<i32, i32>> shared_columns_;
+  std::mutex mutex_;
+  i64 capacity_;
+  i64 size_ = 0;
+  std::map<Key, Entry> entries_;
+  std::list<Key> order_;
+};
+}
+}
@@ -3,25 +3,193 @@
 #include "scanner/engine/op_registry.h"
 #include "scanner/engine/dag_analysis.h"
 #include "scanner/util/cuda.h"
+#include "scanner/util/cuda_stream_pool.h"
+#include "scanner/util/gpu_direct_storage.h"
 
-#include <google/protobuf/io/coded_stream.h>
-#include <google/protobuf/io/zero_copy_stream_impl_lite.h>
+#include <algorithm>
+#include <deque>
+#include <limits>
 #include <thread>
 
 namespace scanner {
 namespace internal {
 
+namespace {
+// Share of a GPU's memory pool that buffered outputs may keep in use in
+// GPU resident mode before they are moved to the CPU
+const double GPU_RESIDENT_POOL_FRACTION = 0.5;
+// Keyframe distance of the software encoder when none is specified
+const i64 DEFAULT_KEYFRAME_DISTANCE = 120;
+const size_t ENCODE_PACKET_BUFFER_SIZE = 4 * 1024 * 1024;
+// Share of the device pool a batch size sweep may push the pool's
+// high-water mark to
+const double AUTOTUNE_POOL_FRACTION = 0.8;
+// Throughput, relative to the best so far, below which a sweep stops
+const double AUTOTUNE_SLOWDOWN_FRACTION = 0.9;
+
+// Copies every packet the encoder has ready into output
+void drain_packets(VideoEncoder* encoder, bool new_packet,
+                   ElementList& output) {
+  while (new_packet) {
+    size_t buffer_size = ENCODE_PACKET_BUFFER_SIZE;
+    u8* buffer = new_buffer(CPU_DEVICE, buffer_size);
+    size_t actual_size;
+    new_packet = encoder->get_packet(buffer, buffer_size, actual_size);
+    LOG_IF(FATAL, new_packet && actual_size > buffer_size)
+        << "Packet buffer not large enough (" << buffer_size << " vs "
+        << actual_size << ")";
+    insert_element(output, buffer, actual_size);
+  }
+}
+
+// True if element is the only reference to its buffer
+bool element_is_unshared(DeviceHandle device, const Element& element) {
+  u8* buffer =
+      element.is_frame ? element.as_const_frame()->data : element.buffer;
+  return buffer != nullptr && buffer_is_unshared(device, buffer);
+}
+
+// Size and layout of the frames decoded from an interval
+FrameInfo decoded_frame_info(const DecodeArgsView& da) {
+  return da.output_width() > 0
+             ? frame_info_for_format(da.output_height(), da.output_width(),
+                                     da.output_format())
+             : frame_info_for_format(da.height(), da.width(),
+                                     da.output_format());
+}
+}
+
 PreEvaluateWorker::PreEvaluateWorker(const PreEvaluateWorkerArgs& args)
   : node_id_(args.node_id),
     worker_id_(args.worker_id),
     device_handle_(args.device_handle),
     num_cpus_(args.num_cpus),
-    profiler_(args.profiler) {
+    profiler_(args.profiler),
+    decoded_frame_cache_(args.decoded_frame_cache),
+    interval_decoders_(args.interval_decoders) {
+  // Workers are built on the thread they run on, which is the one counted
+  if (args.perf_counters) {
+    perf_counters_.reset(new PerfCounters());
+  }
+  // Select a decoder type based on the type of the first op and
+  // the available decoders
+  if (device_handle_.type == DeviceType::GPU &&
+      VideoDecoder::has_decoder_type(VideoDecoderType::NVIDIA)) {
+    decoder_output_handle_.type = DeviceType::GPU;
+    decoder_output_handle_.id = device_handle_.id;
+    decoder_type_ = VideoDecoderType::NVIDIA;
+    num_decoder_devices_ = 1;
+  } else if (args.qsv_async_depth > 0 &&
+             VideoDecoder::has_decoder_type(VideoDecoderType::INTEL)) {
+    decoder_output_handle_ = CPU_DEVICE;
+    decoder_type_ = VideoDecoderType::INTEL;
+    num_decoder_devices_ = args.qsv_async_depth;
+  } else {
+    decoder_output_handle_ = CPU_DEVICE;
+    decoder_type_ = VideoDecoderType::SOFTWARE;
+    num_decoder_devices_ = std::max(1, args.decoder_threads);
+  }
+}
+
+DecoderAutomata* PreEvaluateWorker::acquire_decoder(const DecoderKey& key,
+                                                    i32 index) {
+  PooledDecoders& pooled = decoder_pool_[key];
+  pooled.last_used = tasks_fed_;
+  if (index < pooled.decoders.size()) {
+    profiler_.increment("decoders_reused", 1);
+    return pooled.decoders[index].get();
+  }
+  // Make room by dropping the decoders that have gone unused the longest
+  while (pooled_decoders_ >= MAX_POOLED_DECODERS) {
+    auto victim = decoder_pool_.end();
+    for (auto it = decoder_pool_.begin(); it != decoder_pool_.end(); ++it) {
+      if (it->second.last_used < tasks_fed_ &&
+          !it->second.decoders.empty() &&
+          (victim == decoder_pool_.end() ||
+           it->second.last_used < victim->second.last_used)) {
+        victim = it;
+      }
+    }
+    if (victim == decoder_pool_.end()) {
+      break;
+    }
+    pooled_decoders_ -= victim->second.decoders.size();
+    decoder_pool_.erase(victim);
+  }
+  auto init_start = now();
+  pooled.decoders.emplace_back(new DecoderAutomata(
+      device_handle_, num_decoder_devices_, decoder_type_));
+  pooled.decoders.back()->set_profiler(&profiler_);
+  pooled_decoders_++;
+  profiler_.add_interval("init", init_start, now());
+  return pooled.decoders.back().get();
+}
+
+std::vector<Frame*> PreEvaluateWorker::decode_intervals(
+    const DecoderKey& key, i32 first_index,
+    const std::vector<DecodeArgsView>& args, i32 num_decoders) {
+  auto decode_start = now();
+  i64 total_frames = 0;
+  for (const DecodeArgsView& da : args) {
+    total_frames += da.valid_frames_size();
+  }
+  std::vector<Frame*> frames = new_frames(
+      decoder_output_handle_, decoded_frame_info(args[0]), total_frames);
+  std::vector<std::thread> threads;
+  size_t first_interval = 0;
+  i64 first_frame = 0;
+  for (i32 d = 0; d < num_decoders; ++d) {
+    size_t end_interval = args.size() * (d + 1) / num_decoders;
+    std::vector<DecodeArgsView> intervals(args.begin() + first_interval,
+                                          args.begin() + end_interval);
+    i64 num_frames = 0;
+    for (const DecodeArgsView& da : intervals) {
+      num_frames += da.valid_frames_size();
+    }
+    DecoderAutomata* decoder = acquire_decoder(key, first_index + d);
+    // Flushes the decoder, as for a single one
+    decoder->initialize(intervals);
+    u8* buffer = frames[first_frame]->data;
+    threads.emplace_back([decoder, buffer, num_frames]() {
+      decoder->get_frames(buffer, num_frames);
+    });
+    first_interval = end_interval;
+    first_frame += num_frames;
+  }
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+  profiler_.add_interval("decode_intervals", decode_start, now());
+  return frames;
 }
 
 void PreEvaluateWorker::feed(EvalWorkEntry& work_entry, bool first) {
   auto feed_start = now();
 
+  // Columns the load worker left on disk are read into the memory of the
+  // device this pipeline instance runs on
+  for (size_t c = 0; c < work_entry.direct_reads.size(); ++c) {
+    if (work_entry.direct_reads[c].empty()) {
+      continue;
+    }
+    DeviceHandle device =
+        device_handle_.type == DeviceType::GPU ? device_handle_ : CPU_DEVICE;
+    auto read_start = now();
+    for (const DirectRead& read : work_entry.direct_reads[c]) {
+      u8* block = new_block_buffer(device, read.size, read.row_sizes.size());
+      LOG_IF(FATAL, !read_file_to_device(read.path, read.offset, read.size,
+                                         device, block))
+          << "Failed to read " << read.path << " into device memory";
+      for (size_t r = 0; r < read.row_sizes.size(); ++r) {
+        insert_element(work_entry.columns[c], block + read.row_offsets[r],
+                       read.row_sizes[r]);
+      }
+    }
+    work_entry.column_handles[c] = device;
+    work_entry.direct_reads[c].clear();
+    profiler_.add_interval("direct_read", read_start, now());
+  }
+
   entry_ = work_entry;
 
   needs_configure_ = !(work_entry.job_index == last_job_idx_);
@@ -36,64 +204,94 @@ void PreEvaluateWorker::feed(EvalWorkEntry& work_entry, bool first) {
         std::max(total_rows_, (i64)work_entry.row_ids[i].size());
   }
 
-  // FIXME: do we need this w/ multiple videos of different resolutions in the
-  // same task?
-  if (needs_configure_) {
-    // decoders_.clear();
-  }
-
-  // Setup decoders if they have not been initialized yet
-  if (decoders_.empty()) {
-    auto init_start = now();
-    VideoDecoderType decoder_type;
-    i32 num_devices;
-    // Select a decoder type based on the type of the first op and
-    // the available decoders
-    if (device_handle_.type == DeviceType::GPU &&
-        VideoDecoder::has_decoder_type(VideoDecoderType::NVIDIA)) {
-      decoder_output_handle_.type = DeviceType::GPU;
-      decoder_output_handle_.id = device_handle_.id;
-      decoder_type = VideoDecoderType::NVIDIA;
-      num_devices = 1;
-    } else {
-      decoder_output_handle_ = CPU_DEVICE;
-      decoder_type = VideoDecoderType::SOFTWARE;
-      num_devices = num_cpus_;
-    }
-    for (size_t c = 0; c < work_entry.columns.size(); ++c) {
-      if (work_entry.column_types[c] == ColumnType::Video) {
-        decoders_.emplace_back(
-            new DecoderAutomata(device_handle_, num_devices, decoder_type));
-        decoders_.back()->set_profiler(&profiler_);
-      }
-    }
-    profiler_.add_interval("init", init_start, now());
-  }
+  tasks_fed_++;
+  decoders_.clear();
+  // Columns in this task that share stream parameters each need their own
+  // decoder from the pool
+  std::map<DecoderKey, i32> decoders_taken;
 
   i32 media_col_idx = 0;
   auto setup_start = now();
-  // Deserialize all decode args into protobufs
+  // Decode args are read in place, and their buffers are handed to the
+  // decoder along with the encoded video they point to
   decode_args_.clear();
+  cache_keys_.clear();
+  cached_frames_.clear();
+  interval_frames_.clear();
   for (size_t c = 0; c < work_entry.columns.size(); ++c) {
-    if (work_entry.column_types[c] == ColumnType::Video &&
-        work_entry.video_encoding_type[media_col_idx] ==
-            proto::VideoDescriptor::H264) {
-      decode_args_.emplace_back();
+    if (work_entry.column_types[c] != ColumnType::Video) {
+      continue;
+    }
+    decode_args_.emplace_back();
+    decoders_.push_back(nullptr);
+    cache_keys_.emplace_back();
+    cached_frames_.emplace_back();
+    interval_frames_.emplace_back();
+    if (work_entry.video_encoding_type[media_col_idx] !=
+        proto::VideoDescriptor::RAW) {
       auto& args = decode_args_.back();
       for (Element element : work_entry.columns[c]) {
-        args.emplace_back();
-        proto::DecodeArgs& da = args.back();
-        google::protobuf::io::ArrayInputStream in_stream(element.buffer,
-                                                         element.size);
-        google::protobuf::io::CodedInputStream cstream(&in_stream);
-        cstream.SetTotalBytesLimit(element.size + 1, element.size + 1);
-        bool result = da.ParseFromCodedStream(&cstream);
-        assert(result);
-        delete_element(CPU_DEVICE, element);
-      }
-      decoders_[media_col_idx]->initialize(args);
-      media_col_idx++;
+        args.emplace_back(element.buffer);
+      }
+      if (!args.empty() && decoded_frame_cache_ != nullptr &&
+          decoded_frame_cache_->is_shared(args[0].table_id(),
+                                          args[0].column_id())) {
+        // Another job may already have decoded every row of the column
+        FrameInfo frame_info = decoded_frame_info(args[0]);
+        auto& keys = cache_keys_.back();
+        for (const DecodeArgsView& da : args) {
+          for (i64 i = 0; i < da.valid_frames_size(); ++i) {
+            keys.push_back(DecodedFrameCache::make_key(
+                da.table_id(), da.column_id(), da.valid_frames(i), frame_info,
+                (i32)da.output_format(), decoder_output_handle_));
+          }
+        }
+        auto& frames = cached_frames_.back();
+        for (const DecodedFrameCache::Key& key : keys) {
+          Frame* frame = decoded_frame_cache_->acquire(key);
+          if (frame == nullptr) {
+            break;
+          }
+          frames.push_back(frame);
+        }
+        if (frames.size() < keys.size()) {
+          for (Frame* frame : frames) {
+            delete_buffer(decoder_output_handle_, frame->data);
+            delete frame;
+          }
+          frames.clear();
+        } else {
+          for (const DecodeArgsView& da : args) {
+            delete_buffer(CPU_DEVICE, (u8*)da.encoded_video());
+            delete_buffer(CPU_DEVICE, (u8*)da.buffer());
+          }
+          args.clear();
+        }
+      }
+      if (!args.empty()) {
+        DecoderKey key = std::make_tuple(
+            (i32)args[0].codec_type(), args[0].width(),
+            args[0].height(), (i32)args[0].chroma_format(),
+            args[0].output_width(), args[0].output_height(),
+            (i32)args[0].output_format());
+        i32 num_decoders =
+            std::min(interval_decoders_, (i32)args.size());
+        if (num_decoders > 1) {
+          // The intervals are independent, so each decoder starts at a
+          // keyframe of its own
+          interval_frames_.back() = decode_intervals(
+              key, decoders_taken[key], args, num_decoders);
+          decoders_taken[key] += num_decoders;
+          media_col_idx++;
+          continue;
+        }
+        decoders_.back() = acquire_decoder(key, decoders_taken[key]++);
+        // Only flushes the decoder; it is reconfigured only when the
+        // frame size changes, which pooling by resolution rules out
+        decoders_.back()->initialize(args);
+      }
     }
+    media_col_idx++;
   }
   first_item_ = first;
   current_row_ = 0;
@@ -132,19 +330,46 @@ bool PreEvaluateWorker::yield(i32 item_size,
     if (work_entry.column_types[c] == ColumnType::Video) {
       // Perform decoding
       i64 num_rows = column_end_row - column_start_row;
-      if (work_entry.video_encoding_type[media_col_idx] ==
-          proto::VideoDescriptor::H264) {
-        if (num_rows > 0) {
+      if (work_entry.video_encoding_type[media_col_idx] !=
+          proto::VideoDescriptor::RAW) {
+        std::vector<Frame*>& cached = cached_frames_[media_col_idx];
+        if (num_rows > 0 && !cached.empty()) {
+          // Decoded by a task of another job reading the same rows
+          for (i64 n = column_start_row; n < column_end_row; ++n) {
+            insert_frame(entry.columns[c], cached[n]);
+          }
+          profiler_.increment("decoded_frames_shared", num_rows);
+        } else if (num_rows > 0 &&
+                   !interval_frames_[media_col_idx].empty()) {
+          std::vector<Frame*>& frames = interval_frames_[media_col_idx];
+          const auto& keys = cache_keys_[media_col_idx];
+          for (i64 n = column_start_row; n < column_end_row; ++n) {
+            if (!keys.empty()) {
+              decoded_frame_cache_->insert(keys[n], frames[n]);
+            }
+            insert_frame(entry.columns[c], frames[n]);
+          }
+        } else if (num_rows > 0) {
           // Encoded as video
-          FrameInfo frame_info(decode_args_[media_col_idx][0].height(),
-                               decode_args_[media_col_idx][0].width(), 3,
-                               FrameType::U8);
-          u8* buffer = new_block_buffer(decoder_output_handle_,
-                                        num_rows * frame_info.size(), num_rows);
-          decoders_[media_col_idx]->get_frames(buffer, num_rows);
+          const DecodeArgsView& da = decode_args_[media_col_idx][0];
+          FrameInfo frame_info = decoded_frame_info(da);
+          std::vector<Frame*> frames =
+              new_frames(decoder_output_handle_, frame_info, num_rows);
+          PerfCounters::Sample perf_start;
+          if (perf_counters_) {
+            perf_start = perf_counters_->read();
+          }
+          decoders_[media_col_idx]->get_frames(frames[0]->data, num_rows);
+          if (perf_counters_) {
+            perf_counters_->record(profiler_, "perf_", "decode", perf_start);
+          }
+          const auto& keys = cache_keys_[media_col_idx];
           for (i64 n = 0; n < num_rows; ++n) {
-            insert_frame(entry.columns[c],
-                         new Frame(frame_info, buffer + frame_info.size() * n));
+            if (!keys.empty()) {
+              decoded_frame_cache_->insert(keys[column_start_row + n],
+                                           frames[n]);
+            }
+            insert_frame(entry.columns[c], frames[n]);
           }
         }
         entry.column_handles.push_back(decoder_output_handle_);
@@ -183,12 +408,20 @@ EvaluateWorker::EvaluateWorker(const EvaluateWorkerArgs& args)
   : node_id_(args.node_id),
     worker_id_(worker_id_),
     profiler_(args.profiler),
-    arg_group_(args.arg_group) {
+    arg_group_(args.arg_group),
+    kernel_cache_(args.kernel_cache),
+    kernel_states_(args.kernel_states),
+    reduced_states_(args.reduced_states) {
   auto setup_start = now();
+  if (arg_group_.perf_counters) {
+    perf_counters_.reset(new PerfCounters());
+  }
   for (auto& col : arg_group_.column_mapping) {
     column_mapping_set_.emplace_back(col.begin(), col.end());
   }
-  // Instantiate kernels
+  // Instantiate kernels. Each GPU kernel gets its own stream from the pool
+  // so that its batches can run while the next ones are being staged.
+  kernel_streams_.clear();
   {
     OpRegistry* registry = get_op_registry();
     DeviceHandle last_device = CPU_DEVICE;
@@ -196,12 +429,21 @@ EvaluateWorker::EvaluateWorker(const EvaluateWorkerArgs& args)
       KernelFactory* factory = std::get<0>(arg_group_.kernel_factories[i]);
       if (factory == nullptr) {
         kernel_devices_.push_back(last_device);
+        kernel_profile_keys_.emplace_back();
         kernel_num_outputs_.push_back(1);
         kernels_.emplace_back(nullptr);
+        kernel_streams_.push_back(nullptr);
         continue;
       }
-      const KernelConfig& config = std::get<1>(arg_group_.kernel_factories[i]);
+      KernelConfig config = std::get<1>(arg_group_.kernel_factories[i]);
+      if (config.devices[0].type == DeviceType::GPU) {
+        config.stream = CUDAStreamPool::instance().acquire(
+            config.devices[0].id, arg_group_.stream_priority);
+      }
+      kernel_streams_.push_back(config.stream);
       kernel_devices_.push_back(config.devices[0]);
+      kernel_profile_keys_.push_back(
+          op_profile_key(factory->get_op_name(), factory->get_device_type()));
       last_device = config.devices[0];
       kernel_num_outputs_.push_back(
           registry->get_op_info(factory->get_op_name())
@@ -211,7 +453,15 @@ EvaluateWorker::EvaluateWorker(const EvaluateWorkerArgs& args)
 #ifdef HAVE_CUDA
       cudaSetDevice(0);
 #endif
-      auto kernel = factory->new_instance(config);
+      BaseKernel* kernel = nullptr;
+      if (kernel_cache_ != nullptr) {
+        kernel = kernel_cache_->acquire(factory, config);
+      }
+      if (kernel == nullptr) {
+        kernel = factory->new_instance(config);
+      } else {
+        profiler_.increment("kernels_reused", 1);
+      }
       kernel->validate(&args.result);
       VLOG(1) << "Kernel finished validation " << args.result.success();
       if (!args.result.success()) {
@@ -228,20 +478,139 @@ EvaluateWorker::EvaluateWorker(const EvaluateWorkerArgs& args)
       kernel->set_profiler(&args.profiler);
     }
   }
+  kernel_batches_in_flight_.resize(kernels_.size());
+  for (size_t i = 0; i < kernels_.size(); ++i) {
+    if (kernel_streams_[i] != nullptr) {
+      kernels_[i]->set_stream(kernel_streams_[i]);
+    }
+  }
+  // Spread the batches of replicated kernels across their GPUs. Replicas
+  // run on their own threads, so the kernels do not get this thread's
+  // profiler.
+  kernel_replicas_.resize(kernels_.size());
+  next_replica_.assign(kernels_.size(), 0);
+  for (size_t i = 0; i < kernels_.size(); ++i) {
+    if (i >= arg_group_.kernel_replica_devices.size() ||
+        arg_group_.kernel_replica_devices[i].size() < 2) {
+      continue;
+    }
+    KernelFactory* factory = std::get<0>(arg_group_.kernel_factories[i]);
+    kernels_[i]->set_profiler(nullptr);
+    for (DeviceHandle device : arg_group_.kernel_replica_devices[i]) {
+      kernel_replicas_[i].emplace_back(new KernelReplica);
+      KernelReplica* replica = kernel_replicas_[i].back().get();
+      replica->config = std::get<1>(arg_group_.kernel_factories[i]);
+      replica->config.devices = {device};
+      replica->device = device;
+      replica->config.stream = nullptr;
+      if (kernel_replicas_[i].size() == 1) {
+        replica->kernel = kernels_[i].get();
+        replica->stream = kernel_streams_[i];
+      } else {
+        BaseKernel* kernel = nullptr;
+        replica->config.stream = CUDAStreamPool::instance().acquire(
+            device.id, arg_group_.stream_priority);
+        replica->stream = replica->config.stream;
+        if (kernel_cache_ != nullptr) {
+          kernel = kernel_cache_->acquire(factory, replica->config);
+        }
+        if (kernel == nullptr) {
+          kernel = factory->new_instance(replica->config);
+        }
+        kernel->validate(&args.result);
+        if (!args.result.success()) {
+          VLOG(1) << "Kernel replica validate failed: " << args.result.msg();
+          THREAD_RETURN_SUCCESS();
+        }
+        replica->owned_kernel.reset(kernel);
+        replica->kernel = kernel;
+        kernel->set_stream(replica->stream);
+      }
+      replica->thread = std::thread([replica]() {
+#ifdef HAVE_CUDA
+        CU_CHECK(cudaSetDevice(replica->device.id));
+#endif
+        while (true) {
+          std::function<void()> work;
+          replica->work.pop(work);
+          if (!work) {
+            break;
+          }
+          work();
+        }
+      });
+    }
+  }
   // Setup kernel cache sizes
   element_cache_row_ids_.resize(kernels_.size());
   element_cache_.resize(kernels_.size());
   element_cache_devices_.resize(kernels_.size());
   for (size_t i = 0; i < kernels_.size(); ++i) {
     // Resize stencil cache to be the same size as the number of inputs
-    // to the kernel
-    element_cache_[i].resize(arg_group_.column_mapping[i].size());
-    element_cache_row_ids_[i].resize(arg_group_.column_mapping[i].size());
+    // to the kernel. Each ring starts large enough for a full stencil window
+    // over a batch so steady state feeding does not reallocate.
+    size_t cache_size = 1;
+    if (!is_builtin_op(arg_group_.op_names[i])) {
+      const std::vector<i32>& stencil = arg_group_.kernel_stencils[i];
+      cache_size = 2 * (stencil.back() - stencil.front() +
+                        arg_group_.kernel_batch_sizes[i]);
+    }
+    size_t num_inputs = arg_group_.column_mapping[i].size();
+    element_cache_[i].assign(num_inputs, RingBuffer<Element>(cache_size));
+    element_cache_row_ids_[i].assign(num_inputs, RingBuffer<i64>(cache_size));
   }
   valid_output_rows_.resize(kernels_.size());
   current_valid_input_idx_.resize(kernels_.size());
   current_valid_output_idx_.assign(kernels_.size(), 0);
 
+  // Kernels that may take over their first input column, which requires it
+  // to die at the op and each of its elements to be read by a single row
+  kernel_in_place_.assign(kernels_.size(), false);
+  for (size_t i = 0; i < kernels_.size(); ++i) {
+    KernelFactory* factory = std::get<0>(arg_group_.kernel_factories[i]);
+    if (factory == nullptr || !factory->can_update_in_place() ||
+        arg_group_.fused_with_previous[i] || !kernel_replicas_[i].empty() ||
+        arg_group_.kernel_stencils[i] != std::vector<i32>{0}) {
+      continue;
+    }
+    const std::vector<i32>& inputs = arg_group_.column_mapping[i];
+    const std::vector<i32>& dead = arg_group_.dead_columns[i];
+    const std::vector<i32>& unused = arg_group_.unused_outputs[i];
+    kernel_in_place_[i] =
+        !inputs.empty() &&
+        std::count(inputs.begin(), inputs.end(), inputs[0]) == 1 &&
+        std::count(dead.begin(), dead.end(), inputs[0]) == 1 &&
+        std::count(unused.begin(), unused.end(), 0) == 0;
+  }
+
+  // Fused chains share one batch size and held batches are sized for the
+  // configured one, so neither is swept
+  batch_tuners_.resize(kernels_.size());
+  for (size_t i = 0; i < kernels_.size(); ++i) {
+    KernelFactory* factory = std::get<0>(arg_group_.kernel_factories[i]);
+    bool fusion_head = i + 1 < arg_group_.fused_with_previous.size() &&
+                       arg_group_.fused_with_previous[i + 1];
+    if (!arg_group_.autotune_batch_sizes || factory == nullptr ||
+        !factory->can_batch() || arg_group_.fused_with_previous[i] ||
+        fusion_head || arg_group_.batch_deadline_ms > 0) {
+      continue;
+    }
+    BatchSizeTuner& tuner = batch_tuners_[i];
+    tuner.active = true;
+    for (i32 size = 1; size <= AUTOTUNE_MAX_BATCH_SIZE; size *= 2) {
+      tuner.candidates.push_back(size);
+    }
+    i32 configured = arg_group_.kernel_batch_sizes[i];
+    if (std::find(tuner.candidates.begin(), tuner.candidates.end(),
+                  configured) == tuner.candidates.end()) {
+      tuner.candidates.push_back(configured);
+      std::sort(tuner.candidates.begin(), tuner.candidates.end());
+    }
+    tuner.best = tuner.candidates[0];
+    tuner.pool_exhausted_start = pool_exhausted_count(kernel_devices_[i]);
+    arg_group_.kernel_batch_sizes[i] = tuner.candidates[0];
+  }
+
   args.profiler.add_interval("setup", now(), setup_start);
 
   // Signal the main worker thread that we've finished startup
@@ -251,13 +620,79 @@ EvaluateWorker::EvaluateWorker(const EvaluateWorkerArgs& args)
 }
 
 EvaluateWorker::~EvaluateWorker() {
+  for (size_t i = 0; i < kernel_replicas_.size(); ++i) {
+    for (auto& replica : kernel_replicas_[i]) {
+      replica->work.push(std::function<void()>());
+      replica->thread.join();
+      if (replica->owned_kernel == nullptr) {
+        continue;
+      }
+#ifdef HAVE_CUDA
+      replica->kernel->set_stream(nullptr);
+      CU_CHECK(cudaSetDevice(replica->device.id));
+      CU_CHECK(cudaStreamSynchronize((cudaStream_t)replica->stream));
+      CUDAStreamPool::instance().release(replica->device.id, replica->stream);
+#endif
+      if (kernel_cache_ != nullptr) {
+        kernel_cache_->release(std::get<0>(arg_group_.kernel_factories[i]),
+                               replica->config,
+                               std::move(replica->owned_kernel));
+      }
+    }
+  }
+  for (size_t i = 0; i < kernels_.size(); ++i) {
+    wait_for_kernel_batches(i, 0);
+#ifdef HAVE_CUDA
+    if (kernel_streams_[i] != nullptr) {
+      kernels_[i]->set_stream(nullptr);
+      CU_CHECK(cudaSetDevice(kernel_devices_[i].id));
+      CU_CHECK(cudaStreamSynchronize((cudaStream_t)kernel_streams_[i]));
+      CUDAStreamPool::instance().release(kernel_devices_[i].id,
+                                         kernel_streams_[i]);
+    }
+#endif
+  }
   // Clear the stencil cache
   clear_stencil_cache();
+  // Keep the kernels warm for the next job
+  if (kernel_cache_ != nullptr) {
+    for (size_t i = 0; i < kernels_.size(); ++i) {
+      if (kernels_[i] != nullptr) {
+        kernel_cache_->release(std::get<0>(arg_group_.kernel_factories[i]),
+                               std::get<1>(arg_group_.kernel_factories[i]),
+                               std::move(kernels_[i]));
+      }
+    }
+  }
+}
+
+bool EvaluateWorker::continues_warmup(i32 k, i64 job_idx,
+                                      const TaskStream& stream) const {
+  i32 warmup = k < arg_group_.warmup_sizes.size()
+                   ? arg_group_.warmup_sizes[k] : 0;
+  // Replicas and held batches evaluate rows out of the kernel's order
+  if (warmup <= 0 || job_idx != prev_job_idx_ ||
+      slice_group_ != prev_slice_group_ || stream.resume_state ||
+      !kernel_replicas_[k].empty() || arg_group_.batch_deadline_ms > 0 ||
+      k >= prev_tail_rows_.size() || valid_output_rows_[k].empty()) {
+    return false;
+  }
+  // The kernel must have just evaluated the warmup rows of the first row
+  const std::vector<i64>& tail = prev_tail_rows_[k];
+  i64 first_row = valid_output_rows_[k].front();
+  if (tail.size() != (size_t)warmup || tail.back() != first_row - 1) {
+    return false;
+  }
+  for (size_t i = 1; i < tail.size(); ++i) {
+    if (tail[i] != tail[i - 1] + 1) {
+      return false;
+    }
+  }
+  return true;
 }
 
 void EvaluateWorker::new_task(i64 job_idx, i64 task_idx,
                               const std::vector<TaskStream>& task_streams) {
-  job_idx_ = job_idx;
   task_idx_ = task_idx;
   for (size_t i = 0; i < task_streams.size(); ++i) {
     for (i64 used_rows : current_valid_input_idx_[i]) {
@@ -268,6 +703,19 @@ void EvaluateWorker::new_task(i64 job_idx, i64 task_idx,
   valid_input_rows_set_.clear();
   current_valid_input_idx_.clear();
 
+  // Remember where each warmed up kernel stopped
+  prev_job_idx_ = job_idx_;
+  prev_slice_group_ = slice_group_;
+  prev_tail_rows_.assign(compute_rows_.size(), std::vector<i64>());
+  for (size_t k = 0; k < compute_rows_.size(); ++k) {
+    i32 warmup = k < arg_group_.warmup_sizes.size()
+                     ? arg_group_.warmup_sizes[k] : 0;
+    const std::vector<i64>& rows = compute_rows_[k];
+    size_t tail = std::min(rows.size(), (size_t)warmup);
+    prev_tail_rows_[k].assign(rows.end() - tail, rows.end());
+  }
+  job_idx_ = job_idx;
+
   compute_rows_.clear();
   compute_rows_set_.clear();
   current_compute_idx_.clear();
@@ -284,53 +732,84 @@ void EvaluateWorker::new_task(i64 job_idx, i64 task_idx,
       slice_group_ = ts.slice_group;
     }
     valid_input_rows_.push_back(ts.valid_input_rows);
-    valid_input_rows_set_.push_back(
-        std::set<i64>(ts.valid_input_rows.begin(), ts.valid_input_rows.end()));
+    valid_input_rows_set_.emplace_back(ts.valid_input_rows);
     current_valid_input_idx_.emplace_back();
     for(i64 i = 0; i < arg_group_.column_mapping[k].size(); ++i) {
       current_valid_input_idx_.back().push_back(0);
     }
 
     compute_rows_.push_back(ts.compute_input_rows);
-    compute_rows_set_.push_back(std::set<i64>(
-        ts.compute_input_rows.begin(), ts.compute_input_rows.end()));
+    compute_rows_set_.emplace_back(ts.compute_input_rows);
     current_compute_idx_.push_back(0);
 
     valid_output_rows_.push_back(ts.valid_output_rows);
-    valid_output_rows_set_.push_back(std::set<i64>(ts.valid_output_rows.begin(),
-                                                   ts.valid_output_rows.end()));
+    valid_output_rows_set_.emplace_back(ts.valid_output_rows);
     current_valid_output_idx_.push_back(0);
 
     current_element_cache_input_idx_.push_back(0);
   }
 
-  // Initialize domain samplers for this job and this slice
-  domain_samplers_.clear();
-  for (auto& kv : arg_group_.sampling_args) {
-    i64 op_idx = kv.first;
-    i64 slice = 0;
-    if (arg_group_.sampling_args.at(op_idx).at(job_idx).size() > 1) {
-      slice = slice_group_;
-    }
-    auto& sampling_args =
-        arg_group_.sampling_args.at(op_idx).at(job_idx).at(slice);
-    DomainSampler* sampler = nullptr;
-    Result result = make_domain_sampler_instance(
-        sampling_args.sampling_function(),
-        std::vector<u8>(sampling_args.sampling_args().begin(),
-                        sampling_args.sampling_args().end()),
-        sampler);
-    if (!result.success()) {
-      VLOG(1) << "Make domain sampler failed: " << result.msg();
-      THREAD_RETURN_SUCCESS();
+  // Initialize domain samplers for this job and this slice. Consecutive
+  // tasks of the same job and slice group keep the ones they have.
+  bool same_sampling_args = job_idx == prev_job_idx_ &&
+                            slice_group_ == prev_slice_group_ &&
+                            domain_samplers_.size() ==
+                                arg_group_.sampling_args.size();
+  if (!same_sampling_args) {
+    domain_samplers_.clear();
+    for (auto& kv : arg_group_.sampling_args) {
+      i64 op_idx = kv.first;
+      i64 slice = 0;
+      if (arg_group_.sampling_args.at(op_idx).at(job_idx).size() > 1) {
+        slice = slice_group_;
+      }
+      auto& sampling_args =
+          arg_group_.sampling_args.at(op_idx).at(job_idx).at(slice);
+      DomainSampler* sampler = nullptr;
+      Result result = make_domain_sampler_instance(
+          sampling_args.sampling_function(),
+          std::vector<u8>(sampling_args.sampling_args().begin(),
+                          sampling_args.sampling_args().end()),
+          sampler);
+      if (!result.success()) {
+        VLOG(1) << "Make domain sampler failed: " << result.msg();
+        THREAD_RETURN_SUCCESS();
+      }
+      domain_samplers_[op_idx].reset(sampler);
     }
-    domain_samplers_[op_idx].reset(sampler);
   }
 
-  // Make the op aware of the format of the data
-  for (auto& kernel : kernels_) {
-    if (kernel) {
-      kernel->reset();
+  // Make the op aware of the format of the data. Kernels still warmed up
+  // from the previous task keep their state and skip their warmup rows.
+  for (size_t k = 0; k < kernels_.size(); ++k) {
+    if (!kernels_[k]) {
+      continue;
+    }
+    if (k < task_streams.size() &&
+        continues_warmup(k, job_idx, task_streams[k])) {
+      i64 first_row = valid_output_rows_[k].front();
+      std::vector<i64>& rows = compute_rows_[k];
+      rows.erase(rows.begin(),
+                 std::lower_bound(rows.begin(), rows.end(), first_row));
+      compute_rows_set_[k] = RowSet(rows);
+      profiler_.increment("warmup_rows_skipped",
+                          (i64)(task_streams[k].compute_input_rows.size() -
+                                rows.size()));
+      continue;
+    }
+    kernels_[k]->reset();
+  }
+  // Continue from where the previous task of the job left the state
+  for (size_t k = 0; k < task_streams.size(); ++k) {
+    if (task_streams[k].resume_state && kernels_[k]) {
+      kernels_[k]->deserialize_state(task_streams[k].initial_state);
+    }
+  }
+  for (auto& replicas : kernel_replicas_) {
+    for (auto& replica : replicas) {
+      if (replica->owned_kernel != nullptr) {
+        replica->kernel->reset();
+      }
     }
   }
 
@@ -356,6 +835,9 @@ void EvaluateWorker::feed(EvalWorkEntry& work_entry) {
   std::vector<DeviceHandle> side_output_handles = work_entry.column_handles;
   BatchedColumns side_output_columns = work_entry.columns;
   std::vector<std::vector<i64>> side_row_ids = work_entry.row_ids;
+  // Outputs of fused chains, keyed by the last kernel in the chain
+  std::map<i32, BatchedColumns> fused_outputs;
+  std::map<i32, std::vector<i64>> fused_row_ids;
 
   // For each kernel, produce as much output as can be produced given current
   // input rows and stencil cache.
@@ -364,20 +846,20 @@ void EvaluateWorker::feed(EvalWorkEntry& work_entry) {
     DeviceHandle current_handle = kernel_devices_[k];
 
     std::vector<i64>& kernel_valid_input_rows = valid_input_rows_[k];
-    std::set<i64>& kernel_valid_input_rows_set = valid_input_rows_set_[k];
+    RowSet& kernel_valid_input_rows_set = valid_input_rows_set_[k];
     std::vector<i64>& kernel_current_input_idx = current_valid_input_idx_[k];
 
     std::vector<i64>& kernel_compute_rows = compute_rows_[k];
     i64& kernel_current_compute_idx = current_compute_idx_[k];
 
     std::vector<i64>& kernel_valid_output_rows = valid_output_rows_[k];
-    std::set<i64>& kernel_valid_output_rows_set = valid_output_rows_set_[k];
+    RowSet& kernel_valid_output_rows_set = valid_output_rows_set_[k];
     i64& kernel_current_output_idx = current_valid_output_idx_[k];
 
     i64& kernel_element_cache_input_idx = current_element_cache_input_idx_[k];
-    std::vector<std::deque<Element>>& kernel_cache = element_cache_[k];
+    std::vector<RingBuffer<Element>>& kernel_cache = element_cache_[k];
     std::vector<DeviceHandle>& kernel_cache_devices = element_cache_devices_[k];
-    std::vector<std::deque<i64>>& kernel_cache_row_ids =
+    std::vector<RingBuffer<i64>>& kernel_cache_row_ids =
         element_cache_row_ids_[k];
     std::vector<i32>& input_column_idx = arg_group_.column_mapping[k];
     std::set<i32>& input_column_idx_set = column_mapping_set_[k];
@@ -392,12 +874,21 @@ void EvaluateWorker::feed(EvalWorkEntry& work_entry) {
         kernel_cache_devices.push_back(current_handle);
       }
     }
+    // Transfers for all input columns are issued before waiting on any, a
+    // kernel batch of rows at a time. Each batch only waits on the copies of
+    // the rows it reads, so later batches are copied while earlier ones run.
+    // Every copy is kept with the cache position of its first element.
+    std::deque<std::tuple<size_t, MemcpyHandle>> input_copies;
+    auto marshal_start = now();
+    TransferStats transfers_start = thread_transfer_stats();
+    i64 transferred_rows = 0;
+    std::vector<ElementList> column_inputs(input_column_idx.size());
     for (i32 i = 0; i < input_column_idx.size(); ++i) {
       i32 in_col_idx = input_column_idx[i];
       assert(in_col_idx < side_output_columns.size());
       // Select elements which this kernel requires as inputs
       auto& row_ids = side_row_ids[in_col_idx];
-      ElementList valid_inputs;
+      ElementList& valid_inputs = column_inputs[i];
       i64& current_input_idx = kernel_current_input_idx[i];
       for (size_t r = 0; r < row_ids.size(); ++r) {
         assert(row_ids[r] <= kernel_valid_input_rows[current_input_idx]);
@@ -412,15 +903,69 @@ void EvaluateWorker::feed(EvalWorkEntry& work_entry) {
           current_input_idx++;
         }
       }
-      if (valid_inputs.size() > 0) {
+    }
+    // Builtin ops only pass references on, so their inputs are copied at once
+    size_t copy_rows = is_builtin_op(op_name)
+                           ? std::numeric_limits<size_t>::max()
+                           : std::max(1, arg_group_.kernel_batch_sizes[k]);
+    size_t most_inputs = 0;
+    for (const ElementList& valid_inputs : column_inputs) {
+      most_inputs = std::max(most_inputs, valid_inputs.size());
+    }
+    for (size_t first = 0; first < most_inputs; first += copy_rows) {
+      for (i32 i = 0; i < input_column_idx.size(); ++i) {
+        i32 in_col_idx = input_column_idx[i];
+        ElementList& valid_inputs = column_inputs[i];
+        if (first >= valid_inputs.size()) {
+          continue;
+        }
+        size_t last = valid_inputs.size() - first > copy_rows
+                          ? first + copy_rows
+                          : valid_inputs.size();
+        ElementList part(valid_inputs.begin() + first,
+                         valid_inputs.begin() + last);
+        if (!side_output_handles[in_col_idx].is_same_address_space(
+                current_handle)) {
+          transferred_rows += part.size();
+        }
         auto copy_start = now();
-        ElementList list =
-            copy_or_ref_elements(profiler_, side_output_handles[in_col_idx],
-                                 current_handle, valid_inputs);
+        input_copies.emplace_back(kernel_cache[i].size(), MemcpyHandle());
+        ElementList list = copy_or_ref_elements_async(
+            profiler_, side_output_handles[in_col_idx], current_handle, part,
+            std::get<1>(input_copies.back()));
         profiler_.add_interval("op_marshal", copy_start, now());
         // Insert new elements into cache
-        kernel_cache[i].insert(kernel_cache[i].end(), list.begin(), list.end());
+        kernel_cache[i].reserve(kernel_cache[i].size() + list.size());
+        for (Element& element : list) {
+          kernel_cache[i].push_back(element);
+        }
+      }
+    }
+    // Time spent issuing and waiting on copies, which overlap the kernel
+    i64 marshal_ns = (i64)nano_since(marshal_start);
+    // Waits for the copies into the cache positions before end
+    auto wait_for_input_copies = [&](size_t end) {
+      if (input_copies.empty() || std::get<0>(input_copies.front()) >= end) {
+        return;
       }
+      auto copy_wait_start = now();
+      while (!input_copies.empty() && std::get<0>(input_copies.front()) < end) {
+        std::get<1>(input_copies.front()).wait();
+        input_copies.pop_front();
+      }
+      profiler_.add_interval("op_marshal_wait", copy_wait_start, now());
+      marshal_ns += (i64)nano_since(copy_wait_start);
+    };
+    // The in-place column is not read after this op, so its references are
+    // dropped now to leave the cached ones as the only ones. Copies may still
+    // be reading them.
+    if (kernel_in_place_[k]) {
+      wait_for_input_copies(std::numeric_limits<size_t>::max());
+      i32 in_col_idx = input_column_idx[0];
+      for (Element& element : side_output_columns[in_col_idx]) {
+        delete_element(side_output_handles[in_col_idx], element);
+      }
+      side_output_columns[in_col_idx].clear();
     }
     // Determine the highest row seen so we know how many elements we
     // might be able to produce
@@ -463,6 +1008,8 @@ void EvaluateWorker::feed(EvalWorkEntry& work_entry) {
     // batch size (if not zero). If not, then this should be the last batch
     // in the task we should add an assert to verify this is the case.
     i64 producible_elements = 0;
+    // Rows of this task evaluated in the same batch as the held rows
+    i64 held_fill = 0;
     i32 num_output_columns = 0;
     std::vector<i32> kernel_stencil;
     if (is_builtin_op(op_name)) {
@@ -477,11 +1024,22 @@ void EvaluateWorker::feed(EvalWorkEntry& work_entry) {
       i32 kernel_batch_size = arg_group_.kernel_batch_sizes[k];
       producible_elements =
           compute_producible_elements(kernel_stencil.back(), kernel_batch_size);
-      // If end of task, we set batch size to 1 to get all remaining elements
-      if (kernel_valid_input_rows.size() - producible_elements <
-          kernel_batch_size) {
-        producible_elements =
-            compute_producible_elements(kernel_stencil.back(), 1);
+      i64 available_rows =
+          compute_producible_elements(kernel_stencil.back(), 1);
+      if (!held_row_ids_.empty()) {
+        // Rows held from the previous task are topped up to a full batch
+        // first, then the rest is batched as usual
+        held_fill = std::min(available_rows,
+                             kernel_batch_size - (i64)held_row_ids_.size());
+        i64 rest = available_rows - held_fill;
+        producible_elements = held_fill + rest - rest % kernel_batch_size;
+      }
+      // Rows wait in the cache until they fill a batch, so only produce a
+      // partial batch once every remaining row of the task has arrived
+      i64 remaining_rows =
+          kernel_compute_rows.size() - kernel_element_cache_input_idx;
+      if (available_rows == remaining_rows) {
+        producible_elements = available_rows;
       }
       auto& unused_outputs = arg_group_.unused_outputs[k];
       num_output_columns = kernel_num_outputs_[k] - unused_outputs.size();
@@ -522,7 +1080,7 @@ void EvaluateWorker::feed(EvalWorkEntry& work_entry) {
       auto& output_column = side_output_columns.back();
       for (size_t i = 0; i < downstream_rows.size(); ++i) {
         i64 upstream_row_idx = downstream_upstream_mapping[i];
-        auto& element = *(kernel_cache.at(0).begin() + upstream_row_idx);
+        auto& element = kernel_cache.at(0)[upstream_row_idx];
         Element ele = add_element_ref(current_handle, element);
         output_column.push_back(ele);
       }
@@ -538,18 +1096,27 @@ void EvaluateWorker::feed(EvalWorkEntry& work_entry) {
         VLOG(1) << "Sampler failed: " << result.msg();
         THREAD_RETURN_SUCCESS();
       }
-      // For each available input, expand it by placing nulls or repeats
+      // For each available input, expand it by placing nulls or repeats.
+      // Repeats are references to the upstream buffer, taken for a whole
+      // run of rows at once.
       auto& output_column = side_output_columns.back();
-      for (size_t i = 0; i < downstream_rows.size(); ++i) {
+      output_column.reserve(output_column.size() + downstream_rows.size());
+      for (size_t i = 0; i < downstream_rows.size();) {
         i64 upstream_row_idx = downstream_upstream_mapping[i];
+        size_t run_end = i + 1;
+        while (run_end < downstream_rows.size() &&
+               downstream_upstream_mapping[run_end] == upstream_row_idx) {
+          run_end++;
+        }
+        i32 run = static_cast<i32>(run_end - i);
         if (upstream_row_idx == -1) {
-          // Put null element
-          output_column.emplace_back();
+          // Put null elements
+          output_column.resize(output_column.size() + run);
         } else {
-          auto& element = *(kernel_cache.at(0).begin() + upstream_row_idx);
-          Element ele = add_element_ref(current_handle, element);
-          output_column.push_back(ele);
+          auto& element = kernel_cache.at(0)[upstream_row_idx];
+          add_element_refs(current_handle, element, run, output_column);
         }
+        i = run_end;
       }
       side_row_ids.back() = downstream_rows;
     } else if (op_name == SLICE_OP_NAME) {
@@ -565,7 +1132,7 @@ void EvaluateWorker::feed(EvalWorkEntry& work_entry) {
       auto& output_row_ids = side_row_ids.back();
       for (size_t i = 0; i < producible_row_ids.size(); ++i) {
         output_row_ids.push_back(producible_row_ids[i] - offset);
-        auto& element = *(kernel_cache.at(0).begin() + i);
+        auto& element = kernel_cache.at(0)[i];
         Element ele = add_element_ref(current_handle, element);
         output_column.push_back(ele);
       }
@@ -582,84 +1149,190 @@ void EvaluateWorker::feed(EvalWorkEntry& work_entry) {
       auto& output_row_ids = side_row_ids.back();
       for (size_t i = 0; i < producible_row_ids.size(); ++i) {
         output_row_ids.push_back(producible_row_ids[i] + offset);
-        auto& element = *(kernel_cache.at(0).begin() + i);
+        auto& element = kernel_cache.at(0)[i];
         Element ele = add_element_ref(current_handle, element);
         output_column.push_back(ele);
       }
+    } else if (arg_group_.fused_with_previous[k]) {
+      // Already executed inside the batch loop of the head of its chain, so
+      // just pick up the outputs if this is the end of the chain
+      auto it = fused_outputs.find(k);
+      if (it != fused_outputs.end()) {
+        for (size_t cidx = 0; cidx < it->second.size(); ++cidx) {
+          i32 col_idx = side_output_columns.size() - num_output_columns + cidx;
+          side_output_columns[col_idx].swap(it->second[cidx]);
+          side_row_ids[col_idx] = fused_row_ids.at(k);
+        }
+      }
     } else {
       assert(!is_builtin_op(op_name));
       // If a regular kernel
       DeviceHandle current_handle = kernel_devices_[k];
-      std::unique_ptr<BaseKernel>& kernel = kernels_[k];
       i32 kernel_batch_size = arg_group_.kernel_batch_sizes[k];
       i64 row_start = kernel_element_cache_input_idx;
       i64 row_end = row_start + producible_elements;
-
-      for (i32 start = row_start; start < row_end; start += kernel_batch_size) {
-        i32 batch = std::min((i64)kernel_batch_size, row_end - start);
-        i32 end = start + batch;
-        // Stage inputs to the kernel using the stencil cache
-        StenciledBatchedColumns input_columns(input_column_idx.size());
-        // For each column
-        // NOTE(apoms): choosing the first columns row ids is fine because all
-        // input row ids for each column should be the same since all inputs
-        // must have the same domain
-        auto& cache_row_deque = kernel_cache_row_ids[0];
+      bool fusion_head = k + 1 < arg_group_.fused_with_previous.size() &&
+                         arg_group_.fused_with_previous[k + 1];
+
+      // NOTE(apoms): choosing the first columns row ids is fine because all
+      // input row ids for each column should be the same since all inputs
+      // must have the same domain
+      auto& cache_row_ids = kernel_cache_row_ids[0];
+      // Cache rows are increasing, so each stencil element is found by
+      // bisecting from the previous one instead of scanning the cache
+      auto find_cached_row = [&cache_row_ids](size_t lo, i64 row) {
+        size_t hi = cache_row_ids.size();
+        while (lo < hi) {
+          size_t mid = lo + (hi - lo) / 2;
+          if (cache_row_ids[mid] < row) {
+            lo = mid + 1;
+          } else {
+            hi = mid;
+          }
+        }
+        return lo;
+      };
+      // Appends the stencils of compute rows [start, end) to input_columns
+      auto stage_inputs = [&](i64 start, i64 end,
+                              StenciledBatchedColumns& input_columns) {
+        // Cache positions of each stencil element for every batch row,
+        // shared by all input columns
+        std::vector<size_t> stencil_positions;
+        stencil_positions.reserve((end - start) * kernel_stencil.size());
+        for (i64 r = start; r < end; ++r) {
+          i64 curr_row = kernel_compute_rows[r];
+          size_t pos = 0;
+          for (i64 s : kernel_stencil) {
+            pos = find_cached_row(pos, curr_row + s);
+            assert(pos < cache_row_ids.size() &&
+                   cache_row_ids[pos] == curr_row + s);
+            stencil_positions.push_back(pos);
+          }
+        }
+        if (!stencil_positions.empty()) {
+          wait_for_input_copies(*std::max_element(stencil_positions.begin(),
+                                                  stencil_positions.end()) +
+                                1);
+        }
         for (size_t i = 0; i < input_column_idx.size(); ++i) {
-          auto& cache_deque = kernel_cache[i];
+          auto& cache = kernel_cache[i];
           auto& col = input_columns[i];
-          col.resize(batch);
           // For each batch element
+          size_t p = 0;
           for (i64 r = start; r < end; ++r) {
-            auto& input_stencil = col[r - start];
-            i64 last_cache_element = 0;
+            col.emplace_back();
+            auto& input_stencil = col.back();
+            input_stencil.reserve(kernel_stencil.size());
             // Place elements in "stencil" dimension of input columns
-            i64 curr_row = kernel_compute_rows[r];
-            for (i64 s : kernel_stencil) {
-              i64 desired_row = curr_row + s;
-              // Search for desired stencil element
-              for (; last_cache_element < cache_row_deque.size();
-                   ++last_cache_element) {
-                i64 cache_row_id = cache_row_deque[last_cache_element];
-                if (desired_row == cache_row_id) {
-                  input_stencil.push_back(cache_deque[last_cache_element]);
-                  break;
-                }
-              }
+            for (size_t s = 0; s < kernel_stencil.size(); ++s) {
+              input_stencil.push_back(cache[stencil_positions[p++]]);
+            }
+            if (i == 0 && kernel_in_place_[k]) {
+              input_stencil[0].writable = element_is_unshared(
+                  kernel_cache_devices[0], input_stencil[0]);
             }
-            assert(input_stencil.size() == kernel_stencil.size());
           }
         }
-
-        // Setup output buffers to receive op output
-        DeviceHandle output_handle = current_handle;
+      };
+
+      i64 first_start = row_start;
+      if (!held_row_ids_.empty()) {
+        // Evaluate the rows held from the previous task together with the
+        // first rows of this one. Their outputs are kept apart until they
+        // are handed back to the previous task's entry.
+        i32 held = held_row_ids_.size();
+        StenciledBatchedColumns input_columns;
+        input_columns.swap(held_input_columns_);
+        stage_inputs(row_start, row_start + held_fill, input_columns);
         BatchedColumns output_columns;
-        output_columns.resize(num_output_columns);
-
-        // Map from previous output columns to the set of input columns needed
-        // by the kernel
-        auto eval_start = now();
-        kernel->execute_kernel(input_columns, output_columns);
-        profiler_.add_interval("evaluate:" + op_name, eval_start, now());
-
-        // Delete unused output columns
-        auto& unused_outputs = arg_group_.unused_outputs[k];
-        for (size_t y = 0; y < unused_outputs.size(); ++y) {
-          i32 unused_col_idx =
-              unused_outputs[unused_outputs.size() - 1 - y];
-          ElementList& column = output_columns[unused_col_idx];
-          for (Element& element : column) {
-            delete_element(current_handle, element);
+        execute_kernel_batch(k, input_columns, output_columns,
+                             held + (i32)held_fill);
+        wait_for_kernel_batches(k, 0);
+        for (size_t i = 0; i < input_column_idx.size(); ++i) {
+          for (i32 r = 0; r < held; ++r) {
+            delete_element(kernel_cache_devices[i], input_columns[i][r][0]);
           }
-          output_columns.erase(output_columns.begin() + unused_col_idx);
         }
+        split_held_outputs(k, output_columns);
+        for (size_t cidx = 0; cidx < output_columns.size(); ++cidx) {
+          const ElementList& column = output_columns[cidx];
+          i32 col_idx = side_output_columns.size() - num_output_columns + cidx;
+          side_output_columns[col_idx].insert(
+              side_output_columns[col_idx].end(), column.begin(), column.end());
+          side_row_ids[col_idx].insert(side_row_ids[col_idx].end(),
+                                       producible_row_ids.begin(),
+                                       producible_row_ids.begin() + held_fill);
+        }
+        first_start = row_start + held_fill;
+      }
 
-        // Verify the kernel produced the correct amount of output
-        for (size_t i = 0; i < output_columns.size(); ++i) {
-          LOG_IF(FATAL, output_columns[i].size() != batch)
-              << "Op " << k << " produced " << output_columns[i].size()
-              << " output elements for column " << i << ". Expected " << batch
-              << " outputs.";
+      // Batches handed to replicas, collected in order after the loop
+      std::vector<std::unique_ptr<ReplicaBatch>> replica_batches;
+      auto batch_loop_start = now();
+      for (i32 start = first_start; start < row_end;
+           start += kernel_batch_size) {
+        i32 batch = std::min((i64)kernel_batch_size, row_end - start);
+        i32 end = start + batch;
+        // Stage inputs to the kernel using the stencil cache
+        StenciledBatchedColumns input_columns(input_column_idx.size());
+        stage_inputs(start, end, input_columns);
+
+        // Keep a partial last batch for the next task to fill up. The
+        // driver holds this task's last entry until the outputs are in.
+        if (arg_group_.batch_deadline_ms > 0 && entry_.last_in_task &&
+            batch < kernel_batch_size && end == kernel_compute_rows.size()) {
+          held_input_columns_.swap(input_columns);
+          held_row_ids_.assign(
+              producible_row_ids.begin() + start - row_start,
+              producible_row_ids.begin() + start - row_start + batch);
+          held_valid_outputs_.clear();
+          for (i64 row : held_row_ids_) {
+            held_valid_outputs_.push_back(
+                kernel_valid_output_rows_set.contains(row));
+          }
+          continue;
+        }
+
+        if (!kernel_replicas_[k].empty()) {
+          replica_batches.push_back(submit_replica_batch(
+              k, std::move(input_columns), start - row_start, batch));
+          continue;
+        }
+
+        // Asynchronous kernels keep up to max_batches_in_flight batches
+        // outstanding, which are collected in order with the replica ones
+        i32 max_in_flight = kernels_[k]->max_batches_in_flight();
+        if (!fusion_head && max_in_flight > 0) {
+          replica_batches.push_back(submit_async_batch(
+              k, std::move(input_columns), start - row_start, batch));
+          if (replica_batches.size() > (size_t)max_in_flight) {
+            replica_batches[replica_batches.size() - max_in_flight - 1]
+                ->done.wait();
+          }
+          continue;
+        }
+
+        BatchedColumns output_columns;
+        execute_kernel_batch(k, input_columns, output_columns, batch);
+
+        // Feed the batch straight into the fused kernels instead of
+        // materializing it in the side output columns
+        if (fusion_head) {
+          std::vector<i64> batch_row_ids(
+              producible_row_ids.begin() + start - row_start,
+              producible_row_ids.begin() + start - row_start + batch);
+          i32 last = execute_fused_kernels(k, output_columns, batch_row_ids);
+          BatchedColumns& chain_columns = fused_outputs[last];
+          chain_columns.resize(output_columns.size());
+          for (size_t cidx = 0; cidx < output_columns.size(); ++cidx) {
+            chain_columns[cidx].insert(chain_columns[cidx].end(),
+                                       output_columns[cidx].begin(),
+                                       output_columns[cidx].end());
+          }
+          std::vector<i64>& chain_row_ids = fused_row_ids[last];
+          chain_row_ids.insert(chain_row_ids.end(), batch_row_ids.begin(),
+                               batch_row_ids.end());
+          continue;
         }
 
         // Add new output columns
@@ -675,6 +1348,46 @@ void EvaluateWorker::feed(EvalWorkEntry& work_entry) {
               producible_row_ids.begin() + start - row_start + batch);
         }
       }
+      for (auto& pending : replica_batches) {
+        auto wait_start = now();
+        pending->done.wait();
+        profiler_.add_interval("evaluate_wait:" + op_name, wait_start, now());
+        profiler_.increment("op_rows:" + kernel_profile_keys_[k],
+                            pending->batch);
+        profiler_.increment("op_eval_ns:" + kernel_profile_keys_[k],
+                            pending->eval_ns);
+        if (pending->device_ns > 0) {
+          profiler_.increment("op_device_ns:" + kernel_profile_keys_[k],
+                              pending->device_ns);
+        }
+        for (size_t cidx = 0; cidx < pending->output_columns.size(); ++cidx) {
+          const ElementList& column = pending->output_columns[cidx];
+          i32 col_idx = side_output_columns.size() - num_output_columns + cidx;
+          side_output_columns[col_idx].insert(
+              side_output_columns[col_idx].end(), column.begin(), column.end());
+          side_row_ids[col_idx].insert(
+              side_row_ids[col_idx].end(),
+              producible_row_ids.begin() + pending->start,
+              producible_row_ids.begin() + pending->start + pending->batch);
+        }
+      }
+      // Outputs are read, and inputs freed, after this point
+      wait_for_kernel_batches(k, 0);
+      if (batch_tuners_[k].active) {
+        record_batch_trial(k, row_end - first_start,
+                           nano_since(batch_loop_start));
+      }
+    }
+    // Rows the kernel could not produce yet stay cached for the next entry
+    wait_for_input_copies(std::numeric_limits<size_t>::max());
+    if (transferred_rows > 0 && !kernel_profile_keys_[k].empty()) {
+      profiler_.increment("op_transferred_rows:" + kernel_profile_keys_[k],
+                          transferred_rows);
+      profiler_.increment("op_transfer_ns:" + kernel_profile_keys_[k],
+                          marshal_ns);
+      profiler_.increment(
+          "op_transfer_device_ns:" + kernel_profile_keys_[k],
+          thread_transfer_stats().device_ns() - transfers_start.device_ns());
     }
 
     i64 row_start = kernel_element_cache_input_idx;
@@ -729,20 +1442,25 @@ void EvaluateWorker::feed(EvalWorkEntry& work_entry) {
           row_end, (i64)kernel_valid_input_rows.size() - 1)];
       min_used_row += kernel_stencil[0];
       {
-        auto& row_id_deque = kernel_cache_row_ids[0];
-        while (row_id_deque.size() > 0) {
-          i64 cache_row = row_id_deque.front();
+        auto& row_ids = kernel_cache_row_ids[0];
+        while (row_ids.size() > 0) {
+          i64 cache_row = row_ids.front();
           if (cache_row <= min_used_row) {
-            for (auto& deqs : kernel_cache_row_ids) {
-              deqs.pop_front();
+            for (auto& ids : kernel_cache_row_ids) {
+              ids.pop_front();
             }
+            // Held rows now belong to held_input_columns_
+            bool held = std::binary_search(held_row_ids_.begin(),
+                                           held_row_ids_.end(), cache_row);
             for (size_t i = 0; i < kernel_cache.size(); ++i) {
               auto device = kernel_cache_devices[i];
-              auto& cache_deque = kernel_cache[i];
-              assert(cache_deque.size() > 0);
-              Element element = cache_deque.front();
-              delete_element(device, element);
-              cache_deque.pop_front();
+              auto& cache = kernel_cache[i];
+              assert(cache.size() > 0);
+              Element element = cache.front();
+              if (!held) {
+                delete_element(device, element);
+              }
+              cache.pop_front();
             }
           } else {
             break;
@@ -750,6 +1468,16 @@ void EvaluateWorker::feed(EvalWorkEntry& work_entry) {
         }
         kernel_element_cache_input_idx += producible_elements;
       }
+      if (producible_elements > 0 &&
+          kernel_element_cache_input_idx == (i64)kernel_compute_rows.size()) {
+        if (arg_group_.state_handoff_ops[k] != -1) {
+          save_kernel_state(k, arg_group_.state_handoff_ops[k],
+                            kernel_states_);
+        }
+        if (arg_group_.reduce_ops[k] != -1) {
+          save_kernel_state(k, arg_group_.reduce_ops[k], reduced_states_);
+        }
+      }
     }
 
     // Remove dead columns from side_output_handles
@@ -787,6 +1515,486 @@ void EvaluateWorker::feed(EvalWorkEntry& work_entry) {
   profiler_.add_interval("feed", feed_start, now());
 }
 
+i32 EvaluateWorker::execute_fused_kernels(i32 k, BatchedColumns& columns,
+                                          std::vector<i64>& row_ids) {
+  i32 j = k + 1;
+  for (; j < arg_group_.fused_with_previous.size() &&
+         arg_group_.fused_with_previous[j];
+       ++j) {
+    const std::string& op_name = arg_group_.op_names.at(j);
+    DeviceHandle current_handle = kernel_devices_[j];
+    // Only hand the kernel the rows it would have computed on its own
+    std::vector<i64> compute_row_ids;
+    std::vector<i64> compute_row_idxs;
+    RowSet::Cursor compute_rows(compute_rows_set_[j]);
+    for (size_t r = 0; r < row_ids.size(); ++r) {
+      if (compute_rows.contains(row_ids[r])) {
+        compute_row_ids.push_back(row_ids[r]);
+        compute_row_idxs.push_back(r);
+      }
+    }
+    i32 batch = compute_row_ids.size();
+
+    const std::vector<i32>& input_mapping = arg_group_.fused_input_mapping[j];
+    StenciledBatchedColumns input_columns(input_mapping.size());
+    for (size_t i = 0; i < input_mapping.size(); ++i) {
+      auto& col = input_columns[i];
+      col.resize(batch);
+      for (i32 r = 0; r < batch; ++r) {
+        Element element = columns[input_mapping[i]][compute_row_idxs[r]];
+        element.index = compute_row_ids[r];
+        col[r].push_back(element);
+      }
+    }
+
+    auto& unused_outputs = arg_group_.unused_outputs[j];
+    BatchedColumns output_columns;
+    output_columns.resize(kernel_num_outputs_[j] - unused_outputs.size());
+    if (batch > 0) {
+      PerfCounters::Sample perf_start;
+      if (perf_counters_) {
+        perf_start = perf_counters_->read();
+      }
+      auto eval_start = now();
+      kernels_[j]->execute_kernel(input_columns, output_columns);
+      profiler_.add_interval("evaluate:" + op_name, eval_start, now());
+      profiler_.increment("op_rows:" + kernel_profile_keys_[j], batch);
+      profiler_.increment("op_eval_ns:" + kernel_profile_keys_[j],
+                          (i64)nano_since(eval_start));
+      if (perf_counters_) {
+        perf_counters_->record(profiler_, "op_", kernel_profile_keys_[j],
+                               perf_start);
+      }
+    }
+
+    // The intermediate columns are consumed, so release them now while the
+    // buffers are still hot for the next batch
+    for (ElementList& column : columns) {
+      for (Element& element : column) {
+        delete_element(kernel_devices_[j - 1], element);
+      }
+    }
+
+    // Delete unused output columns
+    for (size_t y = 0; y < unused_outputs.size(); ++y) {
+      i32 unused_col_idx = unused_outputs[unused_outputs.size() - 1 - y];
+      ElementList& column = output_columns[unused_col_idx];
+      for (Element& element : column) {
+        delete_element(current_handle, element);
+      }
+      output_columns.erase(output_columns.begin() + unused_col_idx);
+    }
+
+    // Verify the kernel produced the correct amount of output
+    for (size_t i = 0; i < output_columns.size(); ++i) {
+      LOG_IF(FATAL, output_columns[i].size() != batch)
+          << "Op " << j << " produced " << output_columns[i].size()
+          << " output elements for column " << i << ". Expected " << batch
+          << " outputs.";
+    }
+
+    columns.swap(output_columns);
+    row_ids.swap(compute_row_ids);
+  }
+  return j - 1;
+}
+
+void EvaluateWorker::execute_kernel_batch(i32 k,
+                                          StenciledBatchedColumns& input_columns,
+                                          BatchedColumns& output_columns,
+                                          i32 batch) {
+  const std::string& op_name = arg_group_.op_names.at(k);
+  DeviceHandle current_handle = kernel_devices_[k];
+  auto& unused_outputs = arg_group_.unused_outputs[k];
+  output_columns.resize(kernel_num_outputs_[k] - unused_outputs.size());
+
+  PerfCounters::Sample perf_start;
+  if (perf_counters_) {
+    perf_start = perf_counters_->read();
+  }
+#ifdef HAVE_CUDA
+  cudaEvent_t start_event = nullptr;
+  if (kernel_streams_[k] != nullptr) {
+    CU_CHECK(cudaSetDevice(current_handle.id));
+    CU_CHECK(cudaEventCreate(&start_event));
+    CU_CHECK(cudaEventRecord(start_event, (cudaStream_t)kernel_streams_[k]));
+  }
+#endif
+  auto eval_start = now();
+  kernels_[k]->execute_kernel(input_columns, output_columns);
+  profiler_.add_interval("evaluate:" + op_name, eval_start, now());
+  if (kernel_in_place_[k]) {
+    adopt_in_place_outputs(k, input_columns, output_columns);
+  }
+  profiler_.increment("op_rows:" + kernel_profile_keys_[k], batch);
+  profiler_.increment("op_eval_ns:" + kernel_profile_keys_[k],
+                      (i64)nano_since(eval_start));
+  if (perf_counters_) {
+    perf_counters_->record(profiler_, "op_", kernel_profile_keys_[k],
+                           perf_start);
+  }
+
+  // Delete unused output columns. The kernel may still be writing them if
+  // it runs on a stream, so those are freed once the batch has finished.
+  ElementList unused_elements;
+  for (size_t y = 0; y < unused_outputs.size(); ++y) {
+    i32 unused_col_idx = unused_outputs[unused_outputs.size() - 1 - y];
+    ElementList& column = output_columns[unused_col_idx];
+    for (Element& element : column) {
+      if (kernel_streams_[k] != nullptr) {
+        unused_elements.push_back(element);
+      } else {
+        delete_element(current_handle, element);
+      }
+    }
+    output_columns.erase(output_columns.begin() + unused_col_idx);
+  }
+
+  // Verify the kernel produced the correct amount of output
+  for (size_t i = 0; i < output_columns.size(); ++i) {
+    LOG_IF(FATAL, output_columns[i].size() != batch)
+        << "Op " << k << " produced " << output_columns[i].size()
+        << " output elements for column " << i << ". Expected " << batch
+        << " outputs.";
+  }
+
+#ifdef HAVE_CUDA
+  if (kernel_streams_[k] != nullptr) {
+    cudaEvent_t event;
+    CU_CHECK(cudaSetDevice(current_handle.id));
+    CU_CHECK(cudaEventCreate(&event));
+    CU_CHECK(cudaEventRecord(event, (cudaStream_t)kernel_streams_[k]));
+    kernel_batches_in_flight_[k].emplace_back(start_event, event,
+                                              std::move(unused_elements));
+    wait_for_kernel_batches(k, MAX_BATCHES_IN_FLIGHT - 1);
+  }
+#endif
+}
+
+void EvaluateWorker::save_kernel_state(i32 k, i64 op_idx,
+                                       KernelStateStore* store) {
+  proto::KernelState state;
+  state.set_op_index(op_idx);
+  state.set_next_row(compute_rows_[k].back() + 1);
+  std::vector<u8> bytes;
+  kernels_[k]->serialize_state(bytes);
+  state.set_state(bytes.data(), bytes.size());
+  store->add(job_idx_, task_idx_, state);
+}
+
+void EvaluateWorker::record_batch_trial(i32 k, i64 rows, i64 ns) {
+  BatchSizeTuner& tuner = batch_tuners_[k];
+  tuner.rows += rows;
+  tuner.ns += ns;
+  i32 batch = tuner.candidates[tuner.trial];
+  if (tuner.rows < (i64)AUTOTUNE_BATCHES_PER_TRIAL * batch || tuner.ns == 0) {
+    return;
+  }
+  // A candidate fits if no allocation had to wait on the pool and the pool's
+  // high-water mark left the headroom that other kernels may need
+  DeviceHandle device = kernel_devices_[k];
+  MemoryPoolStats stats = memory_pool_stats(device);
+  bool fits =
+      pool_exhausted_count(device) == tuner.pool_exhausted_start &&
+      (stats.pool_size == 0 ||
+       stats.pool_peak_bytes <= AUTOTUNE_POOL_FRACTION * stats.pool_size);
+  f64 rows_per_ns = tuner.rows / (f64)tuner.ns;
+  if (fits && rows_per_ns > tuner.best_rows_per_ns) {
+    tuner.best = batch;
+    tuner.best_rows_per_ns = rows_per_ns;
+  }
+  // Larger batches than one that ran out of memory or lost throughput are
+  // not worth trying
+  tuner.trial++;
+  if (!fits || tuner.trial == tuner.candidates.size() ||
+      rows_per_ns < AUTOTUNE_SLOWDOWN_FRACTION * tuner.best_rows_per_ns) {
+    tuner.active = false;
+    arg_group_.kernel_batch_sizes[k] = tuner.best;
+    profiler_.increment("op_tuned_batch_size:" + kernel_profile_keys_[k],
+                        tuner.best);
+    VLOG(1) << "Op " << arg_group_.op_names[k] << " tuned to batch size "
+            << tuner.best << " ("
+            << tuner.best_rows_per_ns * 1000000000.0 << " rows/s)";
+    return;
+  }
+  arg_group_.kernel_batch_sizes[k] = tuner.candidates[tuner.trial];
+  tuner.rows = 0;
+  tuner.ns = 0;
+  tuner.pool_exhausted_start = pool_exhausted_count(device);
+}
+
+void EvaluateWorker::adopt_in_place_outputs(
+    i32 k, const StenciledBatchedColumns& input_columns,
+    BatchedColumns& output_columns) {
+  // An input returned as an output gets a reference of its own, so the
+  // cached input can be deleted as usual
+  const std::vector<ElementList>& inputs = input_columns[0];
+  ElementList& outputs = output_columns[0];
+  i64 adopted = 0;
+  for (size_t r = 0; r < inputs.size() && r < outputs.size(); ++r) {
+    const Element& input = inputs[r][0];
+    if (input.writable && outputs[r].buffer == input.buffer) {
+      outputs[r] = add_element_ref(kernel_devices_[k], input);
+      adopted++;
+    }
+  }
+  profiler_.increment("in_place_rows", adopted);
+}
+
+std::unique_ptr<EvaluateWorker::ReplicaBatch>
+EvaluateWorker::submit_async_batch(i32 k,
+                                   StenciledBatchedColumns&& input_columns,
+                                   i64 start, i32 batch) {
+  const std::string& op_name = arg_group_.op_names.at(k);
+  std::unique_ptr<ReplicaBatch> pending(new ReplicaBatch);
+  pending->start = start;
+  pending->batch = batch;
+  pending->device_ns = 0;
+  ReplicaBatch* result = pending.get();
+  auto inputs =
+      std::make_shared<StenciledBatchedColumns>(std::move(input_columns));
+  DeviceHandle device = kernel_devices_[k];
+  const std::vector<i32>& unused_outputs = arg_group_.unused_outputs[k];
+  BatchedColumns& output_columns = result->output_columns;
+  output_columns.resize(kernel_num_outputs_[k] - unused_outputs.size());
+
+  auto eval_start = now();
+  auto issued = std::make_shared<std::future<void>>(
+      kernels_[k]->execute_kernel_async(*inputs, output_columns));
+  profiler_.add_interval("evaluate:" + op_name, eval_start, now());
+  result->eval_ns = nano_since(eval_start);
+
+  // Runs on the evaluate thread when the batch is collected, so the
+  // outputs are only touched after the kernel has finished writing them
+  pending->done = std::async(std::launch::deferred, [=]() {
+    auto wait_start = now();
+    issued->get();
+    result->eval_ns += nano_since(wait_start);
+
+    BatchedColumns& output_columns = result->output_columns;
+    if (kernel_in_place_[k]) {
+      adopt_in_place_outputs(k, *inputs, output_columns);
+    }
+    for (size_t y = 0; y < unused_outputs.size(); ++y) {
+      i32 unused_col_idx = unused_outputs[unused_outputs.size() - 1 - y];
+      for (Element& element : output_columns[unused_col_idx]) {
+        delete_element(device, element);
+      }
+      output_columns.erase(output_columns.begin() + unused_col_idx);
+    }
+    for (size_t i = 0; i < output_columns.size(); ++i) {
+      LOG_IF(FATAL, output_columns[i].size() != batch)
+          << "Op " << k << " produced " << output_columns[i].size()
+          << " output elements for column " << i << ". Expected " << batch
+          << " outputs.";
+    }
+    // Keeps the inputs alive until the kernel is done reading them
+    (void)inputs;
+  });
+  return pending;
+}
+
+std::unique_ptr<EvaluateWorker::ReplicaBatch>
+EvaluateWorker::submit_replica_batch(i32 k,
+                                     StenciledBatchedColumns&& input_columns,
+                                     i64 start, i32 batch) {
+  auto& replicas = kernel_replicas_[k];
+  KernelReplica* replica =
+      replicas[next_replica_[k]++ % replicas.size()].get();
+
+  std::unique_ptr<ReplicaBatch> pending(new ReplicaBatch);
+  pending->start = start;
+  pending->batch = batch;
+  ReplicaBatch* result = pending.get();
+  auto promise = std::make_shared<std::promise<void>>();
+  pending->done = promise->get_future();
+  auto inputs =
+      std::make_shared<StenciledBatchedColumns>(std::move(input_columns));
+  DeviceHandle kernel_device = kernel_devices_[k];
+  const std::vector<i32>& unused_outputs = arg_group_.unused_outputs[k];
+  i32 num_outputs = kernel_num_outputs_[k] - unused_outputs.size();
+
+  replica->work.push([=]() {
+    DeviceHandle device = replica->device;
+    // Inputs are cached on the kernel's own device, so copy each column
+    // over to this replica's GPU in one transfer
+    StenciledBatchedColumns& replica_inputs = *inputs;
+    bool copy_inputs = device != kernel_device;
+    if (copy_inputs) {
+      for (auto& col : replica_inputs) {
+        ElementList flat;
+        for (auto& input_stencil : col) {
+          flat.insert(flat.end(), input_stencil.begin(), input_stencil.end());
+        }
+        if (flat.empty()) {
+          continue;
+        }
+        ElementList copied =
+            copy_elements(replica->profiler, kernel_device, device, flat);
+        size_t e = 0;
+        for (auto& input_stencil : col) {
+          for (Element& element : input_stencil) {
+            copied[e].index = element.index;
+            element = copied[e++];
+          }
+        }
+      }
+    }
+
+    BatchedColumns& output_columns = result->output_columns;
+    output_columns.resize(num_outputs);
+    result->device_ns = 0;
+#ifdef HAVE_CUDA
+    cudaEvent_t start_event = nullptr;
+    if (replica->stream != nullptr) {
+      CU_CHECK(cudaEventCreate(&start_event));
+      CU_CHECK(cudaEventRecord(start_event, (cudaStream_t)replica->stream));
+    }
+#endif
+    auto eval_start = now();
+    replica->kernel->execute_kernel(replica_inputs, output_columns);
+#ifdef HAVE_CUDA
+    if (replica->stream != nullptr) {
+      cudaEvent_t end_event;
+      CU_CHECK(cudaEventCreate(&end_event));
+      CU_CHECK(cudaEventRecord(end_event, (cudaStream_t)replica->stream));
+      CU_CHECK(cudaEventSynchronize(end_event));
+      f32 device_ms;
+      CU_CHECK(cudaEventElapsedTime(&device_ms, start_event, end_event));
+      result->device_ns = (i64)(device_ms * 1000000.0);
+      CU_CHECK(cudaEventDestroy(start_event));
+      CU_CHECK(cudaEventDestroy(end_event));
+    }
+#endif
+    result->eval_ns = nano_since(eval_start);
+
+    for (size_t y = 0; y < unused_outputs.size(); ++y) {
+      i32 unused_col_idx = unused_outputs[unused_outputs.size() - 1 - y];
+      for (Element& element : output_columns[unused_col_idx]) {
+        delete_element(device, element);
+      }
+      output_columns.erase(output_columns.begin() + unused_col_idx);
+    }
+    for (size_t i = 0; i < output_columns.size(); ++i) {
+      LOG_IF(FATAL, output_columns[i].size() != batch)
+          << "Op " << k << " produced " << output_columns[i].size()
+          << " output elements for column " << i << ". Expected " << batch
+          << " outputs.";
+    }
+    // Downstream expects the kernel's outputs on its own device
+    for (ElementList& column : output_columns) {
+      if (!column.empty()) {
+        move_if_different_address_space(replica->profiler, device,
+                                        kernel_device, column);
+      }
+    }
+    if (copy_inputs) {
+      for (auto& col : replica_inputs) {
+        for (auto& input_stencil : col) {
+          for (Element& element : input_stencil) {
+            delete_element(device, element);
+          }
+        }
+      }
+    }
+    promise->set_value();
+  });
+  return pending;
+}
+
+void EvaluateWorker::wait_for_kernel_batches(i32 k, size_t max_in_flight) {
+  auto& in_flight = kernel_batches_in_flight_[k];
+  if (in_flight.size() <= max_in_flight) {
+    return;
+  }
+  auto wait_start = now();
+  while (in_flight.size() > max_in_flight) {
+    auto& batch = in_flight.front();
+#ifdef HAVE_CUDA
+    cudaEvent_t start_event = (cudaEvent_t)std::get<0>(batch);
+    cudaEvent_t event = (cudaEvent_t)std::get<1>(batch);
+    CU_CHECK(cudaSetDevice(kernel_devices_[k].id));
+    CU_CHECK(cudaEventSynchronize(event));
+    f32 device_ms;
+    CU_CHECK(cudaEventElapsedTime(&device_ms, start_event, event));
+    profiler_.increment("op_device_ns:" + kernel_profile_keys_[k],
+                        (i64)(device_ms * 1000000.0));
+    CU_CHECK(cudaEventDestroy(start_event));
+    CU_CHECK(cudaEventDestroy(event));
+#endif
+    for (Element& element : std::get<2>(batch)) {
+      delete_element(kernel_devices_[k], element);
+    }
+    in_flight.pop_front();
+  }
+  profiler_.add_interval("evaluate_wait:" + arg_group_.op_names.at(k),
+                         wait_start, now());
+}
+
+void EvaluateWorker::split_held_outputs(i32 k, BatchedColumns& output_columns) {
+  size_t held = held_row_ids_.size();
+  held_output_columns_.resize(output_columns.size());
+  for (size_t cidx = 0; cidx < output_columns.size(); ++cidx) {
+    ElementList& column = output_columns[cidx];
+    for (size_t r = 0; r < held; ++r) {
+      if (held_valid_outputs_[r]) {
+        held_output_columns_[cidx].push_back(column[r]);
+      } else {
+        delete_element(kernel_devices_[k], column[r]);
+      }
+    }
+    column.erase(column.begin(), column.begin() + held);
+  }
+  for (size_t r = 0; r < held; ++r) {
+    if (held_valid_outputs_[r]) {
+      held_output_row_ids_.push_back(held_row_ids_[r]);
+    }
+  }
+  held_row_ids_.clear();
+  held_valid_outputs_.clear();
+  held_input_columns_.clear();
+}
+
+bool EvaluateWorker::has_held_rows() const {
+  return !held_row_ids_.empty() || !held_output_columns_.empty();
+}
+
+void EvaluateWorker::flush_held_rows() {
+  if (held_row_ids_.empty()) {
+    return;
+  }
+  StenciledBatchedColumns input_columns;
+  input_columns.swap(held_input_columns_);
+  BatchedColumns output_columns;
+  execute_kernel_batch(0, input_columns, output_columns,
+                       (i32)held_row_ids_.size());
+  wait_for_kernel_batches(0, 0);
+  auto& kernel_cache_devices = element_cache_devices_[0];
+  for (size_t i = 0; i < input_columns.size(); ++i) {
+    for (auto& input_stencil : input_columns[i]) {
+      delete_element(kernel_cache_devices[i], input_stencil[0]);
+    }
+  }
+  split_held_outputs(0, output_columns);
+}
+
+void EvaluateWorker::yield_held_outputs(EvalWorkEntry& entry) {
+  flush_held_rows();
+  // The kernel's outputs are the last columns of the group's outputs
+  size_t first_col_idx = entry.columns.size() - held_output_columns_.size();
+  for (size_t cidx = 0; cidx < held_output_columns_.size(); ++cidx) {
+    ElementList& column = held_output_columns_[cidx];
+    entry.columns[first_col_idx + cidx].insert(
+        entry.columns[first_col_idx + cidx].end(), column.begin(),
+        column.end());
+    entry.row_ids[first_col_idx + cidx].insert(
+        entry.row_ids[first_col_idx + cidx].end(),
+        held_output_row_ids_.begin(), held_output_row_ids_.end());
+  }
+  held_output_columns_.clear();
+  held_output_row_ids_.clear();
+}
+
 bool EvaluateWorker::yield(i32 item_size, EvalWorkEntry& output_entry) {
   EvalWorkEntry& work_entry = entry_;
 
@@ -835,20 +2043,23 @@ void EvaluateWorker::clear_stencil_cache() {
     std::vector<i32>& kernel_stencil = arg_group_.kernel_stencils[k];
     bool degenerate_stencil =
         (kernel_stencil.size() == 1 && kernel_stencil[0] == 0);
-    std::vector<std::deque<Element>>& kernel_cache = element_cache_[k];
+    std::vector<RingBuffer<Element>>& kernel_cache = element_cache_[k];
     std::vector<DeviceHandle>& kernel_cache_devices = element_cache_devices_[k];
-    std::vector<std::deque<i64>>& kernel_cache_row_ids =
+    std::vector<RingBuffer<i64>>& kernel_cache_row_ids =
         element_cache_row_ids_[k];
     auto& input_column_idx = arg_group_.column_mapping[k];
     for (i32 i = 0; i < input_column_idx.size(); ++i) {
-      auto& row_id_deque = kernel_cache_row_ids[i];
-      row_id_deque.clear();
-      auto& cache_deque = kernel_cache[i];
-      for (i64 j = 0; j < cache_deque.size(); ++j) {
+      auto& row_ids = kernel_cache_row_ids[i];
+      auto& cache = kernel_cache[i];
+      while (!cache.empty()) {
         assert(!kernel_cache_devices.empty());
-        Element element = cache_deque.back();
-        delete_element(kernel_cache_devices[i], element);
-        cache_deque.pop_back();
+        // Held rows outlive the task they were cached for
+        if (!std::binary_search(held_row_ids_.begin(), held_row_ids_.end(),
+                                row_ids.back())) {
+          delete_element(kernel_cache_devices[i], cache.back());
+        }
+        cache.pop_back();
+        row_ids.pop_back();
       }
     }
   }
@@ -856,23 +2067,41 @@ void EvaluateWorker::clear_stencil_cache() {
 
 PostEvaluateWorker::PostEvaluateWorker(const PostEvaluateWorkerArgs& args)
   : profiler_(args.profiler),
+    gpu_resident_(args.gpu_resident),
+    encode_segments_(std::max(1, args.encode_segments)),
     column_mapping_(args.column_mapping),
     columns_(args.columns),
     column_set_(args.column_mapping.begin(), args.column_mapping.end()) {
   assert(args.column_mapping.size() == args.columns.size());
 
-  encoder_handle_ = CPU_DEVICE;
-  encoder_type_ = VideoEncoderType::SOFTWARE;
-
   // Setup video encoders
-  // TODO(apoms): Make this dynamic based on the encoded column type
   for (size_t i = 0; i < args.columns.size(); ++i) {
     auto& col = args.columns[i];
     auto& compression_opts = args.column_compression[i];
     ColumnType type = col.type();
     if (type != ColumnType::Video || compression_opts.codec == "raw") continue;
-    encoders_.emplace_back(
-        VideoEncoder::make_from_config(encoder_handle_, 1, encoder_type_));
+    VideoEncoderType encoder_type = VideoEncoderType::SOFTWARE;
+    auto encoder_it = compression_opts.options.find("encoder");
+    if (encoder_it != compression_opts.options.end() &&
+        encoder_it->second == "nvidia") {
+      if (VideoEncoder::has_encoder_type(VideoEncoderType::NVIDIA)) {
+        encoder_type = VideoEncoderType::NVIDIA;
+      } else {
+        LOG(WARNING) << "NVIDIA video encoder requested for column "
+                     << col.name() << " but is not available. Falling back "
+                     << "to the software encoder.";
+      }
+    }
+    encoder_types_.push_back(encoder_type);
+    if (encoder_type == VideoEncoderType::NVIDIA) {
+      encoder_handles_.push_back(DeviceHandle{DeviceType::GPU, -1});
+      encoders_.emplace_back(nullptr);
+    } else {
+      encoder_handles_.push_back(CPU_DEVICE);
+      encoders_.emplace_back(
+          VideoEncoder::make_from_config(CPU_DEVICE, 1, encoder_type));
+    }
+    segment_encoders_.emplace_back();
     encoder_configured_.push_back(false);
 
     EncodeOptions opts;
@@ -920,7 +2149,10 @@ void PostEvaluateWorker::feed(EvalWorkEntry& entry) {
     buffered_entry_.compressed.clear();
     for (size_t i = 0; i < columns_.size(); ++i) {
       buffered_entry_.column_types.push_back(columns_[i].type());
-      buffered_entry_.column_handles.push_back(CPU_DEVICE);
+      DeviceHandle handle = work_entry.column_handles[column_mapping_[i]];
+      buffered_entry_.column_handles.push_back(
+          gpu_resident_ && handle.type == DeviceType::GPU ? handle
+                                                          : CPU_DEVICE);
       if (columns_[i].type() == ColumnType::Video) {
         assert(work_entry.columns[i].size() > 0);
         Frame* frame = work_entry.columns[i][0].as_frame();
@@ -943,47 +2175,85 @@ void PostEvaluateWorker::feed(EvalWorkEntry& entry) {
   for (size_t i = 0; i < column_mapping_.size(); ++i) {
     i32 col_idx = column_mapping_[i];
     ColumnType column_type = columns_[i].type();
+    // Encoders and the save worker read frames as packed rows, so views
+    // into larger frames are copied out here at the latest
+    if (column_type == ColumnType::Video) {
+      for (auto& row : work_entry.columns[col_idx]) {
+        make_frame_contiguous(work_entry.column_handles[col_idx],
+                              row.as_frame());
+      }
+    }
     // Encode video frames
     if (compression_enabled_[i] && column_type == ColumnType::Video &&
         buffered_entry_.frame_sizes[encoder_idx].type == FrameType::U8) {
-      auto& encoder = encoders_[encoder_idx];
-      if (!encoder_configured_[encoder_idx]) {
-        // Configure encoder
-        encoder_configured_[encoder_idx] = true;
-        Frame* frame = work_entry.columns[col_idx][0].as_frame();
-        encoder->configure(frame->as_frame_info(),
-
-                           encode_options_[encoder_idx]);
+      DeviceHandle& encoder_handle = encoder_handles_[encoder_idx];
+      if (encoder_types_[encoder_idx] == VideoEncoderType::NVIDIA) {
+        // Encode on the GPU that produced the frames so they never have to
+        // round trip through the host
+        DeviceHandle frames_handle = work_entry.column_handles[col_idx];
+        i32 gpu_id = frames_handle.type == DeviceType::GPU ? frames_handle.id
+                                                           : 0;
+        if (encoder_handle.id != gpu_id) {
+          encoder_handle.id = gpu_id;
+          encoders_[encoder_idx].reset(VideoEncoder::make_from_config(
+              encoder_handle, 1, VideoEncoderType::NVIDIA));
+          encoder_configured_[encoder_idx] = false;
+        }
       }
-
       // Move frames to device for the encoder
       move_if_different_address_space(
-          profiler_, work_entry.column_handles[col_idx], encoder_handle_,
+          profiler_, work_entry.column_handles[col_idx], encoder_handle,
           work_entry.columns[col_idx]);
 
-      // Pass frames into encoder
       auto encode_start = now();
-      for (auto& row : work_entry.columns[col_idx]) {
-        Frame* frame = row.as_frame();
-        bool new_packet = encoder->feed(frame->data, frame->size());
-        while (new_packet) {
-          size_t buffer_size = 4 * 1024 * 1024;
-          u8* buffer = new_buffer(CPU_DEVICE, buffer_size);
-          size_t actual_size;
-          new_packet = encoder->get_packet(buffer, buffer_size, actual_size);
-          LOG_IF(FATAL, new_packet && actual_size > buffer_size)
-              << "Packet buffer not large enough (" << buffer_size << " vs "
-              << actual_size << ")";
-          insert_element(buffered_entry_.columns[i], buffer, actual_size);
+      if (encode_segments_ > 1 &&
+          encoder_types_[encoder_idx] == VideoEncoderType::SOFTWARE &&
+          !encoder_configured_[encoder_idx]) {
+        encode_segmented(encoder_idx, work_entry.columns[col_idx],
+                         buffered_entry_.columns[i]);
+        for (auto& row : work_entry.columns[col_idx]) {
+          delete_element(encoder_handle, row);
+        }
+      } else {
+        auto& encoder = encoders_[encoder_idx];
+        if (!encoder_configured_[encoder_idx]) {
+          // Configure encoder
+          encoder_configured_[encoder_idx] = true;
+          Frame* frame = work_entry.columns[col_idx][0].as_frame();
+          encoder->configure(frame->as_frame_info(),
+                             encode_options_[encoder_idx]);
+        }
+
+        // Pass frames into encoder
+        for (auto& row : work_entry.columns[col_idx]) {
+          Frame* frame = row.as_frame();
+          bool new_packet = encoder->feed(frame->data, frame->size());
+          drain_packets(encoder.get(), new_packet, buffered_entry_.columns[i]);
+          delete_element(encoder_handle, row);
         }
-        delete_element(encoder_handle_, row);
       }
       profiler_.add_interval("encode", encode_start, now());
       encoder_idx++;
     } else {
-      // Move data to CPU to avoid overflow on GPU
+      DeviceHandle& buffered_handle = buffered_entry_.column_handles[i];
+      if (buffered_handle.type == DeviceType::GPU) {
+        i64 size = 0;
+        for (auto& element : work_entry.columns[col_idx]) {
+          size += element.is_frame ? element.as_frame()->size() : element.size;
+        }
+        if (!admit_on_device(buffered_handle, size)) {
+          // Spill what has been buffered for this column so far
+          move_if_different_address_space(profiler_, buffered_handle,
+                                          CPU_DEVICE,
+                                          buffered_entry_.columns[i]);
+          buffered_handle = CPU_DEVICE;
+          profiler_.increment("gpu_resident_spills", 1);
+        }
+      }
+      // Move data to CPU to avoid overflow on GPU, unless it may stay there
+      // until it is saved
       move_if_different_address_space(
-          profiler_, work_entry.column_handles[col_idx], CPU_DEVICE,
+          profiler_, work_entry.column_handles[col_idx], buffered_handle,
           work_entry.columns[col_idx]);
       buffered_entry_.columns[i].insert(
           buffered_entry_.columns[i].end(),
@@ -1014,22 +2284,16 @@ void PostEvaluateWorker::feed(EvalWorkEntry& entry) {
       ColumnType column_type = columns_[i].type();
       if (compression_enabled_[i] && column_type == ColumnType::Video &&
           buffered_entry_.frame_sizes[encoder_idx].type == FrameType::U8) {
-        auto& encoder = encoders_[encoder_idx];
-
-        // Get last packets in encoder
-        auto encode_flush_start = now();
-        bool new_packet = encoder->flush();
-        while (new_packet) {
-          size_t buffer_size = 4 * 1024 * 1024;
-          u8* buffer = new_buffer(CPU_DEVICE, buffer_size);
-          size_t actual_size;
-          new_packet = encoder->get_packet(buffer, buffer_size, actual_size);
-          LOG_IF(FATAL, new_packet && actual_size > buffer_size)
-              << "Packet buffer not large enough (" << buffer_size << " vs "
-              << actual_size << ")";
-          insert_element(buffered_entry_.columns[i], buffer, actual_size);
+        // Segmented encoding flushes every segment as it goes
+        if (encoder_configured_[encoder_idx]) {
+          auto& encoder = encoders_[encoder_idx];
+
+          // Get last packets in encoder
+          auto encode_flush_start = now();
+          bool new_packet = encoder->flush();
+          drain_packets(encoder.get(), new_packet, buffered_entry_.columns[i]);
+          profiler_.add_interval("encode_flush", encode_flush_start, now());
         }
-        profiler_.add_interval("encode_flush", encode_flush_start, now());
         encoder_configured_[encoder_idx] = false;
         encoder_idx++;
       }
@@ -1045,6 +2309,60 @@ void PostEvaluateWorker::feed(EvalWorkEntry& entry) {
   }
 }
 
+void PostEvaluateWorker::encode_segmented(i32 encoder_idx,
+                                          const ElementList& rows,
+                                          ElementList& output) {
+  const EncodeOptions& opts = encode_options_[encoder_idx];
+  i64 keyframe_distance = opts.keyframe_distance > 0
+                              ? opts.keyframe_distance
+                              : DEFAULT_KEYFRAME_DISTANCE;
+  // Segments span at least one GOP so splitting adds few extra keyframes
+  i64 num_rows = rows.size();
+  i64 num_segments = std::max(
+      (i64)1, std::min((i64)encode_segments_, num_rows / keyframe_distance));
+
+  auto& encoders = segment_encoders_[encoder_idx];
+  while (encoders.size() < num_segments) {
+    encoders.emplace_back(VideoEncoder::make_from_config(
+        CPU_DEVICE, 1, VideoEncoderType::SOFTWARE));
+  }
+
+  // Every segment is configured and flushed on its own, so it starts on a
+  // keyframe and the save worker's index creator sees the concatenated
+  // segments as one stream
+  FrameInfo frame_info = rows[0].as_const_frame()->as_frame_info();
+  std::vector<ElementList> segment_packets(num_segments);
+  std::vector<std::thread> threads;
+  for (i64 s = 0; s < num_segments; ++s) {
+    i64 start = num_rows * s / num_segments;
+    i64 end = num_rows * (s + 1) / num_segments;
+    threads.emplace_back([&, s, start, end]() {
+      VideoEncoder* encoder = encoders[s].get();
+      encoder->configure(frame_info, opts);
+      for (i64 r = start; r < end; ++r) {
+        const Frame* frame = rows[r].as_const_frame();
+        bool new_packet = encoder->feed(frame->data, frame->size());
+        drain_packets(encoder, new_packet, segment_packets[s]);
+      }
+      drain_packets(encoder, encoder->flush(), segment_packets[s]);
+    });
+  }
+  for (std::thread& t : threads) {
+    t.join();
+  }
+  for (ElementList& packets : segment_packets) {
+    output.insert(output.end(), packets.begin(), packets.end());
+  }
+  profiler_.increment("encode_segments", num_segments);
+}
+
+bool PostEvaluateWorker::admit_on_device(DeviceHandle device, i64 size) {
+  // Leave room in the pool for the kernels and decoders still running
+  MemoryPoolStats stats = memory_pool_stats(device);
+  return stats.pool_bytes_in_use + size <=
+         stats.pool_size * GPU_RESIDENT_POOL_FRACTION;
+}
+
 bool PostEvaluateWorker::yield(EvalWorkEntry& output) {
   auto yield_start = now();
 
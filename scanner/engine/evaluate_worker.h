@@ -15,14 +15,23 @@
 
 #pragma once
 
+#include "scanner/engine/decoded_frame_cache.h"
+#include "scanner/engine/kernel_cache.h"
 #include "scanner/engine/kernel_factory.h"
 #include "scanner/engine/runtime.h"
 #include "scanner/engine/sampler.h"
 #include "scanner/util/common.h"
+#include "scanner/util/perf_counters.h"
 #include "scanner/util/queue.h"
+#include "scanner/util/ring_buffer.h"
+#include "scanner/util/row_set.h"
 #include "scanner/video/decoder_automata.h"
 #include "scanner/video/video_encoder.h"
 
+#include <functional>
+#include <future>
+#include <thread>
+
 namespace scanner {
 namespace internal {
 
@@ -38,6 +47,18 @@ struct PreEvaluateWorkerArgs {
   i32 node_id;
   i32 num_cpus;
   i32 work_packet_size;
+  // Threads per software decoder
+  i32 decoder_threads;
+  // Surfaces per Intel hardware decoder, or 0 to decode in software
+  i32 qsv_async_depth;
+  // Decoders splitting the keyframe intervals of a video column between
+  // them, or 0 to decode them in order on one
+  i32 interval_decoders;
+  // Frames decoded by any pipeline instance for columns several jobs read,
+  // or nullptr
+  DecodedFrameCache* decoded_frame_cache;
+  // Sample hardware performance counters around decoding
+  bool perf_counters;
 
   // Per worker arguments
   i32 worker_id;
@@ -63,8 +84,47 @@ class PreEvaluateWorker {
 
   i32 last_job_idx_ = -1;
 
+  // Decoders are pooled by stream parameters so that a task reading video
+  // with the same codec, resolution, chroma format, output size and output
+  // pixel format as an earlier one reuses an initialized decoder instead of reconfiguring it
+  using DecoderKey = std::tuple<i32, i32, i32, i32, i32, i32, i32>;
+  struct PooledDecoders {
+    std::vector<std::unique_ptr<DecoderAutomata>> decoders;
+    i64 last_used;
+  };
+  static const i32 MAX_POOLED_DECODERS = 8;
+
+  DecoderAutomata* acquire_decoder(const DecoderKey& key, i32 index);
+
+  // Decodes the keyframe intervals of args on num_decoders decoders of the
+  // pool from index first_index up at once, each taking a contiguous run of
+  // them, and returns the frames in row order
+  std::vector<Frame*> decode_intervals(
+      const DecoderKey& key, i32 first_index,
+      const std::vector<DecodeArgsView>& args, i32 num_decoders);
+
   DeviceHandle decoder_output_handle_;
-  std::vector<std::unique_ptr<DecoderAutomata>> decoders_;
+  // Counters of this thread, when the bulk job samples them
+  std::unique_ptr<PerfCounters> perf_counters_;
+  VideoDecoderType decoder_type_;
+  i32 num_decoder_devices_;
+  std::map<DecoderKey, PooledDecoders> decoder_pool_;
+  i32 pooled_decoders_ = 0;
+  i64 tasks_fed_ = 0;
+  // Decoders for the video columns of the current task
+  std::vector<DecoderAutomata*> decoders_;
+
+  DecodedFrameCache* decoded_frame_cache_;
+  // For each video column of the current task that several jobs read, the
+  // table rows it decodes and their keys in decoded_frame_cache_
+  std::vector<std::vector<DecodedFrameCache::Key>> cache_keys_;
+  // Frames of video columns whose rows were all in the cache, taken when
+  // the task was fed
+  std::vector<std::vector<Frame*>> cached_frames_;
+  const i32 interval_decoders_;
+  // Frames of video columns whose intervals were decoded in parallel when
+  // the task was fed
+  std::vector<std::vector<Frame*>> interval_frames_;
 
   // Continuation state
   bool first_item_;
@@ -74,9 +134,19 @@ class PreEvaluateWorker {
   i64 current_row_;
   i64 total_rows_;
 
-  std::vector<std::vector<proto::DecodeArgs>> decode_args_;
+  std::vector<std::vector<DecodeArgsView>> decode_args_;
 };
 
+// Suffix of the profiler counters an EvaluateWorker keeps for each kernel:
+// op_rows, op_eval_ns, op_transferred_rows and op_transfer_ns, the device
+// time of GPU kernels and of their input copies, op_device_ns and
+// op_transfer_device_ns, plus op_cycles, op_instructions and op_llc_misses
+// when perf counters are sampled
+inline std::string op_profile_key(const std::string& op_name,
+                                  DeviceType device_type) {
+  return op_name + ":" + proto::DeviceType_Name(device_type);
+}
+
 struct OpArgGroup {
   std::vector<std::string> op_names;
   /// For sampling ops
@@ -101,6 +171,30 @@ struct OpArgGroup {
   std::vector<std::vector<i32>> kernel_stencils;
   // Batch size needed by kernels
   std::vector<i32> kernel_batch_sizes;
+  // Kernels which run inside the batch loop of the kernel before them
+  std::vector<bool> fused_with_previous;
+  // Index in the previous kernel's kept outputs for inputs of fused kernels
+  std::vector<std::vector<i32>> fused_input_mapping;
+  // How long the last batch of a task may wait for rows of the next task.
+  // Only set for groups made of a single kernel that can be batched across
+  // tasks.
+  i32 batch_deadline_ms = 0;
+  // Priority of the streams the GPU kernels of the pipeline instance run on
+  i32 stream_priority = 0;
+  // Sample hardware performance counters around each kernel evaluation
+  bool perf_counters = false;
+  // Sweep the batch sizes of batched kernels over the first work packets
+  bool autotune_batch_sizes = false;
+  // Op index of each kernel whose state is handed to the next task, -1 for
+  // the others
+  std::vector<i64> state_handoff_ops;
+  // Op index of each kernel that reduces its rows, -1 for the others
+  std::vector<i64> reduce_ops;
+  // Warmup of each kernel with bounded state, 0 for the others
+  std::vector<i32> warmup_sizes;
+  // GPUs that each kernel's batches are spread across, starting with the
+  // kernel's own device. Empty for kernels that only run on their device.
+  std::vector<std::vector<DeviceHandle>> kernel_replica_devices;
 };
 
 struct EvaluateWorkerArgs {
@@ -109,6 +203,12 @@ struct EvaluateWorkerArgs {
   std::mutex& startup_lock;
   std::condition_variable& startup_cv;
   i32& startup_count;
+  // Kernels are taken from and returned to the cache when set
+  KernelCache* kernel_cache;
+  // Receives the states of kernels that hand theirs to the next task
+  KernelStateStore* kernel_states;
+  // Receives the partial results of reduce kernels over each task
+  KernelStateStore* reduced_states;
 
   // Per worker arguments
   i32 ki;
@@ -132,53 +232,192 @@ class EvaluateWorker {
 
   bool yield(i32 item_size, EvalWorkEntry& output);
 
+  // When arg_group.batch_deadline_ms is set, the partial last batch of a task
+  // is held instead of evaluated so that the first rows of the next task can
+  // fill it up. True while held rows or their outputs are waiting to be
+  // handed back with yield_held_outputs.
+  bool has_held_rows() const;
+
+  // Evaluates the held rows on their own
+  void flush_held_rows();
+
+  // Appends the outputs of the held rows to the last entry of the task they
+  // came from, evaluating them first if no later task has yet
+  void yield_held_outputs(EvalWorkEntry& entry);
+
  private:
   void clear_stencil_cache();
 
+  // Evaluates one batch on kernel k and deletes its unused outputs
+  void execute_kernel_batch(i32 k, StenciledBatchedColumns& input_columns,
+                            BatchedColumns& output_columns, i32 batch);
+
+  // Gives the outputs of kernel k that are its writable inputs, returned
+  // in place, their own reference
+  void adopt_in_place_outputs(i32 k,
+                              const StenciledBatchedColumns& input_columns,
+                              BatchedColumns& output_columns);
+
+  // Hands the state of kernel k, the kernel of op op_idx, after the last row
+  // of the task to the store
+  void save_kernel_state(i32 k, i64 op_idx, KernelStateStore* store);
+
+  // True if kernel k has bounded state and the previous task left it warmed
+  // up on the rows just before the first row of the new task, so its
+  // warmup rows can be skipped instead of evaluated again
+  bool continues_warmup(i32 k, i64 job_idx, const TaskStream& stream) const;
+
+  // Moves the outputs of the held rows at the front of output_columns into
+  // held_output_columns_, dropping the rows their task does not output
+  void split_held_outputs(i32 k, BatchedColumns& output_columns);
+
+  // Blocks until at most max_in_flight batches are still running on kernel
+  // k's stream
+  void wait_for_kernel_batches(i32 k, size_t max_in_flight);
+
+  // A copy of a kernel on one of the GPUs in kernel_replica_devices, with a
+  // thread that evaluates the batches handed to it
+  struct KernelReplica {
+    KernelReplica() : profiler(now()) {}
+
+    BaseKernel* kernel;
+    // Null for the first replica, which is the kernel in kernels_
+    std::unique_ptr<BaseKernel> owned_kernel;
+    KernelConfig config;
+    DeviceHandle device;
+    void* stream = nullptr;
+    // Only used for the copies the replica makes, not reported
+    Profiler profiler;
+    Queue<std::function<void()>> work;
+    std::thread thread;
+  };
+
+  // A batch handed to a replica or issued to an asynchronous kernel, with
+  // outputs on the kernel's own device
+  struct ReplicaBatch {
+    std::future<void> done;
+    BatchedColumns output_columns;
+    i64 start;
+    i32 batch;
+    i64 eval_ns;
+    // Time the batch took on the replica's stream
+    i64 device_ns;
+  };
+
+  // Hands one batch of kernel k to its next replica
+  std::unique_ptr<ReplicaBatch> submit_replica_batch(
+      i32 k, StenciledBatchedColumns&& input_columns, i64 start, i32 batch);
+
+  // Issues one batch to kernel k's execute_kernel_async. Its done future
+  // waits for the kernel and drops the unused outputs.
+  std::unique_ptr<ReplicaBatch> submit_async_batch(
+      i32 k, StenciledBatchedColumns&& input_columns, i64 start, i32 batch);
+
+  // Runs the kernels fused after kernel k on one of its output batches,
+  // replacing columns and row_ids with the last fused kernel's outputs.
+  // Returns the index of that kernel.
+  i32 execute_fused_kernels(i32 k, BatchedColumns& columns,
+                            std::vector<i64>& row_ids);
+
   const i32 node_id_;
   const i32 worker_id_;
 
   Profiler& profiler_;
 
   OpArgGroup arg_group_;
+  KernelCache* kernel_cache_;
+  KernelStateStore* kernel_states_;
+  KernelStateStore* reduced_states_;
   std::vector<DeviceHandle> kernel_devices_;
+  std::vector<std::string> kernel_profile_keys_;
+  // Counters of this thread, when the bulk job samples them. Replicas run
+  // on threads of their own and are not counted.
+  std::unique_ptr<PerfCounters> perf_counters_;
   std::vector<i32> kernel_num_outputs_;
+  // Kernels whose writable inputs may come back as their first output
+  std::vector<bool> kernel_in_place_;
+
+  // Batch size sweep of one kernel. Each candidate runs until it has
+  // evaluated AUTOTUNE_BATCHES_PER_TRIAL batches.
+  struct BatchSizeTuner {
+    bool active = false;
+    std::vector<i32> candidates;
+    size_t trial = 0;
+    i64 rows = 0;
+    i64 ns = 0;
+    i64 pool_exhausted_start = 0;
+    i32 best = 0;
+    f64 best_rows_per_ns = 0;
+  };
+  // Counts the rows kernel k evaluated in ns towards its current trial, and
+  // moves on to the next candidate or settles on the best once it is done
+  void record_batch_trial(i32 k, i64 rows, i64 ns);
+  std::vector<BatchSizeTuner> batch_tuners_;
+  static const i32 AUTOTUNE_MAX_BATCH_SIZE = 128;
+  static const i32 AUTOTUNE_BATCHES_PER_TRIAL = 4;
   std::vector<std::unique_ptr<BaseKernel>> kernels_;
+  // Stream (cudaStream_t) each GPU kernel runs on, nullptr for CPU kernels
+  std::vector<void*> kernel_streams_;
+  // Batches issued on a kernel's stream that may still be running: the
+  // events (cudaEvent_t) recorded before and after each and its unused
+  // outputs, freed once the second event completes. The time between the
+  // events is the batch's device time.
+  std::vector<std::deque<std::tuple<void*, void*, ElementList>>>
+      kernel_batches_in_flight_;
+  static const i32 MAX_BATCHES_IN_FLIGHT = 3;
+  // Per kernel -> replicas on other GPUs, empty if not replicated
+  std::vector<std::vector<std::unique_ptr<KernelReplica>>> kernel_replicas_;
+  std::vector<i64> next_replica_;
 
   // Used for computing complement of column mapping
   std::vector<std::set<i32>> column_mapping_set_;
 
   /// Task state
-  i64 job_idx_;
+  i64 job_idx_ = -1;
   i64 task_idx_;
-  i64 slice_group_;
+  i64 slice_group_ = -1;
+  // Job, slice group and last compute rows (up to a warmup's worth) of
+  // each kernel in the previous task, kept for continues_warmup
+  i64 prev_job_idx_ = -1;
+  i64 prev_slice_group_ = -1;
+  std::vector<std::vector<i64>> prev_tail_rows_;
   std::map<i64, std::unique_ptr<DomainSampler>> domain_samplers_;
 
   // Inputs
-  std::vector<std::set<i64>> valid_input_rows_set_;
+  std::vector<RowSet> valid_input_rows_set_;
   std::vector<std::vector<i64>> valid_input_rows_;
   // Tracks which input we should expect next for which column
   std::vector<std::vector<i64>> current_valid_input_idx_;
 
   // Outputs to compute
-  std::vector<std::set<i64>> compute_rows_set_;
+  std::vector<RowSet> compute_rows_set_;
   std::vector<std::vector<i64>> compute_rows_;
   // Tracks which input we should expect next
   std::vector<i64> current_compute_idx_;
 
   // Outputs to keep
-  std::vector<std::set<i64>> valid_output_rows_set_;
+  std::vector<RowSet> valid_output_rows_set_;
   std::vector<std::vector<i64>> valid_output_rows_;
   // Tracks which output we should expect next
   std::vector<i64> current_valid_output_idx_;
 
   // Per kernel -> per input column -> deque of element)
   std::vector<i64> current_element_cache_input_idx_;
-  std::vector<std::vector<std::deque<Element>>> element_cache_;
+  std::vector<std::vector<RingBuffer<Element>>> element_cache_;
   // Per kernel -> per input column -> device handle
   std::vector<std::vector<DeviceHandle>> element_cache_devices_;
   // Per kernel -> per input column -> deque of row ids
-  std::vector<std::vector<std::deque<i64>>> element_cache_row_ids_;
+  std::vector<std::vector<RingBuffer<i64>>> element_cache_row_ids_;
+
+  /// Batching across tasks
+  // Staged inputs of the partial last batch of the previous task
+  StenciledBatchedColumns held_input_columns_;
+  std::vector<i64> held_row_ids_;
+  // Whether each held row is kept in the previous task's outputs
+  std::vector<bool> held_valid_outputs_;
+  // Kept outputs of the held rows once they have been evaluated
+  BatchedColumns held_output_columns_;
+  std::vector<i64> held_output_row_ids_;
 
   // Continutation state
   EvalWorkEntry entry_;
@@ -206,6 +445,12 @@ struct PostEvaluateWorkerArgs {
   std::vector<i32> column_mapping;
   std::vector<Column> columns;
   std::vector<ColumnCompressionOptions> column_compression;
+  // Leave saved columns produced on a GPU there until the save stage, as
+  // long as the GPU's memory pool has room for them
+  bool gpu_resident;
+  // Closed-GOP segments each work packet of a software encoded column is
+  // split into and encoded in parallel
+  i32 encode_segments;
 };
 
 class PostEvaluateWorker {
@@ -217,14 +462,28 @@ class PostEvaluateWorker {
   bool yield(EvalWorkEntry& output);
 
  private:
+  // Whether rows of size bytes may be buffered in device's memory pool
+  bool admit_on_device(DeviceHandle device, i64 size);
+
+  // Encodes rows as independent segments, each starting on a keyframe, on
+  // one thread per segment and appends the packets to output in order
+  void encode_segmented(i32 encoder_idx, const ElementList& rows,
+                        ElementList& output);
+
   Profiler& profiler_;
+  const bool gpu_resident_;
+  const i32 encode_segments_;
   std::vector<i32> column_mapping_;
   std::vector<Column> columns_;
   std::set<i32> column_set_;
 
-  DeviceHandle encoder_handle_;
-  VideoEncoderType encoder_type_;
+  // Per encoded column. NVIDIA encoders are created when first configured,
+  // on the GPU the column's frames were produced on.
+  std::vector<DeviceHandle> encoder_handles_;
+  std::vector<VideoEncoderType> encoder_types_;
   std::vector<std::unique_ptr<VideoEncoder>> encoders_;
+  // Extra encoders of each encoded column used by encode_segmented
+  std::vector<std::vector<std::unique_ptr<VideoEncoder>>> segment_encoders_;
   std::vector<bool> encoder_configured_;
   std::vector<EncodeOptions> encode_options_;
   std::vector<bool> compression_enabled_;
@@ -17,6 +17,9 @@
 #include "scanner/api/frame.h"
 #include "scanner/engine/metadata.h"
 #include "scanner/video/h264_byte_stream_index_creator.h"
+#include "scanner/video/hevc_byte_stream_index_creator.h"
+#include "scanner/video/video_decoder.h"
+#include "scanner/video/video_encoder.h"
 
 #include "scanner/util/common.h"
 #include "scanner/util/h264.h"
@@ -39,8 +42,14 @@ extern "C" {
 #include "libswscale/swscale.h"
 }
 
+#include <atomic>
 #include <cassert>
+#include <cmath>
+#include <cstring>
 #include <fstream>
+#include <map>
+#include <mutex>
+#include <tuple>
 
 using storehouse::StoreResult;
 using storehouse::WriteFile;
@@ -51,6 +60,10 @@ namespace internal {
 namespace {
 
 const std::string BAD_VIDEOS_FILE_PATH = "bad_videos.txt";
+// Videos between ingest progress reports
+const i64 INGEST_PROGRESS_INTERVAL = 100;
+// Images read by a thread before their format groups are written as items
+const i64 IMAGES_PER_INGEST_BATCH = 1024;
 
 struct FFStorehouseState {
   std::unique_ptr<RandomReadFile> file = nullptr;
@@ -120,6 +133,7 @@ struct CodecState {
 #endif
   i32 video_stream_index;
   AVBitStreamFilterContext* annexb;
+  proto::VideoDescriptor::VideoCodecType codec_type;
 };
 
 bool setup_video_codec(FFStorehouseState* fs, CodecState& state) {
@@ -162,9 +176,19 @@ bool setup_video_codec(FFStorehouseState* fs, CodecState& state) {
   AVStream const* const in_stream =
       state.format_context->streams[state.video_stream_index];
 
-  state.in_codec = avcodec_find_decoder(AV_CODEC_ID_H264);
+  AVCodecID codec_id = in_stream->codec->codec_id;
+  if (codec_id == AV_CODEC_ID_H264) {
+    state.codec_type = proto::VideoDescriptor::H264;
+  } else if (codec_id == AV_CODEC_ID_HEVC) {
+    state.codec_type = proto::VideoDescriptor::HEVC;
+  } else {
+    LOG(ERROR) << "unsupported codec " << avcodec_get_name(codec_id);
+    return false;
+  }
+  state.in_codec = avcodec_find_decoder(codec_id);
   if (state.in_codec == NULL) {
-    LOG(FATAL) << "could not find h264 decoder";
+    LOG(FATAL) << "could not find " << avcodec_get_name(codec_id)
+               << " decoder";
   }
 
   state.in_cc = avcodec_alloc_context3(state.in_codec);
@@ -191,7 +215,9 @@ bool setup_video_codec(FFStorehouseState* fs, CodecState& state) {
     return false;
   }
 
-  state.annexb = av_bitstream_filter_init("h264_mp4toannexb");
+  state.annexb = av_bitstream_filter_init(
+      state.codec_type == proto::VideoDescriptor::HEVC ? "hevc_mp4toannexb"
+                                                       : "h264_mp4toannexb");
 
   return true;
 }
@@ -215,29 +241,258 @@ void cleanup_video_codec(CodecState state) {
   av_bitstream_filter_close(state.annexb);
 }
 
-bool parse_and_write_video(storehouse::StorageBackend* storage,
-                           const std::string& table_name, i32 table_id,
-                           const std::string& path,
-                           std::string& error_message) {
+// Reads the SPS and PPS NAL units of the stream's avcC configuration into
+// parameter_sets with start codes. Only mp4 streams whose NAL units carry 4
+// byte length prefixes can be referenced in place, since swapping those
+// prefixes for start codes keeps every packet the same size.
+bool in_place_parameter_sets(const CodecState& state,
+                             std::vector<u8>& parameter_sets,
+                             std::string& reason) {
+  if (state.codec_type != proto::VideoDescriptor::H264) {
+    reason = "only H.264 streams can be referenced in place";
+    return false;
+  }
+  std::string format_name = state.format_context->iformat->name;
+  if (format_name.find("mp4") == std::string::npos) {
+    reason = "container is " + format_name + ", not mp4";
+    return false;
+  }
+  const u8* extradata = state.in_cc->extradata;
+  i32 size = state.in_cc->extradata_size;
+  if (size < 7 || extradata[0] != 1) {
+    reason = "stream has no avcC configuration";
+    return false;
+  }
+  if ((extradata[4] & 0x3) + 1 != 4) {
+    reason = "NAL unit lengths are not 4 bytes";
+    return false;
+  }
+  const u8 start_code[] = {0, 0, 0, 1};
+  i32 pos = 5;
+  // SPS list then PPS list, each a count followed by 16 bit sized NAL units
+  for (i32 list = 0; list < 2; ++list) {
+    if (pos >= size) {
+      reason = "avcC configuration is truncated";
+      return false;
+    }
+    i32 count = list == 0 ? (extradata[pos] & 0x1f) : extradata[pos];
+    pos++;
+    for (i32 i = 0; i < count; ++i) {
+      if (pos + 2 > size) {
+        reason = "avcC configuration is truncated";
+        return false;
+      }
+      i32 nal_size = (extradata[pos] << 8) | extradata[pos + 1];
+      pos += 2;
+      if (pos + nal_size > size) {
+        reason = "avcC configuration is truncated";
+        return false;
+      }
+      parameter_sets.insert(parameter_sets.end(), start_code, start_code + 4);
+      parameter_sets.insert(parameter_sets.end(), extradata + pos,
+                            extradata + pos + nal_size);
+      pos += nal_size;
+    }
+  }
+  return true;
+}
+
+proto::TableDescriptor video_table_descriptor(const std::string& table_name,
+                                              i32 table_id, bool proxy) {
   proto::TableDescriptor table_desc;
   table_desc.set_id(table_id);
   table_desc.set_name(table_name);
   table_desc.set_job_id(-1);
-  table_desc.set_timestamp(
-      std::chrono::duration_cast<std::chrono::seconds>(now().time_since_epoch())
-          .count());
 
-  {
-    Column* index_col = table_desc.add_columns();
-    index_col->set_name(index_column_name());
-    index_col->set_id(0);
-    index_col->set_type(ColumnType::Other);
+  Column* index_col = table_desc.add_columns();
+  index_col->set_name(index_column_name());
+  index_col->set_id(0);
+  index_col->set_type(ColumnType::Other);
+
+  Column* frame_col = table_desc.add_columns();
+  frame_col->set_name(frame_column_name());
+  frame_col->set_id(1);
+  frame_col->set_type(ColumnType::Video);
+
+  if (proxy) {
+    Column* proxy_col = table_desc.add_columns();
+    proxy_col->set_name(proxy_column_name());
+    proxy_col->set_id(2);
+    proxy_col->set_type(ColumnType::Video);
+  }
+  return table_desc;
+}
+
+// Re-encodes the stream fed to it at a lower resolution as the proxy column
+// of an item, so jobs that decode frames smaller than the proxy can read it
+// instead of the full resolution video
+class ProxyWriter {
+ public:
+  ProxyWriter(storehouse::StorageBackend* storage, i32 table_id, i32 item_id,
+              i32 width, i32 height, i32 proxy_height,
+              proto::VideoDescriptor::VideoCodecType codec_type)
+    : storage_(storage), table_id_(table_id), item_id_(item_id) {
+    // Keep the aspect ratio, with even dimensions for 4:2:0 chroma
+    proxy_height_ = std::min(proxy_height, height) & ~1;
+    proxy_width_ =
+        static_cast<i32>(std::round((f64)width * proxy_height_ / height)) & ~1;
+    proxy_info_ = FrameInfo(proxy_height_, proxy_width_, 3, FrameType::U8);
+    frame_buffer_.resize(proxy_info_.size());
+    packet_buffer_.resize(frame_buffer_.size());
+
+    BACKOFF_FAIL(make_unique_write_file(
+        storage_, table_item_output_path(table_id_, 2, item_id_), file_));
+    index_creator_.reset(new H264ByteStreamIndexCreator(file_.get()));
+
+    decoder_.reset(VideoDecoder::make_from_config(
+        CPU_DEVICE, 1, VideoDecoderType::SOFTWARE));
+    decoder_->configure(FrameInfo(height, width, 3, FrameType::U8),
+                        proxy_info_, PixelFormat::RGB24, codec_type);
+    encoder_.reset(VideoEncoder::make_from_config(CPU_DEVICE, 1,
+                                                  VideoEncoderType::SOFTWARE));
+    encoder_->configure(proxy_info_, EncodeOptions());
+  }
+
+  bool feed(const u8* packet, size_t size, std::string& error_message) {
+    decoder_->feed(packet, size);
+    return encode_decoded_frames(error_message);
+  }
+
+  //! Flushes both codecs and writes the proxy's file and descriptor. The
+  //  proxy has to hold as many frames as the item's video.
+  bool finish(i64 frames, i32 time_base_num, i32 time_base_denom,
+              std::string& error_message) {
+    decoder_->feed(nullptr, 0);
+    if (!encode_decoded_frames(error_message)) {
+      return false;
+    }
+    encoder_->flush();
+    if (!write_encoded_packets(error_message)) {
+      return false;
+    }
+    if (index_creator_->frames() != frames) {
+      error_message = "Proxy stream has " +
+                      std::to_string(index_creator_->frames()) +
+                      " frames but the video has " + std::to_string(frames);
+      return false;
+    }
+    BACKOFF_FAIL(file_->save());
+
+    VideoMetadata proxy_meta;
+    proto::VideoDescriptor& desc = proxy_meta.get_descriptor();
+    desc.set_table_id(table_id_);
+    desc.set_column_id(2);
+    desc.set_item_id(item_id_);
+    desc.set_width(proxy_width_);
+    desc.set_height(proxy_height_);
+    desc.set_channels(3);
+    desc.set_frame_type(FrameType::U8);
+    desc.set_chroma_format(proto::VideoDescriptor::YUV_420);
+    desc.set_codec_type(proto::VideoDescriptor::H264);
+    desc.set_time_base_num(time_base_num);
+    desc.set_time_base_denom(time_base_denom);
+    desc.set_frames(frames);
+    desc.set_num_encoded_videos(1);
+    desc.add_frames_per_video(frames);
+    desc.add_keyframes_per_video(index_creator_->keyframe_positions().size());
+    desc.add_size_per_video(index_creator_->bytestream_pos());
+    std::vector<i64> non_ref_frames = index_creator_->non_ref_frames();
+    desc.add_non_ref_frames_per_video(non_ref_frames.size());
+    for (i64 v : non_ref_frames) {
+      desc.add_non_ref_frames(v);
+    }
+    const std::vector<u8>& metadata_bytes = index_creator_->metadata_bytes();
+    desc.set_metadata_packets(metadata_bytes.data(), metadata_bytes.size());
+    KeyframeIndex::append(desc, 0, 0, index_creator_->keyframe_positions(),
+                          index_creator_->keyframe_timestamps(),
+                          index_creator_->keyframe_byte_offsets());
+    write_video_metadata(storage_, proxy_meta);
+    return true;
+  }
+
+ private:
+  bool encode_decoded_frames(std::string& error_message) {
+    while (decoder_->decoded_frames_buffered() > 0) {
+      decoder_->get_frame(frame_buffer_.data(), frame_buffer_.size());
+      encoder_->feed(frame_buffer_.data(), frame_buffer_.size());
+      if (!write_encoded_packets(error_message)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  bool write_encoded_packets(std::string& error_message) {
+    while (encoder_->decoded_packets_buffered() > 0) {
+      size_t packet_size;
+      encoder_->get_packet(packet_buffer_.data(), packet_buffer_.size(),
+                           packet_size);
+      if (packet_size > packet_buffer_.size()) {
+        // Left queued until there is room for it
+        packet_buffer_.resize(packet_size);
+        continue;
+      }
+      if (!index_creator_->feed_packet(packet_buffer_.data(), packet_size)) {
+        error_message = "Proxy stream: " + index_creator_->error_message();
+        return false;
+      }
+    }
+    return true;
+  }
+
+  storehouse::StorageBackend* storage_;
+  i32 table_id_;
+  i32 item_id_;
+  i32 proxy_width_;
+  i32 proxy_height_;
+  FrameInfo proxy_info_;
+  std::vector<u8> frame_buffer_;
+  std::vector<u8> packet_buffer_;
+  std::unique_ptr<WriteFile> file_;
+  std::unique_ptr<H264ByteStreamIndexCreator> index_creator_;
+  std::unique_ptr<VideoDecoder> decoder_;
+  std::unique_ptr<VideoEncoder> encoder_;
+};
+
+// Writes the index column item of a video item, whose rows hold their row
+// numbers in the table
+void write_index_column(storehouse::StorageBackend* storage, i32 table_id,
+                        i32 item_id, i64 start_row, i64 frames) {
+  std::string index_path = table_item_output_path(table_id, 0, item_id);
+  std::unique_ptr<WriteFile> index_file{};
+  BACKOFF_FAIL(make_unique_write_file(storage, index_path, index_file));
 
-    Column* frame_col = table_desc.add_columns();
-    frame_col->set_name(frame_column_name());
-    frame_col->set_id(1);
-    frame_col->set_type(ColumnType::Video);
+  std::string index_metadata_path =
+      table_item_metadata_path(table_id, 0, item_id);
+  std::unique_ptr<WriteFile> index_metadata_file{};
+  BACKOFF_FAIL(make_unique_write_file(storage, index_metadata_path,
+                                      index_metadata_file));
+  s_write<i64>(index_metadata_file.get(), frames);
+  for (i64 i = 0; i < frames; ++i) {
+    s_write(index_metadata_file.get(), sizeof(i64));
   }
+  BACKOFF_FAIL(index_metadata_file->save());
+  for (i64 i = 0; i < frames; ++i) {
+    s_write(index_file.get(), start_row + i);
+  }
+  BACKOFF_FAIL(index_file->save());
+}
+
+// Writes the video at path as the next item of the table, so a table that
+// already has rows is extended with the video's frames. The table
+// descriptor is only saved once every item file is written, so a failure
+// leaves the table as it was. With a proxy_height, the video is also
+// re-encoded at that height into the proxy column, which the table must have.
+bool parse_and_write_video(storehouse::StorageBackend* storage,
+                           proto::TableDescriptor& table_desc,
+                           const std::string& path, bool inplace,
+                           i32 proxy_height, std::string& error_message) {
+  i32 table_id = table_desc.id();
+  i32 item_id = table_desc.end_rows_size();
+  i64 start_row = item_id == 0 ? 0 : table_desc.end_rows(item_id - 1);
+  table_desc.set_timestamp(
+      std::chrono::duration_cast<std::chrono::seconds>(now().time_since_epoch())
+          .count());
 
   // Setup custom buffer for libavcodec so that we can read from a storehouse
   // file instead of a posix file
@@ -272,21 +527,79 @@ bool parse_and_write_video(storehouse::StorageBackend* storage,
   proto::VideoDescriptor& video_descriptor = video_meta.get_descriptor();
   video_descriptor.set_table_id(table_id);
   video_descriptor.set_column_id(1);
-  video_descriptor.set_item_id(0);
+  video_descriptor.set_item_id(item_id);
 
   video_descriptor.set_width(state.in_cc->width);
   video_descriptor.set_height(state.in_cc->height);
   video_descriptor.set_channels(3);
   video_descriptor.set_frame_type(FrameType::U8);
   video_descriptor.set_chroma_format(proto::VideoDescriptor::YUV_420);
-  video_descriptor.set_codec_type(proto::VideoDescriptor::H264);
+  video_descriptor.set_codec_type(state.codec_type);
+
+  if (item_id > 0) {
+    // Frames of every item of a column have to be interchangeable
+    VideoMetadata first_meta = read_video_metadata(
+        storage, table_item_video_metadata_path(table_id, 1, 0));
+    if (first_meta.codec_type() != state.codec_type) {
+      cleanup_video_codec(state);
+      error_message = "Video codec differs from the codec of table " +
+                      table_desc.name();
+      return false;
+    }
+    if (first_meta.width() != state.in_cc->width ||
+        first_meta.height() != state.in_cc->height) {
+      cleanup_video_codec(state);
+      error_message = "Video is " + std::to_string(state.in_cc->width) + "x" +
+                      std::to_string(state.in_cc->height) + " but table " +
+                      table_desc.name() + " is " +
+                      std::to_string(first_meta.width()) + "x" +
+                      std::to_string(first_meta.height());
+      return false;
+    }
+  }
+
+  std::vector<u8> parameter_sets;
+  if (inplace) {
+    std::string reason;
+    if (!in_place_parameter_sets(state, parameter_sets, reason)) {
+      LOG(WARNING) << "Copying " << path << " into the database since it can "
+                   << "not be referenced in place: " << reason;
+      inplace = false;
+    }
+  }
 
-  std::string data_path = table_item_output_path(table_id, 1, 0);
   std::unique_ptr<WriteFile> demuxed_bytestream{};
-  BACKOFF_FAIL(make_unique_write_file(storage, data_path, demuxed_bytestream));
+  if (!inplace) {
+    std::string data_path = table_item_output_path(table_id, 1, item_id);
+    BACKOFF_FAIL(
+        make_unique_write_file(storage, data_path, demuxed_bytestream));
+  }
+
+  // Referenced in place, the stream is laid out like a copied one but with
+  // the source's parameter sets in front of each keyframe
+  std::vector<i64> source_packet_offsets;
+  std::vector<i64> source_packet_sizes;
+  std::vector<i64> source_keyframe_packets;
+  std::vector<i64> inplace_keyframe_byte_offsets;
+  i64 inplace_stream_size = 0;
+
+  std::unique_ptr<ProxyWriter> proxy_writer;
+  if (proxy_height > 0) {
+    proxy_writer.reset(new ProxyWriter(storage, table_id, item_id,
+                                       state.in_cc->width,
+                                       state.in_cc->height, proxy_height,
+                                       state.codec_type));
+  }
 
   bool succeeded = true;
-  H264ByteStreamIndexCreator index_creator(demuxed_bytestream.get());
+  std::unique_ptr<ByteStreamIndexCreator> index_creator;
+  if (state.codec_type == proto::VideoDescriptor::HEVC) {
+    index_creator.reset(
+        new HEVCByteStreamIndexCreator(demuxed_bytestream.get()));
+  } else {
+    index_creator.reset(
+        new H264ByteStreamIndexCreator(demuxed_bytestream.get()));
+  }
   while (true) {
     // Read from format context
     i32 err = av_read_frame(state.format_context, &state.av_packet);
@@ -296,7 +609,7 @@ bool parse_and_write_video(storehouse::StorageBackend* storage,
     } else if (err != 0) {
       char err_msg[256];
       av_strerror(err, err_msg, 256);
-      int frame = index_creator.frames();
+      int frame = index_creator->frames();
       LOG(ERROR) << "Error while decoding frame " << frame << " (" << err
                  << "): " << err_msg;
       cleanup_video_codec(state);
@@ -336,7 +649,7 @@ bool parse_and_write_video(storehouse::StorageBackend* storage,
                                      state.av_packet.data, state.av_packet.size,
                                      state.av_packet.flags & AV_PKT_FLAG_KEY);
     if (err < 0) {
-      int frame = index_creator.frames();
+      int frame = index_creator->frames();
       char err_msg[256];
       av_strerror(err, err_msg, 256);
       LOG(ERROR) << "Error while filtering " << frame << " (" << frame
@@ -347,74 +660,113 @@ bool parse_and_write_video(storehouse::StorageBackend* storage,
       return false;
     }
 
-    if (!index_creator.feed_packet(filtered_data, filtered_data_size)) {
-      error_message = index_creator.error_message();
+    u64 bytestream_pos = index_creator->bytestream_pos();
+    size_t num_keyframes = index_creator->keyframe_positions().size();
+    if (!index_creator->feed_packet(filtered_data, filtered_data_size)) {
+      error_message = index_creator->error_message();
       return false;
     }
+    // Packets the index creator dropped are not frames of the proxy either
+    if (proxy_writer && index_creator->bytestream_pos() != bytestream_pos) {
+      if (!proxy_writer->feed(filtered_data, filtered_data_size,
+                              error_message)) {
+        free(filtered_data);
+        cleanup_video_codec(state);
+        return false;
+      }
+    }
     free(filtered_data);
 
+    // Packets the index creator dropped are left out of the stream as well
+    if (inplace && index_creator->bytestream_pos() != bytestream_pos) {
+      if (state.av_packet.pos < 0) {
+        cleanup_video_codec(state);
+        error_message = "Packet has no position in the source file";
+        return false;
+      }
+      bool keyframe =
+          index_creator->keyframe_positions().size() > num_keyframes;
+      if (keyframe) {
+        source_keyframe_packets.push_back(source_packet_offsets.size());
+        inplace_keyframe_byte_offsets.push_back(inplace_stream_size);
+      }
+      source_packet_offsets.push_back(state.av_packet.pos);
+      source_packet_sizes.push_back(orig_size);
+      inplace_stream_size += sizeof(i32) + orig_size +
+                             (keyframe ? parameter_sets.size() : 0);
+    }
+
     av_packet_unref(&state.av_packet);
   }
 
   video_descriptor.set_time_base_num(state.in_cc->time_base.num);
   video_descriptor.set_time_base_denom(state.in_cc->time_base.den);
 
-  i64 frame = index_creator.frames();
-  i32 num_non_ref_frames = index_creator.num_non_ref_frames();
-  const std::vector<u8>& metadata_bytes = index_creator.metadata_bytes();
+  i64 frame = index_creator->frames();
+  i32 num_non_ref_frames = index_creator->num_non_ref_frames();
+  const std::vector<u8>& metadata_bytes = index_creator->metadata_bytes();
   const std::vector<i64>& keyframe_positions =
-      index_creator.keyframe_positions();
+      index_creator->keyframe_positions();
   const std::vector<i64>& keyframe_timestamps =
-      index_creator.keyframe_timestamps();
+      index_creator->keyframe_timestamps();
   const std::vector<i64>& keyframe_byte_offsets =
-      index_creator.keyframe_byte_offsets();
+      index_creator->keyframe_byte_offsets();
 
   VLOG(1) << "Num frames: " << frame;
   VLOG(1) << "Num non-reference frames: " << num_non_ref_frames;
   VLOG(1) << "% non-reference frames: " << num_non_ref_frames / (float)frame;
+  VLOG(1) << "Skippable non-reference frames: "
+          << index_creator->non_ref_frames().size();
   VLOG(1) << "Average GOP length: " << frame / (float)keyframe_positions.size();
 
   // Cleanup video decoder
   cleanup_video_codec(state);
 
-  // Save demuxed stream
-  BACKOFF_FAIL(demuxed_bytestream->save());
-
-  // Create index column
-  std::string index_path = table_item_output_path(table_id, 0, 0);
-  std::unique_ptr<WriteFile> index_file{};
-  BACKOFF_FAIL(make_unique_write_file(storage, index_path, index_file));
-
-  std::string index_metadata_path = table_item_metadata_path(table_id, 0, 0);
-  std::unique_ptr<WriteFile> index_metadata_file{};
-  BACKOFF_FAIL(make_unique_write_file(storage, index_metadata_path, index_metadata_file));
-  s_write<i64>(index_metadata_file.get(), frame);
-  for (i64 i = 0; i < frame; ++i) {
-    s_write(index_metadata_file.get(), sizeof(i64));
+  if (proxy_writer &&
+      !proxy_writer->finish(frame, video_descriptor.time_base_num(),
+                            video_descriptor.time_base_denom(),
+                            error_message)) {
+    return false;
   }
-  BACKOFF_FAIL(index_metadata_file->save());
-  for (i64 i = 0; i < frame; ++i) {
-    s_write(index_file.get(), i);
+
+  // Save demuxed stream
+  if (!inplace) {
+    BACKOFF_FAIL(demuxed_bytestream->save());
   }
-  BACKOFF_FAIL(index_file->save());
 
-  table_desc.add_end_rows(frame);
+  write_index_column(storage, table_id, item_id, start_row, frame);
+
+  table_desc.add_end_rows(start_row + frame);
   video_descriptor.set_frames(frame);
   video_descriptor.set_num_encoded_videos(1);
   video_descriptor.add_frames_per_video(frame);
   video_descriptor.add_keyframes_per_video(keyframe_positions.size());
-  video_descriptor.add_size_per_video(index_creator.bytestream_pos());
+  video_descriptor.add_size_per_video(
+      inplace ? inplace_stream_size : index_creator->bytestream_pos());
+  std::vector<i64> non_ref_frames = index_creator->non_ref_frames();
+  video_descriptor.add_non_ref_frames_per_video(non_ref_frames.size());
+  for (i64 v : non_ref_frames) {
+    video_descriptor.add_non_ref_frames(v);
+  }
   video_descriptor.set_metadata_packets(metadata_bytes.data(),
                                         metadata_bytes.size());
 
-  for (i64 v : keyframe_positions) {
-    video_descriptor.add_keyframe_positions(v);
-  }
-  for (i64 v : keyframe_timestamps) {
-    video_descriptor.add_keyframe_timestamps(v);
-  }
-  for (i64 v : keyframe_byte_offsets) {
-    video_descriptor.add_keyframe_byte_offsets(v);
+  KeyframeIndex::append(
+      video_descriptor, 0, 0, keyframe_positions, keyframe_timestamps,
+      inplace ? inplace_keyframe_byte_offsets : keyframe_byte_offsets);
+  if (inplace) {
+    video_descriptor.set_source_path(path);
+    for (i64 v : source_packet_offsets) {
+      video_descriptor.add_source_packet_offsets(v);
+    }
+    for (i64 v : source_packet_sizes) {
+      video_descriptor.add_source_packet_sizes(v);
+    }
+    for (i64 v : source_keyframe_packets) {
+      video_descriptor.add_source_keyframe_packets(v);
+    }
+    video_descriptor.set_source_parameter_sets(parameter_sets.data(),
+                                               parameter_sets.size());
   }
 
   // Save our metadata for the frame column
@@ -429,326 +781,451 @@ bool parse_and_write_video(storehouse::StorageBackend* storage,
   return succeeded;
 }
 
-// void ingest_images(storehouse::StorageBackend* storage,
-//                    const std::string& table_name,
-//                    std::vector<std::string>& image_paths) {
-//   i64 total_images{};
-
-//   i64 min_width{};
-//   i64 average_width{};
-//   i64 max_width{};
-
-//   i64 min_height{};
-//   i64 average_height{};
-//   i64 max_height{};
-
-//   descriptor.set_type(DatasetType_Image);
-
-//   DatasetDescriptor::ImageMetadata& metadata =
-//   *descriptor.mutable_image_data();
-//   std::vector<ImageFormatGroupDescriptor> format_descriptors;
-//   std::vector<std::unique_ptr<WriteFile>> output_files;
-//   std::vector<size_t> image_idx_to_format_group;
-//   std::vector<size_t> bad_image_indices;
-//   for (size_t i = 0; i < image_paths.size(); ++i) {
-//     const std::string& path = image_paths[i];
-
-//     VLOG(1) << "Ingesting image " << path << "..." << std::endl;
-
-//     // Figure out file type from extension
-//     ImageEncodingType image_type;
-//     {
-//       std::string base_name = basename_s(path);
-//       std::vector<std::string> parts;
-//       split(base_name, '.', parts);
-//       if (parts.size() != 2) {
-//         LOG(WARNING) << "File " << path << " does not have a valid name. File
-//         "
-//                      << "must only have a single '.' followed by an image "
-//                      << "extension. Ignoring this file.";
-//         bad_image_indices.push_back(i);
-//         image_idx_to_format_group.push_back(0);
-//         continue;
-//       }
-//       std::string extension = parts[1];
-//       if (!string_to_image_encoding_type(extension, image_type)) {
-//         LOG(WARNING)
-//             << "File " << path << " is not an image with a supported "
-//             << "type. Supported types are: jpeg, png. Ignoring this file";
-//         bad_image_indices.push_back(i);
-//         image_idx_to_format_group.push_back(0);
-//         continue;
-//       }
-//     }
-
-//     // Read image data into a buffer to inspect for color space, width,
-//     // and height
-//     std::vector<u8> image_bytes;
-//     {
-//       std::unique_ptr<RandomReadFile> in_file;
-//       BACKOFF_FAIL(make_unique_random_read_file(storage, path, in_file));
-//       u64 pos = 0;
-//       image_bytes = read_entire_file(in_file.get(), pos);
-//     }
-
-//     VLOG(1) << "path " << path;
-//     VLOG(1) << "image size " << image_bytes.size() / 1024;
-//     i32 image_width;
-//     i32 image_height;
-//     ImageColorSpace color_space;
-//     switch (image_type) {
-//     case ImageEncodingType::JPEG: {
-//       JPEGReader reader;
-//       reader.header_mem(image_bytes.data(), image_bytes.size());
-//       if (reader.warnings() != "") {
-//         LOG(WARNING) << "JPEG file " << path
-//                      << " header could not be parsed: " << reader.warnings()
-//                      << ". Ignoring.";
-//         bad_image_indices.push_back(i);
-//         image_idx_to_format_group.push_back(0);
-//         continue;
-//       }
-//       image_width = reader.width();
-//       image_height = reader.height();
-//       switch (reader.colorSpace()) {
-//       case JPEG::COLOR_GRAYSCALE:
-//         color_space = ImageColorSpace::Gray;
-//         break;
-//       case JPEG::COLOR_RGB:
-//       case JPEG::COLOR_YCC:
-//       case JPEG::COLOR_CMYK:
-//       case JPEG::COLOR_YCCK:
-//         color_space = ImageColorSpace::RGB;
-//         break;
-//       case JPEG::COLOR_UNKNOWN:
-//         LOG(WARNING) << "JPEG file " << path << " is of unsupported type: "
-//                      << "COLOR_UNKNOWN. Ignoring.";
-//         bad_image_indices.push_back(i);
-//         image_idx_to_format_group.push_back(0);
-//         continue;
-//         break;
-//       }
-//       break;
-//     }
-//     case ImageEncodingType::PNG: {
-//       unsigned w;
-//       unsigned h;
-//       LodePNGState png_state;
-//       lodepng_state_init(&png_state);
-//       unsigned error = lodepng_inspect(
-//         &w, &h, &png_state,
-//         reinterpret_cast<const unsigned char*>(image_bytes.data()),
-//         image_bytes.size());
-//       if (error) {
-//         LOG(WARNING) << "PNG file " << path << " header could not be parsed:
-//         "
-//                      << lodepng_error_text(error) << ". Ignoring";
-//         bad_image_indices.push_back(i);
-//         image_idx_to_format_group.push_back(0);
-//         continue;
-//       }
-//       image_width = w;
-//       image_height = h;
-//       switch (png_state.info_png.color.colortype) {
-//       case LCT_GREY:
-//         color_space = ImageColorSpace::Gray;
-//         break;
-//       case LCT_RGB:
-//         color_space = ImageColorSpace::RGB;
-//         break;
-//       case LCT_RGBA:
-//         color_space = ImageColorSpace::RGBA;
-//         break;
-//       case LCT_PALETTE:
-//         // NOTE(apoms): We force a paletted file to RGB
-//         color_space = ImageColorSpace::RGB;
-//         break;
-//         ;
-//       case LCT_GREY_ALPHA: {
-//         LOG(WARNING) << "PNG file " << path << " is of unsupported type: "
-//                      << "GREY_ALPHA. Ignoring.";
-//         bad_image_indices.push_back(i);
-//         image_idx_to_format_group.push_back(0);
-//         continue;
-//       }
-//       }
-
-//       lodepng_state_cleanup(&png_state);
-//       break;
-//     }
-//     case ImageEncodingType::BMP: {
-//       bitmap::BitmapMetadata metadata;
-//       bitmap::DecodeResult result =
-//         bitmap::bitmap_metadata(image_bytes.data(), image_bytes.size(),
-//         metadata);
-//       if (result != bitmap::DecodeResult::Success) {
-//         LOG(WARNING) << "BMP file " << path << " is invalid.";
-//         bad_image_indices.push_back(i);
-//         image_idx_to_format_group.push_back(0);
-//         continue;
-//       }
-//       image_width = metadata.width;
-//       image_height = metadata.height;
-//       color_space = metadata.color_space == bitmap::ImageColorSpace::RGB ?
-//         ImageColorSpace::RGB :
-//         ImageColorSpace::RGBA;
-//       break;
-//     }
-//     default:
-//       assert(false);
-//     }
-
-//     // Check if image is of the same type as an existing set of images. If
-//     so,
-//     // write to that file, otherwise create a new format group.
-//     i32 format_idx = -1;
-//     for (i32 i = 0; i < metadata.format_groups_size(); ++i) {
-//       DatasetDescriptor::ImageMetadata::FormatGroup& group =
-//           *metadata.mutable_format_groups(i);
-//       if (image_type == group.encoding_type() &&
-//           color_space == group.color_space() && image_width == group.width()
-//           &&
-//           image_height == group.height()) {
-//         format_idx = i;
-//         break;
-//       }
-//     }
-//     if (format_idx == -1) {
-//       // Create new format group
-//       format_descriptors.emplace_back();
-//       ImageFormatGroupDescriptor& desc = format_descriptors.back();
-//       DatasetDescriptor::ImageMetadata::FormatGroup& group =
-//           *metadata.add_format_groups();
-//       group.set_encoding_type(image_type);
-//       group.set_color_space(color_space);
-//       group.set_width(image_width);
-//       group.set_height(image_height);
-//       group.set_num_images(1);
-
-//       desc.set_encoding_type(image_type);
-//       desc.set_color_space(color_space);
-//       desc.set_width(image_width);
-//       desc.set_height(image_height);
-//       desc.set_num_images(1);
-
-//       format_idx = metadata.format_groups_size() - 1;
-//       desc.set_id(format_idx);
-//       // Create output file for writing to format group
-//       WriteFile* file;
-//       std::string item_path =
-//           dataset_item_data_path(dataset_name, std::to_string(format_idx));
-//       BACKOFF_FAIL(storage->make_write_file(item_path, file));
-//       output_files.emplace_back(file);
-//     } else {
-//       // Add to existing format group
-//       ImageFormatGroupDescriptor& desc = format_descriptors[format_idx];
-//       DatasetDescriptor::ImageMetadata::FormatGroup& group =
-//           *metadata.mutable_format_groups(format_idx);
-//       group.set_num_images(group.num_images() + 1);
-//       desc.set_num_images(desc.num_images() + 1);
-//     }
-//     image_idx_to_format_group.push_back(format_idx);
-
-//     // Write out compressed image data
-//     std::unique_ptr<WriteFile>& output_file = output_files[format_idx];
-//     i64 image_size = image_bytes.size();
-//     BACKOFF_FAIL(output_file->append(image_bytes));
-
-//     ImageFormatGroupDescriptor& desc = format_descriptors[format_idx];
-//     desc.add_compressed_sizes(image_size);
-
-//     total_images++;
-
-//     // We are summing into the average variables but we will divide
-//     // by the number of entries at the end
-//     min_width = std::min(min_width, (i64)image_width);
-//     average_width += image_width;
-//     max_width = std::max(max_width, (i64)image_width);
-
-//     min_height = std::min(min_height, (i64)image_height);
-//     average_height += image_height;
-//     max_height = std::max(max_height, (i64)image_height);
-
-//     VLOG(1) << "Finished ingesting image " << path << "." << std::endl;
-//   }
-
-//   // Write out all image paths which failed the ingest process
-//   if (!bad_image_indices.empty()) {
-//     LOG(WARNING) << "Writing the path of all ill formatted images which "
-//                  << "failed to ingest to " << BAD_VIDEOS_FILE_PATH << ".";
-
-//     std::fstream bad_paths_file(BAD_VIDEOS_FILE_PATH, std::fstream::out);
-//     for (size_t i : bad_image_indices) {
-//       const std::string& bad_path = image_paths[i];
-//       bad_paths_file << bad_path << std::endl;
-//     }
-//     bad_paths_file.close();
-//   }
-
-//   metadata.set_total_images(total_images);
-
-//   metadata.set_min_width(min_width);
-//   metadata.set_average_width(average_width);
-//   metadata.set_max_width(max_width);
-
-//   metadata.set_min_height(min_height);
-//   metadata.set_average_height(average_height);
-//   metadata.set_max_height(max_height);
-
-//   if (total_images > 0) {
-//     metadata.set_average_width(average_width / total_images);
-//     metadata.set_average_height(average_height / total_images);
-//   }
-
-//   VLOG(1)
-//     << "max width " << max_width
-//     << ",  max_height " << max_height;
-
-//   for (size_t i = 0; i < image_paths.size(); ++i) {
-//     const std::string& path = image_paths[i];
-//     metadata.add_original_image_paths(path);
-//   }
-
-//   // Remove bad paths
-//   size_t num_bad_images = bad_image_indices.size();
-//   for (size_t i = 0; i < num_bad_images; ++i) {
-//     size_t bad_index = bad_image_indices[num_bad_images - 1 - i];
-//     image_paths.erase(image_paths.begin() + bad_index);
-//   }
-
-//   LOG_IF(FATAL, total_images == 0)
-//       << "Dataset would be created with zero images! Exiting.";
-
-//   for (size_t i = 0; i < image_paths.size(); ++i) {
-//     const std::string& path = image_paths[i];
-//     metadata.add_valid_image_paths(path);
-//   }
-
-//   for (size_t i = 0; i < format_descriptors.size(); ++i) {
-//     // Flush image binary files
-//     std::unique_ptr<WriteFile>& file = output_files[i];
-//     BACKOFF_FAIL(file->save());
-
-//     // Write out format descriptors for each group
-//     ImageFormatGroupDescriptor& desc = format_descriptors[i];
-//     std::string metadata_path =
-//         dataset_item_metadata_path(dataset_name, std::to_string(i));
-//     std::unique_ptr<WriteFile> metadata_file;
-//     BACKOFF_FAIL(make_unique_write_file(storage, metadata_path,
-//     metadata_file));
-
-//     ImageFormatGroupMetadata m{desc};
-//     serialize_image_format_group_metadata(metadata_file.get(), m);
-//     BACKOFF_FAIL(metadata_file->save());
-//   }
-// }
+// Annex B packets of a short encoded video that synthetic videos repeat
+struct TemplateVideo {
+  i32 width;
+  i32 height;
+  proto::VideoDescriptor::VideoCodecType codec_type;
+  i32 time_base_num;
+  i32 time_base_denom;
+  std::vector<std::vector<u8>> packets;
+};
+
+// Demuxes the video stream at path into annex B packets, as
+// parse_and_write_video would before indexing them
+bool read_template_video(storehouse::StorageBackend* storage,
+                         const std::string& path, TemplateVideo& video,
+                         std::string& error_message) {
+  FFStorehouseState file_state{};
+  StoreResult result;
+  EXP_BACKOFF(make_unique_random_read_file(storage, path, file_state.file),
+              result);
+  if (result != StoreResult::Success) {
+    error_message = "Can not open template video " + path;
+    return false;
+  }
+  EXP_BACKOFF(file_state.file->get_size(file_state.size), result);
+  if (result != StoreResult::Success || file_state.size <= 0) {
+    error_message = "Can not read template video " + path;
+    return false;
+  }
+  file_state.pos = 0;
+
+  CodecState state;
+  if (!setup_video_codec(&file_state, state)) {
+    error_message = "Failed to set up video codec";
+    return false;
+  }
+  video.width = state.in_cc->width;
+  video.height = state.in_cc->height;
+  video.codec_type = state.codec_type;
+  video.time_base_num = state.in_cc->time_base.num;
+  video.time_base_denom = state.in_cc->time_base.den;
+
+  while (true) {
+    i32 err = av_read_frame(state.format_context, &state.av_packet);
+    if (err == AVERROR_EOF) {
+      av_packet_unref(&state.av_packet);
+      break;
+    } else if (err != 0) {
+      char err_msg[256];
+      av_strerror(err, err_msg, 256);
+      cleanup_video_codec(state);
+      error_message = "Error while reading template video: " +
+                      std::string(err_msg);
+      return false;
+    }
+    if (state.av_packet.stream_index != state.video_stream_index) {
+      av_packet_unref(&state.av_packet);
+      continue;
+    }
+    u8* filtered_data;
+    i32 filtered_data_size;
+    err = av_bitstream_filter_filter(state.annexb, state.in_cc, NULL,
+                                     &filtered_data, &filtered_data_size,
+                                     state.av_packet.data, state.av_packet.size,
+                                     state.av_packet.flags & AV_PKT_FLAG_KEY);
+    av_packet_unref(&state.av_packet);
+    if (err < 0) {
+      char err_msg[256];
+      av_strerror(err, err_msg, 256);
+      cleanup_video_codec(state);
+      error_message = "Error while filtering template video: " +
+                      std::string(err_msg);
+      return false;
+    }
+    video.packets.emplace_back(filtered_data,
+                               filtered_data + filtered_data_size);
+    free(filtered_data);
+  }
+  cleanup_video_codec(state);
+  if (video.packets.empty()) {
+    error_message = "Template video " + path + " has no video packets";
+    return false;
+  }
+  return true;
+}
+
+// Writes a video of the given number of frames as the first item of the
+// table by repeating the template's packets from its first keyframe. The
+// repeated stream goes through the index creator like an ingested one, so
+// the table is indistinguishable from one ingested from a long video while
+// only the template was ever encoded.
+bool write_synthetic_video(storehouse::StorageBackend* storage,
+                           proto::TableDescriptor& table_desc,
+                           const TemplateVideo& video, i64 frames,
+                           std::string& error_message) {
+  i32 table_id = table_desc.id();
+  table_desc.set_timestamp(
+      std::chrono::duration_cast<std::chrono::seconds>(now().time_since_epoch())
+          .count());
+
+  std::unique_ptr<WriteFile> demuxed_bytestream{};
+  BACKOFF_FAIL(make_unique_write_file(
+      storage, table_item_output_path(table_id, 1, 0), demuxed_bytestream));
+  std::unique_ptr<ByteStreamIndexCreator> index_creator;
+  if (video.codec_type == proto::VideoDescriptor::HEVC) {
+    index_creator.reset(
+        new HEVCByteStreamIndexCreator(demuxed_bytestream.get()));
+  } else {
+    index_creator.reset(
+        new H264ByteStreamIndexCreator(demuxed_bytestream.get()));
+  }
+  while (index_creator->frames() < frames) {
+    i64 pass_start = index_creator->frames();
+    for (const std::vector<u8>& packet : video.packets) {
+      if (index_creator->frames() >= frames) {
+        break;
+      }
+      // The index creator only reads the packet, which all threads share
+      if (!index_creator->feed_packet(const_cast<u8*>(packet.data()),
+                                      packet.size())) {
+        error_message = index_creator->error_message();
+        return false;
+      }
+    }
+    if (index_creator->frames() == pass_start) {
+      error_message = "Template video has no frames to repeat";
+      return false;
+    }
+  }
+  BACKOFF_FAIL(demuxed_bytestream->save());
+
+  i64 frame = index_creator->frames();
+  write_index_column(storage, table_id, 0, 0, frame);
+  table_desc.add_end_rows(frame);
+
+  VideoMetadata video_meta;
+  proto::VideoDescriptor& video_descriptor = video_meta.get_descriptor();
+  video_descriptor.set_table_id(table_id);
+  video_descriptor.set_column_id(1);
+  video_descriptor.set_item_id(0);
+  video_descriptor.set_width(video.width);
+  video_descriptor.set_height(video.height);
+  video_descriptor.set_channels(3);
+  video_descriptor.set_frame_type(FrameType::U8);
+  video_descriptor.set_chroma_format(proto::VideoDescriptor::YUV_420);
+  video_descriptor.set_codec_type(video.codec_type);
+  video_descriptor.set_time_base_num(video.time_base_num);
+  video_descriptor.set_time_base_denom(video.time_base_denom);
+  video_descriptor.set_frames(frame);
+  video_descriptor.set_num_encoded_videos(1);
+  video_descriptor.add_frames_per_video(frame);
+  video_descriptor.add_keyframes_per_video(
+      index_creator->keyframe_positions().size());
+  video_descriptor.add_size_per_video(index_creator->bytestream_pos());
+  std::vector<i64> non_ref_frames = index_creator->non_ref_frames();
+  video_descriptor.add_non_ref_frames_per_video(non_ref_frames.size());
+  for (i64 v : non_ref_frames) {
+    video_descriptor.add_non_ref_frames(v);
+  }
+  const std::vector<u8>& metadata_bytes = index_creator->metadata_bytes();
+  video_descriptor.set_metadata_packets(metadata_bytes.data(),
+                                        metadata_bytes.size());
+  KeyframeIndex::append(video_descriptor, 0, 0,
+                        index_creator->keyframe_positions(),
+                        index_creator->keyframe_timestamps(),
+                        index_creator->keyframe_byte_offsets());
+
+  write_video_metadata(storage, video_meta);
+  write_table_metadata(storage, TableMetadata(table_desc));
+  return true;
+}
+
+// Width, height and color space read from the header, without decoding
+struct ImageFormat {
+  ImageEncodingType encoding_type;
+  ImageColorSpace color_space;
+  i32 width;
+  i32 height;
+
+  bool operator<(const ImageFormat& o) const {
+    return std::tie(encoding_type, color_space, width, height) <
+           std::tie(o.encoding_type, o.color_space, o.width, o.height);
+  }
+};
+
+inline i32 read_be16(const u8* p) { return (p[0] << 8) | p[1]; }
+
+inline i32 read_be32(const u8* p) {
+  return (p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+bool parse_jpeg_header(const std::vector<u8>& bytes, ImageFormat& format,
+                       std::string& error_message) {
+  size_t pos = 2;
+  while (pos + 4 <= bytes.size()) {
+    if (bytes[pos] != 0xFF) {
+      error_message = "Malformed JPEG marker";
+      return false;
+    }
+    u8 marker = bytes[pos + 1];
+    if (marker == 0xFF) {
+      // Fill byte
+      pos++;
+      continue;
+    }
+    i32 length = read_be16(&bytes[pos + 2]);
+    // Start of frame markers, excluding DHT, JPG and DAC
+    if (marker >= 0xC0 && marker <= 0xCF && marker != 0xC4 &&
+        marker != 0xC8 && marker != 0xCC) {
+      if (pos + 10 > bytes.size()) {
+        break;
+      }
+      format.encoding_type = ImageEncodingType::JPEG;
+      format.height = read_be16(&bytes[pos + 5]);
+      format.width = read_be16(&bytes[pos + 7]);
+      i32 components = bytes[pos + 9];
+      if (components == 1) {
+        format.color_space = ImageColorSpace::Gray;
+      } else if (components == 3 || components == 4) {
+        // YCbCr, CMYK and YCCK are all decoded to RGB
+        format.color_space = ImageColorSpace::RGB;
+      } else {
+        error_message = "Unsupported JPEG component count " +
+                        std::to_string(components);
+        return false;
+      }
+      return true;
+    }
+    if (marker == 0xDA || marker == 0xD9) {
+      break;
+    }
+    pos += 2 + length;
+  }
+  error_message = "JPEG has no frame header";
+  return false;
+}
+
+bool parse_png_header(const std::vector<u8>& bytes, ImageFormat& format,
+                      std::string& error_message) {
+  // Signature followed by the IHDR chunk, which must come first
+  if (bytes.size() < 29 || std::memcmp(&bytes[12], "IHDR", 4) != 0) {
+    error_message = "PNG has no IHDR chunk";
+    return false;
+  }
+  format.encoding_type = ImageEncodingType::PNG;
+  format.width = read_be32(&bytes[16]);
+  format.height = read_be32(&bytes[20]);
+  switch (bytes[25]) {
+    case 0:
+      format.color_space = ImageColorSpace::Gray;
+      break;
+    case 2:
+    case 3:
+      // Paletted images are decoded to RGB
+      format.color_space = ImageColorSpace::RGB;
+      break;
+    case 6:
+      format.color_space = ImageColorSpace::RGBA;
+      break;
+    default:
+      error_message = "Unsupported PNG color type " +
+                      std::to_string((i32)bytes[25]);
+      return false;
+  }
+  return true;
+}
+
+bool parse_image_header(const std::vector<u8>& bytes, ImageFormat& format,
+                        std::string& error_message) {
+  static const u8 png_signature[] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A,
+                                     '\n'};
+  if (bytes.size() >= 2 && bytes[0] == 0xFF && bytes[1] == 0xD8) {
+    return parse_jpeg_header(bytes, format, error_message);
+  } else if (bytes.size() >= 8 &&
+             std::memcmp(bytes.data(), png_signature, 8) == 0) {
+    return parse_png_header(bytes, format, error_message);
+  }
+  error_message = "Image is not a JPEG or PNG file";
+  return false;
+}
+
+// An item of an image table being written: the images of one batch that
+// share a format
+struct ImageGroupWriter {
+  i32 item_id;
+  ImageFormatGroupMetadata meta;
+  std::unique_ptr<WriteFile> data_file;
+  std::vector<i64> image_indices;
+};
+
+// Reads the images of paths[start, end) and writes each format among them
+// as a new item of the table. Items are numbered from next_item_id, and
+// rows_per_item receives the size of each.
+void ingest_image_batch(storehouse::StorageBackend* storage, i32 table_id,
+                        const std::vector<std::string>& paths, i64 start,
+                        i64 end, std::atomic<i32>& next_item_id,
+                        std::mutex& items_mutex,
+                        std::map<i32, i64>& rows_per_item,
+                        std::vector<u8>& failed,
+                        std::vector<std::string>& messages) {
+  std::map<ImageFormat, ImageGroupWriter> groups;
+  for (i64 i = start; i < end; ++i) {
+    std::unique_ptr<RandomReadFile> file;
+    StoreResult result;
+    EXP_BACKOFF(make_unique_random_read_file(storage, paths[i], file), result);
+    if (result != StoreResult::Success) {
+      failed[i] = true;
+      messages[i] = "Can not open image file";
+      continue;
+    }
+    u64 pos = 0;
+    std::vector<u8> bytes = storehouse::read_entire_file(file.get(), pos);
+    ImageFormat format;
+    if (!parse_image_header(bytes, format, messages[i])) {
+      failed[i] = true;
+      continue;
+    }
+
+    auto it = groups.find(format);
+    if (it == groups.end()) {
+      ImageGroupWriter& group = groups[format];
+      group.item_id = next_item_id++;
+      proto::ImageFormatGroupDescriptor& desc = group.meta.get_descriptor();
+      desc.set_id(group.item_id);
+      desc.set_table_id(table_id);
+      desc.set_column_id(1);
+      desc.set_encoding_type(format.encoding_type);
+      desc.set_color_space(format.color_space);
+      desc.set_width(format.width);
+      desc.set_height(format.height);
+      BACKOFF_FAIL(make_unique_write_file(
+          storage, table_item_output_path(table_id, 1, group.item_id),
+          group.data_file));
+      it = groups.find(format);
+    }
+    ImageGroupWriter& group = it->second;
+    s_write(group.data_file.get(), bytes.data(), bytes.size());
+    group.meta.get_descriptor().add_compressed_sizes(bytes.size());
+    group.image_indices.push_back(i);
+  }
+
+  for (auto& kv : groups) {
+    ImageGroupWriter& group = kv.second;
+    i32 item_id = group.item_id;
+    i64 num_images = group.image_indices.size();
+    proto::ImageFormatGroupDescriptor& desc = group.meta.get_descriptor();
+    desc.set_num_images(num_images);
+    BACKOFF_FAIL(group.data_file->save());
+
+    std::unique_ptr<WriteFile> metadata_file;
+    BACKOFF_FAIL(make_unique_write_file(
+        storage, table_item_metadata_path(table_id, 1, item_id),
+        metadata_file));
+    s_write<i64>(metadata_file.get(), num_images);
+    for (i64 size : desc.compressed_sizes()) {
+      s_write<i64>(metadata_file.get(), size);
+    }
+    BACKOFF_FAIL(metadata_file->save());
+
+    // The index column holds the position of each image in the ingested
+    // paths, since the rows of a table are ordered by format
+    std::unique_ptr<WriteFile> index_file;
+    BACKOFF_FAIL(make_unique_write_file(
+        storage, table_item_output_path(table_id, 0, item_id), index_file));
+    std::unique_ptr<WriteFile> index_metadata_file;
+    BACKOFF_FAIL(make_unique_write_file(
+        storage, table_item_metadata_path(table_id, 0, item_id),
+        index_metadata_file));
+    s_write<i64>(index_metadata_file.get(), num_images);
+    for (i64 image_index : group.image_indices) {
+      s_write(index_file.get(), image_index);
+      s_write(index_metadata_file.get(), sizeof(i64));
+    }
+    BACKOFF_FAIL(index_file->save());
+    BACKOFF_FAIL(index_metadata_file->save());
+
+    write_image_metadata(storage, group.meta);
+
+    std::unique_lock<std::mutex> lock(items_mutex);
+    rows_per_item[item_id] = num_images;
+  }
+}
+
 }  // end anonymous namespace
 
+void ingest_video_set(storehouse::StorageBackend* storage,
+                      const std::vector<std::string>& table_names,
+                      const std::vector<i32>& table_ids,
+                      const std::vector<std::string>& paths, bool inplace,
+                      i32 proxy_height, i32 num_threads,
+                      std::vector<bool>& bad_videos,
+                      std::vector<std::string>& bad_messages) {
+  i64 num_videos = table_names.size();
+  // Bytes rather than vector<bool> bits so threads can set them concurrently
+  std::vector<u8> failed(num_videos, false);
+  bad_messages.assign(num_videos, "");
+
+  // Threads pull videos one at a time so a few long videos do not leave the
+  // other threads idle behind a static split
+  std::atomic<i64> next_video{0};
+  std::atomic<i64> videos_done{0};
+  auto ingest_start = now();
+  std::vector<std::thread> ingest_threads;
+  num_threads = std::max(1, (i32)std::min((i64)num_threads, num_videos));
+  for (i32 t = 0; t < num_threads; ++t) {
+    ingest_threads.emplace_back([&]() {
+      for (i64 i = next_video++; i < num_videos; i = next_video++) {
+        auto video_start = now();
+        bool success = false;
+        try {
+          proto::TableDescriptor table_desc = video_table_descriptor(
+              table_names[i], table_ids[i], proxy_height > 0);
+          success = internal::parse_and_write_video(
+              storage, table_desc, paths[i], inplace, proxy_height,
+              bad_messages[i]);
+        } catch (const std::exception& e) {
+          bad_messages[i] = e.what();
+        }
+        if (!success) {
+          // Did not ingest correctly, skip it
+          failed[i] = true;
+        }
+        VLOG(1) << "Ingested " << paths[i] << " in "
+                << nano_since(video_start) / 1e9 << "s"
+                << (success ? "" : " (failed)");
+        i64 done = ++videos_done;
+        if (done % INGEST_PROGRESS_INTERVAL == 0 || done == num_videos) {
+          LOG(INFO) << "Ingested " << done << "/" << num_videos
+                    << " videos in " << nano_since(ingest_start) / 1e9 << "s";
+        }
+      }
+    });
+  }
+  for (std::thread& t : ingest_threads) {
+    t.join();
+  }
+  bad_videos.assign(failed.begin(), failed.end());
+}
+
 Result ingest_videos(storehouse::StorageConfig* storage_config,
                      const std::string& db_path,
                      const std::vector<std::string>& table_names,
                      const std::vector<std::string>& paths,
-                     std::vector<FailedVideo>& failed_videos) {
+                     bool inplace, i32 proxy_height,
+                     std::vector<FailedVideo>& failed_videos,
+                     const VideoSetIngester& ingester) {
   Result result;
   result.set_success(true);
 
@@ -780,31 +1257,14 @@ Result ingest_videos(storehouse::StorageConfig* storage_config,
   if (!result.success()) {
     return result;
   }
-  std::vector<bool> bad_videos(table_names.size(), false);
-  std::vector<std::string> bad_messages(table_names.size());
-  std::vector<std::thread> ingest_threads;
-  i32 num_threads = std::thread::hardware_concurrency();
-  i32 videos_allocated = 0;
-  for (i32 t = 0; t < num_threads; ++t) {
-    i32 to_allocate =
-        (table_names.size() - videos_allocated) / (num_threads - t);
-    i32 start = videos_allocated;
-    videos_allocated += to_allocate;
-    videos_allocated = std::min((size_t)videos_allocated, table_names.size());
-    i32 end = videos_allocated;
-    ingest_threads.emplace_back([&, start, end]() {
-      for (i32 i = start; i < end; ++i) {
-        if (!internal::parse_and_write_video(storage.get(), table_names[i],
-                                             table_ids[i], paths[i],
-                                             bad_messages[i])) {
-          // Did not ingest correctly, skip it
-          bad_videos[i] = true;
-        }
-      }
-    });
-  }
-  for (i32 t = 0; t < num_threads; ++t) {
-    ingest_threads[t].join();
+  std::vector<bool> bad_videos;
+  std::vector<std::string> bad_messages;
+  if (ingester) {
+    ingester(table_names, table_ids, paths, bad_videos, bad_messages);
+  } else {
+    ingest_video_set(storage.get(), table_names, table_ids, paths, inplace,
+                     proxy_height, std::thread::hardware_concurrency(),
+                     bad_videos, bad_messages);
   }
 
   size_t num_bad_videos = 0;
@@ -827,17 +1287,278 @@ Result ingest_videos(storehouse::StorageConfig* storage_config,
   return result;
 }
 
-void ingest_images(storehouse::StorageConfig* storage_config,
-                   const std::string& db_path, const std::string& table_name,
-                   const std::vector<std::string>& paths) {
+Result append_videos(storehouse::StorageConfig* storage_config,
+                     const std::string& db_path,
+                     const std::vector<std::string>& table_names,
+                     const std::vector<std::string>& paths, bool inplace,
+                     std::vector<FailedVideo>& failed_videos) {
+  Result result;
+  result.set_success(true);
+
+  internal::set_database_path(db_path);
+  av_register_all();
+
+  std::unique_ptr<storehouse::StorageBackend> storage{
+      storehouse::StorageBackend::make_from_config(storage_config)};
+
+  internal::DatabaseMetadata meta = internal::read_database_metadata(
+      storage.get(), internal::DatabaseMetadata::descriptor_path());
+  // Segments of a table are appended one after another in the order given,
+  // while different tables are appended concurrently
+  std::vector<std::string> tables;
+  std::map<std::string, std::vector<size_t>> segments;
+  for (size_t i = 0; i < table_names.size(); ++i) {
+    if (!meta.has_table(table_names[i])) {
+      RESULT_ERROR(&result, "Table %s does not exist to append to.",
+                   table_names[i].c_str());
+      return result;
+    }
+    if (segments.count(table_names[i]) == 0) {
+      tables.push_back(table_names[i]);
+    }
+    segments[table_names[i]].push_back(i);
+  }
+
+  std::vector<u8> failed(table_names.size(), false);
+  std::vector<std::string> messages(table_names.size());
+  std::atomic<i64> next_table{0};
+  i64 num_tables = tables.size();
+  std::vector<std::thread> threads;
+  i32 num_threads = std::max(
+      1, (i32)std::min((i64)std::thread::hardware_concurrency(), num_tables));
+  for (i32 t = 0; t < num_threads; ++t) {
+    threads.emplace_back([&]() {
+      for (i64 ti = next_table++; ti < num_tables; ti = next_table++) {
+        const std::string& table_name = tables[ti];
+        i32 table_id = meta.get_table_id(table_name);
+        TableMetadata table_meta = read_table_metadata(
+            storage.get(), TableMetadata::descriptor_path(table_id));
+        proto::TableDescriptor table_desc = table_meta.get_descriptor();
+        if (table_desc.job_id() != -1) {
+          for (size_t i : segments.at(table_name)) {
+            failed[i] = true;
+            messages[i] = "Table " + table_name +
+                          " was not ingested and can not be appended to";
+          }
+          continue;
+        }
+        // Segments get proxies at the height of the table's existing ones
+        i32 proxy_height = 0;
+        for (const Column& col : table_desc.columns()) {
+          if (col.name() == proxy_column_name()) {
+            proxy_height = read_video_metadata(
+                storage.get(),
+                VideoMetadata::descriptor_path(table_id, col.id(), 0))
+                .height();
+          }
+        }
+        for (size_t i : segments.at(table_name)) {
+          // Work on a copy so a failed segment does not leave a partial item
+          // in the descriptor used for the next one
+          proto::TableDescriptor extended = table_desc;
+          bool success = false;
+          try {
+            success = internal::parse_and_write_video(
+                storage.get(), extended, paths[i], inplace, proxy_height,
+                messages[i]);
+          } catch (const std::exception& e) {
+            messages[i] = e.what();
+          }
+          if (success) {
+            table_desc = extended;
+            VLOG(1) << "Appended " << paths[i] << " to " << table_name;
+          } else {
+            failed[i] = true;
+          }
+        }
+      }
+    });
+  }
+  for (std::thread& t : threads) {
+    t.join();
+  }
+
+  size_t num_failed = 0;
+  for (size_t i = 0; i < table_names.size(); ++i) {
+    if (failed[i]) {
+      num_failed++;
+      LOG(WARNING) << "Failed to append video " << paths[i] << "!";
+      failed_videos.push_back({paths[i], messages[i]});
+    }
+  }
+  if (num_failed == table_names.size()) {
+    RESULT_ERROR(&result, "All videos failed to append properly");
+  }
+  return result;
+}
+
+Result ingest_synthetic_videos(storehouse::StorageConfig* storage_config,
+                               const std::string& db_path,
+                               const std::vector<std::string>& table_names,
+                               const std::string& template_path,
+                               i64 frames_per_video) {
+  Result result;
+  result.set_success(true);
+
   internal::set_database_path(db_path);
+  av_register_all();
 
   std::unique_ptr<storehouse::StorageBackend> storage{
       storehouse::StorageBackend::make_from_config(storage_config)};
 
-  LOG(FATAL) << "Image ingest under construction!" << std::endl;
+  TemplateVideo video;
+  std::string error_message;
+  if (!read_template_video(storage.get(), template_path, video,
+                           error_message)) {
+    RESULT_ERROR(&result, "%s", error_message.c_str());
+    return result;
+  }
 
-  VLOG(1) << "Creating image table " << table_name << "..." << std::endl;
+  internal::DatabaseMetadata meta = internal::read_database_metadata(
+      storage.get(), internal::DatabaseMetadata::descriptor_path());
+  std::vector<i32> table_ids;
+  for (const std::string& table_name : table_names) {
+    i32 table_id = meta.add_table(table_name);
+    if (table_id == -1) {
+      RESULT_ERROR(&result, "Table name %s already exists in database.",
+                   table_name.c_str());
+      return result;
+    }
+    table_ids.push_back(table_id);
+  }
+
+  i64 num_tables = table_names.size();
+  std::vector<std::string> messages(num_tables);
+  std::atomic<i64> next_table{0};
+  std::vector<std::thread> threads;
+  i32 num_threads = std::max(
+      1, (i32)std::min((i64)std::thread::hardware_concurrency(), num_tables));
+  for (i32 t = 0; t < num_threads; ++t) {
+    threads.emplace_back([&]() {
+      for (i64 i = next_table++; i < num_tables; i = next_table++) {
+        proto::TableDescriptor table_desc =
+            video_table_descriptor(table_names[i], table_ids[i], false);
+        if (!write_synthetic_video(storage.get(), table_desc, video,
+                                   frames_per_video, messages[i])) {
+          LOG(WARNING) << "Failed to write synthetic video " << table_names[i]
+                       << ": " << messages[i];
+        }
+      }
+    });
+  }
+  for (std::thread& t : threads) {
+    t.join();
+  }
+  for (i64 i = 0; i < num_tables; ++i) {
+    if (!messages[i].empty()) {
+      // Tables are only added to the database once all are written
+      RESULT_ERROR(&result, "%s", messages[i].c_str());
+      return result;
+    }
+  }
+  internal::write_database_metadata(storage.get(), meta);
+  return result;
+}
+
+Result ingest_images(storehouse::StorageConfig* storage_config,
+                     const std::string& db_path, const std::string& table_name,
+                     const std::vector<std::string>& paths,
+                     std::vector<FailedVideo>& failed_images) {
+  Result result;
+  result.set_success(true);
+
+  internal::set_database_path(db_path);
+
+  std::unique_ptr<storehouse::StorageBackend> storage{
+      storehouse::StorageBackend::make_from_config(storage_config)};
+
+  internal::DatabaseMetadata meta = internal::read_database_metadata(
+      storage.get(), internal::DatabaseMetadata::descriptor_path());
+  i32 table_id = meta.add_table(table_name);
+  if (table_id == -1) {
+    RESULT_ERROR(&result, "Table name %s already exists in databse.",
+                 table_name.c_str());
+    return result;
+  }
+  VLOG(1) << "Creating image table " << table_name << "...";
+
+  // Threads pull batches of images, so the number of items grows with the
+  // number of batches and formats rather than with the number of images
+  i64 num_images = paths.size();
+  i64 num_batches =
+      (num_images + IMAGES_PER_INGEST_BATCH - 1) / IMAGES_PER_INGEST_BATCH;
+  std::vector<u8> failed(num_images, false);
+  std::vector<std::string> messages(num_images);
+  std::atomic<i32> next_item_id{0};
+  std::mutex items_mutex;
+  std::map<i32, i64> rows_per_item;
+  std::atomic<i64> next_batch{0};
+  auto ingest_start = now();
+  std::vector<std::thread> threads;
+  i32 num_threads = std::max(
+      1, (i32)std::min((i64)std::thread::hardware_concurrency(), num_batches));
+  for (i32 t = 0; t < num_threads; ++t) {
+    threads.emplace_back([&]() {
+      for (i64 b = next_batch++; b < num_batches; b = next_batch++) {
+        i64 start = b * IMAGES_PER_INGEST_BATCH;
+        i64 end = std::min(start + IMAGES_PER_INGEST_BATCH, num_images);
+        ingest_image_batch(storage.get(), table_id, paths, start, end,
+                           next_item_id, items_mutex, rows_per_item, failed,
+                           messages);
+        VLOG(1) << "Ingested images " << start << "-" << end << " in "
+                << nano_since(ingest_start) / 1e9 << "s";
+      }
+    });
+  }
+  for (std::thread& t : threads) {
+    t.join();
+  }
+
+  size_t num_failed = 0;
+  for (i64 i = 0; i < num_images; ++i) {
+    if (failed[i]) {
+      num_failed++;
+      LOG(WARNING) << "Failed to ingest image " << paths[i] << "!";
+      failed_images.push_back({paths[i], messages[i]});
+    }
+  }
+  if (num_failed == paths.size()) {
+    RESULT_ERROR(&result, "All images failed to ingest properly");
+    return result;
+  }
+
+  proto::TableDescriptor table_desc;
+  table_desc.set_id(table_id);
+  table_desc.set_name(table_name);
+  table_desc.set_job_id(-1);
+  table_desc.set_timestamp(
+      std::chrono::duration_cast<std::chrono::seconds>(now().time_since_epoch())
+          .count());
+
+  Column* index_col = table_desc.add_columns();
+  index_col->set_name(index_column_name());
+  index_col->set_id(0);
+  index_col->set_type(ColumnType::Other);
+
+  // Stored as plain byte rows so any op taking an encoded image, like
+  // ImageDecoder, can read the column
+  Column* image_col = table_desc.add_columns();
+  image_col->set_name(image_column_name());
+  image_col->set_id(1);
+  image_col->set_type(ColumnType::Other);
+
+  i64 total_rows = 0;
+  for (auto& kv : rows_per_item) {
+    total_rows += kv.second;
+    table_desc.add_end_rows(total_rows);
+  }
+  write_table_metadata(storage.get(), TableMetadata(table_desc));
+  internal::write_database_metadata(storage.get(), meta);
+
+  LOG(INFO) << "Ingested " << total_rows << " images into "
+            << rows_per_item.size() << " format groups in "
+            << nano_since(ingest_start) / 1e9 << "s";
+  return result;
 }
 }
 }
@@ -21,19 +21,72 @@
 #include "storehouse/storage_backend.h"
 #include "storehouse/storage_config.h"
 
+#include <functional>
 #include <string>
 
 namespace scanner {
 namespace internal {
 
+//! Writes the tables of videos whose table ids are already allocated. Each
+//! of num_threads threads takes the next video as soon as it is free. A video
+//! that fails, including by throwing, is marked in bad_videos with its reason
+//! in bad_messages and does not affect the others. With inplace, mp4
+//! videos are only indexed and their bitstreams are read from the source
+//! files later instead of being copied into the database. A proxy_height
+//! above zero also writes each video re-encoded at that height as the
+//! proxy column, which loads decoding to no more than its size read instead.
+void ingest_video_set(storehouse::StorageBackend* storage,
+                      const std::vector<std::string>& table_names,
+                      const std::vector<i32>& table_ids,
+                      const std::vector<std::string>& paths, bool inplace,
+                      i32 proxy_height, i32 num_threads,
+                      std::vector<bool>& bad_videos,
+                      std::vector<std::string>& bad_messages);
+
+//! Ingests a set of videos with allocated table ids, filling in bad_videos
+//! and bad_messages like ingest_video_set
+using VideoSetIngester = std::function<void(
+    const std::vector<std::string>& table_names,
+    const std::vector<i32>& table_ids, const std::vector<std::string>& paths,
+    std::vector<bool>& bad_videos, std::vector<std::string>& bad_messages)>;
+
+//! Adds a table per video to the database. The videos are parsed by ingester
+//! when given, or by ingest_video_set on every core of this machine.
 Result ingest_videos(storehouse::StorageConfig* storage_config,
                      const std::string& db_path,
                      const std::vector<std::string>& table_names,
-                     const std::vector<std::string>& paths,
+                     const std::vector<std::string>& paths, bool inplace,
+                     i32 proxy_height, std::vector<FailedVideo>& failed_videos,
+                     const VideoSetIngester& ingester = nullptr);
+
+//! Appends each video as the next item of the existing ingested table of
+//! the same index, extending it with the video's frames so that jobs can
+//! sample just the new rows. Videos for one table are appended in order,
+//! with proxies if the table was ingested with them.
+Result append_videos(storehouse::StorageConfig* storage_config,
+                     const std::string& db_path,
+                     const std::vector<std::string>& table_names,
+                     const std::vector<std::string>& paths, bool inplace,
                      std::vector<FailedVideo>& failed_videos);
 
-// void ingest_images(storehouse::StorageConfig *storage_config,
-//                    const std::string &db_path, const std::string &table_name,
-//                    const std::vector<std::string> &paths);
+//! Adds a table per name holding a synthetic video of frames_per_video
+//! frames, made by repeating the packets of the short video at
+//! template_path. Nothing is encoded, so tables of any length and number
+//! can be made quickly to stress the scheduler, metadata and loaders.
+Result ingest_synthetic_videos(storehouse::StorageConfig* storage_config,
+                               const std::string& db_path,
+                               const std::vector<std::string>& table_names,
+                               const std::string& template_path,
+                               i64 frames_per_video);
+
+//! Creates a table of the JPEG and PNG images at paths. Threads ingest
+//! batches of images, writing the images of a batch that share an encoding,
+//! color space and resolution as one item described by an
+//! ImageFormatGroupDescriptor. Rows are therefore grouped by format, and the
+//! index column holds the position in paths of each row's image.
+Result ingest_images(storehouse::StorageConfig* storage_config,
+                     const std::string& db_path, const std::string& table_name,
+                     const std::vector<std::string>& paths,
+                     std::vector<FailedVideo>& failed_images);
 }
 }
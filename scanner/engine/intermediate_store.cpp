@@ -0,0 +1,243 @@
+/* Copyright 2017 Carnegie Mellon University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "scanner/engine/intermediate_store.h"
+#include "scanner/util/fs.h"
+
+#include <glog/logging.h>
+#include <grpc++/grpc++.h>
+
+#include <cstdio>
+#include <cstring>
+
+namespace scanner {
+namespace internal {
+
+namespace {
+
+// Collects the appends to a file and hands them to the store on save
+class IntermediateWriteFile : public storehouse::WriteFile {
+ public:
+  IntermediateWriteFile(IntermediateStore* store, const std::string& path)
+    : store_(store), path_(path) {}
+
+  storehouse::StoreResult append(size_t size, const u8* data) override {
+    data_.insert(data_.end(), data, data + size);
+    return storehouse::StoreResult::Success;
+  }
+
+  storehouse::StoreResult save() override {
+    store_->put(path_, std::move(data_));
+    data_.clear();
+    return storehouse::StoreResult::Success;
+  }
+
+  const std::string path() override { return path_; }
+
+ private:
+  IntermediateStore* store_;
+  std::string path_;
+  std::vector<u8> data_;
+};
+}
+
+IntermediateStore::IntermediateStore() {}
+
+IntermediateStore::~IntermediateStore() {
+  for (auto& kv : files_) {
+    if (!kv.second.spill_path.empty()) {
+      std::remove(kv.second.spill_path.c_str());
+    }
+  }
+  if (!spill_dir_.empty()) {
+    std::remove(spill_dir_.c_str());
+  }
+}
+
+void IntermediateStore::set_memory_budget(u64 bytes) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  memory_budget_ = bytes > 0 ? bytes : DEFAULT_MEMORY_BUDGET;
+  spill();
+}
+
+void IntermediateStore::put(const std::string& path, std::vector<u8> data) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  auto it = files_.find(path);
+  if (it != files_.end()) {
+    // A retried task rewrites its files
+    memory_bytes_ -= it->second.data.size();
+    if (!it->second.spill_path.empty()) {
+      std::remove(it->second.spill_path.c_str());
+    }
+    files_.erase(it);
+  }
+  File& file = files_[path];
+  file.size = data.size();
+  file.data = std::move(data);
+  memory_bytes_ += file.size;
+  put_order_.push_back(path);
+  spill();
+}
+
+void IntermediateStore::spill() {
+  size_t next = 0;
+  while (memory_bytes_ > memory_budget_ && next < put_order_.size()) {
+    auto it = files_.find(put_order_[next++]);
+    if (it == files_.end() || it->second.data.empty()) {
+      continue;
+    }
+    File& file = it->second;
+    if (spill_dir_.empty()) {
+      temp_dir(spill_dir_);
+    }
+    file.spill_path =
+        spill_dir_ + "/" + std::to_string(next_spill_id_++) + ".bin";
+    FILE* fp = std::fopen(file.spill_path.c_str(), "wb");
+    LOG_IF(FATAL, fp == nullptr)
+        << "Could not spill intermediate file to " << file.spill_path;
+    size_t written = std::fwrite(file.data.data(), 1, file.size, fp);
+    std::fclose(fp);
+    LOG_IF(FATAL, written != file.size)
+        << "Could not spill intermediate file to " << file.spill_path;
+    memory_bytes_ -= file.size;
+    std::vector<u8>().swap(file.data);
+  }
+  put_order_.erase(put_order_.begin(), put_order_.begin() + next);
+}
+
+bool IntermediateStore::read_local(const std::string& path, u64 offset,
+                                   u64 size, u8* dest) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  auto it = files_.find(path);
+  if (it == files_.end()) {
+    return false;
+  }
+  const File& file = it->second;
+  LOG_IF(FATAL, offset + size > file.size)
+      << "Read past the end of intermediate file " << path;
+  if (file.spill_path.empty()) {
+    std::memcpy(dest, file.data.data() + offset, size);
+    return true;
+  }
+  FILE* fp = std::fopen(file.spill_path.c_str(), "rb");
+  LOG_IF(FATAL, fp == nullptr)
+      << "Spilled intermediate file " << file.spill_path << " is missing";
+  std::fseek(fp, offset, SEEK_SET);
+  size_t read = std::fread(dest, 1, size, fp);
+  std::fclose(fp);
+  LOG_IF(FATAL, read != size)
+      << "Could not read spilled intermediate file " << file.spill_path;
+  return true;
+}
+
+bool IntermediateStore::local_size(const std::string& path, u64& size) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  auto it = files_.find(path);
+  if (it == files_.end()) {
+    return false;
+  }
+  size = it->second.size;
+  return true;
+}
+
+void IntermediateStore::add_table_locations(
+    const proto::TableDescriptor& table) {
+  if (!table.ephemeral()) {
+    return;
+  }
+  std::unique_lock<std::mutex> lock(mutex_);
+  for (i32 item = 0; item < table.item_addresses_size(); ++item) {
+    // Items finished by an earlier, interrupted run have no address
+    if (table.item_addresses(item).empty()) {
+      continue;
+    }
+    for (i32 column = 0; column < table.columns_size(); ++column) {
+      locations_[table_item_output_path(table.id(), column, item)] =
+          table.item_addresses(item);
+    }
+  }
+}
+
+bool IntermediateStore::read(const std::string& path, u64 offset, u64 size,
+                             u8* dest) {
+  if (read_local(path, offset, size, dest)) {
+    return true;
+  }
+  proto::Worker::Stub* stub;
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    auto it = locations_.find(path);
+    if (it == locations_.end()) {
+      return false;
+    }
+    stub = stub_for(it->second);
+  }
+  for (u64 done = 0; done < size;) {
+    proto::IntermediateRead request;
+    request.set_path(path);
+    request.set_offset(offset + done);
+    request.set_size(std::min(size - done, MAX_READ_SIZE));
+    proto::IntermediateData reply;
+    grpc::ClientContext context;
+    grpc::Status status = stub->ReadIntermediate(&context, request, &reply);
+    LOG_IF(FATAL, !status.ok() || !reply.found())
+        << "Could not read intermediate file " << path
+        << " from the worker holding it: " << status.error_message();
+    std::memcpy(dest + done, reply.data().data(), reply.data().size());
+    done += reply.data().size();
+  }
+  return true;
+}
+
+void IntermediateStore::release_table(i32 table_id) {
+  std::string prefix = table_directory(table_id) + "/";
+  std::unique_lock<std::mutex> lock(mutex_);
+  for (auto it = files_.begin(); it != files_.end();) {
+    if (it->first.compare(0, prefix.size(), prefix) != 0) {
+      ++it;
+      continue;
+    }
+    memory_bytes_ -= it->second.data.size();
+    if (!it->second.spill_path.empty()) {
+      std::remove(it->second.spill_path.c_str());
+    }
+    it = files_.erase(it);
+  }
+  for (auto it = locations_.begin(); it != locations_.end();) {
+    if (it->first.compare(0, prefix.size(), prefix) == 0) {
+      it = locations_.erase(it);
+    } else {
+      ++it;
+    }
+  }
+}
+
+storehouse::WriteFile* IntermediateStore::make_write_file(
+    const std::string& path) {
+  return new IntermediateWriteFile(this, path);
+}
+
+proto::Worker::Stub* IntermediateStore::stub_for(const std::string& address) {
+  auto it = stubs_.find(address);
+  if (it == stubs_.end()) {
+    auto channel =
+        grpc::CreateChannel(address, grpc::InsecureChannelCredentials());
+    it = stubs_.emplace(address, proto::Worker::NewStub(channel)).first;
+  }
+  return it->second.get();
+}
+}
+}
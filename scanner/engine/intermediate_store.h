@@ -0,0 +1,103 @@
+/* Copyright 2017 Carnegie Mellon University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#pragma once
+
+#include "scanner/engine/metadata.h"
+#include "scanner/engine/rpc.grpc.pb.h"
+#include "scanner/util/common.h"
+
+#include "storehouse/storage_backend.h"
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace scanner {
+namespace internal {
+
+// Holds the data files of ephemeral tables on the worker that wrote them, so
+// a later stage reads them from that worker's memory instead of a round trip
+// through storage. Once the files held in memory pass the memory budget, the
+// oldest ones spill to a local directory. Workers serve their files to each
+// other through the ReadIntermediate RPC; which worker holds an item comes
+// from the item_addresses of the table's descriptor.
+class IntermediateStore {
+ public:
+  IntermediateStore();
+  ~IntermediateStore();
+
+  //! Bytes of file data kept in memory before spilling to disk
+  void set_memory_budget(u64 bytes);
+
+  //! Takes the contents of a finished file
+  void put(const std::string& path, std::vector<u8> data);
+
+  //! Reads size bytes at offset of a file held by this worker. Returns false
+  //! if it holds no such file.
+  bool read_local(const std::string& path, u64 offset, u64 size, u8* dest);
+
+  bool local_size(const std::string& path, u64& size);
+
+  //! Remembers which workers hold the items of an ephemeral table
+  void add_table_locations(const proto::TableDescriptor& table);
+
+  //! Reads from this worker or from the worker holding the file. Returns
+  //! false if the file is not part of a known ephemeral table.
+  bool read(const std::string& path, u64 offset, u64 size, u8* dest);
+
+  //! Drops the files of a table, e.g. once it is deleted
+  void release_table(i32 table_id);
+
+  //! Wraps a write file so its contents are put here when it is saved
+  storehouse::WriteFile* make_write_file(const std::string& path);
+
+  //! Largest read sent in one ReadIntermediate request, below the default
+  //! gRPC message size limit
+  static const u64 MAX_READ_SIZE = 2 * 1024 * 1024;
+  static const u64 DEFAULT_MEMORY_BUDGET = 1024 * 1024 * 1024;
+
+ private:
+  struct File {
+    // Empty once spilled
+    std::vector<u8> data;
+    u64 size = 0;
+    std::string spill_path;
+  };
+
+  //! Moves files to disk, oldest first, until memory use is within budget.
+  //! Must hold mutex_.
+  void spill();
+
+  proto::Worker::Stub* stub_for(const std::string& address);
+
+  std::mutex mutex_;
+  std::map<std::string, File> files_;
+  // Paths in the order they were put, for spilling
+  std::vector<std::string> put_order_;
+  u64 memory_bytes_ = 0;
+  u64 memory_budget_ = DEFAULT_MEMORY_BUDGET;
+  std::string spill_dir_;
+  i64 next_spill_id_ = 0;
+
+  // Address of the worker holding each file of known ephemeral tables
+  std::map<std::string, std::string> locations_;
+  std::map<std::string, std::unique_ptr<proto::Worker::Stub>> stubs_;
+};
+}
+}
@@ -0,0 +1,75 @@
+/* Copyright 2017 Carnegie Mellon University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include "scanner/util/common.h"
+
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <tuple>
+#include <vector>
+
+namespace scanner {
+namespace internal {
+
+// Element byte offsets of table items, parsed from their metadata files and
+// shared by all load workers of a process. Entries are kept across tasks and
+// jobs so that an item read by several tasks or jobs has its metadata file
+// fetched and parsed once. Each entry remembers the timestamp of the table it
+// was read from, so an entry for a table that has since been rewritten is
+// dropped instead of returned. Least recently used items are evicted once
+// the cached offsets exceed the byte budget.
+class ItemMetadataCache {
+ public:
+  using Offsets = std::shared_ptr<const std::vector<u64>>;
+
+  ItemMetadataCache(size_t max_bytes = DEFAULT_MAX_BYTES);
+
+  //! Returns the cached offsets of the item, or nullptr if it is not cached
+  //! or was cached from a table with a different timestamp.
+  Offsets get(i32 table_id, i32 column_id, i32 item_id, i64 timestamp);
+
+  void put(i32 table_id, i32 column_id, i32 item_id, i64 timestamp,
+           Offsets offsets);
+
+  void clear();
+
+  static const size_t DEFAULT_MAX_BYTES = 256 * 1024 * 1024;
+
+ private:
+  using Key = std::tuple<i32, i32, i32>;
+
+  struct Entry {
+    i64 timestamp;
+    Offsets offsets;
+    std::list<Key>::iterator lru_position;
+  };
+
+  static size_t entry_bytes(const Offsets& offsets);
+
+  void erase(std::map<Key, Entry>::iterator it);
+
+  const size_t max_bytes_;
+  std::mutex mutex_;
+  std::map<Key, Entry> entries_;
+  // Most recently used first
+  std::list<Key> lru_;
+  size_t bytes_ = 0;
+};
+}
+}
@@ -0,0 +1,114 @@
+/* Copyright 2017 Carnegie Mellon University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "scanner/engine/kernel_cache.h"
+
+#include <sstream>
+
+namespace scanner {
+namespace internal {
+
+KernelCache::~KernelCache() { clear(); }
+
+BaseKernel* KernelCache::acquire(KernelFactory* factory,
+                                 const KernelConfig& config) {
+  std::unique_ptr<BaseKernel> kernel;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = entries_.find(make_key(factory, config));
+    if (it == entries_.end() || it->second.idle.empty()) {
+      return nullptr;
+    }
+    kernel = std::move(it->second.idle.back());
+    it->second.idle.pop_back();
+  }
+  // Rows of the new job are not a continuation of the last one
+  kernel->reset();
+  return kernel.release();
+}
+
+void KernelCache::release(KernelFactory* factory, const KernelConfig& config,
+                          std::unique_ptr<BaseKernel> kernel) {
+  kernel->set_profiler(nullptr);
+  std::lock_guard<std::mutex> lock(mutex_);
+  Entry& entry = entries_[make_key(factory, config)];
+  entry.idle.push_back(std::move(kernel));
+  entry.factory = factory;
+  entry.args = config.args;
+  entry.used = true;
+}
+
+void KernelCache::evict_unused() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (auto it = entries_.begin(); it != entries_.end();) {
+    if (!it->second.used) {
+      it = entries_.erase(it);
+    } else {
+      it->second.used = false;
+      ++it;
+    }
+  }
+}
+
+void KernelCache::evict_mismatched(
+    const std::vector<KernelFactory*>& factories,
+    const std::vector<KernelConfig>& configs) {
+  // Idle kernels can hold large device allocations (nets, CUDA contexts), so
+  // they must not stay resident while the next job's kernels are set up
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (auto it = entries_.begin(); it != entries_.end();) {
+    bool wanted = false;
+    for (size_t i = 0; i < factories.size() && !wanted; ++i) {
+      wanted = factories[i] == it->second.factory &&
+               configs[i].args == it->second.args;
+    }
+    if (wanted) {
+      ++it;
+    } else {
+      it = entries_.erase(it);
+    }
+  }
+}
+
+void KernelCache::clear() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  entries_.clear();
+}
+
+KernelCache::Key KernelCache::make_key(KernelFactory* factory,
+                                       const KernelConfig& config) {
+  // The args bytes are part of the key itself rather than a hash of them, so
+  // a collision can never hand back a kernel configured differently
+  std::stringstream key;
+  key << factory->get_op_name() << ":" << (void*)factory << ":"
+      << config.node_id;
+  for (const DeviceHandle& device : config.devices) {
+    key << ":" << device;
+  }
+  for (size_t i = 0; i < config.input_columns.size(); ++i) {
+    key << ":" << config.input_columns[i] << "/"
+        << (i < config.input_column_types.size()
+                ? config.input_column_types[i]
+                : -1);
+  }
+  for (const std::string& column : config.output_columns) {
+    key << ":" << column;
+  }
+  key << ":" << config.args.size() << ":";
+  key.write((const char*)config.args.data(), config.args.size());
+  return key.str();
+}
+}
+}
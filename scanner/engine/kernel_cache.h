@@ -0,0 +1,72 @@
+/* Copyright 2017 Carnegie Mellon University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include "scanner/api/kernel.h"
+#include "scanner/engine/kernel_factory.h"
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace scanner {
+namespace internal {
+
+// Keeps kernel instances alive between bulk jobs on a worker, so that a job
+// using the same op on the same devices with the same arguments as the
+// previous job skips kernel setup (loading nets, creating CUDA contexts and
+// cuDNN handles). Only kernels used by the most recent job are kept.
+class KernelCache {
+ public:
+  ~KernelCache();
+
+  //! Returns an idle kernel made by the factory with an identical config,
+  //! reset and ready for a new job, or nullptr if there is none.
+  BaseKernel* acquire(KernelFactory* factory, const KernelConfig& config);
+
+  //! Hands a kernel back to the cache once its job is done with it.
+  void release(KernelFactory* factory, const KernelConfig& config,
+               std::unique_ptr<BaseKernel> kernel);
+
+  //! Destroys the idle kernels that no job released since the last call.
+  void evict_unused();
+
+  //! Destroys the idle kernels that no op of the next job could acquire,
+  //! before that job builds its own. Ops are matched on factory and args;
+  //! devices are assigned later, so kernels on other devices are kept.
+  void evict_mismatched(const std::vector<KernelFactory*>& factories,
+                        const std::vector<KernelConfig>& configs);
+
+  void clear();
+
+ private:
+  using Key = std::string;
+
+  struct Entry {
+    std::vector<std::unique_ptr<BaseKernel>> idle;
+    KernelFactory* factory = nullptr;
+    std::vector<u8> args;
+    bool used = false;
+  };
+
+  static Key make_key(KernelFactory* factory, const KernelConfig& config);
+
+  std::mutex mutex_;
+  std::map<Key, Entry> entries_;
+};
+}
+}
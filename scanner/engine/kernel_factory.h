@@ -38,12 +38,22 @@ namespace internal {
 class KernelFactory {
  public:
   KernelFactory(const std::string& op_name, DeviceType type, i32 max_devices,
-                bool can_batch, i32 batch_size, KernelConstructor constructor)
+                bool can_batch, i32 batch_size, KernelConstructor constructor,
+                bool can_fuse = false, bool can_update_in_place = false,
+                bool can_serialize_state = false,
+                i64 device_memory_bytes = 0, i64 device_memory_per_row = 0,
+                bool can_reduce = false)
     : op_name_(op_name),
       type_(type),
       max_devices_(max_devices),
       can_batch_(can_batch),
       preferred_batch_size_(batch_size),
+      can_fuse_(can_fuse),
+      can_update_in_place_(can_update_in_place),
+      can_serialize_state_(can_serialize_state),
+      device_memory_bytes_(device_memory_bytes),
+      device_memory_per_row_(device_memory_per_row),
+      can_reduce_(can_reduce),
       constructor_(constructor) {}
 
   const std::string& get_op_name() const { return op_name_; }
@@ -57,6 +67,25 @@ class KernelFactory {
 
   i32 preferred_batch_size() const { return preferred_batch_size_; }
 
+  bool can_fuse() const { return can_fuse_; }
+
+  bool can_update_in_place() const { return can_update_in_place_; }
+
+  bool can_serialize_state() const { return can_serialize_state_; }
+
+  /** Reduces the rows of a job to one result with combine_state */
+  bool can_reduce() const { return can_reduce_; }
+
+  /** Device memory an instance allocates outside the memory pool */
+  i64 device_memory_bytes() const { return device_memory_bytes_; }
+
+  i64 device_memory_per_row() const { return device_memory_per_row_; }
+
+  /** Declared device memory of an instance evaluating batches of rows */
+  i64 device_memory(i32 batch_size) const {
+    return device_memory_bytes_ + device_memory_per_row_ * batch_size;
+  }
+
   /* @brief Constructs a kernel to be used for processing elements of data.
    */
   BaseKernel* new_instance(const KernelConfig& config) {
@@ -69,6 +98,12 @@ class KernelFactory {
   i32 max_devices_;
   bool can_batch_;
   i32 preferred_batch_size_;
+  bool can_fuse_;
+  bool can_update_in_place_;
+  bool can_serialize_state_;
+  i64 device_memory_bytes_;
+  i64 device_memory_per_row_;
+  bool can_reduce_;
   KernelConstructor constructor_;
 };
 }
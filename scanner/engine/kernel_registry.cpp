@@ -22,6 +22,7 @@ void KernelRegistry::add_kernel(const std::string& name,
                                 KernelFactory* factory) {
   DeviceType type = factory->get_device_type();
   factories_.insert({factory_name(name, type), factory});
+  op_names_.insert(name);
 }
 
 bool KernelRegistry::has_kernel(const std::string& name, DeviceType type) {
@@ -33,6 +34,10 @@ KernelFactory* KernelRegistry::get_kernel(const std::string& name,
   return factories_.at(factory_name(name, type));
 }
 
+std::vector<std::string> KernelRegistry::op_names() const {
+  return std::vector<std::string>(op_names_.begin(), op_names_.end());
+}
+
 std::string KernelRegistry::factory_name(const std::string& name,
                                          DeviceType type) {
   return name + ((type == DeviceType::CPU) ? "_cpu" : "_gpu");
@@ -21,6 +21,8 @@
 #include "scanner/util/common.h"
 
 #include <map>
+#include <set>
+#include <vector>
 
 namespace scanner {
 namespace internal {
@@ -33,11 +35,15 @@ class KernelRegistry {
 
   KernelFactory* get_kernel(const std::string& name, DeviceType device_type);
 
+  //! Ops with a kernel for any device
+  std::vector<std::string> op_names() const;
+
  protected:
   static std::string factory_name(const std::string& name, DeviceType type);
 
  private:
   std::map<std::string, KernelFactory*> factories_;
+  std::set<std::string> op_names_;
 };
 
 KernelRegistry* get_kernel_registry();
@@ -0,0 +1,181 @@
+/* Copyright 2017 Carnegie Mellon University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "scanner/engine/metadata.h"
+
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <random>
+
+namespace scanner {
+namespace internal {
+namespace {
+struct Keyframes {
+  std::vector<i64> positions;
+  std::vector<i64> timestamps;
+  std::vector<i64> byte_offsets;
+};
+
+// Keyframes of a video with irregular GOPs, timestamps which step back as
+// after an edit list, and byte offsets past 32 bits
+Keyframes make_keyframes(i64 count, u32 seed) {
+  std::mt19937 gen(seed);
+  std::uniform_int_distribution<i64> gop(1, 300);
+  std::uniform_int_distribution<i64> timestamp_step(-50, 5000);
+  std::uniform_int_distribution<i64> gop_bytes(1, 1LL << 31);
+  Keyframes k;
+  i64 position = 0;
+  i64 timestamp = -1000;
+  i64 byte_offset = 0;
+  for (i64 i = 0; i < count; ++i) {
+    k.positions.push_back(position);
+    k.timestamps.push_back(timestamp);
+    k.byte_offsets.push_back(byte_offset);
+    position += gop(gen);
+    timestamp += timestamp_step(gen);
+    byte_offset += gop_bytes(gen);
+  }
+  return k;
+}
+
+template <typename T>
+std::vector<T> slice(const std::vector<T>& v, i64 start, i64 end) {
+  return std::vector<T>(v.begin() + start, v.begin() + end);
+}
+}
+
+TEST(KeyframeIndexTest, RoundTripAcrossBlocks) {
+  const i64 count = 3 * KeyframeIndex::DEFAULT_BLOCK_SIZE + 44;
+  Keyframes k = make_keyframes(count, 0);
+  proto::VideoDescriptor descriptor;
+  KeyframeIndex::append(descriptor, 0, 0, k.positions, k.timestamps,
+                        k.byte_offsets);
+  ASSERT_TRUE(KeyframeIndex::present(descriptor));
+  EXPECT_EQ(descriptor.keyframe_positions_size(), 0);
+  EXPECT_EQ(descriptor.keyframe_index_block_offsets_size(), 4);
+
+  KeyframeIndex index(descriptor);
+  ASSERT_EQ(index.size(), count);
+  Keyframes decoded;
+  index.decode(0, count, &decoded.positions, &decoded.timestamps,
+               &decoded.byte_offsets);
+  EXPECT_EQ(decoded.positions, k.positions);
+  EXPECT_EQ(decoded.timestamps, k.timestamps);
+  EXPECT_EQ(decoded.byte_offsets, k.byte_offsets);
+
+  // Ranges starting inside a block, ending inside another and on the edges
+  std::vector<std::pair<i64, i64>> ranges = {
+      {0, 1},     {127, 129}, {128, 256}, {100, 300},
+      {383, 384}, {384, count}, {200, 200}};
+  for (auto& r : ranges) {
+    std::vector<i64> positions;
+    std::vector<i64> byte_offsets;
+    index.decode(r.first, r.second, &positions, nullptr, &byte_offsets);
+    EXPECT_EQ(positions, slice(k.positions, r.first, r.second))
+        << r.first << " " << r.second;
+    EXPECT_EQ(byte_offsets, slice(k.byte_offsets, r.first, r.second))
+        << r.first << " " << r.second;
+  }
+}
+
+TEST(KeyframeIndexTest, Find) {
+  const i64 count = 2 * KeyframeIndex::DEFAULT_BLOCK_SIZE + 5;
+  Keyframes k = make_keyframes(count, 1);
+  proto::VideoDescriptor descriptor;
+  KeyframeIndex::append(descriptor, 0, 0, k.positions, k.timestamps,
+                        k.byte_offsets);
+  KeyframeIndex index(descriptor);
+  // Frames on, just before and just after every keyframe
+  for (i64 i = 0; i < count; ++i) {
+    for (i64 d = -1; d <= 1; ++d) {
+      i64 frame = k.positions[i] + d;
+      i64 expected = std::upper_bound(k.positions.begin(),
+                                      k.positions.end(), frame) -
+                     k.positions.begin() - 1;
+      ASSERT_EQ(index.find(frame), std::max(expected, (i64)0)) << frame;
+    }
+  }
+  EXPECT_EQ(KeyframeIndex().find(10), 0);
+}
+
+TEST(KeyframeIndexTest, MultipleVideos) {
+  // The first video spans a block boundary so the second starts mid block
+  Keyframes a = make_keyframes(KeyframeIndex::DEFAULT_BLOCK_SIZE + 72, 2);
+  Keyframes b = make_keyframes(90, 3);
+  i64 frames_a = a.positions.back() + 17;
+  i64 size_a = a.byte_offsets.back() + 12345;
+  i64 frames_b = b.positions.back() + 3;
+  i64 size_b = b.byte_offsets.back() + 678;
+
+  proto::VideoDescriptor descriptor;
+  KeyframeIndex::append(descriptor, 0, 0, a.positions, a.timestamps,
+                        a.byte_offsets);
+  KeyframeIndex::append(descriptor, frames_a, size_a, b.positions,
+                        b.timestamps, b.byte_offsets);
+  descriptor.set_num_encoded_videos(2);
+  descriptor.add_frames_per_video(frames_a);
+  descriptor.add_frames_per_video(frames_b);
+  descriptor.add_keyframes_per_video(a.positions.size());
+  descriptor.add_keyframes_per_video(b.positions.size());
+  descriptor.add_size_per_video(size_a);
+  descriptor.add_size_per_video(size_b);
+
+  // The index holds item-relative values
+  KeyframeIndex index(descriptor);
+  ASSERT_EQ(index.size(), (i64)(a.positions.size() + b.positions.size()));
+  Keyframes decoded;
+  index.decode(a.positions.size(), index.size(), &decoded.positions,
+               &decoded.timestamps, &decoded.byte_offsets);
+  for (size_t i = 0; i < b.positions.size(); ++i) {
+    EXPECT_EQ(decoded.positions[i], b.positions[i] + frames_a);
+    EXPECT_EQ(decoded.byte_offsets[i], b.byte_offsets[i] + size_a);
+  }
+  EXPECT_EQ(decoded.timestamps, b.timestamps);
+  EXPECT_EQ(index.find(frames_a), (i64)a.positions.size());
+  EXPECT_EQ(index.find(frames_a - 1), (i64)a.positions.size() - 1);
+
+  // while the metadata hands out values relative to each video
+  VideoMetadata meta(descriptor);
+  std::vector<i64> positions = a.positions;
+  positions.insert(positions.end(), b.positions.begin(), b.positions.end());
+  std::vector<i64> byte_offsets = a.byte_offsets;
+  byte_offsets.insert(byte_offsets.end(), b.byte_offsets.begin(),
+                      b.byte_offsets.end());
+  EXPECT_EQ(meta.keyframe_positions(), positions);
+  EXPECT_EQ(meta.keyframe_byte_offsets(), byte_offsets);
+}
+
+TEST(KeyframeIndexTest, LegacyDescriptor) {
+  Keyframes k = make_keyframes(KeyframeIndex::DEFAULT_BLOCK_SIZE + 10, 4);
+  proto::VideoDescriptor descriptor;
+  for (size_t i = 0; i < k.positions.size(); ++i) {
+    descriptor.add_keyframe_positions(k.positions[i]);
+    descriptor.add_keyframe_timestamps(k.timestamps[i]);
+    descriptor.add_keyframe_byte_offsets(k.byte_offsets[i]);
+  }
+  descriptor.set_num_encoded_videos(1);
+  descriptor.add_frames_per_video(k.positions.back() + 1);
+  descriptor.add_keyframes_per_video(k.positions.size());
+  descriptor.add_size_per_video(k.byte_offsets.back() + 1);
+  ASSERT_FALSE(KeyframeIndex::present(descriptor));
+
+  VideoMetadata meta(descriptor);
+  EXPECT_EQ(meta.keyframe_positions(), k.positions);
+  EXPECT_EQ(meta.keyframe_byte_offsets(), k.byte_offsets);
+}
+}
+}
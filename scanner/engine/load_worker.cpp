@@ -14,10 +14,18 @@
  */
 
 #include "scanner/engine/load_worker.h"
+#include "scanner/engine/packed_item.h"
+
+#include "scanner/util/compression.h"
+#include "scanner/video/decode_args.h"
 
 #include "storehouse/storage_backend.h"
 
 #include <glog/logging.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <cstring>
 
 using storehouse::StoreResult;
 using storehouse::WriteFile;
@@ -153,6 +161,127 @@ VideoIntervals slice_into_video_intervals(
   return info;
 }
 
+// Source packets [first, last) making up the keyframes in [start, end) of a
+// video ingested in place
+std::tuple<i64, i64> inplace_packet_interval(const VideoIndexEntry& index_entry,
+                                             size_t start_keyframe_index,
+                                             size_t end_keyframe_index) {
+  const std::vector<i64>& keyframe_packets =
+      index_entry.source_keyframe_packets;
+  i64 num_packets = static_cast<i64>(index_entry.source_packet_offsets.size());
+  i64 first = keyframe_packets[start_keyframe_index];
+  i64 last = end_keyframe_index < keyframe_packets.size()
+                 ? keyframe_packets[end_keyframe_index]
+                 : num_packets;
+  return std::make_tuple(first, last);
+}
+
+// Byte ranges of the keyframe intervals, with buffers left for the range
+// reader to allocate
+std::vector<RangeReader::Range> keyframe_ranges(
+    const VideoIndexEntry& index_entry, const VideoIntervals& intervals) {
+  const std::vector<i64>& keyframe_byte_offsets =
+      index_entry.keyframe_byte_offsets;
+  std::vector<RangeReader::Range> ranges;
+  for (auto& interval : intervals.keyframe_index_intervals) {
+    size_t start_keyframe_index;
+    size_t end_keyframe_index;
+    std::tie(start_keyframe_index, end_keyframe_index) = interval;
+
+    if (index_entry.inplace()) {
+      // Packets are read from the source file, which may interleave other
+      // streams, so cover every packet of the interval
+      i64 first;
+      i64 last;
+      std::tie(first, last) = inplace_packet_interval(
+          index_entry, start_keyframe_index, end_keyframe_index);
+      u64 start = std::numeric_limits<u64>::max();
+      u64 end = 0;
+      for (i64 p = first; p < last; ++p) {
+        u64 offset = static_cast<u64>(index_entry.source_packet_offsets[p]);
+        start = std::min(start, offset);
+        end = std::max(
+            end, offset + static_cast<u64>(index_entry.source_packet_sizes[p]));
+      }
+      if (first == last) {
+        start = end = 0;
+      }
+      ranges.push_back(RangeReader::Range{start, end - start, nullptr});
+      continue;
+    }
+
+    u64 start_keyframe_byte_offset =
+        static_cast<u64>(keyframe_byte_offsets[start_keyframe_index]);
+    u64 end_keyframe_byte_offset =
+        static_cast<u64>(keyframe_byte_offsets[end_keyframe_index]);
+    ranges.push_back(RangeReader::Range{
+        start_keyframe_byte_offset,
+        end_keyframe_byte_offset - start_keyframe_byte_offset, nullptr});
+  }
+  return ranges;
+}
+
+// Rebuilds the stream the decoder expects (see H264ByteStreamIndexCreator)
+// for a keyframe interval of a video ingested in place from the source
+// bytes read for it. Takes ownership of source.
+u8* assemble_inplace_interval(const VideoIndexEntry& index_entry,
+                              size_t start_keyframe_index,
+                              size_t end_keyframe_index,
+                              const RangeReader::Range& source, size_t& size) {
+  const std::vector<i64>& keyframe_byte_offsets =
+      index_entry.keyframe_byte_offsets;
+  const std::vector<u8>& parameter_sets = index_entry.source_parameter_sets;
+  size = static_cast<size_t>(keyframe_byte_offsets[end_keyframe_index] -
+                             keyframe_byte_offsets[start_keyframe_index]);
+  u8* buffer = new_buffer(CPU_DEVICE, size);
+
+  i64 first;
+  i64 last;
+  std::tie(first, last) = inplace_packet_interval(
+      index_entry, start_keyframe_index, end_keyframe_index);
+  const std::vector<i64>& keyframe_packets =
+      index_entry.source_keyframe_packets;
+  size_t next_keyframe = start_keyframe_index;
+  u8* out = buffer;
+  for (i64 p = first; p < last; ++p) {
+    bool is_keyframe = next_keyframe < keyframe_packets.size() &&
+                       keyframe_packets[next_keyframe] == p;
+    if (is_keyframe) {
+      next_keyframe++;
+    }
+    i32 packet_size = static_cast<i32>(index_entry.source_packet_sizes[p]);
+    i32 record_size =
+        packet_size + (is_keyframe ? (i32)parameter_sets.size() : 0);
+    memcpy(out, &record_size, sizeof(i32));
+    out += sizeof(i32);
+    if (is_keyframe) {
+      memcpy(out, parameter_sets.data(), parameter_sets.size());
+      out += parameter_sets.size();
+    }
+    // mp4 samples hold 4 byte big endian NAL lengths, which become start
+    // codes of the same size
+    const u8* in = source.buffer +
+                   (index_entry.source_packet_offsets[p] - source.offset);
+    memcpy(out, in, packet_size);
+    i32 pos = 0;
+    while (pos + 4 <= packet_size) {
+      u32 nal_size = (u32(out[pos]) << 24) | (u32(out[pos + 1]) << 16) |
+                     (u32(out[pos + 2]) << 8) | u32(out[pos + 3]);
+      out[pos] = 0;
+      out[pos + 1] = 0;
+      out[pos + 2] = 0;
+      out[pos + 3] = 1;
+      pos += 4 + nal_size;
+    }
+    out += packet_size;
+  }
+  assert(out == buffer + size);
+  if (source.buffer != nullptr) {
+    delete_buffer(CPU_DEVICE, source.buffer);
+  }
+  return buffer;
+}
+
 std::tuple<size_t, size_t> find_keyframe_indices(
     i32 start_frame, i32 end_frame,
     const std::vector<i64>& keyframe_positions) {
@@ -183,21 +312,45 @@ LoadWorker::LoadWorker(const LoadWorkerArgs& args)
     profiler_(args.profiler),
     load_sparsity_threshold_(args.load_sparsity_threshold),
     io_packet_size_(args.io_packet_size),
-    work_packet_size_(args.work_packet_size) {
+    work_packet_size_(args.work_packet_size),
+    item_metadata_cache_(args.item_metadata_cache),
+    video_index_cache_(args.video_index_cache),
+    file_pool_(args.file_pool),
+    intermediates_(args.intermediates),
+    block_cache_(nullptr) {
   storage_.reset(
       storehouse::StorageBackend::make_from_config(args.storage_config));
   meta_ = read_database_metadata(storage_.get(),
                                  DatabaseMetadata::descriptor_path());
   table_metadata_.reset(new TableMetaCache(storage_.get(), meta_));
+  // Only POSIX databases live under an absolute local path
+  const std::string& db_path = get_database_path();
+  struct stat db_stat;
+  local_storage_ =
+      !db_path.empty() && db_path[0] == '/' &&
+      stat(DatabaseMetadata::descriptor_path().c_str(), &db_stat) == 0;
+  direct_reads_ = args.direct_reads && local_storage_;
+  // Local files are already cached by the page cache
+  block_cache_ = local_storage_ ? nullptr : args.block_cache;
+  range_reader_.reset(
+      new RangeReader(args.storage_config, block_cache_, file_pool_));
+  range_reader_->set_intermediate_store(args.intermediates);
 }
 
 void LoadWorker::feed(LoadWorkEntry& input_entry) {
   LoadWorkEntry& load_work_entry = input_entry;
 
   if (load_work_entry.table_id() != last_table_id_) {
-    // Not from the same task so clear cached data
+    // Not from the same task so clear cached data, except for what was
+    // prefetched for this one
     last_table_id_ = load_work_entry.table_id();
-    index_.clear();
+    for (auto it = index_.begin(); it != index_.end();) {
+      if (std::get<0>(it->first) != last_table_id_) {
+        it = index_.erase(it);
+      } else {
+        ++it;
+      }
+    }
   }
 
   entry_ = input_entry;
@@ -228,6 +381,7 @@ bool LoadWorker::yield(i32 item_size,
   // Aggregate all sample columns so we know the tuple size
   i32 num_columns = samples.size();
   eval_work_entry.columns.resize(num_columns);
+  eval_work_entry.direct_reads.resize(num_columns);
 
   // For each sample, insert the row ids and read the rows from disk
   // NOTE(apoms): if the requested rows are different for each column,
@@ -237,9 +391,12 @@ bool LoadWorker::yield(i32 item_size,
   for (const proto::LoadSample& sample : samples) {
     i32 table_id = sample.table_id();
     const TableMetadata& table_meta = table_metadata_->at(table_id);
+    see_table(table_meta);
 
+    // Columns can request fewer rows than others, or none when no Op reads
+    // them, so they run out before the entry does
     i64 total_rows = sample.input_row_ids_size();
-    i64 row_start = current_row_;
+    i64 row_start = std::min(current_row_, total_rows);
     i64 row_end = std::min(current_row_ + item_size, total_rows);
 
     const auto& sample_rows = sample.input_row_ids();
@@ -250,7 +407,10 @@ bool LoadWorker::yield(i32 item_size,
                                  output_row_ids.begin() + row_end);
     eval_work_entry.row_ids.push_back(output_rows);
 
-    RowIntervals intervals = slice_into_row_intervals(table_meta, rows);
+    RowIntervals intervals;
+    if (!rows.empty()) {
+      intervals = slice_into_row_intervals(table_meta, rows);
+    }
     size_t num_items = intervals.item_ids.size();
     i32 col_id = sample.column_id();
 
@@ -265,19 +425,24 @@ bool LoadWorker::yield(i32 item_size,
         i64 item_start_row = intervals.item_start_offsets[i];
         const std::vector<i64>& valid_offsets = intervals.valid_offsets[i];
 
-        auto key = std::make_tuple(table_id, col_id, item_id);
-        if (index_.count(key) == 0) {
-          index_[key] =
-              read_video_index(storage_.get(), table_id, col_id, item_id);
-        }
-        const VideoIndexEntry& entry = index_.at(key);
+        const VideoIndexEntry& entry = decode_video_index(sample, item_id);
         info = FrameInfo(entry.height, entry.width, entry.channels,
                          entry.frame_type);
         encoding_type = entry.codec_type;
-        if (entry.codec_type == proto::VideoDescriptor::H264) {
-          // Video was encoded using h264
-          read_video_column(profiler_, entry, valid_offsets, item_start_row,
+        if (entry.codec_type != proto::VideoDescriptor::RAW) {
+          // Video was encoded using h264 or hevc
+          read_video_column(profiler_, *range_reader_, entry, valid_offsets,
+                            item_start_row, sample.decode_width(),
+                            sample.decode_height(), sample.decode_format(),
                             eval_work_entry.columns[out_col_idx]);
+          if (sample.decode_width() > 0 && sample.decode_height() > 0) {
+            info = frame_info_for_format(sample.decode_height(),
+                                         sample.decode_width(),
+                                         sample.decode_format());
+          } else if (sample.decode_format() != PixelFormat::RGB24) {
+            info = frame_info_for_format(entry.height, entry.width,
+                                         sample.decode_format());
+          }
         } else {
           // Video was encoded as individual images
           i32 item_id = intervals.item_ids[i];
@@ -285,9 +450,15 @@ bool LoadWorker::yield(i32 item_size,
           i64 item_end;
           std::tie(item_start, item_end) = intervals.item_intervals[i];
 
-          read_other_column(table_id, col_id, item_id, item_start, item_end,
-                            valid_offsets,
-                            eval_work_entry.columns[out_col_idx]);
+          if (can_read_directly(table_meta, col_id)) {
+            eval_work_entry.direct_reads[out_col_idx].push_back(
+                direct_read(table_id, col_id, item_id, item_start, item_end,
+                            valid_offsets));
+          } else {
+            read_other_column(table_id, col_id, item_id, item_start, item_end,
+                              valid_offsets,
+                              eval_work_entry.columns[out_col_idx]);
+          }
         }
       }
       if (num_items == 0) {
@@ -307,8 +478,30 @@ bool LoadWorker::yield(i32 item_size,
         std::tie(item_start, item_end) = intervals.item_intervals[i];
         const std::vector<i64>& valid_offsets = intervals.valid_offsets[i];
 
-        read_other_column(table_id, col_id, item_id, item_start, item_end,
-                          valid_offsets, eval_work_entry.columns[out_col_idx]);
+        if (can_read_directly(table_meta, col_id)) {
+          eval_work_entry.direct_reads[out_col_idx].push_back(direct_read(
+              table_id, col_id, item_id, item_start, item_end, valid_offsets));
+        } else {
+          read_other_column(table_id, col_id, item_id, item_start, item_end,
+                            valid_offsets,
+                            eval_work_entry.columns[out_col_idx]);
+        }
+      }
+      std::string codec = table_meta.column_codec(col_id);
+      if (!codec.empty()) {
+        auto decompress_start = now();
+        for (Element& element : eval_work_entry.columns[out_col_idx]) {
+          if (element.size == 0) {
+            continue;
+          }
+          size_t size;
+          u8* buffer =
+              decompress_element(codec, element.buffer, element.size, size);
+          delete_buffer(CPU_DEVICE, element.buffer);
+          element.buffer = buffer;
+          element.size = size;
+        }
+        profiler_.add_interval("decompress", decompress_start, now());
       }
     }
     eval_work_entry.column_types.push_back(column_type);
@@ -320,16 +513,28 @@ bool LoadWorker::yield(i32 item_size,
 
   current_row_ += item_size;
 
+  i64 cache_hits;
+  i64 cache_misses;
+  range_reader_->take_block_cache_counts(cache_hits, cache_misses);
+  profiler_.increment("block_cache_hits", cache_hits);
+  profiler_.increment("block_cache_misses", cache_misses);
+
   return true;
 }
 
 bool LoadWorker::done() { return current_row_ >= total_rows_; }
 
-void read_video_column(Profiler& profiler, const VideoIndexEntry& index_entry,
+void read_video_column(Profiler& profiler, RangeReader& range_reader,
+                       const VideoIndexEntry& entry,
                        const std::vector<i64>& rows, i64 start_frame,
-                       ElementList& element_list) {
-  std::unique_ptr<RandomReadFile> video_file = index_entry.open_file();
-  u64 file_size = index_entry.file_size;
+                       i32 decode_width, i32 decode_height,
+                       PixelFormat decode_format, ElementList& element_list) {
+  // Only the keyframes around the rows are decoded from a compact index
+  VideoIndexEntry slice;
+  if (entry.keyframe_index) {
+    slice = slice_video_index(entry, rows);
+  }
+  const VideoIndexEntry& index_entry = entry.keyframe_index ? slice : entry;
   const std::vector<i64>& keyframe_positions = index_entry.keyframe_positions;
   const std::vector<i64>& keyframe_byte_offsets =
       index_entry.keyframe_byte_offsets;
@@ -342,6 +547,16 @@ void read_video_column(Profiler& profiler, const VideoIndexEntry& index_entry,
   VideoIntervals intervals =
       slice_into_video_intervals(keyframe_positions, rows);
   size_t num_intervals = intervals.keyframe_index_intervals.size();
+  // Fetch every interval up front so nearby intervals share a request and
+  // the rest are read concurrently
+  std::vector<RangeReader::Range> ranges =
+      keyframe_ranges(index_entry, intervals);
+
+  auto io_start = now();
+  u64 bytes_read = range_reader.read(index_entry.data_path(), ranges);
+  profiler.add_interval("io", io_start, now());
+  profiler.increment("io_read", static_cast<i64>(bytes_read));
+
   for (size_t i = 0; i < num_intervals; ++i) {
     size_t start_keyframe_index;
     size_t end_keyframe_index;
@@ -350,8 +565,6 @@ void read_video_column(Profiler& profiler, const VideoIndexEntry& index_entry,
 
     u64 start_keyframe_byte_offset =
         static_cast<u64>(keyframe_byte_offsets[start_keyframe_index]);
-    u64 end_keyframe_byte_offset =
-        static_cast<u64>(keyframe_byte_offsets[end_keyframe_index]);
 
     i64 start_keyframe = keyframe_positions[start_keyframe_index];
     i64 end_keyframe = keyframe_positions[end_keyframe_index];
@@ -366,46 +579,95 @@ void read_video_column(Profiler& profiler, const VideoIndexEntry& index_entry,
                                            start_keyframe_byte_offset);
     }
 
-    size_t buffer_size = end_keyframe_byte_offset - start_keyframe_byte_offset;
-    u8* buffer = new_buffer(CPU_DEVICE, buffer_size);
-
-    auto io_start = now();
-
-    u64 pos = start_keyframe_byte_offset;
-    size_t size_read;
-    storehouse::StoreResult r =
-        video_file->read(pos, buffer_size, buffer, size_read);
-    //s_read(video_file.get(), buffer, buffer_size, pos);
-
-    profiler.add_interval("io", io_start, now());
-    profiler.increment("io_read", static_cast<i64>(buffer_size));
+    u8* buffer = ranges[i].buffer;
+    size_t buffer_size = ranges[i].size;
+    if (index_entry.inplace()) {
+      buffer = assemble_inplace_interval(index_entry, start_keyframe_index,
+                                         end_keyframe_index, ranges[i],
+                                         buffer_size);
+    }
 
-    proto::DecodeArgs decode_args;
-    decode_args.set_width(index_entry.width);
-    decode_args.set_height(index_entry.height);
+    DecodeArgsHeader decode_args = {};
+    decode_args.width = index_entry.width;
+    decode_args.height = index_entry.height;
+    decode_args.chroma_format = index_entry.chroma_format;
+    decode_args.codec_type = index_entry.codec_type;
+    decode_args.table_id = entry.table_id;
+    decode_args.column_id = entry.column_id;
+    if (decode_width > 0 && decode_height > 0 &&
+        (decode_width != index_entry.width ||
+         decode_height != index_entry.height)) {
+      decode_args.output_width = decode_width;
+      decode_args.output_height = decode_height;
+    }
+    decode_args.output_format = decode_format;
     // We add the start frame of this item to all frames since the decoder
     // works in terms of absolute frame numbers, instead of item relative
     // frame numbers
-    decode_args.set_start_keyframe(keyframe_positions[start_keyframe_index] +
-                                   start_frame);
-    decode_args.set_end_keyframe(keyframe_positions[end_keyframe_index] +
-                                 start_frame);
+    decode_args.start_keyframe =
+        keyframe_positions[start_keyframe_index] + start_frame;
+    decode_args.end_keyframe =
+        keyframe_positions[end_keyframe_index] + start_frame;
+    std::vector<i64> keyframes;
     for (i64 k : all_keyframes) {
-      decode_args.add_keyframes(k + start_frame);
-    }
-    for (i64 k : all_keyframes_byte_offsets) {
-      decode_args.add_keyframe_byte_offsets(k);
+      keyframes.push_back(k + start_frame);
     }
+    std::vector<i64> absolute_valid_frames;
     for (size_t j = 0; j < intervals.valid_frames[i].size(); ++j) {
-      decode_args.add_valid_frames(intervals.valid_frames[i][j] + start_frame);
+      absolute_valid_frames.push_back(intervals.valid_frames[i][j] +
+                                      start_frame);
     }
-    decode_args.set_encoded_video((i64)buffer);
-    decode_args.set_encoded_video_size(buffer_size);
-
-    size_t size = decode_args.ByteSizeLong();
-    u8* decode_args_buffer = new_buffer(CPU_DEVICE, size);
-    bool result = decode_args.SerializeToArray(decode_args_buffer, size);
-    assert(result);
+    std::vector<i64> skip_frames;
+    // When only keyframes are sampled, none of the frames depending on them
+    // need to be decoded. Keyframes are IDR frames, so each one is output
+    // before the rest of its group and skipping does not reorder output.
+    bool keyframes_only = true;
+    for (i64 f : intervals.valid_frames[i]) {
+      if (!std::binary_search(all_keyframes.begin(), all_keyframes.end(), f)) {
+        keyframes_only = false;
+        break;
+      }
+    }
+    if (keyframes_only) {
+      size_t keyframe_idx = 0;
+      for (i64 f = start_keyframe; f < end_keyframe; ++f) {
+        if (keyframe_idx < all_keyframes.size() &&
+            all_keyframes[keyframe_idx] == f) {
+          keyframe_idx++;
+          continue;
+        }
+        skip_frames.push_back(f + start_frame);
+      }
+      profiler.increment("keyframe_only_intervals", 1);
+    } else {
+      // Non-reference frames which are not sampled never need to be decoded
+      const std::vector<i64>& non_ref_frames = index_entry.non_ref_frames;
+      const std::vector<i64>& valid_frames = intervals.valid_frames[i];
+      auto it = std::lower_bound(non_ref_frames.begin(), non_ref_frames.end(),
+                                 start_keyframe);
+      size_t valid_idx = 0;
+      for (; it != non_ref_frames.end() && *it < end_keyframe; ++it) {
+        while (valid_idx < valid_frames.size() &&
+               valid_frames[valid_idx] < *it) {
+          valid_idx++;
+        }
+        if (valid_idx < valid_frames.size() && valid_frames[valid_idx] == *it) {
+          continue;
+        }
+        skip_frames.push_back(*it + start_frame);
+      }
+    }
+    decode_args.encoded_video = (i64)buffer;
+    decode_args.encoded_video_size = buffer_size;
+    decode_args.num_keyframes = keyframes.size();
+    decode_args.num_keyframe_byte_offsets = all_keyframes_byte_offsets.size();
+    decode_args.num_valid_frames = absolute_valid_frames.size();
+    decode_args.num_skip_frames = skip_frames.size();
+
+    size_t size;
+    u8* decode_args_buffer = new_decode_args(
+        decode_args, keyframes.data(), all_keyframes_byte_offsets.data(),
+        absolute_valid_frames.data(), skip_frames.data(), size);
     insert_element(element_list, decode_args_buffer, size);
   }
 }
@@ -415,9 +677,283 @@ void LoadWorker::read_other_column(i32 table_id, i32 column_id, i32 item_id,
                                    const std::vector<i64>& rows,
                                    ElementList& element_list) {
   const std::vector<i64>& valid_offsets = rows;
+  ItemMetadataCache::Offsets item_offsets =
+      element_offsets(table_id, column_id, item_id);
+  const std::vector<u64>& offsets = *item_offsets;
+  std::string path =
+      item_data_path(table_metadata_->at(table_id), column_id, item_id);
+
+  // Determine start and end position of elements to read in file
+  u64 start_offset = offsets[item_start];
+  u64 end_offset = offsets[item_end];
+
+  // Local item files are mapped and the elements point into the mapping, so
+  // nothing is copied. Pages of rows that are not requested are never read.
+  if (can_map_items(table_metadata_->at(table_id)) &&
+      end_offset > start_offset) {
+    u8* block = new_mapped_block_buffer(path, start_offset,
+                                        end_offset - start_offset,
+                                        valid_offsets.size());
+    if (block != nullptr) {
+      for (i64 row : valid_offsets) {
+        size_t buffer_size =
+            static_cast<size_t>(offsets[row + 1] - offsets[row]);
+        insert_element(element_list, block + (offsets[row] - start_offset),
+                       buffer_size);
+      }
+      return;
+    }
+  }
+
+  std::vector<RangeReader::Range> ranges =
+      element_ranges(offsets, item_start, item_end, rows);
+  range_reader_->read(path, ranges);
+  if (is_sparse(item_start, item_end, rows)) {
+    for (const RangeReader::Range& range : ranges) {
+      insert_element(element_list, range.buffer, range.size);
+    }
+  } else {
+    u8* element_data = ranges[0].buffer;
+
+    // Extract individual elements and insert into output work entry
+    for (i64 row : valid_offsets) {
+      size_t buffer_size = static_cast<size_t>(offsets[row + 1] - offsets[row]);
+      u8* buffer = new_buffer(CPU_DEVICE, buffer_size);
+      memcpy(buffer, element_data + (offsets[row] - start_offset),
+             buffer_size);
+      insert_element(element_list, buffer, buffer_size);
+    }
+    delete_buffer(CPU_DEVICE, element_data);
+  }
+}
+
+bool LoadWorker::can_map_items(const TableMetadata& table_meta) {
+  // The master only hands out tasks reading tables whose bulk job finished,
+  // and their item files are write once from then on: compaction and
+  // appended segments write files of their own, a deleted table's files
+  // are left in storage, and speculative attempts stage their files under
+  // attempt paths until the winner's are renamed into place, which keeps
+  // existing mappings intact. The items of ephemeral tables are held in the
+  // intermediate stores of the workers that wrote them, not in storage.
+  return local_storage_ && !table_meta.get_descriptor().ephemeral();
+}
+
+bool LoadWorker::can_read_directly(const TableMetadata& table_meta,
+                                   i32 column_id) {
+  return direct_reads_ && !table_meta.get_descriptor().ephemeral() &&
+         table_meta.column_codec(column_id).empty();
+}
+
+DirectRead LoadWorker::direct_read(i32 table_id, i32 column_id, i32 item_id,
+                                   i32 item_start, i32 item_end,
+                                   const std::vector<i64>& rows) {
+  ItemMetadataCache::Offsets item_offsets =
+      element_offsets(table_id, column_id, item_id);
+  const std::vector<u64>& offsets = *item_offsets;
+  // Only the span from the first to the last requested row is read
+  i64 first_row = *std::min_element(rows.begin(), rows.end());
+  i64 last_row = *std::max_element(rows.begin(), rows.end());
+  DirectRead read;
+  read.path = item_data_path(table_metadata_->at(table_id), column_id, item_id);
+  read.offset = offsets[first_row];
+  read.size = offsets[last_row + 1] - offsets[first_row];
+  for (i64 row : rows) {
+    read.row_offsets.push_back(offsets[row] - read.offset);
+    read.row_sizes.push_back(offsets[row + 1] - offsets[row]);
+  }
+  return read;
+}
+
+bool LoadWorker::is_sparse(i64 item_start, i64 item_end,
+                           const std::vector<i64>& rows) {
+  return (item_end - item_start) / (i64)rows.size() >=
+         load_sparsity_threshold_;
+}
+
+std::vector<RangeReader::Range> LoadWorker::element_ranges(
+    const std::vector<u64>& offsets, i64 item_start, i64 item_end,
+    const std::vector<i64>& rows) {
+  // If the requested elements are sufficiently sparse by some threshold, we
+  // read each element individually, merging nearby elements into shared
+  // requests. Otherwise, we read the entire block and copy out only the
+  // necessary elements.
+  std::vector<RangeReader::Range> ranges;
+  if (is_sparse(item_start, item_end, rows)) {
+    ranges.reserve(rows.size());
+    for (i64 row : rows) {
+      ranges.push_back(RangeReader::Range{
+          offsets[row], offsets[row + 1] - offsets[row], nullptr});
+    }
+  } else {
+    ranges.push_back(RangeReader::Range{
+        offsets[item_start], offsets[item_end] - offsets[item_start],
+        nullptr});
+  }
+  return ranges;
+}
+
+const VideoIndexEntry& LoadWorker::video_index(i32 table_id, i32 column_id,
+                                               i32 item_id) {
+  auto key = std::make_tuple(table_id, column_id, item_id);
+  auto it = index_.find(key);
+  if (it == index_.end()) {
+    const proto::TableDescriptor& descriptor =
+        table_metadata_->at(table_id).get_descriptor();
+    i64 timestamp = descriptor.timestamp();
+    VideoIndexCache::Index index =
+        video_index_cache_->get(table_id, column_id, item_id, timestamp);
+    if (!index) {
+      index = std::make_shared<const VideoIndexEntry>(read_video_index(
+          storage_.get(), table_id, column_id, item_id,
+          descriptor.ephemeral() ? nullptr : file_pool_,
+          descriptor.ephemeral()));
+      video_index_cache_->put(table_id, column_id, item_id, timestamp, index);
+      profiler_.increment("video_index_cache_misses", 1);
+    } else {
+      profiler_.increment("video_index_cache_hits", 1);
+    }
+    it = index_.insert(std::make_pair(key, std::move(index))).first;
+  }
+  return *it->second;
+}
+
+const VideoIndexEntry& LoadWorker::decode_video_index(
+    const proto::LoadSample& sample, i32 item_id) {
+  i32 table_id = sample.table_id();
+  i32 column_id = sample.column_id();
+  const VideoIndexEntry& entry = video_index(table_id, column_id, item_id);
+  const TableMetadata& table_meta = table_metadata_->at(table_id);
+  if (sample.decode_width() <= 0 || sample.decode_height() <= 0 ||
+      !table_meta.has_column(proxy_column_name()) ||
+      table_meta.column_name(column_id) != frame_column_name()) {
+    return entry;
+  }
+  const VideoIndexEntry& proxy = video_index(
+      table_id, table_meta.column_id(proxy_column_name()), item_id);
+  if (proxy.width >= sample.decode_width() &&
+      proxy.height >= sample.decode_height() && proxy.width < entry.width) {
+    return proxy;
+  }
+  return entry;
+}
+
+void LoadWorker::see_table(const TableMetadata& table_meta) {
+  const proto::TableDescriptor& descriptor = table_meta.get_descriptor();
+  if (!seen_tables_.insert(descriptor.id()).second) {
+    return;
+  }
+  if (block_cache_ != nullptr) {
+    // Cached blocks of an earlier table with the same id are stale
+    block_cache_->validate_table(descriptor.id(), descriptor.timestamp());
+  }
+  if (intermediates_ != nullptr && descriptor.ephemeral()) {
+    intermediates_->add_table_locations(descriptor);
+  }
+}
+
+void LoadWorker::prefetch(const LoadWorkEntry& entry, i32 item_size) {
+  // Whatever is left over was prefetched for a task that never used it
+  range_reader_->drop_prefetched();
+
+  i64 total_rows = 0;
+  for (auto& sample : entry.samples()) {
+    total_rows = std::max((i64)sample.input_row_ids_size(), total_rows);
+  }
+  // Walk the task in the same io packets that yield will read it in, so the
+  // planned ranges match the ones read later
+  for (i64 current_row = 0; current_row < total_rows;
+       current_row += item_size) {
+    for (const proto::LoadSample& sample : entry.samples()) {
+      i32 table_id = sample.table_id();
+      const TableMetadata& table_meta = table_metadata_->at(table_id);
+      see_table(table_meta);
+
+      i64 sample_rows = sample.input_row_ids_size();
+      i64 row_start = std::min(current_row, sample_rows);
+      i64 row_end = std::min(current_row + item_size, sample_rows);
+      if (row_start == row_end) {
+        continue;
+      }
+      std::vector<i64> rows(sample.input_row_ids().begin() + row_start,
+                            sample.input_row_ids().begin() + row_end);
+      RowIntervals intervals = slice_into_row_intervals(table_meta, rows);
+
+      i32 col_id = sample.column_id();
+      bool is_video = table_meta.column_type(col_id) == ColumnType::Video;
+      for (size_t i = 0; i < intervals.item_ids.size(); ++i) {
+        i32 item_id = intervals.item_ids[i];
+        const std::vector<i64>& valid_offsets = intervals.valid_offsets[i];
+        std::string path = item_data_path(table_meta, col_id, item_id);
+        if (is_video) {
+          const VideoIndexEntry& entry = decode_video_index(sample, item_id);
+          VideoIndexEntry slice;
+          if (entry.keyframe_index) {
+            slice = slice_video_index(entry, valid_offsets);
+          }
+          const VideoIndexEntry& index_entry =
+              entry.keyframe_index ? slice : entry;
+          if (index_entry.codec_type != proto::VideoDescriptor::RAW) {
+            range_reader_->prefetch(
+                index_entry.data_path(),
+                keyframe_ranges(index_entry, slice_into_video_intervals(
+                                                 index_entry.keyframe_positions,
+                                                 valid_offsets)));
+            continue;
+          }
+        }
+        if (can_map_items(table_meta)) {
+          // Mapped instead of read
+          continue;
+        }
+        i64 item_start;
+        i64 item_end;
+        std::tie(item_start, item_end) = intervals.item_intervals[i];
+        ItemMetadataCache::Offsets offsets =
+            element_offsets(table_id, col_id, item_id);
+        range_reader_->prefetch(
+            path, element_ranges(*offsets, item_start, item_end,
+                                 valid_offsets));
+      }
+    }
+  }
+}
+
+ItemMetadataCache::Offsets LoadWorker::element_offsets(i32 table_id,
+                                                       i32 column_id,
+                                                       i32 item_id) {
+  const TableMetadata& table_meta = table_metadata_->at(table_id);
+  i64 timestamp = table_meta.get_descriptor().timestamp();
+  ItemMetadataCache::Offsets cached =
+      item_metadata_cache_->get(table_id, column_id, item_id, timestamp);
+  if (cached) {
+    return cached;
+  }
+
+  if (is_packed_column(table_meta, column_id)) {
+    // The footer indexes every column of the item, so all of them are
+    // cached from the one read
+    std::unique_ptr<RandomReadFile> file;
+    BACKOFF_FAIL(make_unique_random_read_file(
+        storage_.get(), table_item_packed_path(table_id, item_id), file));
+    std::vector<std::vector<u64>> columns =
+        read_packed_item_offsets(file.get());
+    LOG_IF(FATAL, column_id >= (i32)columns.size())
+        << "Packed item " << file->path() << " has no column " << column_id;
+    ItemMetadataCache::Offsets offsets;
+    for (i32 c = 0; c < (i32)columns.size(); ++c) {
+      if (!is_packed_column(table_meta, c)) {
+        continue;
+      }
+      auto column = std::make_shared<std::vector<u64>>(std::move(columns[c]));
+      item_metadata_cache_->put(table_id, c, item_id, timestamp, column);
+      if (c == column_id) {
+        offsets = column;
+      }
+    }
+    return offsets;
+  }
 
   // Read metadata file to determine num rows and sizes
-  u64 num_elements = 0;
   std::vector<i64> element_sizes;
   {
     std::unique_ptr<RandomReadFile> file;
@@ -432,7 +968,7 @@ void LoadWorker::read_other_column(i32 table_id, i32 column_id, i32 item_id,
     // Read number of elements in file
     u64 pos = 0;
     while (pos < file_size) {
-      num_elements += s_read<u64>(file.get(), pos);
+      u64 num_elements = s_read<u64>(file.get(), pos);
 
       // Read element sizes from work item file header
       size_t prev_size = element_sizes.size();
@@ -444,64 +980,13 @@ void LoadWorker::read_other_column(i32 table_id, i32 column_id, i32 item_id,
     assert(pos == file_size);
   }
 
-  std::unique_ptr<RandomReadFile> file;
-  StoreResult result;
-  BACKOFF_FAIL(make_unique_random_read_file(
-      storage_.get(), table_item_output_path(table_id, column_id, item_id),
-      file));
-
-  u64 file_size = 0;
-  BACKOFF_FAIL(file->get_size(file_size));
-
-  u64 pos = 0;
-  // Determine start and end position of elements to read in file
-  u64 start_offset = 0;
-  for (i64 i = 0; i < item_start; ++i) {
-    start_offset += element_sizes[i];
-  }
-  u64 end_offset = start_offset;
-  for (i64 i = item_start; i < item_end; ++i) {
-    end_offset += element_sizes[i];
-  }
-
-  // If the requested elements are sufficiently sparse by some threshold, we
-  // read each element individually. Otherwise, we read the entire block and
-  // copy out only the necessary elements.
-  if ((item_end - item_start) / rows.size() >= load_sparsity_threshold_) {
-    for (i32 row : rows) {
-      size_t buffer_size = static_cast<size_t>(element_sizes[row]);
-      u8* buffer = new_buffer(CPU_DEVICE, buffer_size);
-      u64 row_offset = pos + start_offset;
-      for (i32 i = item_start; i < row; ++i) {
-        row_offset += element_sizes[i];
-      }
-      s_read(file.get(), buffer, buffer_size, row_offset);
-      insert_element(element_list, buffer, buffer_size);
-    }
-  } else {
-    pos += start_offset;
-
-    u64 element_data_size = end_offset - start_offset;
-    std::vector<u8> element_data(element_data_size);
-
-    // Read chunk of file corresponding to requested elements
-    s_read(file.get(), element_data.data(), element_data.size(), pos);
-
-    // Extract individual elements and insert into output work entry
-    u64 offset = 0;
-    size_t valid_idx = 0;
-    for (i32 i = item_start; i < item_end; ++i) {
-      size_t buffer_size = static_cast<size_t>(element_sizes[i]);
-      if (i == valid_offsets[valid_idx]) {
-        u8* buffer = new_buffer(CPU_DEVICE, buffer_size);
-        memcpy(buffer, element_data.data() + offset, buffer_size);
-        insert_element(element_list, buffer, buffer_size);
-        valid_idx++;
-      }
-      offset += buffer_size;
-    }
-    assert(valid_idx == valid_offsets.size());
+  auto offsets = std::make_shared<std::vector<u64>>(element_sizes.size() + 1);
+  (*offsets)[0] = 0;
+  for (size_t i = 0; i < element_sizes.size(); ++i) {
+    (*offsets)[i + 1] = (*offsets)[i] + element_sizes[i];
   }
+  item_metadata_cache_->put(table_id, column_id, item_id, timestamp, offsets);
+  return offsets;
 }
 }
 }
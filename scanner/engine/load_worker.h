@@ -15,12 +15,19 @@
 
 #pragma once
 
+#include "scanner/engine/intermediate_store.h"
+#include "scanner/engine/item_metadata_cache.h"
+#include "scanner/engine/read_file_pool.h"
+#include "scanner/engine/video_index_cache.h"
+#include "scanner/engine/range_reader.h"
 #include "scanner/engine/runtime.h"
 #include "scanner/engine/video_index_entry.h"
 #include "scanner/engine/table_meta_cache.h"
 #include "scanner/util/common.h"
 #include "scanner/util/queue.h"
 
+#include <set>
+
 namespace scanner {
 namespace internal {
 
@@ -34,6 +41,18 @@ struct LoadWorkerArgs {
   i32 load_sparsity_threshold;
   i32 io_packet_size;
   i32 work_packet_size;
+  // Shared by all load workers of the process
+  ItemMetadataCache* item_metadata_cache;
+  BlockCache* block_cache;
+  VideoIndexCache* video_index_cache;
+  ReadFilePool* file_pool;
+  // Sample hardware performance counters around reads
+  bool perf_counters;
+  // Data files of ephemeral tables
+  IntermediateStore* intermediates;
+  // Leave uncompressed elements of local tables for the pre-evaluate
+  // workers to read into their device's memory
+  bool direct_reads;
 };
 
 class LoadWorker {
@@ -46,22 +65,81 @@ class LoadWorker {
 
   bool done();
 
+  //! Starts reading the data of an upcoming task, sliced into item_size
+  //! rows as yield will be, so that its reads are served from memory
+  void prefetch(const LoadWorkEntry& entry, i32 item_size);
+
  private:
+  //! Validates the block cache against, and locates the items of, a table
+  //! the first time this worker reads it
+  void see_table(const TableMetadata& table_meta);
+
   void read_other_column(i32 table_id, i32 column_id, i32 item_id,
                          i32 item_start, i32 item_end,
                          const std::vector<i64>& rows,
                          ElementList& element_list);
+
+  // Whether the item files of a table can be mapped instead of read. A
+  // mapping of a file that is truncated or rewritten in place faults when
+  // touched, so this holds only for tables whose item files never change.
+  bool can_map_items(const TableMetadata& table_meta);
+
+  // Whether read_other_column's rows of a column can be left to a
+  // DirectRead, and the read itself
+  bool can_read_directly(const TableMetadata& table_meta, i32 column_id);
+  DirectRead direct_read(i32 table_id, i32 column_id, i32 item_id,
+                         i32 item_start, i32 item_end,
+                         const std::vector<i64>& rows);
+
+  // Byte offset of every element of an item in its data file, plus the end
+  // of its elements, read from the item's metadata file or the footer of
+  // its packed item
+  ItemMetadataCache::Offsets element_offsets(i32 table_id, i32 column_id,
+                                             i32 item_id);
+
+  bool is_sparse(i64 item_start, i64 item_end, const std::vector<i64>& rows);
+
+  // Ranges read_other_column reads for rows of an item
+  std::vector<RangeReader::Range> element_ranges(
+      const std::vector<u64>& offsets, i64 item_start, i64 item_end,
+      const std::vector<i64>& rows);
+
+  const VideoIndexEntry& video_index(i32 table_id, i32 column_id,
+                                     i32 item_id);
+
+  // Index of the stream to decode an item of a sample's video column from:
+  // the table's proxy when the frames are decoded to no more than its size,
+  // so full resolution decoding is skipped, and the column itself otherwise
+  const VideoIndexEntry& decode_video_index(const proto::LoadSample& sample,
+                                            i32 item_id);
+
   const i32 node_id_;
   const i32 worker_id_;
   Profiler& profiler_;
   // Setup a distinct storage backend for each IO thread
   std::unique_ptr<storehouse::StorageBackend> storage_;
+  // Issues the reads of sparse rows and keyframe intervals
+  std::unique_ptr<RangeReader> range_reader_;
+  // The database is on the local file system, so item files can be mapped
+  // instead of read
+  bool local_storage_;
+  bool direct_reads_;
   // Caching table metadata
   DatabaseMetadata meta_;
   std::unique_ptr<TableMetaCache> table_metadata_;
-  // To ammortize opening files
+  // Indexes used by the current task, held so that references to them stay
+  // valid if the shared cache evicts them
   i32 last_table_id_ = -1;
-  std::map<std::tuple<i32, i32, i32>, VideoIndexEntry> index_;
+  std::map<std::tuple<i32, i32, i32>, VideoIndexCache::Index> index_;
+  ItemMetadataCache* item_metadata_cache_;
+  VideoIndexCache* video_index_cache_;
+  ReadFilePool* file_pool_;
+  IntermediateStore* intermediates_;
+  // Null for local databases
+  BlockCache* block_cache_;
+  // Tables whose descriptors were handed to the block cache and the
+  // intermediate store
+  std::set<i32> seen_tables_;
   i32 load_sparsity_threshold_;
   i32 io_packet_size_;
   i32 work_packet_size_;
@@ -75,9 +153,10 @@ class LoadWorker {
   i64 total_rows_;
 };
 
-void read_video_column(Profiler& profiler,
-                       const VideoIndexEntry& index_entry,
+void read_video_column(Profiler& profiler, RangeReader& range_reader,
+                       const VideoIndexEntry& entry,
                        const std::vector<i64>& rows, i64 start_offset,
-                       ElementList& element_list);
+                       i32 decode_width, i32 decode_height,
+                       PixelFormat decode_format, ElementList& element_list);
 }
 }
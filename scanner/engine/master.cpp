@@ -17,6 +17,9 @@
 #include "scanner/engine/ingest.h"
 #include "scanner/engine/sampler.h"
 #include "scanner/engine/dag_analysis.h"
+#include "scanner/engine/kernel_registry.h"
+#include "scanner/engine/op_registry.h"
+#include "scanner/util/compression.h"
 #include "scanner/util/cuda.h"
 #include "scanner/util/progress_bar.h"
 #include "scanner/util/util.h"
@@ -24,12 +27,109 @@
 #include "scanner/engine/python_kernel.h"
 
 #include <grpc/support/log.h>
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdlib>
+#include <functional>
+#include <limits>
 #include <set>
 #include <mutex>
 
 namespace scanner {
 namespace internal {
 
+namespace {
+// Whether an interrupted bulk job computes exactly what the new one would,
+// so that its finished tasks can be kept
+bool same_bulk_job(const proto::BulkJobDescriptor& previous,
+                   const proto::BulkJobDescriptor& next) {
+  if (!previous.interrupted() ||
+      previous.io_packet_size() != next.io_packet_size() ||
+      previous.work_packet_size() != next.work_packet_size() ||
+      previous.jobs_size() != next.jobs_size() ||
+      previous.ops_size() != next.ops_size() ||
+      previous.input_tables_size() != next.input_tables_size()) {
+    return false;
+  }
+  // A job reading a table that was rewritten since, even under the same
+  // name, computes something else
+  for (i32 i = 0; i < next.input_tables_size(); ++i) {
+    if (previous.input_tables(i).id() != next.input_tables(i).id() ||
+        previous.input_tables(i).timestamp() !=
+            next.input_tables(i).timestamp()) {
+      return false;
+    }
+  }
+  for (i32 i = 0; i < next.jobs_size(); ++i) {
+    if (previous.jobs(i).SerializeAsString() !=
+        next.jobs(i).SerializeAsString()) {
+      return false;
+    }
+  }
+  for (i32 i = 0; i < next.ops_size(); ++i) {
+    if (previous.ops(i).SerializeAsString() !=
+        next.ops(i).SerializeAsString()) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Appends the jobs of the bulk job's groups to its jobs
+void expand_job_groups(proto::BulkJobParameters& params) {
+  for (const proto::JobGroup& group : params.job_groups()) {
+    i32 num_inputs = group.inputs_size();
+    for (i32 j = 0; j < group.output_table_names_size(); ++j) {
+      proto::Job* job = params.add_jobs();
+      job->set_output_table_name(group.output_table_names(j));
+      for (i32 i = 0; i < num_inputs; ++i) {
+        proto::ColumnInput* input = job->add_inputs();
+        input->CopyFrom(group.inputs(i));
+        input->set_table_name(group.input_table_names(j * num_inputs + i));
+      }
+      job->mutable_sampling_args_assignment()->CopyFrom(
+          group.sampling_args_assignment());
+    }
+  }
+  params.clear_job_groups();
+}
+
+// Unallocated tasks the locality scheduler chooses from, and how many recent
+// grants per worker it compares them against
+const size_t LOCALITY_WINDOW_TASKS = 64;
+const size_t LOCALITY_HISTORY_TASKS = 8;
+// A running task is a straggler once it has run this many times longer than
+// the median finished task, measured over at least this many tasks
+const f64 SPECULATION_SLOWDOWN = 3.0;
+const size_t SPECULATION_MIN_FINISHED_TASKS = 8;
+// A worker's measured throughput is trusted once it has retired this many
+// tasks. The last tasks of a job are held back from a worker expected to
+// finish them this many times later than the best other worker.
+const i64 WEIGHTING_MIN_RETIRED_TASKS = 4;
+const f64 WEIGHTING_TAIL_SLOWDOWN = 1.5;
+// Longest-first scheduling refits its cost model and reorders the
+// remaining tasks every this many finished tasks
+const i64 COST_MODEL_REFIT_TASKS = 16;
+// How often the tasks finished so far are saved while a bulk job runs
+const i64 CHECKPOINT_INTERVAL_MS = 30000;
+// Workers heard from over their work stream this recently are not pinged
+const i64 WORK_STREAM_PING_SKIP_MS = 5000;
+// How often the workers of a running bulk job are pinged
+const i64 WORKER_PING_INTERVAL_MS = 5000;
+// Longest an IsJobDone call waits for the bulk job to finish
+const i32 MAX_JOB_DONE_WAIT_MS = 60000;
+// Profile guided placement reads the op profiles of this many of the most
+// recent bulk jobs. Without any measured transfers, moving a row between
+// devices is assumed to cost about as much as copying a 1080p frame.
+const size_t PLACEMENT_PROFILE_BULK_JOBS = 8;
+const f64 PLACEMENT_DEFAULT_TRANSFER_NS_PER_ROW = 1000000;
+// Bulk jobs whose DAG analysis is kept for resubmission
+const size_t ANALYSIS_CACHE_BULK_JOBS = 4;
+// Videos per IngestVideoSet call in a distributed ingest
+const i64 INGEST_VIDEOS_PER_WORKER_CALL = 32;
+}
+
 MasterImpl::MasterImpl(DatabaseParameters& params)
   : watchdog_awake_(true), db_params_(params), bar_(nullptr) {
   init_glog("scanner_master");
@@ -41,12 +141,13 @@ MasterImpl::MasterImpl(DatabaseParameters& params)
 }
 
 MasterImpl::~MasterImpl() {
+  metrics_server_.reset();
   trigger_shutdown_.set();
   {
     std::unique_lock<std::mutex> lock(finished_mutex_);
     finished_ = true;
   }
-  finished_cv_.notify_one();
+  finished_cv_.notify_all();
 
   stop_job_processor();
 
@@ -95,20 +196,13 @@ grpc::Status MasterImpl::RegisterWorker(grpc::ServerContext* context,
   registration->set_node_id(node_id);
   worker_addresses_[node_id] = worker_address;
   worker_active_[node_id] = true;
+  worker_machine_params_[node_id] = worker_info->params();
 
-  // Load ops into worker
-  for (const std::string& so_path : so_paths_) {
-    grpc::ClientContext ctx;
-    proto::OpPath op_path;
-    proto::Empty empty;
-    op_path.set_path(so_path);
-    grpc::Status status = workers_[node_id]->LoadOp(&ctx, op_path, &empty);
-    LOG_IF(FATAL, !status.ok())
-        << "Master could not load op for worker at " << worker_address << " ("
-        << status.error_code() << "): " << status.error_message();
-  }
-
-  if (!finished_) {
+  // Op libraries are loaded by the jobs that use them, so registering many
+  // workers at once does not wait on each of them loading every library.
+  // Workers registering while a bulk job runs join it right away. Those
+  // registering before it is sent out are started along with the rest.
+  if (!finished_ && job_workers_started_) {
     // Update locals
     std::vector<std::string> split_addr = split(worker_address, ':');
     std::string sans_port = split_addr[0];
@@ -159,13 +253,58 @@ grpc::Status MasterImpl::IngestVideos(grpc::ServerContext* context,
                                       const proto::IngestParameters* params,
                                       proto::IngestResult* result) {
   std::vector<FailedVideo> failed_videos;
+  if (params->append()) {
+    // Segments are short and ordered per table, so they stay on the master
+    result->mutable_result()->CopyFrom(append_videos(
+        db_params_.storage_config, db_params_.db_path,
+        std::vector<std::string>(params->table_names().begin(),
+                                 params->table_names().end()),
+        std::vector<std::string>(params->video_paths().begin(),
+                                 params->video_paths().end()),
+        params->inplace(), failed_videos));
+    for (auto& failed : failed_videos) {
+      result->add_failed_paths(failed.path);
+      result->add_failed_messages(failed.message);
+    }
+    return grpc::Status::OK;
+  }
+
+  VideoSetIngester ingester = nullptr;
+  if (params->distributed()) {
+    std::vector<std::pair<i32, proto::Worker::Stub*>> workers;
+    {
+      std::unique_lock<std::mutex> lk(work_mutex_);
+      for (auto& kv : workers_) {
+        if (worker_active_.at(kv.first)) {
+          workers.emplace_back(kv.first, kv.second.get());
+        }
+      }
+    }
+    if (workers.empty()) {
+      LOG(WARNING) << "No active workers to distribute ingest across. "
+                   << "Ingesting on the master.";
+    } else {
+      bool inplace = params->inplace();
+      i32 proxy_height = params->proxy_height();
+      ingester = [this, workers, inplace, proxy_height](
+          const std::vector<std::string>& table_names,
+          const std::vector<i32>& table_ids,
+          const std::vector<std::string>& paths, std::vector<bool>& bad_videos,
+          std::vector<std::string>& bad_messages) {
+        distributed_ingest(workers, table_names, table_ids, paths, inplace,
+                           proxy_height, bad_videos, bad_messages);
+      };
+    }
+  }
+
   result->mutable_result()->CopyFrom(
       ingest_videos(db_params_.storage_config, db_params_.db_path,
                     std::vector<std::string>(params->table_names().begin(),
                                              params->table_names().end()),
                     std::vector<std::string>(params->video_paths().begin(),
                                              params->video_paths().end()),
-                    failed_videos));
+                    params->inplace(), params->proxy_height(), failed_videos,
+                    ingester));
   for (auto& failed : failed_videos) {
     result->add_failed_paths(failed.path);
     result->add_failed_messages(failed.message);
@@ -173,6 +312,99 @@ grpc::Status MasterImpl::IngestVideos(grpc::ServerContext* context,
   return grpc::Status::OK;
 }
 
+grpc::Status MasterImpl::IngestImages(
+    grpc::ServerContext* context, const proto::IngestImagesParameters* params,
+    proto::IngestResult* result) {
+  std::vector<FailedVideo> failed_images;
+  result->mutable_result()->CopyFrom(ingest_images(
+      db_params_.storage_config, db_params_.db_path, params->table_name(),
+      std::vector<std::string>(params->image_paths().begin(),
+                               params->image_paths().end()),
+      failed_images));
+  for (auto& failed : failed_images) {
+    result->add_failed_paths(failed.path);
+    result->add_failed_messages(failed.message);
+  }
+  return grpc::Status::OK;
+}
+
+void MasterImpl::distributed_ingest(
+    const std::vector<std::pair<i32, proto::Worker::Stub*>>& workers,
+    const std::vector<std::string>& table_names,
+    const std::vector<i32>& table_ids, const std::vector<std::string>& paths,
+    bool inplace, i32 proxy_height, std::vector<bool>& bad_videos,
+    std::vector<std::string>& bad_messages) {
+  i64 num_videos = table_names.size();
+  std::vector<u8> failed(num_videos, false);
+  bad_messages.assign(num_videos, "");
+
+  // Each worker repeatedly takes the next chunk of videos, so faster workers
+  // ingest more of them. A chunk whose worker fails is ingested here.
+  std::unique_ptr<storehouse::StorageBackend> storage{
+      storehouse::StorageBackend::make_from_config(db_params_.storage_config)};
+  std::atomic<i64> next_chunk{0};
+  std::atomic<i64> videos_done{0};
+  std::vector<std::thread> threads;
+  for (auto& worker : workers) {
+    threads.emplace_back([&, worker]() {
+      while (true) {
+        i64 start = (next_chunk++) * INGEST_VIDEOS_PER_WORKER_CALL;
+        if (start >= num_videos) {
+          break;
+        }
+        i64 end = std::min(num_videos, start + INGEST_VIDEOS_PER_WORKER_CALL);
+
+        proto::IngestParameters chunk;
+        for (i64 i = start; i < end; ++i) {
+          chunk.add_table_names(table_names[i]);
+          chunk.add_table_ids(table_ids[i]);
+          chunk.add_video_paths(paths[i]);
+        }
+        chunk.set_inplace(inplace);
+        chunk.set_proxy_height(proxy_height);
+        grpc::ClientContext ctx;
+        proto::IngestResult chunk_result;
+        grpc::Status status =
+            worker.second->IngestVideoSet(&ctx, chunk, &chunk_result);
+        if (status.ok()) {
+          for (i32 f = 0; f < chunk_result.failed_indices_size(); ++f) {
+            i64 i = start + chunk_result.failed_indices(f);
+            failed[i] = true;
+            bad_messages[i] = chunk_result.failed_messages(f);
+          }
+        } else {
+          LOG(WARNING) << "Worker " << worker.first << " failed to ingest "
+                       << "videos " << start << " to " << end << " ("
+                       << status.error_message() << "). Ingesting them on "
+                       << "the master.";
+          std::vector<bool> chunk_bad;
+          std::vector<std::string> chunk_messages;
+          ingest_video_set(
+              storage.get(),
+              std::vector<std::string>(table_names.begin() + start,
+                                       table_names.begin() + end),
+              std::vector<i32>(table_ids.begin() + start,
+                               table_ids.begin() + end),
+              std::vector<std::string>(paths.begin() + start,
+                                       paths.begin() + end),
+              inplace, proxy_height, std::thread::hardware_concurrency(),
+              chunk_bad, chunk_messages);
+          for (i64 i = start; i < end; ++i) {
+            failed[i] = chunk_bad[i - start];
+            bad_messages[i] = chunk_messages[i - start];
+          }
+        }
+        i64 done = (videos_done += end - start);
+        LOG(INFO) << "Ingested " << done << "/" << num_videos << " videos";
+      }
+    });
+  }
+  for (std::thread& t : threads) {
+    t.join();
+  }
+  bad_videos.assign(failed.begin(), failed.end());
+}
+
 grpc::Status MasterImpl::NextWork(grpc::ServerContext* context,
                                   const proto::NodeInfo* node_info,
                                   proto::NewWork* new_work) {
@@ -184,8 +416,172 @@ grpc::Status MasterImpl::NextWork(grpc::ServerContext* context,
     return grpc::Status::OK;
   }
 
-  // If we do not have any outstanding work, try and create more
-  if (unallocated_job_tasks_.empty()) {
+  if (!assign_next_task(node_info->node_id(), new_work)) {
+    // No more work
+    new_work->set_no_more_work(true);
+  }
+  return grpc::Status::OK;
+}
+
+grpc::Status MasterImpl::NextWorkBatch(grpc::ServerContext* context,
+                                       const proto::NextWorkParameters* params,
+                                       proto::NewWorkBatch* new_work) {
+  std::unique_lock<std::mutex> lk(work_mutex_);
+  VLOG(1) << "Master received NextWorkBatch command";
+  grant_tasks(params->node_id(), std::max(1, params->max_tasks()), new_work);
+  return grpc::Status::OK;
+}
+
+grpc::Status MasterImpl::WorkStream(
+    grpc::ServerContext* context,
+    grpc::ServerReaderWriter<proto::MasterMessage, proto::WorkerMessage>*
+        stream) {
+  VLOG(1) << "Master opened work stream";
+  // Tasks the worker has asked for that have not been granted yet
+  i32 credit = 0;
+  bool sent_no_more_work = false;
+  proto::WorkerMessage message;
+  while (stream->Read(&message)) {
+    proto::MasterMessage reply;
+    {
+      std::unique_lock<std::mutex> lk(work_mutex_);
+      i32 node_id = message.node_id();
+      worker_heartbeats_[node_id] = now();
+      if (message.op_profiles_size() > 0) {
+        worker_op_profiles_[node_id].assign(message.op_profiles().begin(),
+                                            message.op_profiles().end());
+      }
+      for (const proto::JobTask& task : message.started()) {
+        auto job_task = std::make_tuple(task.job_id(), task.task_id());
+        if (active_job_tasks_[node_id].count(job_task) > 0) {
+          started_tasks_[node_id].insert(job_task);
+        }
+      }
+      for (const proto::FinishedWorkParameters& params : message.finished()) {
+        finish_task(params);
+      }
+      for (const proto::JobTask& task : message.committed()) {
+        commit_task(node_id,
+                    std::make_tuple(task.job_id(), task.task_id()));
+      }
+      credit += message.wanted_tasks();
+      // Every message, heartbeats included, retries the outstanding grants
+      if (credit > 0 && !sent_no_more_work) {
+        grant_tasks(node_id, credit, reply.mutable_batch());
+        credit -= reply.batch().work_size();
+      }
+      auto cancelled = cancelled_attempts_.find(node_id);
+      if (cancelled != cancelled_attempts_.end()) {
+        for (const std::tuple<i64, i64>& job_task : cancelled->second) {
+          proto::JobTask* task = reply.add_cancelled();
+          task->set_job_id(std::get<0>(job_task));
+          task->set_task_id(std::get<1>(job_task));
+        }
+        cancelled_attempts_.erase(cancelled);
+      }
+      auto commits = commit_attempts_.find(node_id);
+      if (commits != commit_attempts_.end()) {
+        for (const std::tuple<i64, i64>& job_task : commits->second) {
+          proto::JobTask* task = reply.add_commit();
+          task->set_job_id(std::get<0>(job_task));
+          task->set_task_id(std::get<1>(job_task));
+        }
+        commit_attempts_.erase(commits);
+      }
+    }
+    if (reply.batch().work_size() == 0 && !reply.batch().no_more_work() &&
+        reply.cancelled_size() == 0 && reply.commit_size() == 0) {
+      continue;
+    }
+    sent_no_more_work = reply.batch().no_more_work();
+    if (!stream->Write(reply)) {
+      break;
+    }
+  }
+  VLOG(1) << "Master closed work stream";
+  return grpc::Status::OK;
+}
+
+void MasterImpl::grant_tasks(i32 node_id, i32 max_tasks,
+                             proto::NewWorkBatch* new_work) {
+  if (!worker_active_.at(node_id)) {
+    // Worker is not active
+    new_work->set_no_more_work(true);
+    return;
+  }
+
+  if (job_params_.weighted_scheduling()) {
+    max_tasks = weighted_task_limit(node_id, max_tasks);
+    if (max_tasks == 0) {
+      // Held back for faster workers, not finished
+      return;
+    }
+  }
+  for (i32 i = 0; i < max_tasks; ++i) {
+    proto::NewWork work;
+    tasks_waiting_on_state_ = false;
+    if (!assign_next_task(node_id, &work)) {
+      if (tasks_waiting_on_state_) {
+        // Not finished, the worker asks again with its next message
+        break;
+      }
+      if (job_params_.speculative_execution() && task_result_.success() &&
+          !running_tasks_.empty()) {
+        // Keep the worker around to pick up duplicates of stragglers once
+        // it has run out of its own tasks
+        if (active_job_tasks_[node_id].empty() &&
+            assign_speculative_task(node_id, &work)) {
+          new_work->add_work()->Swap(&work);
+        }
+      } else {
+        // No more work
+        new_work->set_no_more_work(true);
+      }
+      break;
+    }
+    new_work->add_work()->Swap(&work);
+  }
+}
+
+grpc::Status MasterImpl::ReturnWork(grpc::ServerContext* context,
+                                    const proto::ReturnWorkParameters* params,
+                                    proto::Empty* empty) {
+  std::unique_lock<std::mutex> lk(work_mutex_);
+  VLOG(1) << "Master received ReturnWork command";
+
+  i32 worker_id = params->node_id();
+  auto active = worker_active_.find(worker_id);
+  if (active == worker_active_.end()) {
+    LOG(WARNING) << "Worker " << worker_id
+                 << " returned tasks but never registered";
+    return grpc::Status(grpc::StatusCode::NOT_FOUND,
+                        "Worker " + std::to_string(worker_id) +
+                            " is not registered");
+  }
+  if (!active->second) {
+    // Tasks of removed workers have already been reinserted
+    return grpc::Status::OK;
+  }
+
+  auto& worker_tasks = active_job_tasks_[worker_id];
+  for (const proto::JobTask& task : params->tasks()) {
+    std::tuple<i64, i64> job_task =
+        std::make_tuple(task.job_id(), task.task_id());
+    if (worker_tasks.erase(job_task) == 0) {
+      continue;
+    }
+    started_tasks_[worker_id].erase(job_task);
+    worker_histories_[worker_id].tasks_assigned -= 1;
+    if (!retract_attempt(worker_id, job_task)) {
+      // Returned tasks are granted before any new ones
+      unallocated_job_tasks_.push_back(job_task);
+    }
+  }
+  return grpc::Status::OK;
+}
+
+bool MasterImpl::generate_next_task() {
+  while (true) {
     // If we have no more samples for this task, try and get another task
     if (next_task_ == num_tasks_) {
       // Check if there are any tasks left
@@ -198,44 +594,403 @@ grpc::Status MasterImpl::NextWork(grpc::ServerContext* context,
     }
 
     // Create more work if possible
-    if (next_task_ < num_tasks_) {
-      i64 current_job = next_job_ - 1;
-      i64 current_task = next_task_;
+    if (next_task_ >= num_tasks_) {
+      return false;
+    }
+    i64 current_job = next_job_ - 1;
+    i64 current_task = next_task_;
+    next_task_++;
+
+    std::tuple<i64, i64> job_task = std::make_tuple(current_job, current_task);
+    if (completed_job_tasks_.count(job_task) > 0) {
+      // Finished by an interrupted run of this bulk job
+      continue;
+    }
+    unallocated_job_tasks_.push_front(job_task);
+    return true;
+  }
+}
 
-      unallocated_job_tasks_.push_front(
-          std::make_tuple(current_job, current_task));
-      next_task_++;
+size_t MasterImpl::pick_local_task(i32 node_id) {
+  const auto& recent = worker_recent_tasks_[node_id];
+  // The oldest task wins ties so that tasks are not starved
+  size_t best = unallocated_job_tasks_.size() - 1;
+  i32 best_score = 0;
+  for (size_t i = unallocated_job_tasks_.size(); i-- > 0;) {
+    i64 job_idx;
+    i64 task_idx;
+    std::tie(job_idx, task_idx) = unallocated_job_tasks_[i];
+    i32 score = 0;
+    for (const std::tuple<i64, i64>& r : recent) {
+      i64 recent_job = std::get<0>(r);
+      i64 recent_task = std::get<1>(r);
+      if (recent_job == job_idx && std::abs(recent_task - task_idx) == 1) {
+        // Adjacent row ranges share the item file and the GOP at the boundary
+        score = std::max(score, 2);
+      } else if (recent_job == job_idx ||
+                 job_input_tables_.at(recent_job) ==
+                     job_input_tables_.at(job_idx)) {
+        // Same source tables, whose item files may be in the worker's cache
+        score = std::max(score, 1);
+      }
+    }
+    if (score > best_score) {
+      best = i;
+      best_score = score;
     }
   }
+  return best;
+}
+
+bool MasterImpl::assign_next_task(i32 node_id, proto::NewWork* new_work) {
+  bool locality = job_params_.task_scheduling() ==
+                  proto::BulkJobParameters::LOCALITY;
+  bool longest_first = job_params_.task_scheduling() ==
+                       proto::BulkJobParameters::LONGEST_FIRST;
+  // If we do not have any outstanding work, try and create more. Scheduling
+  // for locality needs a window of tasks to choose from, and longest-first
+  // compares every task in the bulk job.
+  size_t window = locality ? LOCALITY_WINDOW_TASKS : 1;
+  if (longest_first || state_handoff_) {
+    window = std::numeric_limits<size_t>::max();
+  }
+  while (unallocated_job_tasks_.size() < window && generate_next_task()) {
+  }
+  if (longest_first && task_order_stale_) {
+    sort_tasks_by_cost();
+  }
 
   if (unallocated_job_tasks_.empty()) {
-    // No more work
-    new_work->set_no_more_work(true);
-    return grpc::Status::OK;
+    return false;
   }
 
   // Grab the next task sample
-  std::tuple<i64, i64> job_task_id = unallocated_job_tasks_.back();
-  unallocated_job_tasks_.pop_back();
+  size_t position = unallocated_job_tasks_.size() - 1;
+  if (state_handoff_) {
+    // Only tasks whose predecessor in the job has handed off its state can
+    // run, which keeps one task of each job going at a time
+    bool found = false;
+    for (size_t i = unallocated_job_tasks_.size(); i-- > 0;) {
+      i64 job_idx;
+      i64 task_idx;
+      std::tie(job_idx, task_idx) = unallocated_job_tasks_[i];
+      // After a failed task, the next one starts from a fresh state
+      std::tuple<i64, i64> previous = std::make_tuple(job_idx, task_idx - 1);
+      if (task_idx == 0 || completed_job_tasks_.count(previous) > 0 ||
+          failed_job_tasks_.count(previous) > 0) {
+        position = i;
+        found = true;
+        break;
+      }
+    }
+    if (!found) {
+      tasks_waiting_on_state_ = true;
+      return false;
+    }
+  } else if (locality) {
+    position = pick_local_task(node_id);
+  }
+  std::tuple<i64, i64> job_task_id = unallocated_job_tasks_[position];
+  unallocated_job_tasks_.erase(unallocated_job_tasks_.begin() + position);
+  if (locality) {
+    auto& recent = worker_recent_tasks_[node_id];
+    recent.push_back(job_task_id);
+    if (recent.size() > LOCALITY_HISTORY_TASKS) {
+      recent.pop_front();
+    }
+  }
 
   assert(next_task_ <= num_tasks_);
 
+  fill_new_work(job_task_id, new_work);
+
+  // Track sample assigned to worker
+  active_job_tasks_[node_id].insert(job_task_id);
+  worker_histories_[node_id].tasks_assigned += 1;
+  running_tasks_[job_task_id].push_back(TaskAttempt{node_id, now()});
+
+  return true;
+}
+
+f64 MasterImpl::worker_capability(i32 node_id) {
+  auto it = worker_machine_params_.find(node_id);
+  if (it == worker_machine_params_.end()) {
+    return 1;
+  }
+  const proto::MachineParameters& params = it->second;
+  // Workers run one pipeline per GPU when the job has GPU ops, otherwise
+  // they scale with their cores
+  bool uses_gpus = false;
+  for (const proto::Op& op : job_params_.ops()) {
+    if (op.device_type() == DeviceType::GPU) {
+      uses_gpus = true;
+    }
+  }
+  if (uses_gpus) {
+    return std::max(1, params.gpu_ids_size());
+  }
+  return std::max(1, params.num_cpus());
+}
+
+bool MasterImpl::measured_task_rate(i32 node_id, f64& rate) {
+  auto it = worker_histories_.find(node_id);
+  if (it == worker_histories_.end() ||
+      it->second.tasks_retired < WEIGHTING_MIN_RETIRED_TASKS) {
+    return false;
+  }
+  f64 elapsed_s = std::chrono::duration_cast<std::chrono::milliseconds>(
+                      now() - it->second.start_time)
+                      .count() /
+                  1000.0;
+  rate = it->second.tasks_retired / std::max(elapsed_s, 0.001);
+  return true;
+}
+
+f64 MasterImpl::worker_task_rate(i32 node_id) {
+  f64 rate;
+  if (measured_task_rate(node_id, rate)) {
+    return rate;
+  }
+  // Scale the capability by how fast the measured workers retire tasks per
+  // unit of capability. Until any are measured, capability alone is used,
+  // which is fine since rates are only compared with each other.
+  f64 measured_rate = 0;
+  f64 measured_capability = 0;
+  for (auto& kv : unfinished_workers_) {
+    if (!kv.second || !worker_active_[kv.first]) {
+      continue;
+    }
+    if (measured_task_rate(kv.first, rate)) {
+      measured_rate += rate;
+      measured_capability += worker_capability(kv.first);
+    }
+  }
+  f64 capability = worker_capability(node_id);
+  if (measured_capability == 0) {
+    return capability;
+  }
+  return capability * measured_rate / measured_capability;
+}
+
+i32 MasterImpl::weighted_task_limit(i32 node_id, i32 max_tasks) {
+  i64 ungranted = total_tasks_ - total_tasks_used_ - (i64)running_tasks_.size();
+  if (ungranted <= 0) {
+    // Let the caller find out there is nothing left
+    return max_tasks;
+  }
+
+  f64 rate = worker_task_rate(node_id);
+  i64 queued = active_job_tasks_[node_id].size();
+  f64 total_rate = 0;
+  i32 num_workers = 0;
+  // Time for the best other worker to get through its queue and one more task
+  f64 best_other_s = std::numeric_limits<f64>::max();
+  for (auto& kv : unfinished_workers_) {
+    i32 worker_id = kv.first;
+    if (!kv.second || !worker_active_[worker_id]) {
+      continue;
+    }
+    f64 worker_rate = worker_task_rate(worker_id);
+    total_rate += worker_rate;
+    num_workers++;
+    if (worker_id != node_id) {
+      best_other_s = std::min(
+          best_other_s,
+          (active_job_tasks_[worker_id].size() + 1) / worker_rate);
+    }
+  }
+  if (total_rate == 0) {
+    return max_tasks;
+  }
+
+  if (ungranted <= num_workers &&
+      (queued + 1) / rate > WEIGHTING_TAIL_SLOWDOWN * best_other_s) {
+    // One of the last tasks, which a faster worker will finish sooner
+    return 0;
+  }
+
+  // Keep the worker's queue to its share of the outstanding tasks so that
+  // slow workers do not sit on tasks faster ones could have run
+  i64 outstanding = ungranted + running_tasks_.size();
+  i64 share = (i64)std::ceil(outstanding * rate / total_rate);
+  i64 limit = std::max(share - queued, queued == 0 ? (i64)1 : (i64)0);
+  return (i32)std::min((i64)max_tasks, limit);
+}
+
+f64 MasterImpl::decode_frames_per_row(const proto::Job& job,
+                                      i64 output_rows) {
+  f64 frames_per_row = 0;
+  if (output_rows == 0) {
+    return frames_per_row;
+  }
+  for (const proto::ColumnInput& ci : job.inputs()) {
+    const TableMetadata& table = table_metas_->at(ci.table_name());
+    i32 column_id = table.column_id(ci.column_name());
+    if (table.column_type(column_id) != ColumnType::Video) {
+      continue;
+    }
+    VideoMetadata video = read_video_metadata(
+        storage_, VideoMetadata::descriptor_path(table.id(), column_id, 0));
+    f64 keyframe_spacing =
+        video.frames() /
+        (f64)std::max((size_t)1, video.keyframe_positions().size());
+    f64 stride = table.num_rows() / (f64)output_rows;
+    // Rows decode every frame since the previous row, or only since the
+    // last keyframe once rows are further apart than keyframes
+    frames_per_row += std::max(1.0, std::min(stride, keyframe_spacing));
+  }
+  return frames_per_row;
+}
+
+f64 MasterImpl::estimate_task_cost(const std::tuple<i64, i64>& job_task) {
+  i64 job_idx = std::get<0>(job_task);
+  f64 rows = job_tasks_.at(job_idx).at(std::get<1>(job_task)).size();
+  return rows * (task_cost_model_.row_ms +
+                 job_decode_frames_per_row_.at(job_idx) *
+                     task_cost_model_.frame_ms);
+}
+
+void MasterImpl::update_task_cost_model(const std::tuple<i64, i64>& job_task,
+                                        i64 runtime_ms) {
+  TaskCostModel& model = task_cost_model_;
+  i64 job_idx = std::get<0>(job_task);
+  f64 rows = job_tasks_.at(job_idx).at(std::get<1>(job_task)).size();
+  f64 frames = rows * job_decode_frames_per_row_.at(job_idx);
+  model.rows_rows += rows * rows;
+  model.rows_frames += rows * frames;
+  model.frames_frames += frames * frames;
+  model.rows_ms += rows * runtime_ms;
+  model.frames_ms += frames * runtime_ms;
+  model.samples++;
+  if (model.samples % COST_MODEL_REFIT_TASKS != 0) {
+    return;
+  }
+
+  // Solve the 2x2 normal equations. When every task decodes frames at the
+  // same rate per row the two terms cannot be told apart, so fall back to
+  // a single rate per row.
+  f64 det = model.rows_rows * model.frames_frames -
+            model.rows_frames * model.rows_frames;
+  f64 row_ms;
+  f64 frame_ms;
+  if (std::abs(det) > 1e-9 * model.rows_rows * model.frames_frames) {
+    row_ms = (model.rows_ms * model.frames_frames -
+              model.frames_ms * model.rows_frames) /
+             det;
+    frame_ms =
+        (model.frames_ms * model.rows_rows - model.rows_ms * model.rows_frames) /
+        det;
+  } else {
+    row_ms = model.rows_ms / std::max(model.rows_rows, 1.0);
+    frame_ms = 0;
+  }
+  // Negative rates come from noise, not from work that saves time
+  model.row_ms = std::max(row_ms, 0.0);
+  model.frame_ms = std::max(frame_ms, 0.0);
+  if (model.row_ms == 0 && model.frame_ms == 0) {
+    model.row_ms = 1;
+  }
+  task_order_stale_ = true;
+}
+
+void MasterImpl::sort_tasks_by_cost() {
+  std::vector<std::pair<f64, std::tuple<i64, i64>>> costs;
+  costs.reserve(unallocated_job_tasks_.size());
+  for (const std::tuple<i64, i64>& job_task : unallocated_job_tasks_) {
+    costs.emplace_back(estimate_task_cost(job_task), job_task);
+  }
+  // Tasks are granted from the back
+  std::stable_sort(costs.begin(), costs.end(),
+                   [](const std::pair<f64, std::tuple<i64, i64>>& a,
+                      const std::pair<f64, std::tuple<i64, i64>>& b) {
+                     return a.first < b.first;
+                   });
+  unallocated_job_tasks_.clear();
+  for (auto& cost : costs) {
+    unallocated_job_tasks_.push_back(cost.second);
+  }
+  task_order_stale_ = false;
+}
+
+bool MasterImpl::assign_speculative_task(i32 node_id,
+                                         proto::NewWork* new_work) {
+  if (task_runtimes_ms_.size() < SPECULATION_MIN_FINISHED_TASKS) {
+    return false;
+  }
+  std::vector<i64> runtimes = task_runtimes_ms_;
+  std::nth_element(runtimes.begin(), runtimes.begin() + runtimes.size() / 2,
+                   runtimes.end());
+  f64 median_ms = runtimes[runtimes.size() / 2];
+
+  // Duplicate the longest running task that has a single attempt
+  const std::tuple<i64, i64>* straggler = nullptr;
+  f64 longest_ms = SPECULATION_SLOWDOWN * median_ms;
+  timepoint_t current_time = now();
+  for (auto& kv : running_tasks_) {
+    const std::vector<TaskAttempt>& attempts = kv.second;
+    if (attempts.size() != 1 || attempts[0].worker_id == node_id) {
+      continue;
+    }
+    f64 elapsed_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                         current_time - attempts[0].start_time)
+                         .count();
+    if (elapsed_ms > longest_ms) {
+      longest_ms = elapsed_ms;
+      straggler = &kv.first;
+    }
+  }
+  if (straggler == nullptr) {
+    return false;
+  }
+
+  std::tuple<i64, i64> job_task_id = *straggler;
+  VLOG(1) << "Speculatively running task (" << std::get<0>(job_task_id)
+          << ", " << std::get<1>(job_task_id) << ") on worker " << node_id
+          << " after " << longest_ms << " ms (median " << median_ms << " ms)";
+  fill_new_work(job_task_id, new_work);
+  active_job_tasks_[node_id].insert(job_task_id);
+  worker_histories_[node_id].tasks_assigned += 1;
+  running_tasks_[job_task_id].push_back(TaskAttempt{node_id, current_time});
+  return true;
+}
+
+bool MasterImpl::retract_attempt(i32 node_id,
+                                 const std::tuple<i64, i64>& job_task) {
+  auto it = running_tasks_.find(job_task);
+  if (it == running_tasks_.end()) {
+    return false;
+  }
+  auto& attempts = it->second;
+  attempts.erase(std::remove_if(attempts.begin(), attempts.end(),
+                                [node_id](const TaskAttempt& attempt) {
+                                  return attempt.worker_id == node_id;
+                                }),
+                 attempts.end());
+  if (attempts.empty()) {
+    running_tasks_.erase(it);
+    return false;
+  }
+  return true;
+}
+
+void MasterImpl::fill_new_work(const std::tuple<i64, i64>& job_task,
+                               proto::NewWork* new_work) {
   i64 job_idx;
   i64 task_idx;
-  std::tie(job_idx, task_idx) = job_task_id;
+  std::tie(job_idx, task_idx) = job_task;
   new_work->set_table_id(job_to_table_id_.at(job_idx));
   new_work->set_job_index(job_idx);
   new_work->set_task_index(task_idx);
-  const auto& task_rows = job_tasks_.at(job_idx).at(task_idx);
-  for (i64 r : task_rows) {
-    new_work->add_output_rows(r);
+  const TaskRows& task_rows = job_tasks_.at(job_idx).at(task_idx);
+  new_work->set_output_row_start(task_rows.start);
+  new_work->set_output_row_end(task_rows.end);
+  new_work->set_output_row_stride(task_rows.stride);
+  auto states = handoff_states_.find(job_task);
+  if (states != handoff_states_.end()) {
+    for (const proto::KernelState& state : states->second) {
+      new_work->add_kernel_states()->CopyFrom(state);
+    }
   }
-
-  // Track sample assigned to worker
-  active_job_tasks_[node_info->node_id()].insert(job_task_id);
-  worker_histories_[node_info->node_id()].tasks_assigned += 1;
-
-  return grpc::Status::OK;
 }
 
 grpc::Status MasterImpl::FinishedWork(
@@ -243,35 +998,160 @@ grpc::Status MasterImpl::FinishedWork(
     proto::Empty* empty) {
   std::unique_lock<std::mutex> lk(work_mutex_);
   VLOG(1) << "Master received FinishedWork command";
+  finish_task(*params);
+  return grpc::Status::OK;
+}
 
-  i32 worker_id = params->node_id();
-  i64 job_id = params->job_id();
-  i64 task_id = params->task_id();
-  i64 num_rows = params->num_rows();
+void MasterImpl::finish_task(const proto::FinishedWorkParameters& params) {
+  i32 worker_id = params.node_id();
+  i64 job_id = params.job_id();
+  i64 task_id = params.task_id();
 
   if (!worker_active_[worker_id]) {
     // Technically the task was finished, but we don't count it for now
     // because it would have been reinstered into the work queue
-    return grpc::Status::OK;
+    return;
   }
 
   auto& worker_tasks = active_job_tasks_.at(worker_id);
 
   std::tuple<i64, i64> job_tasks = std::make_tuple(job_id, task_id);
-  assert(worker_tasks.count(job_tasks) > 0);
-  worker_tasks.erase(job_tasks);
+  if (worker_tasks.count(job_tasks) == 0) {
+    // A speculative copy of this task on another worker finished first
+    return;
+  }
+
+  // The first attempt to finish wins, so drop the task from the workers
+  // still running copies of it
+  i64 task_runtime_ms = 0;
+  auto running = running_tasks_.find(job_tasks);
+  if (running != running_tasks_.end()) {
+    for (const TaskAttempt& attempt : running->second) {
+      if (attempt.worker_id == worker_id) {
+        i64 runtime_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                             now() - attempt.start_time)
+                             .count();
+        task_runtime_ms = runtime_ms;
+        task_runtimes_ms_.push_back(runtime_ms);
+        if (!job_decode_frames_per_row_.empty()) {
+          update_task_cost_model(job_tasks, runtime_ms);
+        }
+      } else {
+        active_job_tasks_[attempt.worker_id].erase(job_tasks);
+        started_tasks_[attempt.worker_id].erase(job_tasks);
+        worker_histories_[attempt.worker_id].tasks_assigned -= 1;
+        cancelled_attempts_[attempt.worker_id].push_back(job_tasks);
+      }
+    }
+    running_tasks_.erase(running);
+  }
+
+  if (job_params_.speculative_execution()) {
+    // Every attempt wrote its files to paths of its own. The task stays
+    // granted to the winner until it reports them moved into place, so it
+    // is run again if the winner dies before then.
+    pending_commits_[job_tasks] =
+        PendingCommit{worker_id, params, task_runtime_ms};
+    commit_attempts_[worker_id].push_back(job_tasks);
+    return;
+  }
+  complete_task(params, task_runtime_ms);
+}
+
+void MasterImpl::commit_task(i32 node_id,
+                             const std::tuple<i64, i64>& job_task) {
+  auto it = pending_commits_.find(job_task);
+  if (it == pending_commits_.end() || it->second.worker_id != node_id ||
+      !worker_active_.at(node_id) ||
+      active_job_tasks_[node_id].count(job_task) == 0) {
+    // The task was granted again after this worker was lost
+    return;
+  }
+  PendingCommit commit = std::move(it->second);
+  pending_commits_.erase(it);
+  complete_task(commit.params, commit.task_runtime_ms);
+}
+
+void MasterImpl::complete_task(const proto::FinishedWorkParameters& params,
+                               i64 task_runtime_ms) {
+  i32 worker_id = params.node_id();
+  i64 job_id = params.job_id();
+  i64 task_id = params.task_id();
+  i64 num_rows = params.num_rows();
+  std::tuple<i64, i64> job_tasks = std::make_tuple(job_id, task_id);
+
+  active_job_tasks_.at(worker_id).erase(job_tasks);
+  started_tasks_[worker_id].erase(job_tasks);
 
   worker_histories_[worker_id].tasks_retired += 1;
 
+  // Kept until the next task of the job finishes, in case it is retried
+  handoff_states_.erase(job_tasks);
+  if (params.kernel_states_size() > 0) {
+    handoff_states_[std::make_tuple(job_id, task_id + 1)].assign(
+        params.kernel_states().begin(), params.kernel_states().end());
+  }
+  for (const proto::KernelState& partial : params.reduced_states()) {
+    combine_reduced_state(job_id, partial);
+  }
+
+  if (params.has_tuned_parameters()) {
+    worker_tuned_parameters_[worker_id] = params.tuned_parameters();
+  }
+  completed_job_tasks_.insert(job_tasks);
+  task_workers_[job_tasks] = worker_id;
+
   i64 active_job = next_job_ - 1;
 
   total_tasks_used_++;
   if (bar_) {
     bar_->Progressed(total_tasks_used_);
   }
+  proto::TaskEvent event;
+  event.set_job_id(job_id);
+  event.set_task_id(task_id);
+  event.set_node_id(worker_id);
+  event.set_num_rows(num_rows);
+  event.set_duration_ms(task_runtime_ms);
+  add_task_event(event);
+  check_tasks_done();
+}
+
+void MasterImpl::add_task_event(proto::TaskEvent event) {
+  event.set_tasks_done(total_tasks_used_);
+  event.set_total_tasks(total_tasks_);
+  {
+    std::unique_lock<std::mutex> lock(task_events_mutex_);
+    task_events_.push_back(std::move(event));
+  }
+  task_events_cv_.notify_all();
+}
 
+void MasterImpl::quarantine_task(const std::tuple<i64, i64>& job_task) {
+  i64 job_idx = std::get<0>(job_task);
+  i64 task_idx = std::get<1>(job_task);
+  LOG(WARNING) << "Giving up on task " << task_idx << " of job " << job_idx
+               << " after losing " << task_failures_[job_task].size()
+               << " workers running it";
+  failed_job_tasks_.insert(job_task);
+  total_tasks_used_++;
+  if (bar_) {
+    bar_->Progressed(total_tasks_used_);
+  }
+  proto::TaskEvent event;
+  event.set_job_id(job_idx);
+  event.set_task_id(task_idx);
+  event.set_node_id(task_failures_[job_task].back());
+  event.set_failed(true);
+  add_task_event(event);
+  check_tasks_done();
+}
+
+void MasterImpl::check_tasks_done() {
   if (total_tasks_used_ == total_tasks_) {
     VLOG(1) << "Master FinishedWork triggered finished!";
+    // Steps past any trailing tasks a resumed run had already finished
+    generate_next_task();
     assert(next_job_ == num_jobs_);
     {
       std::unique_lock<std::mutex> lock(finished_mutex_);
@@ -279,28 +1159,37 @@ grpc::Status MasterImpl::FinishedWork(
     }
     finished_cv_.notify_all();
   }
-
-  return grpc::Status::OK;
 }
 
 grpc::Status MasterImpl::NewJob(grpc::ServerContext* context,
                                 const proto::BulkJobParameters* job_params,
-                                proto::Result* job_result) {
+                                proto::NewJobReply* reply) {
   VLOG(1) << "Master received NewJob command";
-  job_result->set_success(true);
+  reply->mutable_result()->set_success(true);
   set_database_path(db_params_.db_path);
 
-  job_params_.Clear();
-  job_params_.MergeFrom(*job_params);
-  {
-    std::unique_lock<std::mutex> lock(finished_mutex_);
-    finished_ = false;
+  for (const proto::JobGroup& group : job_params->job_groups()) {
+    if (group.input_table_names_size() !=
+        group.inputs_size() * group.output_table_names_size()) {
+      RESULT_ERROR(reply->mutable_result(),
+                   "Job group has %d input tables for %d jobs of %d inputs",
+                   group.input_table_names_size(),
+                   group.output_table_names_size(), group.inputs_size());
+      return grpc::Status::OK;
+    }
   }
-  finished_cv_.notify_one();
 
   {
     std::unique_lock<std::mutex> lock(active_mutex_);
-    active_bulk_job_ = true;
+    queued_bulk_jobs_.emplace_back();
+    QueuedBulkJob& queued = queued_bulk_jobs_.back();
+    queued.ticket = next_bulk_job_ticket_++;
+    queued.params.CopyFrom(*job_params);
+    expand_job_groups(queued.params);
+    reply->set_ticket(queued.ticket);
+    VLOG(1) << "Queued bulk job " << job_params->job_name() << " as ticket "
+            << queued.ticket << " behind " << queued_bulk_jobs_.size() - 1
+            << " others";
   }
   active_cv_.notify_all();
 
@@ -308,13 +1197,32 @@ grpc::Status MasterImpl::NewJob(grpc::ServerContext* context,
 }
 
 grpc::Status MasterImpl::IsJobDone(grpc::ServerContext* context,
-                                   const proto::Empty* empty,
+                                   const proto::JobTicket* ticket,
                                    proto::JobResult* job_result) {
   VLOG(1) << "Master received IsJobDone command";
   std::unique_lock<std::mutex> lock(active_mutex_);
-  if (!active_bulk_job_) {
+  if (ticket->wait_ms() > 0) {
+    // Reply as soon as the bulk job finishes instead of making the client
+    // poll for it
+    i32 wait_ms = std::min(ticket->wait_ms(), MAX_JOB_DONE_WAIT_MS);
+    bulk_job_results_cv_.wait_for(
+        lock, std::chrono::milliseconds(wait_ms), [&] {
+          return bulk_job_done(ticket->ticket()) ||
+                 trigger_shutdown_.raised();
+        });
+  }
+  auto it = bulk_job_results_.find(ticket->ticket());
+  if (it != bulk_job_results_.end()) {
+    job_result->set_finished(true);
+    job_result->mutable_result()->CopyFrom(it->second);
+    // Each result is delivered once, so a long running master does not keep
+    // the result of every bulk job it ever ran
+    bulk_job_results_.erase(it);
+  } else if (bulk_job_done(ticket->ticket())) {
     job_result->set_finished(true);
-    job_result->mutable_result()->CopyFrom(job_result_);
+    RESULT_ERROR(job_result->mutable_result(),
+                 "Result of bulk job ticket %ld was already collected",
+                 ticket->ticket());
   } else {
     job_result->set_finished(false);
   }
@@ -322,6 +1230,53 @@ grpc::Status MasterImpl::IsJobDone(grpc::ServerContext* context,
 }
 
 
+grpc::Status MasterImpl::WatchJob(
+    grpc::ServerContext* context, const proto::JobTicket* ticket,
+    grpc::ServerWriter<proto::TaskEvent>* writer) {
+  VLOG(1) << "Master received WatchJob command";
+  {
+    std::unique_lock<std::mutex> lock(active_mutex_);
+    if (ticket->ticket() >= next_bulk_job_ticket_ ||
+        bulk_job_done(ticket->ticket())) {
+      return grpc::Status::OK;
+    }
+  }
+  size_t sent = 0;
+  while (!context->IsCancelled() && !trigger_shutdown_.raised()) {
+    std::vector<proto::TaskEvent> events;
+    bool done = false;
+    {
+      std::unique_lock<std::mutex> lock(task_events_mutex_);
+      // Woken periodically to notice cancelled clients
+      task_events_cv_.wait_for(lock, std::chrono::seconds(1), [&] {
+        return task_events_ticket_ == ticket->ticket() &&
+               (task_events_.size() > sent || task_events_done_);
+      });
+      if (task_events_ticket_ == ticket->ticket()) {
+        events.assign(task_events_.begin() + sent, task_events_.end());
+        sent = task_events_.size();
+        done = task_events_done_;
+      }
+    }
+    for (const proto::TaskEvent& event : events) {
+      if (!writer->Write(event)) {
+        return grpc::Status::OK;
+      }
+    }
+    if (done) {
+      break;
+    }
+    if (events.empty()) {
+      // The bulk job may have finished before its events were watched
+      std::unique_lock<std::mutex> lock(active_mutex_);
+      if (bulk_job_done(ticket->ticket())) {
+        break;
+      }
+    }
+  }
+  return grpc::Status::OK;
+}
+
 grpc::Status MasterImpl::Ping(grpc::ServerContext* context,
                               const proto::Empty* empty1,
                               proto::Empty* empty2) {
@@ -367,6 +1322,17 @@ grpc::Status MasterImpl::LoadOp(grpc::ServerContext* context,
     }
   }
 
+  if (so_path_ops_.count(so_path) > 0) {
+    result->set_success(true);
+    return grpc::Status::OK;
+  }
+
+  // Ops and kernels the library registers, to tell which jobs need it
+  std::vector<std::string> op_names = get_op_registry()->op_names();
+  std::vector<std::string> kernel_names = get_kernel_registry()->op_names();
+  std::set<std::string> existing(op_names.begin(), op_names.end());
+  existing.insert(kernel_names.begin(), kernel_names.end());
+
   void* handle = dlopen(so_path.c_str(), RTLD_NOW | RTLD_LOCAL);
   if (handle == nullptr) {
     RESULT_ERROR(result, "Failed to load op library: %s", dlerror());
@@ -374,12 +1340,17 @@ grpc::Status MasterImpl::LoadOp(grpc::ServerContext* context,
   }
   so_paths_.push_back(so_path);
 
-  for (auto& kv : worker_active_) {
-    if (kv.second) {
-      auto& worker = workers_[kv.first];
-      grpc::ClientContext ctx;
-      proto::Empty empty;
-      worker->LoadOp(&ctx, *op_path, &empty);
+  std::set<std::string>& provided = so_path_ops_[so_path];
+  op_names = get_op_registry()->op_names();
+  kernel_names = get_kernel_registry()->op_names();
+  for (const std::string& name : op_names) {
+    if (existing.count(name) == 0) {
+      provided.insert(name);
+    }
+  }
+  for (const std::string& name : kernel_names) {
+    if (existing.count(name) == 0) {
+      provided.insert(name);
     }
   }
 
@@ -404,6 +1375,7 @@ grpc::Status MasterImpl::RegisterOp(
       col.set_id(i++);
       col.set_name(c.name());
       col.set_type(c.type());
+      col.mutable_pixel_formats()->CopyFrom(c.pixel_formats());
       input_columns.push_back(col);
     }
     std::vector<Column> output_columns;
@@ -460,9 +1432,12 @@ grpc::Status MasterImpl::RegisterPythonKernel(
     DeviceType device_type = python_kernel->device_type();
     const std::string& kernel_str = python_kernel->kernel_str();
     const std::string& pickled_config = python_kernel->pickled_config();
+    bool multiprocess = python_kernel->multiprocess();
     // Create a kernel builder function
-    auto constructor = [kernel_str, pickled_config](const KernelConfig& config) {
-      return new PythonKernel(config, kernel_str, pickled_config);
+    auto constructor = [kernel_str, pickled_config,
+                        multiprocess](const KernelConfig& config) {
+      return new PythonKernel(config, kernel_str, pickled_config,
+                              multiprocess);
     };
     // Create a new kernel factory
     // TODO(apoms): Support batching and # of devices in python kernels
@@ -528,18 +1503,99 @@ grpc::Status MasterImpl::PokeWatchdog(grpc::ServerContext* context,
     rpcs[i]->Finish(&results[i], &statuses[i], (void*)id);
     i++;
   }
-  for (int i = 0; i < ws.size(); ++i) {
-    void* got_tag;
-    bool ok = false;
-    GPR_ASSERT(cq.Next(&got_tag, &ok));
-    // GPR_ASSERT((i64)got_tag < workers_.size());
-    i64 worker_id = (i64)got_tag;
-    if (!ok) {
-      LOG(WARNING) << "Could not poke worker " << worker_id << "!";
+  for (int i = 0; i < ws.size(); ++i) {
+    void* got_tag;
+    bool ok = false;
+    GPR_ASSERT(cq.Next(&got_tag, &ok));
+    // GPR_ASSERT((i64)got_tag < workers_.size());
+    i64 worker_id = (i64)got_tag;
+    if (!ok) {
+      LOG(WARNING) << "Could not poke worker " << worker_id << "!";
+    }
+  }
+  cq.Shutdown();
+  return grpc::Status::OK;
+}
+
+void MasterImpl::start_metrics_server(i32 port) {
+  metrics_server_.reset(new MetricsServer(
+      port, [this](MetricsWriter& writer) { write_metrics(writer); }));
+}
+
+void MasterImpl::write_metrics(MetricsWriter& writer) {
+  {
+    std::unique_lock<std::mutex> lk(active_mutex_);
+    writer.family("scanner_master_bulk_job_active", "gauge",
+                  "Whether a bulk job is running");
+    writer.sample("scanner_master_bulk_job_active", active_bulk_job_ ? 1 : 0);
+    writer.family("scanner_master_bulk_jobs_queued", "gauge",
+                  "Bulk jobs waiting to run");
+    writer.sample("scanner_master_bulk_jobs_queued",
+                  queued_bulk_jobs_.size());
+  }
+
+  std::unique_lock<std::mutex> lk(work_mutex_);
+  i64 active_workers = 0;
+  for (auto& kv : worker_active_) {
+    active_workers += kv.second ? 1 : 0;
+  }
+  writer.family("scanner_master_workers", "gauge", "Active workers");
+  writer.sample("scanner_master_workers", active_workers);
+
+  writer.family("scanner_master_tasks", "gauge",
+                "Tasks of the current bulk job by state");
+  writer.sample("scanner_master_tasks", total_tasks_, {{"state", "total"}});
+  writer.sample("scanner_master_tasks", completed_job_tasks_.size(),
+                {{"state", "completed"}});
+  writer.sample("scanner_master_tasks", running_tasks_.size(),
+                {{"state", "running"}});
+  writer.sample("scanner_master_tasks", unallocated_job_tasks_.size(),
+                {{"state", "unallocated"}});
+
+  writer.family("scanner_master_worker_tasks_assigned", "gauge",
+                "Tasks each worker holds in the current bulk job");
+  for (auto& kv : worker_histories_) {
+    writer.sample("scanner_master_worker_tasks_assigned",
+                  kv.second.tasks_assigned,
+                  {{"worker", std::to_string(kv.first)}});
+  }
+  writer.family("scanner_master_worker_tasks_retired_total", "counter",
+                "Tasks each worker finished in the current bulk job");
+  for (auto& kv : worker_histories_) {
+    writer.sample("scanner_master_worker_tasks_retired_total",
+                  kv.second.tasks_retired,
+                  {{"worker", std::to_string(kv.first)}});
+  }
+
+  // Workers report their totals for the bulk job, so rates are summed over
+  // the workers' own rates
+  std::map<std::tuple<std::string, DeviceType>, proto::OpProfile> profiles;
+  std::map<std::tuple<std::string, DeviceType>, f64> rates;
+  for (auto& kv : worker_op_profiles_) {
+    for (const proto::OpProfile& profile : kv.second) {
+      auto key = std::make_tuple(profile.name(), profile.device_type());
+      proto::OpProfile& total = profiles[key];
+      total.set_rows(total.rows() + profile.rows());
+      if (profile.eval_ns() > 0) {
+        rates[key] += profile.rows() * 1e9 / profile.eval_ns();
+      }
     }
   }
-  cq.Shutdown();
-  return grpc::Status::OK;
+  writer.family("scanner_op_rows_total", "counter",
+                "Rows each op evaluated in the current bulk job");
+  for (auto& kv : profiles) {
+    writer.sample("scanner_op_rows_total", kv.second.rows(),
+                  {{"op", std::get<0>(kv.first)},
+                   {"device", proto::DeviceType_Name(std::get<1>(kv.first))}});
+  }
+  writer.family("scanner_op_rows_per_second", "gauge",
+                "Rows each op evaluates per second of evaluation, summed "
+                "over workers");
+  for (auto& kv : rates) {
+    writer.sample("scanner_op_rows_per_second", kv.second,
+                  {{"op", std::get<0>(kv.first)},
+                   {"device", proto::DeviceType_Name(std::get<1>(kv.first))}});
+  }
 }
 
 void MasterImpl::start_watchdog(grpc::Server* server, bool enable_timeout,
@@ -587,15 +1643,71 @@ void MasterImpl::start_watchdog(grpc::Server* server, bool enable_timeout,
 void MasterImpl::start_job_processor() {
   job_processor_thread_ = std::thread([this]() {
     while (!trigger_shutdown_.raised()) {
-      // Wait on not finished
+      // Wait for a queued bulk job
+      i64 ticket;
       {
         std::unique_lock<std::mutex> lock(active_mutex_);
-        active_cv_.wait(
-            lock, [this] { return active_bulk_job_ || trigger_shutdown_.raised(); });
+        active_cv_.wait(lock, [this] {
+          return !queued_bulk_jobs_.empty() || trigger_shutdown_.raised();
+        });
+        if (trigger_shutdown_.raised()) break;
+        auto next = next_queued_bulk_job();
+        ticket = next->ticket;
+        job_params_.Clear();
+        job_params_.Swap(&next->params);
+        queued_bulk_jobs_.erase(next);
+        submitter_bulk_jobs_run_[job_params_.submitter()] += 1;
+        active_bulk_job_ = true;
+        running_bulk_job_ticket_ = ticket;
       }
-      if (trigger_shutdown_.raised()) break;
+      {
+        std::unique_lock<std::mutex> lock(task_events_mutex_);
+        task_events_ticket_ = ticket;
+        task_events_done_ = false;
+        task_events_.clear();
+      }
+      // Share identical subgraphs between jobs before the DAG is analyzed
+      // and sent to the workers
+      {
+        std::vector<proto::Job> jobs(job_params_.jobs().begin(),
+                                     job_params_.jobs().end());
+        std::vector<proto::Op> ops(job_params_.ops().begin(),
+                                   job_params_.ops().end());
+        i32 removed = eliminate_common_subexpressions(ops, jobs);
+        if (removed > 0) {
+          VLOG(1) << "Merged " << removed << " duplicate ops";
+          job_params_.clear_jobs();
+          for (auto& job : jobs) {
+            job_params_.add_jobs()->CopyFrom(job);
+          }
+          job_params_.clear_ops();
+          for (auto& op : ops) {
+            job_params_.add_ops()->CopyFrom(op);
+          }
+        }
+      }
+      if (job_params_.device_placement() ==
+          proto::BulkJobParameters::PROFILE_GUIDED) {
+        place_ops_by_profile(job_params_);
+      }
+      {
+        std::unique_lock<std::mutex> lock(finished_mutex_);
+        finished_ = false;
+      }
+      finished_cv_.notify_all();
       // Start processing job
       bool result = process_job(&job_params_, &job_result_);
+      {
+        std::unique_lock<std::mutex> lock(active_mutex_);
+        bulk_job_results_[ticket] = job_result_;
+        running_bulk_job_ticket_ = -1;
+      }
+      bulk_job_results_cv_.notify_all();
+      {
+        std::unique_lock<std::mutex> lock(task_events_mutex_);
+        task_events_done_ = true;
+      }
+      task_events_cv_.notify_all();
     }
   });
 }
@@ -604,14 +1716,199 @@ void MasterImpl::stop_job_processor() {
   // Wake up job processor
   {
     std::unique_lock<std::mutex> lock(active_mutex_);
-    active_bulk_job_ = true;
   }
   active_cv_.notify_all();
+  bulk_job_results_cv_.notify_all();
   if (job_processor_thread_.joinable()) {
     job_processor_thread_.join();
   }
 }
 
+std::deque<MasterImpl::QueuedBulkJob>::iterator
+MasterImpl::next_queued_bulk_job() {
+  // Highest priority first, then the submitter that has had the fewest bulk
+  // jobs run, then the oldest
+  auto best = queued_bulk_jobs_.begin();
+  for (auto it = queued_bulk_jobs_.begin(); it != queued_bulk_jobs_.end();
+       ++it) {
+    i32 priority = it->params.priority();
+    i32 best_priority = best->params.priority();
+    if (priority != best_priority) {
+      if (priority > best_priority) {
+        best = it;
+      }
+      continue;
+    }
+    if (submitter_bulk_jobs_run_[it->params.submitter()] <
+        submitter_bulk_jobs_run_[best->params.submitter()]) {
+      best = it;
+    }
+  }
+  return best;
+}
+
+bool MasterImpl::bulk_job_done(i64 ticket) {
+  if (bulk_job_results_.count(ticket) > 0) {
+    return true;
+  }
+  // Tickets are handed out in order, so an issued ticket that is neither
+  // queued nor running has finished and had its result collected
+  if (ticket <= 0 || ticket >= next_bulk_job_ticket_ ||
+      ticket == running_bulk_job_ticket_) {
+    return false;
+  }
+  for (const QueuedBulkJob& queued : queued_bulk_jobs_) {
+    if (queued.ticket == ticket) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void MasterImpl::place_ops_by_profile(proto::BulkJobParameters& params) {
+  // GPU kernels can only be chosen if every worker has a GPU to run them on
+  bool gpus_available;
+  {
+    std::unique_lock<std::mutex> lk(work_mutex_);
+    gpus_available = !worker_machine_params_.empty();
+    for (auto& kv : worker_machine_params_) {
+      if (kv.second.gpu_ids_size() == 0) {
+        gpus_available = false;
+      }
+    }
+  }
+  if (!gpus_available) {
+    VLOG(1) << "Not all workers have GPUs, keeping the requested devices";
+    return;
+  }
+
+  // Sum the profiles of the most recent bulk jobs
+  DatabaseMetadata meta =
+      read_database_metadata(storage_, DatabaseMetadata::descriptor_path());
+  std::vector<i32> bulk_job_ids;
+  for (const std::string& name : meta.bulk_job_names()) {
+    bulk_job_ids.push_back(meta.get_bulk_job_id(name));
+  }
+  std::sort(bulk_job_ids.begin(), bulk_job_ids.end(), std::greater<i32>());
+  if (bulk_job_ids.size() > PLACEMENT_PROFILE_BULK_JOBS) {
+    bulk_job_ids.resize(PLACEMENT_PROFILE_BULK_JOBS);
+  }
+  std::map<std::tuple<std::string, DeviceType>, proto::OpProfile> profiles;
+  i64 transferred_rows = 0;
+  i64 transfer_ns = 0;
+  for (i32 bulk_job_id : bulk_job_ids) {
+    std::string path = BulkJobMetadata::descriptor_path(bulk_job_id);
+    storehouse::FileInfo info;
+    if (storage_->get_file_info(path, info) !=
+        storehouse::StoreResult::Success) {
+      continue;
+    }
+    BulkJobMetadata bulk_job = read_bulk_job_metadata(storage_, path);
+    for (const proto::OpProfile& profile :
+         bulk_job.get_descriptor().op_profiles()) {
+      proto::OpProfile& total =
+          profiles[std::make_tuple(profile.name(), profile.device_type())];
+      total.set_rows(total.rows() + profile.rows());
+      total.set_eval_ns(total.eval_ns() + profile.eval_ns());
+      transferred_rows += profile.transferred_rows();
+      transfer_ns += profile.transfer_ns();
+    }
+  }
+  f64 transfer_ns_per_row = transferred_rows > 0
+                                ? transfer_ns / (f64)transferred_rows
+                                : PLACEMENT_DEFAULT_TRANSFER_NS_PER_ROW;
+
+  // Ops with both kernels profiled are free to move
+  KernelRegistry* kernel_registry = get_kernel_registry();
+  std::vector<proto::Op> ops(params.ops().begin(), params.ops().end());
+  std::vector<DeviceType> devices;
+  std::map<i64, std::map<DeviceType, f64>> eval_ns_per_row;
+  for (size_t i = 0; i < ops.size(); ++i) {
+    const proto::Op& op = ops[i];
+    devices.push_back(op.device_type());
+    if (is_builtin_op(op.name())) {
+      continue;
+    }
+    std::map<DeviceType, f64> costs;
+    for (DeviceType type : {DeviceType::CPU, DeviceType::GPU}) {
+      auto it = profiles.find(std::make_tuple(op.name(), type));
+      if (kernel_registry->has_kernel(op.name(), type) &&
+          it != profiles.end() && it->second.rows() > 0) {
+        costs[type] = it->second.eval_ns() / (f64)it->second.rows();
+      }
+    }
+    if (costs.size() == 2) {
+      eval_ns_per_row[i] = costs;
+    }
+  }
+  if (eval_ns_per_row.empty()) {
+    VLOG(1) << "No ops with profiles for both devices to place";
+    return;
+  }
+
+  // Estimated time per row for a placement. Builtin ops run on the device
+  // of their input and the input and output ops on the CPU.
+  auto placement_cost = [&](const std::vector<DeviceType>& placement) {
+    f64 cost = 0;
+    std::vector<DeviceType> op_devices(ops.size(), DeviceType::CPU);
+    for (size_t i = 0; i < ops.size(); ++i) {
+      const proto::Op& op = ops[i];
+      std::set<i64> parents;
+      for (auto& input : op.inputs()) {
+        if (input.op_index() >= 0 && input.op_index() < (i64)i) {
+          parents.insert(input.op_index());
+        }
+      }
+      DeviceType device = DeviceType::CPU;
+      if (!is_builtin_op(op.name())) {
+        device = placement[i];
+      } else if (op.name() != INPUT_OP_NAME && op.name() != OUTPUT_OP_NAME &&
+                 !parents.empty()) {
+        device = op_devices[*parents.begin()];
+      }
+      op_devices[i] = device;
+      for (i64 parent : parents) {
+        if (op_devices[parent] != device) {
+          cost += transfer_ns_per_row;
+        }
+      }
+      auto it = eval_ns_per_row.find(i);
+      if (it != eval_ns_per_row.end()) {
+        cost += it->second.at(device);
+      }
+    }
+    return cost;
+  };
+
+  // Flip single ops while that lowers the cost
+  f64 best_cost = placement_cost(devices);
+  bool improved = true;
+  while (improved) {
+    improved = false;
+    for (auto& kv : eval_ns_per_row) {
+      i64 op_idx = kv.first;
+      DeviceType previous = devices[op_idx];
+      devices[op_idx] = previous == DeviceType::CPU ? DeviceType::GPU
+                                                    : DeviceType::CPU;
+      f64 cost = placement_cost(devices);
+      if (cost < best_cost) {
+        best_cost = cost;
+        improved = true;
+      } else {
+        devices[op_idx] = previous;
+      }
+    }
+  }
+
+  for (size_t i = 0; i < ops.size(); ++i) {
+    if (devices[i] != ops[i].device_type()) {
+      VLOG(1) << "Placing op " << i << " (" << ops[i].name() << ") on "
+              << proto::DeviceType_Name(devices[i]);
+      params.mutable_ops(i)->set_device_type(devices[i]);
+    }
+  }
+}
+
 bool MasterImpl::process_job(const proto::BulkJobParameters* job_params,
                              proto::Result* job_result) {
   // Reset job state
@@ -627,9 +1924,34 @@ bool MasterImpl::process_job(const proto::BulkJobParameters* job_params,
   task_result_.set_success(true);
   active_job_tasks_.clear();
   worker_histories_.clear();
+  worker_tuned_parameters_.clear();
+  handoff_states_.clear();
+  reduce_kernels_.clear();
+  reduced_states_.clear();
+  tasks_waiting_on_state_ = false;
+  worker_op_profiles_.clear();
+  job_row_analysis_.clear();
+  job_input_tables_.clear();
+  worker_recent_tasks_.clear();
+  running_tasks_.clear();
+  cancelled_attempts_.clear();
+  pending_commits_.clear();
+  commit_attempts_.clear();
+  started_tasks_.clear();
+  worker_heartbeats_.clear();
+  completed_job_tasks_.clear();
+  task_workers_.clear();
+  task_failures_.clear();
+  failed_job_tasks_.clear();
+  checkpointed_tasks_ = -1;
+  task_cost_model_ = TaskCostModel();
+  job_decode_frames_per_row_.clear();
+  task_order_stale_ = true;
+  task_runtimes_ms_.clear();
   unfinished_workers_.clear();
   local_ids_.clear();
   local_totals_.clear();
+  job_workers_started_ = false;
   client_contexts_.clear();
   statuses_.clear();
   replies_.clear();
@@ -679,36 +2001,83 @@ bool MasterImpl::process_job(const proto::BulkJobParameters* job_params,
 
   // Prefetch table metadata for all tables in samplers
   {
-    auto load_table_meta = [&](const std::string& table_name) {
-      std::string table_path =
-          TableMetadata::descriptor_path(meta_.get_table_id(table_name));
-      table_metas_->update(read_table_metadata(storage_, table_path));
-    };
     std::set<std::string> tables_to_read;
     for (auto& job : jobs) {
       for (auto& column_input : job.inputs()) {
         tables_to_read.insert(column_input.table_name());
       }
     }
-    // TODO(apoms): make this a thread pool instead of spawning potentially
-    // thousands of threads
-    std::vector<std::thread> threads;
-    for (const std::string& t : tables_to_read) {
-      threads.emplace_back(load_table_meta, t);
-    }
-    for (auto& thread : threads) {
-      thread.join();
+    table_metas_->prefetch(std::vector<std::string>(tables_to_read.begin(),
+                                                    tables_to_read.end()));
+    // The tables of a bulk job that did not finish are missing rows until
+    // it is resumed, so they can not be read
+    for (const std::string& table : tables_to_read) {
+      if (!meta_.has_table(table)) {
+        continue;
+      }
+      i32 job_id = table_metas_->at(table).get_descriptor().job_id();
+      if (job_id == -1 || !meta_.has_bulk_job(job_id)) {
+        continue;
+      }
+      BulkJobMetadata input_job = read_bulk_job_metadata(
+          storage_, BulkJobMetadata::descriptor_path(job_id));
+      if (input_job.get_descriptor().interrupted()) {
+        RESULT_ERROR(job_result,
+                     "Input table %s was written by bulk job %s, which did "
+                     "not finish. Resume that bulk job before reading it.",
+                     table.c_str(), input_job.get_descriptor().name().c_str());
+        finished_fn();
+        return false;
+      }
     }
   }
 
+  if (!job_params->replay_bundle().empty()) {
+    write_replay_bundle(*job_params);
+  }
+
+  // A table gets a new id whenever it is rewritten, so the ids stand in for
+  // the contents of the input tables in the cache key
+  size_t analysis_key;
+  {
+    std::string key;
+    for (auto& op : ops) {
+      key += op.SerializeAsString();
+    }
+    for (auto& job : jobs) {
+      key += job.SerializeAsString();
+      for (auto& ci : job.inputs()) {
+        key += std::to_string(meta_.get_table_id(ci.table_name())) + ",";
+      }
+    }
+    analysis_key = std::hash<std::string>()(key);
+  }
   DAGAnalysisInfo dag_info;
-  *job_result =
-      validate_jobs_and_ops(meta_, *table_metas_.get(), jobs, ops, dag_info);
-  if (!job_result->success()) {
-    // No database changes made at this point, so just return
-    finished_fn();
-    return false;
+  bool cached_analysis = false;
+  for (auto& entry : analysis_cache_) {
+    if (std::get<0>(entry) == analysis_key) {
+      dag_info = std::get<1>(entry);
+      cached_analysis = true;
+      VLOG(1) << "Reusing the DAG analysis of an identical bulk job";
+      break;
+    }
+  }
+  if (!cached_analysis) {
+    *job_result =
+        validate_jobs_and_ops(meta_, *table_metas_.get(), jobs, ops, dag_info);
+    if (!job_result->success()) {
+      // No database changes made at this point, so just return
+      finished_fn();
+      return false;
+    }
+  }
+  {
+    DAGAnalysisInfo state_info;
+    populate_analysis_info(ops, state_info);
+    state_handoff_ = !state_info.state_handoff_ops.empty();
+    reduce_ops_ = state_info.reduce_ops;
   }
+  setup_reduce_kernels(ops);
 
   // Map all input Ops into a single input collection
   const std::map<i64, i64>& input_op_idx_to_column_idx = dag_info.input_ops;
@@ -790,7 +2159,8 @@ bool MasterImpl::process_job(const proto::BulkJobParameters* job_params,
       output_columns.push_back(c);
     }
   }
-  proto::BulkJobDescriptor job_descriptor;
+  proto::BulkJobDescriptor& job_descriptor = job_descriptor_;
+  job_descriptor.Clear();
   job_descriptor.set_io_packet_size(io_packet_size);
   job_descriptor.set_work_packet_size(work_packet_size);
   job_descriptor.set_num_nodes(workers_.size());
@@ -798,6 +2168,50 @@ bool MasterImpl::process_job(const proto::BulkJobParameters* job_params,
   {
     auto& jobs = job_params->jobs();
     job_descriptor.mutable_jobs()->CopyFrom(jobs);
+    for (auto& job : jobs) {
+      for (auto& column_input : job.inputs()) {
+        const proto::TableDescriptor& input =
+            table_metas_->at(column_input.table_name()).get_descriptor();
+        proto::InputTableVersion* version =
+            job_descriptor.add_input_tables();
+        version->set_id(input.id());
+        version->set_timestamp(input.timestamp());
+      }
+    }
+  }
+  job_descriptor.mutable_ops()->CopyFrom(job_params->ops());
+  // Stays set in the saved descriptor if the bulk job does not finish
+  job_descriptor.set_interrupted(true);
+
+  // Pick up where an interrupted run of the same bulk job stopped. Its
+  // output tables still point at it.
+  bool resuming = false;
+  if (job_params->resume() && !jobs.empty() &&
+      meta_.has_table(jobs[0].output_table_name())) {
+    TableMetadata output_table = read_table_metadata(
+        storage_, TableMetadata::descriptor_path(
+                      meta_.get_table_id(jobs[0].output_table_name())));
+    i32 previous_id = output_table.get_descriptor().job_id();
+    if (meta_.has_bulk_job(previous_id)) {
+      BulkJobMetadata previous = read_bulk_job_metadata(
+          storage_, BulkJobMetadata::descriptor_path(previous_id));
+      if (same_bulk_job(previous.get_descriptor(), job_descriptor)) {
+        resuming = true;
+        // The partial results of the tasks a reduced bulk job finished are
+        // lost with its master, so all of its tasks run again
+        for (const proto::CompletedTask& task :
+             previous.get_descriptor().completed_tasks()) {
+          if (!reduce_ops_.empty()) {
+            break;
+          }
+          completed_job_tasks_.insert(
+              std::make_tuple(task.job_id(), task.task_id()));
+        }
+        meta_.remove_bulk_job(previous_id);
+        LOG(INFO) << "Resuming interrupted bulk job " << previous_id << " with "
+                  << completed_job_tasks_.size() << " tasks already done";
+      }
+    }
   }
 
   // Add job name into database metadata so we can look up what jobs have
@@ -807,16 +2221,22 @@ bool MasterImpl::process_job(const proto::BulkJobParameters* job_params,
   job_descriptor.set_name(job_params->job_name());
   // Determine total output rows and slice input rows for using to
   // split stream
-  *job_result = determine_input_rows_to_slices(meta_, *table_metas_.get(), jobs,
-                                               ops, dag_info);
+  if (!cached_analysis) {
+    *job_result = determine_input_rows_to_slices(meta_, *table_metas_.get(),
+                                                 jobs, ops, dag_info);
+    if (!job_result->success()) {
+      // No database changes made at this point, so just return
+      finished_fn();
+      return false;
+    }
+    analysis_cache_.emplace_back(analysis_key, dag_info);
+    if (analysis_cache_.size() > ANALYSIS_CACHE_BULK_JOBS) {
+      analysis_cache_.pop_front();
+    }
+  }
   slice_input_rows_per_job_ = dag_info.slice_input_rows;
   total_output_rows_per_job_ = dag_info.total_output_rows;
-
-  if (!job_result->success()) {
-    // No database changes made at this point, so just return
-    finished_fn();
-    return false;
-  }
+  export_row_analysis(dag_info, job_row_analysis_);
 
 
   // HACK(apoms): we currently split work into tasks in two ways:
@@ -845,27 +2265,42 @@ bool MasterImpl::process_job(const proto::BulkJobParameters* job_params,
       // Derive the output rows produced by each slice group
       i64 slice_op_idx = slice_input_rows.begin()->first;
       i64 slice_in_rows = slice_input_rows.begin()->second;
+      std::vector<i64> group_boundaries;
       *job_result = derive_slice_final_output_rows(
           jobs.at(i), ops, slice_op_idx, slice_in_rows, dag_info,
-          partition_boundaries);
+          group_boundaries);
       if (!job_result->success()) {
         // No database changes made at this point, so just return
         finished_fn();
         return false;
       }
+      // Split groups longer than an IO packet into several tasks so that one
+      // long group does not leave a single worker running after the rest
+      // are done. Each task stays within its group, which is all the row
+      // analysis needs. Unbounded state Ops would replay their group from
+      // the start in every task, so their groups are kept whole.
+      bool split_groups =
+          dag_info.unbounded_state_ops.empty() && io_packet_size > 0;
+      partition_boundaries.push_back(group_boundaries.front());
+      for (size_t g = 1; g < group_boundaries.size(); ++g) {
+        i64 group_start = group_boundaries[g - 1];
+        i64 group_end = group_boundaries[g];
+        if (split_groups) {
+          for (i64 r = group_start + io_packet_size; r < group_end;
+               r += io_packet_size) {
+            partition_boundaries.push_back(r);
+          }
+        }
+        partition_boundaries.push_back(group_end);
+      }
     }
     assert(partition_boundaries.back() == total_output_rows);
     job_tasks_.emplace_back();
     auto& tasks = job_tasks_.back();
+    tasks.reserve(partition_boundaries.size() - 1);
     for (i64 pi = 0; pi < partition_boundaries.size() - 1; ++pi) {
-      tasks.emplace_back();
-      auto& task_rows = tasks.back();
-
-      i64 s = partition_boundaries[pi];
-      i64 e = partition_boundaries[pi + 1];
-      for (i64 r = s; r < e; ++r) {
-        task_rows.push_back(r);
-      }
+      tasks.push_back(
+          TaskRows{partition_boundaries[pi], partition_boundaries[pi + 1], 1});
       total_tasks_++;
     }
   }
@@ -877,11 +2312,23 @@ bool MasterImpl::process_job(const proto::BulkJobParameters* job_params,
   }
 
   // Write out database metadata so that workers can read it
-  write_bulk_job_metadata(storage_, BulkJobMetadata(job_descriptor));
+  checkpoint_completed_tasks();
 
+  std::vector<std::string> new_output_tables;
   for (i64 job_idx = 0; job_idx < job_params->jobs_size(); ++job_idx) {
     auto& job = job_params->jobs(job_idx);
-    i32 table_id = meta_.add_table(job.output_table_name());
+    job_input_tables_.emplace_back();
+    for (auto& column_input : job.inputs()) {
+      job_input_tables_.back().insert(
+          meta_.get_table_id(column_input.table_name()));
+    }
+    i32 table_id = -1;
+    if (resuming && meta_.has_table(job.output_table_name())) {
+      table_id = meta_.get_table_id(job.output_table_name());
+    } else {
+      table_id = meta_.add_table(job.output_table_name());
+      new_output_tables.push_back(job.output_table_name());
+    }
     job_to_table_id_[job_idx] = table_id;
     proto::TableDescriptor table_desc;
     table_desc.set_id(table_id);
@@ -893,6 +2340,13 @@ bool MasterImpl::process_job(const proto::BulkJobParameters* job_params,
     for (size_t i = 0; i < job_output_columns[job_idx].size(); ++i) {
       Column* col = table_desc.add_columns();
       col->CopyFrom(job_output_columns[job_idx][i]);
+      // Save workers compress the elements of non-video columns themselves,
+      // so loads need to know the codec
+      if (col->type() != ColumnType::Video &&
+          i < job_params->compression_size() &&
+          is_element_codec(job_params->compression(i).codec())) {
+        col->set_codec(job_params->compression(i).codec());
+      }
     }
     table_metas_->update(TableMetadata(table_desc));
 
@@ -904,15 +2358,35 @@ bool MasterImpl::process_job(const proto::BulkJobParameters* job_params,
       total_rows += task_rows;
       end_rows.push_back(total_rows);
     }
-    for (i64 r : end_rows) {
-      table_desc.add_end_rows(r);
-    }
     table_desc.set_job_id(bulk_job_id);
+    if (!reduce_ops_.empty()) {
+      // The master writes the result of each reduce op as the one row of
+      // the table, uncompressed
+      table_desc.add_end_rows(1);
+      for (Column& col : *table_desc.mutable_columns()) {
+        col.clear_codec();
+      }
+    } else {
+      for (i64 r : end_rows) {
+        table_desc.add_end_rows(r);
+      }
+      table_desc.set_ephemeral(job_params->ephemeral_outputs());
+      table_desc.set_packed_items(job_params->packed_outputs() &&
+                                  !job_params->ephemeral_outputs());
+    }
 
     write_table_metadata(storage_, TableMetadata(table_desc));
     table_metas_->update(TableMetadata(table_desc));
   }
 
+  if (job_params->task_scheduling() ==
+      proto::BulkJobParameters::LONGEST_FIRST) {
+    for (size_t i = 0; i < jobs.size(); ++i) {
+      job_decode_frames_per_row_.push_back(
+          decode_frames_per_row(jobs[i], total_output_rows_per_job_[i]));
+    }
+  }
+
   // Setup initial task sampler
   task_result_.set_success(true);
   next_task_ = 0;
@@ -930,35 +2404,48 @@ bool MasterImpl::process_job(const proto::BulkJobParameters* job_params,
     bar_.reset(nullptr);
   }
 
-  // TODO(apoms): change this to support adding and removing nodes
-  //              the main change is that the workers should handle
-  //              spawning sub processes instead of appearing as
-  //              multiple logical nodes
-  for (auto kv : worker_addresses_) {
-    const std::string& address = kv.second;
-    // Strip port
-    std::vector<std::string> split_addr = split(address, ':');
-    std::string sans_port = split_addr[0];
-    if (local_totals_.count(sans_port) == 0) {
-      local_totals_[sans_port] = 0;
-    }
-    local_totals_[sans_port] += 1;
+  // Tasks finished by an interrupted run are not granted again
+  total_tasks_used_ = completed_job_tasks_.size();
+  if (bar_) {
+    bar_->Progressed(total_tasks_used_);
+  }
+  if (total_tasks_used_ == total_tasks_) {
+    generate_next_task();
+    std::unique_lock<std::mutex> lock(finished_mutex_);
+    finished_ = true;
   }
 
   // Send new job command to workers
   VLOG(1) << "Sending new job command to workers";
 
   {
+    // Held throughout so that a worker registering now is either counted
+    // and started here or started by RegisterWorker, but not both
     std::unique_lock<std::mutex> lk(work_mutex_);
+    // TODO(apoms): change this to support adding and removing nodes
+    //              the main change is that the workers should handle
+    //              spawning sub processes instead of appearing as
+    //              multiple logical nodes
+    for (auto kv : worker_addresses_) {
+      const std::string& address = kv.second;
+      // Strip port
+      std::vector<std::string> split_addr = split(address, ':');
+      std::string sans_port = split_addr[0];
+      if (local_totals_.count(sans_port) == 0) {
+        local_totals_[sans_port] = 0;
+      }
+      local_totals_[sans_port] += 1;
+    }
     for (auto kv : worker_addresses_) {
       i32 worker_id = kv.first;
       std::string& address = kv.second;
 
       start_job_on_worker(worker_id, address);
     }
+    job_workers_started_ = true;
   }
 
-  // Ping workers every 10 seconds to make sure they are alive
+  // Ping workers periodically to make sure they are alive
   start_worker_pinger();
 
   // Wait for all workers to finish
@@ -1011,10 +2498,27 @@ bool MasterImpl::process_job(const proto::BulkJobParameters* job_params,
 
   // No need to check status of workers anymore
   stop_worker_pinger();
+  {
+    std::unique_lock<std::mutex> lk(work_mutex_);
+    job_workers_started_ = false;
+  }
 
   if (!job_result->success()) {
-    // Overwrite database metadata with copy from prior to modification
-    write_database_metadata(storage_, meta_copy);
+    if (!completed_job_tasks_.empty()) {
+      // Keep the output tables and record the finished tasks so that
+      // resubmitting the bulk job resumes it
+      checkpoint_completed_tasks();
+    } else {
+      // Overwrite database metadata with copy from prior to modification.
+      // Its table index is read lazily, so it already has the output tables
+      // and they have to be taken out again.
+      for (const std::string& table : new_output_tables) {
+        if (meta_copy.has_table(table)) {
+          meta_copy.remove_table(meta_copy.get_table_id(table));
+        }
+      }
+      write_database_metadata(storage_, meta_copy);
+    }
   }
 
   if (!task_result_.success()) {
@@ -1026,6 +2530,133 @@ bool MasterImpl::process_job(const proto::BulkJobParameters* job_params,
     }
   }
 
+  if (job_result->success() && !worker_tuned_parameters_.empty()) {
+    // Every node runs the same pipeline, so pick values all of them can
+    // sustain: the fewest instances and the smallest packets any worker
+    // asked for, and the deepest task queue
+    proto::TunedParameters tuned = worker_tuned_parameters_.begin()->second;
+    for (auto& kv : worker_tuned_parameters_) {
+      const proto::TunedParameters& t = kv.second;
+      tuned.set_pipeline_instances_per_node(
+          std::min(tuned.pipeline_instances_per_node(),
+                   t.pipeline_instances_per_node()));
+      tuned.set_work_packet_size(
+          std::min(tuned.work_packet_size(), t.work_packet_size()));
+      tuned.set_io_packet_size(
+          std::min(tuned.io_packet_size(), t.io_packet_size()));
+      tuned.set_tasks_in_queue_per_pu(
+          std::max(tuned.tasks_in_queue_per_pu(), t.tasks_in_queue_per_pu()));
+    }
+    tuned.set_io_packet_size(
+        std::max(1, tuned.io_packet_size() / tuned.work_packet_size()) *
+        tuned.work_packet_size());
+    VLOG(1) << "Tuned pipeline parameters: " << tuned.ShortDebugString();
+    job_descriptor.mutable_tuned_parameters()->CopyFrom(tuned);
+  }
+
+  if (job_result->success() && !reduce_ops_.empty()) {
+    std::unique_lock<std::mutex> lk(work_mutex_);
+    write_reduced_outputs();
+  }
+
+  if (job_result->success() && !failed_job_tasks_.empty()) {
+    // Report the tasks given up on and mark their items as missing, so that
+    // they can be rerun on their own rather than with the whole bulk job
+    std::map<i64, std::vector<i64>> failed_items;
+    for (const std::tuple<i64, i64>& job_task : failed_job_tasks_) {
+      i64 job_idx = std::get<0>(job_task);
+      i64 task_idx = std::get<1>(job_task);
+      const proto::TableDescriptor& desc =
+          table_metas_->at(job_to_table_id_.at(job_idx)).get_descriptor();
+      proto::FailedTask* failed = job_descriptor.add_failed_tasks();
+      failed->set_job_id(job_idx);
+      failed->set_task_id(task_idx);
+      for (i32 worker_id : task_failures_[job_task]) {
+        failed->add_worker_addresses(worker_addresses_.at(worker_id));
+      }
+      if (!reduce_ops_.empty()) {
+        // The one reduced row is missing the rows of the task
+        failed->set_start_row(0);
+        failed->set_end_row(1);
+        if (failed_items[job_idx].empty()) {
+          failed_items[job_idx].push_back(0);
+        }
+        continue;
+      }
+      failed->set_start_row(task_idx > 0 ? desc.end_rows(task_idx - 1) : 0);
+      failed->set_end_row(desc.end_rows(task_idx));
+      failed_items[job_idx].push_back(task_idx);
+    }
+    for (auto& kv : failed_items) {
+      proto::TableDescriptor desc =
+          table_metas_->at(job_to_table_id_.at(kv.first)).get_descriptor();
+      for (i64 item : kv.second) {
+        desc.add_failed_items(item);
+      }
+      write_table_metadata(storage_, TableMetadata(desc));
+      table_metas_->update(TableMetadata(desc));
+    }
+    LOG(WARNING) << "Bulk job finished with " << failed_job_tasks_.size()
+                 << " tasks given up on after they failed";
+  }
+
+  if (job_result->success() && job_params->ephemeral_outputs() &&
+      reduce_ops_.empty()) {
+    // Later bulk jobs find the items of the output tables on the workers
+    // that wrote them
+    for (i64 job_idx = 0; job_idx < num_jobs_; ++job_idx) {
+      proto::TableDescriptor desc =
+          table_metas_->at(job_to_table_id_.at(job_idx)).get_descriptor();
+      desc.clear_item_addresses();
+      for (i64 task_id = 0; task_id < desc.end_rows_size(); ++task_id) {
+        auto it = task_workers_.find(std::make_tuple(job_idx, task_id));
+        desc.add_item_addresses(it != task_workers_.end()
+                                    ? worker_addresses_.at(it->second)
+                                    : "");
+      }
+      write_table_metadata(storage_, TableMetadata(desc));
+      table_metas_->update(TableMetadata(desc));
+    }
+  }
+
+  if (job_result->success()) {
+    // Save how long each op took for profile guided placement of later jobs
+    std::map<std::tuple<std::string, DeviceType>, proto::OpProfile> profiles;
+    {
+      std::unique_lock<std::mutex> lk(work_mutex_);
+      for (auto& kv : worker_op_profiles_) {
+        for (const proto::OpProfile& profile : kv.second) {
+          proto::OpProfile& total =
+              profiles[std::make_tuple(profile.name(), profile.device_type())];
+          total.set_name(profile.name());
+          total.set_device_type(profile.device_type());
+          total.set_rows(total.rows() + profile.rows());
+          total.set_eval_ns(total.eval_ns() + profile.eval_ns());
+          total.set_transferred_rows(total.transferred_rows() +
+                                     profile.transferred_rows());
+          total.set_transfer_ns(total.transfer_ns() + profile.transfer_ns());
+          total.set_device_ns(total.device_ns() + profile.device_ns());
+          total.set_transfer_device_ns(total.transfer_device_ns() +
+                                       profile.transfer_device_ns());
+          total.set_cycles(total.cycles() + profile.cycles());
+          total.set_instructions(total.instructions() +
+                                 profile.instructions());
+          total.set_llc_misses(total.llc_misses() + profile.llc_misses());
+          if (profile.tuned_batch_size() > 0 &&
+              (total.tuned_batch_size() == 0 ||
+               profile.tuned_batch_size() < total.tuned_batch_size())) {
+            total.set_tuned_batch_size(profile.tuned_batch_size());
+          }
+        }
+      }
+    }
+    for (auto& kv : profiles) {
+      job_descriptor.add_op_profiles()->CopyFrom(kv.second);
+    }
+    job_descriptor.set_interrupted(false);
+    write_bulk_job_metadata(storage_, BulkJobMetadata(job_descriptor));
+  }
+
   std::fflush(NULL);
   sync();
 
@@ -1035,7 +2666,24 @@ bool MasterImpl::process_job(const proto::BulkJobParameters* job_params,
 }
 
 void MasterImpl::start_worker_pinger() {
-  while (!finished_) {
+  stop_worker_pinger();
+  worker_pinger_thread_ = std::thread([this]() { worker_pinger_loop(); });
+}
+
+void MasterImpl::worker_pinger_loop() {
+  timepoint_t last_checkpoint = now();
+  while (true) {
+    {
+      std::unique_lock<std::mutex> lock(finished_mutex_);
+      if (finished_) break;
+    }
+    if (std::chrono::duration_cast<std::chrono::milliseconds>(
+            now() - last_checkpoint)
+            .count() >= CHECKPOINT_INTERVAL_MS) {
+      checkpoint_completed_tasks();
+      last_checkpoint = now();
+    }
+
     std::map<i32, proto::Worker::Stub*> ws;
     {
       std::unique_lock<std::mutex> lk(work_mutex_);
@@ -1043,6 +2691,14 @@ void MasterImpl::start_worker_pinger() {
         i32 worker_id = kv.first;
         auto& worker = kv.second;
         if (!worker_active_[worker_id]) continue;
+        auto heartbeat = worker_heartbeats_.find(worker_id);
+        if (heartbeat != worker_heartbeats_.end() &&
+            std::chrono::duration_cast<std::chrono::milliseconds>(
+                now() - heartbeat->second)
+                    .count() < WORK_STREAM_PING_SKIP_MS) {
+          // Worker is known to be alive
+          continue;
+        }
 
         ws.insert({worker_id, kv.second.get()});
       }
@@ -1060,23 +2716,205 @@ void MasterImpl::start_worker_pinger() {
         // Worker not responding, remove it from active workers
         LOG(WARNING) << "Worker " << worker_id << " did not respond to Ping. "
                      << "Removing worker from active list.";
-        remove_worker(worker_id);
+        std::unique_lock<std::mutex> lk(work_mutex_);
+        remove_worker(worker_id, true);
       }
     }
-    // FIXME(apoms): this sleep is unfortunate because it means a
-    //               job must take at least this long. A solution
-    //               would be to put it in a separate thread.
-    std::this_thread::sleep_for(std::chrono::seconds(5));
+    // Woken early when the bulk job finishes so it does not wait out the
+    // interval
+    std::unique_lock<std::mutex> lock(finished_mutex_);
+    finished_cv_.wait_for(lock,
+                          std::chrono::milliseconds(WORKER_PING_INTERVAL_MS),
+                          [this] { return finished_; });
   }
 }
 
 void MasterImpl::stop_worker_pinger() {
+  if (worker_pinger_thread_.joinable()) {
+    worker_pinger_thread_.join();
+  }
+}
+
+void MasterImpl::checkpoint_completed_tasks() {
+  proto::BulkJobDescriptor descriptor;
+  {
+    std::unique_lock<std::mutex> lk(work_mutex_);
+    if ((i64)completed_job_tasks_.size() == checkpointed_tasks_) {
+      return;
+    }
+    checkpointed_tasks_ = completed_job_tasks_.size();
+    descriptor.CopyFrom(job_descriptor_);
+    for (const std::tuple<i64, i64>& job_task : completed_job_tasks_) {
+      proto::CompletedTask* task = descriptor.add_completed_tasks();
+      task->set_job_id(std::get<0>(job_task));
+      task->set_task_id(std::get<1>(job_task));
+    }
+  }
+  write_bulk_job_metadata(storage_, BulkJobMetadata(descriptor));
+}
+
+std::vector<std::string> MasterImpl::job_op_libraries() const {
+  std::set<std::string> job_ops;
+  for (const proto::Op& op : job_params_.ops()) {
+    job_ops.insert(op.name());
+  }
+  std::vector<std::string> libraries;
+  for (const std::string& so_path : so_paths_) {
+    const std::set<std::string>& provided = so_path_ops_.at(so_path);
+    bool used = provided.empty();
+    for (const std::string& name : provided) {
+      if (job_ops.count(name) > 0) {
+        used = true;
+        break;
+      }
+    }
+    if (used) {
+      libraries.push_back(so_path);
+    }
+  }
+  return libraries;
+}
+
+void MasterImpl::combine_reduced_state(i64 job_idx,
+                                       const proto::KernelState& partial) {
+  std::vector<u8> bytes(partial.state().begin(), partial.state().end());
+  auto key = std::make_tuple(job_idx, (i64)partial.op_index());
+  auto it = reduced_states_.find(key);
+  if (it == reduced_states_.end()) {
+    reduced_states_[key] = std::move(bytes);
+    return;
+  }
+  BaseKernel* kernel = reduce_kernels_.at(partial.op_index()).get();
+  kernel->reset();
+  kernel->deserialize_state(it->second);
+  kernel->combine_state(bytes);
+  it->second.clear();
+  kernel->serialize_state(it->second);
+}
+
+void MasterImpl::setup_reduce_kernels(const std::vector<proto::Op>& ops) {
+  OpRegistry* op_registry = get_op_registry();
+  KernelRegistry* kernel_registry = get_kernel_registry();
+  for (i64 op_idx : reduce_ops_) {
+    const proto::Op& op = ops.at(op_idx);
+    OpInfo* op_info = op_registry->get_op_info(op.name());
+    KernelConfig config;
+    config.node_id = -1;
+    config.devices = {CPU_DEVICE};
+    config.args = std::vector<u8>(op.kernel_args().begin(),
+                                  op.kernel_args().end());
+    for (auto& col : op_info->output_columns()) {
+      config.output_columns.push_back(col.name());
+    }
+    auto& input_columns = op_info->input_columns();
+    for (int i = 0; i < op.inputs().size(); ++i) {
+      config.input_columns.push_back(op.inputs(i).column());
+      config.input_column_types.push_back(input_columns.size() == 0
+                                              ? ColumnType::Other
+                                              : input_columns[i].type());
+    }
+    KernelFactory* factory =
+        kernel_registry->get_kernel(op.name(), DeviceType::CPU);
+    reduce_kernels_[op_idx].reset(factory->new_instance(config));
+  }
+}
+
+void MasterImpl::write_reduced_outputs() {
+  const proto::Op& output_op = job_params_.ops(job_params_.ops_size() - 1);
+  for (i64 job_idx = 0; job_idx < num_jobs_; ++job_idx) {
+    const proto::TableDescriptor& desc =
+        table_metas_->at(job_to_table_id_.at(job_idx)).get_descriptor();
+    for (i32 c = 0; c < output_op.inputs_size(); ++c) {
+      i64 op_idx = output_op.inputs(c).op_index();
+      std::vector<u8> result;
+      auto it = reduced_states_.find(std::make_tuple(job_idx, op_idx));
+      if (it != reduced_states_.end()) {
+        result = it->second;
+      } else {
+        // No task of the job had rows, so the result is that of no rows
+        BaseKernel* kernel = reduce_kernels_.at(op_idx).get();
+        kernel->reset();
+        kernel->serialize_state(result);
+      }
+      i32 column_id = desc.columns(c).id();
+
+      std::unique_ptr<storehouse::WriteFile> output_file;
+      BACKOFF_FAIL(make_unique_write_file(
+          storage_, table_item_output_path(desc.id(), column_id, 0),
+          output_file));
+      s_write(output_file.get(), result.data(), result.size());
+      BACKOFF_FAIL(output_file->save());
+
+      std::vector<u64> header = {1, result.size()};
+      std::unique_ptr<storehouse::WriteFile> metadata_file;
+      BACKOFF_FAIL(make_unique_write_file(
+          storage_, table_item_metadata_path(desc.id(), column_id, 0),
+          metadata_file));
+      s_write(metadata_file.get(), reinterpret_cast<const u8*>(header.data()),
+              header.size() * sizeof(u64));
+      BACKOFF_FAIL(metadata_file->save());
+    }
+  }
+}
+
+void MasterImpl::write_replay_bundle(
+    const proto::BulkJobParameters& params) {
+  proto::ReplayBundle bundle;
+  proto::BulkJobParameters& replay_params = *bundle.mutable_params();
+  replay_params.CopyFrom(params);
+  replay_params.clear_replay_bundle();
+  for (const std::string& so_path : job_op_libraries()) {
+    replay_params.add_op_libraries(so_path);
+  }
+
+  std::set<std::string> table_names;
+  for (const proto::Job& job : params.jobs()) {
+    for (const proto::ColumnInput& ci : job.inputs()) {
+      table_names.insert(ci.table_name());
+    }
+  }
+  for (const std::string& name : table_names) {
+    const TableMetadata& table = table_metas_->at(name);
+    const proto::TableDescriptor& descriptor = table.get_descriptor();
+    proto::ReplayTable* replay_table = bundle.add_input_tables();
+    replay_table->mutable_table()->CopyFrom(descriptor);
+    // Sizes of separate column files only; video and packed items vary too
+    // much within a file to say
+    i64 first_item_rows =
+        descriptor.end_rows_size() > 0 ? descriptor.end_rows(0) : 0;
+    for (const proto::Column& column : descriptor.columns()) {
+      i64 row_bytes = 0;
+      storehouse::FileInfo info;
+      if (first_item_rows > 0 && !descriptor.packed_items() &&
+          column.type() != ColumnType::Video &&
+          storage_->get_file_info(
+              table_item_output_path(descriptor.id(), column.id(), 0),
+              info) == storehouse::StoreResult::Success) {
+        row_bytes = info.size / first_item_rows;
+      }
+      replay_table->add_row_bytes(row_bytes);
+    }
+  }
+
+  std::unique_ptr<storehouse::WriteFile> output_file;
+  BACKOFF_FAIL(make_unique_write_file(
+      storage_, replay_bundle_path(params.replay_bundle()), output_file));
+  serialize_db_proto(output_file.get(), bundle);
+  BACKOFF_FAIL(output_file->save());
+  VLOG(1) << "Recorded bulk job " << params.job_name() << " in replay bundle "
+          << params.replay_bundle();
 }
 
 void MasterImpl::start_job_on_worker(i32 worker_id,
                                      const std::string& address) {
   proto::BulkJobParameters w_job_params;
   w_job_params.MergeFrom(job_params_);
+  for (const std::string& so_path : job_op_libraries()) {
+    w_job_params.add_op_libraries(so_path);
+  }
+  for (const proto::JobRowAnalysis& analysis : job_row_analysis_) {
+    w_job_params.add_job_row_analysis()->CopyFrom(analysis);
+  }
 
   auto& worker = workers_.at(worker_id);
   std::vector<std::string> split_addr = split(address, ':');
@@ -1099,17 +2937,44 @@ void MasterImpl::start_job_on_worker(i32 worker_id,
   VLOG(2) << "Sent NewJob command to worker " << worker_id;
 }
 
-void MasterImpl::stop_job_on_worker(i32 worker_id) {
+void MasterImpl::stop_job_on_worker(i32 worker_id, bool worker_failed) {
   // Place workers active tasks back into the unallocated task samples
   if (active_job_tasks_.count(worker_id) > 0) {
+    std::set<std::tuple<i64, i64>> worker_tasks =
+        active_job_tasks_.at(worker_id);
+    active_job_tasks_.erase(worker_id);
+    commit_attempts_.erase(worker_id);
+    for (auto it = pending_commits_.begin(); it != pending_commits_.end();) {
+      if (it->second.worker_id == worker_id) {
+        it = pending_commits_.erase(it);
+      } else {
+        ++it;
+      }
+    }
+    std::set<std::tuple<i64, i64>> started = started_tasks_[worker_id];
+    started_tasks_.erase(worker_id);
+    VLOG(1) << "Reassigning worker " << worker_id << "'s "
+            << worker_tasks.size() << " task samples.";
+    i32 max_failures = job_params_.max_task_failures();
     // Place workers active tasks back into the unallocated task samples
-    for (const std::tuple<i64, i64>& worker_job_task :
-         active_job_tasks_.at(worker_id)) {
+    for (const std::tuple<i64, i64>& worker_job_task : worker_tasks) {
+      // Tasks with a copy still running elsewhere need not be granted again
+      if (retract_attempt(worker_id, worker_job_task)) {
+        continue;
+      }
+      if (worker_failed && started.count(worker_job_task) > 0) {
+        // A task that keeps taking down the workers running it, e.g. on a
+        // corrupt input, would otherwise fail the whole bulk job. Tasks
+        // that were only queued behind it are not to blame.
+        std::vector<i32>& failures = task_failures_[worker_job_task];
+        failures.push_back(worker_id);
+        if (max_failures > 0 && (i32)failures.size() >= max_failures) {
+          quarantine_task(worker_job_task);
+          continue;
+        }
+      }
       unallocated_job_tasks_.push_back(worker_job_task);
     }
-    VLOG(1) << "Reassigning worker " << worker_id << "'s "
-            << active_job_tasks_.at(worker_id).size() << " task samples.";
-    active_job_tasks_.erase(worker_id);
   }
 
   worker_histories_[worker_id].end_time = now();
@@ -1124,7 +2989,7 @@ void MasterImpl::stop_job_on_worker(i32 worker_id) {
   rpcs_.erase(worker_id);*/
 }
 
-void MasterImpl::remove_worker(i32 node_id) {
+void MasterImpl::remove_worker(i32 node_id, bool worker_failed) {
   assert(workers_.count(node_id) > 0);
 
   std::string worker_address = worker_addresses_.at(node_id);
@@ -1134,7 +2999,7 @@ void MasterImpl::remove_worker(i32 node_id) {
   {
     std::unique_lock<std::mutex> lock(active_mutex_);
     if (active_bulk_job_ && client_contexts_.count(node_id) > 0) {
-      stop_job_on_worker(node_id);
+      stop_job_on_worker(node_id, worker_failed);
     }
   }
 
@@ -16,13 +16,18 @@
 #pragma once
 
 #include <grpc/support/log.h>
+#include "scanner/engine/dag_analysis.h"
 #include "scanner/engine/rpc.grpc.pb.h"
 #include "scanner/engine/runtime.h"
 #include "scanner/engine/sampler.h"
+#include "scanner/util/metrics_server.h"
 #include "scanner/util/progress_bar.h"
 #include "scanner/util/util.h"
 
+#include <deque>
+#include <map>
 #include <mutex>
+#include <set>
 #include <thread>
 
 namespace scanner {
@@ -56,22 +61,48 @@ class MasterImpl final : public proto::Master::Service {
                             const proto::IngestParameters* params,
                             proto::IngestResult* result);
 
+  grpc::Status IngestImages(grpc::ServerContext* context,
+                            const proto::IngestImagesParameters* params,
+                            proto::IngestResult* result);
+
   grpc::Status NextWork(grpc::ServerContext* context,
                         const proto::NodeInfo* node_info,
                         proto::NewWork* new_work);
 
+  grpc::Status NextWorkBatch(grpc::ServerContext* context,
+                             const proto::NextWorkParameters* params,
+                             proto::NewWorkBatch* new_work);
+
+  // Grants tasks as the worker makes room for them and receives its
+  // completions and heartbeats, all over one stream per bulk job
+  grpc::Status WorkStream(
+      grpc::ServerContext* context,
+      grpc::ServerReaderWriter<proto::MasterMessage, proto::WorkerMessage>*
+          stream);
+
+  grpc::Status ReturnWork(grpc::ServerContext* context,
+                          const proto::ReturnWorkParameters* params,
+                          proto::Empty* empty);
+
   grpc::Status FinishedWork(grpc::ServerContext* context,
                             const proto::FinishedWorkParameters* params,
                             proto::Empty* empty);
 
+  // Queues the bulk job and returns a ticket to poll IsJobDone with
   grpc::Status NewJob(grpc::ServerContext* context,
                       const proto::BulkJobParameters* job_params,
-                      proto::Result* job_result);
+                      proto::NewJobReply* reply);
 
   grpc::Status IsJobDone(grpc::ServerContext* context,
-                         const proto::Empty* empty,
+                         const proto::JobTicket* ticket,
                          proto::JobResult* job_result);
 
+  // Writes the task events of the bulk job until it finishes or the client
+  // goes away
+  grpc::Status WatchJob(grpc::ServerContext* context,
+                        const proto::JobTicket* ticket,
+                        grpc::ServerWriter<proto::TaskEvent>* writer);
+
   grpc::Status Ping(grpc::ServerContext* context, const proto::Empty* empty1,
                     proto::Empty* empty2);
 
@@ -100,23 +131,163 @@ class MasterImpl final : public proto::Master::Service {
   void start_watchdog(grpc::Server* server, bool enable_timeout,
                       i32 timeout_ms = 50000);
 
+  //! Serves metrics on the workers, tasks and op throughput of the current
+  //! bulk job over HTTP
+  void start_metrics_server(i32 port);
+
  private:
+  void write_metrics(MetricsWriter& writer);
+
+  struct QueuedBulkJob {
+    i64 ticket;
+    proto::BulkJobParameters params;
+  };
+
   void start_job_processor();
 
   void stop_job_processor();
 
+  // Queued bulk job to run next. Expects active_mutex_ to be held and the
+  // queue to be non-empty.
+  std::deque<QueuedBulkJob>::iterator next_queued_bulk_job();
+
+  // Whether the bulk job of the ticket has finished, guarded by
+  // active_mutex_
+  bool bulk_job_done(i64 ticket);
+
+  // Moves ops that have both CPU and GPU kernels to the devices with the
+  // lowest profiled evaluation time plus transfers between devices, using
+  // the op profiles saved by recent bulk jobs
+  void place_ops_by_profile(proto::BulkJobParameters& params);
+
+  // Spreads ingesting videos with allocated table ids across workers in
+  // chunks, ingesting a chunk locally if its worker fails
+  void distributed_ingest(
+      const std::vector<std::pair<i32, proto::Worker::Stub*>>& workers,
+      const std::vector<std::string>& table_names,
+      const std::vector<i32>& table_ids, const std::vector<std::string>& paths,
+      bool inplace, i32 proxy_height, std::vector<bool>& bad_videos,
+      std::vector<std::string>& bad_messages);
+
+  // Assigns the next unallocated task to the worker. Returns false if there
+  // is no work left, or none ready yet when tasks_waiting_on_state_ is set.
+  // Expects work_mutex_ to be held.
+  bool assign_next_task(i32 node_id, proto::NewWork* new_work);
+
+  // Fills new_work with up to max_tasks tasks, or sets no_more_work. Expects
+  // work_mutex_ to be held.
+  void grant_tasks(i32 node_id, i32 max_tasks, proto::NewWorkBatch* new_work);
+
+  // Records a task as done, or for speculative jobs picks the attempt whose
+  // files are kept and waits for it to commit them. Expects work_mutex_ to
+  // be held.
+  void finish_task(const proto::FinishedWorkParameters& params);
+
+  // Records a task whose winning attempt moved its files into place as
+  // done. Expects work_mutex_ to be held.
+  void commit_task(i32 node_id, const std::tuple<i64, i64>& job_task);
+
+  void complete_task(const proto::FinishedWorkParameters& params,
+                     i64 task_runtime_ms);
+
+  // Folds the partial result of a reduce op over a task of the job into the
+  // result of the job so far. Expects work_mutex_ to be held.
+  void combine_reduced_state(i64 job_idx, const proto::KernelState& partial);
+
+  // Creates the CPU kernels the partial results of the reduce ops of the
+  // bulk job are combined with
+  void setup_reduce_kernels(const std::vector<proto::Op>& ops);
+
+  // Writes the result of every reduce op of every job as the single row of
+  // its output column
+  void write_reduced_outputs();
+
+  // Generates the next task into unallocated_job_tasks_. Returns false if
+  // every task has been generated.
+  bool generate_next_task();
+
+  // Position in unallocated_job_tasks_ of the task whose inputs the worker
+  // most likely has cached
+  size_t pick_local_task(i32 node_id);
+
+  // Relative throughput of the worker's hardware for the current job
+  f64 worker_capability(i32 node_id);
+
+  // Tasks per second the worker has retired this job. Returns false until
+  // it has retired enough tasks for the rate to be meaningful.
+  bool measured_task_rate(i32 node_id, f64& rate);
+
+  // Measured task rate, or an estimate from the worker's capability
+  f64 worker_task_rate(i32 node_id);
+
+  // Caps a grant of max_tasks to the worker's share of the outstanding
+  // tasks and returns 0 when one of the last tasks would be better left for
+  // a faster worker. Expects work_mutex_ to be held.
+  i32 weighted_task_limit(i32 node_id, i32 max_tasks);
+
+  // Frames decoded for each output row of the job, estimated from the
+  // sampling stride and keyframe spacing of its video inputs
+  f64 decode_frames_per_row(const proto::Job& job, i64 output_rows);
+
+  // Estimated time to run the task under the current cost model
+  f64 estimate_task_cost(const std::tuple<i64, i64>& job_task);
+
+  // Adds a finished task's runtime to the cost model and refits it every
+  // few tasks. Expects work_mutex_ to be held.
+  void update_task_cost_model(const std::tuple<i64, i64>& job_task,
+                              i64 runtime_ms);
+
+  // Orders unallocated_job_tasks_ so the most expensive task is granted
+  // next. Expects work_mutex_ to be held.
+  void sort_tasks_by_cost();
+
+  // Grants the worker a duplicate of the slowest straggling task. Returns
+  // false if no task is slow enough. Expects work_mutex_ to be held.
+  bool assign_speculative_task(i32 node_id, proto::NewWork* new_work);
+
+  // Forgets the worker's attempt at the task. Returns true if another worker
+  // is still running a copy of it. Expects work_mutex_ to be held.
+  bool retract_attempt(i32 node_id, const std::tuple<i64, i64>& job_task);
+
+  void fill_new_work(const std::tuple<i64, i64>& job_task,
+                     proto::NewWork* new_work);
+
   bool process_job(const proto::BulkJobParameters* job_params,
                    proto::Result* job_result);
 
+  // Pings the workers of the bulk job and checkpoints its finished tasks on
+  // a separate thread until the bulk job finishes
   void start_worker_pinger();
 
   void stop_worker_pinger();
 
+  void worker_pinger_loop();
+
+  // Saves the bulk job descriptor with the tasks finished so far, if any
+  // finished since the last checkpoint
+  void checkpoint_completed_tasks();
+
   void start_job_on_worker(i32 node_id, const std::string& address);
 
-  void stop_job_on_worker(i32 node_id);
+  //! Op libraries providing the ops of the current bulk job, plus those
+  //! that registered nothing the master could see
+  std::vector<std::string> job_op_libraries() const;
 
-  void remove_worker(i32 node_id);
+  //! Records the bulk job and the shape of its input tables in the replay
+  //! bundle it names
+  void write_replay_bundle(const proto::BulkJobParameters& params);
+
+  //! Regrants the tasks the worker was running. With worker_failed, they
+  //! count a failure each and those out of retries are quarantined.
+  void stop_job_on_worker(i32 node_id, bool worker_failed);
+
+  void remove_worker(i32 node_id, bool worker_failed = false);
+
+  //! Gives up on a task, which then counts as done
+  void quarantine_task(const std::tuple<i64, i64>& job_task);
+
+  //! Marks the bulk job finished once every task is done
+  void check_tasks_done();
 
 
   std::thread watchdog_thread_;
@@ -125,6 +296,7 @@ class MasterImpl final : public proto::Master::Service {
   std::map<i32, bool> worker_active_;
   std::map<i32, std::unique_ptr<proto::Worker::Stub>> workers_;
   std::map<i32, std::string> worker_addresses_;
+  std::map<i32, proto::MachineParameters> worker_machine_params_;
   Flag trigger_shutdown_;
   DatabaseParameters db_params_;
   storehouse::StorageBackend* storage_;
@@ -132,6 +304,9 @@ class MasterImpl final : public proto::Master::Service {
   std::unique_ptr<TableMetaCache> table_metas_;
   std::unique_ptr<ProgressBar> bar_;
   std::vector<std::string> so_paths_;
+  // Ops and kernels each op library registered when the master loaded it.
+  // Workers only load the libraries a bulk job uses, on its NewJob.
+  std::map<std::string, std::set<std::string>> so_path_ops_;
   std::vector<proto::OpRegistration> op_registrations_;
   std::vector<proto::PythonKernelRegistration> py_kernel_registrations_;
   proto::BulkJobParameters job_params_;
@@ -143,6 +318,28 @@ class MasterImpl final : public proto::Master::Service {
   std::mutex active_mutex_;
   std::condition_variable active_cv_;
   bool active_bulk_job_ = false;
+  // Bulk jobs waiting to run, guarded by active_mutex_
+  std::deque<QueuedBulkJob> queued_bulk_jobs_;
+  i64 next_bulk_job_ticket_ = 1;
+  // Ticket of the bulk job being processed, or -1
+  i64 running_bulk_job_ticket_ = -1;
+  // Bulk jobs started for each submitter, for fair sharing
+  std::map<std::string, i64> submitter_bulk_jobs_run_;
+  // Results of finished bulk jobs by ticket, until IsJobDone delivers them
+  std::map<i64, Result> bulk_job_results_;
+  // Signaled when a result is added to bulk_job_results_
+  std::condition_variable bulk_job_results_cv_;
+
+  // Task events of the running bulk job for WatchJob, guarded by
+  // task_events_mutex_ and signaled on task_events_cv_
+  std::mutex task_events_mutex_;
+  std::condition_variable task_events_cv_;
+  i64 task_events_ticket_ = 0;
+  bool task_events_done_ = false;
+  std::vector<proto::TaskEvent> task_events_;
+
+  // Records a task event for watchers of the running bulk job
+  void add_task_event(proto::TaskEvent event);
 
   // True if all work for job is done
   std::mutex finished_mutex_;
@@ -151,6 +348,7 @@ class MasterImpl final : public proto::Master::Service {
   Result job_result_;
 
   std::thread job_processor_thread_;
+  std::thread worker_pinger_thread_;
   // Manages modification of all of the below structures
   std::mutex work_mutex_;
   // Mapping from jobs to table ids
@@ -159,8 +357,15 @@ class MasterImpl final : public proto::Master::Service {
   std::vector<std::map<i64, i64>> slice_input_rows_per_job_;
   // Output rows for each job
   std::vector<i64> total_output_rows_per_job_;
+  // Output rows [start, end) of a task, every stride rows
+  struct TaskRows {
+    i64 start;
+    i64 end;
+    i64 stride;
+    i64 size() const { return (end - start + stride - 1) / stride; }
+  };
   // All job task output rows
-  std::vector<std::vector<std::vector<i64>>> job_tasks_;
+  std::vector<std::vector<TaskRows>> job_tasks_;
   // Outstanding set of generated task samples that should be processed
   std::deque<std::tuple<i64, i64>> unallocated_job_tasks_;
   // The next job to use to generate tasks
@@ -188,9 +393,105 @@ class MasterImpl final : public proto::Master::Service {
 
   std::map<i64, std::map<i64, i64>> job_task_num_rows_;
 
+  // Input tables read by each job
+  std::vector<std::set<i32>> job_input_tables_;
+  // Most recent tasks granted to each worker, newest last
+  std::map<i32, std::deque<std::tuple<i64, i64>>> worker_recent_tasks_;
+
+  // Workers running each granted task and when they were granted it. A
+  // task has several attempts once it has been speculatively duplicated.
+  struct TaskAttempt {
+    i32 worker_id;
+    timepoint_t start_time;
+  };
+  std::map<std::tuple<i64, i64>, std::vector<TaskAttempt>> running_tasks_;
+  // Losing attempts of speculated tasks per worker, sent to the worker with
+  // its next work stream reply so that it drops them
+  std::map<i32, std::vector<std::tuple<i64, i64>>> cancelled_attempts_;
+  // Speculated tasks whose first attempt to finish still has to move its
+  // staged files to their final paths, and the workers to tell to do so
+  struct PendingCommit {
+    i32 worker_id;
+    proto::FinishedWorkParameters params;
+    i64 task_runtime_ms;
+  };
+  std::map<std::tuple<i64, i64>, PendingCommit> pending_commits_;
+  std::map<i32, std::vector<std::tuple<i64, i64>>> commit_attempts_;
+  // Granted tasks each worker reported it began running. Only those are
+  // charged a failure when the worker dies, not the ones it had queued.
+  std::map<i32, std::set<std::tuple<i64, i64>>> started_tasks_;
+  // Runtimes of finished tasks in milliseconds
+  std::vector<i64> task_runtimes_ms_;
+
+  // Tasks whose outputs have been written, including those from an
+  // interrupted run that this bulk job resumes
+  std::set<std::tuple<i64, i64>> completed_job_tasks_;
+  // Worker that wrote the outputs of each task, for ephemeral outputs
+  std::map<std::tuple<i64, i64>, i32> task_workers_;
+  // Workers lost while running each task
+  std::map<std::tuple<i64, i64>, std::vector<i32>> task_failures_;
+  // Tasks given up on after max_task_failures lost workers
+  std::set<std::tuple<i64, i64>> failed_job_tasks_;
+  // Number of completed tasks in the last saved checkpoint
+  i64 checkpointed_tasks_ = -1;
+  // Descriptor of the running bulk job, without its completed tasks
+  proto::BulkJobDescriptor job_descriptor_;
+
+  // Last message received over each worker's work stream
+  std::map<i32, timepoint_t> worker_heartbeats_;
+
+  // Cost model for longest-first scheduling: a task costs
+  // rows * (row_ms + frames_per_row * frame_ms), with both rates fit to
+  // the finished tasks by least squares
+  struct TaskCostModel {
+    f64 row_ms = 1;
+    f64 frame_ms = 1;
+    f64 rows_rows = 0;
+    f64 rows_frames = 0;
+    f64 frames_frames = 0;
+    f64 rows_ms = 0;
+    f64 frames_ms = 0;
+    i64 samples = 0;
+  };
+  TaskCostModel task_cost_model_;
+  std::vector<f64> job_decode_frames_per_row_;
+  // Set when the cost model has changed since the tasks were last sorted
+  bool task_order_stale_ = true;
+
+  // Pipeline parameters each worker chose when autotuning
+  std::map<i32, proto::TunedParameters> worker_tuned_parameters_;
+  // Set when ops of the bulk job hand kernel state from each task to the
+  // next, so a task is only granted once its predecessor has finished
+  bool state_handoff_ = false;
+  // Kernel states waiting for the task they were handed to
+  std::map<std::tuple<i64, i64>, std::vector<proto::KernelState>>
+      handoff_states_;
+  // Ops of the bulk job that reduce the rows of each job to one result
+  std::set<i64> reduce_ops_;
+  std::map<i64, std::unique_ptr<BaseKernel>> reduce_kernels_;
+  // Combined result of each (job, reduce op) over the tasks finished so far
+  std::map<std::tuple<i64, i64>, std::vector<u8>> reduced_states_;
+  // Set by assign_next_task when the only tasks left wait on the state of
+  // tasks that are still running
+  bool tasks_waiting_on_state_ = false;
+  // DAG analysis of recent bulk jobs keyed by a hash of their ops, jobs and
+  // input tables, so that resubmitting a bulk job skips rederiving it
+  std::deque<std::tuple<size_t, DAGAnalysisInfo>> analysis_cache_;
+  // Row counts of the current bulk job, sent along to the workers
+  std::vector<proto::JobRowAnalysis> job_row_analysis_;
+
+  // Latest per op timings reported by each worker
+  std::map<i32, std::vector<proto::OpProfile>> worker_op_profiles_;
+
+  std::unique_ptr<MetricsServer> metrics_server_;
+
   // Worker connections
   std::map<std::string, i32> local_ids_;
   std::map<std::string, i32> local_totals_;
+  // True once the running bulk job has been sent to the workers registered
+  // when it started. Workers registering after that are sent it on their
+  // own. Guarded by work_mutex_.
+  bool job_workers_started_ = false;
   grpc::CompletionQueue cq_;
   std::map<i32, std::unique_ptr<grpc::ClientContext>> client_contexts_;
   std::map<i32, std::unique_ptr<grpc::Status>> statuses_;
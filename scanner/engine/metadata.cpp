@@ -24,6 +24,7 @@
 #include <limits.h> /* PATH_MAX */
 #include <string.h>
 #include <sys/stat.h> /* mkdir(2) */
+#include <algorithm>
 #include <cassert>
 #include <cstdarg>
 #include <iostream>
@@ -51,6 +52,13 @@ std::string Metadata<VideoDescriptor>::descriptor_path() const {
                                         meta->item_id());
 }
 
+template <>
+std::string Metadata<ImageFormatGroupDescriptor>::descriptor_path() const {
+  const ImageFormatGroupMetadata* meta = (const ImageFormatGroupMetadata*)this;
+  return table_item_image_metadata_path(meta->table_id(), meta->column_id(),
+                                        meta->item_id());
+}
+
 template <>
 std::string Metadata<BulkJobDescriptor>::descriptor_path() const {
   const BulkJobMetadata* meta = (const BulkJobMetadata*)this;
@@ -63,15 +71,32 @@ std::string Metadata<TableDescriptor>::descriptor_path() const {
   return table_descriptor_path(meta->id());
 }
 
-DatabaseMetadata::DatabaseMetadata() : next_table_id_(0), next_bulk_job_id_(0) {}
+DatabaseMetadata::DatabaseMetadata()
+  : next_table_id_(0),
+    next_bulk_job_id_(0),
+    num_table_shards_(DEFAULT_NUM_TABLE_SHARDS),
+    all_shards_loaded_(true) {}
 
 DatabaseMetadata::DatabaseMetadata(const DatabaseDescriptor& d)
   : Metadata(d),
     next_table_id_(d.next_table_id()),
-    next_bulk_job_id_(d.next_bulk_job_id()) {
-  for (int i = 0; i < descriptor_.tables_size(); ++i) {
-    const DatabaseDescriptor::Table& table = descriptor_.tables(i);
-    table_id_names_.insert({table.id(), table.name()});
+    next_bulk_job_id_(d.next_bulk_job_id()),
+    num_table_shards_(d.num_table_shards()),
+    all_shards_loaded_(d.num_table_shards() == 0) {
+  if (num_table_shards_ == 0) {
+    // Move the tables of a database without an index into one, to be
+    // written the next time the database is
+    num_table_shards_ = DEFAULT_NUM_TABLE_SHARDS;
+    for (int i = 0; i < descriptor_.tables_size(); ++i) {
+      const DatabaseDescriptor::Table& table = descriptor_.tables(i);
+      IndexShard& by_name = name_shards_[name_shard(table.name())];
+      by_name.tables.insert({table.id(), table.name()});
+      by_name.dirty = true;
+      IndexShard& by_id = id_shards_[table.id() % num_table_shards_];
+      by_id.tables.insert({table.id(), table.name()});
+      by_id.dirty = true;
+    }
+    descriptor_.clear_tables();
   }
   for (int i = 0; i < descriptor_.bulk_jobs_size(); ++i) {
     const DatabaseDescriptor_BulkJob& bulk_job = descriptor_.bulk_jobs(i);
@@ -80,18 +105,37 @@ DatabaseMetadata::DatabaseMetadata(const DatabaseDescriptor& d)
   }
 }
 
+DatabaseMetadata::DatabaseMetadata(const DatabaseMetadata& other) {
+  *this = other;
+}
+
+DatabaseMetadata& DatabaseMetadata::operator=(const DatabaseMetadata& other) {
+  if (this == &other) {
+    return *this;
+  }
+  std::lock(mutex_, other.mutex_);
+  std::lock_guard<std::mutex> lock(mutex_, std::adopt_lock);
+  std::lock_guard<std::mutex> other_lock(other.mutex_, std::adopt_lock);
+  descriptor_ = other.descriptor_;
+  next_table_id_ = other.next_table_id_;
+  next_bulk_job_id_ = other.next_bulk_job_id_;
+  bulk_job_names_ = other.bulk_job_names_;
+  bulk_job_id_names_ = other.bulk_job_id_names_;
+  num_table_shards_ = other.num_table_shards_;
+  storage_ = other.storage_;
+  all_shards_loaded_ = other.all_shards_loaded_;
+  name_shards_ = other.name_shards_;
+  id_shards_ = other.id_shards_;
+  return *this;
+}
+
 const DatabaseDescriptor& DatabaseMetadata::get_descriptor() const {
   descriptor_.set_next_table_id(next_table_id_);
   descriptor_.set_next_bulk_job_id(next_bulk_job_id_);
+  descriptor_.set_num_table_shards(num_table_shards_);
   descriptor_.clear_tables();
   descriptor_.clear_bulk_jobs();
 
-  for (auto& kv : table_id_names_) {
-    auto table = descriptor_.add_tables();
-    table->set_id(kv.first);
-    table->set_name(kv.second);
-  }
-
   for (auto& kv : bulk_job_id_names_) {
     auto bulk_job = descriptor_.add_bulk_jobs();
     bulk_job->set_id(kv.first);
@@ -105,16 +149,106 @@ std::string DatabaseMetadata::descriptor_path() {
   return database_metadata_path();
 }
 
+void DatabaseMetadata::set_storage(storehouse::StorageBackend* storage) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  storage_ = storage;
+}
+
+void DatabaseMetadata::write(storehouse::StorageBackend* storage) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  // Shards go first so the descriptor never refers to an index that is not
+  // on storage yet
+  for (i32 by_name = 0; by_name < 2; ++by_name) {
+    for (auto& kv : by_name ? name_shards_ : id_shards_) {
+      IndexShard& shard = kv.second;
+      if (!shard.dirty) {
+        continue;
+      }
+      TableIndexShard shard_desc;
+      for (auto& table : shard.tables) {
+        DatabaseDescriptor::Table* t = shard_desc.add_tables();
+        t->set_id(table.first);
+        t->set_name(table.second);
+      }
+      std::unique_ptr<WriteFile> file;
+      BACKOFF_FAIL(make_unique_write_file(
+          storage,
+          by_name ? table_name_index_path(kv.first)
+                  : table_id_index_path(kv.first),
+          file));
+      serialize_db_proto(file.get(), shard_desc);
+      BACKOFF_FAIL(file->save());
+      shard.dirty = false;
+    }
+  }
+
+  std::unique_ptr<WriteFile> file;
+  BACKOFF_FAIL(make_unique_write_file(storage, descriptor_path(), file));
+  serialize_db_proto(file.get(), get_descriptor());
+  BACKOFF_FAIL(file->save());
+  if (storage_ == nullptr) {
+    storage_ = storage;
+  }
+}
+
+i32 DatabaseMetadata::name_shard(const std::string& table) const {
+  // FNV-1a, which the Python client computes as well
+  u32 hash = 2166136261u;
+  for (char c : table) {
+    hash ^= static_cast<u8>(c);
+    hash *= 16777619u;
+  }
+  return hash % num_table_shards_;
+}
+
+DatabaseMetadata::IndexShard& DatabaseMetadata::index_shard(bool by_name,
+                                                            i32 shard) const {
+  std::map<i32, IndexShard>& shards = by_name ? name_shards_ : id_shards_;
+  auto it = shards.find(shard);
+  if (it != shards.end()) {
+    return it->second;
+  }
+  IndexShard& index = shards[shard];
+  if (all_shards_loaded_) {
+    return index;
+  }
+  LOG_IF(FATAL, storage_ == nullptr)
+      << "Database metadata has no storage to read its table index from";
+  std::string path =
+      by_name ? table_name_index_path(shard) : table_id_index_path(shard);
+  storehouse::FileInfo info;
+  if (storage_->get_file_info(path, info) != StoreResult::Success) {
+    // No table was ever put in this shard
+    return index;
+  }
+  std::unique_ptr<RandomReadFile> file;
+  BACKOFF_FAIL(make_unique_random_read_file(storage_, path, file));
+  u64 pos = 0;
+  TableIndexShard shard_desc =
+      deserialize_db_proto<TableIndexShard>(file.get(), pos);
+  for (auto& table : shard_desc.tables()) {
+    index.tables.insert({table.id(), table.name()});
+  }
+  return index;
+}
+
 const std::vector<std::string> DatabaseMetadata::table_names() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  std::map<i32, std::string> tables;
+  for (i32 i = 0; i < num_table_shards_; ++i) {
+    const IndexShard& shard = index_shard(false, i);
+    tables.insert(shard.tables.begin(), shard.tables.end());
+  }
   std::vector<std::string> names;
-  for (auto& entry : table_id_names_) {
+  for (auto& entry : tables) {
     names.push_back(entry.second);
   }
   return names;
 }
 
 bool DatabaseMetadata::has_table(const std::string& table) const {
-  for (const auto& kv : table_id_names_) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (const auto& kv : index_shard(true, name_shard(table)).tables) {
     if (kv.second == table) {
       return true;
     }
@@ -123,12 +257,15 @@ bool DatabaseMetadata::has_table(const std::string& table) const {
 }
 
 bool DatabaseMetadata::has_table(i32 table_id) const {
-  return table_id_names_.count(table_id) > 0;
+  std::lock_guard<std::mutex> lock(mutex_);
+  return index_shard(false, table_id % num_table_shards_)
+             .tables.count(table_id) > 0;
 }
 
 i32 DatabaseMetadata::get_table_id(const std::string& table) const {
+  std::lock_guard<std::mutex> lock(mutex_);
   i32 id = -1;
-  for (const auto& kv : table_id_names_) {
+  for (const auto& kv : index_shard(true, name_shard(table)).tables) {
     if (kv.second == table) {
       id = kv.first;
       break;
@@ -139,21 +276,37 @@ i32 DatabaseMetadata::get_table_id(const std::string& table) const {
 }
 
 const std::string& DatabaseMetadata::get_table_name(i32 table_id) const {
-  return table_id_names_.at(table_id);
+  std::lock_guard<std::mutex> lock(mutex_);
+  return index_shard(false, table_id % num_table_shards_).tables.at(table_id);
 }
 
 i32 DatabaseMetadata::add_table(const std::string& table) {
-  i32 table_id = -1;
-  if (!has_table(table)) {
-    table_id = next_table_id_++;
-    table_id_names_[table_id] = table;
+  std::lock_guard<std::mutex> lock(mutex_);
+  IndexShard& by_name = index_shard(true, name_shard(table));
+  for (const auto& kv : by_name.tables) {
+    if (kv.second == table) {
+      return -1;
+    }
   }
+  i32 table_id = next_table_id_++;
+  by_name.tables[table_id] = table;
+  by_name.dirty = true;
+  IndexShard& by_id = index_shard(false, table_id % num_table_shards_);
+  by_id.tables[table_id] = table;
+  by_id.dirty = true;
   return table_id;
 }
 
 void DatabaseMetadata::remove_table(i32 table_id) {
-  assert(table_id_names_.count(table_id) > 0);
-  table_id_names_.erase(table_id);
+  std::lock_guard<std::mutex> lock(mutex_);
+  IndexShard& by_id = index_shard(false, table_id % num_table_shards_);
+  assert(by_id.tables.count(table_id) > 0);
+  std::string table = by_id.tables.at(table_id);
+  by_id.tables.erase(table_id);
+  by_id.dirty = true;
+  IndexShard& by_name = index_shard(true, name_shard(table));
+  by_name.tables.erase(table_id);
+  by_name.dirty = true;
 }
 
 const std::vector<std::string>& DatabaseMetadata::bulk_job_names() const {
@@ -200,6 +353,162 @@ void DatabaseMetadata::remove_bulk_job(i32 bulk_job_id) {
   bulk_job_id_names_.erase(bulk_job_id);
 }
 
+void write_database_metadata(storehouse::StorageBackend* storage,
+                             DatabaseMetadata& meta) {
+  meta.write(storage);
+}
+
+DatabaseMetadata read_database_metadata(storehouse::StorageBackend* storage,
+                                        const std::string& path) {
+  DatabaseMetadata meta = read_db_proto<DatabaseMetadata>(storage, path);
+  meta.set_storage(storage);
+  return meta;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/// KeyframeIndex
+namespace {
+
+void put_varint(std::string& data, i64 value) {
+  u64 v = (static_cast<u64>(value) << 1) ^ static_cast<u64>(value >> 63);
+  while (v >= 0x80) {
+    data.push_back(static_cast<char>((v & 0x7f) | 0x80));
+    v >>= 7;
+  }
+  data.push_back(static_cast<char>(v));
+}
+
+i64 get_varint(const std::string& data, size_t& pos) {
+  u64 v = 0;
+  i32 shift = 0;
+  while (true) {
+    LOG_IF(FATAL, pos >= data.size()) << "Truncated keyframe index";
+    u8 byte = static_cast<u8>(data[pos++]);
+    v |= static_cast<u64>(byte & 0x7f) << shift;
+    if (!(byte & 0x80)) {
+      break;
+    }
+    shift += 7;
+  }
+  return static_cast<i64>(v >> 1) ^ -static_cast<i64>(v & 1);
+}
+}
+
+KeyframeIndex::KeyframeIndex(const VideoDescriptor& descriptor)
+  : data_(descriptor.keyframe_index()),
+    block_offsets_(descriptor.keyframe_index_block_offsets().begin(),
+                   descriptor.keyframe_index_block_offsets().end()),
+    block_size_(descriptor.keyframe_index_block_size()) {
+  if (block_offsets_.empty()) {
+    return;
+  }
+  for (i64 offset : block_offsets_) {
+    size_t pos = offset;
+    block_positions_.push_back(get_varint(data_, pos));
+  }
+  // Only the last block may be short
+  size_t pos = block_offsets_.back();
+  i64 last_block_size = 0;
+  while (pos < data_.size()) {
+    for (i32 i = 0; i < 3; ++i) {
+      get_varint(data_, pos);
+    }
+    last_block_size++;
+  }
+  size_ = (block_offsets_.size() - 1) * block_size_ + last_block_size;
+}
+
+void KeyframeIndex::decode(i64 start, i64 end, std::vector<i64>* positions,
+                           std::vector<i64>* timestamps,
+                           std::vector<i64>* byte_offsets) const {
+  assert(start >= 0 && end <= size_);
+  if (start >= end) {
+    return;
+  }
+  i64 k = (start / block_size_) * block_size_;
+  size_t pos = block_offsets_[start / block_size_];
+  i64 position = 0;
+  i64 timestamp = 0;
+  i64 byte_offset = 0;
+  for (; k < end; ++k) {
+    if (k % block_size_ == 0) {
+      position = 0;
+      timestamp = 0;
+      byte_offset = 0;
+    }
+    position += get_varint(data_, pos);
+    timestamp += get_varint(data_, pos);
+    byte_offset += get_varint(data_, pos);
+    if (k < start) {
+      continue;
+    }
+    if (positions != nullptr) {
+      positions->push_back(position);
+    }
+    if (timestamps != nullptr) {
+      timestamps->push_back(timestamp);
+    }
+    if (byte_offsets != nullptr) {
+      byte_offsets->push_back(byte_offset);
+    }
+  }
+}
+
+i64 KeyframeIndex::find(i64 frame) const {
+  if (size_ == 0) {
+    return 0;
+  }
+  i64 block = std::upper_bound(block_positions_.begin(),
+                               block_positions_.end(), frame) -
+              block_positions_.begin() - 1;
+  block = std::max(block, (i64)0);
+  i64 start = block * block_size_;
+  std::vector<i64> positions;
+  decode(start, std::min(start + block_size_, size_), &positions, nullptr,
+         nullptr);
+  i64 i = std::upper_bound(positions.begin(), positions.end(), frame) -
+          positions.begin() - 1;
+  return start + std::max(i, (i64)0);
+}
+
+void KeyframeIndex::append(VideoDescriptor& descriptor, i64 frame_offset,
+                           i64 byte_offset, const std::vector<i64>& positions,
+                           const std::vector<i64>& timestamps,
+                           const std::vector<i64>& byte_offsets) {
+  std::vector<i64> all_positions;
+  std::vector<i64> all_timestamps;
+  std::vector<i64> all_byte_offsets;
+  i32 block_size = DEFAULT_BLOCK_SIZE;
+  if (present(descriptor)) {
+    KeyframeIndex index(descriptor);
+    index.decode(0, index.size(), &all_positions, &all_timestamps,
+                 &all_byte_offsets);
+    block_size = descriptor.keyframe_index_block_size();
+  }
+  for (size_t i = 0; i < positions.size(); ++i) {
+    all_positions.push_back(positions[i] + frame_offset);
+    all_timestamps.push_back(timestamps[i]);
+    all_byte_offsets.push_back(byte_offsets[i] + byte_offset);
+  }
+
+  std::string data;
+  descriptor.clear_keyframe_index_block_offsets();
+  for (size_t i = 0; i < all_positions.size(); ++i) {
+    if (i % block_size == 0) {
+      descriptor.add_keyframe_index_block_offsets(data.size());
+      put_varint(data, all_positions[i]);
+      put_varint(data, all_timestamps[i]);
+      put_varint(data, all_byte_offsets[i]);
+    } else {
+      put_varint(data, all_positions[i] - all_positions[i - 1]);
+      put_varint(data, all_timestamps[i] - all_timestamps[i - 1]);
+      put_varint(data, all_byte_offsets[i] - all_byte_offsets[i - 1]);
+    }
+  }
+  descriptor.set_keyframe_index(data);
+  descriptor.set_keyframe_index_block_size(block_size);
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 /// VideoMetdata
 VideoMetadata::VideoMetadata() {}
@@ -232,6 +541,10 @@ VideoDescriptor::VideoCodecType VideoMetadata::codec_type() const {
   return descriptor_.codec_type();
 }
 
+VideoDescriptor::VideoChromaFormat VideoMetadata::chroma_format() const {
+  return descriptor_.chroma_format();
+}
+
 i64 VideoMetadata::num_encoded_videos() const { return descriptor_.num_encoded_videos(); }
 
 std::vector<i64> VideoMetadata::frames_per_video() const {
@@ -250,13 +563,76 @@ std::vector<i64> VideoMetadata::size_per_video() const {
 }
 
 std::vector<i64> VideoMetadata::keyframe_positions() const {
-  return std::vector<i64>(descriptor_.keyframe_positions().begin(),
-                          descriptor_.keyframe_positions().end());
+  if (!KeyframeIndex::present(descriptor_)) {
+    return std::vector<i64>(descriptor_.keyframe_positions().begin(),
+                            descriptor_.keyframe_positions().end());
+  }
+  std::vector<i64> positions;
+  KeyframeIndex index(descriptor_);
+  index.decode(0, index.size(), &positions, nullptr, nullptr);
+  // Relative to each encoded video, like the uncompressed arrays
+  i64 k = 0;
+  i64 frame_offset = 0;
+  for (i64 v = 0; v < descriptor_.keyframes_per_video_size(); ++v) {
+    for (i64 i = 0; i < descriptor_.keyframes_per_video(v); ++i) {
+      positions[k++] -= frame_offset;
+    }
+    frame_offset += descriptor_.frames_per_video(v);
+  }
+  return positions;
 }
 
 std::vector<i64> VideoMetadata::keyframe_byte_offsets() const {
-  return std::vector<i64>(descriptor_.keyframe_byte_offsets().begin(),
-                          descriptor_.keyframe_byte_offsets().end());
+  if (!KeyframeIndex::present(descriptor_)) {
+    return std::vector<i64>(descriptor_.keyframe_byte_offsets().begin(),
+                            descriptor_.keyframe_byte_offsets().end());
+  }
+  std::vector<i64> byte_offsets;
+  KeyframeIndex index(descriptor_);
+  index.decode(0, index.size(), nullptr, nullptr, &byte_offsets);
+  i64 k = 0;
+  i64 byte_offset = 0;
+  for (i64 v = 0; v < descriptor_.keyframes_per_video_size(); ++v) {
+    for (i64 i = 0; i < descriptor_.keyframes_per_video(v); ++i) {
+      byte_offsets[k++] -= byte_offset;
+    }
+    byte_offset += descriptor_.size_per_video(v);
+  }
+  return byte_offsets;
+}
+
+std::vector<i64> VideoMetadata::non_ref_frames() const {
+  return std::vector<i64>(descriptor_.non_ref_frames().begin(),
+                          descriptor_.non_ref_frames().end());
+}
+
+std::vector<i64> VideoMetadata::non_ref_frames_per_video() const {
+  return std::vector<i64>(descriptor_.non_ref_frames_per_video().begin(),
+                          descriptor_.non_ref_frames_per_video().end());
+}
+
+std::string VideoMetadata::source_path() const {
+  return descriptor_.source_path();
+}
+
+std::vector<i64> VideoMetadata::source_packet_offsets() const {
+  return std::vector<i64>(descriptor_.source_packet_offsets().begin(),
+                          descriptor_.source_packet_offsets().end());
+}
+
+std::vector<i64> VideoMetadata::source_packet_sizes() const {
+  return std::vector<i64>(descriptor_.source_packet_sizes().begin(),
+                          descriptor_.source_packet_sizes().end());
+}
+
+std::vector<i64> VideoMetadata::source_keyframe_packets() const {
+  return std::vector<i64>(descriptor_.source_keyframe_packets().begin(),
+                          descriptor_.source_keyframe_packets().end());
+}
+
+std::vector<u8> VideoMetadata::source_parameter_sets() const {
+  return std::vector<u8>(descriptor_.source_parameter_sets().begin(),
+                         descriptor_.source_parameter_sets().end());
 }
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -267,6 +643,22 @@ ImageFormatGroupMetadata::ImageFormatGroupMetadata(
     const ImageFormatGroupDescriptor& descriptor)
   : Metadata(descriptor) {}
 
+std::string ImageFormatGroupMetadata::descriptor_path(i32 table_id,
+                                                      i32 column_id,
+                                                      i32 item_id) {
+  return table_item_image_metadata_path(table_id, column_id, item_id);
+}
+
+i32 ImageFormatGroupMetadata::table_id() const {
+  return descriptor_.table_id();
+}
+
+i32 ImageFormatGroupMetadata::column_id() const {
+  return descriptor_.column_id();
+}
+
+i32 ImageFormatGroupMetadata::item_id() const { return descriptor_.id(); }
+
 i32 ImageFormatGroupMetadata::num_images() const {
   return descriptor_.num_images();
 }
@@ -392,6 +784,15 @@ ColumnType TableMetadata::column_type(i32 column_id) const {
   LOG(FATAL) << "Column id " << column_id << " not found!";
 }
 
+std::string TableMetadata::column_codec(i32 column_id) const {
+  for (auto& c : descriptor_.columns()) {
+    if (c.id() == column_id) {
+      return c.codec();
+    }
+  }
+  LOG(FATAL) << "Column id " << column_id << " not found!";
+}
+
 namespace {
 std::string& get_database_path_ref() {
   static std::string prefix = "";
@@ -19,6 +19,8 @@
 #include "scanner/util/storehouse.h"
 #include "storehouse/storage_backend.h"
 
+#include <map>
+#include <mutex>
 #include <set>
 
 namespace scanner {
@@ -38,6 +40,16 @@ inline std::string database_metadata_path() {
   return get_database_path() + "db_metadata.bin";
 }
 
+inline std::string table_name_index_path(i32 shard) {
+  return get_database_path() + "table_index/name_" + std::to_string(shard) +
+         ".bin";
+}
+
+inline std::string table_id_index_path(i32 shard) {
+  return get_database_path() + "table_index/id_" + std::to_string(shard) +
+         ".bin";
+}
+
 inline std::string table_directory(i32 table_id) {
   return get_database_path() + "tables/" + std::to_string(table_id);
 }
@@ -52,12 +64,24 @@ inline std::string table_item_output_path(i32 table_id, i32 column_id,
          std::to_string(item_id) + ".bin";
 }
 
+//! The non-video columns of an item of a table with packed_items
+inline std::string table_item_packed_path(i32 table_id, i32 item_id) {
+  return table_directory(table_id) + "/" + std::to_string(item_id) +
+         "_packed.bin";
+}
+
 inline std::string table_item_video_metadata_path(i32 table_id, i32 column_id,
                                                   i32 item_id) {
   return table_directory(table_id) + "/" + std::to_string(column_id) + "_" +
          std::to_string(item_id) + "_video_metadata.bin";
 }
 
+inline std::string table_item_image_metadata_path(i32 table_id, i32 column_id,
+                                                  i32 item_id) {
+  return table_directory(table_id) + "/" + std::to_string(column_id) + "_" +
+         std::to_string(item_id) + "_image_metadata.bin";
+}
+
 inline std::string table_item_metadata_path(i32 table_id, i32 column_id,
                                             i32 item_id) {
   return table_directory(table_id) + "/" + std::to_string(column_id) + "_" +
@@ -77,6 +101,22 @@ inline std::string bulk_job_profiler_path(i32 bulk_job_id, i32 node) {
          ".bin";
 }
 
+inline std::string bulk_job_trace_path(i32 bulk_job_id, i32 node) {
+  return bulk_job_directory(bulk_job_id) + "/trace_" + std::to_string(node) +
+         ".json";
+}
+
+// Events a node streamed while the bulk job ran, in the order of chunk
+inline std::string bulk_job_trace_chunk_path(i32 bulk_job_id, i32 node,
+                                             i32 chunk) {
+  return bulk_job_directory(bulk_job_id) + "/trace_" + std::to_string(node) +
+         "_" + std::to_string(chunk) + ".json";
+}
+
+inline std::string replay_bundle_path(const std::string& name) {
+  return get_database_path() + "replays/" + name + ".bin";
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 /// Common persistent data structs and their serialization helpers
 
@@ -95,15 +135,29 @@ class Metadata {
   mutable Descriptor descriptor_;
 };
 
+//! Names and ids of the tables and bulk jobs of a database. Tables are kept
+//! in a sharded index, whose shards are read from storage the first time a
+//! lookup needs them and written back only if they changed, so opening a
+//! database and adding a table do not depend on how many tables it has.
 class DatabaseMetadata : public Metadata<proto::DatabaseDescriptor> {
  public:
   DatabaseMetadata();
   DatabaseMetadata(const Descriptor& descriptor);
+  DatabaseMetadata(const DatabaseMetadata& other);
+  DatabaseMetadata& operator=(const DatabaseMetadata& other);
 
   const Descriptor& get_descriptor() const;
 
   static std::string descriptor_path();
 
+  //! Where index shards are read from. Set by read_database_metadata.
+  void set_storage(storehouse::StorageBackend* storage);
+
+  //! Saves the descriptor along with the index shards changed since they
+  //! were read. A database without an index is converted to one.
+  void write(storehouse::StorageBackend* storage);
+
+  //! Reads every shard of the index
   const std::vector<std::string> table_names() const;
 
   bool has_table(const std::string& table) const;
@@ -123,12 +177,74 @@ class DatabaseMetadata : public Metadata<proto::DatabaseDescriptor> {
   void remove_bulk_job(i32 job_id);
 
  private:
+  // Tables of one shard file by id
+  struct IndexShard {
+    std::map<i32, std::string> tables;
+    bool dirty = false;
+  };
+
+  static const i32 DEFAULT_NUM_TABLE_SHARDS = 1024;
+
+  i32 name_shard(const std::string& table) const;
+
+  // Expects mutex_ to be held
+  IndexShard& index_shard(bool by_name, i32 shard) const;
+
   i32 next_table_id_;
   i32 next_bulk_job_id_;
-  std::vector<std::string> table_names_;
   std::vector<std::string> bulk_job_names_;
-  std::map<i32, std::string> table_id_names_;
   std::map<i32, std::string> bulk_job_id_names_;
+
+  i32 num_table_shards_;
+  storehouse::StorageBackend* storage_ = nullptr;
+  // Set when shards missing from the maps below are known to be empty, as
+  // when the database has no index on storage yet
+  bool all_shards_loaded_;
+  mutable std::map<i32, IndexShard> name_shards_;
+  mutable std::map<i32, IndexShard> id_shards_;
+  mutable std::mutex mutex_;
+};
+
+// Reads and writes the compact keyframe index of a VideoDescriptor
+class KeyframeIndex {
+ public:
+  KeyframeIndex() {}
+  KeyframeIndex(const proto::VideoDescriptor& descriptor);
+
+  static bool present(const proto::VideoDescriptor& descriptor) {
+    return descriptor.keyframe_index_block_size() > 0;
+  }
+
+  i64 size() const { return size_; }
+
+  size_t encoded_bytes() const {
+    return data_.size() + block_offsets_.size() * 2 * sizeof(i64);
+  }
+
+  //! Decodes keyframes [start, end) into the outputs which are not null
+  void decode(i64 start, i64 end, std::vector<i64>* positions,
+              std::vector<i64>* timestamps,
+              std::vector<i64>* byte_offsets) const;
+
+  //! Index of the last keyframe at or before the frame
+  i64 find(i64 frame) const;
+
+  //! Adds the keyframes of a video placed at frame_offset and byte_offset of
+  //! the item to the descriptor's compact index
+  static void append(proto::VideoDescriptor& descriptor, i64 frame_offset,
+                     i64 byte_offset, const std::vector<i64>& positions,
+                     const std::vector<i64>& timestamps,
+                     const std::vector<i64>& byte_offsets);
+
+  static const i32 DEFAULT_BLOCK_SIZE = 128;
+
+ private:
+  std::string data_;
+  std::vector<i64> block_offsets_;
+  // Position of the first keyframe of every block
+  std::vector<i64> block_positions_;
+  i32 block_size_ = 0;
+  i64 size_ = 0;
 };
 
 class VideoMetadata : public Metadata<proto::VideoDescriptor> {
@@ -147,12 +263,20 @@ class VideoMetadata : public Metadata<proto::VideoDescriptor> {
   i32 channels() const;
   proto::FrameType frame_type() const;
   proto::VideoDescriptor::VideoCodecType codec_type() const;
+  proto::VideoDescriptor::VideoChromaFormat chroma_format() const;
   i64 num_encoded_videos() const;
   std::vector<i64> frames_per_video() const;
   std::vector<i64> keyframes_per_video() const;
   std::vector<i64> size_per_video() const;
   std::vector<i64> keyframe_positions() const;
   std::vector<i64> keyframe_byte_offsets() const;
+  std::vector<i64> non_ref_frames() const;
+  std::vector<i64> non_ref_frames_per_video() const;
+  std::string source_path() const;
+  std::vector<i64> source_packet_offsets() const;
+  std::vector<i64> source_packet_sizes() const;
+  std::vector<i64> source_keyframe_packets() const;
+  std::vector<u8> source_parameter_sets() const;
 };
 
 class ImageFormatGroupMetadata
@@ -161,6 +285,11 @@ class ImageFormatGroupMetadata
   ImageFormatGroupMetadata();
   ImageFormatGroupMetadata(const Descriptor& descriptor);
 
+  static std::string descriptor_path(i32 table_id, i32 column_id, i32 item_id);
+
+  i32 table_id() const;
+  i32 column_id() const;
+  i32 item_id() const;
   i32 num_images() const;
   i32 width() const;
   i32 height() const;
@@ -230,6 +359,9 @@ class TableMetadata : public Metadata<proto::TableDescriptor> {
 
   ColumnType column_type(i32 column_id) const;
 
+  //! Element codec of a non-video column, empty if it is not compressed
+  std::string column_codec(i32 column_id) const;
+
  private:
   std::vector<proto::Column> columns_;
 };
@@ -241,6 +373,10 @@ inline std::string index_column_name() { return "index"; }
 
 inline std::string frame_column_name() { return "frame"; }
 
+inline std::string image_column_name() { return "img"; }
+
+inline std::string proxy_column_name() { return "frame_proxy"; }
+
 inline std::string frame_info_column_name() { return "frame_info"; }
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -288,10 +424,11 @@ template <typename T>
 using ReadFn = T (*)(storehouse::StorageBackend* storage,
                      const std::string& path);
 
-constexpr WriteFn<DatabaseMetadata> write_database_metadata =
-    write_db_proto<DatabaseMetadata>;
-constexpr ReadFn<DatabaseMetadata> read_database_metadata =
-    read_db_proto<DatabaseMetadata>;
+void write_database_metadata(storehouse::StorageBackend* storage,
+                             DatabaseMetadata& meta);
+
+DatabaseMetadata read_database_metadata(storehouse::StorageBackend* storage,
+                                        const std::string& path);
 
 constexpr WriteFn<BulkJobMetadata> write_bulk_job_metadata =
     write_db_proto<BulkJobMetadata>;
@@ -307,5 +444,10 @@ constexpr WriteFn<VideoMetadata> write_video_metadata =
     write_db_proto<VideoMetadata>;
 constexpr ReadFn<VideoMetadata> read_video_metadata =
     read_db_proto<VideoMetadata>;
+
+constexpr WriteFn<ImageFormatGroupMetadata> write_image_metadata =
+    write_db_proto<ImageFormatGroupMetadata>;
+constexpr ReadFn<ImageFormatGroupMetadata> read_image_metadata =
+    read_db_proto<ImageFormatGroupMetadata>;
 }
 }
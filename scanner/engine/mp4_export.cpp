@@ -0,0 +1,367 @@
+/* Copyright 2017 Carnegie Mellon University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "scanner/engine/mp4_export.h"
+#include "scanner/engine/metadata.h"
+#include "scanner/engine/video_index_entry.h"
+#include "scanner/util/h264.h"
+#include "scanner/util/storehouse.h"
+
+extern "C" {
+#include "libavformat/avformat.h"
+#include "libavutil/mem.h"
+}
+
+#include <algorithm>
+#include <cstring>
+#include <map>
+
+namespace scanner {
+namespace internal {
+
+namespace {
+
+struct MuxFrame {
+  // Offset and size of the Annex B data in the item's bytes
+  size_t offset;
+  size_t size;
+  bool keyframe;
+  i64 poc;
+};
+
+// Removes the emulation prevention bytes of a NAL unit's payload
+std::vector<u8> nal_to_rbsp(const u8* nal_start, i32 nal_size) {
+  std::vector<u8> rbsp;
+  rbsp.reserve(nal_size);
+  u32 consecutive_zeros = 0;
+  for (i32 i = 1; i < nal_size; ++i) {
+    u8 b = nal_start[i];
+    if (consecutive_zeros < 2 || b != 0x03) {
+      rbsp.push_back(b);
+    }
+    consecutive_zeros = b == 0 ? consecutive_zeros + 1 : 0;
+  }
+  return rbsp;
+}
+
+// Splits the size prefixed packets of a stretch of an item's bitstream into
+// frames and computes their picture order counts. Parameter sets are
+// collected as Annex B extradata from the first keyframe.
+class PacketParser {
+ public:
+  bool parse(const std::vector<u8>& data, std::vector<MuxFrame>& frames,
+             std::vector<u8>& extradata, std::string& error_message) {
+    size_t pos = 0;
+    while (pos + sizeof(i32) <= data.size()) {
+      i32 size;
+      memcpy(&size, data.data() + pos, sizeof(i32));
+      pos += sizeof(i32);
+      if (size < 0 || pos + size > data.size()) {
+        error_message = "Truncated packet in video bitstream";
+        return false;
+      }
+      MuxFrame frame{pos, (size_t)size, false, 0};
+      if (!parse_packet(data.data() + pos, size, frame, extradata,
+                        error_message)) {
+        return false;
+      }
+      frames.push_back(frame);
+      pos += size;
+    }
+    return true;
+  }
+
+ private:
+  bool parse_packet(const u8* data, i32 size, MuxFrame& frame,
+                    std::vector<u8>& extradata, std::string& error_message) {
+    bool collect = extradata.empty();
+    std::vector<u8> parameter_sets;
+    const u8* nal_parse = data;
+    i32 size_left = size;
+    while (size_left > 3) {
+      const u8* nal_start = nullptr;
+      i32 nal_size = 0;
+      next_nal(nal_parse, size_left, nal_start, nal_size);
+      if (size_left < 0 || nal_size < 1) {
+        continue;
+      }
+      i32 nal_unit_type = get_nal_unit_type(nal_start);
+      if (nal_unit_type == 7 || nal_unit_type == 8) {
+        std::vector<u8> rbsp = nal_to_rbsp(nal_start, nal_size);
+        GetBitsState gb{rbsp.data(), 0, (i64)rbsp.size()};
+        if (nal_unit_type == 7) {
+          SPS sps;
+          if (!parse_sps(gb, sps)) {
+            error_message = "Failed to parse sps";
+            return false;
+          }
+          sps_map_[sps.sps_id] = sps;
+          last_sps_ = sps.sps_id;
+        } else {
+          PPS pps;
+          if (!parse_pps(gb, pps)) {
+            error_message = "Failed to parse pps";
+            return false;
+          }
+          pps_map_[pps.pps_id] = pps;
+        }
+        const u8 start_code[] = {0, 0, 0, 1};
+        parameter_sets.insert(parameter_sets.end(), start_code,
+                              start_code + 4);
+        parameter_sets.insert(parameter_sets.end(), nal_start,
+                              nal_start + nal_size);
+      } else if (is_vcl_nal(nal_unit_type)) {
+        if (last_sps_ < 0) {
+          error_message = "Slice before any sps";
+          return false;
+        }
+        // The first slice of the packet decides its picture order
+        GetBitsState gb{nal_start, 8, nal_size};
+        SliceHeader sh;
+        SPS& sps = sps_map_.at(last_sps_);
+        if (!parse_slice_header(gb, sps, pps_map_, nal_unit_type,
+                                get_nal_ref_idc(nal_start), sh)) {
+          error_message = "Failed to parse slice header";
+          return false;
+        }
+        frame.keyframe = nal_unit_type == 5;
+        frame.poc = picture_order(sps, sh);
+        break;
+      }
+    }
+    if (collect && frame.keyframe) {
+      extradata = parameter_sets;
+    }
+    return true;
+  }
+
+  // Picture order count of type 0 streams (8.2.1.1), ignoring memory
+  // management resets. Other types are treated as decode order, which type
+  // 2 guarantees.
+  i64 picture_order(const SPS& sps, const SliceHeader& sh) {
+    if (sh.nal_unit_type == 5) {
+      prev_poc_msb_ = 0;
+      prev_poc_lsb_ = 0;
+      decode_count_ = 0;
+    }
+    i64 decode_count = decode_count_++;
+    if (sps.poc_type != 0) {
+      return decode_count;
+    }
+    i64 max_lsb = 1LL << sps.log2_max_pic_order_cnt_lsb;
+    i64 lsb = sh.pic_order_cnt_lsb;
+    i64 msb = prev_poc_msb_;
+    if (lsb < prev_poc_lsb_ && prev_poc_lsb_ - lsb >= max_lsb / 2) {
+      msb += max_lsb;
+    } else if (lsb > prev_poc_lsb_ && lsb - prev_poc_lsb_ > max_lsb / 2) {
+      msb -= max_lsb;
+    }
+    if (sh.nal_ref_idc != 0) {
+      prev_poc_msb_ = msb;
+      prev_poc_lsb_ = lsb;
+    }
+    return msb + lsb;
+  }
+
+  std::map<u32, SPS> sps_map_;
+  std::map<u32, PPS> pps_map_;
+  i64 last_sps_ = -1;
+  i64 prev_poc_msb_ = 0;
+  i64 prev_poc_lsb_ = 0;
+  i64 decode_count_ = 0;
+};
+
+// Presentation index of every frame from its picture order count, which
+// runs within the interval between two keyframes
+std::vector<i64> presentation_order(const std::vector<MuxFrame>& frames) {
+  std::vector<i64> pts(frames.size());
+  size_t start = 0;
+  while (start < frames.size()) {
+    size_t end = start + 1;
+    while (end < frames.size() && !frames[end].keyframe) {
+      end++;
+    }
+    std::vector<size_t> order;
+    for (size_t i = start; i < end; ++i) {
+      order.push_back(i);
+    }
+    std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+      return frames[a].poc < frames[b].poc;
+    });
+    for (size_t r = 0; r < order.size(); ++r) {
+      pts[order[r]] = start + r;
+    }
+    start = end;
+  }
+  return pts;
+}
+
+}
+
+bool export_mp4(storehouse::StorageConfig* storage_config,
+                const std::string& db_path, i32 table_id, i32 column_id,
+                i64 start_row, i64 end_row, const std::string& output_path,
+                std::string& error_message) {
+  set_database_path(db_path);
+  av_register_all();
+  std::unique_ptr<storehouse::StorageBackend> storage(
+      storehouse::StorageBackend::make_from_config(storage_config));
+  TableMetadata table_meta = read_table_metadata(
+      storage.get(), TableMetadata::descriptor_path(table_id));
+  std::vector<i64> end_rows = table_meta.end_rows();
+  end_row = std::min(end_row, table_meta.num_rows());
+  if (start_row < 0 || start_row >= end_row) {
+    error_message = "Empty row range";
+    return false;
+  }
+
+  // Frames of all items, and bytes they point into
+  std::vector<std::vector<u8>> item_data;
+  std::vector<std::vector<MuxFrame>> item_frames;
+  std::vector<u8> extradata;
+  i32 width = 0;
+  i32 height = 0;
+  AVRational time_base{1, 25};
+  i64 item_start = 0;
+  for (size_t item_id = 0; item_id < end_rows.size(); ++item_id) {
+    i64 item_end = end_rows[item_id];
+    i64 first = std::max(start_row, item_start) - item_start;
+    i64 last = std::min(end_row, item_end) - item_start;
+    item_start = item_end;
+    if (first >= last) {
+      continue;
+    }
+
+    VideoMetadata video_meta = read_video_metadata(
+        storage.get(),
+        VideoMetadata::descriptor_path(table_id, column_id, item_id));
+    VideoIndexEntry entry = read_video_index(storage.get(), video_meta);
+    if (entry.codec_type != proto::VideoDescriptor::H264) {
+      error_message = "Only H.264 columns can be remuxed";
+      return false;
+    }
+    if (entry.inplace()) {
+      error_message = "Videos ingested in place are stored in their source";
+      return false;
+    }
+    if (entry.keyframe_index) {
+      entry = slice_video_index(entry, {first, last - 1});
+    }
+    const proto::VideoDescriptor& desc = video_meta.get_descriptor();
+    if (item_data.empty()) {
+      width = entry.width;
+      height = entry.height;
+      if (desc.time_base_num() > 0 && desc.time_base_denom() > 0) {
+        time_base = AVRational{desc.time_base_num(), desc.time_base_denom()};
+      }
+    }
+
+    // Whole keyframe intervals covering the rows
+    const std::vector<i64>& positions = entry.keyframe_positions;
+    size_t k0 = std::upper_bound(positions.begin(), positions.end(), first) -
+                positions.begin() - 1;
+    size_t k1 =
+        std::lower_bound(positions.begin(), positions.end(), last) -
+        positions.begin();
+    u64 offset = entry.keyframe_byte_offsets[k0];
+    u64 size = entry.keyframe_byte_offsets[k1] - offset;
+
+    item_data.emplace_back(size);
+    std::unique_ptr<storehouse::RandomReadFile> file;
+    BACKOFF_FAIL(storehouse::make_unique_random_read_file(
+        storage.get(), entry.data_path(), file));
+    s_read(file.get(), item_data.back().data(), size, offset);
+
+    item_frames.emplace_back();
+    PacketParser parser;
+    if (!parser.parse(item_data.back(), item_frames.back(), extradata,
+                      error_message)) {
+      return false;
+    }
+  }
+  if (extradata.empty()) {
+    error_message = "Video has no parameter sets";
+    return false;
+  }
+
+  AVFormatContext* context = nullptr;
+  if (avformat_alloc_output_context2(&context, nullptr, "mp4",
+                                     output_path.c_str()) < 0) {
+    error_message = "Failed to create MP4 muxer";
+    return false;
+  }
+  AVStream* stream = avformat_new_stream(context, nullptr);
+  stream->time_base = time_base;
+  AVCodecParameters* par = stream->codecpar;
+  par->codec_type = AVMEDIA_TYPE_VIDEO;
+  par->codec_id = AV_CODEC_ID_H264;
+  par->width = width;
+  par->height = height;
+  // The muxer turns Annex B parameter sets into avcC and converts the
+  // packets to length prefixed NAL units
+  par->extradata =
+      (u8*)av_mallocz(extradata.size() + AV_INPUT_BUFFER_PADDING_SIZE);
+  memcpy(par->extradata, extradata.data(), extradata.size());
+  par->extradata_size = extradata.size();
+
+  bool success = false;
+  if (avio_open(&context->pb, output_path.c_str(), AVIO_FLAG_WRITE) < 0) {
+    error_message = "Failed to open " + output_path;
+  } else if (avformat_write_header(context, nullptr) < 0) {
+    error_message = "Failed to write MP4 header";
+  } else {
+    success = true;
+    i64 frame_offset = 0;
+    for (size_t i = 0; i < item_frames.size() && success; ++i) {
+      const std::vector<MuxFrame>& frames = item_frames[i];
+      std::vector<i64> pts = presentation_order(frames);
+      // Presentation may not precede decoding, so reordered streams are
+      // shifted by their deepest reordering
+      i64 delay = 0;
+      for (size_t f = 0; f < frames.size(); ++f) {
+        delay = std::max(delay, (i64)f - pts[f]);
+      }
+      for (size_t f = 0; f < frames.size(); ++f) {
+        AVPacket packet;
+        av_init_packet(&packet);
+        packet.data = item_data[i].data() + frames[f].offset;
+        packet.size = frames[f].size;
+        packet.stream_index = stream->index;
+        packet.flags = frames[f].keyframe ? AV_PKT_FLAG_KEY : 0;
+        packet.dts = av_rescale_q(frame_offset + f, time_base,
+                                  stream->time_base);
+        packet.pts = av_rescale_q(frame_offset + pts[f] + delay, time_base,
+                                  stream->time_base);
+        packet.duration = av_rescale_q(1, time_base, stream->time_base);
+        if (av_write_frame(context, &packet) < 0) {
+          error_message = "Failed to write frame to MP4";
+          success = false;
+          break;
+        }
+      }
+      frame_offset += frames.size() + delay;
+    }
+    if (av_write_trailer(context) < 0 && success) {
+      error_message = "Failed to finish MP4";
+      success = false;
+    }
+  }
+  avio_closep(&context->pb);
+  avformat_free_context(context);
+  return success;
+}
+}
+}
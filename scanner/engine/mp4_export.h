@@ -0,0 +1,40 @@
+/* Copyright 2017 Carnegie Mellon University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#pragma once
+
+#include "scanner/util/common.h"
+
+#include "storehouse/storage_backend.h"
+
+#include <string>
+
+namespace scanner {
+namespace internal {
+
+//! Writes rows [start_row, end_row) of an H.264 video column to an MP4 file
+//! at the local output_path by remuxing the stored bitstream, without
+//! decoding it. Since nothing is re-encoded the range is widened to whole
+//! keyframe intervals. Frames are timed by time_base of the video, one tick
+//! per frame, and presented in picture order count order. Returns false
+//! with error_message set when the column can not be remuxed, e.g. for
+//! other codecs or videos ingested in place.
+bool export_mp4(storehouse::StorageConfig* storage_config,
+                const std::string& db_path, i32 table_id, i32 column_id,
+                i64 start_row, i64 end_row, const std::string& output_path,
+                std::string& error_message);
+}
+}
@@ -49,6 +49,14 @@ bool OpRegistry::has_op(const std::string& name) const {
   return ops_.count(name) > 0;
 }
 
+std::vector<std::string> OpRegistry::op_names() const {
+  std::vector<std::string> names;
+  for (auto& kv : ops_) {
+    names.push_back(kv.first);
+  }
+  return names;
+}
+
 OpRegistry* get_op_registry() {
   static OpRegistry* registry = new OpRegistry;
   return registry;
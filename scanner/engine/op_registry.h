@@ -21,6 +21,7 @@
 #include "scanner/util/common.h"
 
 #include <map>
+#include <vector>
 
 namespace scanner {
 namespace internal {
@@ -33,6 +34,8 @@ class OpRegistry {
 
   bool has_op(const std::string& name) const;
 
+  std::vector<std::string> op_names() const;
+
  private:
   std::map<std::string, OpInfo*> ops_;
 };
@@ -0,0 +1,174 @@
+/* Copyright 2017 Carnegie Mellon University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "scanner/engine/packed_item.h"
+#include "scanner/util/storehouse.h"
+
+#include <glog/logging.h>
+
+#include <algorithm>
+#include <cstring>
+
+namespace scanner {
+namespace internal {
+
+namespace {
+
+// Footers up to this size are read along with the trailer in one read
+const u64 FOOTER_READ_SIZE = 64 * 1024;
+const u64 TRAILER_SIZE = 3 * sizeof(u64);
+
+u64 read_u64(const u8* data) {
+  u64 value;
+  memcpy(&value, data, sizeof(u64));
+  return value;
+}
+}
+
+class PackedItemFile::MemoryFile : public storehouse::WriteFile {
+ public:
+  MemoryFile(const std::string& path) : path_(path) {}
+
+  storehouse::StoreResult append(size_t size, const u8* data) override {
+    data_.insert(data_.end(), data, data + size);
+    return storehouse::StoreResult::Success;
+  }
+
+  storehouse::StoreResult save() override {
+    return storehouse::StoreResult::Success;
+  }
+
+  const std::string path() override { return path_; }
+
+  std::vector<u8>& data() { return data_; }
+
+ private:
+  std::string path_;
+  std::vector<u8> data_;
+};
+
+PackedItemFile::PackedItemFile(storehouse::WriteFile* file, i32 num_columns)
+  : file_(file), data_(num_columns), metadata_(num_columns) {}
+
+PackedItemFile::~PackedItemFile() {}
+
+storehouse::WriteFile* PackedItemFile::data_file(i32 column_id) {
+  auto& file = data_.at(column_id);
+  if (!file) {
+    file.reset(new MemoryFile(path()));
+  }
+  return file.get();
+}
+
+storehouse::WriteFile* PackedItemFile::metadata_file(i32 column_id) {
+  auto& file = metadata_.at(column_id);
+  if (!file) {
+    file.reset(new MemoryFile(path()));
+  }
+  return file.get();
+}
+
+storehouse::StoreResult PackedItemFile::append(size_t size, const u8* data) {
+  LOG(FATAL) << "Packed item " << path()
+             << " is only written through its column files";
+  return storehouse::StoreResult::TransientFailure;
+}
+
+storehouse::StoreResult PackedItemFile::save() {
+  std::vector<u64> footer;
+  u64 start = 0;
+  for (size_t c = 0; c < data_.size(); ++c) {
+    footer.push_back(start);
+    size_t count_pos = footer.size();
+    footer.push_back(0);
+    if (data_[c]) {
+      // The metadata is blocks of an element count followed by that many
+      // element sizes, one block per io packet
+      const std::vector<u8>& metadata = metadata_[c]->data();
+      size_t pos = 0;
+      while (pos < metadata.size()) {
+        u64 num_elements = read_u64(metadata.data() + pos);
+        pos += sizeof(u64);
+        for (u64 i = 0; i < num_elements; ++i) {
+          footer.push_back(read_u64(metadata.data() + pos));
+          pos += sizeof(u64);
+        }
+        footer[count_pos] += num_elements;
+      }
+      std::vector<u8>& data = data_[c]->data();
+      s_write(file_.get(), data.data(), data.size());
+      start += data.size();
+      // Freed as soon as it is written
+      std::vector<u8>().swap(data);
+    }
+  }
+  footer.push_back(data_.size());
+  footer.push_back((footer.size() + 2) * sizeof(u64));
+  footer.push_back(PACKED_ITEM_MAGIC);
+  s_write(file_.get(), reinterpret_cast<const u8*>(footer.data()),
+          footer.size() * sizeof(u64));
+  return file_->save();
+}
+
+const std::string PackedItemFile::path() { return file_->path(); }
+
+std::vector<std::vector<u64>> read_packed_item_offsets(
+    storehouse::RandomReadFile* file) {
+  u64 file_size = 0;
+  BACKOFF_FAIL(file->get_size(file_size));
+  LOG_IF(FATAL, file_size < TRAILER_SIZE)
+      << "Packed item " << file->path() << " is too small for a footer";
+
+  u64 tail_size = std::min(file_size, FOOTER_READ_SIZE);
+  std::vector<u8> tail(tail_size);
+  u64 pos = file_size - tail_size;
+  s_read(file, tail.data(), tail_size, pos);
+
+  const u8* trailer = tail.data() + tail_size - TRAILER_SIZE;
+  u64 num_columns = read_u64(trailer);
+  u64 footer_size = read_u64(trailer + sizeof(u64));
+  LOG_IF(FATAL, read_u64(trailer + 2 * sizeof(u64)) != PACKED_ITEM_MAGIC ||
+                    footer_size < TRAILER_SIZE || footer_size > file_size)
+      << "Packed item " << file->path() << " has no valid footer";
+  if (footer_size > tail_size) {
+    tail.resize(footer_size);
+    pos = file_size - footer_size;
+    s_read(file, tail.data(), footer_size, pos);
+  }
+  const u8* footer = tail.data() + tail.size() - footer_size;
+  const u8* footer_end = footer + footer_size - TRAILER_SIZE;
+
+  std::vector<std::vector<u64>> offsets(num_columns);
+  for (u64 c = 0; c < num_columns; ++c) {
+    LOG_IF(FATAL, footer + 2 * sizeof(u64) > footer_end)
+        << "Packed item " << file->path() << " has a truncated footer";
+    u64 start = read_u64(footer);
+    u64 num_elements = read_u64(footer + sizeof(u64));
+    footer += 2 * sizeof(u64);
+    LOG_IF(FATAL, footer + num_elements * sizeof(u64) > footer_end)
+        << "Packed item " << file->path() << " has a truncated footer";
+    std::vector<u64>& column = offsets[c];
+    column.resize(num_elements + 1);
+    column[0] = start;
+    for (u64 i = 0; i < num_elements; ++i) {
+      column[i + 1] = column[i] + read_u64(footer);
+      footer += sizeof(u64);
+    }
+  }
+  return offsets;
+}
+}
+}
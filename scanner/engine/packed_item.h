@@ -0,0 +1,92 @@
+/* Copyright 2017 Carnegie Mellon University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#pragma once
+
+#include "scanner/engine/metadata.h"
+#include "scanner/util/common.h"
+
+#include "storehouse/storage_backend.h"
+
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace scanner {
+namespace internal {
+
+// Tables written with packed_items keep all of the non-video columns of an
+// item in one file rather than in a data and a metadata file per column. The
+// elements of each column are contiguous, and a footer at the end indexes
+// them:
+//
+//   for each column: u64 start, u64 num_elements, u64 sizes[num_elements]
+//   u64 num_columns
+//   u64 footer_size, the bytes of the footer including these three words
+//   u64 PACKED_ITEM_MAGIC
+//
+// so a reader finds every element of the item with one read from the end of
+// the file. Video columns keep their own files and have no elements here.
+const u64 PACKED_ITEM_MAGIC = 0x4d455449444b4350;
+
+inline bool is_packed_column(const TableMetadata& table, i32 column_id) {
+  return table.get_descriptor().packed_items() &&
+         table.column_type(column_id) != ColumnType::Video;
+}
+
+//! File holding the elements of a column of an item
+inline std::string item_data_path(const TableMetadata& table, i32 column_id,
+                                  i32 item_id) {
+  return is_packed_column(table, column_id)
+             ? table_item_packed_path(table.id(), item_id)
+             : table_item_output_path(table.id(), column_id, item_id);
+}
+
+// Collects the data and metadata files of the columns of an item in memory
+// and, when saved, writes them to one file as a packed item
+class PackedItemFile : public storehouse::WriteFile {
+ public:
+  //! Takes ownership of file
+  PackedItemFile(storehouse::WriteFile* file, i32 num_columns);
+  ~PackedItemFile();
+
+  //! Where a column's elements and their sizes are written, in the same
+  //! format as its output and metadata files would be
+  storehouse::WriteFile* data_file(i32 column_id);
+  storehouse::WriteFile* metadata_file(i32 column_id);
+
+  //! Columns are written through their files only
+  storehouse::StoreResult append(size_t size, const u8* data) override;
+
+  storehouse::StoreResult save() override;
+
+  const std::string path() override;
+
+ private:
+  class MemoryFile;
+
+  std::unique_ptr<storehouse::WriteFile> file_;
+  std::vector<std::unique_ptr<MemoryFile>> data_;
+  std::vector<std::unique_ptr<MemoryFile>> metadata_;
+};
+
+//! Reads the footer of a packed item, usually with a single read, and
+//! returns the byte offset of every element of each of its columns in the
+//! file, followed by the end of the column's elements
+std::vector<std::vector<u64>> read_packed_item_offsets(
+    storehouse::RandomReadFile* file);
+}
+}
@@ -1,7 +1,16 @@
 #include "scanner/api/database.h"
 #include "scanner/engine/op_info.h"
 #include "scanner/engine/op_registry.h"
+#include "scanner/engine/mp4_export.h"
+#include "scanner/engine/packed_item.h"
+#include "scanner/engine/range_reader.h"
+#include "scanner/engine/stream_runner.h"
+#include "scanner/engine/table_reader.h"
 #include "scanner/util/common.h"
+#include "scanner/util/compression.h"
+#include "scanner/util/storehouse.h"
+
+#include "storehouse/storage_backend.h"
 
 #include <boost/python.hpp>
 #include <boost/python/stl_iterator.hpp>
@@ -28,6 +37,7 @@ class GILRelease {
 }
 
 namespace py = boost::python;
+namespace np = boost::python::numpy;
 
 template <typename T>
 inline std::vector<T> to_std_vector(const py::object& iterable) {
@@ -54,6 +64,11 @@ std::string default_machine_params_wrapper() {
   for (auto gpu_id : params.gpu_ids) {
     params_proto.add_gpu_ids(gpu_id);
   }
+  params_proto.set_partition_cores(params.partition_cores);
+  params_proto.set_num_io_cores(params.num_io_cores);
+  params_proto.set_disk_cache_path(params.disk_cache_path);
+  params_proto.set_disk_cache_bytes(params.disk_cache_bytes);
+  params_proto.set_disk_cache_lfu(params.disk_cache_lfu);
 
   std::string output;
   bool success = params_proto.SerializeToString(&output);
@@ -61,13 +76,16 @@ std::string default_machine_params_wrapper() {
   return output;
 }
 
-proto::Result start_master_wrapper(Database& db, const std::string& port, bool watchdog) {
+proto::Result start_master_wrapper(Database& db, const std::string& port,
+                                   bool watchdog, i32 metrics_port) {
   GILRelease r;
-  return db.start_master(default_machine_params(), port, watchdog);
+  return db.start_master(default_machine_params(), port, watchdog,
+                         metrics_port);
 }
 
 proto::Result start_worker_wrapper(Database& db, const std::string& params_s,
-                                   const std::string& port, bool watchdog) {
+                                   const std::string& port, bool watchdog,
+                                   i32 metrics_port) {
   GILRelease r;
   proto::MachineParameters params_proto;
   params_proto.ParseFromString(params_s);
@@ -78,8 +96,13 @@ proto::Result start_worker_wrapper(Database& db, const std::string& params_s,
   for (auto gpu_id : params_proto.gpu_ids()) {
     params.gpu_ids.push_back(gpu_id);
   }
+  params.partition_cores = params_proto.partition_cores();
+  params.num_io_cores = params_proto.num_io_cores();
+  params.disk_cache_path = params_proto.disk_cache_path();
+  params.disk_cache_bytes = params_proto.disk_cache_bytes();
+  params.disk_cache_lfu = params_proto.disk_cache_lfu();
 
-  return db.start_worker(params, port, watchdog);
+  return db.start_worker(params, port, watchdog, metrics_port);
 }
 
 py::list ingest_videos_wrapper(Database& db, const py::list table_names,
@@ -111,6 +134,341 @@ Result new_table_wrapper(Database& db, const std::string& name,
   return db.new_table(name, columns_py, rows_py2);
 }
 
+Result new_columnar_table_wrapper(Database& db, const std::string& name,
+                                  const py::list columns, const py::list data,
+                                  const py::list sizes, i64 num_rows,
+                                  i64 rows_per_item, i32 num_threads) {
+  std::vector<std::string> columns_py = to_std_vector<std::string>(columns);
+  std::vector<np::ndarray> data_py = to_std_vector<np::ndarray>(data);
+  std::vector<np::ndarray> sizes_py = to_std_vector<np::ndarray>(sizes);
+  // The arrays stay referenced by the caller's lists while the GIL is
+  // released, so their buffers are read in place
+  std::vector<const u8*> column_data;
+  std::vector<const i64*> column_sizes;
+  for (size_t j = 0; j < data_py.size() && j < sizes_py.size(); ++j) {
+    LOG_IF(FATAL, data_py[j].get_dtype() != np::dtype::get_builtin<u8>() ||
+                      !(data_py[j].get_flags() & np::ndarray::C_CONTIGUOUS))
+        << "Column data must be a contiguous uint8 array";
+    LOG_IF(FATAL, sizes_py[j].get_dtype() != np::dtype::get_builtin<i64>() ||
+                      !(sizes_py[j].get_flags() & np::ndarray::C_CONTIGUOUS) ||
+                      sizes_py[j].shape(0) != num_rows)
+        << "Column sizes must be a contiguous int64 array with a size for "
+        << "every row";
+    column_data.push_back((const u8*)data_py[j].get_data());
+    column_sizes.push_back((const i64*)sizes_py[j].get_data());
+  }
+
+  GILRelease r;
+  return db.new_columnar_table(name, columns_py, column_data, column_sizes,
+                               num_rows, rows_per_item, num_threads);
+}
+
+Result new_synthetic_table_wrapper(Database& db, const std::string& name,
+                                   const py::list columns, i64 num_rows,
+                                   i64 rows_per_item, i64 element_bytes) {
+  std::vector<std::string> columns_py = to_std_vector<std::string>(columns);
+  GILRelease r;
+  return db.new_synthetic_table(name, columns_py, num_rows, rows_per_item,
+                                element_bytes);
+}
+
+Result ingest_synthetic_videos_wrapper(Database& db, const py::list names,
+                                       const std::string& template_path,
+                                       i64 frames_per_video) {
+  std::vector<std::string> names_py = to_std_vector<std::string>(names);
+  GILRelease r;
+  return db.ingest_synthetic_videos(names_py, template_path,
+                                    frames_per_video);
+}
+
+Result compact_table_wrapper(Database& db, const std::string& name,
+                             i64 target_item_bytes) {
+  GILRelease r;
+  return db.compact_table(name, target_item_bytes);
+}
+
+// Reads the elements of the given rows (all rows if empty) of one column item
+// and returns them packed into a single uint8 array along with the offsets of
+// each row in it, so the caller can slice rows out without copying them.
+// Consecutive rows are read as one range and ranges are fetched concurrently.
+// offsets holds the position of each element of the item in data_path,
+// followed by the end of the last one.
+py::tuple load_elements(storehouse::StorageConfig* sc,
+                        const std::string& data_path,
+                        const std::vector<u64>& offsets,
+                        std::vector<i64> rows, const std::string& codec) {
+  std::vector<u64> sizes;
+  u64 total_size = 0;
+  i64 num_elements = (i64)offsets.size() - 1;
+  if (rows.empty()) {
+    for (i64 i = 0; i < num_elements; ++i) {
+      rows.push_back(i);
+    }
+  }
+  for (i64 row : rows) {
+    LOG_IF(FATAL, row < 0 || row >= num_elements)
+        << "Row " << row << " is outside of " << data_path;
+    sizes.push_back(offsets[row + 1] - offsets[row]);
+    total_size += sizes.back();
+  }
+
+  bool compressed = is_element_codec(codec);
+  // Compressed elements are read into a staging buffer and expanded into
+  // the returned array
+  std::vector<u8> staging(compressed ? total_size : 0);
+  np::ndarray data = np::empty(py::make_tuple(compressed ? 0 : total_size),
+                               np::dtype::get_builtin<u8>());
+  std::vector<u64> packed_offsets(rows.size() + 1, 0);
+  std::vector<u8> decompressed;
+  {
+    GILRelease r;
+    u8* dest = compressed ? staging.data() : (u8*)data.get_data();
+    std::vector<internal::RangeReader::Range> ranges;
+    u64 packed = 0;
+    for (size_t i = 0; i < rows.size(); ++i) {
+      u64 offset = offsets[rows[i]];
+      if (!ranges.empty() &&
+          ranges.back().offset + ranges.back().size == offset) {
+        ranges.back().size += sizes[i];
+      } else {
+        ranges.push_back(
+            internal::RangeReader::Range{offset, sizes[i], dest + packed});
+      }
+      packed += sizes[i];
+      packed_offsets[i + 1] = packed;
+    }
+    internal::RangeReader reader(sc);
+    reader.read(data_path, ranges);
+
+    if (compressed) {
+      decompressed.reserve(total_size);
+      for (size_t i = 0; i < rows.size(); ++i) {
+        // Null elements are stored empty
+        if (sizes[i] > 0) {
+          decompress_element(codec, staging.data() + packed_offsets[i],
+                             sizes[i], decompressed);
+        }
+        packed_offsets[i + 1] = decompressed.size();
+      }
+    }
+  }
+  if (compressed) {
+    data = np::empty(py::make_tuple(decompressed.size()),
+                     np::dtype::get_builtin<u8>());
+    memcpy(data.get_data(), decompressed.data(), decompressed.size());
+  }
+
+  np::ndarray row_offsets = np::empty(py::make_tuple(packed_offsets.size()),
+                                      np::dtype::get_builtin<i64>());
+  memcpy(row_offsets.get_data(), packed_offsets.data(),
+         packed_offsets.size() * sizeof(u64));
+  return py::make_tuple(data, row_offsets);
+}
+
+py::tuple load_item_elements_wrapper(storehouse::StorageConfig* sc,
+                                     const std::string& metadata_path,
+                                     const std::string& data_path,
+                                     const py::object rows_py,
+                                     const std::string& codec) {
+  std::vector<u64> offsets;
+  {
+    GILRelease r;
+    std::unique_ptr<storehouse::StorageBackend> storage(
+        storehouse::StorageBackend::make_from_config(sc));
+    std::unique_ptr<storehouse::RandomReadFile> file;
+    BACKOFF_FAIL(
+        storehouse::make_unique_random_read_file(storage.get(), metadata_path,
+                                                 file));
+    u64 file_size = 0;
+    BACKOFF_FAIL(file->get_size(file_size));
+    std::vector<u64> element_sizes;
+    u64 pos = 0;
+    while (pos < file_size) {
+      u64 num_elements = s_read<u64>(file.get(), pos);
+      size_t prev_size = element_sizes.size();
+      element_sizes.resize(prev_size + num_elements);
+      s_read(file.get(),
+             reinterpret_cast<u8*>(element_sizes.data() + prev_size),
+             num_elements * sizeof(u64), pos);
+    }
+    offsets.resize(element_sizes.size() + 1);
+    offsets[0] = 0;
+    for (size_t i = 0; i < element_sizes.size(); ++i) {
+      offsets[i + 1] = offsets[i] + element_sizes[i];
+    }
+  }
+  return load_elements(sc, data_path, offsets, to_std_vector<i64>(rows_py),
+                       codec);
+}
+
+py::tuple load_packed_item_elements_wrapper(storehouse::StorageConfig* sc,
+                                            const std::string& path,
+                                            i32 column_id,
+                                            const py::object rows_py,
+                                            const std::string& codec) {
+  std::vector<u64> offsets;
+  {
+    GILRelease r;
+    std::unique_ptr<storehouse::StorageBackend> storage(
+        storehouse::StorageBackend::make_from_config(sc));
+    std::unique_ptr<storehouse::RandomReadFile> file;
+    BACKOFF_FAIL(storehouse::make_unique_random_read_file(storage.get(), path,
+                                                          file));
+    std::vector<std::vector<u64>> columns =
+        internal::read_packed_item_offsets(file.get());
+    LOG_IF(FATAL, column_id < 0 || column_id >= (i32)columns.size())
+        << "Packed item " << path << " has no column " << column_id;
+    offsets = std::move(columns[column_id]);
+  }
+  return load_elements(sc, path, offsets, to_std_vector<i64>(rows_py), codec);
+}
+
+boost::shared_ptr<internal::TableReader> table_reader_init_wrapper(
+    storehouse::StorageConfig* sc, const std::string& db_path) {
+  GILRelease r;
+  return boost::shared_ptr<internal::TableReader>(
+      new internal::TableReader(sc, db_path));
+}
+
+// Video columns come back as one array of shape (rows, height, width,
+// channels) and other columns as a list of byte strings
+py::object table_reader_read_wrapper(internal::TableReader& reader,
+                                     i32 table_id, i32 column_id,
+                                     const py::object rows_py) {
+  std::vector<i64> rows = to_std_vector<i64>(rows_py);
+  FrameInfo frame_info;
+  ElementList elements;
+  {
+    GILRelease r;
+    elements = reader.read(table_id, column_id, rows, frame_info);
+  }
+  if (elements.empty() || !elements[0].is_frame) {
+    py::list output;
+    for (Element& element : elements) {
+      output.append(py::str((const char*)element.buffer, element.size));
+      delete_element(CPU_DEVICE, element);
+    }
+    return output;
+  }
+
+  np::dtype dtype = np::dtype::get_builtin<u8>();
+  if (frame_info.type == FrameType::F32) {
+    dtype = np::dtype::get_builtin<f32>();
+  } else if (frame_info.type == FrameType::F64) {
+    dtype = np::dtype::get_builtin<f64>();
+  }
+  np::ndarray frames = np::empty(
+      py::make_tuple(elements.size(), frame_info.shape[0],
+                     frame_info.shape[1], frame_info.shape[2]),
+      dtype);
+  u8* dest = (u8*)frames.get_data();
+  {
+    GILRelease r;
+    for (Element& element : elements) {
+      const Frame* frame = element.as_const_frame();
+      memcpy(dest, frame->data, frame_info.size());
+      dest += frame_info.size();
+      delete_element(CPU_DEVICE, element);
+    }
+  }
+  return frames;
+}
+
+// Ops are serialized proto::Op messages, of which only the name, device type
+// and kernel args are used
+boost::shared_ptr<internal::StreamRunner> stream_runner_init_wrapper(
+    const std::string& url, const py::list ops_py, bool gpu_decode, i32 gpu_id,
+    i32 batch_size, i64 max_latency_ms, i32 max_buffered_results) {
+  internal::StreamParameters params;
+  params.url = url;
+  for (const std::string& op_bytes : to_std_vector<std::string>(ops_py)) {
+    proto::Op op;
+    op.ParseFromString(op_bytes);
+    internal::StreamOp stream_op;
+    stream_op.name = op.name();
+    stream_op.device_type = op.device_type();
+    stream_op.args.assign(op.kernel_args().begin(), op.kernel_args().end());
+    params.ops.push_back(stream_op);
+  }
+  if (gpu_decode &&
+      internal::VideoDecoder::has_decoder_type(
+          internal::VideoDecoderType::NVIDIA)) {
+    params.decoder_type = internal::VideoDecoderType::NVIDIA;
+  }
+  params.gpu_id = gpu_id;
+  params.batch_size = batch_size;
+  params.max_latency_ms = max_latency_ms;
+  params.max_buffered_results = max_buffered_results;
+  return boost::shared_ptr<internal::StreamRunner>(
+      new internal::StreamRunner(params));
+}
+
+Result stream_runner_start_wrapper(internal::StreamRunner& runner) {
+  GILRelease r;
+  return runner.start();
+}
+
+// Returns (frame, latency in seconds, outputs) for the next result, or None
+// if there was none within the timeout. Frame outputs are arrays of shape
+// (height, width, channels) and other outputs byte strings.
+py::object stream_runner_next_wrapper(internal::StreamRunner& runner,
+                                      i64 timeout_ms) {
+  internal::StreamResult result;
+  bool got_result;
+  {
+    GILRelease r;
+    got_result = runner.next(result, timeout_ms);
+  }
+  if (!got_result) {
+    return py::object();
+  }
+  py::list outputs;
+  for (Element& element : result.columns) {
+    if (element.is_frame) {
+      const Frame* frame = element.as_const_frame();
+      np::dtype dtype = np::dtype::get_builtin<u8>();
+      if (frame->type == FrameType::F32) {
+        dtype = np::dtype::get_builtin<f32>();
+      } else if (frame->type == FrameType::F64) {
+        dtype = np::dtype::get_builtin<f64>();
+      }
+      np::ndarray array = np::empty(
+          py::make_tuple(frame->shape[0], frame->shape[1], frame->shape[2]),
+          dtype);
+      memcpy(array.get_data(), frame->data, frame->size());
+      outputs.append(array);
+    } else {
+      outputs.append(py::str((const char*)element.buffer, element.size));
+    }
+    delete_element(CPU_DEVICE, element);
+  }
+  return py::make_tuple(result.frame, result.latency_ns / 1e9, outputs);
+}
+
+void stream_runner_stop_wrapper(internal::StreamRunner& runner) {
+  GILRelease r;
+  runner.stop();
+}
+
+py::list stream_runner_output_columns_wrapper(
+    internal::StreamRunner& runner) {
+  return to_py_list<std::string>(runner.output_columns());
+}
+
+// Returns an error message, empty on success
+std::string export_mp4_wrapper(storehouse::StorageConfig* sc,
+                               const std::string& db_path, i32 table_id,
+                               i32 column_id, i64 start_row, i64 end_row,
+                               const std::string& output_path) {
+  GILRelease r;
+  std::string error_message;
+  if (!internal::export_mp4(sc, db_path, table_id, column_id, start_row,
+                            end_row, output_path, error_message)) {
+    return error_message.empty() ? "Failed to export MP4" : error_message;
+  }
+  return "";
+}
+
 boost::shared_ptr<Database> initWrapper(storehouse::StorageConfig* sc,
                                         const std::string& db_path,
                                         const std::string& master_addr) {
@@ -137,5 +495,26 @@ BOOST_PYTHON_MODULE(libscanner) {
   def("wait_for_server_shutdown", wait_for_server_shutdown_wrapper);
   def("default_machine_params", default_machine_params_wrapper);
   def("new_table", new_table_wrapper);
+  def("new_columnar_table", new_columnar_table_wrapper);
+  def("compact_table", compact_table_wrapper);
+  def("new_synthetic_table", new_synthetic_table_wrapper);
+  def("ingest_synthetic_videos", ingest_synthetic_videos_wrapper);
+  def("load_item_elements", load_item_elements_wrapper);
+  def("load_packed_item_elements", load_packed_item_elements_wrapper);
+  def("export_mp4", export_mp4_wrapper);
+  class_<internal::TableReader, boost::shared_ptr<internal::TableReader>,
+         boost::noncopyable>("TableReader", no_init)
+      .def("__init__", make_constructor(&table_reader_init_wrapper))
+      .def("read", &table_reader_read_wrapper);
+  class_<internal::StreamRunner, boost::shared_ptr<internal::StreamRunner>,
+         boost::noncopyable>("StreamRunner", no_init)
+      .def("__init__", make_constructor(&stream_runner_init_wrapper))
+      .def("start", stream_runner_start_wrapper)
+      .def("next", stream_runner_next_wrapper)
+      .def("stop", stream_runner_stop_wrapper)
+      .def("finished", &internal::StreamRunner::finished)
+      .def("error", &internal::StreamRunner::error)
+      .def("frames_dropped", &internal::StreamRunner::frames_dropped)
+      .def("output_columns", stream_runner_output_columns_wrapper);
 }
 }
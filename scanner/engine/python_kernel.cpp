@@ -29,11 +29,100 @@ std::string handle_pyerror() {
   return extract<std::string>(formatted);
 }
 
+namespace {
+
+// Reference on a frame buffer held by the NumPy arrays that wrap it, so an
+// array kept alive past execute still points at valid memory
+struct FrameRef {
+  DeviceHandle device;
+  u8* buffer;
+};
+
+const char* FRAME_REF_NAME = "scanner.FrameRef";
+
+void release_frame_ref(PyObject* capsule) {
+  FrameRef* ref = (FrameRef*)PyCapsule_GetPointer(capsule, FRAME_REF_NAME);
+  delete_buffer(ref->device, ref->buffer);
+  delete ref;
+}
+
+py::object frame_owner(DeviceHandle device, u8* buffer) {
+  add_buffer_ref(device, buffer);
+  PyObject* capsule = PyCapsule_New(new FrameRef{device, buffer},
+                                    FRAME_REF_NAME, release_frame_ref);
+  return py::object(py::handle<>(capsule));
+}
+
+np::dtype frame_type_to_dtype(FrameType type) {
+  switch (type) {
+    case FrameType::U8:
+      return np::dtype::get_builtin<uint8_t>();
+    case FrameType::F32:
+      return np::dtype::get_builtin<f32>();
+    case FrameType::F64:
+      return np::dtype::get_builtin<f64>();
+    default:
+      LOG(FATAL) << "Frame type has no numpy dtype";
+  }
+  return np::dtype::get_builtin<uint8_t>();
+}
+
+FrameType dtype_to_frame_type(const np::dtype& dtype) {
+  if (dtype == np::dtype::get_builtin<uint8_t>()) {
+    return FrameType::U8;
+  } else if (dtype == np::dtype::get_builtin<f32>()) {
+    return FrameType::F32;
+  } else if (dtype == np::dtype::get_builtin<f64>()) {
+    return FrameType::F64;
+  }
+  LOG(FATAL) << "Invalid numpy dtype: "
+             << py::extract<char const*>(py::str(dtype));
+  return FrameType::U8;
+}
+
+// Wraps the frame's memory without copying it. Input frames are shared with
+// the rest of the pipeline and so are exposed read-only.
+np::ndarray frame_to_ndarray(DeviceHandle device, const Frame* frame,
+                             bool writable) {
+  size_t elem_size = size_of_frame_type(frame->type);
+  np::ndarray frame_np = np::from_data(
+      frame->data, frame_type_to_dtype(frame->type),
+      py::make_tuple(frame->height(), frame->width(), frame->channels()),
+      py::make_tuple(frame->row_stride, frame->channels() * elem_size,
+                     elem_size),
+      frame_owner(device, frame->data));
+  if (!writable) {
+    frame_np.attr("setflags")(false);
+  }
+  return frame_np;
+}
+
+}
+
 PythonKernel::PythonKernel(const KernelConfig& config,
                            const std::string& kernel_str,
-                           const std::string& pickled_config)
+                           const std::string& pickled_config,
+                           bool multiprocess)
   : BatchedKernel(config), config_(config), device_(config.devices[0]) {
   PyGILState_STATE gstate = PyGILState_Ensure();
+  if (multiprocess) {
+    std::string python_executable;
+    try {
+      python_executable =
+          py::extract<std::string>(py::import("sys").attr("executable"));
+    } catch (py::error_already_set& e) {
+      LOG(FATAL) << handle_pyerror();
+    }
+    PyGILState_Release(gstate);
+    if (python_executable.empty()) {
+      python_executable = "python";
+    }
+    process_.reset(new PythonKernelProcess(
+        python_executable, kernel_str,
+        std::string((const char*)config.args.data(), config.args.size()),
+        pickled_config));
+    return;
+  }
   try {
     py::object main = py::import("__main__");
     main.attr("kernel_str") = py::str(kernel_str);
@@ -58,6 +147,9 @@ PythonKernel::PythonKernel(const KernelConfig& config,
 }
 
 PythonKernel::~PythonKernel() {
+  if (process_) {
+    return;
+  }
   PyGILState_STATE gstate = PyGILState_Ensure();
   try {
     py::object main = py::import("__main__");
@@ -73,33 +165,78 @@ void PythonKernel::execute(const BatchedColumns& input_columns,
                            BatchedColumns& output_columns) {
   i32 input_count = (i32)num_rows(input_columns[0]);
 
+  if (process_) {
+    std::vector<bool> frame_inputs;
+    for (i32 j = 0; j < input_columns.size(); ++j) {
+      frame_inputs.push_back(config_.input_column_types[j] ==
+                             proto::ColumnType::Video);
+    }
+    std::vector<bool> frame_outputs;
+    for (i32 j = 0; j < output_columns.size(); ++j) {
+      frame_outputs.push_back(config_.output_columns[j] == "frame");
+    }
+    process_->execute(input_columns, frame_inputs, frame_outputs, device_,
+                      output_columns);
+    return;
+  }
+
   PyGILState_STATE gstate = PyGILState_Ensure();
 
   try {
     py::object main = py::import("__main__");
     py::object kernel = main.attr("kernel");
 
+    py::object numpy = py::import("numpy");
+    // Kernels that declare their output shapes write into preallocated
+    // frames instead of returning arrays that have to be copied
+    bool preallocate = py::hasattr(kernel, "output_frame_shapes");
+
     for (i32 i = 0; i < input_count; ++i) {
       py::list cols;
       for (i32 j = 0; j < input_columns.size(); ++j) {
         // HACK(wcrichto): should pass column type in config and check here
         if (config_.input_column_types[j] == proto::ColumnType::Video) {
-          const Frame* frame = input_columns[j][i].as_const_frame();
-          np::ndarray frame_np =
-              np::from_data(frame->data, np::dtype::get_builtin<uint8_t>(),
-                            py::make_tuple(frame->height(), frame->width(),
-                                           frame->channels()),
-                            py::make_tuple(frame->width() * frame->channels(),
-                                           frame->channels(), 1),
-                            py::object());
-          cols.append(frame_np);
+          cols.append(frame_to_ndarray(
+              device_, input_columns[j][i].as_const_frame(), false));
         } else {
           cols.append(py::str((char const*)input_columns[j][i].buffer,
                               input_columns[j][i].size));
         }
       }
 
-      py::list out_cols = py::extract<py::list>(kernel.attr("execute")(cols));
+      std::vector<Frame*> preallocated(output_columns.size(), nullptr);
+      py::object result;
+      if (preallocate) {
+        py::list shapes =
+            py::extract<py::list>(kernel.attr("output_frame_shapes")(cols));
+        LOG_IF(FATAL, py::len(shapes) != output_columns.size())
+            << "Incorrect number of output frame shapes. Expected "
+            << output_columns.size();
+        py::list outputs;
+        for (i32 j = 0; j < output_columns.size(); ++j) {
+          if (shapes[j].is_none()) {
+            outputs.append(py::object());
+            continue;
+          }
+          py::object shape = shapes[j][0];
+          np::dtype dtype = py::extract<np::dtype>(
+              numpy.attr("dtype")(shapes[j][1]));
+          std::vector<i32> dims;
+          for (i32 n = 0; n < py::len(shape); ++n) {
+            dims.push_back(py::extract<i32>(shape[n]));
+          }
+          LOG_IF(FATAL, dims.size() != 3)
+              << "Output frame shapes must have 3 dimensions";
+          preallocated[j] =
+              new_frame(device_, FrameInfo(dims, dtype_to_frame_type(dtype)));
+          outputs.append(frame_to_ndarray(device_, preallocated[j], true));
+        }
+        result = kernel.attr("execute")(cols, outputs);
+      } else {
+        result = kernel.attr("execute")(cols);
+      }
+
+      py::list out_cols = py::extract<py::list>(result);
       LOG_IF(FATAL, py::len(out_cols) != output_columns.size())
           << "Incorrect number of output columns. Expected "
           << output_columns.size();
@@ -108,45 +245,36 @@ void PythonKernel::execute(const BatchedColumns& input_columns,
         // HACK(wcrichto): should pass column type in config and check here
         if (config_.output_columns[j] == "frame") {
           np::ndarray frame_np = py::extract<np::ndarray>(out_cols[j]);
-          FrameType frame_type;
-          {
-            np::dtype dtype = frame_np.get_dtype();
-            if (dtype == np::dtype::get_builtin<uint8_t>()) {
-              frame_type = FrameType::U8;
-            } else if (dtype == np::dtype::get_builtin<f32>()) {
-              frame_type = FrameType::F32;
-            } else if (dtype == np::dtype::get_builtin<f64>()) {
-              frame_type = FrameType::F64;
-            } else {
-              LOG(FATAL) << "Invalid numpy dtype: "
-                         << py::extract<char const*>(py::str(dtype));
-            }
+          Frame* out_frame = preallocated[j];
+          if (out_frame != nullptr &&
+              frame_np.get_data() == (char*)out_frame->data) {
+            insert_frame(output_columns[j], out_frame);
+            continue;
           }
+          if (out_frame != nullptr) {
+            delete_buffer(device_, out_frame->data);
+            delete out_frame;
+          }
+
+          FrameType frame_type = dtype_to_frame_type(frame_np.get_dtype());
           i32 ndim = frame_np.get_nd();
-          if (ndim > 3) {
-            LOG(FATAL) << "Invalid number of dimensions (must be less than 4): "
-                       << ndim;
+          if (ndim != 3) {
+            LOG(FATAL) << "Can not support ndim != 3.";
           }
           std::vector<i32> shapes;
-          std::vector<i32> strides;
           for (int n = 0; n < ndim; ++n) {
             shapes.push_back(frame_np.shape(n));
-            strides.push_back(frame_np.strides(n));
+          }
+          // Arbitrary strides are compacted by numpy so a single copy
+          // suffices
+          if (!(frame_np.get_flags() & np::ndarray::C_CONTIGUOUS)) {
+            frame_np = py::extract<np::ndarray>(
+                numpy.attr("ascontiguousarray")(frame_np));
           }
           FrameInfo frame_info(shapes, frame_type);
           Frame* frame = new_frame(device_, frame_info);
-          const char* frame_data = frame_np.get_data();
-
-          if (ndim == 3) {
-            assert(strides[1] % strides[2] == 0);
-            for (int i = 0; i < shapes[0]; ++i) {
-              u64 offset = strides[0] * i;
-              memcpy(frame->data + offset, frame_data + offset,
-                     shapes[2] * shapes[1] * strides[2]);
-            }
-          } else {
-            LOG(FATAL) << "Can not support ndim != 3.";
-          }
+          memcpy_buffer(frame->data, device_, (u8*)frame_np.get_data(),
+                        CPU_DEVICE, frame_info.size());
           insert_frame(output_columns[j], frame);
         } else {
           std::string field = py::extract<std::string>(out_cols[j]);
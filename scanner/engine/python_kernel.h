@@ -1,5 +1,6 @@
 #include "scanner/api/kernel.h"
 #include "scanner/api/op.h"
+#include "scanner/engine/python_kernel_process.h"
 #include "scanner/util/memory.h"
 #include "scanner/metadata.pb.h"
 
@@ -11,7 +12,7 @@ namespace scanner {
 class PythonKernel : public BatchedKernel {
  public:
   PythonKernel(const KernelConfig& config, const std::string& kernel_str,
-               const std::string& pickled_config);
+               const std::string& pickled_config, bool multiprocess = false);
 
   ~PythonKernel();
 
@@ -21,6 +22,8 @@ class PythonKernel : public BatchedKernel {
  private:
   KernelConfig config_;
   DeviceHandle device_;
+  // Set when the kernel runs in its own Python process
+  std::unique_ptr<PythonKernelProcess> process_;
 };
 
 }
@@ -0,0 +1,280 @@
+#include "scanner/engine/python_kernel_process.h"
+#include "scanner/util/memory.h"
+
+#include <fcntl.h>
+#include <spawn.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <atomic>
+#include <cstring>
+
+extern char** environ;
+
+namespace scanner {
+
+namespace {
+
+// Each row and column is described by a fixed record of i64 fields
+enum RecordField {
+  KIND = 0,
+  OFFSET,
+  SIZE,
+  HEIGHT,
+  WIDTH,
+  CHANNELS,
+  TYPE,
+  ROW_STRIDE,
+  RECORD_FIELDS
+};
+
+enum RecordKind { BYTES = 0, FRAME = 1 };
+
+enum Command { CLOSE = 0, EXECUTE = 1 };
+
+// Rows are laid out on cache line boundaries within a segment
+const size_t SEGMENT_ALIGNMENT = 64;
+
+size_t align_up(size_t size) {
+  return (size + SEGMENT_ALIGNMENT - 1) / SEGMENT_ALIGNMENT *
+         SEGMENT_ALIGNMENT;
+}
+
+std::string segment_name(const std::string& suffix) {
+  static std::atomic<i32> next_id{0};
+  return "/scanner-pykernel-" + std::to_string(getpid()) + "-" +
+         std::to_string(next_id++) + "-" + suffix;
+}
+
+}
+
+PythonKernelProcess::PythonKernelProcess(const std::string& python_executable,
+                                         const std::string& kernel_str,
+                                         const std::string& args,
+                                         const std::string& pickled_config) {
+  input_.name = segment_name("in");
+  output_.name = segment_name("out");
+  for (Segment* segment : {&input_, &output_}) {
+    segment->fd = shm_open(segment->name.c_str(), O_CREAT | O_EXCL | O_RDWR,
+                           S_IRUSR | S_IWUSR);
+    LOG_IF(FATAL, segment->fd < 0) << "Failed to create shared memory "
+                                   << segment->name << ": " << strerror(errno);
+  }
+
+  int to_child[2];
+  int from_child[2];
+  LOG_IF(FATAL, pipe(to_child) != 0 || pipe(from_child) != 0)
+      << "Failed to create pipes for Python kernel process";
+
+  // Spawning rather than forking keeps the child clear of the locks held by
+  // the worker's other threads
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_init(&actions);
+  posix_spawn_file_actions_addclose(&actions, to_child[1]);
+  posix_spawn_file_actions_addclose(&actions, from_child[0]);
+  std::string in_fd = std::to_string(to_child[0]);
+  std::string out_fd = std::to_string(from_child[1]);
+  std::vector<char*> argv = {(char*)python_executable.c_str(),
+                             (char*)"-m",
+                             (char*)"scannerpy.kernel_process",
+                             (char*)in_fd.c_str(),
+                             (char*)out_fd.c_str(),
+                             (char*)input_.name.c_str(),
+                             (char*)output_.name.c_str(),
+                             nullptr};
+  int err = posix_spawnp(&pid_, python_executable.c_str(), &actions,
+                         nullptr, argv.data(), environ);
+  posix_spawn_file_actions_destroy(&actions);
+  LOG_IF(FATAL, err != 0) << "Failed to spawn Python kernel process: "
+                          << strerror(err);
+  close(to_child[0]);
+  close(from_child[1]);
+  to_child_ = to_child[1];
+  from_child_ = from_child[0];
+
+  write_string(kernel_str);
+  write_string(args);
+  write_string(pickled_config);
+  i64 status;
+  read_all(&status, sizeof(status));
+  LOG_IF(FATAL, status != 0) << "Python kernel process failed to start";
+}
+
+PythonKernelProcess::~PythonKernelProcess() {
+  i64 command = CLOSE;
+  write_all(&command, sizeof(command));
+  close(to_child_);
+  close(from_child_);
+  waitpid(pid_, nullptr, 0);
+  for (Segment* segment : {&input_, &output_}) {
+    unmap_segment(*segment);
+    close(segment->fd);
+    shm_unlink(segment->name.c_str());
+  }
+}
+
+void PythonKernelProcess::execute(const BatchedColumns& input_columns,
+                                  const std::vector<bool>& frame_inputs,
+                                  const std::vector<bool>& frame_outputs,
+                                  DeviceHandle device,
+                                  BatchedColumns& output_columns) {
+  i32 input_count = (i32)num_rows(input_columns[0]);
+  i32 num_inputs = (i32)input_columns.size();
+  i32 num_outputs = (i32)output_columns.size();
+
+  // Lay out the batch, packing frame rows so the child sees contiguous
+  // arrays
+  std::vector<i64> records(input_count * num_inputs * RECORD_FIELDS, 0);
+  size_t total_size = 0;
+  for (i32 i = 0; i < input_count; ++i) {
+    for (i32 j = 0; j < num_inputs; ++j) {
+      i64* record = &records[(i * num_inputs + j) * RECORD_FIELDS];
+      const Element& element = input_columns[j][i];
+      size_t size = element.size;
+      record[KIND] = BYTES;
+      if (frame_inputs[j]) {
+        const Frame* frame = element.as_const_frame();
+        size = frame->size();
+        record[KIND] = FRAME;
+        record[HEIGHT] = frame->height();
+        record[WIDTH] = frame->width();
+        record[CHANNELS] = frame->channels();
+        record[TYPE] = frame->type;
+        record[ROW_STRIDE] = frame->row_size();
+      }
+      record[OFFSET] = total_size;
+      record[SIZE] = size;
+      total_size = align_up(total_size + size);
+    }
+  }
+  if (total_size > input_.size) {
+    map_segment(input_, total_size, true);
+  }
+  for (i32 i = 0; i < input_count; ++i) {
+    for (i32 j = 0; j < num_inputs; ++j) {
+      i64* record = &records[(i * num_inputs + j) * RECORD_FIELDS];
+      const Element& element = input_columns[j][i];
+      u8* dest = input_.data + record[OFFSET];
+      if (frame_inputs[j]) {
+        const Frame* frame = element.as_const_frame();
+        if (frame->is_contiguous()) {
+          memcpy_buffer(dest, CPU_DEVICE, frame->data, device, frame->size());
+        } else {
+          for (i32 r = 0; r < frame->height(); ++r) {
+            memcpy_buffer(dest + r * frame->row_size(), CPU_DEVICE,
+                          frame->data + r * frame->row_stride, device,
+                          frame->row_size());
+          }
+        }
+      } else {
+        memcpy_buffer(dest, CPU_DEVICE, element.buffer, device, element.size);
+      }
+    }
+  }
+
+  i64 header[] = {EXECUTE, (i64)input_.size, input_count, num_inputs,
+                  num_outputs};
+  write_all(header, sizeof(header));
+  write_all(records.data(), records.size() * sizeof(i64));
+
+  i64 status;
+  read_all(&status, sizeof(status));
+  if (status != 0) {
+    i64 length;
+    read_all(&length, sizeof(length));
+    std::string message(length, '\0');
+    read_all(&message[0], length);
+    LOG(FATAL) << message;
+  }
+  i64 output_size;
+  read_all(&output_size, sizeof(output_size));
+  std::vector<i64> out_records(input_count * num_outputs * RECORD_FIELDS);
+  read_all(out_records.data(), out_records.size() * sizeof(i64));
+  if ((size_t)output_size != output_.size) {
+    map_segment(output_, output_size, false);
+  }
+
+  for (i32 i = 0; i < input_count; ++i) {
+    for (i32 j = 0; j < num_outputs; ++j) {
+      i64* record = &out_records[(i * num_outputs + j) * RECORD_FIELDS];
+      u8* src = output_.data + record[OFFSET];
+      if (frame_outputs[j]) {
+        LOG_IF(FATAL, record[KIND] != FRAME)
+            << "Python kernel returned a non-array for frame column " << j;
+        FrameInfo info(record[HEIGHT], record[WIDTH], record[CHANNELS],
+                       (FrameType)record[TYPE]);
+        Frame* frame = new_frame(device, info);
+        memcpy_buffer(frame->data, device, src, CPU_DEVICE, info.size());
+        insert_frame(output_columns[j], frame);
+      } else {
+        u8* buffer = new_buffer(device, record[SIZE]);
+        memcpy_buffer(buffer, device, src, CPU_DEVICE, record[SIZE]);
+        insert_element(output_columns[j], buffer, record[SIZE]);
+      }
+    }
+  }
+}
+
+void PythonKernelProcess::write_all(const void* data, size_t size) {
+  const u8* bytes = (const u8*)data;
+  while (size > 0) {
+    ssize_t written = write(to_child_, bytes, size);
+    if (written < 0 && errno == EINTR) {
+      continue;
+    }
+    LOG_IF(FATAL, written <= 0) << "Python kernel process exited";
+    bytes += written;
+    size -= written;
+  }
+}
+
+void PythonKernelProcess::read_all(void* data, size_t size) {
+  u8* bytes = (u8*)data;
+  while (size > 0) {
+    ssize_t bytes_read = read(from_child_, bytes, size);
+    if (bytes_read < 0 && errno == EINTR) {
+      continue;
+    }
+    LOG_IF(FATAL, bytes_read <= 0) << "Python kernel process exited";
+    bytes += bytes_read;
+    size -= bytes_read;
+  }
+}
+
+void PythonKernelProcess::write_string(const std::string& str) {
+  i64 length = str.size();
+  write_all(&length, sizeof(length));
+  write_all(str.data(), str.size());
+}
+
+void PythonKernelProcess::map_segment(Segment& segment, size_t size,
+                                      bool resize) {
+  unmap_segment(segment);
+  if (resize) {
+    // Grown segments keep some headroom so slowly growing batches do not
+    // remap on every call
+    size = align_up(size + size / 4);
+    LOG_IF(FATAL, ftruncate(segment.fd, size) != 0)
+        << "Failed to resize shared memory " << segment.name;
+  }
+  if (size == 0) {
+    return;
+  }
+  void* data =
+      mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, segment.fd, 0);
+  LOG_IF(FATAL, data == MAP_FAILED) << "Failed to map shared memory "
+                                    << segment.name;
+  segment.data = (u8*)data;
+  segment.size = size;
+}
+
+void PythonKernelProcess::unmap_segment(Segment& segment) {
+  if (segment.data != nullptr) {
+    munmap(segment.data, segment.size);
+    segment.data = nullptr;
+  }
+  segment.size = 0;
+}
+
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include "scanner/api/kernel.h"
+#include "scanner/api/frame.h"
+
+#include <sys/types.h>
+#include <string>
+
+namespace scanner {
+
+//! Runs a Python kernel in a child interpreter so kernel instances do not
+//! contend for the GIL of the worker process. Rows are exchanged through two
+//! shared memory segments, one written by each side, while a pipe carries
+//! their layout (see scannerpy/kernel_process.py for the other end).
+class PythonKernelProcess {
+ public:
+  PythonKernelProcess(const std::string& python_executable,
+                      const std::string& kernel_str, const std::string& args,
+                      const std::string& pickled_config);
+
+  ~PythonKernelProcess();
+
+  //! Executes every row of the batch in the child and inserts its outputs.
+  //! frame_outputs tells for each output column whether it holds frames.
+  void execute(const BatchedColumns& input_columns,
+               const std::vector<bool>& frame_inputs,
+               const std::vector<bool>& frame_outputs, DeviceHandle device,
+               BatchedColumns& output_columns);
+
+ private:
+  struct Segment {
+    std::string name;
+    int fd = -1;
+    u8* data = nullptr;
+    size_t size = 0;
+  };
+
+  void write_all(const void* data, size_t size);
+  void read_all(void* data, size_t size);
+  void write_string(const std::string& str);
+  void map_segment(Segment& segment, size_t size, bool resize);
+  void unmap_segment(Segment& segment);
+
+  pid_t pid_ = -1;
+  int to_child_ = -1;
+  int from_child_ = -1;
+  Segment input_;
+  Segment output_;
+};
+
+}
@@ -0,0 +1,302 @@
+/* Copyright 2017 Carnegie Mellon University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "scanner/engine/range_reader.h"
+#include "scanner/util/memory.h"
+#include "scanner/util/storehouse.h"
+
+#include <algorithm>
+#include <cstring>
+#include <future>
+
+namespace scanner {
+namespace internal {
+namespace {
+
+// A single read covering ranges [first_range, end_range) of the input
+struct Request {
+  u64 offset;
+  u64 size;
+  size_t first_range;
+  size_t end_range;
+};
+
+std::vector<Request> plan_requests(
+    const std::vector<RangeReader::Range>& ranges, u64 gap_tolerance,
+    u64 max_request_size) {
+  std::vector<Request> requests;
+  for (size_t i = 0; i < ranges.size(); ++i) {
+    const RangeReader::Range& range = ranges[i];
+    if (!requests.empty()) {
+      Request& last = requests.back();
+      u64 last_end = last.offset + last.size;
+      u64 range_end = range.offset + range.size;
+      if (range.offset >= last.offset &&
+          range.offset <= last_end + gap_tolerance &&
+          std::max(last_end, range_end) - last.offset <= max_request_size) {
+        last.size = std::max(last_end, range_end) - last.offset;
+        last.end_range = i + 1;
+        continue;
+      }
+    }
+    requests.push_back(Request{range.offset, range.size, i, i + 1});
+  }
+  return requests;
+}
+}
+
+RangeReader::RangeReader(storehouse::StorageConfig* storage_config,
+                         BlockCache* block_cache, ReadFilePool* file_pool,
+                         i32 num_threads, u64 gap_tolerance)
+  : block_cache_(block_cache),
+    file_pool_(file_pool),
+    block_cache_hits_(0),
+    block_cache_misses_(0),
+    gap_tolerance_(gap_tolerance),
+    work_(num_threads * 2) {
+  for (i32 i = 0; i < num_threads; ++i) {
+    threads_.emplace_back([this, storage_config]() {
+      // Storage backends are not shared between threads
+      std::unique_ptr<storehouse::StorageBackend> storage(
+          storehouse::StorageBackend::make_from_config(storage_config));
+      while (true) {
+        Work work;
+        work_.pop(work);
+        if (!work) {
+          break;
+        }
+        work(storage.get());
+      }
+    });
+  }
+}
+
+RangeReader::~RangeReader() {
+  drop_prefetched();
+  for (size_t i = 0; i < threads_.size(); ++i) {
+    work_.push(Work());
+  }
+  for (std::thread& thread : threads_) {
+    thread.join();
+  }
+}
+
+u64 RangeReader::read(const std::string& path, std::vector<Range>& ranges) {
+  u64 total_size = 0;
+  // Serve what was prefetched and fetch the rest
+  std::vector<size_t> missing;
+  for (size_t i = 0; i < ranges.size(); ++i) {
+    Range& range = ranges[i];
+    auto it = prefetched_.find(std::make_tuple(path, range.offset, range.size));
+    if (it == prefetched_.end()) {
+      missing.push_back(i);
+      continue;
+    }
+    it->second.done.wait();
+    if (range.buffer == nullptr) {
+      range.buffer = it->second.buffer;
+    } else {
+      memcpy(range.buffer, it->second.buffer, range.size);
+      delete_buffer(CPU_DEVICE, it->second.buffer);
+    }
+    prefetched_bytes_ -= range.size;
+    total_size += range.size;
+    prefetched_.erase(it);
+  }
+  if (missing.empty()) {
+    return total_size;
+  }
+
+  std::vector<Range> missing_ranges;
+  missing_ranges.reserve(missing.size());
+  for (size_t i : missing) {
+    Range& range = ranges[i];
+    if (range.buffer == nullptr) {
+      range.buffer = new_buffer(CPU_DEVICE, range.size);
+    }
+    missing_ranges.push_back(range);
+  }
+  for (auto& done : issue(path, missing_ranges, total_size)) {
+    done.wait();
+  }
+  return total_size;
+}
+
+void RangeReader::prefetch(const std::string& path,
+                           const std::vector<Range>& ranges) {
+  std::vector<Range> new_ranges;
+  for (const Range& range : ranges) {
+    Key key = std::make_tuple(path, range.offset, range.size);
+    if (range.size == 0 || prefetched_.count(key) > 0) {
+      continue;
+    }
+    if (prefetched_bytes_ + range.size > MAX_PREFETCH_BYTES) {
+      break;
+    }
+    new_ranges.push_back(Range{range.offset, range.size,
+                               new_buffer(CPU_DEVICE, range.size)});
+    prefetched_bytes_ += range.size;
+  }
+  u64 total_size = 0;
+  std::vector<std::shared_future<void>> done =
+      issue(path, new_ranges, total_size);
+  for (size_t i = 0; i < new_ranges.size(); ++i) {
+    const Range& range = new_ranges[i];
+    prefetched_[std::make_tuple(path, range.offset, range.size)] =
+        Prefetched{range.buffer, done[i]};
+  }
+}
+
+void RangeReader::drop_prefetched() {
+  for (auto& kv : prefetched_) {
+    // The reader threads may still be writing into the buffer
+    kv.second.done.wait();
+    delete_buffer(CPU_DEVICE, kv.second.buffer);
+  }
+  prefetched_.clear();
+  prefetched_bytes_ = 0;
+}
+
+std::vector<std::shared_future<void>> RangeReader::issue(
+    const std::string& path, const std::vector<Range>& ranges,
+    u64& total_size) {
+  std::vector<Request> requests =
+      plan_requests(ranges, gap_tolerance_, MAX_REQUEST_SIZE);
+  // Reads may outlive the caller's ranges when prefetching
+  auto shared_ranges = std::make_shared<std::vector<Range>>(ranges);
+
+  std::vector<std::shared_future<void>> done(ranges.size());
+  for (const Request& request : requests) {
+    total_size += request.size;
+    auto promise = std::make_shared<std::promise<void>>();
+    std::shared_future<void> request_done = promise->get_future().share();
+    for (size_t i = request.first_range; i < request.end_range; ++i) {
+      done[i] = request_done;
+    }
+    if (request.size == 0) {
+      promise->set_value();
+      continue;
+    }
+    work_.push([this, path, shared_ranges, request,
+                promise](storehouse::StorageBackend* storage) {
+      const std::vector<Range>& ranges = *shared_ranges;
+      const Range& first = ranges[request.first_range];
+      if (request.end_range - request.first_range == 1) {
+        // Nothing was merged, so read straight into the destination
+        fetch(storage, path, request.offset, request.size, first.buffer);
+      } else {
+        std::vector<u8> data(request.size);
+        fetch(storage, path, request.offset, request.size, data.data());
+        for (size_t i = request.first_range; i < request.end_range; ++i) {
+          const Range& range = ranges[i];
+          memcpy(range.buffer, data.data() + (range.offset - request.offset),
+                 range.size);
+        }
+      }
+      promise->set_value();
+    });
+  }
+  return done;
+}
+
+void RangeReader::take_block_cache_counts(i64& hits, i64& misses) {
+  hits = block_cache_hits_.exchange(0);
+  misses = block_cache_misses_.exchange(0);
+}
+
+void RangeReader::fetch(storehouse::StorageBackend* storage,
+                        const std::string& path, u64 offset, u64 size,
+                        u8* dest) {
+  if (intermediates_ != nullptr &&
+      intermediates_->read(path, offset, size, dest)) {
+    return;
+  }
+  std::unique_ptr<storehouse::RandomReadFile> own_file;
+  ReadFilePool::Handle pooled_file;
+  storehouse::RandomReadFile* file = nullptr;
+  auto open_file = [&]() {
+    if (file != nullptr) {
+      return;
+    }
+    if (file_pool_ != nullptr) {
+      pooled_file = file_pool_->acquire(path);
+      file = pooled_file.get();
+    } else {
+      BACKOFF_FAIL(
+          storehouse::make_unique_random_read_file(storage, path, own_file));
+      file = own_file.get();
+    }
+  };
+  if (block_cache_ == nullptr) {
+    open_file();
+    u64 pos = offset;
+    s_read(file, dest, size, pos);
+    return;
+  }
+
+  // The last block of a file is short, so its size has to be known
+  u64 file_size;
+  if (!block_cache_->file_size(path, file_size)) {
+    open_file();
+    BACKOFF_FAIL(file->get_size(file_size));
+    block_cache_->put_file_size(path, file_size);
+  }
+  u64 block_size = block_cache_->block_size();
+  u64 end = offset + size;
+  u64 first_block = offset / block_size;
+  u64 end_block = (end + block_size - 1) / block_size;
+
+  // Copies the part of a block that overlaps the requested bytes
+  auto copy_out = [&](u64 block_index, const std::vector<u8>& block) {
+    u64 block_start = block_index * block_size;
+    u64 copy_start = std::max(offset, block_start);
+    u64 copy_end = std::min(end, block_start + block.size());
+    memcpy(dest + (copy_start - offset),
+           block.data() + (copy_start - block_start), copy_end - copy_start);
+  };
+
+  u64 block_index = first_block;
+  while (block_index < end_block) {
+    BlockCache::Block block = block_cache_->get(path, block_index);
+    if (block) {
+      block_cache_hits_++;
+      copy_out(block_index, *block);
+      block_index++;
+      continue;
+    }
+    // Read the whole run of missing blocks in one request
+    u64 run_end = block_index + 1;
+    while (run_end < end_block && !block_cache_->get(path, run_end)) {
+      run_end++;
+    }
+    u64 run_start_byte = block_index * block_size;
+    u64 run_end_byte = std::min(run_end * block_size, file_size);
+    std::vector<u8> data(run_end_byte - run_start_byte);
+    open_file();
+    u64 pos = run_start_byte;
+    s_read(file, data.data(), data.size(), pos);
+    for (; block_index < run_end; ++block_index) {
+      u64 block_start = block_index * block_size - run_start_byte;
+      u64 block_end = std::min(block_start + block_size, (u64)data.size());
+      auto new_block = std::make_shared<std::vector<u8>>(
+          data.begin() + block_start, data.begin() + block_end);
+      block_cache_misses_++;
+      copy_out(block_index, *new_block);
+      block_cache_->put(path, block_index, std::move(new_block));
+    }
+  }
+}
+}
+}
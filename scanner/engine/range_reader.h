@@ -0,0 +1,133 @@
+/* Copyright 2017 Carnegie Mellon University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include "scanner/engine/block_cache.h"
+#include "scanner/engine/intermediate_store.h"
+#include "scanner/engine/read_file_pool.h"
+#include "scanner/util/common.h"
+#include "scanner/util/queue.h"
+
+#include "storehouse/storage_backend.h"
+
+#include <atomic>
+#include <functional>
+#include <future>
+#include <map>
+#include <memory>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <vector>
+
+namespace scanner {
+namespace internal {
+
+// Reads many byte ranges of one file at a time. Ranges that lie within a gap
+// tolerance of each other are merged into a single request, trading a few
+// wasted bytes for fewer round trips, and the merged requests are issued
+// concurrently from a small set of reader threads. Reads of scattered
+// elements from cloud storage are bound by request latency rather than
+// bandwidth, so both help.
+//
+// Ranges can also be prefetched ahead of the read that needs them, e.g. for
+// the next task while the current one is being processed. A later read of
+// the same range of the same file is then served from the prefetched bytes.
+//
+// Given a BlockCache, requests are fetched block by block through it, and
+// only the blocks it is missing are read from storage. Given a ReadFilePool,
+// files are read through its pooled handles instead of being opened for
+// every request.
+class RangeReader {
+ public:
+  struct Range {
+    u64 offset;
+    u64 size;
+    //! Must hold size bytes. If nullptr, read allocates a CPU buffer with
+    //! new_buffer and stores it here for the caller to delete.
+    u8* buffer;
+  };
+
+  RangeReader(storehouse::StorageConfig* storage_config,
+              BlockCache* block_cache = nullptr,
+              ReadFilePool* file_pool = nullptr,
+              i32 num_threads = DEFAULT_NUM_THREADS,
+              u64 gap_tolerance = DEFAULT_GAP_TOLERANCE);
+
+  ~RangeReader();
+
+  //! Fills the buffer of every range with the bytes of the file at path and
+  //! returns the number of bytes fetched, including merged gaps. Ranges
+  //! should be sorted by offset for merging to take effect.
+  u64 read(const std::string& path, std::vector<Range>& ranges);
+
+  //! Starts fetching the ranges (buffers are ignored) without waiting for
+  //! them. Ranges that would take the prefetched bytes past the budget are
+  //! skipped.
+  void prefetch(const std::string& path, const std::vector<Range>& ranges);
+
+  //! Discards prefetched ranges that no read has used
+  void drop_prefetched();
+
+  //! Returns the block cache hits and misses since the last call
+  void take_block_cache_counts(i64& hits, i64& misses);
+
+  //! Files of ephemeral tables are then read from the store, which holds
+  //! them in memory or fetches them from the worker that wrote them
+  void set_intermediate_store(IntermediateStore* intermediates) {
+    intermediates_ = intermediates;
+  }
+
+  static const i32 DEFAULT_NUM_THREADS = 4;
+  static const u64 DEFAULT_GAP_TOLERANCE = 1024 * 1024;
+  // Merging stops here so that long runs of ranges still spread over the
+  // reader threads
+  static const u64 MAX_REQUEST_SIZE = 32 * 1024 * 1024;
+  static const u64 MAX_PREFETCH_BYTES = 256 * 1024 * 1024;
+
+ private:
+  using Work = std::function<void(storehouse::StorageBackend*)>;
+  using Key = std::tuple<std::string, u64, u64>;
+
+  struct Prefetched {
+    u8* buffer;
+    std::shared_future<void> done;
+  };
+
+  //! Issues reads filling every range's buffer and returns, for each range,
+  //! a future set once its bytes have arrived. Adds the bytes requested to
+  //! total_size.
+  std::vector<std::shared_future<void>> issue(const std::string& path,
+                                              const std::vector<Range>& ranges,
+                                              u64& total_size);
+
+  //! Reads size bytes at offset of the file into dest, on a reader thread
+  void fetch(storehouse::StorageBackend* storage, const std::string& path,
+             u64 offset, u64 size, u8* dest);
+
+  BlockCache* block_cache_;
+  ReadFilePool* file_pool_;
+  IntermediateStore* intermediates_ = nullptr;
+  std::atomic<i64> block_cache_hits_;
+  std::atomic<i64> block_cache_misses_;
+  const u64 gap_tolerance_;
+  Queue<Work> work_;
+  std::vector<std::thread> threads_;
+  std::map<Key, Prefetched> prefetched_;
+  u64 prefetched_bytes_ = 0;
+};
+}
+}
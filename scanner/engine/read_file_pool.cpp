@@ -0,0 +1,101 @@
+/* Copyright 2017 Carnegie Mellon University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "scanner/engine/read_file_pool.h"
+#include "scanner/util/storehouse.h"
+
+namespace scanner {
+namespace internal {
+
+ReadFilePool::Handle::Handle(ReadFilePool* pool, const std::string& path,
+                             std::unique_ptr<storehouse::RandomReadFile> file)
+  : pool_(pool), path_(path), file_(std::move(file)) {}
+
+ReadFilePool::Handle& ReadFilePool::Handle::operator=(Handle&& other) {
+  if (this != &other) {
+    if (file_) {
+      pool_->release(path_, std::move(file_));
+    }
+    pool_ = other.pool_;
+    path_ = std::move(other.path_);
+    file_ = std::move(other.file_);
+  }
+  return *this;
+}
+
+ReadFilePool::Handle::~Handle() {
+  if (file_) {
+    pool_->release(path_, std::move(file_));
+  }
+}
+
+ReadFilePool::ReadFilePool(storehouse::StorageConfig* storage_config,
+                           size_t max_idle_files)
+  : max_idle_files_(max_idle_files), next_backend_(0) {
+  for (i32 i = 0; i < NUM_BACKENDS; ++i) {
+    backends_.emplace_back(new Backend);
+    backends_.back()->storage.reset(
+        storehouse::StorageBackend::make_from_config(storage_config));
+  }
+}
+
+ReadFilePool::Handle ReadFilePool::acquire(const std::string& path) {
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    auto it = idle_.find(path);
+    if (it != idle_.end()) {
+      std::unique_ptr<storehouse::RandomReadFile> file =
+          std::move(it->second->file);
+      lru_.erase(it->second);
+      idle_.erase(it);
+      return Handle(this, path, std::move(file));
+    }
+  }
+  Backend& backend = *backends_[next_backend_++ % NUM_BACKENDS];
+  std::unique_ptr<storehouse::RandomReadFile> file;
+  {
+    std::unique_lock<std::mutex> lock(backend.mutex);
+    BACKOFF_FAIL(storehouse::make_unique_random_read_file(
+        backend.storage.get(), path, file));
+  }
+  return Handle(this, path, std::move(file));
+}
+
+void ReadFilePool::clear() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  idle_.clear();
+  lru_.clear();
+}
+
+void ReadFilePool::release(const std::string& path,
+                           std::unique_ptr<storehouse::RandomReadFile> file) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  lru_.push_front(Idle{path, std::move(file)});
+  idle_.insert(std::make_pair(path, lru_.begin()));
+  while (lru_.size() > max_idle_files_) {
+    auto oldest = std::prev(lru_.end());
+    auto range = idle_.equal_range(oldest->path);
+    for (auto it = range.first; it != range.second; ++it) {
+      if (it->second == oldest) {
+        idle_.erase(it);
+        break;
+      }
+    }
+    lru_.erase(oldest);
+  }
+}
+}
+}
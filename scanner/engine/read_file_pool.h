@@ -0,0 +1,100 @@
+/* Copyright 2017 Carnegie Mellon University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#pragma once
+
+#include "scanner/util/common.h"
+
+#include "storehouse/storage_backend.h"
+
+#include <atomic>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace scanner {
+namespace internal {
+
+// Open read handles of database files, shared by all load workers of a
+// process. On cloud storage opening a file costs a metadata round trip, so a
+// handle is returned to the pool once its holder is done with it and reused
+// by the next read of the same path. Each handle is held by one reader at a
+// time. Least recently used idle handles are closed once more than the limit
+// are kept. Paths are never reused for different contents (table ids are not
+// recycled), so a pooled handle never goes stale.
+class ReadFilePool {
+ public:
+  class Handle {
+   public:
+    Handle() = default;
+    Handle(Handle&& other) = default;
+    Handle& operator=(Handle&& other);
+    ~Handle();
+
+    storehouse::RandomReadFile* get() const { return file_.get(); }
+    storehouse::RandomReadFile* operator->() const { return file_.get(); }
+
+   private:
+    friend class ReadFilePool;
+
+    Handle(ReadFilePool* pool, const std::string& path,
+           std::unique_ptr<storehouse::RandomReadFile> file);
+
+    ReadFilePool* pool_ = nullptr;
+    std::string path_;
+    std::unique_ptr<storehouse::RandomReadFile> file_;
+  };
+
+  ReadFilePool(storehouse::StorageConfig* storage_config,
+               size_t max_idle_files = DEFAULT_MAX_IDLE_FILES);
+
+  //! Returns an idle handle of path, or opens a new one
+  Handle acquire(const std::string& path);
+
+  void clear();
+
+  static const size_t DEFAULT_MAX_IDLE_FILES = 1024;
+  // Files are opened through several backends so that concurrent opens are
+  // not serialized on one
+  static const i32 NUM_BACKENDS = 8;
+
+ private:
+  struct Idle {
+    std::string path;
+    std::unique_ptr<storehouse::RandomReadFile> file;
+  };
+
+  struct Backend {
+    std::unique_ptr<storehouse::StorageBackend> storage;
+    std::mutex mutex;
+  };
+
+  void release(const std::string& path,
+               std::unique_ptr<storehouse::RandomReadFile> file);
+
+  const size_t max_idle_files_;
+  std::vector<std::unique_ptr<Backend>> backends_;
+  std::atomic<u32> next_backend_;
+  std::mutex mutex_;
+  // Most recently released first
+  std::list<Idle> lru_;
+  std::multimap<std::string, std::list<Idle>::iterator> idle_;
+};
+}
+}
@@ -34,6 +34,37 @@ void move_if_different_address_space(Profiler& profiler,
                                      DeviceHandle current_handle,
                                      DeviceHandle target_handle,
                                      ElementList& column) {
+  MemcpyHandle handle = move_if_different_address_space_async(
+      profiler, current_handle, target_handle, column);
+  auto wait_start = now();
+  handle.wait();
+  profiler.add_interval("memcpy_wait", wait_start, now());
+}
+
+void move_if_different_address_space(Profiler& profiler,
+                                     DeviceHandle current_handle,
+                                     DeviceHandle target_handle,
+                                     BatchedColumns& columns) {
+  // Issue the transfers for every column before waiting on any of them so
+  // they can overlap
+  std::vector<MemcpyHandle> handles;
+  for (i32 i = 0; i < (i32)columns.size(); ++i) {
+    ElementList& column = columns[i];
+    handles.push_back(move_if_different_address_space_async(
+        profiler, current_handle, target_handle, column));
+  }
+  auto wait_start = now();
+  for (MemcpyHandle& handle : handles) {
+    handle.wait();
+  }
+  profiler.add_interval("memcpy_wait", wait_start, now());
+}
+
+MemcpyHandle move_if_different_address_space_async(Profiler& profiler,
+                                                   DeviceHandle current_handle,
+                                                   DeviceHandle target_handle,
+                                                   ElementList& column) {
+  MemcpyHandle handle;
   if (!current_handle.is_same_address_space(target_handle) &&
       column.size() > 0) {
     bool is_frame = column[0].is_frame;
@@ -45,7 +76,7 @@ void move_if_different_address_space(Profiler& profiler,
       for (i32 b = 0; b < (i32)column.size(); ++b) {
         Frame* frame = column[b].as_frame();
         src_buffers.push_back(frame->data);
-        sizes.push_back(frame->size());
+        sizes.push_back(frame->span_size());
       }
     } else {
       for (i32 b = 0; b < (i32)column.size(); ++b) {
@@ -67,34 +98,26 @@ void move_if_different_address_space(Profiler& profiler,
     }
 
     auto memcpy_start = now();
-    memcpy_vec(dest_buffers, target_handle, src_buffers, current_handle, sizes);
+    handle = memcpy_vec_async(dest_buffers, target_handle, src_buffers,
+                              current_handle, sizes);
     profiler.add_interval("memcpy", memcpy_start, now());
 
-    auto delete_start = now();
+    // The sources are still being read by the copy, so they are released
+    // when the handle completes
     if (is_frame) {
       for (i32 b = 0; b < (i32)column.size(); ++b) {
         Frame* frame = column[b].as_frame();
-        delete_buffer(current_handle, frame->data);
+        handle.defer_delete(current_handle, frame->data);
         frame->data = dest_buffers[b];
       }
     } else {
       for (i32 b = 0; b < (i32)column.size(); ++b) {
-        delete_buffer(current_handle, column[b].buffer);
+        handle.defer_delete(current_handle, column[b].buffer);
         column[b].buffer = dest_buffers[b];
       }
     }
   }
-}
-
-void move_if_different_address_space(Profiler& profiler,
-                                     DeviceHandle current_handle,
-                                     DeviceHandle target_handle,
-                                     BatchedColumns& columns) {
-  for (i32 i = 0; i < (i32)columns.size(); ++i) {
-    ElementList& column = columns[i];
-    move_if_different_address_space(profiler, current_handle, target_handle,
-                                    column);
-  }
+  return handle;
 }
 
 ElementList copy_elements(Profiler& profiler, DeviceHandle current_handle,
@@ -108,7 +131,7 @@ ElementList copy_elements(Profiler& profiler, DeviceHandle current_handle,
     for (i32 b = 0; b < (i32)column.size(); ++b) {
       Frame* frame = column[b].as_frame();
       src_buffers.push_back(frame->data);
-      sizes.push_back(frame->size());
+      sizes.push_back(frame->span_size());
     }
   } else {
     for (i32 b = 0; b < (i32)column.size(); ++b) {
@@ -136,8 +159,9 @@ ElementList copy_elements(Profiler& profiler, DeviceHandle current_handle,
   ElementList output_list;
   if (is_frame) {
     for (i32 b = 0; b < (i32)column.size(); ++b) {
+      const Frame* src = column[b].as_frame();
       Frame* frame =
-          new Frame(column[b].as_frame()->as_frame_info(), dest_buffers[b]);
+          new Frame(src->as_frame_info(), dest_buffers[b], src->row_stride);
       insert_frame(output_list, frame);
     }
   } else {
@@ -152,6 +176,33 @@ ElementList copy_or_ref_elements(Profiler& profiler,
                                  DeviceHandle current_handle,
                                  DeviceHandle target_handle,
                                  ElementList& column) {
+  MemcpyHandle handle;
+  ElementList output_list = copy_or_ref_elements_async(
+      profiler, current_handle, target_handle, column, handle);
+  auto wait_start = now();
+  handle.wait();
+  profiler.add_interval("memcpy_wait", wait_start, now());
+  return output_list;
+}
+
+ElementList copy_or_ref_elements_async(Profiler& profiler,
+                                       DeviceHandle current_handle,
+                                       DeviceHandle target_handle,
+                                       ElementList& column,
+                                       MemcpyHandle& handle) {
+  // Consumers in the same address space share the buffers copy-on-write:
+  // each takes a reference, and an op updating its input in place only gets
+  // to write into it when no other reference is left (see Element::writable)
+  if (current_handle.is_same_address_space(target_handle)) {
+    ElementList output_list;
+    output_list.reserve(column.size());
+    for (const Element& element : column) {
+      output_list.push_back(add_element_ref(current_handle, element));
+    }
+    profiler.increment("shared_elements", column.size());
+    return output_list;
+  }
+
   bool is_frame = column[0].is_frame;
 
   std::vector<u8*> src_buffers;
@@ -160,7 +211,7 @@ ElementList copy_or_ref_elements(Profiler& profiler,
     for (i32 b = 0; b < (i32)column.size(); ++b) {
       Frame* frame = column[b].as_frame();
       src_buffers.push_back(frame->data);
-      sizes.push_back(frame->size());
+      sizes.push_back(frame->span_size());
     }
   } else {
     for (i32 b = 0; b < (i32)column.size(); ++b) {
@@ -176,15 +227,16 @@ ElementList copy_or_ref_elements(Profiler& profiler,
 
   auto memcpy_start = now();
   std::vector<u8*> dest_buffers;
-  copy_or_ref_buffers(dest_buffers, target_handle, src_buffers, current_handle,
-                      sizes);
+  handle = copy_or_ref_buffers_async(dest_buffers, target_handle, src_buffers,
+                                     current_handle, sizes);
   profiler.add_interval("memcpy", memcpy_start, now());
 
   ElementList output_list;
   if (is_frame) {
     for (i32 b = 0; b < (i32)column.size(); ++b) {
+      const Frame* src = column[b].as_frame();
       Frame* frame =
-          new Frame(column[b].as_frame()->as_frame_info(), dest_buffers[b]);
+          new Frame(src->as_frame_info(), dest_buffers[b], src->row_stride);
       insert_frame(output_list, frame);
     }
   } else {
@@ -22,6 +22,7 @@
 #include "scanner/engine/metadata.h"
 #include "scanner/engine/op_registry.h"
 #include "scanner/engine/rpc.grpc.pb.h"
+#include "scanner/util/memory.h"
 #include "scanner/util/queue.h"
 
 #include "storehouse/storage_backend.h"
@@ -32,6 +33,9 @@
 #include <grpc++/server_builder.h>
 
 #include <dlfcn.h>
+#include <map>
+#include <mutex>
+#include <set>
 #include <string>
 #include <thread>
 
@@ -41,6 +45,18 @@ namespace internal {
 ///////////////////////////////////////////////////////////////////////////////
 /// Work structs - structs used to exchange data between workers during
 ///   execution of the run command.
+// Elements of an item that the pre-evaluate worker reads from a local file
+// itself, straight into the memory of its device
+struct DirectRead {
+  std::string path;
+  // Bytes [offset, offset + size) of the file hold the rows
+  u64 offset;
+  u64 size;
+  // Start of each row from offset, and its size
+  std::vector<u64> row_offsets;
+  std::vector<u64> row_sizes;
+};
+
 struct EvalWorkEntry {
   i64 table_id;
   i64 job_index;
@@ -60,6 +76,9 @@ struct EvalWorkEntry {
   // For save and pre worker
   std::vector<FrameInfo> frame_sizes;
   std::vector<bool> compressed;
+  // Per column, reads whose elements are appended to the column when the
+  // pre-evaluate worker receives the entry. Empty if it has none.
+  std::vector<std::vector<DirectRead>> direct_reads;
 };
 
 struct TaskStream {
@@ -67,6 +86,89 @@ struct TaskStream {
   std::vector<i64> valid_input_rows;
   std::vector<i64> compute_input_rows;
   std::vector<i64> valid_output_rows;
+  // Set for unbounded state ops that continue from the state the previous
+  // task of the job handed off, which is initial_state
+  bool resume_state = false;
+  std::vector<u8> initial_state;
+};
+
+//! Kernel states evaluate workers saved at the end of tasks, kept until the
+//! worker reports the task to the master
+class KernelStateStore {
+ public:
+  void add(i64 job_idx, i64 task_idx, const proto::KernelState& state) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    states_[std::make_tuple(job_idx, task_idx)].push_back(state);
+  }
+
+  std::vector<proto::KernelState> take(i64 job_idx, i64 task_idx) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::vector<proto::KernelState> states;
+    auto it = states_.find(std::make_tuple(job_idx, task_idx));
+    if (it != states_.end()) {
+      states.swap(it->second);
+      states_.erase(it);
+    }
+    return states;
+  }
+
+ private:
+  std::mutex mutex_;
+  std::map<std::tuple<i64, i64>, std::vector<proto::KernelState>> states_;
+};
+
+//! Tasks the master cancelled on this worker because a speculative copy of
+//! them finished elsewhere first. Shared by the threads of the pipeline so
+//! that each can drop what it still has of them.
+class TaskSet {
+ public:
+  void add(i64 job_idx, i64 task_idx) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    tasks_.insert(std::make_tuple(job_idx, task_idx));
+  }
+
+  bool contains(i64 job_idx, i64 task_idx) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return tasks_.count(std::make_tuple(job_idx, task_idx)) > 0;
+  }
+
+ private:
+  mutable std::mutex mutex_;
+  std::set<std::tuple<i64, i64>> tasks_;
+};
+
+//! Files saved to attempt specific paths by the tasks of a speculative job,
+//! each with the path it takes once the master picks this worker's attempt.
+//! Filled by the save workers and taken by the NewJob loop, which moves the
+//! files of winning attempts into place and deletes those of losing ones.
+class StagedFiles {
+ public:
+  using Files = std::vector<std::tuple<std::string, std::string>>;
+
+  //! Path a file of the task is written to by the attempt of a node
+  static std::string staged_path(const std::string& path, i32 node_id) {
+    return path + ".attempt" + std::to_string(node_id);
+  }
+
+  void add(i64 job_idx, i64 task_idx, Files files) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    files_[std::make_tuple(job_idx, task_idx)] = std::move(files);
+  }
+
+  Files take(i64 job_idx, i64 task_idx) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    Files files;
+    auto it = files_.find(std::make_tuple(job_idx, task_idx));
+    if (it != files_.end()) {
+      files = std::move(it->second);
+      files_.erase(it);
+    }
+    return files;
+  }
+
+ private:
+  std::mutex mutex_;
+  std::map<std::tuple<i64, i64>, Files> files_;
 };
 
 using LoadInputQueue =
@@ -87,6 +189,11 @@ struct DatabaseParameters {
   i32 num_load_workers;
   i32 num_save_workers;
   std::vector<i32> gpu_ids;
+  bool partition_cores;
+  i32 num_io_cores;
+  std::string disk_cache_path;
+  i64 disk_cache_bytes;
+  bool disk_cache_lfu;
 };
 
 class MasterImpl;
@@ -109,12 +216,31 @@ void move_if_different_address_space(Profiler& profiler,
                                      DeviceHandle target_handle,
                                      BatchedColumns& columns);
 
+// Starts moving the column and returns without waiting for the transfer. The
+// column points at the new buffers immediately, but they must not be read
+// until the returned handle has been waited on. The old buffers are freed
+// when the transfer completes.
+MemcpyHandle move_if_different_address_space_async(Profiler& profiler,
+                                                   DeviceHandle current_handle,
+                                                   DeviceHandle target_handle,
+                                                   ElementList& column);
+
 ElementList copy_elements(Profiler& profiler, DeviceHandle current_handle,
                           DeviceHandle target_handle, ElementList& column);
 
+// Elements already in the target address space are shared by reference,
+// others are copied to it
 ElementList copy_or_ref_elements(Profiler& profiler,
                                  DeviceHandle current_handle,
                                  DeviceHandle target_handle,
                                  ElementList& column);
+
+// Like copy_or_ref_elements, but the returned elements must not be read until
+// handle has been waited on
+ElementList copy_or_ref_elements_async(Profiler& profiler,
+                                       DeviceHandle current_handle,
+                                       DeviceHandle target_handle,
+                                       ElementList& column,
+                                       MemcpyHandle& handle);
 }
 }
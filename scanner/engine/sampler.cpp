@@ -17,8 +17,11 @@
 #include "scanner/metadata.pb.h"
 
 #include <cmath>
+#include <cstdlib>
 #include <vector>
 #include <algorithm>
+#include <limits>
+#include <tuple>
 
 namespace scanner {
 namespace internal {
@@ -28,6 +31,300 @@ namespace {
 using DomainSamplerFactory =
     std::function<DomainSampler*(const std::vector<u8>&)>;
 
+// Ordered list of gathered rows stored as runs of consecutive rows. Explicit
+// rows are folded into runs as they are added, so a gather over a few long
+// intervals costs O(runs) memory and O(log runs) per lookup no matter how
+// many rows it covers.
+class GatherRuns {
+ public:
+  template <typename T>
+  Result init(const T& args) {
+    Result valid;
+    valid.set_success(true);
+    if (args.range_starts_size() != args.range_ends_size()) {
+      RESULT_ERROR(&valid,
+                   "Gather args have %d range starts but %d range ends",
+                   args.range_starts_size(), args.range_ends_size());
+      return valid;
+    }
+    for (i64 r : args.rows()) {
+      add(r, r + 1);
+    }
+    for (i32 i = 0; i < args.range_starts_size(); ++i) {
+      i64 start = args.range_starts(i);
+      i64 end = args.range_ends(i);
+      if (start < 0 || end < start) {
+        RESULT_ERROR(&valid, "Gather range [%ld, %ld) is invalid", start,
+                     end);
+        return valid;
+      }
+      add(start, end);
+    }
+    finish();
+    return valid;
+  }
+
+  //! Appends rows [start, end) to the gather list
+  void add(i64 start, i64 end) {
+    if (start == end) {
+      return;
+    }
+    if (!ends_.empty() && ends_.back() == start) {
+      ends_.back() = end;
+    } else {
+      starts_.push_back(start);
+      ends_.push_back(end);
+      offsets_.push_back(size_);
+    }
+    size_ += end - start;
+  }
+
+  //! Must be called once after the last add and before any lookup
+  void finish() {
+    offsets_.push_back(size_);
+    sorted_runs_.resize(starts_.size());
+    for (size_t i = 0; i < sorted_runs_.size(); ++i) {
+      sorted_runs_[i] = i;
+    }
+    std::stable_sort(sorted_runs_.begin(), sorted_runs_.end(),
+                     [this](size_t a, size_t b) {
+                       return starts_[a] < starts_[b];
+                     });
+  }
+
+  i64 size() const { return size_; }
+
+  //! Row at position idx of the gather list
+  i64 at(i64 idx) const {
+    size_t run = std::upper_bound(offsets_.begin(), offsets_.end(), idx) -
+                 offsets_.begin() - 1;
+    return starts_[run] + (idx - offsets_[run]);
+  }
+
+  //! Position of row in the gather list, or -1 if it is not gathered. When
+  //! runs overlap, the position in the run starting latest is returned.
+  i64 position_of(i64 row) const {
+    auto it = std::upper_bound(
+        sorted_runs_.begin(), sorted_runs_.end(), row,
+        [this](i64 r, size_t run) { return r < starts_[run]; });
+    if (it == sorted_runs_.begin()) {
+      return -1;
+    }
+    size_t run = *(it - 1);
+    if (row >= ends_[run]) {
+      return -1;
+    }
+    return offsets_[run] + (row - starts_[run]);
+  }
+
+  //! Length of the longest prefix of the gather list below row
+  i64 prefix_below(i64 row) const {
+    for (size_t i = 0; i < starts_.size(); ++i) {
+      if (ends_[i] > row) {
+        return offsets_[i] + std::max(row - starts_[i], (i64)0);
+      }
+    }
+    return size_;
+  }
+
+  void append_rows(std::vector<i64>& rows) const {
+    rows.reserve(rows.size() + size_);
+    for (size_t i = 0; i < starts_.size(); ++i) {
+      for (i64 r = starts_[i]; r < ends_[i]; ++r) {
+        rows.push_back(r);
+      }
+    }
+  }
+
+ private:
+  std::vector<i64> starts_;
+  std::vector<i64> ends_;
+  // Position of the first row of each run, plus the total size at the end
+  std::vector<i64> offsets_;
+  // Runs ordered by start row, for lookups by row
+  std::vector<size_t> sorted_runs_;
+  i64 size_ = 0;
+};
+
+// Maps between rows and presentation times described by a proto::FrameClock
+class FrameClock {
+ public:
+  Result init(const proto::FrameClock& clock) {
+    Result valid;
+    valid.set_success(true);
+    num_rows_ = clock.num_rows();
+    frame_duration_ = clock.frame_duration();
+    if (frame_duration_ <= 0) {
+      RESULT_ERROR(&valid, "Frame duration (%f) must be greater than 0",
+                   frame_duration_);
+      return valid;
+    }
+    if (clock.keyframe_positions_size() != clock.keyframe_times_size()) {
+      RESULT_ERROR(&valid,
+                   "Frame clock has %d keyframe positions but %d times",
+                   clock.keyframe_positions_size(),
+                   clock.keyframe_times_size());
+      return valid;
+    }
+    positions_.assign(clock.keyframe_positions().begin(),
+                      clock.keyframe_positions().end());
+    times_.assign(clock.keyframe_times().begin(),
+                  clock.keyframe_times().end());
+    for (size_t i = 1; i < positions_.size(); ++i) {
+      if (positions_[i] <= positions_[i - 1] || times_[i] < times_[i - 1]) {
+        RESULT_ERROR(&valid,
+                     "Frame clock keyframes must increase (keyframe %lu)", i);
+        return valid;
+      }
+    }
+    if (positions_.empty() || positions_[0] != 0) {
+      positions_.insert(positions_.begin(), 0);
+      times_.insert(times_.begin(),
+                    times_.empty() ? 0 : times_[0] - positions_[1] *
+                                                         frame_duration_);
+    }
+    // Frames past the last keyframe keep the average rate of the video
+    tail_duration_ = frame_duration_;
+    if (positions_.size() > 1 && times_.back() > times_.front()) {
+      tail_duration_ = (times_.back() - times_.front()) /
+                       (positions_.back() - positions_.front());
+    }
+    return valid;
+  }
+
+  i64 num_rows() const { return num_rows_; }
+
+  //! Time at which row is presented
+  f64 time_at(i64 row) const {
+    size_t k = std::upper_bound(positions_.begin(), positions_.end(), row) -
+               positions_.begin() - 1;
+    return times_[k] + (row - positions_[k]) * duration_after(k);
+  }
+
+  //! First row presented at or after time, or num_rows if there is none
+  i64 row_at(f64 time) const {
+    size_t k = std::upper_bound(times_.begin(), times_.end(), time) -
+               times_.begin();
+    k = k == 0 ? 0 : k - 1;
+    f64 duration = duration_after(k);
+    i64 row = positions_[k];
+    if (time > times_[k] && duration > 0) {
+      // Tolerate rounding in times computed from frame counts
+      row += (i64)std::ceil((time - times_[k]) / duration - 1e-6);
+    }
+    if (k + 1 < positions_.size()) {
+      row = std::min(row, positions_[k + 1]);
+    }
+    return std::max(std::min(row, num_rows_), (i64)0);
+  }
+
+ private:
+  // Seconds per frame of the GOP starting at keyframe k
+  f64 duration_after(size_t k) const {
+    if (k + 1 < times_.size()) {
+      return (times_[k + 1] - times_[k]) /
+             (positions_[k + 1] - positions_[k]);
+    }
+    return tail_duration_;
+  }
+
+  std::vector<i64> positions_;
+  std::vector<f64> times_;
+  i64 num_rows_ = 0;
+  f64 frame_duration_ = 0;
+  f64 tail_duration_ = 0;
+};
+
+// Gathers the rows picked by a TimeSamplerArgs
+Result select_time_rows(const proto::TimeSamplerArgs& args, FrameClock& clock,
+                        GatherRuns& runs) {
+  Result valid = clock.init(args.clock());
+  if (!valid.success()) {
+    return valid;
+  }
+  if (args.stride() < 0) {
+    RESULT_ERROR(&valid, "Time stride (%f) must not be negative",
+                 args.stride());
+    return valid;
+  }
+  if (args.starts_size() != args.ends_size()) {
+    RESULT_ERROR(&valid, "Time sampler has %d range starts but %d ends",
+                 args.starts_size(), args.ends_size());
+    return valid;
+  }
+  std::vector<std::tuple<f64, f64>> ranges;
+  for (i32 i = 0; i < args.starts_size(); ++i) {
+    ranges.emplace_back(args.starts(i), args.ends(i));
+  }
+  if (ranges.empty()) {
+    ranges.emplace_back(0, std::numeric_limits<f64>::infinity());
+  }
+  for (auto& range : ranges) {
+    f64 start = std::get<0>(range);
+    f64 end = std::get<1>(range);
+    i64 end_row = std::isinf(end) ? clock.num_rows() : clock.row_at(end);
+    if (args.stride() == 0) {
+      runs.add(clock.row_at(start), std::max(clock.row_at(start), end_row));
+      continue;
+    }
+    // Times are computed from the sample index so strides do not drift
+    i64 last = -1;
+    for (i64 k = 0;; ++k) {
+      i64 row = clock.row_at(start + k * args.stride());
+      if (row >= end_row) {
+        break;
+      }
+      // Strides shorter than a frame land on the same row more than once
+      if (row > last) {
+        runs.add(row, row + 1);
+        last = row;
+      }
+    }
+  }
+  runs.finish();
+  return valid;
+}
+
+// Picks the rows worth processing from per-row change scores. Scores are
+// accumulated from the last picked row, so slow drift is picked up as well
+// as sudden changes, and a row is picked once the accumulated change reaches
+// the threshold. The first row is always picked.
+template <typename T>
+Result select_adaptive_rows(const T& args, GatherRuns& runs) {
+  Result valid;
+  valid.set_success(true);
+  if (args.min_gap() < 1) {
+    RESULT_ERROR(&valid, "Adaptive sampling min gap (%ld) must be at least 1",
+                 args.min_gap());
+    return valid;
+  }
+  if (args.max_gap() != 0 && args.max_gap() < args.min_gap()) {
+    RESULT_ERROR(&valid,
+                 "Adaptive sampling max gap (%ld) must not be less than the "
+                 "min gap (%ld)",
+                 args.max_gap(), args.min_gap());
+    return valid;
+  }
+  i64 num_rows = args.scores_size();
+  i64 last = 0;
+  f64 change = 0;
+  if (num_rows > 0) {
+    runs.add(0, 1);
+  }
+  for (i64 r = 1; r < num_rows; ++r) {
+    change += args.scores(r);
+    i64 gap = r - last;
+    if ((gap >= args.min_gap() && change >= args.threshold()) ||
+        (args.max_gap() > 0 && gap >= args.max_gap())) {
+      runs.add(r, r + 1);
+      last = r;
+      change = 0;
+    }
+  }
+  runs.finish();
+  return valid;
+}
+
 // 1 to 1 mapping
 class DefaultDomainSampler : public DomainSampler {
  public:
@@ -261,20 +558,11 @@ class StridedRangesDomainSampler : public DomainSampler {
   std::vector<i64> offset_at_range_starts_;
 };
 
-class GatherDomainSampler : public DomainSampler {
+// Samples an ordered list of rows held as GatherRuns
+class RunsDomainSampler : public DomainSampler {
  public:
-  GatherDomainSampler(const std::vector<u8>& args)
-    : DomainSampler("Gather") {
+  RunsDomainSampler(const std::string& name) : DomainSampler(name) {
     valid_.set_success(true);
-    if (!args_.ParseFromArray(args.data(), args.size())) {
-      RESULT_ERROR(&valid_,
-                   "Gather sampler provided with invalid protobuf args");
-      return;
-    }
-    i64 offset = 0;
-    for (i64 r : args_.rows()) {
-      gather_rows_[r] = offset++;
-    }
   }
 
   Result validate() override { return valid_; }
@@ -284,28 +572,21 @@ class GatherDomainSampler : public DomainSampler {
     Result valid;
     valid.set_success(true);
     for (i64 in_row : upstream_rows) {
-      if (in_row >= args_.rows_size()) {
+      if (in_row < 0 || in_row >= runs_.size()) {
         RESULT_ERROR(&valid,
-                     "Gather sampler received out of bounds request for "
+                     "%s sampler received out of bounds request for "
                      "row %ld (max requestable row is %ld).",
-                     in_row,
-                     args_.rows_size());
+                     name_.c_str(), in_row, runs_.size());
         return valid;
       }
-      downstream_rows.push_back(args_.rows(in_row));
+      downstream_rows.push_back(runs_.at(in_row));
     }
     return valid;
   }
 
   Result get_num_downstream_rows(i64 num_upstream_rows,
                                  i64& num_downstream_rows) const {
-    num_downstream_rows = 0;
-    for (i64 r : args_.rows()) {
-      if (r >= num_upstream_rows) {
-        break;
-      }
-      num_downstream_rows++;
-    }
+    num_downstream_rows = runs_.prefix_below(num_upstream_rows);
     Result valid;
     valid.set_success(true);
     return valid;
@@ -315,9 +596,9 @@ class GatherDomainSampler : public DomainSampler {
       const std::vector<i64>& upstream_rows, std::vector<i64>& downstream_rows,
       std::vector<i64>& downstream_upstream_mapping) const {
     for (i64 i = 0; i < upstream_rows.size(); ++i) {
-      i64 r = upstream_rows[i];
-      if (gather_rows_.count(r) > 0) {
-        downstream_rows.push_back(gather_rows_.at(r));
+      i64 pos = runs_.position_of(upstream_rows[i]);
+      if (pos >= 0) {
+        downstream_rows.push_back(pos);
         downstream_upstream_mapping.push_back(i);
       }
     }
@@ -326,12 +607,64 @@ class GatherDomainSampler : public DomainSampler {
     return valid;
   }
 
- private:
+ protected:
   Result valid_;
+  GatherRuns runs_;
+};
+
+class GatherDomainSampler : public RunsDomainSampler {
+ public:
+  GatherDomainSampler(const std::vector<u8>& args)
+    : RunsDomainSampler("Gather") {
+    if (!args_.ParseFromArray(args.data(), args.size())) {
+      RESULT_ERROR(&valid_,
+                   "Gather sampler provided with invalid protobuf args");
+      return;
+    }
+    valid_ = runs_.init(args_);
+  }
+
+ private:
   proto::GatherSamplerArgs args_;
-  std::map<i64, i64> gather_rows_;
 };
 
+// Gathers the rows whose precomputed change scores (e.g. reduced
+// FrameDifference outputs) say something happened since the last gathered
+// row
+class AdaptiveDomainSampler : public RunsDomainSampler {
+ public:
+  AdaptiveDomainSampler(const std::vector<u8>& args)
+    : RunsDomainSampler("Adaptive") {
+    if (!args_.ParseFromArray(args.data(), args.size())) {
+      RESULT_ERROR(&valid_,
+                   "Adaptive sampler provided with invalid protobuf args");
+      return;
+    }
+    valid_ = select_adaptive_rows(args_, runs_);
+  }
+
+ private:
+  proto::AdaptiveSamplerArgs args_;
+};
+
+// Samples rows by presentation time, so strides in seconds and time ranges
+// are resolved here instead of shipping a row list with the job
+class TimeDomainSampler : public RunsDomainSampler {
+ public:
+  TimeDomainSampler(const std::vector<u8>& args)
+    : RunsDomainSampler("Time") {
+    if (!args_.ParseFromArray(args.data(), args.size())) {
+      RESULT_ERROR(&valid_,
+                   "Time sampler provided with invalid protobuf args");
+      return;
+    }
+    valid_ = select_time_rows(args_, clock_, runs_);
+  }
+
+ private:
+  proto::TimeSamplerArgs args_;
+  FrameClock clock_;
+};
 
 class SpaceNullDomainSampler : public DomainSampler {
  public:
@@ -468,6 +801,8 @@ Result make_domain_sampler_instance(const std::string& sampler_type,
       {"Strided", make_domain_factory<StridedDomainSampler>()},
       {"StridedRanges", make_domain_factory<StridedRangesDomainSampler>()},
       {"Gather", make_domain_factory<GatherDomainSampler>()},
+      {"Adaptive", make_domain_factory<AdaptiveDomainSampler>()},
+      {"Time", make_domain_factory<TimeDomainSampler>()},
       {"SpaceNull", make_domain_factory<SpaceNullDomainSampler>()},
       {"SpaceRepeat", make_domain_factory<SpaceRepeatDomainSampler>()},
   };
@@ -580,6 +915,101 @@ class StridedPartitioner : public Partitioner {
   std::vector<i64> offset_at_group_;
 };
 
+// Cuts contiguous groups of roughly group_size rows, moving each boundary onto
+// the nearest keyframe within tolerance rows. A boundary that falls mid-GOP
+// makes both neighboring tasks decode from the preceding keyframe, so
+// aligning boundaries avoids that redundant decoding.
+class KeyframePartitioner : public Partitioner {
+ public:
+  KeyframePartitioner(const std::vector<u8>& args, i64 num_rows)
+    : Partitioner("Keyframe", num_rows) {
+    valid_.set_success(true);
+    if (!args_.ParseFromArray(args.data(), args.size())) {
+      RESULT_ERROR(&valid_,
+                   "Keyframe partitioner provided with invalid protobuf args");
+      return;
+    }
+    if (args_.group_size() <= 0) {
+      RESULT_ERROR(
+          &valid_,
+          "Keyframe partitioner group size (%ld) must be greater than 0",
+          args_.group_size());
+      return;
+    }
+    if (args_.tolerance() < 0) {
+      RESULT_ERROR(&valid_,
+                   "Keyframe partitioner tolerance (%ld) must not be negative",
+                   args_.tolerance());
+      return;
+    }
+    std::vector<i64> keyframes(args_.keyframes().begin(),
+                               args_.keyframes().end());
+    i64 tolerance = std::min(args_.tolerance(), args_.group_size() - 1);
+    i64 s = 0;
+    offset_at_group_.push_back(0);
+    while (s < num_rows_) {
+      i64 e = s + args_.group_size();
+      // Pick the keyframe closest to the nominal boundary, if any is close
+      // enough and still leaves a non-empty group
+      auto it = std::lower_bound(keyframes.begin(), keyframes.end(),
+                                 e - tolerance);
+      i64 best = -1;
+      for (; it != keyframes.end() && *it <= e + tolerance; ++it) {
+        if (*it > s && (best == -1 || std::abs(*it - e) < std::abs(best - e))) {
+          best = *it;
+        }
+      }
+      if (best != -1) {
+        e = best;
+      }
+      s = std::min(e, num_rows_);
+      offset_at_group_.push_back(s);
+    }
+    total_groups_ = offset_at_group_.size() - 1;
+  }
+
+  Result validate() override { return valid_; }
+
+  i64 total_rows() const override { return num_rows_; }
+
+  i64 total_groups() const override { return total_groups_; }
+
+  std::vector<i64> total_rows_per_group() const override {
+    std::vector<i64> rows;
+    for (i64 i = 0; i < total_groups_; ++i) {
+      rows.push_back(offset_at_group_[i + 1] - offset_at_group_[i]);
+    }
+    return rows;
+  }
+
+  PartitionGroup next_group() override {
+    assert(curr_group_idx_ < total_groups_);
+    return group_at(curr_group_idx_++);
+  }
+
+  void reset() override { curr_group_idx_ = 0; }
+
+  PartitionGroup group_at(i64 group_idx) override {
+    PartitionGroup group;
+    for (i64 i = offset_at_group_.at(group_idx);
+         i < offset_at_group_.at(group_idx + 1); ++i) {
+      group.rows.push_back(i);
+    }
+    return group;
+  }
+
+  i64 offset_at_group(i64 group_idx) const override {
+    return offset_at_group_.at(group_idx);
+  }
+
+ private:
+  Result valid_;
+  proto::KeyframePartitionerArgs args_;
+  i64 curr_group_idx_ = 0;
+  i64 total_groups_;
+  std::vector<i64> offset_at_group_;
+};
+
 class StridedRangePartitioner : public Partitioner {
  public:
   StridedRangePartitioner(const std::vector<u8>& args, i64 num_rows)
@@ -679,11 +1109,14 @@ class GatherPartitioner : public Partitioner {
                    "Gather sampler provided with invalid protobuf args");
       return;
     }
+    groups_.resize(args_.groups_size());
     for (i32 i = 0; i < args_.groups_size(); ++i) {
-      auto& s = args_.groups(i);
-      i64 rows = s.rows_size();
+      valid_ = groups_[i].init(args_.groups(i));
+      if (!valid_.success()) {
+        return;
+      }
       offset_at_group_.push_back(total_rows_);
-      total_rows_ += rows;
+      total_rows_ += groups_[i].size();
     }
     offset_at_group_.push_back(total_rows_);
     total_groups_ = args_.groups_size();
@@ -712,8 +1145,7 @@ class GatherPartitioner : public Partitioner {
 
   PartitionGroup group_at(i64 group_idx) override {
     PartitionGroup group;
-    auto& s = args_.groups(curr_group_idx_);
-    group.rows = std::vector<i64>(s.rows().begin(), s.rows().end());
+    groups_.at(group_idx).append_rows(group.rows);
     return group;
   }
 
@@ -724,12 +1156,177 @@ class GatherPartitioner : public Partitioner {
  private:
   Result valid_;
   proto::GatherPartitionerArgs args_;
+  std::vector<GatherRuns> groups_;
   i64 total_rows_ = 0;
   i64 total_groups_ = 0;
   std::vector<i64> offset_at_group_;
   i64 curr_group_idx_ = 0;
 };
 
+// Partitions the rows picked by adaptive sampling into groups of
+// group_size picked rows, so tasks carry even amounts of expensive work
+// instead of even spans of mostly static video
+class AdaptivePartitioner : public Partitioner {
+ public:
+  AdaptivePartitioner(const std::vector<u8>& args, i64 num_rows)
+    : Partitioner("Adaptive", num_rows) {
+    valid_.set_success(true);
+    if (!args_.ParseFromArray(args.data(), args.size())) {
+      RESULT_ERROR(&valid_,
+                   "Adaptive partitioner provided with invalid protobuf args");
+      return;
+    }
+    if (args_.group_size() <= 0) {
+      RESULT_ERROR(
+          &valid_,
+          "Adaptive partitioner group size (%ld) must be greater than 0",
+          args_.group_size());
+      return;
+    }
+    valid_ = select_adaptive_rows(args_, runs_);
+    total_groups_ =
+        (runs_.size() + args_.group_size() - 1) / args_.group_size();
+  }
+
+  Result validate() override { return valid_; }
+
+  i64 total_rows() const override { return runs_.size(); }
+
+  i64 total_groups() const override { return total_groups_; }
+
+  std::vector<i64> total_rows_per_group() const override {
+    std::vector<i64> rows;
+    for (i64 i = 0; i < total_groups_; ++i) {
+      rows.push_back(offset_at_group(i + 1) - offset_at_group(i));
+    }
+    return rows;
+  }
+
+  PartitionGroup next_group() override {
+    assert(curr_group_idx_ < total_groups_);
+    return group_at(curr_group_idx_++);
+  }
+
+  void reset() override { curr_group_idx_ = 0; }
+
+  PartitionGroup group_at(i64 group_idx) override {
+    PartitionGroup group;
+    i64 end = offset_at_group(group_idx + 1);
+    for (i64 i = offset_at_group(group_idx); i < end; ++i) {
+      group.rows.push_back(runs_.at(i));
+    }
+    return group;
+  }
+
+  i64 offset_at_group(i64 group_idx) const override {
+    return std::min(group_idx * args_.group_size(), runs_.size());
+  }
+
+ private:
+  Result valid_;
+  proto::AdaptivePartitionerArgs args_;
+  GatherRuns runs_;
+  i64 total_groups_ = 0;
+  i64 curr_group_idx_ = 0;
+};
+
+// Partitions rows picked by time into groups spanning about group_duration
+// seconds. Each group boundary is moved to the first keyframe at or after
+// it, so no two groups decode the same GOP.
+class TimePartitioner : public Partitioner {
+ public:
+  TimePartitioner(const std::vector<u8>& args, i64 num_rows)
+    : Partitioner("Time", num_rows) {
+    valid_.set_success(true);
+    if (!args_.ParseFromArray(args.data(), args.size())) {
+      RESULT_ERROR(&valid_,
+                   "Time partitioner provided with invalid protobuf args");
+      return;
+    }
+    if (args_.group_duration() <= 0) {
+      RESULT_ERROR(
+          &valid_,
+          "Time partitioner group duration (%f) must be greater than 0",
+          args_.group_duration());
+      return;
+    }
+    valid_ = select_time_rows(args_.sampling(), clock_, runs_);
+    if (!valid_.success()) {
+      return;
+    }
+    auto& clock = args_.sampling().clock();
+    std::vector<i64> keyframes(clock.keyframe_positions().begin(),
+                               clock.keyframe_positions().end());
+    std::vector<i64> rows;
+    runs_.append_rows(rows);
+
+    offset_at_group_.push_back(0);
+    i64 boundary = -1;
+    for (i64 i = 0; i < (i64)rows.size(); ++i) {
+      if (rows[i] < boundary) {
+        continue;
+      }
+      // Close the current group at the first row past its boundary
+      if (i > 0) {
+        offset_at_group_.push_back(i);
+      }
+      f64 end_time = clock_.time_at(rows[i]) + args_.group_duration();
+      boundary = clock_.row_at(end_time);
+      auto it = std::lower_bound(keyframes.begin(), keyframes.end(),
+                                 boundary);
+      boundary = it == keyframes.end() ? clock_.num_rows() : *it;
+      boundary = std::max(boundary, rows[i] + 1);
+    }
+    if (!rows.empty()) {
+      offset_at_group_.push_back(rows.size());
+    }
+    total_groups_ = offset_at_group_.size() - 1;
+  }
+
+  Result validate() override { return valid_; }
+
+  i64 total_rows() const override { return runs_.size(); }
+
+  i64 total_groups() const override { return total_groups_; }
+
+  std::vector<i64> total_rows_per_group() const override {
+    std::vector<i64> rows;
+    for (i64 i = 0; i < total_groups_; ++i) {
+      rows.push_back(offset_at_group_[i + 1] - offset_at_group_[i]);
+    }
+    return rows;
+  }
+
+  PartitionGroup next_group() override {
+    assert(curr_group_idx_ < total_groups_);
+    return group_at(curr_group_idx_++);
+  }
+
+  void reset() override { curr_group_idx_ = 0; }
+
+  PartitionGroup group_at(i64 group_idx) override {
+    PartitionGroup group;
+    for (i64 i = offset_at_group_.at(group_idx);
+         i < offset_at_group_.at(group_idx + 1); ++i) {
+      group.rows.push_back(runs_.at(i));
+    }
+    return group;
+  }
+
+  i64 offset_at_group(i64 group_idx) const override {
+    return offset_at_group_.at(group_idx);
+  }
+
+ private:
+  Result valid_;
+  proto::TimePartitionerArgs args_;
+  FrameClock clock_;
+  GatherRuns runs_;
+  i64 total_groups_ = 0;
+  std::vector<i64> offset_at_group_;
+  i64 curr_group_idx_ = 0;
+};
+
 template <typename T>
 PartitionerFactory make_factory() {
   return [](const std::vector<u8>& args, i64 num_rows) {
@@ -744,7 +1341,10 @@ Result make_partitioner_instance(const std::string& sampler_type,
   static std::map<std::string, PartitionerFactory> samplers = {
       {"Strided", make_factory<StridedPartitioner>()},
       {"StridedRange", make_factory<StridedRangePartitioner>()},
-      {"Gather", make_factory<GatherPartitioner>()}};
+      {"Keyframe", make_factory<KeyframePartitioner>()},
+      {"Gather", make_factory<GatherPartitioner>()},
+      {"Adaptive", make_factory<AdaptivePartitioner>()},
+      {"Time", make_factory<TimePartitioner>()}};
 
   Result result;
   result.set_success(true);
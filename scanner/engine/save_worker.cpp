@@ -16,7 +16,9 @@
 #include "scanner/engine/save_worker.h"
 
 #include "scanner/engine/metadata.h"
+#include "scanner/engine/packed_item.h"
 #include "scanner/util/common.h"
+#include "scanner/util/compression.h"
 #include "scanner/util/storehouse.h"
 #include "scanner/video/h264_byte_stream_index_creator.h"
 
@@ -24,6 +26,9 @@
 
 #include <glog/logging.h>
 
+#include <cstring>
+#include <future>
+
 using storehouse::StoreResult;
 using storehouse::WriteFile;
 using storehouse::RandomReadFile;
@@ -32,206 +37,508 @@ namespace scanner {
 namespace internal {
 
 SaveWorker::SaveWorker(const SaveWorkerArgs& args)
-    : node_id_(args.node_id), worker_id_(args.worker_id), profiler_(args.profiler) {
+    : node_id_(args.node_id),
+      worker_id_(args.worker_id),
+      profiler_(args.profiler),
+      storage_config_(args.storage_config),
+      write_buffer_size_(args.write_buffer_size > 0
+                             ? args.write_buffer_size
+                             : DEFAULT_WRITE_BUFFER_SIZE),
+      intermediates_(args.ephemeral ? args.intermediates : nullptr),
+      packed_(args.packed && intermediates_ == nullptr),
+      staged_files_(args.staged_files),
+      upload_work_(NUM_UPLOAD_THREADS * 4),
+      column_work_(NUM_COLUMN_THREADS * 4) {
   auto setup_start = now();
-  // Setup a distinct storage backend for each IO thread
-  storage_.reset(
-      storehouse::StorageBackend::make_from_config(args.storage_config));
+  for (auto& compression : args.column_compression) {
+    std::string codec;
+    i32 level = -1;
+    if (is_element_codec(compression.codec())) {
+      codec = compression.codec();
+      auto it = compression.options().find("level");
+      if (it != compression.options().end()) {
+        level = std::atoi(it->second.c_str());
+      }
+    }
+    column_codecs_.push_back(codec);
+    column_codec_levels_.push_back(level);
+  }
+  auto start_threads = [](Queue<std::function<void()>>& queue, i32 count,
+                          std::vector<std::thread>& threads) {
+    for (i32 i = 0; i < count; ++i) {
+      threads.emplace_back([&queue]() {
+        while (true) {
+          std::function<void()> work;
+          queue.pop(work);
+          if (!work) {
+            break;
+          }
+          work();
+        }
+      });
+    }
+  };
+  start_threads(upload_work_, NUM_UPLOAD_THREADS, upload_threads_);
+  start_threads(column_work_, NUM_COLUMN_THREADS, column_threads_);
 
   args.profiler.add_interval("setup", setup_start, now());
 
 }
 
 SaveWorker::~SaveWorker() {
+  finish_task(nullptr);
+  // Uploads are taken in order, so every pending save has been started
+  // before a thread sees its stop signal, and joining waits for the rest
+  for (size_t i = 0; i < upload_threads_.size(); ++i) {
+    upload_work_.push(std::function<void()>());
+  }
+  for (std::thread& thread : upload_threads_) {
+    thread.join();
+  }
+  for (size_t i = 0; i < column_threads_.size(); ++i) {
+    column_work_.push(std::function<void()>());
+  }
+  for (std::thread& thread : column_threads_) {
+    thread.join();
+  }
+}
+
+void SaveWorker::finish_task(std::function<void()> on_saved) {
+  for (auto& writer : output_writers_) {
+    writer->flush();
+  }
+  for (auto& writer : output_metadata_writers_) {
+    writer->flush();
+  }
+  output_writers_.clear();
+  output_metadata_writers_.clear();
+
+  auto pending = std::make_shared<PendingSave>();
   for (auto& file : output_) {
-    file->save();
+    pending->files.push_back(std::move(file));
   }
   for (auto& file : output_metadata_) {
-    file->save();
+    pending->files.push_back(std::move(file));
   }
-  for (auto& meta : video_metadata_) {
-    write_video_metadata(storage_.get(), meta);
+  pending->video_metadata = std::move(video_metadata_);
+  for (VideoMetadata& meta : pending->video_metadata) {
+    pending->video_metadata_paths.push_back(
+        attempt_path(VideoMetadata::descriptor_path(
+            meta.table_id(), meta.column_id(), meta.item_id())));
   }
+  pending->staged = std::move(staged_);
+  pending->job_index = job_index_;
+  pending->task_index = task_index_;
+  staged_.clear();
+  job_index_ = -1;
+  task_index_ = -1;
+  for (auto& storage : output_storage_) {
+    pending->storage.push_back(std::move(storage));
+  }
+  output_storage_.clear();
   output_.clear();
   output_metadata_.clear();
   video_metadata_.clear();
+
+  i32 num_saves = pending->files.size() + pending->video_metadata.size();
+  if (num_saves == 0) {
+    for (auto& storage : pending->storage) {
+      release_storage(std::move(storage));
+    }
+    if (staged_files_ != nullptr && pending->job_index != -1) {
+      staged_files_->add(pending->job_index, pending->task_index,
+                         std::move(pending->staged));
+    }
+    if (on_saved) {
+      on_saved();
+    }
+    return;
+  }
+  pending->remaining = num_saves;
+  pending->on_saved = std::move(on_saved);
+  auto saved_one = [this, pending]() {
+    if (--pending->remaining == 0) {
+      pending->files.clear();
+      for (auto& storage : pending->storage) {
+        release_storage(std::move(storage));
+      }
+      if (staged_files_ != nullptr) {
+        staged_files_->add(pending->job_index, pending->task_index,
+                           std::move(pending->staged));
+      }
+      if (pending->on_saved) {
+        pending->on_saved();
+      }
+    }
+  };
+  for (size_t i = 0; i < pending->files.size(); ++i) {
+    upload_work_.push([pending, saved_one, i]() {
+      BACKOFF_FAIL(pending->files[i]->save());
+      saved_one();
+    });
+  }
+  for (size_t i = 0; i < pending->video_metadata.size(); ++i) {
+    upload_work_.push([this, pending, saved_one, i]() {
+      std::unique_ptr<storehouse::StorageBackend> storage = acquire_storage();
+      std::unique_ptr<WriteFile> file;
+      BACKOFF_FAIL(make_unique_write_file(
+          storage.get(), pending->video_metadata_paths[i], file));
+      serialize_db_proto<proto::VideoDescriptor>(
+          file.get(), pending->video_metadata[i].get_descriptor());
+      BACKOFF_FAIL(file->save());
+      release_storage(std::move(storage));
+      saved_one();
+    });
+  }
+}
+
+void SaveWorker::abandon_task() {
+  // Buffered writers flush when destroyed, so what they still hold is
+  // dropped first
+  for (auto& writer : output_writers_) {
+    writer->discard();
+  }
+  for (auto& writer : output_metadata_writers_) {
+    writer->discard();
+  }
+  output_writers_.clear();
+  output_metadata_writers_.clear();
+  output_.clear();
+  output_metadata_.clear();
+  video_metadata_.clear();
+  for (auto& storage : output_storage_) {
+    release_storage(std::move(storage));
+  }
+  output_storage_.clear();
+  // The files of the attempt may already exist in part
+  if (!staged_.empty()) {
+    std::unique_ptr<storehouse::StorageBackend> storage = acquire_storage();
+    for (auto& file : staged_) {
+      storage->delete_file(std::get<0>(file));
+    }
+    release_storage(std::move(storage));
+  }
+  staged_.clear();
+  job_index_ = -1;
+  task_index_ = -1;
+}
+
+WriteFile* SaveWorker::make_write_file(const std::string& path) {
+  std::unique_ptr<storehouse::StorageBackend> storage = acquire_storage();
+  WriteFile* file = nullptr;
+  BACKOFF_FAIL(storage->make_write_file(path, file));
+  output_storage_.push_back(std::move(storage));
+  return file;
+}
+
+std::string SaveWorker::attempt_path(const std::string& path) {
+  if (staged_files_ == nullptr) {
+    return path;
+  }
+  std::string staged = StagedFiles::staged_path(path, node_id_);
+  staged_.emplace_back(staged, path);
+  return staged;
+}
+
+std::unique_ptr<storehouse::StorageBackend> SaveWorker::acquire_storage() {
+  {
+    std::lock_guard<std::mutex> lock(storage_mutex_);
+    if (!idle_storage_.empty()) {
+      std::unique_ptr<storehouse::StorageBackend> storage =
+          std::move(idle_storage_.back());
+      idle_storage_.pop_back();
+      return storage;
+    }
+  }
+  return std::unique_ptr<storehouse::StorageBackend>(
+      storehouse::StorageBackend::make_from_config(storage_config_));
+}
+
+void SaveWorker::release_storage(
+    std::unique_ptr<storehouse::StorageBackend> storage) {
+  std::lock_guard<std::mutex> lock(storage_mutex_);
+  idle_storage_.push_back(std::move(storage));
 }
 
 void SaveWorker::feed(EvalWorkEntry& input_entry) {
   EvalWorkEntry& work_entry = input_entry;
 
-  // Write out each output column to an individual data file
-  i32 video_col_idx = 0;
+  // Start moving every column to the CPU up front so later columns transfer
+  // while earlier ones are being written
+  std::vector<MemcpyHandle> transfers;
   for (size_t out_idx = 0; out_idx < work_entry.columns.size(); ++out_idx) {
-    u64 num_elements = static_cast<u64>(work_entry.columns[out_idx].size());
+    transfers.push_back(move_if_different_address_space_async(
+        profiler_, work_entry.column_handles[out_idx], CPU_DEVICE,
+        work_entry.columns[out_idx]));
+  }
 
-    auto io_start = now();
+  // Write out each output column to an individual data file. Columns are
+  // independent, so they are written concurrently on the column threads,
+  // with every packet of a column still written by one of them in order.
+  // Each file was made through a backend it alone uses, so the column
+  // threads never share one.
+  std::vector<ColumnSaveStats> stats(work_entry.columns.size());
+  std::vector<std::future<void>> done;
+  i32 video_col_idx = 0;
+  for (size_t out_idx = 0; out_idx < work_entry.columns.size(); ++out_idx) {
+    i32 col_video_idx = video_col_idx;
+    if (work_entry.column_types[out_idx] == ColumnType::Video) {
+      video_col_idx++;
+    }
+    if (work_entry.columns.size() == 1) {
+      save_column(work_entry, out_idx, col_video_idx, transfers[out_idx],
+                  stats[out_idx]);
+      continue;
+    }
+    auto promise = std::make_shared<std::promise<void>>();
+    done.push_back(promise->get_future());
+    column_work_.push([this, &work_entry, &transfers, &stats, out_idx,
+                       col_video_idx, promise]() {
+      save_column(work_entry, out_idx, col_video_idx, transfers[out_idx],
+                  stats[out_idx]);
+      promise->set_value();
+    });
+  }
+  for (std::future<void>& f : done) {
+    f.wait();
+  }
 
-    WriteFile* output_file = output_.at(out_idx).get();
-    WriteFile* output_metadata_file = output_metadata_.at(out_idx).get();
+  for (const ColumnSaveStats& column_stats : stats) {
+    profiler_.add_interval("memcpy_wait", column_stats.wait_start,
+                           column_stats.wait_end);
+    profiler_.add_interval("io", column_stats.io_start, column_stats.io_end);
+    profiler_.increment("io_write", column_stats.size_written);
+  }
+}
 
-    if (work_entry.columns[out_idx].size() != num_elements) {
-      LOG(FATAL) << "Output layer's element vector has wrong length";
-    }
+void SaveWorker::save_column(EvalWorkEntry& work_entry, size_t out_idx,
+                             i32 video_col_idx, MemcpyHandle& transfer,
+                             ColumnSaveStats& stats) {
+  u64 num_elements = static_cast<u64>(work_entry.columns[out_idx].size());
 
-    // Ensure the data is on the CPU
-    move_if_different_address_space(profiler_,
-                                    work_entry.column_handles[out_idx],
-                                    CPU_DEVICE, work_entry.columns[out_idx]);
+  stats.io_start = now();
 
-    bool compressed = work_entry.compressed[out_idx];
-    // If this is a video...
-    i64 size_written = 0;
-    if (work_entry.column_types[out_idx] == ColumnType::Video) {
-      // Read frame info column
-      assert(work_entry.columns[out_idx].size() > 0);
-      FrameInfo frame_info = work_entry.frame_sizes[video_col_idx];
+  BufferedWriteFile* output_writer = output_writers_.at(out_idx).get();
+  BufferedWriteFile* output_metadata_writer =
+      output_metadata_writers_.at(out_idx).get();
 
-      // Create index column
-      VideoMetadata& video_meta = video_metadata_[video_col_idx];
-      proto::VideoDescriptor& video_descriptor = video_meta.get_descriptor();
+  if (work_entry.columns[out_idx].size() != num_elements) {
+    LOG(FATAL) << "Output layer's element vector has wrong length";
+  }
 
-      video_descriptor.set_width(frame_info.width());
-      video_descriptor.set_height(frame_info.height());
-      video_descriptor.set_channels(frame_info.channels());
-      video_descriptor.set_frame_type(frame_info.type);
-
-      video_descriptor.set_time_base_num(1);
-      video_descriptor.set_time_base_denom(25);
-
-      video_descriptor.set_num_encoded_videos(
-          video_descriptor.num_encoded_videos() + 1);
-
-      if (compressed && frame_info.type == FrameType::U8 &&
-          frame_info.channels() == 3) {
-        H264ByteStreamIndexCreator index_creator(output_file);
-        for (size_t i = 0; i < num_elements; ++i) {
-          Element& element = work_entry.columns[out_idx][i];
-          if (!index_creator.feed_packet(element.buffer, element.size)) {
-            LOG(FATAL) << "Error in save worker h264 index creator: "
-                       << index_creator.error_message();
-          }
-          size_written += element.size;
+  // Ensure the data is on the CPU
+  stats.wait_start = now();
+  transfer.wait();
+  stats.wait_end = now();
+
+  bool compressed = work_entry.compressed[out_idx];
+  // If this is a video...
+  i64& size_written = stats.size_written;
+  if (work_entry.column_types[out_idx] == ColumnType::Video) {
+    // Read frame info column
+    assert(work_entry.columns[out_idx].size() > 0);
+    FrameInfo frame_info = work_entry.frame_sizes[video_col_idx];
+
+    // Create index column
+    VideoMetadata& video_meta = video_metadata_[video_col_idx];
+    proto::VideoDescriptor& video_descriptor = video_meta.get_descriptor();
+
+    video_descriptor.set_width(frame_info.width());
+    video_descriptor.set_height(frame_info.height());
+    video_descriptor.set_channels(frame_info.channels());
+    video_descriptor.set_frame_type(frame_info.type);
+
+    video_descriptor.set_time_base_num(1);
+    video_descriptor.set_time_base_denom(25);
+
+    video_descriptor.set_num_encoded_videos(
+        video_descriptor.num_encoded_videos() + 1);
+
+    if (compressed && frame_info.type == FrameType::U8 &&
+        frame_info.channels() == 3) {
+      // The index creator appends to the file itself
+      output_writer->flush();
+      H264ByteStreamIndexCreator index_creator(output_writer->file());
+      for (size_t i = 0; i < num_elements; ++i) {
+        Element& element = work_entry.columns[out_idx][i];
+        if (!index_creator.feed_packet(element.buffer, element.size)) {
+          LOG(FATAL) << "Error in save worker h264 index creator: "
+                     << index_creator.error_message();
         }
+        size_written += element.size;
+      }
 
-        i64 frame = index_creator.frames();
-        i32 num_non_ref_frames = index_creator.num_non_ref_frames();
-        const std::vector<u8>& metadata_bytes = index_creator.metadata_bytes();
-        const std::vector<i64>& keyframe_positions =
-            index_creator.keyframe_positions();
-        const std::vector<i64>& keyframe_timestamps =
-            index_creator.keyframe_timestamps();
-        const std::vector<i64>& keyframe_byte_offsets =
-            index_creator.keyframe_byte_offsets();
-
-        video_descriptor.set_chroma_format(proto::VideoDescriptor::YUV_420);
-        video_descriptor.set_codec_type(proto::VideoDescriptor::H264);
-
-        video_descriptor.set_frames(video_descriptor.frames() + frame);
-        video_descriptor.add_frames_per_video(frame);
-        video_descriptor.add_keyframes_per_video(keyframe_positions.size());
-        video_descriptor.add_size_per_video(index_creator.bytestream_pos());
-        video_descriptor.set_metadata_packets(metadata_bytes.data(),
-                                              metadata_bytes.size());
-
-        for (i64 v : keyframe_positions) {
-          video_descriptor.add_keyframe_positions(v);
-        }
-        for (i64 v : keyframe_timestamps) {
-          video_descriptor.add_keyframe_timestamps(v);
-        }
-        for (i64 v : keyframe_byte_offsets) {
-          video_descriptor.add_keyframe_byte_offsets(v);
-        }
-      } else {
-        // Non h264 compressible video column
-        video_descriptor.set_codec_type(proto::VideoDescriptor::RAW);
-        // Need to specify but not used for this type
-        video_descriptor.set_chroma_format(proto::VideoDescriptor::YUV_420);
-        video_descriptor.set_frames(video_descriptor.frames() + num_elements);
-
-        // Write number of elements in the file
-        s_write(output_metadata_file, num_elements);
-        // Write out all output sizes first so we can easily index into the
-        // file
-        for (size_t i = 0; i < num_elements; ++i) {
-          Frame* frame = work_entry.columns[out_idx][i].as_frame();
-          u64 buffer_size = frame->size();
-          s_write(output_metadata_file, buffer_size);
-          size_written += sizeof(u64);
-        }
-        // Write actual output data
-        for (size_t i = 0; i < num_elements; ++i) {
-          Frame* frame = work_entry.columns[out_idx][i].as_frame();
-          i64 buffer_size = frame->size();
-          u8* buffer = frame->data;
-          s_write(output_file, buffer, buffer_size);
-          size_written += buffer_size;
-        }
+      i64 frame = index_creator.frames();
+      i32 num_non_ref_frames = index_creator.num_non_ref_frames();
+      const std::vector<u8>& metadata_bytes = index_creator.metadata_bytes();
+      const std::vector<i64>& keyframe_positions =
+          index_creator.keyframe_positions();
+      const std::vector<i64>& keyframe_timestamps =
+          index_creator.keyframe_timestamps();
+      const std::vector<i64>& keyframe_byte_offsets =
+          index_creator.keyframe_byte_offsets();
+
+      video_descriptor.set_chroma_format(proto::VideoDescriptor::YUV_420);
+      video_descriptor.set_codec_type(proto::VideoDescriptor::H264);
+
+      // This video starts after the ones already written to the item
+      i64 byte_offset = 0;
+      for (i64 size : video_descriptor.size_per_video()) {
+        byte_offset += size;
+      }
+      KeyframeIndex::append(video_descriptor, video_descriptor.frames(),
+                            byte_offset, keyframe_positions,
+                            keyframe_timestamps, keyframe_byte_offsets);
+
+      video_descriptor.set_frames(video_descriptor.frames() + frame);
+      video_descriptor.add_frames_per_video(frame);
+      video_descriptor.add_keyframes_per_video(keyframe_positions.size());
+      video_descriptor.add_size_per_video(index_creator.bytestream_pos());
+      std::vector<i64> non_ref_frames = index_creator.non_ref_frames();
+      video_descriptor.add_non_ref_frames_per_video(non_ref_frames.size());
+      for (i64 v : non_ref_frames) {
+        video_descriptor.add_non_ref_frames(v);
       }
+      video_descriptor.set_metadata_packets(metadata_bytes.data(),
+                                            metadata_bytes.size());
 
-      video_col_idx++;
     } else {
-      // Write number of elements in the file
-      s_write(output_metadata_file, num_elements);
-      // Write out all output sizes to metadata file  so we can easily index into the data file
+      // Non h264 compressible video column
+      video_descriptor.set_codec_type(proto::VideoDescriptor::RAW);
+      // Need to specify but not used for this type
+      video_descriptor.set_chroma_format(proto::VideoDescriptor::YUV_420);
+      video_descriptor.set_frames(video_descriptor.frames() + num_elements);
+
+      // Write the number of elements and then all output sizes as one
+      // block so we can easily index into the file
+      std::vector<u64> header(num_elements + 1);
+      header[0] = num_elements;
       for (size_t i = 0; i < num_elements; ++i) {
-        u64 buffer_size = work_entry.columns[out_idx][i].size;
-        s_write(output_metadata_file, buffer_size);
-        size_written += sizeof(u64);
+        Frame* frame = work_entry.columns[out_idx][i].as_frame();
+        header[i + 1] = frame->size();
       }
+      output_metadata_writer->append(
+          reinterpret_cast<const u8*>(header.data()),
+          header.size() * sizeof(u64));
+      size_written += num_elements * sizeof(u64);
       // Write actual output data
       for (size_t i = 0; i < num_elements; ++i) {
-        i64 buffer_size = work_entry.columns[out_idx][i].size;
-        u8* buffer = work_entry.columns[out_idx][i].buffer;
-        s_write(output_file, buffer, buffer_size);
+        Frame* frame = work_entry.columns[out_idx][i].as_frame();
+        i64 buffer_size = frame->size();
+        u8* buffer = frame->data;
+        output_writer->append(buffer, buffer_size);
         size_written += buffer_size;
       }
     }
 
-    // TODO(apoms): For now, all evaluators are expected to return CPU
-    //   buffers as output so just assume CPU
+  } else if (out_idx < column_codecs_.size() &&
+             !column_codecs_[out_idx].empty()) {
+    // Compress each element on its own so they can still be read one at
+    // a time, and record the compressed sizes
+    std::vector<u64> header(num_elements + 1);
+    header[0] = num_elements;
+    std::vector<u8> compressed;
+    for (size_t i = 0; i < num_elements; ++i) {
+      const Element& element = work_entry.columns[out_idx][i];
+      size_t prev_size = compressed.size();
+      if (i > 0 && element.buffer != nullptr &&
+          element.buffer == work_entry.columns[out_idx][i - 1].buffer &&
+          element.size == work_entry.columns[out_idx][i - 1].size) {
+        // Rows repeated by Space share a buffer, so reuse the bytes the
+        // previous row compressed to
+        size_t prev_start = prev_size - header[i];
+        compressed.resize(prev_size + header[i]);
+        memcpy(compressed.data() + prev_size, compressed.data() + prev_start,
+               header[i]);
+      } else {
+        compress_element(column_codecs_[out_idx],
+                         column_codec_levels_[out_idx], element.buffer,
+                         element.size, compressed);
+      }
+      header[i + 1] = compressed.size() - prev_size;
+    }
+    output_metadata_writer->append(
+        reinterpret_cast<const u8*>(header.data()),
+        header.size() * sizeof(u64));
+    size_written += num_elements * sizeof(u64);
+    output_writer->append(compressed.data(), compressed.size());
+    size_written += compressed.size();
+  } else {
+    // Write the number of elements and then all output sizes to the
+    // metadata file as one block so we can easily index into the data file
+    std::vector<u64> header(num_elements + 1);
+    header[0] = num_elements;
+    for (size_t i = 0; i < num_elements; ++i) {
+      header[i + 1] = work_entry.columns[out_idx][i].size;
+    }
+    output_metadata_writer->append(
+        reinterpret_cast<const u8*>(header.data()),
+        header.size() * sizeof(u64));
+    size_written += num_elements * sizeof(u64);
+    // Write actual output data
     for (size_t i = 0; i < num_elements; ++i) {
-      delete_element(CPU_DEVICE, work_entry.columns[out_idx][i]);
+      i64 buffer_size = work_entry.columns[out_idx][i].size;
+      u8* buffer = work_entry.columns[out_idx][i].buffer;
+      output_writer->append(buffer, buffer_size);
+      size_written += buffer_size;
     }
+  }
 
-    profiler_.add_interval("io", io_start, now());
-    profiler_.increment("io_write", size_written);
+  // TODO(apoms): For now, all evaluators are expected to return CPU
+  //   buffers as output so just assume CPU
+  for (size_t i = 0; i < num_elements; ++i) {
+    delete_element(CPU_DEVICE, work_entry.columns[out_idx][i]);
   }
+
+  stats.io_end = now();
 }
 
-void SaveWorker::new_task(i32 table_id, i32 task_id,
+void SaveWorker::new_task(i32 table_id, i32 job_index, i32 task_id,
                           std::vector<ColumnType> column_types) {
   auto io_start = now();
-  for (auto& file : output_) {
-    file->save();
-  }
-  for (auto& file : output_metadata_) {
-    file->save();
-  }
-  for (auto& meta : video_metadata_) {
-    write_video_metadata(storage_.get(), meta);
-  }
-  output_.clear();
-  output_metadata_.clear();
-  video_metadata_.clear();
-
+  // Tasks are normally finished by their last packet
+  finish_task(nullptr);
   profiler_.add_interval("io", io_start, now());
+  job_index_ = job_index;
+  task_index_ = task_id;
+
+  PackedItemFile* packed_file = nullptr;
+  if (packed_) {
+    WriteFile* file = make_write_file(
+        attempt_path(table_item_packed_path(table_id, task_id)));
+    packed_file = new PackedItemFile(file, column_types.size());
+    output_.emplace_back(packed_file);
+  }
 
   for (size_t out_idx = 0; out_idx < column_types.size(); ++out_idx) {
+    if (packed_file != nullptr && column_types[out_idx] != ColumnType::Video) {
+      output_writers_.emplace_back(new BufferedWriteFile(
+          packed_file->data_file(out_idx), write_buffer_size_));
+      output_metadata_writers_.emplace_back(new BufferedWriteFile(
+          packed_file->metadata_file(out_idx), write_buffer_size_));
+      continue;
+    }
     const std::string output_path =
         table_item_output_path(table_id, out_idx, task_id);
     const std::string output_metdata_path =
         table_item_metadata_path(table_id, out_idx, task_id);
 
     WriteFile* output_file = nullptr;
-    BACKOFF_FAIL(storage_->make_write_file(output_path, output_file));
+    if (intermediates_ != nullptr) {
+      // Only readers on the node of the winning attempt look here
+      output_file = intermediates_->make_write_file(output_path);
+    } else {
+      output_file = make_write_file(attempt_path(output_path));
+    }
     output_.emplace_back(output_file);
+    output_writers_.emplace_back(
+        new BufferedWriteFile(output_file, write_buffer_size_));
 
-    WriteFile* output_metadata_file = nullptr;
-    BACKOFF_FAIL(
-        storage_->make_write_file(output_metdata_path, output_metadata_file));
+    WriteFile* output_metadata_file =
+        make_write_file(attempt_path(output_metdata_path));
     output_metadata_.emplace_back(output_metadata_file);
+    output_metadata_writers_.emplace_back(
+        new BufferedWriteFile(output_metadata_file, write_buffer_size_));
 
     if (column_types[out_idx] == ColumnType::Video) {
       video_metadata_.emplace_back();
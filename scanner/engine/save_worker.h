@@ -15,11 +15,18 @@
 
 #pragma once
 
+#include "scanner/engine/intermediate_store.h"
 #include "scanner/engine/runtime.h"
 #include "scanner/util/common.h"
+#include "scanner/util/memory.h"
 #include "scanner/util/queue.h"
 #include "scanner/util/storehouse.h"
 
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <thread>
+
 namespace scanner {
 namespace internal {
 
@@ -31,6 +38,23 @@ struct SaveWorkerArgs {
   int worker_id;
   storehouse::StorageConfig* storage_config;
   Profiler& profiler;
+  // Bytes of small writes to combine before writing them to a file
+  i64 write_buffer_size;
+  // One per output column
+  std::vector<proto::OutputColumnCompression> column_compression;
+  // Keep the data files of the outputs in this worker's intermediate store
+  // rather than writing them to storage
+  bool ephemeral;
+  IntermediateStore* intermediates;
+  // Write the non-video columns of each item to one packed item file
+  bool packed;
+  // The outputs are reduced by the master, so the rows of each task are
+  // discarded rather than written
+  bool reduced;
+  // Set when tasks may run on several workers at once. Files are then
+  // written to paths of this attempt and recorded here once saved, to be
+  // moved to their final paths only if the master picks this attempt.
+  StagedFiles* staged_files;
 };
 
 class SaveWorker {
@@ -40,19 +64,100 @@ class SaveWorker {
 
   void feed(EvalWorkEntry& input_entry);
 
-  void new_task(i32 table_id, i32 task_id,
+  void new_task(i32 table_id, i32 job_index, i32 task_id,
                 std::vector<ColumnType> column_types);
 
+  //! Writes out buffered data and hands the files of the current task to
+  //! the upload threads, which save them concurrently with each other and
+  //! with the writes of later tasks. on_saved, if set, is called from an
+  //! upload thread once all of them are saved.
+  void finish_task(std::function<void()> on_saved);
+
+  //! Drops the files of the current task without saving them or writing
+  //! out their buffered data, for tasks the master cancelled
+  void abandon_task();
+
+  static const i64 DEFAULT_WRITE_BUFFER_SIZE = 8 * 1024 * 1024;
+  static const i32 NUM_UPLOAD_THREADS = 4;
+  static const i32 NUM_COLUMN_THREADS = 4;
+
  private:
+  // Timings of saving one column of a packet, added to the profiler by the
+  // save thread
+  struct ColumnSaveStats {
+    timepoint_t wait_start;
+    timepoint_t wait_end;
+    timepoint_t io_start;
+    timepoint_t io_end;
+    i64 size_written = 0;
+  };
+
+  //! Writes one column of a packet to its files
+  void save_column(EvalWorkEntry& work_entry, size_t out_idx,
+                   i32 video_col_idx, MemcpyHandle& transfer,
+                   ColumnSaveStats& stats);
+
+  //! Creates a file of the current task through a backend of its own
+  storehouse::WriteFile* make_write_file(const std::string& path);
+
+  //! Path the current task writes a file to, which differs from its final
+  //! path for staged attempts
+  std::string attempt_path(const std::string& path);
+
+  //! Leases an idle backend, or makes one
+  std::unique_ptr<storehouse::StorageBackend> acquire_storage();
+  void release_storage(std::unique_ptr<storehouse::StorageBackend> storage);
+
+  // Files of a finished task that are being saved
+  struct PendingSave {
+    std::vector<std::unique_ptr<storehouse::WriteFile>> files;
+    // Backends the files were created through, released once they are
+    // all saved
+    std::vector<std::unique_ptr<storehouse::StorageBackend>> storage;
+    std::vector<VideoMetadata> video_metadata;
+    std::vector<std::string> video_metadata_paths;
+    StagedFiles::Files staged;
+    i64 job_index;
+    i64 task_index;
+    std::atomic<i32> remaining;
+    std::function<void()> on_saved;
+  };
+
   const i32 node_id_;
   const i32 worker_id_;
   Profiler& profiler_;
-  // Setup a distinct storage backend for each IO thread
-  std::unique_ptr<storehouse::StorageBackend> storage_;
+  storehouse::StorageConfig* storage_config_;
+  // Backends are not shared between threads, and the files of a task pass
+  // from the save thread to a column thread to an upload thread, so each
+  // file leases a backend of its own until it is saved
+  std::mutex storage_mutex_;
+  std::vector<std::unique_ptr<storehouse::StorageBackend>> idle_storage_;
+  // Backends of the files of the current task
+  std::vector<std::unique_ptr<storehouse::StorageBackend>> output_storage_;
   // Files to write io packets to
   std::vector<std::unique_ptr<storehouse::WriteFile>> output_;
   std::vector<std::unique_ptr<storehouse::WriteFile>> output_metadata_;
+  // Combine the writes of many small elements into a few large writes
+  std::vector<std::unique_ptr<BufferedWriteFile>> output_writers_;
+  std::vector<std::unique_ptr<BufferedWriteFile>> output_metadata_writers_;
+  const i64 write_buffer_size_;
+  IntermediateStore* intermediates_;
+  const bool packed_;
+  StagedFiles* staged_files_;
+  i64 job_index_ = -1;
+  i64 task_index_ = -1;
+  // Attempt and final paths of the files of the current task, when staged
+  StagedFiles::Files staged_;
   std::vector<VideoMetadata> video_metadata_;
+  // Element codec and level of each output column, empty for raw columns
+  std::vector<std::string> column_codecs_;
+  std::vector<i32> column_codec_levels_;
+  // Saves the files of finished tasks
+  Queue<std::function<void()>> upload_work_;
+  std::vector<std::thread> upload_threads_;
+  // Write the columns of a packet
+  Queue<std::function<void()>> column_work_;
+  std::vector<std::thread> column_threads_;
 
   // Continuation state
   bool first_item_;
@@ -0,0 +1,461 @@
+/* Copyright 2017 Carnegie Mellon University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "scanner/engine/stream_runner.h"
+#include "scanner/engine/kernel_registry.h"
+#include "scanner/engine/op_registry.h"
+#include "scanner/engine/runtime.h"
+#include "scanner/util/cuda.h"
+#include "scanner/util/cuda_stream_pool.h"
+#include "scanner/util/util.h"
+
+#include <glog/logging.h>
+
+extern "C" {
+#include "libavcodec/avcodec.h"
+#include "libavformat/avformat.h"
+}
+
+namespace scanner {
+namespace internal {
+namespace {
+
+// Packets read but not yet decoded before the reader waits
+const i32 MAX_QUEUED_PACKETS = 1024;
+// Frames a decoder can hold back to reorder them, the largest H.264 DPB
+const size_t MAX_REORDERED_FRAMES = 16;
+
+// Lets a blocked av_read_frame return once the stream is stopped
+i32 interrupt_read(void* opaque) {
+  return ((std::atomic<bool>*)opaque)->load() ? 1 : 0;
+}
+
+}
+
+struct StreamRunner::Source {
+  AVFormatContext* format_context = nullptr;
+  AVBitStreamFilterContext* annexb = nullptr;
+  i32 video_stream_index = -1;
+  proto::VideoDescriptor::VideoCodecType codec_type;
+  // Annex B parameter sets sent out of band, e.g. in an RTSP session's SDP
+  std::vector<u8> parameter_sets;
+
+  ~Source() {
+    if (annexb != nullptr) {
+      av_bitstream_filter_close(annexb);
+    }
+    if (format_context != nullptr) {
+      avformat_close_input(&format_context);
+    }
+  }
+};
+
+StreamRunner::StreamRunner(const StreamParameters& params)
+  : params_(params),
+    profiler_(now()),
+    packets_(MAX_QUEUED_PACKETS) {
+  error_.set_success(true);
+}
+
+StreamRunner::~StreamRunner() {
+  stop();
+  for (StreamResult& result : results_) {
+    for (Element& element : result.columns) {
+      delete_element(CPU_DEVICE, element);
+    }
+  }
+  for (size_t i = 0; i < kernel_streams_.size(); ++i) {
+    if (kernel_streams_[i] != nullptr) {
+      CUDAStreamPool::instance().release(kernel_devices_[i].id,
+                                         kernel_streams_[i]);
+    }
+  }
+}
+
+Result StreamRunner::start() {
+  Result result = open_source();
+  if (!result.success()) {
+    return result;
+  }
+  result = create_kernels();
+  if (!result.success()) {
+    return result;
+  }
+  reader_thread_ = std::thread(&StreamRunner::read_packets, this);
+  process_thread_ = std::thread(&StreamRunner::process_packets, this);
+  return result;
+}
+
+Result StreamRunner::open_source() {
+  Result result;
+  result.set_success(true);
+  av_register_all();
+  avformat_network_init();
+
+  source_.reset(new Source);
+  source_->format_context = avformat_alloc_context();
+  source_->format_context->interrupt_callback.callback = &interrupt_read;
+  source_->format_context->interrupt_callback.opaque = &stopped_;
+  // Hand packets over as soon as they arrive instead of buffering them to
+  // smooth out the network
+  AVDictionary* options = nullptr;
+  av_dict_set(&options, "fflags", "nobuffer", 0);
+  av_dict_set(&options, "flags", "low_delay", 0);
+  av_dict_set(&options, "rtsp_transport", "tcp", 0);
+  av_dict_set(&options, "max_delay", "500000", 0);
+  i32 err = avformat_open_input(&source_->format_context,
+                                params_.url.c_str(), nullptr, &options);
+  av_dict_free(&options);
+  if (err < 0) {
+    RESULT_ERROR(&result, "Could not open stream %s", params_.url.c_str());
+    return result;
+  }
+  if (avformat_find_stream_info(source_->format_context, nullptr) < 0) {
+    RESULT_ERROR(&result, "Could not find streams of %s",
+                 params_.url.c_str());
+    return result;
+  }
+  AVCodec* codec = nullptr;
+  source_->video_stream_index = av_find_best_stream(
+      source_->format_context, AVMEDIA_TYPE_VIDEO, -1, -1, &codec, 0);
+  if (source_->video_stream_index < 0) {
+    RESULT_ERROR(&result, "Stream %s has no video", params_.url.c_str());
+    return result;
+  }
+  AVCodecContext* cc =
+      source_->format_context->streams[source_->video_stream_index]->codec;
+  if (cc->codec_id == AV_CODEC_ID_H264) {
+    source_->codec_type = proto::VideoDescriptor::H264;
+  } else if (cc->codec_id == AV_CODEC_ID_HEVC) {
+    source_->codec_type = proto::VideoDescriptor::HEVC;
+  } else {
+    RESULT_ERROR(&result, "Unsupported stream codec %s",
+                 avcodec_get_name(cc->codec_id));
+    return result;
+  }
+  // Containers like flv and mp4 hold length prefixed packets, while RTSP
+  // and MPEG-TS already carry annex B
+  bool length_prefixed = cc->extradata_size > 0 && cc->extradata[0] == 1;
+  if (length_prefixed) {
+    source_->annexb = av_bitstream_filter_init(
+        source_->codec_type == proto::VideoDescriptor::HEVC
+            ? "hevc_mp4toannexb"
+            : "h264_mp4toannexb");
+  } else if (cc->extradata_size > 0) {
+    source_->parameter_sets.assign(cc->extradata,
+                                   cc->extradata + cc->extradata_size);
+  }
+
+  frame_info_ = FrameInfo(cc->height, cc->width, 3, FrameType::U8);
+  decoder_device_ = params_.decoder_type == VideoDecoderType::NVIDIA
+                        ? DeviceHandle{DeviceType::GPU, params_.gpu_id}
+                        : CPU_DEVICE;
+  decoder_.reset(VideoDecoder::make_from_config(decoder_device_, 1,
+                                                params_.decoder_type));
+  decoder_->configure(frame_info_, frame_info_, PixelFormat::RGB24,
+                      source_->codec_type);
+  return result;
+}
+
+Result StreamRunner::create_kernels() {
+  Result result;
+  result.set_success(true);
+  OpRegistry* op_registry = get_op_registry();
+  KernelRegistry* kernel_registry = get_kernel_registry();
+  for (size_t i = 0; i < params_.ops.size(); ++i) {
+    const StreamOp& op = params_.ops[i];
+    if (!kernel_registry->has_kernel(op.name, op.device_type)) {
+      RESULT_ERROR(&result, "Op %s has no kernel for the requested device",
+                   op.name.c_str());
+      return result;
+    }
+    OpInfo* info = op_registry->get_op_info(op.name);
+    if (info->variadic_inputs() || info->input_columns().size() != 1) {
+      RESULT_ERROR(&result, "Stream op %s must have exactly one input",
+                   op.name.c_str());
+      return result;
+    }
+    if (info->preferred_stencil() != std::vector<i32>{0} ||
+        info->warmup() > 0) {
+      RESULT_ERROR(&result, "Stream op %s can not use a stencil or warmup",
+                   op.name.c_str());
+      return result;
+    }
+    KernelFactory* factory = kernel_registry->get_kernel(op.name,
+                                                         op.device_type);
+    DeviceHandle device = op.device_type == DeviceType::GPU
+                              ? DeviceHandle{DeviceType::GPU, params_.gpu_id}
+                              : CPU_DEVICE;
+    KernelConfig config;
+    config.devices = {device};
+    config.input_columns = {info->input_columns()[0].name()};
+    config.input_column_types = {info->input_columns()[0].type()};
+    for (const Column& column : info->output_columns()) {
+      config.output_columns.push_back(column.name());
+    }
+    config.args = op.args;
+    config.node_id = i;
+    if (device.type == DeviceType::GPU) {
+      config.stream = CUDAStreamPool::instance().acquire(device.id);
+    }
+    kernel_devices_.push_back(device);
+    kernel_streams_.push_back(config.stream);
+
+    BaseKernel* kernel = factory->new_instance(config);
+    kernels_.emplace_back(kernel);
+    kernel->validate(&result);
+    if (!result.success()) {
+      return result;
+    }
+    kernel->set_stream(config.stream);
+    kernel->set_profiler(&profiler_);
+    if (i + 1 == params_.ops.size()) {
+      output_columns_ = config.output_columns;
+    }
+  }
+  if (kernels_.empty()) {
+    // Without ops the stream's output is the decoded frames themselves
+    output_columns_ = {"frame"};
+  }
+  return result;
+}
+
+void StreamRunner::read_packets() {
+  AVPacket packet;
+  av_init_packet(&packet);
+  Result result;
+  result.set_success(true);
+  while (!stopped_) {
+    i32 err = av_read_frame(source_->format_context, &packet);
+    if (err == AVERROR_EOF || (err < 0 && stopped_)) {
+      break;
+    } else if (err < 0) {
+      char err_msg[256];
+      av_strerror(err, err_msg, 256);
+      RESULT_ERROR(&result, "Error while reading stream: %s", err_msg);
+      break;
+    }
+    if (packet.stream_index != source_->video_stream_index) {
+      av_packet_unref(&packet);
+      continue;
+    }
+    Packet p;
+    p.read_time = now();
+    if (source_->annexb != nullptr) {
+      u8* filtered_data;
+      i32 filtered_size;
+      AVCodecContext* cc =
+          source_->format_context->streams[source_->video_stream_index]
+              ->codec;
+      err = av_bitstream_filter_filter(source_->annexb, cc, nullptr,
+                                       &filtered_data, &filtered_size,
+                                       packet.data, packet.size,
+                                       packet.flags & AV_PKT_FLAG_KEY);
+      if (err < 0) {
+        av_packet_unref(&packet);
+        RESULT_ERROR(&result, "Could not convert stream packets to annex B");
+        break;
+      }
+      p.data.assign(filtered_data, filtered_data + filtered_size);
+      if (filtered_data != packet.data) {
+        free(filtered_data);
+      }
+    } else {
+      p.data.assign(packet.data, packet.data + packet.size);
+    }
+    av_packet_unref(&packet);
+    packets_.push(std::move(p));
+  }
+  if (!result.success()) {
+    std::unique_lock<std::mutex> lock(results_mutex_);
+    error_ = result;
+  }
+  // An empty packet tells the processing thread the source is done
+  packets_.push(Packet());
+}
+
+void StreamRunner::process_packets() {
+  bool sent_parameter_sets = source_->parameter_sets.empty();
+  // Read times of the packets fed so far, taken as the frames come out
+  std::deque<timepoint_t> pending_times;
+  ElementList batch;
+  std::vector<i64> batch_ids;
+  std::vector<timepoint_t> batch_times;
+  i64 next_frame = 0;
+  i64 max_latency_ns = params_.max_latency_ms * 1000000;
+
+  if (decoder_device_.type == DeviceType::GPU) {
+    CUDA_PROTECT({ CU_CHECK(cudaSetDevice(decoder_device_.id)); });
+  }
+  while (true) {
+    Packet packet;
+    packets_.pop(packet);
+    if (packet.data.empty()) {
+      break;
+    }
+    if (!sent_parameter_sets) {
+      decoder_->feed(source_->parameter_sets.data(),
+                     source_->parameter_sets.size(), false);
+      sent_parameter_sets = true;
+    }
+    decoder_->feed(packet.data.data(), packet.data.size(), false);
+    pending_times.push_back(packet.read_time);
+
+    while (decoder_->decoded_frames_buffered() > 0) {
+      timepoint_t read_time = pending_times.front();
+      pending_times.pop_front();
+      i64 frame_id = next_frame++;
+      // Decoding everything keeps the reference frames intact, but frames
+      // that are already too old are not worth evaluating
+      if (nano_since(read_time) > max_latency_ns) {
+        decoder_->discard_frame();
+        frames_dropped_++;
+        continue;
+      }
+      Frame* frame = new_frame(decoder_device_, frame_info_);
+      decoder_->get_frame(frame->data, frame->size());
+      insert_frame(batch, frame);
+      batch.back().index = frame_id;
+      batch_ids.push_back(frame_id);
+      batch_times.push_back(read_time);
+      if ((i32)batch.size() >= params_.batch_size) {
+        evaluate(batch, batch_ids, batch_times);
+        batch.clear();
+        batch_ids.clear();
+        batch_times.clear();
+      }
+    }
+    // Older read times belong to packets the decoder produced no frame for
+    while (pending_times.size() > MAX_REORDERED_FRAMES) {
+      pending_times.pop_front();
+    }
+  }
+  if (!batch.empty()) {
+    evaluate(batch, batch_ids, batch_times);
+  }
+  Result result;
+  result.set_success(true);
+  finish(result);
+}
+
+void StreamRunner::evaluate(ElementList& frames,
+                            const std::vector<i64>& frame_ids,
+                            const std::vector<timepoint_t>& read_times) {
+  BatchedColumns columns = {frames};
+  DeviceHandle current_device = decoder_device_;
+  for (size_t k = 0; k < kernels_.size(); ++k) {
+    ElementList& input = columns[0];
+    move_if_different_address_space(profiler_, current_device,
+                                    kernel_devices_[k], input);
+    if (kernel_devices_[k].type == DeviceType::GPU) {
+      CUDA_PROTECT({ CU_CHECK(cudaSetDevice(kernel_devices_[k].id)); });
+    }
+    StenciledBatchedColumns inputs(1);
+    for (Element& element : input) {
+      inputs[0].push_back({element});
+    }
+    const OpInfo* info = get_op_registry()->get_op_info(params_.ops[k].name);
+    BatchedColumns outputs(info->output_columns().size());
+    kernels_[k]->execute_kernel(inputs, outputs);
+#ifdef HAVE_CUDA
+    if (kernel_streams_[k] != nullptr) {
+      CU_CHECK(cudaStreamSynchronize((cudaStream_t)kernel_streams_[k]));
+    }
+#endif
+    for (Element& element : input) {
+      delete_element(kernel_devices_[k], element);
+    }
+    // Only the first output feeds the next op
+    for (size_t c = 1; c < outputs.size() && k + 1 < kernels_.size(); ++c) {
+      for (Element& element : outputs[c]) {
+        delete_element(kernel_devices_[k], element);
+      }
+    }
+    if (k + 1 < kernels_.size()) {
+      outputs.resize(1);
+    }
+    columns = std::move(outputs);
+    current_device = kernel_devices_[k];
+  }
+  for (ElementList& column : columns) {
+    move_if_different_address_space(profiler_, current_device, CPU_DEVICE,
+                                    column);
+  }
+
+  std::unique_lock<std::mutex> lock(results_mutex_);
+  for (size_t r = 0; r < frame_ids.size(); ++r) {
+    StreamResult result;
+    result.frame = frame_ids[r];
+    result.latency_ns = nano_since(read_times[r]);
+    for (ElementList& column : columns) {
+      result.columns.push_back(column[r]);
+    }
+    results_.push_back(std::move(result));
+  }
+  // A consumer that falls behind loses the oldest results instead of
+  // getting ever later ones
+  while ((i32)results_.size() > params_.max_buffered_results) {
+    for (Element& element : results_.front().columns) {
+      delete_element(CPU_DEVICE, element);
+    }
+    results_.pop_front();
+    frames_dropped_++;
+  }
+  results_ready_.notify_all();
+}
+
+bool StreamRunner::next(StreamResult& result, i64 timeout_ms) {
+  std::unique_lock<std::mutex> lock(results_mutex_);
+  results_ready_.wait_for(lock, std::chrono::milliseconds(timeout_ms),
+                          [&] { return !results_.empty() || finished_; });
+  if (results_.empty()) {
+    return false;
+  }
+  result = std::move(results_.front());
+  results_.pop_front();
+  return true;
+}
+
+void StreamRunner::stop() {
+  stopped_ = true;
+  if (reader_thread_.joinable()) {
+    reader_thread_.join();
+  }
+  if (process_thread_.joinable()) {
+    process_thread_.join();
+  }
+}
+
+bool StreamRunner::finished() {
+  std::unique_lock<std::mutex> lock(results_mutex_);
+  return finished_;
+}
+
+Result StreamRunner::error() {
+  std::unique_lock<std::mutex> lock(results_mutex_);
+  return error_;
+}
+
+void StreamRunner::finish(const Result& result) {
+  std::unique_lock<std::mutex> lock(results_mutex_);
+  if (error_.success()) {
+    error_ = result;
+  }
+  finished_ = true;
+  results_ready_.notify_all();
+}
+}
+}
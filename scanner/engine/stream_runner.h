@@ -0,0 +1,150 @@
+/* Copyright 2017 Carnegie Mellon University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#pragma once
+
+#include "scanner/api/kernel.h"
+#include "scanner/util/common.h"
+#include "scanner/util/profiler.h"
+#include "scanner/util/queue.h"
+#include "scanner/video/video_decoder.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace scanner {
+namespace internal {
+
+//! An op of a stream pipeline, which is fed the first output of the op
+//! before it, or the decoded frames for the first op
+struct StreamOp {
+  std::string name;
+  DeviceType device_type;
+  std::vector<u8> args;
+};
+
+struct StreamParameters {
+  //! Anything libavformat can open live, e.g. rtsp:// or an HLS playlist
+  std::string url;
+  std::vector<StreamOp> ops;
+  VideoDecoderType decoder_type = VideoDecoderType::SOFTWARE;
+  //! GPU of the GPU ops and of the NVIDIA decoder
+  i32 gpu_id = 0;
+  //! Frames evaluated together. Every frame waits for its batch to fill, so
+  //! this is kept tiny.
+  i32 batch_size = 1;
+  //! Decoded frames older than this when their batch would start are not
+  //! evaluated, so falling behind the source drops frames rather than
+  //! growing the delay
+  i64 max_latency_ms = 1000;
+  //! Results not yet taken before the oldest one is dropped
+  i32 max_buffered_results = 16;
+};
+
+struct StreamResult {
+  //! Position of the frame in the stream since it was opened
+  i64 frame;
+  //! From the frame's packet being read to its result being ready
+  i64 latency_ns;
+  //! One element per output column of the last op, in CPU memory and owned
+  //! by the caller
+  ElementList columns;
+};
+
+//! Runs a linear pipeline of ops on a live video source as its frames
+//! arrive. Unlike a bulk job there is no table, no task boundaries and no
+//! save step: kernels are created once, see every frame in order and each
+//! result is handed out as soon as it is produced. Ops with stencils or
+//! several inputs are not supported. The ops must be loaded in this process.
+class StreamRunner {
+ public:
+  StreamRunner(const StreamParameters& params);
+
+  ~StreamRunner();
+
+  //! Opens the source and starts reading, decoding and evaluating it
+  Result start();
+
+  //! Waits up to timeout_ms for the next result. Returns false when there
+  //! is none yet or, once finished() is true, none is left.
+  bool next(StreamResult& result, i64 timeout_ms);
+
+  void stop();
+
+  //! Whether the source ended, failed or was stopped
+  bool finished();
+
+  //! Why the stream stopped, if it failed
+  Result error();
+
+  const std::vector<std::string>& output_columns() const {
+    return output_columns_;
+  }
+
+  //! Frames decoded but not evaluated or whose result was not taken in time
+  i64 frames_dropped() const { return frames_dropped_; }
+
+ private:
+  struct Packet {
+    std::vector<u8> data;
+    timepoint_t read_time;
+  };
+  struct Source;
+
+  Result open_source();
+
+  Result create_kernels();
+
+  void read_packets();
+
+  void process_packets();
+
+  void evaluate(ElementList& frames, const std::vector<i64>& frame_ids,
+                const std::vector<timepoint_t>& read_times);
+
+  void finish(const Result& result);
+
+  StreamParameters params_;
+  Profiler profiler_;
+  std::unique_ptr<Source> source_;
+  std::unique_ptr<VideoDecoder> decoder_;
+  DeviceHandle decoder_device_;
+  FrameInfo frame_info_;
+  std::vector<std::unique_ptr<BaseKernel>> kernels_;
+  std::vector<DeviceHandle> kernel_devices_;
+  std::vector<void*> kernel_streams_;
+  std::vector<std::string> output_columns_;
+
+  Queue<Packet> packets_;
+  std::thread reader_thread_;
+  std::thread process_thread_;
+  std::atomic<bool> stopped_{false};
+  std::atomic<i64> frames_dropped_{0};
+
+  std::mutex results_mutex_;
+  std::condition_variable results_ready_;
+  std::deque<StreamResult> results_;
+  bool finished_ = false;
+  Result error_;
+};
+}
+}
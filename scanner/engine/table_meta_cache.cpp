@@ -13,26 +13,32 @@
  * limitations under the License.
  */
 
+
 #include "scanner/engine/table_meta_cache.h"
 
+#include <algorithm>
+#include <atomic>
+#include <thread>
+
 namespace scanner {
 namespace internal {
 
+namespace {
+// Reads are dominated by storage latency, so prefetch uses more threads than
+// there are cores
+const i32 PREFETCH_THREADS = 64;
+}
+
 TableMetaCache::TableMetaCache(storehouse::StorageBackend* storage,
                                const DatabaseMetadata& meta)
   : storage_(storage), meta_(meta) {}
 
 const TableMetadata& TableMetaCache::at(const std::string& table_name) const {
-  i32 table_id = meta_.get_table_id(table_name);
-  memoized_read(table_id);
-  std::lock_guard<std::mutex> lock(lock_);
-  return cache_.at(table_id);
+  return memoized_read(meta_.get_table_id(table_name));
 }
 
 const TableMetadata& TableMetaCache::at(i32 table_id) const {
-  memoized_read(table_id);
-  std::lock_guard<std::mutex> lock(lock_);
-  return cache_.at(table_id);
+  return memoized_read(table_id);
 }
 
 bool TableMetaCache::exists(const std::string& table_name) const {
@@ -44,28 +50,82 @@ bool TableMetaCache::exists(i32 table_id) const {
 }
 
 void TableMetaCache::update(const TableMetadata& meta) {
-  std::lock_guard<std::mutex> lock(lock_);
   i32 table_id = meta_.get_table_id(meta.name());
-  cache_[table_id] = meta;
+  Shard& s = shard(table_id);
+  std::unique_ptr<TableMetadata> updated(new TableMetadata(meta));
+  std::unique_lock<std::shared_timed_mutex> lock(s.lock);
+  std::unique_ptr<TableMetadata>& entry = s.tables[table_id];
+  if (entry) {
+    s.retired.push_back(std::move(entry));
+  }
+  entry = std::move(updated);
 }
 
+void TableMetaCache::prefetch(const std::vector<i32>& table_ids) const {
+  std::vector<i32> missing;
+  for (i32 table_id : table_ids) {
+    if (find(table_id) == nullptr && meta_.has_table(table_id)) {
+      missing.push_back(table_id);
+    }
+  }
+  if (missing.empty()) {
+    return;
+  }
 
-void TableMetaCache::memoized_read(const std::string& table_name) const {
-  memoized_read(meta_.get_table_id(table_name));
+  std::atomic<size_t> next{0};
+  std::vector<std::thread> threads;
+  size_t num_threads = std::min((size_t)PREFETCH_THREADS, missing.size());
+  for (size_t t = 0; t < num_threads; ++t) {
+    threads.emplace_back([&]() {
+      for (size_t i = next++; i < missing.size(); i = next++) {
+        memoized_read(missing[i]);
+      }
+    });
+  }
+  for (std::thread& t : threads) {
+    t.join();
+  }
 }
 
-void TableMetaCache::memoized_read(i32 table_id) const {
-  bool b;
-  {
-    std::lock_guard<std::mutex> lock(lock_);
-    b = cache_.count(table_id) == 0 && meta_.has_table(table_id);
+void TableMetaCache::prefetch(
+    const std::vector<std::string>& table_names) const {
+  std::vector<i32> table_ids;
+  for (const std::string& name : table_names) {
+    if (meta_.has_table(name)) {
+      table_ids.push_back(meta_.get_table_id(name));
+    }
   }
-  if (b) {
-    std::string table_path = TableMetadata::descriptor_path(table_id);
-    TableMetadata meta = read_table_metadata(storage_, table_path);
-    std::lock_guard<std::mutex> lock(lock_);
-    cache_.insert({table_id, meta});
+  prefetch(table_ids);
+}
+
+TableMetaCache::Shard& TableMetaCache::shard(i32 table_id) const {
+  return shards_[static_cast<u32>(table_id) % NUM_SHARDS];
+}
+
+const TableMetadata* TableMetaCache::find(i32 table_id) const {
+  Shard& s = shard(table_id);
+  std::shared_lock<std::shared_timed_mutex> lock(s.lock);
+  auto it = s.tables.find(table_id);
+  return it == s.tables.end() ? nullptr : it->second.get();
+}
+
+const TableMetadata& TableMetaCache::memoized_read(i32 table_id) const {
+  const TableMetadata* cached = find(table_id);
+  if (cached != nullptr) {
+    return *cached;
   }
+  LOG_IF(FATAL, !meta_.has_table(table_id))
+      << "Table " << table_id << " does not exist";
+
+  // Read without holding the lock so other tables can be read meanwhile. If
+  // another thread reads the same table first, its copy is kept.
+  std::string table_path = TableMetadata::descriptor_path(table_id);
+  std::unique_ptr<TableMetadata> meta(
+      new TableMetadata(read_table_metadata(storage_, table_path)));
+  Shard& s = shard(table_id);
+  std::unique_lock<std::shared_timed_mutex> lock(s.lock);
+  auto it = s.tables.emplace(table_id, std::move(meta)).first;
+  return *it->second;
 }
 
 }
@@ -13,16 +13,25 @@
  * limitations under the License.
  */
 
+
 #pragma once
 
 #include "scanner/engine/metadata.h"
 
+#include <array>
 #include <map>
-#include <mutex>
+#include <memory>
+#include <shared_mutex>
+#include <vector>
 
 namespace scanner {
 namespace internal {
 
+//! Caches the descriptors of the tables of a database, reading each one the
+//! first time it is needed. Lookups of cached tables only take a shared lock
+//! on one of several shards, so concurrent readers do not contend. A
+//! returned reference stays valid for the life of the cache, even after the
+//! table is updated.
 class TableMetaCache {
  public:
   TableMetaCache(storehouse::StorageBackend* storage,
@@ -38,15 +47,32 @@ class TableMetaCache {
 
   void update(const TableMetadata& meta);
 
+  //! Reads the descriptors of the tables that are not cached yet
+  //! concurrently, so a job over many tables does not read them one by one
+  void prefetch(const std::vector<i32>& table_ids) const;
+
+  void prefetch(const std::vector<std::string>& table_names) const;
+
  private:
-  void memoized_read(const std::string& table_name) const;
+  static const i32 NUM_SHARDS = 16;
+
+  struct Shard {
+    std::shared_timed_mutex lock;
+    std::map<i32, std::unique_ptr<TableMetadata>> tables;
+    // Descriptors replaced by update, kept while references may remain
+    std::vector<std::unique_ptr<TableMetadata>> retired;
+  };
+
+  Shard& shard(i32 table_id) const;
+
+  // Cached descriptor of the table, nullptr if it has not been read
+  const TableMetadata* find(i32 table_id) const;
 
-  void memoized_read(i32 table_id) const;
+  const TableMetadata& memoized_read(i32 table_id) const;
 
   storehouse::StorageBackend* storage_;
   const DatabaseMetadata& meta_;
-  mutable std::mutex lock_;
-  mutable std::map<i32, TableMetadata> cache_;
+  mutable std::array<Shard, NUM_SHARDS> shards_;
 };
 
 }
@@ -0,0 +1,110 @@
+/* Copyright 2017 Carnegie Mellon University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "scanner/engine/table_reader.h"
+#include "scanner/engine/metadata.h"
+#include "scanner/util/memory.h"
+
+namespace scanner {
+namespace internal {
+
+TableReader::TableReader(storehouse::StorageConfig* storage_config,
+                         const std::string& db_path)
+  : profiler_(now()) {
+  set_database_path(db_path);
+  // Clients that also run a worker share its pool
+  if (!memory_allocators_initialized()) {
+    init_memory_allocators(proto::MemoryPoolConfig(), {});
+  }
+  LoadWorkerArgs args{0,
+                      0,
+                      storage_config,
+                      profiler_,
+                      8,
+                      PACKET_SIZE,
+                      PACKET_SIZE,
+                      &item_metadata_cache_,
+                      nullptr,
+                      &video_index_cache_,
+                      nullptr,
+                      false,
+                      &intermediates_};
+  load_worker_.reset(new LoadWorker(args));
+}
+
+ElementList TableReader::read(i32 table_id, i32 column_id,
+                              const std::vector<i64>& rows,
+                              FrameInfo& frame_info) {
+  LoadWorkEntry entry;
+  entry.set_table_id(table_id);
+  proto::LoadSample* sample = entry.add_samples();
+  sample->set_table_id(table_id);
+  sample->set_column_id(column_id);
+  for (i64 row : rows) {
+    sample->add_input_row_ids(row);
+    sample->add_output_row_ids(row);
+  }
+
+  ElementList output;
+  output.reserve(rows.size());
+  load_worker_->feed(entry);
+  EvalWorkEntry packet;
+  while (load_worker_->yield(PACKET_SIZE, packet)) {
+    ElementList& column = packet.columns[0];
+    if (packet.column_types[0] != ColumnType::Video) {
+      output.insert(output.end(), column.begin(), column.end());
+      continue;
+    }
+    if (packet.video_encoding_type[0] == proto::VideoDescriptor::RAW) {
+      frame_info = packet.frame_sizes[0];
+      for (Element& element : column) {
+        insert_frame(output, new Frame(frame_info, element.buffer));
+      }
+      continue;
+    }
+
+    // Encoded video comes as the decode arguments of its keyframe intervals
+    std::vector<DecodeArgsView> args;
+    for (Element& element : column) {
+      args.emplace_back(element.buffer);
+    }
+    if (args.empty()) {
+      continue;
+    }
+    if (!decoder_) {
+      decoder_.reset(
+          new DecoderAutomata(CPU_DEVICE, 1, VideoDecoderType::SOFTWARE));
+      decoder_->set_profiler(&profiler_);
+    }
+    decoder_->initialize(args);
+    const DecodeArgsView& da = args[0];
+    frame_info = da.output_width() > 0
+                     ? frame_info_for_format(da.output_height(),
+                                             da.output_width(),
+                                             da.output_format())
+                     : frame_info_for_format(da.height(), da.width(),
+                                             da.output_format());
+    i64 num_rows = packet.row_ids[0].size();
+    std::vector<Frame*> frames = new_frames(CPU_DEVICE, frame_info, num_rows);
+    decoder_->get_frames(frames[0]->data, num_rows);
+    for (Frame* frame : frames) {
+      insert_frame(output, frame);
+    }
+  }
+  return output;
+}
+}
+}
@@ -0,0 +1,63 @@
+/* Copyright 2017 Carnegie Mellon University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#pragma once
+
+#include "scanner/engine/item_metadata_cache.h"
+#include "scanner/engine/load_worker.h"
+#include "scanner/engine/video_index_cache.h"
+#include "scanner/util/profiler.h"
+#include "scanner/video/decoder_automata.h"
+
+#include "storehouse/storage_backend.h"
+
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace scanner {
+namespace internal {
+
+// Reads rows of table columns in the calling process, through the same load
+// path the workers use: range reads of the requested elements and, for
+// encoded video, their keyframe intervals decoded with a software decoder.
+// Lets clients fetch results without running a job.
+class TableReader {
+ public:
+  TableReader(storehouse::StorageConfig* storage_config,
+              const std::string& db_path);
+
+  //! Reads the rows, in increasing order, of a column. Non-video columns
+  //! give one element per row and video columns one frame per row, RGB for
+  //! encoded video. frame_info is set for video columns. The elements are
+  //! CPU buffers for the caller to delete with delete_element.
+  ElementList read(i32 table_id, i32 column_id, const std::vector<i64>& rows,
+                   FrameInfo& frame_info);
+
+  //! Rows read and decoded per load packet
+  static const i32 PACKET_SIZE = 1024;
+
+ private:
+  Profiler profiler_;
+  ItemMetadataCache item_metadata_cache_;
+  VideoIndexCache video_index_cache_;
+  // Reads ephemeral tables from the workers holding them
+  IntermediateStore intermediates_;
+  std::unique_ptr<LoadWorker> load_worker_;
+  std::unique_ptr<DecoderAutomata> decoder_;
+};
+}
+}
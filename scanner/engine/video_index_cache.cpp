@@ -0,0 +1,86 @@
+/* Copyright 2017 Carnegie Mellon University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "scanner/engine/video_index_cache.h"
+
+namespace scanner {
+namespace internal {
+
+VideoIndexCache::VideoIndexCache(size_t max_bytes) : max_bytes_(max_bytes) {}
+
+VideoIndexCache::Index VideoIndexCache::get(i32 table_id, i32 column_id,
+                                            i32 item_id, i64 timestamp) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  auto it = entries_.find(std::make_tuple(table_id, column_id, item_id));
+  if (it == entries_.end()) {
+    return nullptr;
+  }
+  if (it->second.timestamp != timestamp) {
+    erase(it);
+    return nullptr;
+  }
+  lru_.splice(lru_.begin(), lru_, it->second.lru_position);
+  return it->second.index;
+}
+
+void VideoIndexCache::put(i32 table_id, i32 column_id, i32 item_id,
+                          i64 timestamp, Index index) {
+  size_t bytes = entry_bytes(index);
+  if (bytes > max_bytes_) {
+    return;
+  }
+  std::unique_lock<std::mutex> lock(mutex_);
+  Key key = std::make_tuple(table_id, column_id, item_id);
+  auto it = entries_.find(key);
+  if (it != entries_.end()) {
+    // Another load worker read the same item concurrently
+    erase(it);
+  }
+  while (bytes_ + bytes > max_bytes_) {
+    erase(entries_.find(lru_.back()));
+  }
+  lru_.push_front(key);
+  entries_[key] = Entry{timestamp, std::move(index), lru_.begin()};
+  bytes_ += bytes;
+}
+
+void VideoIndexCache::clear() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  entries_.clear();
+  lru_.clear();
+  bytes_ = 0;
+}
+
+size_t VideoIndexCache::entry_bytes(const Index& index) {
+  return sizeof(VideoIndexEntry) +
+         (index->frames_per_video.size() + index->keyframes_per_video.size() +
+          index->size_per_video.size() + index->keyframe_positions.size() +
+          index->keyframe_byte_offsets.size() + index->non_ref_frames.size() +
+          index->source_packet_offsets.size() +
+          index->source_packet_sizes.size() +
+          index->source_keyframe_packets.size()) *
+             sizeof(i64) +
+         index->source_parameter_sets.size() + index->source_path.size() +
+         (index->keyframe_index ? index->keyframe_index->encoded_bytes() : 0);
+}
+
+void VideoIndexCache::erase(std::map<Key, Entry>::iterator it) {
+  bytes_ -= entry_bytes(it->second.index);
+  lru_.erase(it->second.lru_position);
+  entries_.erase(it);
+}
+}
+}
@@ -15,34 +15,62 @@
 
 #include "scanner/engine/video_index_entry.h"
 
+#include <algorithm>
+#include <cassert>
+
 namespace scanner {
 namespace internal {
+namespace {
+
+// Non-reference frames relative to the whole item, or none if unknown
+std::vector<i64> item_non_ref_frames(const VideoMetadata& video_meta) {
+  // Videos written before non-reference frames were recorded have no
+  // counts, so only use the list when every video has one
+  std::vector<i64> non_ref_frames;
+  std::vector<i64> non_ref_frames_per_video =
+      video_meta.non_ref_frames_per_video();
+  std::vector<i64> frames_per_video = video_meta.frames_per_video();
+  i64 num_encoded_videos = video_meta.num_encoded_videos();
+  if (non_ref_frames_per_video.size() == num_encoded_videos) {
+    non_ref_frames = video_meta.non_ref_frames();
+    i64 frame_offset = 0;
+    i64 non_ref_offset = 0;
+    for (i64 v = 0; v < num_encoded_videos; ++v) {
+      for (i64 i = 0; i < non_ref_frames_per_video[v]; ++i) {
+        non_ref_frames[non_ref_offset + i] += frame_offset;
+      }
+      frame_offset += frames_per_video[v];
+      non_ref_offset += non_ref_frames_per_video[v];
+    }
+  }
+  return non_ref_frames;
+}
+}
 
-std::unique_ptr<storehouse::RandomReadFile> VideoIndexEntry::open_file() const {
-  std::unique_ptr<storehouse::RandomReadFile> file;
-  BACKOFF_FAIL(storehouse::make_unique_random_read_file(
-      storage, table_item_output_path(table_id, column_id, item_id),
-      file));
-  return std::move(file);
+std::string VideoIndexEntry::data_path() const {
+  if (inplace()) {
+    return source_path;
+  }
+  return table_item_output_path(table_id, column_id, item_id);
 }
 
 VideoIndexEntry read_video_index(storehouse::StorageBackend* storage,
-                                 i32 table_id, i32 column_id, i32 item_id) {
+                                 i32 table_id, i32 column_id, i32 item_id,
+                                 ReadFilePool* file_pool, bool ephemeral) {
   VideoMetadata video_meta = read_video_metadata(
       storage, VideoMetadata::descriptor_path(table_id, column_id, item_id));
-  return read_video_index(storage, video_meta);
+  return read_video_index(storage, video_meta, file_pool, ephemeral);
 }
 
 VideoIndexEntry read_video_index(storehouse::StorageBackend* storage,
-                                 const VideoMetadata& video_meta) {
+                                 const VideoMetadata& video_meta,
+                                 ReadFilePool* file_pool, bool ephemeral) {
   VideoIndexEntry index_entry;
 
   i32 table_id = video_meta.table_id();
   i32 column_id = video_meta.column_id();
   i32 item_id = video_meta.item_id();
 
-  // Open the video file for reading
-  index_entry.storage = storage;
   index_entry.table_id = table_id;
   index_entry.column_id = column_id;
   index_entry.item_id = item_id;
@@ -51,19 +79,61 @@ VideoIndexEntry read_video_index(storehouse::StorageBackend* storage,
   index_entry.channels = video_meta.channels();
   index_entry.frame_type = video_meta.frame_type();
   index_entry.codec_type = video_meta.codec_type();
+  index_entry.chroma_format = video_meta.chroma_format();
 
-  std::unique_ptr<storehouse::RandomReadFile> file;
-  BACKOFF_FAIL(storehouse::make_unique_random_read_file(
-      storage, table_item_output_path(table_id, column_id, item_id),
-      file));
-  BACKOFF_FAIL(file->get_size(index_entry.file_size));
+  index_entry.source_path = video_meta.source_path();
+  if (index_entry.inplace()) {
+    // Nothing was written to the table, so the stream size is the one
+    // recorded at ingest
+    index_entry.source_packet_offsets = video_meta.source_packet_offsets();
+    index_entry.source_packet_sizes = video_meta.source_packet_sizes();
+    index_entry.source_keyframe_packets = video_meta.source_keyframe_packets();
+    index_entry.source_parameter_sets = video_meta.source_parameter_sets();
+    index_entry.file_size = 0;
+    for (i64 size : video_meta.size_per_video()) {
+      index_entry.file_size += size;
+    }
+  } else if (ephemeral) {
+    // The item is held by a worker and holds just the encoded videos
+    index_entry.file_size = 0;
+    for (i64 size : video_meta.size_per_video()) {
+      index_entry.file_size += size;
+    }
+  } else if (file_pool != nullptr) {
+    ReadFilePool::Handle file = file_pool->acquire(index_entry.data_path());
+    BACKOFF_FAIL(file->get_size(index_entry.file_size));
+  } else {
+    std::unique_ptr<storehouse::RandomReadFile> file;
+    BACKOFF_FAIL(storehouse::make_unique_random_read_file(
+        storage, table_item_output_path(table_id, column_id, item_id), file));
+    BACKOFF_FAIL(file->get_size(index_entry.file_size));
+  }
+  index_entry.frames = video_meta.frames();
   index_entry.num_encoded_videos = video_meta.num_encoded_videos();
   index_entry.frames_per_video = video_meta.frames_per_video();
   index_entry.keyframes_per_video = video_meta.keyframes_per_video();
   index_entry.size_per_video = video_meta.size_per_video();
+  const proto::VideoDescriptor& descriptor = video_meta.get_descriptor();
+  if (KeyframeIndex::present(descriptor)) {
+    // Keyframes are already relative to the whole item
+    auto keyframe_index = std::make_shared<const KeyframeIndex>(descriptor);
+    if (!index_entry.inplace()) {
+      index_entry.keyframe_index = keyframe_index;
+    } else {
+      // The source packets are indexed by keyframe, so videos ingested in
+      // place keep their whole keyframe index
+      keyframe_index->decode(0, keyframe_index->size(),
+                             &index_entry.keyframe_positions, nullptr,
+                             &index_entry.keyframe_byte_offsets);
+      index_entry.keyframe_positions.push_back(video_meta.frames());
+      index_entry.keyframe_byte_offsets.push_back(index_entry.file_size);
+    }
+    index_entry.non_ref_frames = item_non_ref_frames(video_meta);
+    return index_entry;
+  }
   index_entry.keyframe_positions = video_meta.keyframe_positions();
   index_entry.keyframe_byte_offsets = video_meta.keyframe_byte_offsets();
-  if (index_entry.codec_type == proto::VideoDescriptor::H264) {
+  if (index_entry.codec_type != proto::VideoDescriptor::RAW) {
     // Update keyframe positions and byte offsets so that the separately
     // encoded videos seem like they are one
     i64 frame_offset = 0;
@@ -80,6 +150,8 @@ VideoIndexEntry read_video_index(storehouse::StorageBackend* storage,
       byte_offset += index_entry.size_per_video[v];
     }
 
+    index_entry.non_ref_frames = item_non_ref_frames(video_meta);
+
     // Place total frames at the end of keyframe positions and total file size
     // at the end of byte offsets to make interval calculation not need to
     // deal with edge cases surrounding those
@@ -90,5 +162,32 @@ VideoIndexEntry read_video_index(storehouse::StorageBackend* storage,
   return index_entry;
 }
 
+VideoIndexEntry slice_video_index(const VideoIndexEntry& index_entry,
+                                  const std::vector<i64>& rows) {
+  assert(index_entry.keyframe_index && !rows.empty());
+  const KeyframeIndex& keyframe_index = *index_entry.keyframe_index;
+  VideoIndexEntry slice = index_entry;
+  slice.keyframe_index.reset();
+  slice.non_ref_frames.clear();
+
+  i64 start = keyframe_index.find(rows.front());
+  i64 end = keyframe_index.find(rows.back()) + 1;
+  // The keyframe after the last one also bounds the read
+  keyframe_index.decode(start, std::min(end + 1, keyframe_index.size()),
+                        &slice.keyframe_positions, nullptr,
+                        &slice.keyframe_byte_offsets);
+  if (end >= keyframe_index.size()) {
+    slice.keyframe_positions.push_back(index_entry.frames);
+    slice.keyframe_byte_offsets.push_back(index_entry.file_size);
+  }
+
+  const std::vector<i64>& non_ref_frames = index_entry.non_ref_frames;
+  auto first = std::lower_bound(non_ref_frames.begin(), non_ref_frames.end(),
+                                slice.keyframe_positions.front());
+  auto last = std::lower_bound(first, non_ref_frames.end(),
+                               slice.keyframe_positions.back());
+  slice.non_ref_frames.assign(first, last);
+  return slice;
+}
 }
 }
@@ -16,6 +16,7 @@
 #pragma once
 
 #include "scanner/engine/metadata.h"
+#include "scanner/engine/read_file_pool.h"
 #include "scanner/engine/runtime.h"
 #include "scanner/util/common.h"
 
@@ -25,9 +26,11 @@ namespace scanner {
 namespace internal {
 
 struct VideoIndexEntry {
-  std::unique_ptr<storehouse::RandomReadFile> open_file() const;
+  // File holding the bitstream: the source video for in-place ingest and
+  // the table item otherwise
+  std::string data_path() const;
+  bool inplace() const { return !source_path.empty(); }
 
-  storehouse::StorageBackend* storage;
   i32 table_id;
   i32 column_id;
   i32 item_id;
@@ -36,19 +39,47 @@ struct VideoIndexEntry {
   i32 channels;
   FrameType frame_type;
   proto::VideoDescriptor::VideoCodecType codec_type;
+  proto::VideoDescriptor::VideoChromaFormat chroma_format;
   u64 file_size;
+  i64 frames;
   i32 num_encoded_videos;
   std::vector<i64> frames_per_video;
   std::vector<i64> keyframes_per_video;
   std::vector<i64> size_per_video;
+  // End with the item's frames and file size. Left empty when the video has
+  // a compact keyframe index, which is decoded only for the keyframes a read
+  // needs (see slice_video_index).
   std::vector<i64> keyframe_positions;
   std::vector<i64> keyframe_byte_offsets;
+  std::shared_ptr<const KeyframeIndex> keyframe_index;
+  // Sorted, empty when unknown
+  std::vector<i64> non_ref_frames;
+  // Set for videos ingested in place. keyframe_byte_offsets and file_size
+  // then describe the stream reconstructed from these source packets.
+  std::string source_path;
+  std::vector<i64> source_packet_offsets;
+  std::vector<i64> source_packet_sizes;
+  std::vector<i64> source_keyframe_packets;
+  std::vector<u8> source_parameter_sets;
 };
 
+// Given a file pool, the table item is opened through it to look up its size.
+// Items of ephemeral tables are not in storage, so their size is the total of
+// the encoded videos written to them.
 VideoIndexEntry read_video_index(storehouse::StorageBackend *storage,
-                                 i32 table_id, i32 column_id, i32 item_id);
+                                 i32 table_id, i32 column_id, i32 item_id,
+                                 ReadFilePool* file_pool = nullptr,
+                                 bool ephemeral = false);
 
 VideoIndexEntry read_video_index(storehouse::StorageBackend *storage,
-                                 const VideoMetadata& video_meta);
+                                 const VideoMetadata& video_meta,
+                                 ReadFilePool* file_pool = nullptr,
+                                 bool ephemeral = false);
+
+// Copy of an index with a compact keyframe index whose keyframe positions
+// and byte offsets cover only the keyframes needed to decode the rows,
+// which are sorted
+VideoIndexEntry slice_video_index(const VideoIndexEntry& index_entry,
+                                  const std::vector<i64>& rows);
 }
 }
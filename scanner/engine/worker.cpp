@@ -15,6 +15,7 @@
 
 #include "scanner/engine/worker.h"
 #include "scanner/engine/evaluate_worker.h"
+#include "scanner/engine/ingest.h"
 #include "scanner/engine/kernel_registry.h"
 #include "scanner/engine/load_worker.h"
 #include "scanner/engine/runtime.h"
@@ -24,6 +25,7 @@
 #include "scanner/engine/dag_analysis.h"
 #include "scanner/util/cuda.h"
 #include "scanner/util/glog.h"
+#include "scanner/util/numa.h"
 
 #include <arpa/inet.h>
 #include <grpc/grpc_posix.h>
@@ -31,6 +33,7 @@
 #include <ifaddrs.h>
 #include <netdb.h>
 #include <sys/socket.h>
+#include <cmath>
 #include <omp.h>
 
 // For avcodec_register_all()... should go in software video with global mutex
@@ -46,28 +49,145 @@ namespace scanner {
 namespace internal {
 
 namespace {
+// Expands the output rows of a task, which the master sends as a range
+std::vector<i64> task_output_rows(const proto::NewWork& new_work) {
+  std::vector<i64> rows(new_work.output_rows().begin(),
+                        new_work.output_rows().end());
+  if (rows.empty() && new_work.output_row_stride() > 0) {
+    for (i64 r = new_work.output_row_start(); r < new_work.output_row_end();
+         r += new_work.output_row_stride()) {
+      rows.push_back(r);
+    }
+  }
+  return rows;
+}
+
 inline bool operator==(const MemoryPoolConfig& lhs,
                        const MemoryPoolConfig& rhs) {
   return (lhs.cpu().use_pool() == rhs.cpu().use_pool()) &&
          (lhs.cpu().free_space() == rhs.cpu().free_space()) &&
+         (lhs.cpu().allocator() == rhs.cpu().allocator()) &&
+         (lhs.cpu().thread_cache_size() == rhs.cpu().thread_cache_size()) &&
+         (lhs.cpu().exhaustion() == rhs.cpu().exhaustion()) &&
+         (lhs.cpu().frame_cache_size() == rhs.cpu().frame_cache_size()) &&
          (lhs.gpu().use_pool() == rhs.gpu().use_pool()) &&
-         (lhs.gpu().free_space() == rhs.gpu().free_space());
+         (lhs.gpu().free_space() == rhs.gpu().free_space()) &&
+         (lhs.gpu().allocator() == rhs.gpu().allocator()) &&
+         (lhs.gpu().thread_cache_size() == rhs.gpu().thread_cache_size()) &&
+         (lhs.gpu().exhaustion() == rhs.gpu().exhaustion()) &&
+         (lhs.gpu().frame_cache_size() == rhs.gpu().frame_cache_size()) &&
+         (lhs.numa_aware() == rhs.numa_aware());
 }
 inline bool operator!=(const MemoryPoolConfig& lhs,
                        const MemoryPoolConfig& rhs) {
   return !(lhs == rhs);
 }
 
+// Starts fn(args...) on a new thread bound to the given NUMA node so that the
+// CPU buffers it allocates come from that node's pool. A negative node leaves
+// the thread unpinned. A non-empty cpus set pins the thread to those cores
+// instead and sizes the OpenMP pool of the thread to match.
+template <typename Fn, typename... Args>
+std::thread start_numa_thread(i32 numa_node, std::vector<i32> cpus, Fn fn,
+                              Args... args) {
+  return std::thread([=]() mutable {
+    if (!cpus.empty()) {
+      bind_thread_to_cpus(cpus);
+      omp_set_num_threads(cpus.size());
+      if (numa_node >= 0) {
+        set_thread_numa_node(numa_node);
+      }
+    } else if (numa_node >= 0) {
+      bind_thread_to_numa_node(numa_node);
+    }
+    fn(args...);
+  });
+}
+
+// Queue instrumentation. Each stage records, in its own profiler, how long
+// it was starved waiting on its input queue and how long it was blocked on a
+// full output queue, plus the depth of its input queue sampled every time it
+// asks for work. scannerpy.Profiler.bottleneck() uses these to find the
+// limiting stage.
+template <typename Q, typename T>
+void pop_input(Profiler& profiler, Q& queue, T& item) {
+  profiler.increment("input_queue_depth", std::max(queue.size(), 0));
+  profiler.increment("input_queue_samples", 1);
+  auto wait_start = now();
+  queue.pop(item);
+  profiler.increment("input_wait_ns", (i64)nano_since(wait_start));
+}
+
+template <typename Q, typename T>
+void push_output(Profiler& profiler, Q& queue, T item) {
+  auto wait_start = now();
+  queue.push(std::move(item));
+  profiler.increment("output_wait_ns", (i64)nano_since(wait_start));
+}
+
+template <typename Q, typename T, typename Pushed>
+void push_outputs(Profiler& profiler, Q& queue, std::vector<T>& items,
+                  Pushed pushed) {
+  auto wait_start = now();
+  queue.push_n(items, pushed);
+  profiler.increment("output_wait_ns", (i64)nano_since(wait_start));
+}
+
+// Counts pushes to the pre-evaluate queues of the node, so that idle
+// pre-evaluate threads that may steal from any of them sleep until one of
+// them gets work instead of polling
+class WorkSignal {
+ public:
+  void notify() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      pushes_++;
+    }
+    cv_.notify_all();
+  }
+
+  u64 pushes() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return pushes_;
+  }
+
+  //! Returns once there was a push after the seen'th
+  void wait_for_push(u64 seen) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    cv_.wait(lock, [&] { return pushes_ != seen; });
+  }
+
+ private:
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  u64 pushes_ = 0;
+};
+
 void load_driver(LoadInputQueue& load_work,
                  std::vector<EvalQueue>& initial_eval_work,
+                 WorkSignal& eval_work_pushed,
+                 const TaskSet& cancelled_tasks,
+                 Queue<std::tuple<i64, i64>>& started_tasks,
                  LoadWorkerArgs args) {
   Profiler& profiler = args.profiler;
   LoadWorker worker(args);
+  std::unique_ptr<PerfCounters> perf_counters;
+  if (args.perf_counters) {
+    perf_counters.reset(new PerfCounters());
+  }
+  // Task claimed early so its reads could start during the previous task
+  std::tuple<i32, std::deque<TaskStream>, LoadWorkEntry> next_entry;
+  bool has_next_entry = false;
   while (true) {
     auto idle_start = now();
 
     std::tuple<i32, std::deque<TaskStream>, LoadWorkEntry> entry;
-    load_work.pop(entry);
+    if (has_next_entry) {
+      entry = std::move(next_entry);
+      has_next_entry = false;
+    } else {
+      pop_input(profiler, load_work, entry);
+    }
     i32& output_queue_idx = std::get<0>(entry);
     auto& task_streams = std::get<1>(entry);
     LoadWorkEntry& load_work_entry = std::get<2>(entry);
@@ -77,6 +197,12 @@ void load_driver(LoadInputQueue& load_work,
     if (load_work_entry.job_index() == -1) {
       break;
     }
+    if (cancelled_tasks.contains(load_work_entry.job_index(),
+                                 load_work_entry.task_index())) {
+      continue;
+    }
+    started_tasks.push(std::make_tuple(load_work_entry.job_index(),
+                                       load_work_entry.task_index()));
 
     VLOG(2) << "Load (N/PU: " << args.node_id << "/" << args.worker_id
             << "): processing job task (" << load_work_entry.job_index() << ", "
@@ -87,15 +213,24 @@ void load_driver(LoadInputQueue& load_work,
     auto input_entry = load_work_entry;
     worker.feed(input_entry);
 
+    // Hand all io packets of the task to the pipeline instance at once
+    std::vector<std::tuple<std::deque<TaskStream>, EvalWorkEntry>> outputs;
     while (true) {
       EvalWorkEntry output_entry;
       i32 io_packet_size = args.io_packet_size;
-      if (worker.yield(io_packet_size, output_entry)) {
+      PerfCounters::Sample perf_start;
+      if (perf_counters) {
+        perf_start = perf_counters->read();
+      }
+      bool yielded = worker.yield(io_packet_size, output_entry);
+      if (perf_counters) {
+        perf_counters->record(profiler, "perf_", "load", perf_start);
+      }
+      if (yielded) {
         auto& work_entry = output_entry;
         work_entry.first = !task_streams.empty();
         work_entry.last_in_task = worker.done();
-        initial_eval_work[output_queue_idx].push(
-            std::make_tuple(task_streams, work_entry));
+        outputs.push_back(std::make_tuple(task_streams, work_entry));
         // We use the task streams being empty to indicate that this is
         // a new task, so clear it here to show that this is from the same task
         task_streams.clear();
@@ -103,6 +238,31 @@ void load_driver(LoadInputQueue& load_work,
         break;
       }
     }
+    // Pushing waits while the pipeline is busy with earlier tasks, so start
+    // reading the next queued task before then. Only a task bound for the
+    // same pipeline instance is claimed, since it would wait behind this
+    // push anyway. Tasks for other instances are left for idle load workers.
+    std::vector<std::tuple<i32, std::deque<TaskStream>, LoadWorkEntry>>
+        claimed;
+    if (load_work.try_pop_front(
+            claimed, [&](LoadInputQueue::const_iterator begin,
+                         LoadInputQueue::const_iterator end) {
+              return begin != end &&
+                             std::get<0>(*begin) == output_queue_idx &&
+                             std::get<2>(*begin).job_index() != -1
+                         ? 1
+                         : 0;
+            })) {
+      next_entry = std::move(claimed[0]);
+      has_next_entry = true;
+      worker.prefetch(std::get<2>(next_entry), args.io_packet_size);
+    }
+    // A task can have more io packets than fit in the queue. Stealing
+    // pre-evaluate threads sleep on eval_work_pushed rather than on the
+    // queue, so signal every run of packets that lands before blocking for
+    // more space, or the instance owning the queue never drains it.
+    push_outputs(profiler, initial_eval_work[output_queue_idx], outputs,
+                 [&] { eval_work_pushed.notify(); });
     profiler.add_interval("task", work_start, now());
     VLOG(2) << "Load (N/PU: " << args.node_id << "/" << args.worker_id
             << "): finished job task (" << load_work_entry.job_index() << ", "
@@ -117,7 +277,77 @@ std::map<int, std::mutex> no_pipelining_locks;
 std::map<int, std::condition_variable> no_pipelining_cvars;
 std::map<int, bool> no_pipelining_conditions;
 
+// Number of entries at the front of a pipeline instance's input queue that
+// make up one whole task, or 0 if the front does not hold a complete task.
+// Only whole tasks may move between instances because an instance's kernels
+// see every row of a task in order.
+template <typename It>
+i32 whole_task_at_front(It begin, It end) {
+  if (begin == end) {
+    return 0;
+  }
+  const EvalWorkEntry& head = std::get<1>(*begin);
+  if (head.job_index == -1 || !head.first) {
+    return 0;
+  }
+  i32 count = 0;
+  for (It it = begin; it != end; ++it) {
+    const EvalWorkEntry& entry = std::get<1>(*it);
+    if (entry.job_index != head.job_index ||
+        entry.task_index != head.task_index) {
+      return 0;
+    }
+    count++;
+    if (entry.last_in_task) {
+      return count;
+    }
+  }
+  return 0;
+}
+
+// Waits for work on the instance's own queue while it is empty, stealing a
+// whole queued task from a sibling instance's queue whenever one is
+// available. Sibling queues are visited starting after this instance so that
+// thieves spread out over victims. Between attempts the thread sleeps until
+// work is pushed to any of the queues.
+void pop_or_steal(Profiler& profiler, i32 worker_id, EvalQueue& input_work,
+                  const std::vector<EvalQueue*>& steal_queues,
+                  WorkSignal& eval_work_pushed,
+                  std::vector<std::tuple<std::deque<TaskStream>,
+                                         EvalWorkEntry>>& entries) {
+  auto wait_start = now();
+  while (true) {
+    // Read before looking so that a push during the attempt is not missed
+    u64 pushes = eval_work_pushed.pushes();
+    entries.emplace_back();
+    if (input_work.try_pop(entries.back())) {
+      break;
+    }
+    entries.pop_back();
+    bool stolen = false;
+    for (size_t i = 1; i <= steal_queues.size() && !stolen; ++i) {
+      EvalQueue* victim = steal_queues[(worker_id + i) % steal_queues.size()];
+      if (victim == &input_work) {
+        continue;
+      }
+      stolen = victim->try_pop_front(
+          entries, [](EvalQueue::const_iterator begin,
+                      EvalQueue::const_iterator end) {
+            return whole_task_at_front(begin, end);
+          });
+    }
+    if (stolen) {
+      profiler.increment("tasks_stolen", 1);
+      break;
+    }
+    eval_work_pushed.wait_for_push(pushes);
+  }
+  profiler.increment("input_wait_ns", (i64)nano_since(wait_start));
+}
+
 void pre_evaluate_driver(EvalQueue& input_work, EvalQueue& output_work,
+                         std::vector<EvalQueue*> steal_queues,
+                         WorkSignal& eval_work_pushed,
                          PreEvaluateWorkerArgs args) {
   Profiler& profiler = args.profiler;
   PreEvaluateWorker worker(args);
@@ -129,33 +359,45 @@ void pre_evaluate_driver(EvalQueue& input_work, EvalQueue& output_work,
   i32 work_packet_size = args.work_packet_size;
 
   std::tuple<i32, i32> active_job_task = std::make_tuple(-1, -1);
-  while (true) {
+  bool exit = false;
+  while (!exit) {
     auto idle_start = now();
 
     // If we have no work at all or we do not have work for our current task..
     if (task_work_queue.empty() ||
         (std::get<0>(active_job_task) != -1 &&
          task_work_queue.at(active_job_task).size() <= 0)) {
-      std::tuple<std::deque<TaskStream>, EvalWorkEntry> entry;
-      input_work.pop(entry);
+      std::vector<std::tuple<std::deque<TaskStream>, EvalWorkEntry>> entries;
+      if (steal_queues.empty()) {
+        entries.emplace_back();
+        pop_input(profiler, input_work, entries.back());
+      } else {
+        pop_or_steal(profiler, args.worker_id, input_work, steal_queues,
+                     eval_work_pushed, entries);
+      }
 
+      for (auto& entry : entries) {
+        EvalWorkEntry& work_entry = std::get<1>(entry);
+        VLOG(1) << "Pre-evaluate (N/KI: " << args.node_id << "/"
+                << args.worker_id << "): got work " << work_entry.job_index
+                << " " << work_entry.task_index;
+        if (work_entry.job_index == -1) {
+          exit = true;
+          break;
+        }
 
-      auto& task_streams = std::get<0>(entry);
-      EvalWorkEntry& work_entry = std::get<1>(entry);
-      VLOG(1) << "Pre-evaluate (N/KI: " << args.node_id << "/" << args.worker_id
-              << "): got work " << work_entry.job_index << " " << work_entry.task_index;
-      if (work_entry.job_index == -1) {
+        VLOG(1) << "Pre-evaluate (N/KI: " << args.node_id << "/"
+                << args.worker_id << "): "
+                << "received job task " << work_entry.job_index << ", "
+                << work_entry.task_index;
+
+        task_work_queue[std::make_tuple(work_entry.job_index,
+                                        work_entry.task_index)]
+            .push(entry);
+      }
+      if (exit) {
         break;
       }
-
-      VLOG(1) << "Pre-evaluate (N/KI: " << args.node_id << "/" << args.worker_id
-              << "): "
-              << "received job task " << work_entry.job_index << ", "
-              << work_entry.task_index;
-
-      task_work_queue[std::make_tuple(work_entry.job_index,
-                                      work_entry.task_index)]
-          .push(entry);
     }
 
     args.profiler.add_interval("idle", idle_start, now());
@@ -207,11 +449,12 @@ void pre_evaluate_driver(EvalQueue& input_work, EvalQueue& output_work,
       }
 
       if (first) {
-        output_work.push(std::make_tuple(task_streams, output_entry));
+        push_output(profiler, output_work,
+                    std::make_tuple(task_streams, output_entry));
         first = false;
       } else {
-        output_work.push(
-            std::make_tuple(std::deque<TaskStream>(), output_entry));
+        push_output(profiler, output_work,
+                    std::make_tuple(std::deque<TaskStream>(), output_entry));
       }
 
       if (std::getenv("NO_PIPELINING")) {
@@ -239,17 +482,46 @@ void evaluate_driver(EvalQueue& input_work, EvalQueue& output_work,
                      EvaluateWorkerArgs args) {
   Profiler& profiler = args.profiler;
   EvaluateWorker worker(args);
+  const i64 batch_deadline_ns = args.arg_group.batch_deadline_ms * 1000000;
+  // Last entry of a task whose partial last batch is held by the worker
+  bool holding_entry = false;
+  std::tuple<std::deque<TaskStream>, EvalWorkEntry> held_entry;
+  auto release_held_entry = [&]() {
+    worker.yield_held_outputs(std::get<1>(held_entry));
+    push_output(profiler, output_work, held_entry);
+    holding_entry = false;
+  };
   while (true) {
     auto idle_pull_start = now();
 
     std::tuple<std::deque<TaskStream>, EvalWorkEntry> entry;
-    input_work.pop(entry);
+    if (holding_entry) {
+      // Wait for the next task only up to the deadline before evaluating
+      // the held rows on their own
+      auto hold_start = now();
+      while (!input_work.try_pop(entry)) {
+        if (nano_since(hold_start) >= batch_deadline_ns) {
+          release_held_entry();
+          pop_input(profiler, input_work, entry);
+          break;
+        }
+        std::this_thread::sleep_for(std::chrono::microseconds(100));
+      }
+    } else {
+      pop_input(profiler, input_work, entry);
+    }
 
     auto& task_streams = std::get<0>(entry);
     EvalWorkEntry& work_entry = std::get<1>(entry);
 
     args.profiler.add_interval("idle_pull", idle_pull_start, now());
 
+    // Rows are only batched with the next task of the same job
+    if (holding_entry &&
+        work_entry.job_index != std::get<1>(held_entry).job_index) {
+      release_held_entry();
+    }
+
     if (work_entry.job_index == -1) {
       break;
     }
@@ -287,7 +559,17 @@ void evaluate_driver(EvalQueue& input_work, EvalQueue& output_work,
     profiler.add_interval("task", work_start, now());
 
     auto idle_push_start = now();
-    output_work.push(std::make_tuple(task_streams, output_entry));
+    if (holding_entry) {
+      // The held rows were evaluated with this entry's first batch
+      release_held_entry();
+    }
+    if (worker.has_held_rows()) {
+      held_entry = std::make_tuple(task_streams, output_entry);
+      holding_entry = true;
+    } else {
+      push_output(profiler, output_work,
+                  std::make_tuple(task_streams, output_entry));
+    }
     args.profiler.add_interval("idle_push", idle_push_start, now());
 
   }
@@ -303,7 +585,7 @@ void post_evaluate_driver(EvalQueue& input_work, OutputEvalQueue& output_work,
     auto idle_start = now();
 
     std::tuple<std::deque<TaskStream>, EvalWorkEntry> entry;
-    input_work.pop(entry);
+    pop_input(profiler, input_work, entry);
     EvalWorkEntry& work_entry = std::get<1>(entry);
 
     args.profiler.add_interval("idle", idle_start, now());
@@ -326,7 +608,8 @@ void post_evaluate_driver(EvalQueue& input_work, OutputEvalQueue& output_work,
 
     if (result) {
       output_entry.last_in_task = work_entry.last_in_task;
-      output_work.push(std::make_tuple(args.id, output_entry));
+      push_output(profiler, output_work,
+                  std::make_tuple(args.id, output_entry));
     }
 
     if (std::getenv("NO_PIPELINING")) {
@@ -347,39 +630,46 @@ void save_coordinator(OutputEvalQueue& eval_work,
   i32 num_save_workers = save_work.size();
   std::map<std::tuple<i32, i32>, i32> task_to_worker_mapping;
   i32 last_worker_assigned = 0;
-  while (true) {
+  // Drain everything the post-evaluate stages have produced in one go
+  const i32 max_entries_per_pop = 16;
+  std::vector<std::tuple<i32, EvalWorkEntry>> entries;
+  bool done = false;
+  while (!done) {
     auto idle_start = now();
 
-    std::tuple<i32, EvalWorkEntry> entry;
-    eval_work.pop(entry);
-    EvalWorkEntry& work_entry = std::get<1>(entry);
+    entries.clear();
+    eval_work.pop_up_to(entries, max_entries_per_pop);
 
     //args.profiler.add_interval("idle", idle_start, now());
 
-    if (work_entry.job_index == -1) {
-      break;
-    }
+    for (auto& entry : entries) {
+      EvalWorkEntry& work_entry = std::get<1>(entry);
+      if (work_entry.job_index == -1) {
+        done = true;
+        break;
+      }
 
-    auto job_task_id =
-        std::make_tuple(work_entry.job_index, work_entry.task_index);
-    if (task_to_worker_mapping.count(job_task_id) == 0) {
-      // Assign worker to this task
-      task_to_worker_mapping[job_task_id] =
-          last_worker_assigned++ % num_save_workers;
-    }
+      auto job_task_id =
+          std::make_tuple(work_entry.job_index, work_entry.task_index);
+      if (task_to_worker_mapping.count(job_task_id) == 0) {
+        // Assign worker to this task
+        task_to_worker_mapping[job_task_id] =
+            last_worker_assigned++ % num_save_workers;
+      }
 
-    i32 assigned_worker = task_to_worker_mapping.at(job_task_id);
-    save_work[assigned_worker].push(entry);
+      i32 assigned_worker = task_to_worker_mapping.at(job_task_id);
+      save_work[assigned_worker].push(entry);
 
-    if (work_entry.last_in_task) {
-      task_to_worker_mapping.erase(job_task_id);
+      if (work_entry.last_in_task) {
+        task_to_worker_mapping.erase(job_task_id);
+      }
     }
   }
 }
 
 void save_driver(SaveInputQueue& save_work,
                  SaveOutputQueue& output_work,
-                 SaveWorkerArgs args) {
+                 const TaskSet& cancelled_tasks, SaveWorkerArgs args) {
   Profiler& profiler = args.profiler;
   SaveWorker worker(args);
 
@@ -390,7 +680,7 @@ void save_driver(SaveInputQueue& save_work,
     auto idle_start = now();
 
     std::tuple<i32, EvalWorkEntry> entry;
-    save_work.pop(entry);
+    pop_input(profiler, save_work, entry);
 
     i32 pipeline_instance = std::get<0>(entry);
     EvalWorkEntry& work_entry = std::get<1>(entry);
@@ -407,19 +697,36 @@ void save_driver(SaveInputQueue& save_work,
 
     auto work_start = now();
 
-    if (work_entry.job_index != active_job ||
-        work_entry.task_index != active_task) {
-      active_job = work_entry.job_index;
-      active_task = work_entry.task_index;
+    bool cancelled = cancelled_tasks.contains(work_entry.job_index,
+                                              work_entry.task_index);
+    if (args.reduced || cancelled) {
+      for (size_t i = 0; i < work_entry.columns.size(); ++i) {
+        for (Element& element : work_entry.columns[i]) {
+          delete_element(work_entry.column_handles[i], element);
+        }
+      }
+      // The copy that finished first already saved the files of the task
+      if (cancelled && work_entry.job_index == active_job &&
+          work_entry.task_index == active_task) {
+        worker.abandon_task();
+        active_job = -1;
+        active_task = -1;
+      }
+    } else {
+      if (work_entry.job_index != active_job ||
+          work_entry.task_index != active_task) {
+        active_job = work_entry.job_index;
+        active_task = work_entry.task_index;
+
+        worker.new_task(work_entry.table_id, work_entry.job_index,
+                        work_entry.task_index, work_entry.column_types);
+        processed = 0;
+      }
+      processed++;
 
-      worker.new_task(work_entry.table_id, work_entry.task_index,
-                      work_entry.column_types);
-      processed = 0;
+      auto input_entry = work_entry;
+      worker.feed(input_entry);
     }
-    processed++;
-
-    auto input_entry = work_entry;
-    worker.feed(input_entry);
 
     VLOG(2) << "Save (N/KI: " << args.node_id << "/" << args.worker_id
             << "): finished task (" << work_entry.job_index << ", "
@@ -428,14 +735,194 @@ void save_driver(SaveInputQueue& save_work,
     args.profiler.add_interval("task", work_start, now());
 
     if (work_entry.last_in_task) {
-      output_work.push(std::make_tuple(pipeline_instance, work_entry.job_index,
-                                       work_entry.task_index));
+      // The task is only retired once its files are saved, which happens
+      // while this thread goes on to the next task
+      i32 job_index = work_entry.job_index;
+      i32 task_index = work_entry.task_index;
+      worker.finish_task([&output_work, pipeline_instance, job_index,
+                          task_index]() {
+        output_work.push(
+            std::make_tuple(pipeline_instance, job_index, task_index));
+      });
     }
   }
 
   VLOG(1) << "Save (N/KI: " << args.node_id << "/" << args.worker_id
           << "): thread finished ";
 }
+
+// Autotuning thresholds. A work packet is too small when fixed per-packet
+// overhead dominates the kernels, and a task is too small when the per-task
+// RPCs and flushes to disk start to show up next to the load time.
+const i64 AUTOTUNE_WARMUP_TASKS_PER_PU = 2;
+const i64 AUTOTUNE_MIN_PACKET_NS = 20000000;
+const i64 AUTOTUNE_MAX_PACKET_NS = 1000000000;
+const i64 AUTOTUNE_MIN_TASK_NS = 100000000;
+const f64 AUTOTUNE_STARVED_FRACTION = 0.1;
+const i32 AUTOTUNE_MAX_TASKS_IN_QUEUE_PER_PU = 16;
+
+// How often a worker with nothing else to send tells the master it is alive
+// over the work stream
+const i64 WORK_STREAM_HEARTBEAT_MS = 50;
+
+// Retired tasks between reports of the per op timings to the master
+const i64 OP_PROFILE_REPORT_TASKS = 16;
+
+// FFmpeg's H.264 decoder gains little from more threads than this
+const i32 MAX_DECODER_THREADS = 16;
+
+// Time a stage's threads spent processing, summed over the threads
+i64 stage_busy_ns(std::vector<Profiler*> profilers, i64& packets) {
+  i64 total_ns = 0;
+  for (Profiler* profiler : profilers) {
+    profiler->sum_intervals("task", packets, total_ns);
+  }
+  return total_ns;
+}
+
+// Sums the per op counters the evaluate workers keep into one profile for
+// each distinct op and device
+void collect_op_profiles(const std::vector<proto::Op>& ops,
+                         std::vector<std::vector<Profiler>>& eval_profilers,
+                         proto::WorkerMessage& message) {
+  std::set<std::string> seen;
+  for (const proto::Op& op : ops) {
+    if (is_builtin_op(op.name())) {
+      continue;
+    }
+    std::string key = op_profile_key(op.name(), op.device_type());
+    if (!seen.insert(key).second) {
+      continue;
+    }
+    proto::OpProfile profile;
+    profile.set_name(op.name());
+    profile.set_device_type(op.device_type());
+    for (auto& instance_profilers : eval_profilers) {
+      for (Profiler& profiler : instance_profilers) {
+        profile.set_rows(profile.rows() + profiler.counter("op_rows:" + key));
+        profile.set_eval_ns(profile.eval_ns() +
+                            profiler.counter("op_eval_ns:" + key));
+        profile.set_transferred_rows(
+            profile.transferred_rows() +
+            profiler.counter("op_transferred_rows:" + key));
+        profile.set_transfer_ns(profile.transfer_ns() +
+                                profiler.counter("op_transfer_ns:" + key));
+        profile.set_device_ns(profile.device_ns() +
+                              profiler.counter("op_device_ns:" + key));
+        profile.set_transfer_device_ns(
+            profile.transfer_device_ns() +
+            profiler.counter("op_transfer_device_ns:" + key));
+        profile.set_cycles(profile.cycles() +
+                           profiler.counter("op_cycles:" + key));
+        profile.set_instructions(profile.instructions() +
+                                 profiler.counter("op_instructions:" + key));
+        profile.set_llc_misses(profile.llc_misses() +
+                               profiler.counter("op_llc_misses:" + key));
+        i64 tuned = profiler.counter("op_tuned_batch_size:" + key);
+        if (tuned > 0 && (profile.tuned_batch_size() == 0 ||
+                          tuned < profile.tuned_batch_size())) {
+          profile.set_tuned_batch_size(tuned);
+        }
+      }
+    }
+    if (profile.rows() > 0) {
+      message.add_op_profiles()->CopyFrom(profile);
+    }
+  }
+}
+
+// Chooses pipeline parameters from the time each stage spent on the first
+// tasks_processed tasks. Load and save threads are shared by all pipeline
+// instances, so the instance count is picked to make the slowest instance
+// stage keep up with them.
+proto::TunedParameters tune_pipeline_parameters(
+    i32 pipeline_instances, i32 max_pipeline_instances, i32 io_packet_size,
+    i32 work_packet_size, i32 tasks_in_queue_per_pu, i64 tasks_processed,
+    i64 elapsed_ns, std::vector<Profiler>& load_profilers,
+    std::vector<std::vector<Profiler>>& eval_profilers,
+    std::vector<Profiler>& save_profilers) {
+  i64 shared_packets = 0;
+  std::vector<Profiler*> stage;
+  for (Profiler& profiler : load_profilers) {
+    stage.push_back(&profiler);
+  }
+  f64 load_ns_per_task = stage_busy_ns(stage, shared_packets) /
+                         (f64)tasks_processed / load_profilers.size();
+  stage.clear();
+  for (Profiler& profiler : save_profilers) {
+    stage.push_back(&profiler);
+  }
+  f64 save_ns_per_task = stage_busy_ns(stage, shared_packets) /
+                         (f64)tasks_processed / save_profilers.size();
+
+  // Time one instance needs per task in its slowest stage
+  f64 instance_ns_per_task = 0;
+  i64 eval_ns = 0;
+  i64 eval_packets = 0;
+  i64 input_wait_ns = 0;
+  size_t num_stages = eval_profilers[0].size();
+  for (size_t s = 0; s < num_stages; ++s) {
+    stage.clear();
+    for (auto& instance_profilers : eval_profilers) {
+      stage.push_back(&instance_profilers[s]);
+    }
+    i64 stage_packets = 0;
+    i64 busy_ns = stage_busy_ns(stage, stage_packets);
+    instance_ns_per_task = std::max(
+        instance_ns_per_task, busy_ns / (f64)tasks_processed);
+    if (s > 0 && s + 1 < num_stages) {
+      eval_ns += busy_ns;
+      eval_packets += stage_packets;
+    }
+  }
+  for (auto& instance_profilers : eval_profilers) {
+    input_wait_ns += instance_profilers[0].counter("input_wait_ns");
+  }
+
+  proto::TunedParameters tuned;
+  f64 shared_ns_per_task = std::max(load_ns_per_task, save_ns_per_task);
+  i32 instances = max_pipeline_instances;
+  if (shared_ns_per_task > 0) {
+    instances = (i32)std::ceil(instance_ns_per_task / shared_ns_per_task);
+  }
+  tuned.set_pipeline_instances_per_node(
+      std::max(1, std::min(instances, max_pipeline_instances)));
+
+  i32 new_work_packet_size = work_packet_size;
+  if (eval_packets > 0) {
+    i64 ns_per_packet = eval_ns / eval_packets;
+    if (ns_per_packet < AUTOTUNE_MIN_PACKET_NS) {
+      new_work_packet_size = work_packet_size * 2;
+    } else if (ns_per_packet > AUTOTUNE_MAX_PACKET_NS) {
+      new_work_packet_size = std::max(1, work_packet_size / 2);
+    }
+  }
+  tuned.set_work_packet_size(new_work_packet_size);
+
+  // IO packets must stay a multiple of the work packet size
+  i32 new_io_packet_size = io_packet_size;
+  if (load_ns_per_task * load_profilers.size() < AUTOTUNE_MIN_TASK_NS) {
+    new_io_packet_size = io_packet_size * 2;
+  }
+  new_io_packet_size =
+      std::max(1, (new_io_packet_size + new_work_packet_size / 2) /
+                      new_work_packet_size) *
+      new_work_packet_size;
+  tuned.set_io_packet_size(new_io_packet_size);
+
+  // Instances that wait for input while loading keeps up are starved by the
+  // round trips to the master, so keep more tasks queued
+  f64 starved = input_wait_ns / (f64)pipeline_instances / elapsed_ns;
+  bool load_bound =
+      load_ns_per_task >= instance_ns_per_task / pipeline_instances;
+  i32 new_tasks_in_queue = tasks_in_queue_per_pu;
+  if (starved > AUTOTUNE_STARVED_FRACTION && !load_bound) {
+    new_tasks_in_queue = std::min(tasks_in_queue_per_pu * 2,
+                                  AUTOTUNE_MAX_TASKS_IN_QUEUE_PER_PU);
+  }
+  tuned.set_tasks_in_queue_per_pu(new_tasks_in_queue);
+  return tuned;
+}
 }
 
 WorkerImpl::WorkerImpl(DatabaseParameters& db_params,
@@ -464,12 +951,21 @@ WorkerImpl::WorkerImpl(DatabaseParameters& db_params,
 
   storage_ =
       storehouse::StorageBackend::make_from_config(db_params_.storage_config);
+  file_pool_.reset(new ReadFilePool(db_params_.storage_config));
+  if (!db_params_.disk_cache_path.empty() && db_params_.disk_cache_bytes > 0) {
+    block_cache_.set_disk_tier(db_params_.disk_cache_path,
+                               db_params_.disk_cache_bytes,
+                               db_params_.disk_cache_lfu
+                                   ? BlockCache::Eviction::LFU
+                                   : BlockCache::Eviction::LRU);
+  }
 
   // Set up Python runtime if any kernels need it
   Py_Initialize();
 }
 
 WorkerImpl::~WorkerImpl() {
+  metrics_server_.reset();
   State state = state_.get();
   state_.set(State::SHUTTING_DOWN);
 
@@ -480,6 +976,8 @@ WorkerImpl::~WorkerImpl() {
     watchdog_thread_.join();
   }
   delete storage_;
+  // Cached kernels may hold buffers from the pools
+  kernel_cache_.clear();
   if (memory_pool_initialized_) {
     destroy_memory_allocators();
   }
@@ -488,6 +986,11 @@ WorkerImpl::~WorkerImpl() {
 grpc::Status WorkerImpl::NewJob(grpc::ServerContext* context,
                                 const proto::BulkJobParameters* job_params,
                                 proto::Result* job_result) {
+  if (draining_) {
+    // Jobs sent before the master saw this worker unregister get no tasks
+    job_result->set_success(true);
+    return grpc::Status::OK;
+  }
   // Ensure that only one job is running at a time and that the worker
   // is in idle mode before transitioning to job start
   State state = state_.get();
@@ -519,6 +1022,17 @@ grpc::Status WorkerImpl::NewJob(grpc::ServerContext* context,
   job_result->set_success(true);
   set_database_path(db_params_.db_path);
 
+  // Op libraries are loaded by the first job that uses them
+  for (const std::string& so_path : job_params->op_libraries()) {
+    std::string error;
+    if (!load_op_library(so_path, error)) {
+      RESULT_ERROR(job_result, "Worker %d failed to load op library %s: %s",
+                   node_id_, so_path.c_str(), error.c_str());
+      state_.test_and_set(RUNNING_JOB, IDLE);
+      return grpc::Status::OK;
+    }
+  }
+
   // Setup up table metadata cache for use in other operations
   DatabaseMetadata meta =
       read_database_metadata(storage_, DatabaseMetadata::descriptor_path());
@@ -544,12 +1058,32 @@ grpc::Status WorkerImpl::NewJob(grpc::ServerContext* context,
 
   DAGAnalysisInfo analysis_results;
   populate_analysis_info(ops, analysis_results);
-  // Need slice input rows to know which slice we are in
-  determine_input_rows_to_slices(meta, table_meta, jobs, ops, analysis_results);
+  // Need slice input rows to know which slice we are in. The master sends
+  // the ones it derived, which saves reading every input table's metadata.
+  if (job_params->job_row_analysis_size() == (i32)jobs.size()) {
+    import_row_analysis(
+        std::vector<proto::JobRowAnalysis>(
+            job_params->job_row_analysis().begin(),
+            job_params->job_row_analysis().end()),
+        analysis_results);
+  } else {
+    std::vector<std::string> input_tables;
+    for (auto& job : jobs) {
+      for (auto& column_input : job.inputs()) {
+        input_tables.push_back(column_input.table_name());
+      }
+    }
+    table_meta.prefetch(input_tables);
+    determine_input_rows_to_slices(meta, table_meta, jobs, ops,
+                                   analysis_results);
+  }
   remap_input_op_edges(ops, analysis_results);
+  intermediates_.set_memory_budget(job_params->intermediate_memory_bytes());
   // Analyze op DAG to determine what inputs need to be pipped along
   // and when intermediates can be retired -- essentially liveness analysis
   perform_liveness_analysis(ops, analysis_results);
+  // Chains of CPU kernels that can share a batch loop
+  perform_fusion_analysis(ops, analysis_results);
   // The live columns at each op index
   std::vector<std::vector<std::tuple<i32, std::string>>>& live_columns =
       analysis_results.live_columns;
@@ -665,6 +1199,8 @@ grpc::Status WorkerImpl::NewJob(grpc::ServerContext* context,
 
   // Break up kernels into groups that run on the same device
   std::vector<OpArgGroup> groups;
+  // Per group -> per kernel -> whether it can have replicas on every GPU
+  std::vector<std::vector<bool>> replicable_kernels;
   if (!kernel_factories.empty()) {
     bool first_op = true;
     DeviceType last_device_type;
@@ -692,6 +1228,8 @@ grpc::Status WorkerImpl::NewJob(grpc::ServerContext* context,
       auto& cm = groups.back().column_mapping;
       auto& st = groups.back().kernel_stencils;
       auto& bt = groups.back().kernel_batch_sizes;
+      auto& fw = groups.back().fused_with_previous;
+      auto& fm = groups.back().fused_input_mapping;
       const std::string& op_name = ops.at(i).name();
       op_group.push_back(op_name);
       if (analysis_results.slice_ops.count(i) > 0) {
@@ -737,6 +1275,45 @@ grpc::Status WorkerImpl::NewJob(grpc::ServerContext* context,
       cm.push_back(column_mapping[i]);
       st.push_back(analysis_results.stencils[i]);
       bt.push_back(analysis_results.batch_sizes[i]);
+      groups.back().state_handoff_ops.push_back(
+          analysis_results.state_handoff_ops.count(i) > 0 ? (i64)i : -1);
+      bool reduces = analysis_results.reduce_ops.count(i) > 0;
+      groups.back().reduce_ops.push_back(reduces ? (i64)i : -1);
+      groups.back().warmup_sizes.push_back(
+          analysis_results.bounded_state_ops.count(i) > 0
+              ? analysis_results.warmup_sizes.at(i)
+              : 0);
+      // Fusion cannot cross kernel groups
+      bool fused =
+          group.size() > 1 && analysis_results.fused_ops.count(i) > 0;
+      fw.push_back(fused);
+      fm.push_back(fused ? analysis_results.fused_input_mapping.at(i)
+                         : std::vector<i32>());
+      // Holding back the last batch of a task is only safe when no other
+      // kernel in the group waits on it and the kernel does not care which
+      // task its rows come from
+      bool can_hold_batch =
+          group.size() == 1 && factory != nullptr && !reduces &&
+          analysis_results.batch_sizes[i] > 1 &&
+          analysis_results.stencils[i] == std::vector<i32>{0} &&
+          analysis_results.bounded_state_ops.count(i) == 0 &&
+          analysis_results.unbounded_state_ops.count(i) == 0;
+      groups.back().batch_deadline_ms =
+          can_hold_batch ? job_params->batch_deadline_ms() : 0;
+      groups.back().perf_counters = job_params->perf_counters();
+      groups.back().autotune_batch_sizes = job_params->autotune_batch_sizes();
+      // Replicas evaluate batches side by side, so only kernels that keep
+      // no state between batches are spread across GPUs
+      bool replicable =
+          job_params->replicate_gpu_kernels() && factory != nullptr &&
+          !reduces &&
+          factory->get_device_type() == DeviceType::GPU &&
+          factory->get_max_devices() == 1 &&
+          analysis_results.bounded_state_ops.count(i) == 0 &&
+          analysis_results.unbounded_state_ops.count(i) == 0;
+      replicable_kernels.resize(groups.size());
+      replicable_kernels.back().push_back(replicable);
+      groups.back().kernel_replica_devices.emplace_back();
     }
   }
 
@@ -760,7 +1337,9 @@ grpc::Status WorkerImpl::NewJob(grpc::ServerContext* context,
         KernelFactory* factory = std::get<0>(group[k]);
         DeviceType device_type = factory->get_device_type();
         i32 max_devices = factory->get_max_devices();
-        if (max_devices == Kernel::UnlimitedDevices) {
+        if (max_devices == Kernel::UnlimitedDevices ||
+            (replicable_kernels[kg][k] && num_gpus > 1)) {
+          // Already uses every device from one pipeline instance
           pipeline_instances_per_node = 1;
         } else {
           pipeline_instances_per_node =
@@ -802,30 +1381,205 @@ grpc::Status WorkerImpl::NewJob(grpc::ServerContext* context,
                    "Cannot oversubscribe GPUs and also use GPU memory pool");
       return grpc::Status::OK;
     }
+    std::unique_lock<std::mutex> lk(metrics_mutex_);
     if (memory_pool_initialized_) {
+      kernel_cache_.clear();
       destroy_memory_allocators();
     }
     init_memory_allocators(job_params->memory_pool_config(), gpu_ids);
     cached_memory_pool_config_ = job_params->memory_pool_config();
     memory_pool_initialized_ = true;
   }
+  // Pools persist across jobs, so only report exhaustion from this job
+  std::vector<DeviceHandle> pool_devices = {CPU_DEVICE};
+  for (i32 device_id : gpu_ids) {
+    pool_devices.push_back(DeviceHandle{DeviceType::GPU, device_id});
+  }
+  std::vector<i64> pool_exhausted_start;
+  std::vector<TransferStats> transfers_start;
+  for (DeviceHandle device : pool_devices) {
+    pool_exhausted_start.push_back(pool_exhausted_count(device));
+    transfers_start.push_back(device_transfer_stats(device));
+  }
+  reset_memory_pool_peaks();
+
+  // Admit only as many pipeline instances per GPU as the device memory their
+  // kernels declare leaves room for, since that memory is allocated outside
+  // the pool and oversubscribing it fails at random under load
+  if (num_gpus > 0 && job_params->gpu_memory_budget() >= 0) {
+    auto instance_memory = [&]() {
+      i64 bytes = 0;
+      for (i32 kg = 0; kg < num_kernel_groups; ++kg) {
+        auto& group = groups[kg].kernel_factories;
+        for (size_t k = 0; k < group.size(); ++k) {
+          KernelFactory* factory = std::get<0>(group[k]);
+          if (factory != nullptr &&
+              factory->get_device_type() == DeviceType::GPU) {
+            bytes += factory->device_memory(
+                groups[kg].kernel_batch_sizes[k]);
+          }
+        }
+      }
+      return bytes;
+    };
+    i64 budget = job_params->gpu_memory_budget();
+    if (budget == 0 && instance_memory() > 0) {
+      budget = std::numeric_limits<i64>::max();
+#ifdef HAVE_CUDA
+      for (i32 device_id : gpu_ids) {
+        size_t free_bytes;
+        size_t total_bytes;
+        CU_CHECK(cudaSetDevice(device_id));
+        CU_CHECK(cudaMemGetInfo(&free_bytes, &total_bytes));
+        budget = std::min(budget, (i64)free_bytes);
+      }
+#endif
+    }
+    // Shrink the batches of kernels whose memory grows with them until a
+    // single instance fits
+    bool shrunk = false;
+    while (instance_memory() > budget) {
+      bool changed = false;
+      for (i32 kg = 0; kg < num_kernel_groups; ++kg) {
+        auto& group = groups[kg].kernel_factories;
+        auto& batch_sizes = groups[kg].kernel_batch_sizes;
+        for (size_t k = 0; k < group.size(); ++k) {
+          KernelFactory* factory = std::get<0>(group[k]);
+          if (factory != nullptr &&
+              factory->get_device_type() == DeviceType::GPU &&
+              factory->device_memory_per_row() > 0 && batch_sizes[k] > 1) {
+            batch_sizes[k] /= 2;
+            changed = true;
+          }
+        }
+      }
+      if (!changed) {
+        break;
+      }
+      shrunk = true;
+    }
+    i64 need = instance_memory();
+    if (need > budget) {
+      LOG(WARNING) << "GPU kernels declare " << need
+                   << " bytes of device memory per pipeline instance, more "
+                      "than the budget of "
+                   << budget << " bytes per GPU";
+    } else if (need > 0) {
+      i64 admitted = std::max((i64)1, (budget / need) * num_gpus);
+      if (admitted < pipeline_instances_per_node) {
+        LOG(WARNING) << "Running " << admitted << " of "
+                     << pipeline_instances_per_node
+                     << " pipeline instances so that the device memory of "
+                        "their GPU kernels fits in "
+                     << budget << " bytes per GPU";
+        pipeline_instances_per_node = admitted;
+      }
+    }
+    if (shrunk) {
+      LOG(WARNING) << "Reduced the batch sizes of GPU kernels so that the "
+                      "device memory of a pipeline instance fits in "
+                   << budget << " bytes per GPU";
+    }
+  }
 
   omp_set_num_threads(std::thread::hardware_concurrency());
 
+  // With core partitioning, load, decode and save threads share a set of
+  // dedicated cores and the remaining cores are split between the kernel
+  // groups of every pipeline instance, so CPU kernels and their OpenMP pools
+  // do not compete with the decoders. Workers sharing a machine each take
+  // their own slice of the cores.
+  std::vector<i32> io_cpus;
+  std::vector<std::vector<std::vector<i32>>> kernel_group_cpus(
+      pipeline_instances_per_node,
+      std::vector<std::vector<i32>>(num_kernel_groups));
+  if (db_params_.partition_cores) {
+    std::vector<i32> cpus = split_cpus(process_cpus(), local_total, local_id);
+    i32 num_io_cores = db_params_.num_io_cores > 0
+                           ? db_params_.num_io_cores
+                           : std::max(1, (i32)cpus.size() / 4);
+    num_io_cores = std::min(num_io_cores, std::max(1, (i32)cpus.size() - 1));
+    io_cpus.assign(cpus.begin(), cpus.begin() + num_io_cores);
+    std::vector<i32> compute_cpus(cpus.begin() + num_io_cores, cpus.end());
+    if (compute_cpus.empty()) {
+      compute_cpus = io_cpus;
+    }
+    i32 num_partitions = pipeline_instances_per_node * num_kernel_groups;
+    for (i32 pu = 0; pu < pipeline_instances_per_node; ++pu) {
+      for (i32 kg = 0; kg < num_kernel_groups; ++kg) {
+        kernel_group_cpus[pu][kg] = split_cpus(
+            compute_cpus, num_partitions, pu * num_kernel_groups + kg);
+      }
+    }
+    VLOG(1) << "Worker " << node_id_ << " reserved " << io_cpus.size()
+            << " cores for IO and " << compute_cpus.size()
+            << " cores for " << num_partitions << " kernel groups";
+  }
+
+  // Software decoders thread over the cores decode runs on: the IO cores when
+  // cores are partitioned, this worker's share of the node otherwise. Their
+  // threads inherit the pre evaluate thread's affinity.
+  i32 decoder_threads = job_params->decoder_threads();
+  if (decoder_threads <= 0) {
+    i32 decode_cpus = db_params_.partition_cores
+                          ? (i32)io_cpus.size()
+                          : db_params_.num_cpus / local_total;
+    decoder_threads =
+        std::min(MAX_DECODER_THREADS,
+                 std::max(1, decode_cpus / pipeline_instances_per_node));
+  }
+  VLOG(1) << "Worker " << node_id_ << " using " << decoder_threads
+          << " threads per software decoder";
+  VideoDecoder::set_hardware_session_limit(
+      job_params->nvdec_sessions_per_gpu());
+
+  // Spread threads across NUMA nodes. Every thread of a pipeline instance runs
+  // on the same node so its buffers stay in that node's memory.
+  const bool numa_aware = job_params->memory_pool_config().numa_aware();
+  const i32 num_nodes = numa_aware ? num_numa_nodes() : 1;
+  auto numa_node_for = [&](i32 index) {
+    return numa_aware ? index % num_nodes : -1;
+  };
+
   // Setup shared resources for distributing work to processing threads
   i64 accepted_tasks = 0;
-  LoadInputQueue load_work;
-  std::vector<EvalQueue> initial_eval_work(pipeline_instances_per_node);
+  const QueueType queue_type = job_params->lock_free_queues()
+                                   ? QueueType::LockFree
+                                   : QueueType::Locked;
+  const i32 queue_size = 4;
+  LoadInputQueue load_work(queue_size, queue_type);
+  std::vector<EvalQueue> initial_eval_work;
+  initial_eval_work.reserve(pipeline_instances_per_node);
+  for (i32 pu = 0; pu < pipeline_instances_per_node; ++pu) {
+    initial_eval_work.emplace_back(queue_size, queue_type);
+  }
   std::vector<std::vector<EvalQueue>> eval_work(pipeline_instances_per_node);
-  OutputEvalQueue output_eval_work(pipeline_instances_per_node);
-  std::vector<SaveInputQueue> save_work(db_params_.num_save_workers);
-  SaveOutputQueue retired_tasks;
+  OutputEvalQueue output_eval_work(pipeline_instances_per_node, queue_type);
+  std::vector<SaveInputQueue> save_work;
+  save_work.reserve(db_params_.num_save_workers);
+  for (i32 i = 0; i < db_params_.num_save_workers; ++i) {
+    save_work.emplace_back(queue_size, queue_type);
+  }
+  SaveOutputQueue retired_tasks(queue_size, queue_type);
+  KernelStateStore kernel_states;
+  KernelStateStore reduced_states;
+  TaskSet cancelled_tasks;
+  // Copies of a task in a speculative job may run on several workers, so
+  // each writes its own files and only the master's pick moves them in place
+  StagedFiles staged_files;
+  WorkSignal eval_work_pushed;
+  // Tasks the load workers began, for the master to know which tasks were
+  // running if this worker dies
+  Queue<std::tuple<i64, i64>> started_tasks(std::numeric_limits<i32>::max());
+
+  const i64 profile_sample_period = job_params->profile_sample_period();
 
   // Setup load workers
   i32 num_load_workers = db_params_.num_load_workers;
   std::vector<Profiler> load_thread_profilers;
   for (i32 i = 0; i < num_load_workers; ++i) {
-    load_thread_profilers.emplace_back(Profiler(base_time));
+    load_thread_profilers.emplace_back(
+        Profiler(base_time, profile_sample_period));
   }
   std::vector<std::thread> load_threads;
   for (i32 i = 0; i < num_load_workers; ++i) {
@@ -834,10 +1588,18 @@ grpc::Status WorkerImpl::NewJob(grpc::ServerContext* context,
                         // Per worker arguments
                         i, db_params_.storage_config, load_thread_profilers[i],
                         job_params->load_sparsity_threshold(), io_packet_size,
-                        work_packet_size};
-
-    load_threads.emplace_back(load_driver, std::ref(load_work),
-                              std::ref(initial_eval_work), args);
+                        work_packet_size, &item_metadata_cache_,
+                        &block_cache_, &video_index_cache_, file_pool_.get(),
+                        job_params->perf_counters(), &intermediates_,
+                        job_params->gpu_direct_storage()};
+
+    load_threads.push_back(start_numa_thread(numa_node_for(i), io_cpus,
+                                             load_driver,
+                                             std::ref(load_work),
+                                             std::ref(initial_eval_work),
+                                             std::ref(eval_work_pushed),
+                                             std::cref(cancelled_tasks),
+                                             std::ref(started_tasks), args));
   }
 
   // Setup evaluate workers
@@ -846,6 +1608,37 @@ grpc::Status WorkerImpl::NewJob(grpc::ServerContext* context,
   std::vector<std::vector<proto::Result>> eval_results(
       pipeline_instances_per_node);
 
+  // Video columns that more than one job reads are decoded once per worker
+  // for all of them, as far as the cache holds their frames
+  std::unique_ptr<DecodedFrameCache> decoded_frame_cache;
+  if (job_params->decoded_frame_cache_size() > 0) {
+    std::map<std::tuple<i32, i32>, i32> column_jobs;
+    for (auto& job : jobs) {
+      std::set<std::tuple<i32, i32>> job_columns;
+      for (auto& column_input : job.inputs()) {
+        const TableMetadata& table = table_meta.at(column_input.table_name());
+        i32 column_id = table.column_id(column_input.column_name());
+        if (table.column_type(column_id) == ColumnType::Video) {
+          job_columns.insert(std::make_tuple(table.id(), column_id));
+        }
+      }
+      for (auto& column : job_columns) {
+        column_jobs[column]++;
+      }
+    }
+    std::set<std::tuple<i32, i32>> shared_columns;
+    for (auto& kv : column_jobs) {
+      if (kv.second > 1) {
+        shared_columns.insert(kv.first);
+      }
+    }
+    if (!shared_columns.empty()) {
+      decoded_frame_cache.reset(
+          new DecodedFrameCache(job_params->decoded_frame_cache_size()));
+      decoded_frame_cache->set_shared_columns(shared_columns);
+    }
+  }
+
   std::vector<std::tuple<EvalQueue*, EvalQueue*>> pre_eval_queues;
   std::vector<PreEvaluateWorkerArgs> pre_eval_args;
   std::vector<std::vector<std::tuple<EvalQueue*, EvalQueue*>>> eval_queues(
@@ -861,17 +1654,29 @@ grpc::Status WorkerImpl::NewJob(grpc::ServerContext* context,
   std::condition_variable startup_cv;
   i32 startup_count = 0;
   i32 eval_total = 0;
+  KernelCache* kernel_cache = nullptr;
+  if (job_params->keep_kernels_warm()) {
+    kernel_cache_.evict_mismatched(kernel_factories, kernel_configs);
+    kernel_cache = &kernel_cache_;
+  } else {
+    kernel_cache_.clear();
+  }
   for (i32 ki = 0; ki < pipeline_instances_per_node; ++ki) {
     auto& work_queues = eval_work[ki];
     std::vector<Profiler>& eval_thread_profilers = eval_profilers[ki];
     std::vector<proto::Result>& results = eval_results[ki];
-    work_queues.resize(num_kernel_groups - 1 + 2);  // +2 for pre/post
+    // +2 for pre/post
+    work_queues.reserve(num_kernel_groups - 1 + 2);
+    for (i32 i = 0; i < num_kernel_groups - 1 + 2; ++i) {
+      work_queues.emplace_back(queue_size, queue_type);
+    }
     results.resize(num_kernel_groups);
     for (auto& result : results) {
       result.set_success(true);
     }
     for (i32 i = 0; i < num_kernel_groups + 2; ++i) {
-      eval_thread_profilers.push_back(Profiler(base_time));
+      eval_thread_profilers.push_back(
+          Profiler(base_time, profile_sample_period));
     }
 
     // Evaluate worker
@@ -909,11 +1714,21 @@ grpc::Status WorkerImpl::NewJob(grpc::ServerContext* context,
         }
       } else {
         for (i32 i = 0; i < max_devices; ++i) {
-          i32 device_id = gpu_ids[next_gpu_idx++ % num_gpus];
+          i32 gpu_idx = next_gpu_idx++ % num_gpus;
+          i32 device_id = gpu_ids[gpu_idx];
           for (size_t i = 0; i < group.size(); ++i) {
             KernelConfig& config = std::get<1>(group[i]);
             config.devices.clear();
             config.devices.push_back({device_type, device_id});
+            // Replicas on the other GPUs, starting from this instance's
+            auto& replica_devices = groups[kg].kernel_replica_devices[i];
+            replica_devices.clear();
+            if (replicable_kernels[kg][i] && num_gpus > 1) {
+              for (i32 g = 0; g < num_gpus; ++g) {
+                replica_devices.push_back(
+                    {device_type, gpu_ids[(gpu_idx + g) % num_gpus]});
+              }
+            }
           }
         }
       }
@@ -929,9 +1744,15 @@ grpc::Status WorkerImpl::NewJob(grpc::ServerContext* context,
       // Create eval thread for passing data through neural net
       thread_qs.push_back(
           std::make_tuple(input_work_queue, output_work_queue));
+      // Instances past the listed priorities get the default one
+      groups[kg].stream_priority =
+          ki < job_params->gpu_stream_priorities_size()
+              ? job_params->gpu_stream_priorities(ki)
+              : 0;
       thread_args.emplace_back(EvaluateWorkerArgs{
           // Uniform arguments
-          node_id_, startup_lock, startup_cv, startup_count,
+          node_id_, startup_lock, startup_cv, startup_count, kernel_cache,
+          &kernel_states, &reduced_states,
 
           // Per worker arguments
           ki, kg, groups[kg], eval_thread_profilers[kg + 1], results[kg]});
@@ -956,6 +1777,9 @@ grpc::Status WorkerImpl::NewJob(grpc::ServerContext* context,
       pre_eval_args.emplace_back(PreEvaluateWorkerArgs{
           // Uniform arguments
           node_id_, num_cpus, job_params->work_packet_size(),
+          decoder_threads, job_params->qsv_async_depth(),
+          job_params->interval_decoders(), decoded_frame_cache.get(),
+          job_params->perf_counters(),
 
           // Per worker arguments
           ki, decoder_type, eval_thread_profilers.front(),
@@ -981,6 +1805,7 @@ grpc::Status WorkerImpl::NewJob(grpc::ServerContext* context,
           // Per worker arguments
           ki, eval_thread_profilers.back(), column_mapping.back(),
           final_output_columns, final_compression_options,
+          job_params->gpu_resident(), job_params->encode_segments(),
       });
     }
   }
@@ -989,23 +1814,37 @@ grpc::Status WorkerImpl::NewJob(grpc::ServerContext* context,
   std::vector<std::thread> pre_eval_threads;
   std::vector<std::vector<std::thread>> eval_threads;
   std::vector<std::thread> post_eval_threads;
+  // Idle pipeline instances steal whole queued tasks from their siblings.
+  // Stealing inspects the queue contents, so it needs the locked queues.
+  std::vector<EvalQueue*> steal_queues;
+  if (distribute_work_dynamically && job_params->work_stealing() &&
+      queue_type == QueueType::Locked && pipeline_instances_per_node > 1) {
+    for (EvalQueue& queue : initial_eval_work) {
+      steal_queues.push_back(&queue);
+    }
+  }
   for (i32 pu = 0; pu < pipeline_instances_per_node; ++pu) {
+    i32 numa_node = numa_node_for(pu);
     // Pre thread
-    pre_eval_threads.emplace_back(
-        pre_evaluate_driver, std::ref(*std::get<0>(pre_eval_queues[pu])),
-        std::ref(*std::get<1>(pre_eval_queues[pu])), pre_eval_args[pu]);
+    pre_eval_threads.push_back(start_numa_thread(
+        numa_node, io_cpus, pre_evaluate_driver,
+        std::ref(*std::get<0>(pre_eval_queues[pu])),
+        std::ref(*std::get<1>(pre_eval_queues[pu])), steal_queues,
+        std::ref(eval_work_pushed), pre_eval_args[pu]));
     // Op threads
     eval_threads.emplace_back();
     std::vector<std::thread>& threads = eval_threads.back();
     for (i32 kg = 0; kg < num_kernel_groups; ++kg) {
-      threads.emplace_back(
-          evaluate_driver, std::ref(*std::get<0>(eval_queues[pu][kg])),
-          std::ref(*std::get<1>(eval_queues[pu][kg])), eval_args[pu][kg]);
+      threads.push_back(start_numa_thread(
+          numa_node, kernel_group_cpus[pu][kg], evaluate_driver,
+          std::ref(*std::get<0>(eval_queues[pu][kg])),
+          std::ref(*std::get<1>(eval_queues[pu][kg])), eval_args[pu][kg]));
     }
     // Post threads
-    post_eval_threads.emplace_back(
-        post_evaluate_driver, std::ref(*std::get<0>(post_eval_queues[pu])),
-        std::ref(*std::get<1>(post_eval_queues[pu])), post_eval_args[pu]);
+    post_eval_threads.push_back(start_numa_thread(
+        numa_node, io_cpus, post_evaluate_driver,
+        std::ref(*std::get<0>(post_eval_queues[pu])),
+        std::ref(*std::get<1>(post_eval_queues[pu])), post_eval_args[pu]));
   }
 
   // Setup save coordinator
@@ -1016,7 +1855,8 @@ grpc::Status WorkerImpl::NewJob(grpc::ServerContext* context,
   i32 num_save_workers = db_params_.num_save_workers;
   std::vector<Profiler> save_thread_profilers;
   for (i32 i = 0; i < num_save_workers; ++i) {
-    save_thread_profilers.emplace_back(Profiler(base_time));
+    save_thread_profilers.emplace_back(
+        Profiler(base_time, profile_sample_period));
   }
   std::vector<std::thread> save_threads;
   for (i32 i = 0; i < num_save_workers; ++i) {
@@ -1024,10 +1864,22 @@ grpc::Status WorkerImpl::NewJob(grpc::ServerContext* context,
                         node_id_,
 
                         // Per worker arguments
-                        i, db_params_.storage_config, save_thread_profilers[i]};
-
-    save_threads.emplace_back(save_driver, std::ref(save_work[i]),
-                              std::ref(retired_tasks), args);
+                        i, db_params_.storage_config, save_thread_profilers[i],
+                        job_params->save_buffer_size(),
+                        std::vector<proto::OutputColumnCompression>(
+                            job_params->compression().begin(),
+                            job_params->compression().end()),
+                        job_params->ephemeral_outputs(), &intermediates_,
+                        job_params->packed_outputs(),
+                        !analysis_results.reduce_ops.empty(),
+                        job_params->speculative_execution() ? &staged_files
+                                                            : nullptr};
+
+    save_threads.push_back(start_numa_thread(numa_node_for(i), io_cpus,
+                                             save_driver,
+                                             std::ref(save_work[i]),
+                                             std::ref(retired_tasks),
+                                             std::cref(cancelled_tasks), args));
   }
 
   if (job_params->profiling()) {
@@ -1040,25 +1892,331 @@ grpc::Status WorkerImpl::NewJob(grpc::ServerContext* context,
 
   timepoint_t start_time = now();
 
+  // Every load, evaluate and save thread is a thread of the node's trace
+  i32 job_id = meta.get_bulk_job_id(job_params->job_name());
+  TraceWriter trace_writer(node_id_);
+  auto thread_name = [&](const std::string& type, i32 worker,
+                         const std::string& tag) {
+    char name[64];
+    snprintf(name, sizeof(name), "%s_%02d_%02d", type.c_str(), node_id_,
+             worker);
+    return std::string(name) + (tag.empty() ? "" : "_" + tag);
+  };
+  for (i32 i = 0; i < num_load_workers; ++i) {
+    trace_writer.add_thread(thread_name("load", i, ""),
+                            &load_thread_profilers[i]);
+  }
+  for (i32 pu = 0; pu < pipeline_instances_per_node; ++pu) {
+    size_t num_stages = eval_profilers[pu].size();
+    for (size_t s = 0; s < num_stages; ++s) {
+      std::string tag = s == 0 ? "pre"
+                               : s + 1 == num_stages
+                                     ? "post"
+                                     : "eval_" + std::to_string(s - 1);
+      trace_writer.add_thread(thread_name("eval", pu, tag),
+                              &eval_profilers[pu][s]);
+    }
+  }
+  for (i32 i = 0; i < num_save_workers; ++i) {
+    trace_writer.add_thread(thread_name("save", i, ""),
+                            &save_thread_profilers[i]);
+  }
+  // Streams new events while the job runs so a job that stops making
+  // progress can be looked at before it ends
+  std::atomic<bool> trace_streaming(true);
+  std::thread trace_stream_thread;
+  i32 trace_stream_interval_ms = job_params->trace_stream_interval_ms();
+  if (trace_stream_interval_ms > 0) {
+    trace_stream_thread = std::thread([&, job_id, trace_stream_interval_ms]() {
+      std::unique_ptr<storehouse::StorageBackend> storage(
+          storehouse::StorageBackend::make_from_config(
+              db_params_.storage_config));
+      i32 chunk = 0;
+      auto last_write = now();
+      bool streaming = true;
+      while (streaming) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(
+            std::min(trace_stream_interval_ms, 100)));
+        streaming = trace_streaming.load();
+        if (streaming &&
+            nano_since(last_write) < trace_stream_interval_ms * 1000000.0) {
+          continue;
+        }
+        last_write = now();
+        std::string events = trace_writer.events();
+        std::unique_ptr<WriteFile> chunk_file;
+        StoreResult result;
+        EXP_BACKOFF(make_unique_write_file(
+                        storage.get(),
+                        bulk_job_trace_chunk_path(job_id, node_id_, chunk),
+                        chunk_file),
+                    result);
+        if (result == StoreResult::Success) {
+          // A failed chunk should not take the job down
+          EXP_BACKOFF(
+              chunk_file->append(events.size(), (const u8*)events.data()),
+              result);
+        }
+        if (result == StoreResult::Success) {
+          EXP_BACKOFF(chunk_file->save(), result);
+        }
+        LOG_IF(WARNING, result != StoreResult::Success)
+            << "Worker " << node_id_ << " could not write trace chunk "
+            << chunk;
+        chunk++;
+      }
+    });
+  }
+
   // Monitor amount of work left and request more when running low
   // Round robin work
   std::vector<i64> allocated_work_to_queues(pipeline_instances_per_node);
+  // Last task given to each pipeline instance. The next task of the same
+  // job goes to the same instance when it is not much busier than the
+  // others, so kernels with bounded state can carry their warmup over.
+  std::vector<std::tuple<i64, i64>> last_queued_tasks(
+      pipeline_instances_per_node, std::make_tuple(-1, -1));
+  const bool prefer_task_affinity = !analysis_results.bounded_state_ops.empty();
   std::vector<i64> retired_work_for_queues(pipeline_instances_per_node);
+  // Queue each task was allocated to. A stolen task retires on the instance
+  // that stole it, but is charged back to the queue it was taken from.
+  std::map<std::tuple<i64, i64>, i32> task_work_queues;
+  // Autotuning only changes how many tasks are kept queued during this job.
+  // The other parameters fix the shape of the pipeline and the table layout,
+  // so they are reported to the master for later runs.
+  i32 tasks_in_queue_per_pu = job_params->tasks_in_queue_per_pu();
+  bool tuned = !job_params->autotune();
+  std::atomic<i64> tasks_retired(0);
+  // Retired tasks covered by the last op profile report
+  i64 profiled_tasks = 0;
+
+  // Exposed to the metrics server until the job's queues and profilers go
+  // out of scope
+  {
+    std::unique_lock<std::mutex> lk(metrics_mutex_);
+    job_metrics_ = [&](MetricsWriter& writer) {
+      writer.family("scanner_worker_tasks_retired_total", "counter",
+                    "Tasks this worker finished in the current bulk job");
+      writer.sample("scanner_worker_tasks_retired_total", tasks_retired);
+
+      writer.family("scanner_worker_queue_depth", "gauge",
+                    "Work entries waiting in each pipeline queue");
+      writer.sample("scanner_worker_queue_depth", load_work.size(),
+                    {{"stage", "load"}});
+      for (size_t pu = 0; pu < initial_eval_work.size(); ++pu) {
+        writer.sample("scanner_worker_queue_depth",
+                      initial_eval_work[pu].size(),
+                      {{"stage", "pre"}, {"instance", std::to_string(pu)}});
+        for (size_t q = 0; q < eval_work[pu].size(); ++q) {
+          writer.sample("scanner_worker_queue_depth", eval_work[pu][q].size(),
+                        {{"stage", "eval_" + std::to_string(q)},
+                         {"instance", std::to_string(pu)}});
+        }
+      }
+      writer.sample("scanner_worker_queue_depth", output_eval_work.size(),
+                    {{"stage", "post"}});
+      for (size_t i = 0; i < save_work.size(); ++i) {
+        writer.sample("scanner_worker_queue_depth", save_work[i].size(),
+                      {{"stage", "save"}, {"thread", std::to_string(i)}});
+      }
+      writer.sample("scanner_worker_queue_depth", retired_tasks.size(),
+                    {{"stage", "retired"}});
+
+      f64 elapsed_s = nano_since(start_time) / 1e9;
+      writer.family("scanner_worker_op_rows_total", "counter",
+                    "Rows each op evaluated on this worker in the current "
+                    "bulk job");
+      std::map<std::string, f64> op_rates;
+      for (const proto::Op& op : ops) {
+        if (is_builtin_op(op.name())) {
+          continue;
+        }
+        std::string key = op_profile_key(op.name(), op.device_type());
+        if (op_rates.count(key) > 0) {
+          continue;
+        }
+        i64 rows = 0;
+        for (auto& instance_profilers : eval_profilers) {
+          for (Profiler& profiler : instance_profilers) {
+            rows += profiler.counter("op_rows:" + key);
+          }
+        }
+        op_rates[key] = elapsed_s > 0 ? rows / elapsed_s : 0;
+        writer.sample("scanner_worker_op_rows_total", rows,
+                      {{"op", op.name()},
+                       {"device", proto::DeviceType_Name(op.device_type())}});
+      }
+      writer.family("scanner_worker_op_rows_per_second", "gauge",
+                    "Rows each op evaluated per second since the bulk job "
+                    "started");
+      for (auto& kv : op_rates) {
+        size_t split = kv.first.rfind(':');
+        writer.sample("scanner_worker_op_rows_per_second", kv.second,
+                      {{"op", kv.first.substr(0, split)},
+                       {"device", kv.first.substr(split + 1)}});
+      }
+
+      i64 frames_decoded = 0;
+      for (auto& instance_profilers : eval_profilers) {
+        frames_decoded += instance_profilers.front().counter("frames_decoded");
+      }
+      writer.family("scanner_worker_frames_decoded_total", "counter",
+                    "Video frames decoded in the current bulk job");
+      writer.sample("scanner_worker_frames_decoded_total", frames_decoded);
+      writer.family("scanner_worker_decode_fps", "gauge",
+                    "Video frames decoded per second since the bulk job "
+                    "started");
+      writer.sample("scanner_worker_decode_fps",
+                    elapsed_s > 0 ? frames_decoded / elapsed_s : 0);
+    };
+  }
+  struct ClearJobMetrics {
+    WorkerImpl* worker;
+    ~ClearJobMetrics() {
+      std::unique_lock<std::mutex> lk(worker->metrics_mutex_);
+      worker->job_metrics_ = nullptr;
+    }
+  } clear_job_metrics{this};
+  i32 max_pipeline_instances = db_params_.num_cpus / local_total;
+  for (auto& group : groups) {
+    for (auto& factory : group.kernel_factories) {
+      if (std::get<0>(factory) != nullptr &&
+          std::get<0>(factory)->get_device_type() == DeviceType::GPU) {
+        max_pipeline_instances = std::max(1, num_gpus);
+      }
+    }
+  }
+  // Grants, completions and heartbeats share one stream to the master, so
+  // finishing a task and being granted the next is a single message each way
+  grpc::ClientContext work_stream_context;
+  std::unique_ptr<
+      grpc::ClientReaderWriter<proto::WorkerMessage, proto::MasterMessage>>
+      work_stream(master_->WorkStream(&work_stream_context));
+  Queue<proto::NewWorkBatch> granted_work(std::numeric_limits<i32>::max());
+  Queue<std::tuple<i64, i64>> cancelled_work(
+      std::numeric_limits<i32>::max());
+  Queue<std::tuple<i64, i64>> commit_work(std::numeric_limits<i32>::max());
+  std::atomic<bool> work_stream_open(true);
+  std::thread work_stream_reader([&] {
+    proto::MasterMessage message;
+    while (work_stream->Read(&message)) {
+      for (const proto::JobTask& task : message.cancelled()) {
+        cancelled_tasks.add(task.job_id(), task.task_id());
+        cancelled_work.push(std::make_tuple(task.job_id(), task.task_id()));
+      }
+      for (const proto::JobTask& task : message.commit()) {
+        commit_work.push(std::make_tuple(task.job_id(), task.task_id()));
+      }
+      granted_work.push(message.batch());
+    }
+    work_stream_open = false;
+  });
+  // Set once the master cancelled a task this worker still had queued, whose
+  // leftover work is flushed rather than run once the job is done
+  bool cancelled_in_flight = false;
+  // Tasks asked for that the master has not granted yet
+  i32 requested_tasks = 0;
+  timepoint_t last_message_time = now();
   bool finished = false;
+  // Hand unfinished tasks back so the master can grant them elsewhere
+  // without waiting to notice this worker is gone
+  auto return_unfinished_tasks = [&]() {
+    if (task_work_queues.empty()) {
+      return;
+    }
+    grpc::ClientContext context;
+    proto::ReturnWorkParameters params;
+    proto::Empty empty;
+    params.set_node_id(node_id_);
+    for (auto& kv : task_work_queues) {
+      proto::JobTask* task = params.add_tasks();
+      task->set_job_id(std::get<0>(kv.first));
+      task->set_task_id(std::get<1>(kv.first));
+    }
+    grpc::Status status = master_->ReturnWork(&context, params, &empty);
+    LOG_IF(WARNING, !status.ok())
+        << "Worker " << node_id_ << " could not return its queued tasks: "
+        << status.error_message();
+  };
+  // Draining ended the job before its tasks were all done
+  bool drained = false;
   while (true) {
     if (trigger_shutdown_.raised()) {
       // Abandon ship!
       VLOG(1) << "Worker " << node_id_ << " received shutdown while in NewJob";
       RESULT_ERROR(job_result, "Worker %d shutdown while processing NewJob",
                    node_id_);
+      return_unfinished_tasks();
       break;
     }
+    proto::WorkerMessage message;
+    message.set_node_id(node_id_);
+
+    // Cancelled tasks count as processed, so the job does not wait for
+    // them. What they still have in the pipeline is dropped.
+    std::tuple<i64, i64> cancelled_task;
+    while (cancelled_work.try_pop(cancelled_task)) {
+      // Files the task already saved are those of a losing attempt
+      for (auto& file : staged_files.take(std::get<0>(cancelled_task),
+                                          std::get<1>(cancelled_task))) {
+        storage_->delete_file(std::get<0>(file));
+      }
+      auto it = task_work_queues.find(cancelled_task);
+      if (it != task_work_queues.end()) {
+        VLOG(1) << "Worker " << node_id_ << " dropping cancelled task ("
+                << std::get<0>(cancelled_task) << ", "
+                << std::get<1>(cancelled_task) << ")";
+        retired_work_for_queues[it->second] += 1;
+        task_work_queues.erase(it);
+        cancelled_in_flight = true;
+      }
+    }
+
+    // Winning attempts move their files over the final paths, and the task
+    // is done once the master hears they are in place
+    std::tuple<i64, i64> commit_task;
+    bool committed = false;
+    while (commit_work.try_pop(commit_task)) {
+      for (auto& file : staged_files.take(std::get<0>(commit_task),
+                                          std::get<1>(commit_task))) {
+        move_file(storage_, std::get<0>(file), std::get<1>(file));
+      }
+      proto::JobTask* task = message.add_committed();
+      task->set_job_id(std::get<0>(commit_task));
+      task->set_task_id(std::get<1>(commit_task));
+      auto it = task_work_queues.find(commit_task);
+      if (it != task_work_queues.end()) {
+        retired_work_for_queues[it->second] += 1;
+        task_work_queues.erase(it);
+      }
+      committed = true;
+    }
+    if (committed) {
+      std::fflush(NULL);
+      sync();
+    }
+
+    std::tuple<i64, i64> started_task;
+    while (started_tasks.try_pop(started_task)) {
+      proto::JobTask* task = message.add_started();
+      task->set_job_id(std::get<0>(started_task));
+      task->set_task_id(std::get<1>(started_task));
+    }
+
     // We batch up retired tasks to avoid sync overhead
     std::vector<std::tuple<i32, i64, i64>> batched_retired_tasks;
     while (retired_tasks.size() > 0) {
       // Pull retired tasks
       std::tuple<i32, i64, i64> task_retired;
       retired_tasks.pop(task_retired);
+      if (cancelled_tasks.contains(std::get<1>(task_retired),
+                                   std::get<2>(task_retired))) {
+        for (auto& file : staged_files.take(std::get<1>(task_retired),
+                                            std::get<2>(task_retired))) {
+          storage_->delete_file(std::get<0>(file));
+        }
+        continue;
+      }
       batched_retired_tasks.push_back(task_retired);
     }
     if (!batched_retired_tasks.empty()) {
@@ -1068,68 +2226,81 @@ grpc::Status WorkerImpl::NewJob(grpc::ServerContext* context,
     }
     for (std::tuple<i32, i64, i64>& task_retired : batched_retired_tasks) {
       // Inform master that this task was finished
-      grpc::ClientContext context;
-      proto::FinishedWorkParameters params;
-      proto::Empty empty;
-
-      params.set_node_id(node_id_);
-      params.set_job_id(std::get<1>(task_retired));
-      params.set_task_id(std::get<2>(task_retired));
-      grpc::Status status = master_->FinishedWork(&context, params, &empty);
-
-      if (!status.ok()) {
-        RESULT_ERROR(job_result,
-                     "Worker %d could not tell finished work to master",
-                     node_id_);
-        break;
+      proto::FinishedWorkParameters* params = message.add_finished();
+      params->set_node_id(node_id_);
+      params->set_job_id(std::get<1>(task_retired));
+      params->set_task_id(std::get<2>(task_retired));
+      for (proto::KernelState& state : kernel_states.take(
+               std::get<1>(task_retired), std::get<2>(task_retired))) {
+        params->add_kernel_states()->Swap(&state);
+      }
+      for (proto::KernelState& state : reduced_states.take(
+               std::get<1>(task_retired), std::get<2>(task_retired))) {
+        params->add_reduced_states()->Swap(&state);
+      }
+      tasks_retired++;
+      if (!tuned && tasks_retired >= AUTOTUNE_WARMUP_TASKS_PER_PU *
+                                          pipeline_instances_per_node) {
+        proto::TunedParameters tuning = tune_pipeline_parameters(
+            pipeline_instances_per_node, max_pipeline_instances,
+            io_packet_size, work_packet_size, tasks_in_queue_per_pu,
+            tasks_retired, (i64)nano_since(start_time), load_thread_profilers,
+            eval_profilers, save_thread_profilers);
+        VLOG(1) << "Worker " << node_id_ << " tuned pipeline: "
+                << tuning.ShortDebugString();
+        tasks_in_queue_per_pu = tuning.tasks_in_queue_per_pu();
+        params->mutable_tuned_parameters()->CopyFrom(tuning);
+        tuned = true;
+      }
+
+      if (job_params->speculative_execution()) {
+        // Processed once the master picked this attempt and its files are
+        // in place, or it was cancelled
+        continue;
       }
 
       // Update how much is in each pipeline instances work queue
-      retired_work_for_queues[std::get<0>(task_retired)] += 1;
+      auto task_key =
+          std::make_tuple(std::get<1>(task_retired), std::get<2>(task_retired));
+      auto it = task_work_queues.find(task_key);
+      if (it != task_work_queues.end()) {
+        retired_work_for_queues[it->second] += 1;
+        task_work_queues.erase(it);
+      } else {
+        retired_work_for_queues[std::get<0>(task_retired)] += 1;
+      }
     }
     i64 total_tasks_processed = 0;
     for (i64 t : retired_work_for_queues) {
       total_tasks_processed += t;
     }
-    if (finished) {
-      if (total_tasks_processed == accepted_tasks) {
-        break;
-      } else {
-        std::this_thread::yield();
-        continue;
-      }
-    }
-    i32 local_work = accepted_tasks - total_tasks_processed;
-    if (local_work <
-        pipeline_instances_per_node * job_params->tasks_in_queue_per_pu()) {
-      grpc::ClientContext context;
-      proto::NodeInfo node_info;
-      proto::NewWork new_work;
-
-      node_info.set_node_id(node_id_);
-      grpc::Status status = master_->NextWork(&context, node_info, &new_work);
-      if (!status.ok()) {
-        RESULT_ERROR(job_result,
-                     "Worker %d could not get next work from master", node_id_);
-        break;
-      }
 
-      if (new_work.no_more_work()) {
-        // No more work left
-        VLOG(1) << "Node " << node_id_ << " received done signal.";
-        finished = true;
-      } else {
+    proto::NewWorkBatch new_work_batch;
+    while (granted_work.try_pop(new_work_batch)) {
+      requested_tasks -= new_work_batch.work_size();
+      for (const proto::NewWork& new_work : new_work_batch.work()) {
         // Perform analysis on load work entry to determine upstream
         // requirements and when to discard elements.
         std::deque<TaskStream> task_stream;
         LoadWorkEntry stenciled_entry;
+        std::map<i64, i64> state_start_rows;
+        for (const proto::KernelState& state : new_work.kernel_states()) {
+          state_start_rows[state.op_index()] = state.next_row();
+        }
         derive_stencil_requirements(
             meta, table_meta, jobs.at(new_work.job_index()), ops,
             analysis_results, job_params->boundary_condition(),
             new_work.table_id(), new_work.job_index(), new_work.task_index(),
-            std::vector<i64>(new_work.output_rows().begin(),
-                             new_work.output_rows().end()),
-            stenciled_entry, task_stream);
+            task_output_rows(new_work),
+            stenciled_entry, task_stream, state_start_rows);
+        // Streams start after the input op
+        for (const proto::KernelState& state : new_work.kernel_states()) {
+          TaskStream& stream = task_stream.at(state.op_index() - 1);
+          if (stream.resume_state) {
+            stream.initial_state.assign(state.state().begin(),
+                                        state.state().end());
+          }
+        }
 
         // Determine which worker to allocate to
         i32 target_work_queue = -1;
@@ -1142,11 +2313,83 @@ grpc::Status WorkerImpl::NewJob(grpc::ServerContext* context,
             target_work_queue = i;
           }
         }
+        if (prefer_task_affinity) {
+          auto previous_task = std::make_tuple((i64)new_work.job_index(),
+                                               new_work.task_index() - 1);
+          for (int i = 0; i < pipeline_instances_per_node; ++i) {
+            i64 outstanding_work =
+                allocated_work_to_queues[i] - retired_work_for_queues[i];
+            if (last_queued_tasks[i] == previous_task &&
+                outstanding_work <= min_work + 1) {
+              target_work_queue = i;
+              break;
+            }
+          }
+        }
+        last_queued_tasks[target_work_queue] = std::make_tuple(
+            (i64)new_work.job_index(), (i64)new_work.task_index());
         load_work.push(
             std::make_tuple(target_work_queue, task_stream, stenciled_entry));
         allocated_work_to_queues[target_work_queue]++;
+        task_work_queues[std::make_tuple(new_work.job_index(),
+                                         new_work.task_index())] =
+            target_work_queue;
         accepted_tasks++;
       }
+
+      if (new_work_batch.no_more_work()) {
+        // No more work left
+        VLOG(1) << "Node " << node_id_ << " received done signal.";
+        finished = true;
+      }
+    }
+
+    if (!finished && !draining_) {
+      i32 local_work = accepted_tasks - total_tasks_processed;
+      i32 wanted_work = pipeline_instances_per_node * tasks_in_queue_per_pu -
+                        local_work - requested_tasks;
+      if (wanted_work > 0) {
+        message.set_wanted_tasks(wanted_work);
+        requested_tasks += wanted_work;
+      }
+    }
+    bool last_message = finished && total_tasks_processed == accepted_tasks;
+    if (tasks_retired >= profiled_tasks + OP_PROFILE_REPORT_TASKS ||
+        (last_message && tasks_retired > profiled_tasks)) {
+      collect_op_profiles(ops, eval_profilers, message);
+      profiled_tasks = tasks_retired;
+    }
+    // Idle workers still send heartbeats, which also let the master retry
+    // requests it could not fill, e.g. to hand out speculative copies
+    if (message.finished_size() > 0 || message.wanted_tasks() > 0 ||
+        message.op_profiles_size() > 0 || message.started_size() > 0 ||
+        message.committed_size() > 0 ||
+        nano_since(last_message_time) >= WORK_STREAM_HEARTBEAT_MS * 1000000) {
+      if (!work_stream->Write(message)) {
+        RESULT_ERROR(job_result, "Worker %d could not talk to master",
+                     node_id_);
+        break;
+      }
+      last_message_time = now();
+    }
+    if (!work_stream_open && !finished) {
+      RESULT_ERROR(job_result, "Worker %d lost its work stream to master",
+                   node_id_);
+      break;
+    }
+    if (last_message) {
+      break;
+    }
+    if (draining_ && (accepted_tasks == total_tasks_processed ||
+                      std::chrono::duration_cast<std::chrono::nanoseconds>(
+                          now().time_since_epoch())
+                              .count() >= drain_deadline_ns_)) {
+      VLOG(1) << "Worker " << node_id_ << " drained with "
+              << accepted_tasks - total_tasks_processed
+              << " tasks unfinished";
+      return_unfinished_tasks();
+      drained = true;
+      break;
     }
 
     for (size_t i = 0; i < eval_results.size(); ++i) {
@@ -1168,11 +2411,18 @@ grpc::Status WorkerImpl::NewJob(grpc::ServerContext* context,
 
     std::this_thread::yield();
   }
+  work_stream->WritesDone();
+  work_stream_reader.join();
+  work_stream->Finish();
+  if (trace_stream_thread.joinable()) {
+    trace_streaming = false;
+    trace_stream_thread.join();
+  }
 
-  // If the job failed, can't expect queues to have drained, so
-  // attempt to flush all queues here (otherwise we could block
+  // If the job failed or was drained, can't expect queues to have drained,
+  // so attempt to flush all queues here (otherwise we could block
   // on pushing into a queue)
-  if (!job_result->success()) {
+  if (!job_result->success() || drained || cancelled_in_flight) {
     load_work.clear();
     for (i32 pu = 0; pu < pipeline_instances_per_node; ++pu) {
       initial_eval_work[pu].clear();
@@ -1230,6 +2480,7 @@ grpc::Status WorkerImpl::NewJob(grpc::ServerContext* context,
       push_exit_message(initial_eval_work[0]);
     }
   }
+  eval_work_pushed.notify();
 
   for (i32 i = 0; i < pipeline_instances_per_node; ++i) {
     // Wait until pre eval has finished
@@ -1247,6 +2498,9 @@ grpc::Status WorkerImpl::NewJob(grpc::ServerContext* context,
     }
   }
 
+  // Only keep the kernels this job used warm for the next one
+  kernel_cache_.evict_unused();
+
   // Terminate post eval threads
   for (i32 pu = 0; pu < pipeline_instances_per_node; ++pu) {
     push_exit_message(eval_work[pu].back());
@@ -1269,6 +2523,15 @@ grpc::Status WorkerImpl::NewJob(grpc::ServerContext* context,
     save_threads[i].join();
   }
 
+  for (size_t i = 0; i < pool_devices.size(); ++i) {
+    i64 exhausted =
+        pool_exhausted_count(pool_devices[i]) - pool_exhausted_start[i];
+    LOG_IF(WARNING, exhausted > 0)
+        << "Worker " << node_id_ << " found the " << pool_devices[i]
+        << " memory pool exhausted on " << exhausted
+        << " allocations. Consider increasing the pool size.";
+  }
+
   // Ensure all files are flushed
   if (job_params->profiling()) {
     std::fflush(NULL);
@@ -1284,7 +2547,6 @@ grpc::Status WorkerImpl::NewJob(grpc::ServerContext* context,
 
   // Execution done, write out profiler intervals for each worker
   // TODO: job_name -> job_id?
-  i32 job_id = meta.get_bulk_job_id(job_params->job_name());
   std::string profiler_file_name = bulk_job_profiler_path(job_id, node_id_);
   std::unique_ptr<WriteFile> profiler_output;
   BACKOFF_FAIL(
@@ -1346,8 +2608,80 @@ grpc::Status WorkerImpl::NewJob(grpc::ServerContext* context,
                            save_thread_profilers[i]);
   }
 
+  // Memory telemetry as counters prefixed by device, e.g. "gpu0:live_blocks"
+  Profiler memory_profiler(base_time);
+  for (size_t d = 0; d < pool_devices.size(); ++d) {
+    DeviceHandle device = pool_devices[d];
+    MemoryPoolStats stats = memory_pool_stats(device);
+    std::string prefix = device.type == DeviceType::CPU
+                             ? "cpu:"
+                             : "gpu" + std::to_string(device.id) + ":";
+    memory_profiler.increment(prefix + "pool_size", stats.pool_size);
+    memory_profiler.increment(prefix + "pool_bytes_in_use",
+                              stats.pool_bytes_in_use);
+    memory_profiler.increment(prefix + "pool_peak_bytes",
+                              stats.pool_peak_bytes);
+    memory_profiler.increment(prefix + "largest_free_extent",
+                              stats.largest_free_extent);
+    memory_profiler.increment(prefix + "system_bytes_in_use",
+                              stats.system_bytes_in_use);
+    memory_profiler.increment(prefix + "system_peak_bytes",
+                              stats.system_peak_bytes);
+    memory_profiler.increment(prefix + "system_live_buffers",
+                              stats.system_live_buffers);
+    memory_profiler.increment(prefix + "live_blocks", stats.live_blocks);
+    memory_profiler.increment(prefix + "recycled_bytes", stats.recycled_bytes);
+    memory_profiler.increment(
+        prefix + "pool_exhausted",
+        pool_exhausted_count(device) - pool_exhausted_start[d]);
+    if (device.type == DeviceType::GPU) {
+      TransferStats transfers = device_transfer_stats(device);
+      TransferStats& start = transfers_start[d];
+      memory_profiler.increment(prefix + "h2d_bytes",
+                                transfers.h2d_bytes - start.h2d_bytes);
+      memory_profiler.increment(prefix + "h2d_ns",
+                                transfers.h2d_ns - start.h2d_ns);
+      memory_profiler.increment(prefix + "d2h_bytes",
+                                transfers.d2h_bytes - start.d2h_bytes);
+      memory_profiler.increment(prefix + "d2h_ns",
+                                transfers.d2h_ns - start.d2h_ns);
+      memory_profiler.increment(prefix + "d2d_bytes",
+                                transfers.d2d_bytes - start.d2d_bytes);
+      memory_profiler.increment(prefix + "d2d_ns",
+                                transfers.d2d_ns - start.d2d_ns);
+    }
+  }
+  u8 memory_profiler_count = 1;
+  s_write(profiler_output.get(), memory_profiler_count);
+  write_profiler_to_file(profiler_output.get(), out_rank, "memory", "", 0,
+                         memory_profiler);
+
+  // Interval aggregates of every profiler above, in the same order
+  for (Profiler& profiler : load_thread_profilers) {
+    write_profiler_aggregates_to_file(profiler_output.get(), profiler);
+  }
+  for (i32 pu = 0; pu < pipeline_instances_per_node; ++pu) {
+    for (i32 s = 0; s < 3; ++s) {
+      write_profiler_aggregates_to_file(profiler_output.get(),
+                                        eval_profilers[pu][s]);
+    }
+  }
+  for (Profiler& profiler : save_thread_profilers) {
+    write_profiler_aggregates_to_file(profiler_output.get(), profiler);
+  }
+  write_profiler_aggregates_to_file(profiler_output.get(), memory_profiler);
+
   BACKOFF_FAIL(profiler_output->save());
 
+  // The whole trace, including the events already streamed
+  std::string trace_events = trace_writer.events(false);
+  std::unique_ptr<WriteFile> trace_output;
+  BACKOFF_FAIL(make_unique_write_file(
+      storage_, bulk_job_trace_path(job_id, node_id_), trace_output));
+  s_write(trace_output.get(), (const u8*)trace_events.data(),
+          trace_events.size());
+  BACKOFF_FAIL(trace_output->save());
+
   std::fflush(NULL);
   sync();
 
@@ -1355,6 +2689,9 @@ grpc::Status WorkerImpl::NewJob(grpc::ServerContext* context,
 
   // Set to idle if we finished without a shutdown
   state_.test_and_set(RUNNING_JOB, IDLE);
+  if (draining_) {
+    finish_drain();
+  }
 
   return grpc::Status::OK;
 }
@@ -1363,11 +2700,26 @@ grpc::Status WorkerImpl::LoadOp(grpc::ServerContext* context,
                                 const proto::OpPath* op_path,
                                 proto::Empty* empty) {
   const std::string& so_path = op_path->path();
+  std::string error;
+  LOG_IF(FATAL, !load_op_library(so_path, error))
+      << "dlopen of " << so_path << " failed: " << error;
+  return grpc::Status::OK;
+}
+
+bool WorkerImpl::load_op_library(const std::string& so_path,
+                                 std::string& error) {
+  std::unique_lock<std::mutex> lock(op_libraries_mutex_);
+  if (loaded_op_libraries_.count(so_path) > 0) {
+    return true;
+  }
   VLOG(1) << "Worker " << node_id_ << " loading Op library: " << so_path;
   void* handle = dlopen(so_path.c_str(), RTLD_NOW | RTLD_LOCAL);
-  LOG_IF(FATAL, handle == nullptr)
-      << "dlopen of " << so_path << " failed: " << dlerror();
-  return grpc::Status::OK;
+  if (handle == nullptr) {
+    error = dlerror();
+    return false;
+  }
+  loaded_op_libraries_.insert(so_path);
+  return true;
 }
 
 grpc::Status WorkerImpl::RegisterOp(
@@ -1382,6 +2734,7 @@ grpc::Status WorkerImpl::RegisterOp(
     col.set_id(i++);
     col.set_name(c.name());
     col.set_type(c.type());
+    col.mutable_pixel_formats()->CopyFrom(c.pixel_formats());
     input_columns.push_back(col);
   }
   std::vector<Column> output_columns;
@@ -1420,9 +2773,11 @@ grpc::Status WorkerImpl::RegisterPythonKernel(
   DeviceType device_type = python_kernel->device_type();
   const std::string& kernel_str = python_kernel->kernel_str();
   const std::string& pickled_config = python_kernel->pickled_config();
+  bool multiprocess = python_kernel->multiprocess();
   // Create a kernel builder function
-  auto constructor = [kernel_str, pickled_config](const KernelConfig& config) {
-    return new PythonKernel(config, kernel_str, pickled_config);
+  auto constructor = [kernel_str, pickled_config,
+                      multiprocess](const KernelConfig& config) {
+    return new PythonKernel(config, kernel_str, pickled_config, multiprocess);
   };
   // Create a new kernel factory
   KernelFactory* factory =
@@ -1434,6 +2789,50 @@ grpc::Status WorkerImpl::RegisterPythonKernel(
   return grpc::Status::OK;
 }
 
+grpc::Status WorkerImpl::IngestVideoSet(grpc::ServerContext* context,
+                                        const proto::IngestParameters* params,
+                                        proto::IngestResult* result) {
+  std::vector<bool> bad_videos;
+  std::vector<std::string> bad_messages;
+  ingest_video_set(
+      storage_,
+      std::vector<std::string>(params->table_names().begin(),
+                               params->table_names().end()),
+      std::vector<i32>(params->table_ids().begin(), params->table_ids().end()),
+      std::vector<std::string>(params->video_paths().begin(),
+                               params->video_paths().end()),
+      params->inplace(), params->proxy_height(), db_params_.num_cpus,
+      bad_videos, bad_messages);
+  for (size_t i = 0; i < bad_videos.size(); ++i) {
+    if (bad_videos[i]) {
+      result->add_failed_indices(i);
+      result->add_failed_paths(params->video_paths(i));
+      result->add_failed_messages(bad_messages[i]);
+    }
+  }
+  result->mutable_result()->set_success(true);
+  return grpc::Status::OK;
+}
+
+grpc::Status WorkerImpl::Drain(grpc::ServerContext* context,
+                               const proto::DrainParameters* params,
+                               Result* result) {
+  VLOG(1) << "Worker " << node_id_ << " draining within "
+          << params->deadline_ms() << " ms";
+  drain_deadline_ns_ =
+      std::chrono::duration_cast<std::chrono::nanoseconds>(
+          (now() + std::chrono::milliseconds(params->deadline_ms()))
+              .time_since_epoch())
+          .count();
+  draining_ = true;
+  // A running job finishes the drain when it ends
+  if (state_.get() != RUNNING_JOB) {
+    finish_drain();
+  }
+  result->set_success(true);
+  return grpc::Status::OK;
+}
+
 grpc::Status WorkerImpl::Shutdown(grpc::ServerContext* context,
                                   const proto::Empty* empty, Result* result) {
   State state = state_.get();
@@ -1475,6 +2874,65 @@ grpc::Status WorkerImpl::Ping(grpc::ServerContext* context,
   return grpc::Status::OK;
 }
 
+grpc::Status WorkerImpl::ReadIntermediate(
+    grpc::ServerContext* context, const proto::IntermediateRead* request,
+    proto::IntermediateData* reply) {
+  u64 file_size;
+  if (!intermediates_.local_size(request->path(), file_size) ||
+      request->offset() < 0 || request->size() < 0 ||
+      (u64)(request->offset() + request->size()) > file_size) {
+    reply->set_found(false);
+    return grpc::Status::OK;
+  }
+  std::string* data = reply->mutable_data();
+  data->resize(request->size());
+  intermediates_.read_local(request->path(), request->offset(),
+                            request->size(), (u8*)&(*data)[0]);
+  reply->set_found(true);
+  reply->set_file_size(file_size);
+  return grpc::Status::OK;
+}
+
+void WorkerImpl::start_metrics_server(i32 port) {
+  metrics_server_.reset(new MetricsServer(
+      port, [this](MetricsWriter& writer) { write_metrics(writer); }));
+}
+
+void WorkerImpl::write_metrics(MetricsWriter& writer) {
+  State state = state_.get();
+  writer.family("scanner_worker_running_job", "gauge",
+                "Whether the worker is running a bulk job");
+  writer.sample("scanner_worker_running_job",
+                state == State::RUNNING_JOB ? 1 : 0);
+
+  std::unique_lock<std::mutex> lk(metrics_mutex_);
+  if (memory_pool_initialized_) {
+    std::vector<DeviceHandle> devices = {CPU_DEVICE};
+    for (i32 device_id : db_params_.gpu_ids) {
+      devices.push_back(DeviceHandle{DeviceType::GPU, device_id});
+    }
+    writer.family("scanner_worker_pool_bytes", "gauge",
+                  "Memory pool capacity and bytes in use by device");
+    for (DeviceHandle device : devices) {
+      MemoryPoolStats stats = memory_pool_stats(device);
+      std::string name = device.type == DeviceType::CPU
+                             ? "cpu"
+                             : "gpu" + std::to_string(device.id);
+      writer.sample("scanner_worker_pool_bytes", stats.pool_size,
+                    {{"device", name}, {"kind", "size"}});
+      writer.sample("scanner_worker_pool_bytes", stats.pool_bytes_in_use,
+                    {{"device", name}, {"kind", "in_use"}});
+      writer.sample("scanner_worker_pool_bytes", stats.pool_peak_bytes,
+                    {{"device", name}, {"kind", "peak"}});
+      writer.sample("scanner_worker_pool_bytes", stats.system_bytes_in_use,
+                    {{"device", name}, {"kind", "system_in_use"}});
+    }
+  }
+  if (job_metrics_) {
+    job_metrics_(writer);
+  }
+}
+
 void WorkerImpl::start_watchdog(grpc::Server* server, bool enable_timeout,
                                 i32 timeout_ms) {
   watchdog_thread_ = std::thread([this, server, enable_timeout, timeout_ms]() {
@@ -1520,6 +2978,8 @@ void WorkerImpl::register_with_master() {
   for (i32 gpu_id : db_params_.gpu_ids) {
     params->add_gpu_ids(gpu_id);
   }
+  params->set_partition_cores(db_params_.partition_cores);
+  params->set_num_io_cores(db_params_.num_io_cores);
 
   grpc::Status status =
       master_->RegisterWorker(&context, worker_info, &registration);
@@ -1533,6 +2993,12 @@ void WorkerImpl::register_with_master() {
   state_.set(State::IDLE);
 }
 
+void WorkerImpl::finish_drain() {
+  try_unregister();
+  state_.set(SHUTTING_DOWN);
+  trigger_shutdown_.set();
+}
+
 void WorkerImpl::try_unregister() {
   if (state_.get() != State::INITIALIZING && !unregistered_.test_and_set()) {
     grpc::ClientContext ct;
@@ -15,13 +15,23 @@
 
 #pragma once
 
+#include "scanner/engine/block_cache.h"
+#include "scanner/engine/intermediate_store.h"
+#include "scanner/engine/item_metadata_cache.h"
+#include "scanner/engine/read_file_pool.h"
+#include "scanner/engine/video_index_cache.h"
+#include "scanner/engine/kernel_cache.h"
 #include "scanner/engine/metadata.h"
 #include "scanner/engine/rpc.grpc.pb.h"
 #include "scanner/engine/runtime.h"
+#include "scanner/util/metrics_server.h"
 
 #include <grpc/grpc_posix.h>
 #include <grpc/support/log.h>
 #include <atomic>
+#include <functional>
+#include <mutex>
+#include <set>
 #include <thread>
 #include <boost/python.hpp>
 
@@ -51,23 +61,46 @@ class WorkerImpl final : public proto::Worker::Service {
       const proto::PythonKernelRegistration* python_kernel,
       proto::Result* result);
 
+  grpc::Status IngestVideoSet(grpc::ServerContext* context,
+                              const proto::IngestParameters* params,
+                              proto::IngestResult* result);
+
   grpc::Status Shutdown(grpc::ServerContext* context, const proto::Empty* empty,
                         Result* result);
 
+  grpc::Status Drain(grpc::ServerContext* context,
+                     const proto::DrainParameters* params, Result* result);
+
   grpc::Status PokeWatchdog(grpc::ServerContext* context,
                             const proto::Empty* empty, proto::Empty* result);
 
   grpc::Status Ping(grpc::ServerContext* context, const proto::Empty* empty,
                     proto::Empty* result);
 
+  grpc::Status ReadIntermediate(grpc::ServerContext* context,
+                                const proto::IntermediateRead* request,
+                                proto::IntermediateData* reply);
+
   void start_watchdog(grpc::Server* server, bool enable_timeout,
                       i32 timeout_ms = 50000);
 
   void register_with_master();
 
+  //! Serves metrics on the pipeline queues, op throughput, decoding and
+  //! memory pools of this worker over HTTP
+  void start_metrics_server(i32 port);
+
  private:
+  void write_metrics(MetricsWriter& writer);
+
+  //! Loads an op library unless this process already has
+  bool load_op_library(const std::string& so_path, std::string& error);
+
   void try_unregister();
 
+  //! Unregisters and shuts down a draining worker once it has no job
+  void finish_drain();
+
   enum State {
     INITIALIZING,
     IDLE,
@@ -84,6 +117,10 @@ class WorkerImpl final : public proto::Worker::Service {
   storehouse::StorageConfig* storage_config_;
   DatabaseParameters db_params_;
   Flag trigger_shutdown_;
+  // Set by Drain. The running job stops asking for tasks and ends once its
+  // tasks are done or the deadline (ns since the epoch of now()) passes.
+  std::atomic<bool> draining_{false};
+  std::atomic<i64> drain_deadline_ns_{0};
   std::string master_address_;
   std::string worker_port_;
   i32 node_id_;
@@ -91,6 +128,26 @@ class WorkerImpl final : public proto::Worker::Service {
   std::map<std::string, TableMetadata*> table_metas_;
   bool memory_pool_initialized_ = false;
   MemoryPoolConfig cached_memory_pool_config_;
+  // Kernels kept warm from the previous job
+  KernelCache kernel_cache_;
+  // Parsed item metadata kept across load tasks and jobs
+  ItemMetadataCache item_metadata_cache_;
+  // Blocks of table files read from remote storage
+  BlockCache block_cache_;
+  // Video indexes and open read handles of table files, kept across load
+  // tasks and jobs
+  VideoIndexCache video_index_cache_;
+  std::unique_ptr<ReadFilePool> file_pool_;
+  // Data files of ephemeral tables written or read by this worker
+  IntermediateStore intermediates_;
+  std::mutex op_libraries_mutex_;
+  std::set<std::string> loaded_op_libraries_;
+
+  std::unique_ptr<MetricsServer> metrics_server_;
+  // Guards the memory pools being replaced and job_metrics_
+  std::mutex metrics_mutex_;
+  // Writes the metrics of the running bulk job, unset between jobs
+  std::function<void(MetricsWriter&)> job_metrics_;
 };
 }
 }
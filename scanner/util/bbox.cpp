@@ -1,109 +1,173 @@
 #include "scanner/util/bbox.h"
 
-#include <queue>
+#include <algorithm>
+#include <numeric>
 
 namespace scanner {
 
-std::vector<BoundingBox> best_nms(const std::vector<BoundingBox>& boxes,
-                                  f32 overlap) {
-  std::vector<bool> valid(boxes.size(), true);
-  auto cmp = [](std::pair<f32, i32> left, std::pair<f32, i32> right) {
-    return left.first < right.first;
-  };
-  std::priority_queue<std::pair<f32, i32>, std::vector<std::pair<f32, i32>>,
-                      decltype(cmp)>
-      q(cmp);
-  for (i32 i = 0; i < (i32)boxes.size(); ++i) {
-    q.emplace(boxes[i].score(), i);
+namespace {
+
+// Boxes copied into decreasing score order with their areas precomputed, so
+// the suppression loops below walk contiguous arrays without branches
+struct SortedBoxes {
+  std::vector<i32> order;
+  std::vector<f32> x1;
+  std::vector<f32> y1;
+  std::vector<f32> x2;
+  std::vector<f32> y2;
+  std::vector<f32> score;
+  std::vector<f32> area;
+};
+
+SortedBoxes sort_boxes(const BoxArrays& boxes) {
+  i32 n = (i32)boxes.size();
+  SortedBoxes s;
+  s.order.resize(n);
+  std::iota(s.order.begin(), s.order.end(), 0);
+  std::stable_sort(s.order.begin(), s.order.end(), [&](i32 a, i32 b) {
+    return boxes.score[a] > boxes.score[b];
+  });
+  s.x1.resize(n);
+  s.y1.resize(n);
+  s.x2.resize(n);
+  s.y2.resize(n);
+  s.score.resize(n);
+  s.area.resize(n);
+  for (i32 i = 0; i < n; ++i) {
+    i32 k = s.order[i];
+    s.x1[i] = boxes.x1[k];
+    s.y1[i] = boxes.y1[k];
+    s.x2[i] = boxes.x2[k];
+    s.y2[i] = boxes.y2[k];
+    s.score[i] = boxes.score[k];
+    s.area[i] = (s.x2[i] - s.x1[i] + 1) * (s.y2[i] - s.y1[i] + 1);
   }
-  std::vector<i32> best;
-  while (!q.empty()) {
-    std::pair<f32, i32> entry = q.top();
-    q.pop();
-    i32 c_idx = entry.second;
-    if (!valid[c_idx]) continue;
+  return s;
+}
+
+BoxArrays to_box_arrays(const std::vector<BoundingBox>& boxes) {
+  BoxArrays arrays;
+  arrays.reserve(boxes.size());
+  for (const BoundingBox& b : boxes) {
+    arrays.push_back(b.x1(), b.y1(), b.x2(), b.y2(), b.score(), b.label(),
+                     b.track_id());
+  }
+  return arrays;
+}
+}
+
+void BoxArrays::reserve(size_t n) {
+  x1.reserve(n);
+  y1.reserve(n);
+  x2.reserve(n);
+  y2.reserve(n);
+  score.reserve(n);
+  label.reserve(n);
+  track_id.reserve(n);
+}
 
-    best.push_back(c_idx);
+void BoxArrays::clear() {
+  x1.clear();
+  y1.clear();
+  x2.clear();
+  y2.clear();
+  score.clear();
+  label.clear();
+  track_id.clear();
+}
 
-    for (i32 i = 0; i < (i32)boxes.size(); ++i) {
-      if (!valid[i]) continue;
+void BoxArrays::push_back(f32 bx1, f32 by1, f32 bx2, f32 by2, f32 bscore,
+                          i32 blabel, i32 btrack_id) {
+  x1.push_back(bx1);
+  y1.push_back(by1);
+  x2.push_back(bx2);
+  y2.push_back(by2);
+  score.push_back(bscore);
+  label.push_back(blabel);
+  track_id.push_back(btrack_id);
+}
 
-      f32 x1 = std::max(boxes[c_idx].x1(), boxes[i].x1());
-      f32 y1 = std::max(boxes[c_idx].y1(), boxes[i].y1());
-      f32 x2 = std::min(boxes[c_idx].x2(), boxes[i].x2());
-      f32 y2 = std::min(boxes[c_idx].y2(), boxes[i].y2());
+BoundingBox BoxArrays::box(size_t i) const {
+  BoundingBox b;
+  b.set_x1(x1[i]);
+  b.set_y1(y1[i]);
+  b.set_x2(x2[i]);
+  b.set_y2(y2[i]);
+  b.set_score(score[i]);
+  b.set_label(label[i]);
+  b.set_track_id(track_id[i]);
+  return b;
+}
+
+std::vector<i32> best_nms_indices(const BoxArrays& boxes, f32 overlap) {
+  SortedBoxes s = sort_boxes(boxes);
+  i32 n = (i32)s.order.size();
+  std::vector<u8> valid(n, 1);
+  std::vector<i32> best;
+  for (i32 c = 0; c < n; ++c) {
+    if (!valid[c]) continue;
+    best.push_back(s.order[c]);
+
+    // Everything before c has already been kept or suppressed
+    const f32 cx1 = s.x1[c], cy1 = s.y1[c], cx2 = s.x2[c], cy2 = s.y2[c];
+    for (i32 i = c; i < n; ++i) {
+      f32 x1 = std::max(cx1, s.x1[i]);
+      f32 y1 = std::max(cy1, s.y1[i]);
+      f32 x2 = std::min(cx2, s.x2[i]);
+      f32 y2 = std::min(cy2, s.y2[i]);
 
       f32 o_w = std::max(0.0f, x2 - x1 + 1);
       f32 o_h = std::max(0.0f, y2 - y1 + 1);
+      f32 box_overlap = o_w * o_h / s.area[i];
 
-      f32 box_overlap = o_w * o_h / ((boxes[i].x2() - boxes[i].x1() + 1) *
-                                     (boxes[i].y2() - boxes[i].y1() + 1));
-
-      valid[i] = box_overlap < overlap;
+      valid[i] &= (u8)(box_overlap < overlap);
     }
   }
+  return best;
+}
 
+std::vector<BoundingBox> best_nms(const BoxArrays& boxes, f32 overlap) {
   std::vector<BoundingBox> out_boxes;
-  for (i32 i : best) {
-    out_boxes.push_back(boxes[i]);
+  for (i32 i : best_nms_indices(boxes, overlap)) {
+    out_boxes.push_back(boxes.box(i));
   }
   return out_boxes;
 }
 
-std::vector<BoundingBox> average_nms(const std::vector<BoundingBox>& boxes,
-                                     f32 overlap) {
+std::vector<BoundingBox> average_nms(const BoxArrays& boxes, f32 overlap) {
+  SortedBoxes s = sort_boxes(boxes);
+  i32 n = (i32)s.order.size();
+  std::vector<u8> valid(n, 1);
   std::vector<BoundingBox> best_boxes;
-  std::vector<bool> valid(boxes.size(), true);
-  auto cmp = [](std::pair<f32, i32> left, std::pair<f32, i32> right) {
-    return left.first < right.first;
-  };
-  std::priority_queue<std::pair<f32, i32>, std::vector<std::pair<f32, i32>>,
-                      decltype(cmp)>
-      q(cmp);
-  for (i32 i = 0; i < (i32)boxes.size(); ++i) {
-    q.emplace(boxes[i].score(), i);
-  }
-  std::vector<i32> best;
-  while (!q.empty()) {
-    std::pair<f32, i32> entry = q.top();
-    q.pop();
-    i32 c_idx = entry.second;
-    if (!valid[c_idx]) continue;
-
-    best.push_back(c_idx);
-
-    const BoundingBox& current_box = boxes[c_idx];
-    f64 total_weight = current_box.score();
-    f64 best_x1 = current_box.x1() * current_box.score();
-    f64 best_y1 = current_box.y1() * current_box.score();
-    f64 best_x2 = current_box.x2() * current_box.score();
-    f64 best_y2 = current_box.y2() * current_box.score();
-    for (i32 i = 0; i < (i32)boxes.size(); ++i) {
-      if (!valid[i]) continue;
-
-      const BoundingBox& candidate = boxes[i];
-
-      f32 x1 = std::max(current_box.x1(), candidate.x1());
-      f32 y1 = std::max(current_box.y1(), candidate.y1());
-      f32 x2 = std::min(current_box.x2(), candidate.x2());
-      f32 y2 = std::min(current_box.y2(), candidate.y2());
+  for (i32 c = 0; c < n; ++c) {
+    if (!valid[c]) continue;
+
+    const f32 cx1 = s.x1[c], cy1 = s.y1[c], cx2 = s.x2[c], cy2 = s.y2[c];
+    f64 total_weight = s.score[c];
+    f64 best_x1 = cx1 * s.score[c];
+    f64 best_y1 = cy1 * s.score[c];
+    f64 best_x2 = cx2 * s.score[c];
+    f64 best_y2 = cy2 * s.score[c];
+    for (i32 i = c; i < n; ++i) {
+      f32 x1 = std::max(cx1, s.x1[i]);
+      f32 y1 = std::max(cy1, s.y1[i]);
+      f32 x2 = std::min(cx2, s.x2[i]);
+      f32 y2 = std::min(cy2, s.y2[i]);
 
       f32 o_w = std::max(0.0f, x2 - x1 + 1);
       f32 o_h = std::max(0.0f, y2 - y1 + 1);
+      f32 box_overlap = o_w * o_h / s.area[i];
 
-      f32 box_overlap = o_w * o_h / ((candidate.x2() - candidate.x1() + 1) *
-                                     (candidate.y2() - candidate.y1() + 1));
-
-      valid[i] = box_overlap < overlap;
+      u8 suppressed = valid[i] & (u8)!(box_overlap < overlap);
+      valid[i] &= (u8)!suppressed;
 
       // Add to average for this box
-      if (!valid[i]) {
-        total_weight += candidate.score();
-        best_x1 += candidate.x1() * candidate.score();
-        best_y1 += candidate.y1() * candidate.score();
-        best_x2 += candidate.x2() * candidate.score();
-        best_y2 += candidate.y2() * candidate.score();
-      }
+      f32 w = suppressed ? s.score[i] : 0.0f;
+      total_weight += w;
+      best_x1 += s.x1[i] * w;
+      best_y1 += s.y1[i] * w;
+      best_x2 += s.x2[i] * w;
+      best_y2 += s.y2[i] * w;
     }
     best_x1 /= total_weight;
     best_y1 /= total_weight;
@@ -115,11 +179,25 @@ std::vector<BoundingBox> average_nms(const std::vector<BoundingBox>& boxes,
     best_box.set_y1(best_y1);
     best_box.set_x2(best_x2);
     best_box.set_y2(best_y2);
-    best_box.set_score(current_box.score());
+    best_box.set_score(s.score[c]);
 
     best_boxes.push_back(best_box);
   }
 
   return best_boxes;
 }
+
+std::vector<BoundingBox> best_nms(const std::vector<BoundingBox>& boxes,
+                                  f32 overlap) {
+  std::vector<BoundingBox> out_boxes;
+  for (i32 i : best_nms_indices(to_box_arrays(boxes), overlap)) {
+    out_boxes.push_back(boxes[i]);
+  }
+  return out_boxes;
+}
+
+std::vector<BoundingBox> average_nms(const std::vector<BoundingBox>& boxes,
+                                     f32 overlap) {
+  return average_nms(to_box_arrays(boxes), overlap);
+}
 }
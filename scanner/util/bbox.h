@@ -4,6 +4,40 @@
 
 namespace scanner {
 
+// Candidate boxes of one frame kept as parallel arrays, so detector output
+// kernels can decode into them and suppress them with vectorizable loops
+struct BoxArrays {
+  std::vector<f32> x1;
+  std::vector<f32> y1;
+  std::vector<f32> x2;
+  std::vector<f32> y2;
+  std::vector<f32> score;
+  std::vector<i32> label;
+  std::vector<i32> track_id;
+
+  size_t size() const { return score.size(); }
+
+  void reserve(size_t n);
+
+  void clear();
+
+  void push_back(f32 bx1, f32 by1, f32 bx2, f32 by2, f32 bscore,
+                 i32 blabel = 0, i32 btrack_id = 0);
+
+  BoundingBox box(size_t i) const;
+};
+
+// Greedy suppression in decreasing score order: a box is dropped when a
+// better box covers at least `overlap` of its area. Returns the indices of
+// the kept boxes, best first.
+std::vector<i32> best_nms_indices(const BoxArrays& boxes, f32 overlap);
+
+std::vector<BoundingBox> best_nms(const BoxArrays& boxes, f32 overlap);
+
+// Like best_nms, but each kept box is replaced by the score-weighted average
+// of the boxes it suppressed
+std::vector<BoundingBox> average_nms(const BoxArrays& boxes, f32 overlap);
+
 std::vector<BoundingBox> best_nms(const std::vector<BoundingBox>& boxes,
                                   f32 overlap);
 
@@ -0,0 +1,77 @@
+/* Copyright 2017 Carnegie Mellon University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "scanner/util/compression.h"
+#include "scanner/util/memory.h"
+
+#include <glog/logging.h>
+#include <zlib.h>
+
+#include <cstring>
+
+namespace scanner {
+
+bool is_element_codec(const std::string& codec) { return codec == "zlib"; }
+
+void compress_element(const std::string& codec, i32 level, const u8* data,
+                      size_t size, std::vector<u8>& output) {
+  if (size == 0) {
+    return;
+  }
+  LOG_IF(FATAL, codec != "zlib") << "Unknown element codec " << codec;
+  size_t start = output.size();
+  uLongf compressed_size = compressBound(size);
+  output.resize(start + sizeof(u64) + compressed_size);
+  u64 uncompressed_size = size;
+  memcpy(output.data() + start, &uncompressed_size, sizeof(u64));
+  int result =
+      compress2(output.data() + start + sizeof(u64), &compressed_size, data,
+                size, level < 0 ? Z_DEFAULT_COMPRESSION : level);
+  LOG_IF(FATAL, result != Z_OK) << "zlib failed to compress an element ("
+                                << result << ")";
+  output.resize(start + sizeof(u64) + compressed_size);
+}
+
+u8* decompress_element(const std::string& codec, const u8* data, size_t size,
+                       size_t& decompressed_size) {
+  LOG_IF(FATAL, codec != "zlib") << "Unknown element codec " << codec;
+  LOG_IF(FATAL, size < sizeof(u64)) << "Compressed element is truncated";
+  u64 uncompressed_size;
+  memcpy(&uncompressed_size, data, sizeof(u64));
+  u8* buffer = new_buffer(CPU_DEVICE, uncompressed_size);
+  uLongf buffer_size = uncompressed_size;
+  int result = uncompress(buffer, &buffer_size, data + sizeof(u64),
+                          size - sizeof(u64));
+  LOG_IF(FATAL, result != Z_OK || buffer_size != uncompressed_size)
+      << "zlib failed to decompress an element (" << result << ")";
+  decompressed_size = uncompressed_size;
+  return buffer;
+}
+
+void decompress_element(const std::string& codec, const u8* data, size_t size,
+                        std::vector<u8>& output) {
+  LOG_IF(FATAL, codec != "zlib") << "Unknown element codec " << codec;
+  LOG_IF(FATAL, size < sizeof(u64)) << "Compressed element is truncated";
+  u64 uncompressed_size;
+  memcpy(&uncompressed_size, data, sizeof(u64));
+  size_t start = output.size();
+  output.resize(start + uncompressed_size);
+  uLongf buffer_size = uncompressed_size;
+  int result = uncompress(output.data() + start, &buffer_size,
+                          data + sizeof(u64), size - sizeof(u64));
+  LOG_IF(FATAL, result != Z_OK || buffer_size != uncompressed_size)
+      << "zlib failed to decompress an element (" << result << ")";
+}
+}
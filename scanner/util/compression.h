@@ -0,0 +1,47 @@
+/* Copyright 2017 Carnegie Mellon University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include "scanner/util/common.h"
+
+#include <string>
+#include <vector>
+
+namespace scanner {
+
+// General purpose codecs for the elements of non-video columns. Elements are
+// compressed one at a time, so the metadata of an item still gives the byte
+// range of every element and single elements can be read and decompressed
+// on their own. A compressed element starts with its uncompressed size as a
+// u64. Empty (null) elements are stored as they are.
+
+//! True for the codecs compress_element understands ("zlib")
+bool is_element_codec(const std::string& codec);
+
+//! Appends the compressed element to output. level follows the codec's own
+//! scale, with -1 meaning its default.
+void compress_element(const std::string& codec, i32 level, const u8* data,
+                      size_t size, std::vector<u8>& output);
+
+//! Returns a new CPU buffer holding the decompressed element
+u8* decompress_element(const std::string& codec, const u8* data, size_t size,
+                       size_t& decompressed_size);
+
+//! Appends the decompressed element to output. Unlike the overload above it
+//! does not need the memory pool, e.g. in client processes.
+void decompress_element(const std::string& codec, const u8* data, size_t size,
+                        std::vector<u8>& output);
+}
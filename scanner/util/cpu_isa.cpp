@@ -0,0 +1,65 @@
+/* Copyright 2017 Carnegie Mellon University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "scanner/util/cpu_isa.h"
+
+#include <glog/logging.h>
+
+#include <cstdlib>
+#include <cstring>
+
+namespace scanner {
+namespace {
+CPUISA detect_cpu_isa() {
+  CPUISA isa = CPUISA::GENERIC;
+#ifdef SCANNER_ISA_DISPATCH
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f") &&
+      __builtin_cpu_supports("avx512bw")) {
+    isa = CPUISA::AVX512;
+  } else if (__builtin_cpu_supports("avx2")) {
+    isa = CPUISA::AVX2;
+  }
+#endif
+  const char* cap = std::getenv("SCANNER_CPU_ISA");
+  if (cap != nullptr) {
+    for (CPUISA limit : {CPUISA::GENERIC, CPUISA::AVX2, CPUISA::AVX512}) {
+      if (std::strcmp(cap, cpu_isa_name(limit)) == 0 && limit < isa) {
+        isa = limit;
+      }
+    }
+  }
+  VLOG(1) << "Dispatching CPU kernels for " << cpu_isa_name(isa);
+  return isa;
+}
+}
+
+CPUISA cpu_isa() {
+  static CPUISA isa = detect_cpu_isa();
+  return isa;
+}
+
+const char* cpu_isa_name(CPUISA isa) {
+  switch (isa) {
+    case CPUISA::AVX2:
+      return "avx2";
+    case CPUISA::AVX512:
+      return "avx512";
+    default:
+      return "generic";
+  }
+}
+}
@@ -0,0 +1,51 @@
+/* Copyright 2017 Carnegie Mellon University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#pragma once
+
+#include "scanner/util/common.h"
+
+namespace scanner {
+
+///////////////////////////////////////////////////////////////////////////////
+/// CPU instruction set dispatch
+//
+// Scanner is built for a generic x86-64 target so that one build runs on
+// every node of a cluster. Hot CPU kernels compile extra variants of their
+// inner loops for newer instruction sets with SCANNER_TARGET_AVX2 and
+// SCANNER_TARGET_AVX512, and pick one with cpu_isa() when they are
+// instantiated.
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define SCANNER_ISA_DISPATCH
+#define SCANNER_TARGET_AVX2 __attribute__((target("avx2")))
+#define SCANNER_TARGET_AVX512 __attribute__((target("avx512f,avx512bw")))
+#endif
+
+enum class CPUISA {
+  GENERIC = 0,
+  AVX2 = 1,
+  // AVX-512 with byte and word instructions
+  AVX512 = 2,
+};
+
+//! Newest instruction set the CPU supports that kernels have variants for.
+//! The SCANNER_CPU_ISA environment variable (generic, avx2 or avx512) caps
+//! it, e.g. to compare variants on one node.
+CPUISA cpu_isa();
+
+const char* cpu_isa_name(CPUISA isa);
+}
@@ -0,0 +1,76 @@
+/* Copyright 2017 Carnegie Mellon University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "scanner/util/cuda_stream_pool.h"
+#include "scanner/util/cuda.h"
+
+#include <algorithm>
+
+namespace scanner {
+
+CUDAStreamPool& CUDAStreamPool::instance() {
+  // Leaked so streams outlive the kernels destroyed at exit
+  static CUDAStreamPool* pool = new CUDAStreamPool;
+  return *pool;
+}
+
+void* CUDAStreamPool::acquire(i32 device_id, i32 priority) {
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    std::vector<void*>& streams =
+        free_streams_[std::make_pair(device_id, priority)];
+    if (!streams.empty()) {
+      void* stream = streams.back();
+      streams.pop_back();
+      return stream;
+    }
+    num_streams_[device_id]++;
+  }
+  void* stream = nullptr;
+#ifdef HAVE_CUDA
+  i32 current_device;
+  CU_CHECK(cudaGetDevice(&current_device));
+  CU_CHECK(cudaSetDevice(device_id));
+  // CUDA priorities count down from 0, the lowest
+  i32 least_priority;
+  i32 greatest_priority;
+  CU_CHECK(
+      cudaDeviceGetStreamPriorityRange(&least_priority, &greatest_priority));
+  i32 cuda_priority = std::max(greatest_priority, least_priority - priority);
+  cudaStream_t s;
+  CU_CHECK(cudaStreamCreateWithPriority(&s, cudaStreamNonBlocking,
+                                        cuda_priority));
+  CU_CHECK(cudaSetDevice(current_device));
+  stream = s;
+  std::unique_lock<std::mutex> lock(mutex_);
+  stream_priorities_[stream] = priority;
+#else
+  LOG(FATAL) << "Cuda not enabled.";
+#endif
+  return stream;
+}
+
+void CUDAStreamPool::release(i32 device_id, void* stream) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  free_streams_[std::make_pair(device_id, stream_priorities_[stream])]
+      .push_back(stream);
+}
+
+i32 CUDAStreamPool::num_streams(i32 device_id) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  return num_streams_[device_id];
+}
+}
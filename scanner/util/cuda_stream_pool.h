@@ -0,0 +1,59 @@
+/* Copyright 2017 Carnegie Mellon University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#pragma once
+
+#include "scanner/util/common.h"
+
+#include <map>
+#include <mutex>
+#include <vector>
+
+namespace scanner {
+
+//! Non-blocking CUDA streams of each GPU, shared by every pipeline instance
+//! and kernel of the process. A stream is held by one user at a time, so
+//! independent kernels never serialize on a shared stream, and released
+//! streams are kept for the next user instead of being destroyed.
+//!
+//! Pipeline instances of a worker share one CUDA context per GPU, so their
+//! kernels overlap on the GPU instead of being time-sliced, and the worker
+//! is a single client when the GPU runs under CUDA MPS. Streams of higher
+//! priority have their blocks scheduled ahead of those of lower ones.
+class CUDAStreamPool {
+ public:
+  static CUDAStreamPool& instance();
+
+  //! A stream (a cudaStream_t) of the GPU, held until it is released.
+  //! Priority 0 is the default one, and higher ones are clamped to the
+  //! number of priorities the GPU supports.
+  void* acquire(i32 device_id, i32 priority = 0);
+
+  //! Returns a stream from acquire once no work on it is wanted anymore.
+  //! Work still queued on it finishes before the next user's.
+  void release(i32 device_id, void* stream);
+
+  //! Streams ever created on the GPU, held or not
+  i32 num_streams(i32 device_id);
+
+ private:
+  std::mutex mutex_;
+  // Keyed by device and priority
+  std::map<std::pair<i32, i32>, std::vector<void*>> free_streams_;
+  std::map<void*, i32> stream_priorities_;
+  std::map<i32, i32> num_streams_;
+};
+}
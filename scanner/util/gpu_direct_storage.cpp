@@ -0,0 +1,134 @@
+/* Copyright 2017 Carnegie Mellon University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "scanner/util/gpu_direct_storage.h"
+#include "scanner/util/cuda.h"
+#include "scanner/util/memory.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#include <mutex>
+
+#ifdef HAVE_CUFILE
+#include <cufile.h>
+#endif
+
+namespace scanner {
+
+namespace {
+bool pread_fully(i32 fd, u64 offset, u64 size, u8* dest) {
+  while (size > 0) {
+    ssize_t n = pread(fd, dest, size, offset);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    dest += n;
+    offset += n;
+    size -= n;
+  }
+  return true;
+}
+
+#ifdef HAVE_CUFILE
+// The driver is opened by the first read and stays open for the process
+bool open_cufile_driver() {
+  static std::once_flag once;
+  static bool opened = false;
+  std::call_once(once, []() {
+    CUfileError_t status = cuFileDriverOpen();
+    opened = status.err == CU_FILE_SUCCESS;
+    LOG_IF(WARNING, !opened)
+        << "GPUDirect Storage driver unavailable (error " << status.err
+        << "), reading GPU columns through host memory";
+  });
+  return opened;
+}
+
+bool cufile_read(const std::string& path, u64 offset, u64 size,
+                 DeviceHandle device, u8* dest) {
+  // Direct IO bypasses the page cache, which GPUDirect Storage requires
+  i32 fd = open(path.c_str(), O_RDONLY | O_DIRECT);
+  if (fd < 0) {
+    return false;
+  }
+  CUfileDescr_t descr = {};
+  descr.handle.fd = fd;
+  descr.type = CU_FILE_HANDLE_TYPE_OPAQUE_FD;
+  CUfileHandle_t handle;
+  if (cuFileHandleRegister(&handle, &descr).err != CU_FILE_SUCCESS) {
+    close(fd);
+    return false;
+  }
+  CU_CHECK(cudaSetDevice(device.id));
+  bool success = true;
+  u64 done = 0;
+  while (done < size) {
+    ssize_t n = cuFileRead(handle, dest, size - done, offset + done, done);
+    if (n <= 0) {
+      success = false;
+      break;
+    }
+    done += n;
+  }
+  cuFileHandleDeregister(handle);
+  close(fd);
+  return success;
+}
+#endif
+}
+
+bool gpu_direct_storage_available() {
+#ifdef HAVE_CUFILE
+  return open_cufile_driver();
+#else
+  return false;
+#endif
+}
+
+bool read_file_to_device(const std::string& path, u64 offset, u64 size,
+                         DeviceHandle device, u8* dest) {
+  if (size == 0) {
+    return true;
+  }
+#ifdef HAVE_CUFILE
+  if (device.type == DeviceType::GPU && gpu_direct_storage_available() &&
+      cufile_read(path, offset, size, device, dest)) {
+    return true;
+  }
+#endif
+  i32 fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+  bool success;
+  if (device.type == DeviceType::CPU) {
+    success = pread_fully(fd, offset, size, dest);
+  } else {
+    u8* staging = new_buffer(CPU_DEVICE, size);
+    success = pread_fully(fd, offset, size, staging);
+    if (success) {
+      memcpy_buffer(dest, device, staging, CPU_DEVICE, size);
+    }
+    delete_buffer(CPU_DEVICE, staging);
+  }
+  close(fd);
+  return success;
+}
+}
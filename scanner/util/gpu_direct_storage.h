@@ -0,0 +1,34 @@
+/* Copyright 2017 Carnegie Mellon University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#pragma once
+
+#include "scanner/util/common.h"
+
+#include <string>
+
+namespace scanner {
+
+//! Whether GPUDirect Storage was built in and its driver could be opened
+bool gpu_direct_storage_available();
+
+//! Reads size bytes at offset of the local file at path into dest, a buffer
+//! on device. GPU buffers are filled by DMA from the file with GPUDirect
+//! Storage when it is available and through a host buffer otherwise.
+//! Returns false if the file could not be read.
+bool read_file_to_device(const std::string& path, u64 offset, u64 size,
+                         DeviceHandle device, u8* dest);
+}
@@ -17,6 +17,12 @@
 
 #include "scanner/util/common.h"
 
+#include <algorithm>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 namespace scanner {
 
 struct GetBitsState {
@@ -32,62 +38,98 @@ inline u32 get_bit(GetBitsState& gb) {
   return v;
 }
 
+// Reads whole runs of bits out of each byte instead of one bit at a time.
+// Only the bytes holding the requested bits are touched, since callers do not
+// always set the size of the buffer
 inline u32 get_bits(GetBitsState& gb, i32 bits) {
   u32 v = 0;
-  for (i32 i = bits - 1; i >= 0; i--) {
-    v |= get_bit(gb) << i;
+  while (bits > 0) {
+    i32 avail = 8 - (gb.offset & 0x7);
+    i32 take = std::min(avail, bits);
+    u32 byte = *(gb.buffer + (gb.offset >> 0x3));
+    v = (v << take) | ((byte >> (avail - take)) & ((1u << take) - 1));
+    gb.offset += take;
+    bits -= take;
   }
   return v;
 }
 
-inline u32 get_ue_golomb(GetBitsState& gb) {
-  // calculate zero bits. Will be optimized.
+// Counts the zero bits before the next set bit and consumes them along with
+// the set bit, skipping zero bytes whole
+inline i32 get_leading_zero_bits(GetBitsState& gb) {
   i32 zeros = 0;
-  while (0 == get_bit(gb)) {
-    zeros++;
+  while (true) {
+    i32 avail = 8 - (gb.offset & 0x7);
+    u32 rest = *(gb.buffer + (gb.offset >> 0x3)) & ((1u << avail) - 1);
+    if (rest != 0) {
+      i32 z = __builtin_clz(rest) - (32 - avail);
+      gb.offset += z + 1;
+      return zeros + z;
+    }
+    zeros += avail;
+    gb.offset += avail;
   }
+}
 
+inline u32 get_ue_golomb(GetBitsState& gb) {
+  i32 zeros = get_leading_zero_bits(gb);
   // insert first 1 bit
-  u32 info = 1 << zeros;
-
-  for (i32 i = zeros - 1; i >= 0; i--) {
-    info |= get_bit(gb) << i;
-  }
-
+  u32 info = (1 << zeros) | get_bits(gb, zeros);
   return (info - 1);
 }
 
 inline u32 get_se_golomb(GetBitsState& gb) {
-  // calculate zero bits. Will be optimized.
-  i32 zeros = 0;
-  while (0 == get_bit(gb)) {
-    zeros++;
-  }
-
-  // insert first 1 bit
-  u32 info = 1 << zeros;
+  // Same decoding as before: callers only skip over signed values
+  return get_ue_golomb(gb);
+}
 
-  for (i32 i = zeros - 1; i >= 0; i--) {
-    info |= get_bit(gb) << i;
+// Returns the first position p in [buffer, end - 2) where p[0] == p[1] == 0
+// and p[2] == 1 (or p[2] == 0 if accept_zero is set). If there is none, the
+// position where a byte by byte scan would stop, max(buffer, end - 2), is
+// returned. With SSE2, 16 positions are tested per step and only those with
+// two zero bytes are looked at further, which are rare in coded slice data.
+inline const u8* find_start_code(const u8* buffer, const u8* end,
+                                 bool accept_zero) {
+  const u8* last = end - 2;
+  const u8* p = buffer;
+  if (p >= last) {
+    return p;
   }
-
-  return (info - 1);
+#ifdef __SSE2__
+  const __m128i zero = _mm_setzero_si128();
+  // 16 positions read up to p[17]
+  while (last - p >= 16) {
+    __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+    __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 1));
+    u32 mask = _mm_movemask_epi8(
+        _mm_and_si128(_mm_cmpeq_epi8(a, zero), _mm_cmpeq_epi8(b, zero)));
+    while (mask != 0) {
+      const u8* q = p + __builtin_ctz(mask);
+      if (q[2] == 0x01 || (accept_zero && q[2] == 0x00)) {
+        return q;
+      }
+      mask &= mask - 1;
+    }
+    p += 16;
+  }
+#endif
+  for (; p < last; ++p) {
+    if (p[0] == 0x00 && p[1] == 0x00 &&
+        (p[2] == 0x01 || (accept_zero && p[2] == 0x00))) {
+      return p;
+    }
+  }
+  return last;
 }
 
 inline void next_nal(const u8*& buffer, i32& buffer_size_left,
                      const u8*& nal_start, i32& nal_size) {
-  bool found = false;
-  while (buffer_size_left > 2) {
-    if (buffer[0] == 0x00 && buffer[1] == 0x00 && buffer[2] == 0x01) {
-      found = true;
-      break;
-    }
-    buffer++;
-    buffer_size_left--;
-  }
+  const u8* end = buffer + buffer_size_left;
+  buffer = find_start_code(buffer, end, false);
+  bool found = end - buffer > 2;
 
   buffer += 3;
-  buffer_size_left -= 3;
+  buffer_size_left = end - buffer;
 
   nal_start = buffer;
   nal_size = 0;
@@ -95,13 +137,10 @@ inline void next_nal(const u8*& buffer, i32& buffer_size_left,
   if (!found) {
     return;
   }
-  while (buffer_size_left > 2 &&
-         !(buffer[0] == 0x00 && buffer[1] == 0x00 &&
-           (buffer[2] == 0x00 || buffer[2] == 0x01))) {
-    buffer++;
-    buffer_size_left--;
-    nal_size++;
-  }
+  const u8* next = find_start_code(buffer, end, true);
+  nal_size = next - buffer;
+  buffer = next;
+  buffer_size_left = end - buffer;
   if (!(buffer_size_left > 3)) {
     nal_size += buffer_size_left;
     // Not sure if this is needed or not...
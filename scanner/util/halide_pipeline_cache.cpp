@@ -0,0 +1,71 @@
+/* Copyright 2017 Carnegie Mellon University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "scanner/util/halide_pipeline_cache.h"
+#include "scanner/util/util.h"
+
+#include <glog/logging.h>
+
+namespace scanner {
+
+std::string halide_target_for(const DeviceHandle& device) {
+  Halide::Target target = Halide::get_host_target();
+  if (device.type == DeviceType::GPU) {
+    target.set_feature(Halide::Target::CUDA);
+    target.set_feature(Halide::Target::CUDACapability50);
+  }
+  return target.to_string();
+}
+
+HalidePipelineCache& HalidePipelineCache::instance() {
+  static HalidePipelineCache cache;
+  return cache;
+}
+
+std::shared_ptr<Halide::Pipeline> HalidePipelineCache::get(
+    const HalidePipelineKey& key, const Builder& builder) {
+  std::shared_ptr<Entry> entry;
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    std::shared_ptr<Entry>& slot = entries_[key];
+    if (!slot) {
+      slot = std::make_shared<Entry>();
+    }
+    entry = slot;
+  }
+  // Compiling takes seconds, so it happens outside the lock
+  std::call_once(entry->compiled, [&]() {
+    auto start = now();
+    std::shared_ptr<Halide::Pipeline> pipeline =
+        std::make_shared<Halide::Pipeline>(builder(key));
+    pipeline->compile_jit(Halide::Target(key.target));
+    VLOG(1) << "Compiled Halide pipeline " << key.pipeline << " for "
+            << key.target << " in " << nano_since(start) / 1e9 << "s";
+    entry->pipeline = pipeline;
+  });
+  return entry->pipeline;
+}
+
+size_t HalidePipelineCache::size() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  return entries_.size();
+}
+
+void HalidePipelineCache::clear() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  entries_.clear();
+}
+}
@@ -0,0 +1,81 @@
+/* Copyright 2017 Carnegie Mellon University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#pragma once
+
+#include "scanner/util/common.h"
+
+#include "Halide.h"
+
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <tuple>
+#include <vector>
+
+namespace scanner {
+
+//! Identifies a compiled pipeline: the same algorithm is compiled separately
+//! for each input shape and target so its schedule can be specialized to them
+struct HalidePipelineKey {
+  std::string pipeline;
+  std::vector<i32> dims;
+  std::string target;
+
+  bool operator<(const HalidePipelineKey& o) const {
+    return std::tie(pipeline, dims, target) <
+           std::tie(o.pipeline, o.dims, o.target);
+  }
+};
+
+//! Halide target string for running on the device, with the features the
+//! ahead of time generators are compiled with
+std::string halide_target_for(const DeviceHandle& device);
+
+//! Process-wide cache of JIT compiled Halide pipelines. Kernels of every
+//! task and job in the process share it, so a pipeline is compiled once per
+//! shape and target instead of once per kernel instance, and new
+//! preprocessing pipelines can be built at runtime without a rebuild.
+class HalidePipelineCache {
+ public:
+  //! Defines the pipeline and schedules it for the key's dims and target
+  using Builder = std::function<Halide::Pipeline(const HalidePipelineKey&)>;
+
+  static HalidePipelineCache& instance();
+
+  //! The pipeline of key compiled for its target. The first caller for a key
+  //! builds and compiles it while later callers for the same key wait;
+  //! callers for other keys are not blocked.
+  std::shared_ptr<Halide::Pipeline> get(const HalidePipelineKey& key,
+                                        const Builder& builder);
+
+  //! Distinct keys compiled so far
+  size_t size();
+
+  void clear();
+
+ private:
+  struct Entry {
+    std::once_flag compiled;
+    std::shared_ptr<Halide::Pipeline> pipeline;
+  };
+
+  std::mutex mutex_;
+  std::map<HalidePipelineKey, std::shared_ptr<Entry>> entries_;
+};
+}
@@ -0,0 +1,208 @@
+/* Copyright 2017 Carnegie Mellon University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#pragma once
+
+#include "scanner/util/common.h"
+#include "scanner/util/h264.h"
+
+#include <algorithm>
+#include <map>
+#include <vector>
+
+namespace scanner {
+
+// NAL unit types of H.265 (Table 7-1) that the indexer distinguishes
+const i32 HEVC_NAL_IDR_W_RADL = 19;
+const i32 HEVC_NAL_IDR_N_LP = 20;
+const i32 HEVC_NAL_VPS = 32;
+const i32 HEVC_NAL_SPS = 33;
+const i32 HEVC_NAL_PPS = 34;
+
+// Slice types of H.265 (Table 7-7)
+const u32 HEVC_SLICE_B = 0;
+const u32 HEVC_SLICE_P = 1;
+const u32 HEVC_SLICE_I = 2;
+
+inline i32 get_hevc_nal_unit_type(const u8* nal_start) {
+  return (nal_start[0] >> 1) & 0x3F;
+}
+
+inline i32 get_hevc_temporal_id(const u8* nal_start) {
+  return (nal_start[1] & 0x7) - 1;
+}
+
+inline bool is_hevc_vcl_nal(i32 nal_type) { return nal_type < 32; }
+
+inline bool is_hevc_irap_nal(i32 nal_type) {
+  return nal_type >= 16 && nal_type <= 23;
+}
+
+inline bool is_hevc_idr_nal(i32 nal_type) {
+  return nal_type == HEVC_NAL_IDR_W_RADL || nal_type == HEVC_NAL_IDR_N_LP;
+}
+
+//! TRAIL_N, TSA_N, STSA_N, RADL_N, RASL_N and the reserved even types below
+//  16 are not referenced by pictures of the same temporal sub-layer
+inline bool is_hevc_sub_layer_non_ref_nal(i32 nal_type) {
+  return nal_type <= 14 && nal_type % 2 == 0;
+}
+
+//! Strips the emulation prevention bytes of at most max_size bytes of a NAL
+//  unit after its two byte header
+inline void hevc_nal_to_rbsp(const u8* nal_start, i32 nal_size, i32 max_size,
+                             std::vector<u8>& rbsp) {
+  rbsp.clear();
+  u32 consecutive_zeros = 0;
+  const u8* pb = nal_start + 2;
+  i32 bytes = std::min(nal_size - 2, max_size);
+  while (bytes > 0) {
+    if (consecutive_zeros < 2 || *pb != 0x03) {
+      rbsp.push_back(*pb);
+    }
+    if (*pb == 0) {
+      ++consecutive_zeros;
+    } else {
+      consecutive_zeros = 0;
+    }
+    ++pb;
+    --bytes;
+  }
+  // Slack for readers that run past truncated headers
+  rbsp.resize(rbsp.size() + 16, 0);
+}
+
+inline void skip_hevc_profile_tier_level(GetBitsState& gb,
+                                         u32 max_sub_layers_minus1) {
+  // general_profile_space, tier, profile_idc, compatibility flags,
+  // constraint flags and level_idc
+  gb.offset += 96;
+  std::vector<bool> profile_present(max_sub_layers_minus1);
+  std::vector<bool> level_present(max_sub_layers_minus1);
+  for (u32 i = 0; i < max_sub_layers_minus1; ++i) {
+    profile_present[i] = get_bit(gb);
+    level_present[i] = get_bit(gb);
+  }
+  if (max_sub_layers_minus1 > 0) {
+    // reserved_zero_2bits
+    gb.offset += 2 * (8 - max_sub_layers_minus1);
+  }
+  for (u32 i = 0; i < max_sub_layers_minus1; ++i) {
+    if (profile_present[i]) {
+      gb.offset += 88;
+    }
+    if (level_present[i]) {
+      gb.offset += 8;
+    }
+  }
+}
+
+inline u32 parse_hevc_vps_id(GetBitsState& gb) {
+  // vps_video_parameter_set_id
+  return get_bits(gb, 4);
+}
+
+struct HEVCSPS {
+  u32 sps_id;
+  u32 max_sub_layers_minus1;
+};
+
+inline bool parse_hevc_sps(GetBitsState& gb, HEVCSPS& info) {
+  // sps_video_parameter_set_id
+  get_bits(gb, 4);
+  // sps_max_sub_layers_minus1
+  info.max_sub_layers_minus1 = get_bits(gb, 3);
+  if (info.max_sub_layers_minus1 > 6) {
+    LOG(WARNING) << "invalid sps_max_sub_layers_minus1 "
+                 << info.max_sub_layers_minus1;
+    return false;
+  }
+  // sps_temporal_id_nesting_flag
+  get_bit(gb);
+  skip_hevc_profile_tier_level(gb, info.max_sub_layers_minus1);
+  // sps_seq_parameter_set_id
+  info.sps_id = get_ue_golomb(gb);
+  if (info.sps_id > 15) {
+    LOG(WARNING) << "invalid sps id " << info.sps_id;
+    return false;
+  }
+  return true;
+}
+
+struct HEVCPPS {
+  u32 pps_id;
+  u32 sps_id;
+  bool dependent_slice_segments_enabled_flag;
+  u32 num_extra_slice_header_bits;
+};
+
+inline bool parse_hevc_pps(GetBitsState& gb, HEVCPPS& info) {
+  // pps_pic_parameter_set_id
+  info.pps_id = get_ue_golomb(gb);
+  if (info.pps_id > 63) {
+    LOG(WARNING) << "invalid pps id " << info.pps_id;
+    return false;
+  }
+  // pps_seq_parameter_set_id
+  info.sps_id = get_ue_golomb(gb);
+  // dependent_slice_segments_enabled_flag
+  info.dependent_slice_segments_enabled_flag = get_bit(gb);
+  // output_flag_present_flag
+  get_bit(gb);
+  // num_extra_slice_header_bits
+  info.num_extra_slice_header_bits = get_bits(gb, 3);
+  return true;
+}
+
+struct HEVCSliceHeader {
+  bool first_slice_segment_in_pic_flag;
+  u32 pps_id;
+  //! Only parsed for the first slice segment of a picture
+  u32 slice_type;
+};
+
+inline bool parse_hevc_slice_header(GetBitsState& gb, i32 nal_unit_type,
+                                    std::map<u32, HEVCPPS>& pps_map,
+                                    HEVCSliceHeader& info) {
+  // first_slice_segment_in_pic_flag
+  info.first_slice_segment_in_pic_flag = get_bit(gb);
+  if (is_hevc_irap_nal(nal_unit_type)) {
+    // no_output_of_prior_pics_flag
+    get_bit(gb);
+  }
+  // slice_pic_parameter_set_id
+  info.pps_id = get_ue_golomb(gb);
+  auto it = pps_map.find(info.pps_id);
+  if (it == pps_map.end()) {
+    LOG(WARNING) << "slice refers to unknown pps " << info.pps_id;
+    return false;
+  }
+  info.slice_type = HEVC_SLICE_I;
+  if (!info.first_slice_segment_in_pic_flag) {
+    // The address and type follow, but the picture is already counted
+    return true;
+  }
+  // slice_reserved_flag
+  gb.offset += it->second.num_extra_slice_header_bits;
+  // slice_type
+  info.slice_type = get_ue_golomb(gb);
+  if (info.slice_type > 2) {
+    LOG(WARNING) << "invalid slice type " << info.slice_type;
+    return false;
+  }
+  return true;
+}
+}
@@ -15,7 +15,9 @@
 
 #include "scanner/util/image.h"
 
+#include <algorithm>
 #include <cuda.h>
+#include <cuda_fp16.h>
 #include <cuda_runtime_api.h>
 
 namespace scanner {
@@ -226,6 +228,25 @@ __host__ __device__ __forceinline__ int divUp(int total, int grain) {
 }
 // End OpenCV code
 
+namespace {
+__global__ void RGB_to_RGBA(const u8* srcImage, size_t nSourcePitch,
+                            u8* dstImage, size_t nDestPitch, uint width,
+                            uint height) {
+  const int x = blockIdx.x * blockDim.x + threadIdx.x;
+  const int y = blockIdx.y * blockDim.y + threadIdx.y;
+
+  if (x >= width || y >= height)
+    return;
+
+  const u8* src = srcImage + y * nSourcePitch + x * 3;
+  u8* dst = dstImage + y * nDestPitch + x * 4;
+  dst[0] = src[0];
+  dst[1] = src[1];
+  dst[2] = src[2];
+  dst[3] = 0xff;
+}
+}
+
 cudaError_t convertNV12toRGBA(const u8 *in, size_t in_pitch,
                               u8 *out, size_t out_pitch,
                               int width, int height,
@@ -249,4 +270,411 @@ cudaError_t convertRGBInterleavedToPlanar(const u8 *in, size_t in_pitch,
   return cudaPeekAtLastError();
 }
 
+// Each block counts a slice of one frame into bins in shared memory and adds
+// them to the frame's histogram once, so the global atomics are few
+__global__ void histogram_batch(const u8* const* frames, const size_t* pitches,
+                                uint width, uint height, int32_t* hists) {
+  __shared__ int32_t bins[48];
+  for (int i = threadIdx.x; i < 48; i += blockDim.x)
+    bins[i] = 0;
+  __syncthreads();
+
+  const int frame = blockIdx.y;
+  const u8* image = frames[frame];
+  const size_t pitch = pitches[frame];
+  const size_t row_bytes = (size_t)width * 3;
+  const size_t total = row_bytes * height;
+  for (size_t i = (size_t)blockIdx.x * blockDim.x + threadIdx.x; i < total;
+       i += (size_t)gridDim.x * blockDim.x) {
+    const size_t y = i / row_bytes;
+    const size_t x = i - y * row_bytes;
+    const int channel = x % 3;
+    atomicAdd(&bins[channel * 16 + (image[y * pitch + x] >> 4)], 1);
+  }
+  __syncthreads();
+
+  for (int i = threadIdx.x; i < 48; i += blockDim.x)
+    if (bins[i] > 0)
+      atomicAdd(&hists[frame * 48 + i], bins[i]);
+}
+
+cudaError_t histogramBatch(const u8 *const *frames, const size_t *pitches,
+                           int width, int height, int num_frames,
+                           int32_t *hists, cudaStream_t stream) {
+  cudaError_t err =
+      cudaMemsetAsync(hists, 0, sizeof(int32_t) * 48 * num_frames, stream);
+  if (err != cudaSuccess) {
+    return err;
+  }
+  dim3 block(256);
+  // Enough blocks per frame to fill the device, but no more than a frame's
+  // bytes can keep busy
+  int blocks_per_frame = std::min(divUp(width * height * 3, block.x), 32);
+  dim3 grid(blocks_per_frame, num_frames);
+
+  histogram_batch<<<grid, block, 0, stream>>>(frames, pitches, width, height,
+                                              hists);
+  return cudaPeekAtLastError();
+}
+
+// Samples output pixel (x, y) of an interleaved 3 channel image resized to
+// out_width x out_height, with the same pixel centers as cv::resize with
+// INTER_LINEAR
+__device__ __forceinline__ void bilinear_rgb(const u8* image, size_t pitch,
+                                             int width, int height,
+                                             int out_width, int out_height,
+                                             int x, int y, float v[3]) {
+  float fx = (x + 0.5f) * width / out_width - 0.5f;
+  float fy = (y + 0.5f) * height / out_height - 0.5f;
+  fx = fmaxf(fx, 0.0f);
+  fy = fmaxf(fy, 0.0f);
+  const int x0 = min((int)fx, width - 1);
+  const int y0 = min((int)fy, height - 1);
+  const int x1 = min(x0 + 1, width - 1);
+  const int y1 = min(y0 + 1, height - 1);
+  const float ax = fx - x0;
+  const float ay = fy - y0;
+
+  const u8* row0 = image + y0 * pitch;
+  const u8* row1 = image + y1 * pitch;
+  for (int c = 0; c < 3; ++c) {
+    float top = row0[x0 * 3 + c] * (1.0f - ax) + row0[x1 * 3 + c] * ax;
+    float bottom = row1[x0 * 3 + c] * (1.0f - ax) + row1[x1 * 3 + c] * ax;
+    v[c] = top * (1.0f - ay) + bottom * ay;
+  }
+}
+
+__global__ void resize_batch(const u8* const* frames, const size_t* pitches,
+                             int width, int height, u8* out, int out_width,
+                             int out_height, bool planar, bool swap_channels,
+                             float mean0, float mean1, float mean2,
+                             float scale) {
+  const int x = blockIdx.x * blockDim.x + threadIdx.x;
+  const int y = blockIdx.y * blockDim.y + threadIdx.y;
+  const int frame = blockIdx.z;
+
+  if (x >= out_width || y >= out_height)
+    return;
+
+  float v[3];
+  bilinear_rgb(frames[frame], pitches[frame], width, height, out_width,
+               out_height, x, y, v);
+
+  const size_t plane = (size_t)out_width * out_height;
+  if (planar) {
+    float* dst = reinterpret_cast<float*>(out) + frame * plane * 3;
+    const float mean[3] = {mean0, mean1, mean2};
+    for (int c = 0; c < 3; ++c) {
+      float value = v[swap_channels ? 2 - c : c];
+      dst[c * plane + y * out_width + x] = (value - mean[c]) * scale;
+    }
+  } else {
+    u8* dst = out + frame * plane * 3 + ((size_t)y * out_width + x) * 3;
+    for (int c = 0; c < 3; ++c) {
+      dst[c] = (u8)(v[c] + 0.5f);
+    }
+  }
+}
+
+cudaError_t resizeBatch(const u8 *const *frames, const size_t *pitches,
+                        int width, int height, int num_frames, u8 *out,
+                        int out_width, int out_height, bool planar,
+                        bool swap_channels, const float mean[3], float scale,
+                        cudaStream_t stream) {
+  dim3 block(32, 8);
+  dim3 grid(divUp(out_width, block.x), divUp(out_height, block.y),
+            num_frames);
+
+  resize_batch<<<grid, block, 0, stream>>>(
+      frames, pitches, width, height, out, out_width, out_height, planar,
+      swap_channels, mean[0], mean[1], mean[2], scale);
+  return cudaPeekAtLastError();
+}
+
+__global__ void montage_batch(const u8* const* frames, const size_t* pitches,
+                              int width, int height, u8* const* tiles,
+                              size_t out_pitch, int tile_width,
+                              int tile_height) {
+  const int x = blockIdx.x * blockDim.x + threadIdx.x;
+  const int y = blockIdx.y * blockDim.y + threadIdx.y;
+  const int frame = blockIdx.z;
+
+  if (x >= tile_width || y >= tile_height)
+    return;
+
+  float v[3];
+  bilinear_rgb(frames[frame], pitches[frame], width, height, tile_width,
+               tile_height, x, y, v);
+
+  u8* dst = tiles[frame] + y * out_pitch + x * 3;
+  for (int c = 0; c < 3; ++c) {
+    dst[c] = (u8)(v[c] + 0.5f);
+  }
+}
+
+cudaError_t montageBatch(const u8 *const *frames, const size_t *pitches,
+                         int width, int height, int num_frames,
+                         u8 *const *tiles, size_t out_pitch, int tile_width,
+                         int tile_height, cudaStream_t stream) {
+  dim3 block(32, 8);
+  dim3 grid(divUp(tile_width, block.x), divUp(tile_height, block.y),
+            num_frames);
+
+  montage_batch<<<grid, block, 0, stream>>>(frames, pitches, width, height,
+                                            tiles, out_pitch, tile_width,
+                                            tile_height);
+  return cudaPeekAtLastError();
+}
+
+// blockIdx.y picks the box and blockIdx.z one of its four edges. Threads
+// walk the edge's stroke, which extends past the corners so they are filled.
+__global__ void draw_boxes_batch(u8* const* frames, const size_t* pitches,
+                                 int width, int height,
+                                 const DrawBoxRect* boxes, int half, u8 c0,
+                                 u8 c1, u8 c2) {
+  const DrawBoxRect box = boxes[blockIdx.y];
+  const int edge = blockIdx.z;
+  const bool horizontal = edge < 2;
+  const int span = 2 * half + 1;
+  const int length =
+      (horizontal ? box.x2 - box.x1 : box.y2 - box.y1) + 2 * half + 1;
+
+  u8* image = frames[box.frame];
+  const size_t pitch = pitches[box.frame];
+  for (int i = blockIdx.x * blockDim.x + threadIdx.x; i < length * span;
+       i += gridDim.x * blockDim.x) {
+    const int along = i / span;
+    const int across = i - along * span - half;
+    int x, y;
+    if (horizontal) {
+      x = box.x1 - half + along;
+      y = (edge == 0 ? box.y1 : box.y2) + across;
+    } else {
+      x = (edge == 2 ? box.x1 : box.x2) + across;
+      y = box.y1 - half + along;
+    }
+    if (x < 0 || y < 0 || x >= width || y >= height)
+      continue;
+    u8* pixel = image + y * pitch + x * 3;
+    pixel[0] = c0;
+    pixel[1] = c1;
+    pixel[2] = c2;
+  }
+}
+
+cudaError_t drawBoxesBatch(u8 *const *frames, const size_t *pitches,
+                           int width, int height, const DrawBoxRect *boxes,
+                           int num_boxes, int thickness, const u8 color[3],
+                           cudaStream_t stream) {
+  if (num_boxes == 0) {
+    return cudaSuccess;
+  }
+  const int half = thickness / 2;
+  dim3 block(256);
+  // Enough threads to cover the stroke of an edge as long as the frame
+  const int longest = (std::max(width, height) + 2 * half + 1) * (2 * half + 1);
+  dim3 grid(std::min(divUp(longest, block.x), 16), num_boxes, 4);
+
+  draw_boxes_batch<<<grid, block, 0, stream>>>(frames, pitches, width, height,
+                                               boxes, half, color[0], color[1],
+                                               color[2]);
+  return cudaPeekAtLastError();
+}
+
+// One thread per row and channel sweeps a running sum along the row
+__global__ void box_blur_rows(const u8* in, size_t in_pitch, uint32_t* sums,
+                              int width, int height, int left, int right) {
+  const int i = blockIdx.x * blockDim.x + threadIdx.x;
+  const int y = i / 3;
+  const int c = i - y * 3;
+  if (y >= height)
+    return;
+
+  const u8* row = in + y * in_pitch;
+  uint32_t* row_sums = sums + (size_t)y * width * 3;
+  const int size = left + right + 1;
+  uint32_t acc = 0;
+  for (int x = 0; x < size; ++x)
+    acc += row[x * 3 + c];
+  row_sums[left * 3 + c] = acc;
+  for (int x = left + 1; x < width - right; ++x) {
+    acc = acc + row[(x + right) * 3 + c] - row[(x - left - 1) * 3 + c];
+    row_sums[x * 3 + c] = acc;
+  }
+}
+
+// One thread per column and channel sweeps the row sums down the column
+__global__ void box_blur_cols(const uint32_t* sums, u8* out, size_t out_pitch,
+                              int width, int height, int left, int right) {
+  const int j = left * 3 + blockIdx.x * blockDim.x + threadIdx.x;
+  if (j >= (width - right) * 3)
+    return;
+
+  const size_t row_elements = (size_t)width * 3;
+  const int size = left + right + 1;
+  const float inv_area = 1.0f / (size * size);
+  uint32_t acc = 0;
+  for (int r = 0; r < size; ++r)
+    acc += sums[r * row_elements + j];
+  for (int y = left; y < height - right; ++y) {
+    out[y * out_pitch + j] = (u8)((acc + 0.5f) * inv_area);
+    if (y + right + 1 < height)
+      acc = acc + sums[(y + right + 1) * row_elements + j] -
+            sums[(y - left) * row_elements + j];
+  }
+}
+
+cudaError_t boxBlur(const u8 *in, size_t in_pitch, u8 *out, size_t out_pitch,
+                    uint32_t *sums, int width, int height, int filter_left,
+                    int filter_right, cudaStream_t stream) {
+  const int size = filter_left + filter_right + 1;
+  if (width < size || height < size) {
+    return cudaSuccess;
+  }
+  dim3 block(128);
+  box_blur_rows<<<divUp(height * 3, block.x), block, 0, stream>>>(
+      in, in_pitch, sums, width, height, filter_left, filter_right);
+  box_blur_cols<<<divUp((width - size + 1) * 3, block.x), block, 0, stream>>>(
+      sums, out, out_pitch, width, height, filter_left, filter_right);
+  return cudaPeekAtLastError();
+}
+
+__global__ void abs_diff_batch(const u8* const* frames, const size_t* pitches,
+                               int row_bytes, int height, u8* out) {
+  const int x = blockIdx.x * blockDim.x + threadIdx.x;
+  const int y = blockIdx.y * blockDim.y + threadIdx.y;
+  const int pair = blockIdx.z;
+
+  if (x >= row_bytes || y >= height)
+    return;
+
+  const u8 a = frames[pair * 2][y * pitches[pair * 2] + x];
+  const u8 b = frames[pair * 2 + 1][y * pitches[pair * 2 + 1] + x];
+  out[((size_t)pair * height + y) * row_bytes + x] = a > b ? a - b : b - a;
+}
+
+cudaError_t absDiffBatch(const u8 *const *frames, const size_t *pitches,
+                         int row_bytes, int height, int num_frames, u8 *out,
+                         cudaStream_t stream) {
+  dim3 block(128, 2);
+  dim3 grid(divUp(row_bytes, block.x), divUp(height, block.y), num_frames);
+
+  abs_diff_batch<<<grid, block, 0, stream>>>(frames, pitches, row_bytes,
+                                             height, out);
+  return cudaPeekAtLastError();
+}
+
+__global__ void F32_to_F16(const float* src, uint16_t* dst, size_t count) {
+  const size_t i = (size_t)blockIdx.x * blockDim.x + threadIdx.x;
+  if (i >= count)
+    return;
+  __half h = __float2half(src[i]);
+  dst[i] = *reinterpret_cast<uint16_t*>(&h);
+}
+
+__global__ void F16_to_F32(const uint16_t* src, float* dst, size_t count) {
+  const size_t i = (size_t)blockIdx.x * blockDim.x + threadIdx.x;
+  if (i >= count)
+    return;
+  dst[i] = __half2float(*reinterpret_cast<const __half*>(&src[i]));
+}
+
+cudaError_t convertF32toF16(const float *in, uint16_t *out, size_t count,
+                            cudaStream_t stream) {
+  dim3 block(256);
+  dim3 grid(divUp(count, block.x));
+
+  F32_to_F16<<<grid, block, 0, stream>>>(in, out, count);
+  return cudaPeekAtLastError();
+}
+
+cudaError_t convertF16toF32(const uint16_t *in, float *out, size_t count,
+                            cudaStream_t stream) {
+  dim3 block(256);
+  dim3 grid(divUp(count, block.x));
+
+  F16_to_F32<<<grid, block, 0, stream>>>(in, out, count);
+  return cudaPeekAtLastError();
+}
+
+// Each thread matches one query descriptor, kept in registers, against the
+// pair's train descriptors, which the block stages through shared memory a
+// tile at a time
+__global__ void match_descriptors_batch(const DescriptorPair* pairs,
+                                        int32_t* train_idx, float* distances) {
+  const int DIMS = 64;
+  const int TILE = 32;
+  __shared__ float tile[TILE * DIMS];
+
+  const DescriptorPair pair = pairs[blockIdx.y];
+  if (blockIdx.x * blockDim.x >= pair.query_count)
+    return;
+  const int q = blockIdx.x * blockDim.x + threadIdx.x;
+  const bool active = q < pair.query_count;
+
+  float query[DIMS];
+  if (active) {
+#pragma unroll
+    for (int d = 0; d < DIMS; ++d)
+      query[d] = pair.query[(size_t)q * pair.query_step + d];
+  }
+
+  float best = INFINITY;
+  int best_idx = -1;
+  for (int t0 = 0; t0 < pair.train_count; t0 += TILE) {
+    const int rows = min(TILE, pair.train_count - t0);
+    for (int i = threadIdx.x; i < rows * DIMS; i += blockDim.x) {
+      const int r = i / DIMS;
+      tile[i] = pair.train[(size_t)(t0 + r) * pair.train_step + i % DIMS];
+    }
+    __syncthreads();
+
+    if (active) {
+      for (int r = 0; r < rows; ++r) {
+        float dist = 0;
+#pragma unroll
+        for (int d = 0; d < DIMS; ++d) {
+          const float diff = query[d] - tile[r * DIMS + d];
+          dist += diff * diff;
+        }
+        if (dist < best) {
+          best = dist;
+          best_idx = t0 + r;
+        }
+      }
+    }
+    __syncthreads();
+  }
+
+  if (active) {
+    train_idx[pair.out_offset + q] = best_idx;
+    distances[pair.out_offset + q] = sqrtf(best);
+  }
+}
+
+cudaError_t matchDescriptorsBatch(const DescriptorPair *pairs, int num_pairs,
+                                  int max_query_count, int32_t *train_idx,
+                                  float *distances, cudaStream_t stream) {
+  if (num_pairs == 0 || max_query_count == 0) {
+    return cudaSuccess;
+  }
+  dim3 block(128);
+  dim3 grid(divUp(max_query_count, block.x), num_pairs);
+
+  match_descriptors_batch<<<grid, block, 0, stream>>>(pairs, train_idx,
+                                                      distances);
+  return cudaPeekAtLastError();
+}
+
+cudaError_t convertRGBtoRGBA(const u8 *in, size_t in_pitch, u8 *out,
+                             size_t out_pitch, int width, int height,
+                             cudaStream_t stream) {
+  dim3 block(32, 8);
+  dim3 grid(divUp(width, block.x), divUp(height, block.y));
+
+  RGB_to_RGBA<<<grid, block, 0, stream>>>(in, in_pitch, out, out_pitch, width,
+                                          height);
+  return cudaPeekAtLastError();
+}
+
 }
@@ -35,5 +35,98 @@ cudaError_t convertNV12toRGBA(const u8* in, size_t in_pitch, u8* out,
 cudaError_t convertRGBInterleavedToPlanar(const u8* in, size_t in_pitch,
                                           u8* out, size_t out_pitch, int width,
                                           int height, cudaStream_t stream);
+
+//! Computes the 16 bin histogram of each channel of num_frames interleaved
+//! 3 channel frames of the same size in one launch. frames and pitches are
+//! device arrays with one entry per frame. hists receives 48 counts per
+//! frame, channel by channel.
+cudaError_t histogramBatch(const u8* const* frames, const size_t* pitches,
+                           int width, int height, int num_frames,
+                           int32_t* hists, cudaStream_t stream);
+
+//! Bilinearly resizes num_frames interleaved 3 channel frames of the same
+//! size in one launch. The outputs are packed back to back at out, either as
+//! U8 frames of the same layout or, when planar is set, as (3, height, width)
+//! float tensors whose channels are optionally swapped, have mean[c]
+//! subtracted and are multiplied by scale.
+cudaError_t resizeBatch(const u8* const* frames, const size_t* pitches,
+                        int width, int height, int num_frames, u8* out,
+                        int out_width, int out_height, bool planar,
+                        bool swap_channels, const float mean[3], float scale,
+                        cudaStream_t stream);
+
+//! Bilinearly resizes num_frames interleaved 3 channel frames of the same
+//! size to tile_width x tile_height and writes each into its own tile of
+//! interleaved 3 channel images, in one launch. tiles is a device array with
+//! the address of each frame's top left output pixel, and out_pitch is the
+//! row pitch of the images that hold the tiles.
+cudaError_t montageBatch(const u8* const* frames, const size_t* pitches,
+                         int width, int height, int num_frames,
+                         u8* const* tiles, size_t out_pitch, int tile_width,
+                         int tile_height, cudaStream_t stream);
+
+//! A rectangle to outline on frame number frame of a drawBoxesBatch call,
+//! from (x1, y1) to (x2, y2) inclusive
+struct DrawBoxRect {
+  int frame;
+  int x1;
+  int y1;
+  int x2;
+  int y2;
+};
+
+//! Outlines num_boxes rectangles on interleaved 3 channel frames of the same
+//! size in one launch, with strokes thickness / 2 pixels to either side of
+//! each edge in the given color. frames, pitches and boxes are device arrays.
+cudaError_t drawBoxesBatch(u8* const* frames, const size_t* pitches,
+                           int width, int height, const DrawBoxRect* boxes,
+                           int num_boxes, int thickness, const u8 color[3],
+                           cudaStream_t stream);
+
+//! Box filters the pixels of an interleaved 3 channel frame that are at least
+//! filter_left from its top left and filter_right from its bottom right
+//! border, from running sums along rows and then columns. sums is scratch
+//! space for width * height * 3 uint32_t values. in and out may be the same.
+cudaError_t boxBlur(const u8* in, size_t in_pitch, u8* out, size_t out_pitch,
+                    uint32_t* sums, int width, int height, int filter_left,
+                    int filter_right, cudaStream_t stream);
+
+//! Writes |frames[2i] - frames[2i + 1]| of each byte for num_frames pairs of
+//! frames in one launch. The differences are packed back to back at out.
+cudaError_t absDiffBatch(const u8* const* frames, const size_t* pitches,
+                         int row_bytes, int height, int num_frames, u8* out,
+                         cudaStream_t stream);
+
+//! Converts count floats to or from IEEE half precision, stored as uint16_t
+cudaError_t convertF32toF16(const float* in, uint16_t* out, size_t count,
+                            cudaStream_t stream);
+
+cudaError_t convertF16toF32(const uint16_t* in, float* out, size_t count,
+                            cudaStream_t stream);
+
+//! One query/train pair of descriptor sets for matchDescriptorsBatch. Both
+//! sets are rows of 64 floats, step floats apart, in device memory.
+struct DescriptorPair {
+  const float* query;
+  const float* train;
+  int query_step;
+  int train_step;
+  int query_count;
+  int train_count;
+  //! Index of the pair's first query descriptor in the outputs
+  int out_offset;
+};
+
+//! Finds the nearest train descriptor by L2 distance of every query
+//! descriptor of num_pairs pairs in one launch. pairs is a device array.
+//! train_idx and distances receive one entry per query descriptor, at the
+//! pair's out_offset. max_query_count is the largest query_count of any pair.
+cudaError_t matchDescriptorsBatch(const DescriptorPair* pairs, int num_pairs,
+                                  int max_query_count, int32_t* train_idx,
+                                  float* distances, cudaStream_t stream);
+
+cudaError_t convertRGBtoRGBA(const u8* in, size_t in_pitch, u8* out,
+                             size_t out_pitch, int width, int height,
+                             cudaStream_t stream);
 #endif
 }
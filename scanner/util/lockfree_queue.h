@@ -0,0 +1,107 @@
+/* Copyright 2017 Carnegie Mellon University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace scanner {
+
+// Bounded multi-producer multi-consumer ring buffer. Each slot carries a
+// sequence number that tells producers and consumers whether it is free or
+// full for the current lap, so the hand-off is a single CAS on the enqueue or
+// dequeue position. Blocking calls spin briefly before parking on a condition
+// variable, and wake-ups are skipped entirely when nobody is parked.
+template <typename T>
+class LockFreeQueue {
+ public:
+  LockFreeQueue(int max_size = 4);
+
+  int size();
+
+  bool try_push(T& item);
+
+  void push(T item);
+
+  void push_n(std::vector<T>& items);
+
+  //! Calls pushed() whenever items were pushed since the last call, before
+  //! blocking on a full queue and once at the end
+  template <typename Pushed>
+  void push_n(std::vector<T>& items, Pushed pushed);
+
+  bool try_pop(T& item);
+
+  void pop(T& item);
+
+  int pop_up_to(std::vector<T>& items, int n);
+
+  //! Only safe while no other thread pops from the queue
+  void peek(T& item);
+
+  void clear();
+
+  void wait_until_empty();
+
+ private:
+  struct Cell {
+    std::atomic<size_t> sequence;
+    T data;
+  };
+
+  // Claim or fill a slot without waking anyone. Parked threads call these
+  // while holding park_mutex_.
+  bool enqueue(T& item);
+
+  bool dequeue(T& item);
+
+  void popped();
+
+  bool try_peek(T& item);
+
+  bool empty();
+
+  template <typename Predicate>
+  bool spin(Predicate ready);
+
+  template <typename Predicate>
+  void park(std::condition_variable& cv, std::atomic<int>& waiters,
+            Predicate ready);
+
+  void wake(std::condition_variable& cv, std::atomic<int>& waiters);
+
+  static const int SPIN_ITERATIONS = 64;
+
+  const size_t capacity_;
+  std::unique_ptr<Cell[]> cells_;
+  alignas(64) std::atomic<size_t> enqueue_pos_;
+  alignas(64) std::atomic<size_t> dequeue_pos_;
+
+  std::mutex park_mutex_;
+  std::condition_variable empty_;
+  std::condition_variable not_empty_;
+  std::condition_variable not_full_;
+  std::atomic<int> pop_waiters_{0};
+  std::atomic<int> push_waiters_{0};
+  std::atomic<int> empty_waiters_{0};
+};
+}
+
+#include "lockfree_queue.inl"
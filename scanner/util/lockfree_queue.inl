@@ -0,0 +1,258 @@
+/* Copyright 2017 Carnegie Mellon University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "lockfree_queue.h"
+
+#include <thread>
+
+namespace scanner {
+
+template <typename T>
+LockFreeQueue<T>::LockFreeQueue(int max_size)
+    : capacity_(max_size > 0 ? max_size : 1),
+      cells_(new Cell[capacity_]),
+      enqueue_pos_(0),
+      dequeue_pos_(0) {
+  for (size_t i = 0; i < capacity_; ++i) {
+    cells_[i].sequence.store(i, std::memory_order_relaxed);
+  }
+}
+
+template <typename T>
+int LockFreeQueue<T>::size() {
+  size_t enqueue = enqueue_pos_.load(std::memory_order_acquire);
+  size_t dequeue = dequeue_pos_.load(std::memory_order_acquire);
+  int queued = enqueue > dequeue ? (int)(enqueue - dequeue) : 0;
+  return queued - pop_waiters_ + push_waiters_;
+}
+
+template <typename T>
+bool LockFreeQueue<T>::try_push(T& item) {
+  if (!enqueue(item)) {
+    return false;
+  }
+  wake(not_empty_, pop_waiters_);
+  return true;
+}
+
+template <typename T>
+void LockFreeQueue<T>::push(T item) {
+  if (!spin([&] { return enqueue(item); })) {
+    park(not_full_, push_waiters_, [&] { return enqueue(item); });
+  }
+  wake(not_empty_, pop_waiters_);
+}
+
+template <typename T>
+void LockFreeQueue<T>::push_n(std::vector<T>& items) {
+  push_n(items, [] {});
+}
+
+template <typename T>
+template <typename Pushed>
+void LockFreeQueue<T>::push_n(std::vector<T>& items, Pushed pushed) {
+  bool unreported = false;
+  for (T& item : items) {
+    if (!enqueue(item)) {
+      // Let consumers drain what has been pushed so far before blocking
+      wake(not_empty_, pop_waiters_);
+      if (unreported) {
+        pushed();
+        unreported = false;
+      }
+      if (!spin([&] { return enqueue(item); })) {
+        park(not_full_, push_waiters_, [&] { return enqueue(item); });
+      }
+    }
+    unreported = true;
+  }
+  wake(not_empty_, pop_waiters_);
+  if (unreported) {
+    pushed();
+  }
+}
+
+template <typename T>
+bool LockFreeQueue<T>::try_pop(T& item) {
+  if (!dequeue(item)) {
+    return false;
+  }
+  popped();
+  return true;
+}
+
+template <typename T>
+void LockFreeQueue<T>::pop(T& item) {
+  if (!spin([&] { return dequeue(item); })) {
+    park(not_empty_, pop_waiters_, [&] { return dequeue(item); });
+  }
+  popped();
+}
+
+template <typename T>
+int LockFreeQueue<T>::pop_up_to(std::vector<T>& items, int n) {
+  if (n <= 0) {
+    return 0;
+  }
+  T item;
+  if (!spin([&] { return dequeue(item); })) {
+    park(not_empty_, pop_waiters_, [&] { return dequeue(item); });
+  }
+  items.push_back(std::move(item));
+  int count = 1;
+  while (count < n && dequeue(item)) {
+    items.push_back(std::move(item));
+    count++;
+  }
+  popped();
+  return count;
+}
+
+template <typename T>
+bool LockFreeQueue<T>::enqueue(T& item) {
+  size_t pos = enqueue_pos_.load(std::memory_order_relaxed);
+  Cell* cell;
+  while (true) {
+    cell = &cells_[pos % capacity_];
+    size_t seq = cell->sequence.load(std::memory_order_acquire);
+    ptrdiff_t diff = (ptrdiff_t)seq - (ptrdiff_t)pos;
+    if (diff == 0) {
+      if (enqueue_pos_.compare_exchange_weak(pos, pos + 1,
+                                             std::memory_order_relaxed)) {
+        break;
+      }
+    } else if (diff < 0) {
+      // Slot still holds the previous lap's item, so the queue is full
+      return false;
+    } else {
+      pos = enqueue_pos_.load(std::memory_order_relaxed);
+    }
+  }
+  cell->data = std::move(item);
+  cell->sequence.store(pos + 1, std::memory_order_release);
+  return true;
+}
+
+template <typename T>
+bool LockFreeQueue<T>::dequeue(T& item) {
+  size_t pos = dequeue_pos_.load(std::memory_order_relaxed);
+  Cell* cell;
+  while (true) {
+    cell = &cells_[pos % capacity_];
+    size_t seq = cell->sequence.load(std::memory_order_acquire);
+    ptrdiff_t diff = (ptrdiff_t)seq - (ptrdiff_t)(pos + 1);
+    if (diff == 0) {
+      if (dequeue_pos_.compare_exchange_weak(pos, pos + 1,
+                                             std::memory_order_relaxed)) {
+        break;
+      }
+    } else if (diff < 0) {
+      // Slot has not been filled for this lap, so the queue is empty
+      return false;
+    } else {
+      pos = dequeue_pos_.load(std::memory_order_relaxed);
+    }
+  }
+  item = std::move(cell->data);
+  cell->data = T();
+  cell->sequence.store(pos + capacity_, std::memory_order_release);
+  return true;
+}
+
+template <typename T>
+void LockFreeQueue<T>::popped() {
+  wake(not_full_, push_waiters_);
+  if (empty()) {
+    wake(empty_, empty_waiters_);
+  }
+}
+
+template <typename T>
+bool LockFreeQueue<T>::try_peek(T& item) {
+  size_t pos = dequeue_pos_.load(std::memory_order_relaxed);
+  Cell& cell = cells_[pos % capacity_];
+  if (cell.sequence.load(std::memory_order_acquire) != pos + 1) {
+    return false;
+  }
+  item = cell.data;
+  return true;
+}
+
+template <typename T>
+void LockFreeQueue<T>::peek(T& item) {
+  if (!spin([&] { return try_peek(item); })) {
+    park(not_empty_, pop_waiters_, [&] { return try_peek(item); });
+  }
+}
+
+template <typename T>
+void LockFreeQueue<T>::clear() {
+  T item;
+  while (dequeue(item)) {
+  }
+  popped();
+}
+
+template <typename T>
+void LockFreeQueue<T>::wait_until_empty() {
+  if (!spin([&] { return empty(); })) {
+    park(empty_, empty_waiters_, [&] { return empty(); });
+  }
+}
+
+template <typename T>
+bool LockFreeQueue<T>::empty() {
+  return dequeue_pos_.load(std::memory_order_acquire) >=
+         enqueue_pos_.load(std::memory_order_acquire);
+}
+
+template <typename T>
+template <typename Predicate>
+bool LockFreeQueue<T>::spin(Predicate ready) {
+  for (int i = 0; i < SPIN_ITERATIONS; ++i) {
+    if (ready()) {
+      return true;
+    }
+    std::this_thread::yield();
+  }
+  return false;
+}
+
+template <typename T>
+template <typename Predicate>
+void LockFreeQueue<T>::park(std::condition_variable& cv,
+                            std::atomic<int>& waiters, Predicate ready) {
+  std::unique_lock<std::mutex> lock(park_mutex_);
+  waiters++;
+  // Pairs with the fence in wake: either the waker sees this waiter or the
+  // predicate sees the waker's update
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  while (!ready()) {
+    cv.wait(lock);
+  }
+  waiters--;
+}
+
+template <typename T>
+void LockFreeQueue<T>::wake(std::condition_variable& cv,
+                            std::atomic<int>& waiters) {
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (waiters.load(std::memory_order_relaxed) > 0) {
+    // Taking the lock orders the notify after a parked thread's last check
+    { std::lock_guard<std::mutex> guard(park_mutex_); }
+    cv.notify_all();
+  }
+}
+}
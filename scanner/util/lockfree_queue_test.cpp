@@ -0,0 +1,224 @@
+/* Copyright 2017 Carnegie Mellon University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "scanner/util/lockfree_queue.h"
+#include "scanner/util/queue.h"
+
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+namespace scanner {
+
+TEST(LockFreeQueue, FifoUntilFull) {
+  LockFreeQueue<int> queue(4);
+  for (int i = 0; i < 4; ++i) {
+    int item = i;
+    EXPECT_TRUE(queue.try_push(item));
+  }
+  int overflow = 4;
+  EXPECT_FALSE(queue.try_push(overflow));
+  EXPECT_EQ(queue.size(), 4);
+  for (int i = 0; i < 4; ++i) {
+    int item;
+    ASSERT_TRUE(queue.try_pop(item));
+    EXPECT_EQ(item, i);
+  }
+  int item;
+  EXPECT_FALSE(queue.try_pop(item));
+  EXPECT_EQ(queue.size(), 0);
+}
+
+TEST(LockFreeQueue, WrapsAroundManyLaps) {
+  // Capacity not dividing the number of items, so slots are reused at
+  // every offset
+  LockFreeQueue<int> queue(3);
+  for (int i = 0; i < 1000; ++i) {
+    queue.push(2 * i);
+    queue.push(2 * i + 1);
+    int a, b;
+    queue.pop(a);
+    queue.pop(b);
+    ASSERT_EQ(a, 2 * i);
+    ASSERT_EQ(b, 2 * i + 1);
+  }
+}
+
+TEST(LockFreeQueue, DeliversEveryItemExactlyOnce) {
+  const int PRODUCERS = 4;
+  const int CONSUMERS = 4;
+  const int ITEMS = 20000;
+  // Small enough that producers and consumers keep blocking on each other
+  LockFreeQueue<int> queue(8);
+
+  std::vector<std::vector<int>> popped(CONSUMERS);
+  std::vector<std::thread> consumers;
+  for (int c = 0; c < CONSUMERS; ++c) {
+    consumers.emplace_back([&, c] {
+      while (true) {
+        int item;
+        queue.pop(item);
+        if (item == -1) {
+          break;
+        }
+        popped[c].push_back(item);
+      }
+    });
+  }
+  std::vector<std::thread> producers;
+  for (int p = 0; p < PRODUCERS; ++p) {
+    producers.emplace_back([&, p] {
+      for (int i = 0; i < ITEMS; ++i) {
+        queue.push(p * ITEMS + i);
+      }
+    });
+  }
+  for (auto& t : producers) {
+    t.join();
+  }
+  for (int c = 0; c < CONSUMERS; ++c) {
+    queue.push(-1);
+  }
+  for (auto& t : consumers) {
+    t.join();
+  }
+
+  std::vector<int> all;
+  for (auto& items : popped) {
+    // Each consumer sees the items of a producer in the order pushed
+    std::vector<int> last(PRODUCERS, -1);
+    for (int item : items) {
+      int p = item / ITEMS;
+      EXPECT_LT(last[p], item);
+      last[p] = item;
+    }
+    all.insert(all.end(), items.begin(), items.end());
+  }
+  std::sort(all.begin(), all.end());
+  ASSERT_EQ(all.size(), PRODUCERS * ITEMS);
+  for (int i = 0; i < PRODUCERS * ITEMS; ++i) {
+    ASSERT_EQ(all[i], i);
+  }
+  EXPECT_EQ(queue.size(), 0);
+}
+
+TEST(LockFreeQueue, PushNAndPopUpToAtCapacity) {
+  const int ITEMS = 1000;
+  LockFreeQueue<int> queue(4);
+  std::vector<int> items;
+  for (int i = 0; i < ITEMS; ++i) {
+    items.push_back(i);
+  }
+  // Pushes many times the capacity, so push_n blocks until it is drained
+  std::thread producer([&] { queue.push_n(items); });
+
+  std::vector<int> popped;
+  while (popped.size() < ITEMS) {
+    std::vector<int> batch;
+    int n = queue.pop_up_to(batch, 7);
+    ASSERT_GE(n, 1);
+    ASSERT_LE(n, 4);
+    ASSERT_EQ(batch.size(), n);
+    popped.insert(popped.end(), batch.begin(), batch.end());
+  }
+  producer.join();
+  for (int i = 0; i < ITEMS; ++i) {
+    ASSERT_EQ(popped[i], i);
+  }
+
+  // A full queue hands out no more than asked for
+  std::vector<int> full = {0, 1, 2, 3};
+  queue.push_n(full);
+  std::vector<int> batch;
+  EXPECT_EQ(queue.pop_up_to(batch, 3), 3);
+  EXPECT_EQ(queue.pop_up_to(batch, 3), 1);
+  EXPECT_EQ(batch, full);
+  EXPECT_EQ(queue.pop_up_to(batch, 0), 0);
+}
+
+// Pushes many times the capacity to a consumer that, like a stealing
+// pre-evaluate thread, only ever sleeps on a signal of its own. The
+// producer has to raise the signal before blocking on the full queue.
+void push_n_to_signalled_consumer(QueueType type) {
+  const int ITEMS = 100;
+  Queue<int> queue(4, type);
+  std::vector<int> items;
+  for (int i = 0; i < ITEMS; ++i) {
+    items.push_back(i);
+  }
+  std::mutex mutex;
+  std::condition_variable cv;
+  int signals = 0;
+  std::thread producer([&] {
+    queue.push_n(items, [&] {
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        signals++;
+      }
+      cv.notify_all();
+    });
+  });
+
+  std::vector<int> popped;
+  while (popped.size() < ITEMS) {
+    int seen;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      seen = signals;
+    }
+    int item;
+    while (queue.try_pop(item)) {
+      popped.push_back(item);
+    }
+    if (popped.size() < ITEMS) {
+      std::unique_lock<std::mutex> lock(mutex);
+      cv.wait(lock, [&] { return signals != seen; });
+    }
+  }
+  producer.join();
+  for (int i = 0; i < ITEMS; ++i) {
+    ASSERT_EQ(popped[i], i);
+  }
+}
+
+TEST(Queue, PushNSignalsBeforeBlocking) {
+  push_n_to_signalled_consumer(QueueType::Locked);
+}
+
+TEST(LockFreeQueue, PushNSignalsBeforeBlocking) {
+  push_n_to_signalled_consumer(QueueType::LockFree);
+}
+
+TEST(LockFreeQueue, WaitUntilEmpty) {
+  LockFreeQueue<int> queue(4);
+  for (int i = 0; i < 4; ++i) {
+    queue.push(i);
+  }
+  std::thread consumer([&] {
+    for (int i = 0; i < 4; ++i) {
+      int item;
+      queue.pop(item);
+    }
+  });
+  queue.wait_until_empty();
+  consumer.join();
+  int item;
+  EXPECT_FALSE(queue.try_pop(item));
+}
+}
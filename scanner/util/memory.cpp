@@ -15,18 +15,36 @@
 
 #include "scanner/util/memory.h"
 #include "scanner/util/cuda.h"
+#include "scanner/util/cuda_stream_pool.h"
+#include "scanner/util/numa.h"
+#include "scanner/util/util.h"
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/syscall.h>
 #include <sys/sysinfo.h>
 #include <unistd.h>
+#include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <condition_variable>
+#include <map>
 #include <mutex>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
 
 #ifdef HAVE_CUDA
 #include <cuda.h>
 #include <cuda_runtime_api.h>
 #endif
 
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+
 namespace scanner {
 
 // Allocations in Scanner differ from manual memory management in three
@@ -65,18 +83,80 @@ namespace scanner {
 // or block memory segments, the former of which is allocated by the system
 // and the latter by the pool if it exists.
 
+// CPU allocations registered with CUDA, keyed by start with their size.
+// Transfers touching them skip the pinned staging buffers.
+static std::mutex registered_cpu_ranges_lock;
+static std::map<const u8*, size_t> registered_cpu_ranges;
+
+static void add_registered_cpu_range(const u8* buffer, size_t size) {
+  std::lock_guard<std::mutex> guard(registered_cpu_ranges_lock);
+  registered_cpu_ranges[buffer] = size;
+}
+
+static void remove_registered_cpu_range(const u8* buffer) {
+  std::lock_guard<std::mutex> guard(registered_cpu_ranges_lock);
+  registered_cpu_ranges.erase(buffer);
+}
+
+static bool in_registered_cpu_range(const u8* buffer, size_t size) {
+  std::lock_guard<std::mutex> guard(registered_cpu_ranges_lock);
+  auto it = registered_cpu_ranges.upper_bound(buffer);
+  if (it == registered_cpu_ranges.begin()) {
+    return false;
+  }
+  --it;
+  return buffer + size <= it->first + it->second;
+}
+
 class Allocator {
  public:
   virtual ~Allocator(){};
 
   virtual u8* allocate(size_t size) = 0;
   virtual void free(u8* buffer) = 0;
+
+  //! Like allocate, but returns nullptr instead of failing when the allocator
+  //! is out of memory.
+  virtual u8* try_allocate(size_t size) { return allocate(size); }
+
+  //! Frees a buffer whose allocation size the caller knows. Allocators that
+  //! cache buffers by size override this.
+  virtual void free_sized(u8* buffer, size_t size) { free(buffer); }
+
+  //! Allocates num buffers of the same size, appending them to buffers.
+  virtual void allocate_batch(size_t size, i32 num, std::vector<u8*>& buffers) {
+    for (i32 i = 0; i < num; ++i) {
+      buffers.push_back(allocate(size));
+    }
+  }
+
+  virtual void free_batch(const std::vector<u8*>& buffers) {
+    for (u8* buffer : buffers) {
+      free(buffer);
+    }
+  }
+
+  //! Adds this allocator's usage to stats. Allocators that only forward to
+  //! another allocator report nothing.
+  virtual void add_stats(MemoryPoolStats& stats) {}
+
+  //! Restarts high-water mark tracking from the current usage
+  virtual void reset_peak() {}
 };
 
 class SystemAllocator : public Allocator {
  public:
-  SystemAllocator(DeviceHandle device)
-    : device_(device) {
+  // If numa_node is non-negative, CPU allocations are first-touched from that
+  // NUMA node so their pages are placed in its memory. A non-zero
+  // huge_page_size maps CPU allocations with pages of that size, and pinned
+  // registers them with CUDA so transfers from them DMA directly. Both are
+  // meant for the few large allocations backing a pool.
+  SystemAllocator(DeviceHandle device, i32 numa_node = -1,
+                  size_t huge_page_size = 0, bool pinned = false)
+    : device_(device),
+      numa_node_(numa_node),
+      huge_page_size_(huge_page_size),
+      pinned_(pinned) {
   }
 
   ~SystemAllocator() {
@@ -90,9 +170,17 @@ class SystemAllocator : public Allocator {
   }
 
   u8* allocate(size_t size) {
-    if (device_.type == DeviceType::CPU) {
+    if (device_.type == DeviceType::CPU &&
+        (huge_page_size_ > 0 || pinned_)) {
+      return allocate_mapped(size);
+    } else if (device_.type == DeviceType::CPU) {
       try {
-        return new u8[size];
+        u8* buffer = new u8[size];
+        if (numa_node_ >= 0) {
+          first_touch_on_numa_node(buffer, size, numa_node_);
+        }
+        track_allocate(buffer, size);
+        return buffer;
       } catch (const std::bad_alloc& e) {
         LOG(FATAL) << "CPU memory allocation failed: " << e.what();
       }
@@ -102,12 +190,17 @@ class SystemAllocator : public Allocator {
         CU_CHECK(cudaSetDevice(device_.id));
         CU_CHECK(cudaMalloc((void**)&buffer, size));
       });
+      track_allocate(buffer, size);
       return buffer;
     }
   }
 
   void free(u8* buffer) {
-    if (device_.type == DeviceType::CPU) {
+    size_t size = track_free(buffer);
+    if (device_.type == DeviceType::CPU &&
+        (huge_page_size_ > 0 || pinned_)) {
+      free_mapped(buffer, size);
+    } else if (device_.type == DeviceType::CPU) {
       delete[] buffer;
     } else if (device_.type == DeviceType::GPU) {
       CUDA_PROTECT({
@@ -125,8 +218,98 @@ class SystemAllocator : public Allocator {
     }
   }
 
+  void add_stats(MemoryPoolStats& stats) {
+    std::lock_guard<std::mutex> guard(stats_lock_);
+    stats.system_bytes_in_use += bytes_in_use_;
+    stats.system_peak_bytes += peak_bytes_;
+    stats.system_live_buffers += sizes_.size();
+  }
+
+  void reset_peak() {
+    std::lock_guard<std::mutex> guard(stats_lock_);
+    peak_bytes_ = bytes_in_use_;
+  }
+
  private:
+  void track_allocate(u8* buffer, size_t size) {
+    std::lock_guard<std::mutex> guard(stats_lock_);
+    sizes_[buffer] = size;
+    bytes_in_use_ += size;
+    peak_bytes_ = std::max(peak_bytes_, bytes_in_use_);
+  }
+
+  size_t track_free(u8* buffer) {
+    std::lock_guard<std::mutex> guard(stats_lock_);
+    auto it = sizes_.find(buffer);
+    size_t size = 0;
+    if (it != sizes_.end()) {
+      size = it->second;
+      bytes_in_use_ -= size;
+      sizes_.erase(it);
+    }
+    return size;
+  }
+
+  u8* allocate_mapped(size_t size) {
+    size_t page_size = huge_page_size_ > 0 ? huge_page_size_ : getpagesize();
+    size_t mapped_size = (size + page_size - 1) / page_size * page_size;
+    void* ptr = MAP_FAILED;
+    if (huge_page_size_ > 0) {
+      i32 page_shift = __builtin_ctzll(huge_page_size_);
+      ptr = mmap(nullptr, mapped_size, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB |
+                     (page_shift << MAP_HUGE_SHIFT),
+                 -1, 0);
+      if (ptr == MAP_FAILED) {
+        // No huge pages of this size are reserved, so ask for transparent
+        // huge pages instead
+        LOG(WARNING) << "Could not map " << mapped_size << " bytes of "
+                     << huge_page_size_ << " byte huge pages ("
+                     << strerror(errno) << "), falling back to transparent "
+                     << "huge pages";
+      }
+    }
+    if (ptr == MAP_FAILED) {
+      ptr = mmap(nullptr, mapped_size, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      LOG_IF(FATAL, ptr == MAP_FAILED)
+          << "CPU memory allocation failed: " << strerror(errno);
+      if (huge_page_size_ > 0) {
+        madvise(ptr, mapped_size, MADV_HUGEPAGE);
+      }
+    }
+    u8* buffer = (u8*)ptr;
+    if (numa_node_ >= 0) {
+      first_touch_on_numa_node(buffer, mapped_size, numa_node_);
+    }
+    if (pinned_) {
+      // Registering faults in every page, so it comes after the first touch
+      CUDA_PROTECT({
+        CU_CHECK(cudaHostRegister(buffer, mapped_size,
+                                  cudaHostRegisterPortable));
+      });
+      add_registered_cpu_range(buffer, mapped_size);
+    }
+    track_allocate(buffer, mapped_size);
+    return buffer;
+  }
+
+  void free_mapped(u8* buffer, size_t mapped_size) {
+    if (pinned_) {
+      remove_registered_cpu_range(buffer);
+      CUDA_PROTECT({ CU_CHECK(cudaHostUnregister(buffer)); });
+    }
+    munmap(buffer, mapped_size);
+  }
+
   DeviceHandle device_;
+  i32 numa_node_;
+  size_t huge_page_size_;
+  bool pinned_;
+  std::mutex stats_lock_;
+  std::unordered_map<u8*, size_t> sizes_;
+  i64 bytes_in_use_ = 0;
+  i64 peak_bytes_ = 0;
 };
 
 bool pointer_in_buffer(u8* ptr, u8* buf_start, u8* buf_end) {
@@ -146,11 +329,68 @@ class PoolAllocator : public Allocator {
   }
 
   u8* allocate(size_t size) {
+    std::lock_guard<std::mutex> guard(lock_);
+    u8* buffer = allocate_locked(size);
+    LOG_IF(FATAL, buffer == nullptr) << "Exceeded pool size";
+    return buffer;
+  }
+
+  u8* try_allocate(size_t size) {
+    std::lock_guard<std::mutex> guard(lock_);
+    return allocate_locked(size);
+  }
+
+  void allocate_batch(size_t size, i32 num, std::vector<u8*>& buffers) {
+    std::lock_guard<std::mutex> guard(lock_);
+    for (i32 i = 0; i < num; ++i) {
+      u8* buffer = allocate_locked(size);
+      LOG_IF(FATAL, buffer == nullptr) << "Exceeded pool size";
+      buffers.push_back(buffer);
+    }
+  }
+
+  size_t align(size_t ptr) {
+    size_t alignment = system_allocator->alignment();
+    size_t remainder = ptr % alignment;
+    if (remainder != 0) {
+      return ptr + (alignment - remainder);
+    } else {
+      return ptr;
+    }
+  }
+
+  void free(u8* buffer) {
+    std::lock_guard<std::mutex> guard(lock_);
+    free_locked(buffer);
+  }
+
+  void free_batch(const std::vector<u8*>& buffers) {
+    std::lock_guard<std::mutex> guard(lock_);
+    for (u8* buffer : buffers) {
+      free_locked(buffer);
+    }
+  }
+
+  void add_stats(MemoryPoolStats& stats) {
+    std::lock_guard<std::mutex> guard(lock_);
+    stats.pool_size += pool_size_;
+    stats.pool_bytes_in_use += bytes_in_use_;
+    stats.pool_peak_bytes += peak_bytes_;
+    stats.largest_free_extent =
+        std::max(stats.largest_free_extent, (i64)largest_free_extent_locked());
+  }
+
+  void reset_peak() {
+    std::lock_guard<std::mutex> guard(lock_);
+    peak_bytes_ = bytes_in_use_;
+  }
+
+ private:
+  u8* allocate_locked(size_t size) {
     Allocation alloc;
     alloc.length = size;
 
-    std::lock_guard<std::mutex> guard(lock_);
-    bool found = false;
+    i32 insert_index = -1;
     i32 num_alloc = allocations_.size();
     for (i32 i = 0; i < num_alloc; ++i) {
       Allocation lower;
@@ -165,53 +405,55 @@ class PoolAllocator : public Allocator {
       size_t base = align(lower.offset + lower.length);
       if ((higher.offset - base) >= size) {
         alloc.offset = base;
-        allocations_.insert(allocations_.begin() + i, alloc);
-        found = true;
+        insert_index = i;
         break;
       }
     }
 
-    if (!found) {
+    if (insert_index == -1) {
       if (num_alloc > 0) {
         Allocation& last = allocations_[num_alloc - 1];
         alloc.offset = align(last.offset + last.length);
       } else {
         alloc.offset = 0;
       }
+      if (alloc.offset + alloc.length >= pool_size_) {
+        // Exceeded pool size
+        return nullptr;
+      }
       allocations_.push_back(alloc);
+    } else {
+      allocations_.insert(allocations_.begin() + insert_index, alloc);
     }
-
-    LOG_IF(FATAL, alloc.offset + alloc.length >= pool_size_)
-        << "Exceeded pool size";
+    bytes_in_use_ += alloc.length;
+    peak_bytes_ = std::max(peak_bytes_, bytes_in_use_);
 
     u8* buffer = pool_ + alloc.offset;
     return buffer;
   }
 
-  size_t align(size_t ptr) {
-    size_t alignment = system_allocator->alignment();
-    size_t remainder = ptr % alignment;
-    if (remainder != 0) {
-      return ptr + (alignment - remainder);
-    } else {
-      return ptr;
-    }
-  }
-
-  void free(u8* buffer) {
+  void free_locked(u8* buffer) {
     LOG_IF(FATAL, !pointer_in_buffer(buffer, pool_, pool_ + pool_size_))
         << "Pool allocator tried to free buffer not in pool";
 
-    std::lock_guard<std::mutex> guard(lock_);
     i32 index;
     bool found = find_buffer(buffer, index);
     LOG_IF(FATAL, !found) << "Attempted to free unallocated buffer in pool";
 
-    Allocation& alloc = allocations_[index];
+    bytes_in_use_ -= allocations_[index].length;
     allocations_.erase(allocations_.begin() + index);
   }
 
- private:
+  size_t largest_free_extent_locked() {
+    size_t largest = 0;
+    size_t end = 0;
+    for (const Allocation& alloc : allocations_) {
+      largest = std::max(largest, alloc.offset - end);
+      end = alloc.offset + alloc.length;
+    }
+    return std::max(largest, pool_size_ - end);
+  }
+
   bool find_buffer(u8* buffer, i32& index) {
     i32 num_alloc = allocations_.size();
     for (i32 i = 0; i < num_alloc; ++i) {
@@ -234,30 +476,571 @@ class PoolAllocator : public Allocator {
   size_t pool_size_;
   std::mutex lock_;
   std::vector<Allocation> allocations_;
+  i64 bytes_in_use_ = 0;
+  i64 peak_bytes_ = 0;
+
+  SystemAllocator* system_allocator;
+};
+
+// Pool allocator that keeps the free space of the pool as a set of extents
+// indexed both by offset (to coalesce neighbours on free) and by length (for
+// best-fit allocation). Live allocations are kept in a hash index from offset
+// to length, so both allocate and free are O(log n) in the number of free
+// extents instead of linear in the number of live buffers.
+class FreeListPoolAllocator : public Allocator {
+ public:
+  FreeListPoolAllocator(DeviceHandle device, SystemAllocator* allocator,
+                        size_t pool_size)
+    : device_(device), system_allocator(allocator), pool_size_(pool_size) {
+    pool_ = system_allocator->allocate(pool_size_);
+    insert_free(0, pool_size_);
+  }
+
+  ~FreeListPoolAllocator() {
+    system_allocator->free(pool_);
+  }
+
+  u8* allocate(size_t size) {
+    std::lock_guard<std::mutex> guard(lock_);
+    u8* buffer = allocate_locked(size);
+    LOG_IF(FATAL, buffer == nullptr) << "Exceeded pool size";
+    return buffer;
+  }
+
+  u8* try_allocate(size_t size) {
+    std::lock_guard<std::mutex> guard(lock_);
+    return allocate_locked(size);
+  }
+
+  void allocate_batch(size_t size, i32 num, std::vector<u8*>& buffers) {
+    std::lock_guard<std::mutex> guard(lock_);
+    for (i32 i = 0; i < num; ++i) {
+      u8* buffer = allocate_locked(size);
+      LOG_IF(FATAL, buffer == nullptr) << "Exceeded pool size";
+      buffers.push_back(buffer);
+    }
+  }
+
+  size_t align(size_t ptr) {
+    size_t alignment = system_allocator->alignment();
+    size_t remainder = ptr % alignment;
+    if (remainder != 0) {
+      return ptr + (alignment - remainder);
+    } else {
+      return ptr;
+    }
+  }
+
+  void free(u8* buffer) {
+    std::lock_guard<std::mutex> guard(lock_);
+    free_locked(buffer);
+  }
+
+  void free_batch(const std::vector<u8*>& buffers) {
+    std::lock_guard<std::mutex> guard(lock_);
+    for (u8* buffer : buffers) {
+      free_locked(buffer);
+    }
+  }
+
+  void add_stats(MemoryPoolStats& stats) {
+    std::lock_guard<std::mutex> guard(lock_);
+    stats.pool_size += pool_size_;
+    stats.pool_bytes_in_use += bytes_in_use_;
+    stats.pool_peak_bytes += peak_bytes_;
+    stats.largest_free_extent =
+        std::max(stats.largest_free_extent, (i64)largest_free_extent_locked());
+  }
+
+  void reset_peak() {
+    std::lock_guard<std::mutex> guard(lock_);
+    peak_bytes_ = bytes_in_use_;
+  }
+
+ private:
+  u8* allocate_locked(size_t size) {
+    // Round lengths up to the device alignment so every extent starts at an
+    // aligned offset
+    size_t length = std::max(align(size), system_allocator->alignment());
+
+    auto it = free_by_length_.lower_bound(std::make_pair(length, (size_t)0));
+    if (it == free_by_length_.end()) {
+      // Exceeded pool size
+      return nullptr;
+    }
+
+    size_t extent_length = it->first;
+    size_t extent_offset = it->second;
+    remove_free(extent_offset, extent_length);
+    if (extent_length > length) {
+      insert_free(extent_offset + length, extent_length - length);
+    }
+    allocations_[extent_offset] = length;
+    bytes_in_use_ += length;
+    peak_bytes_ = std::max(peak_bytes_, bytes_in_use_);
+
+    u8* buffer = pool_ + extent_offset;
+    return buffer;
+  }
+
+  void free_locked(u8* buffer) {
+    LOG_IF(FATAL, !pointer_in_buffer(buffer, pool_, pool_ + pool_size_))
+        << "Pool allocator tried to free buffer not in pool";
+
+    size_t offset = buffer - pool_;
+
+    auto alloc_it = allocations_.find(offset);
+    LOG_IF(FATAL, alloc_it == allocations_.end())
+        << "Attempted to free unallocated buffer in pool";
+    size_t length = alloc_it->second;
+    allocations_.erase(alloc_it);
+    bytes_in_use_ -= length;
+
+    // Coalesce with the free extent directly after this one
+    auto next = free_by_offset_.find(offset + length);
+    if (next != free_by_offset_.end()) {
+      size_t next_offset = next->first;
+      size_t next_length = next->second;
+      remove_free(next_offset, next_length);
+      length += next_length;
+    }
+    // Coalesce with the free extent directly before this one
+    auto prev = free_by_offset_.lower_bound(offset);
+    if (prev != free_by_offset_.begin()) {
+      --prev;
+      if (prev->first + prev->second == offset) {
+        size_t prev_offset = prev->first;
+        size_t prev_length = prev->second;
+        remove_free(prev_offset, prev_length);
+        offset = prev_offset;
+        length += prev_length;
+      }
+    }
+    insert_free(offset, length);
+  }
+
+  void insert_free(size_t offset, size_t length) {
+    free_by_offset_[offset] = length;
+    free_by_length_.insert(std::make_pair(length, offset));
+  }
+
+  void remove_free(size_t offset, size_t length) {
+    free_by_offset_.erase(offset);
+    free_by_length_.erase(std::make_pair(length, offset));
+  }
+
+  size_t largest_free_extent_locked() {
+    return free_by_length_.empty() ? 0 : free_by_length_.rbegin()->first;
+  }
+
+  DeviceHandle device_;
+  u8* pool_ = nullptr;
+  size_t pool_size_;
+  std::mutex lock_;
+  // Free extents: offset -> length
+  std::map<size_t, size_t> free_by_offset_;
+  // Free extents ordered by (length, offset) for best-fit lookups
+  std::set<std::pair<size_t, size_t>> free_by_length_;
+  // Live allocations: offset -> aligned length
+  std::unordered_map<size_t, size_t> allocations_;
+  i64 bytes_in_use_ = 0;
+  i64 peak_bytes_ = 0;
 
   SystemAllocator* system_allocator;
 };
 
+// Returns the buffers parked in the thread caches stacked over an allocator
+// to it. Defined with ThreadCachingAllocator below.
+void reclaim_thread_caches(Allocator* allocator);
+
+// Applies the pool's exhaustion policy when the pool runs out of space. WAIT
+// blocks the requesting stage until buffers are freed downstream and SPILL
+// serves the request from the device's system allocator instead. Every
+// exhausted allocation is counted so pools can be run close to capacity.
+// Buffers cached by other threads are free as far as the pool is concerned,
+// so they are reclaimed before either policy applies.
+class BackpressureAllocator : public Allocator {
+ public:
+  BackpressureAllocator(Allocator* pool, SystemAllocator* spill_allocator,
+                        MemoryPoolConfig::PoolExhaustionPolicy policy,
+                        std::atomic<i64>* exhausted_count)
+    : pool_(pool),
+      spill_allocator_(spill_allocator),
+      policy_(policy),
+      exhausted_count_(exhausted_count) {}
+
+  u8* allocate(size_t size) {
+    u8* buffer = try_allocate(size);
+    LOG_IF(FATAL, buffer == nullptr) << "Exceeded pool size";
+    return buffer;
+  }
+
+  u8* try_allocate(size_t size) {
+    u8* buffer = pool_->try_allocate(size);
+    if (buffer != nullptr) {
+      return buffer;
+    }
+    reclaim_thread_caches(this);
+    buffer = pool_->try_allocate(size);
+    if (buffer != nullptr) {
+      return buffer;
+    }
+    (*exhausted_count_)++;
+    switch (policy_) {
+      case MemoryPoolConfig::WAIT: {
+        std::unique_lock<std::mutex> lock(lock_);
+        auto wait_start = now();
+        while (buffer == nullptr) {
+          // Retry whenever a buffer is returned to the pool, or parked in a
+          // thread cache since the last try
+          i64 frees = frees_;
+          lock.unlock();
+          reclaim_thread_caches(this);
+          buffer = pool_->try_allocate(size);
+          lock.lock();
+          if (buffer != nullptr) {
+            break;
+          }
+          if (nano_since(wait_start) / 1e6 > POOL_EXHAUSTED_WAIT_MS) {
+            LOG(FATAL) << "Exceeded pool size: waited "
+                       << POOL_EXHAUSTED_WAIT_MS << "ms for " << size
+                       << " bytes to be freed";
+          }
+          freed_.wait_for(lock, std::chrono::milliseconds(100),
+                          [&] { return frees_ != frees; });
+        }
+        break;
+      }
+      case MemoryPoolConfig::SPILL: {
+        buffer = spill_allocator_->allocate(size);
+        std::lock_guard<std::mutex> guard(lock_);
+        spilled_.insert(buffer);
+        break;
+      }
+      case MemoryPoolConfig::FAIL:
+      default:
+        break;
+    }
+    return buffer;
+  }
+
+  void free(u8* buffer) {
+    if (!free_spilled(buffer)) {
+      pool_->free(buffer);
+    }
+    notify_freed();
+  }
+
+  void free_batch(const std::vector<u8*>& buffers) {
+    std::vector<u8*> pool_buffers;
+    for (u8* buffer : buffers) {
+      if (!free_spilled(buffer)) {
+        pool_buffers.push_back(buffer);
+      }
+    }
+    pool_->free_batch(pool_buffers);
+    notify_freed();
+  }
+
+ private:
+  static constexpr i64 POOL_EXHAUSTED_WAIT_MS = 60000;
+
+  bool free_spilled(u8* buffer) {
+    if (policy_ != MemoryPoolConfig::SPILL) {
+      return false;
+    }
+    {
+      std::lock_guard<std::mutex> guard(lock_);
+      if (spilled_.erase(buffer) == 0) {
+        return false;
+      }
+    }
+    spill_allocator_->free(buffer);
+    return true;
+  }
+
+  void notify_freed() {
+    if (policy_ != MemoryPoolConfig::WAIT) {
+      return;
+    }
+    {
+      std::lock_guard<std::mutex> guard(lock_);
+      frees_++;
+    }
+    freed_.notify_all();
+  }
+
+  Allocator* pool_;
+  SystemAllocator* spill_allocator_;
+  MemoryPoolConfig::PoolExhaustionPolicy policy_;
+  std::atomic<i64>* exhausted_count_;
+  std::mutex lock_;
+  std::condition_variable freed_;
+  i64 frees_ = 0;
+  std::unordered_set<u8*> spilled_;
+};
+
+constexpr i64 BackpressureAllocator::POOL_EXHAUSTED_WAIT_MS;
+
+// Keeps a per-thread magazine of recently freed buffers in front of another
+// allocator. Frame and DecodeArgs buffers come in only a few distinct sizes
+// per job, so most allocations are served from the calling thread's magazine
+// without touching the shared allocator or its lock. Magazines are refilled
+// and flushed in batches, and each thread's magazine is bounded by
+// cache_size bytes. A magazine has a lock of its own, only ever contended
+// when an exhausted pool reclaims the buffers cached over it.
+class ThreadCachingAllocator : public Allocator {
+ public:
+  ThreadCachingAllocator(Allocator* allocator, size_t cache_size)
+    : allocator_(allocator), cache_size_(cache_size), id_(next_id_++) {
+    std::lock_guard<std::mutex> guard(registry_lock_);
+    registry_[id_] = this;
+  }
+
+  ~ThreadCachingAllocator() {
+    {
+      std::lock_guard<std::mutex> guard(registry_lock_);
+      registry_.erase(id_);
+    }
+    std::lock_guard<std::mutex> guard(lock_);
+    for (auto& cache : caches_) {
+      flush(cache.get());
+    }
+    caches_.clear();
+  }
+
+  u8* allocate(size_t size) {
+    ThreadCache* cache = thread_cache();
+    {
+      std::lock_guard<std::mutex> guard(cache->lock);
+      std::vector<u8*>& magazine = cache->magazines[size];
+      if (!magazine.empty()) {
+        u8* buffer = magazine.back();
+        magazine.pop_back();
+        cache->cached_bytes -= size;
+        return buffer;
+      }
+    }
+    // Refilled without holding the magazine lock, since an exhausted
+    // allocator reclaims every cache over it, this one included
+    std::vector<u8*> refill;
+    allocator_->allocate_batch(size, refill_count(size), refill);
+    u8* buffer = refill.back();
+    refill.pop_back();
+    std::lock_guard<std::mutex> guard(cache->lock);
+    std::vector<u8*>& magazine = cache->magazines[size];
+    magazine.insert(magazine.end(), refill.begin(), refill.end());
+    cache->cached_bytes += refill.size() * size;
+    return buffer;
+  }
+
+  void free(u8* buffer) {
+    // Size unknown, so the buffer can not be placed in a magazine
+    allocator_->free(buffer);
+  }
+
+  void free_sized(u8* buffer, size_t size) {
+    if (size > cache_size_) {
+      allocator_->free(buffer);
+      return;
+    }
+    ThreadCache* cache = thread_cache();
+    std::lock_guard<std::mutex> guard(cache->lock);
+    std::vector<u8*>& magazine = cache->magazines[size];
+    magazine.push_back(buffer);
+    cache->cached_bytes += size;
+    if (cache->cached_bytes > cache_size_) {
+      // Return half of this magazine to the shared allocator in one batch
+      size_t keep = magazine.size() / 2;
+      std::vector<u8*> spill(magazine.begin() + keep, magazine.end());
+      magazine.resize(keep);
+      cache->cached_bytes -= spill.size() * size;
+      allocator_->free_batch(spill);
+      // Other sizes are hogging the cache, so drop everything
+      if (cache->cached_bytes > cache_size_) {
+        flush(cache);
+      }
+    }
+  }
+
+ private:
+  struct ThreadCache {
+    std::mutex lock;
+    std::unordered_map<size_t, std::vector<u8*>> magazines;
+    size_t cached_bytes = 0;
+  };
+
+  // Returns a thread's magazines to the allocator when the thread exits so
+  // memory is not stranded in caches of threads from previous jobs.
+  struct ThreadCacheOwner {
+    ~ThreadCacheOwner() {
+      std::lock_guard<std::mutex> guard(registry_lock_);
+      for (auto& kv : caches) {
+        auto it = registry_.find(kv.first);
+        if (it != registry_.end()) {
+          it->second->retire(kv.second);
+        }
+      }
+    }
+
+    std::unordered_map<u64, ThreadCache*> caches;
+  };
+
+  i32 refill_count(size_t size) {
+    return std::max((size_t)1, std::min((size_t)8, cache_size_ / size / 4));
+  }
+
+  ThreadCache* thread_cache() {
+    static thread_local ThreadCacheOwner owner;
+    auto it = owner.caches.find(id_);
+    if (it != owner.caches.end()) {
+      return it->second;
+    }
+    std::lock_guard<std::mutex> guard(lock_);
+    caches_.emplace_back(new ThreadCache);
+    ThreadCache* cache = caches_.back().get();
+    owner.caches[id_] = cache;
+    return cache;
+  }
+
+  void flush(ThreadCache* cache) {
+    for (auto& kv : cache->magazines) {
+      allocator_->free_batch(kv.second);
+      kv.second.clear();
+    }
+    cache->cached_bytes = 0;
+  }
+
+  void retire(ThreadCache* cache) {
+    std::lock_guard<std::mutex> guard(lock_);
+    {
+      std::lock_guard<std::mutex> cache_guard(cache->lock);
+      flush(cache);
+    }
+    for (auto it = caches_.begin(); it != caches_.end(); ++it) {
+      if (it->get() == cache) {
+        caches_.erase(it);
+        break;
+      }
+    }
+  }
+
+  Allocator* allocator_;
+  size_t cache_size_;
+  u64 id_;
+  std::mutex lock_;
+  std::vector<std::unique_ptr<ThreadCache>> caches_;
+
+  static std::atomic<u64> next_id_;
+  static std::mutex registry_lock_;
+  static std::map<u64, ThreadCachingAllocator*> registry_;
+
+  friend void reclaim_thread_caches(Allocator* allocator);
+};
+
+std::atomic<u64> ThreadCachingAllocator::next_id_{0};
+std::mutex ThreadCachingAllocator::registry_lock_;
+std::map<u64, ThreadCachingAllocator*> ThreadCachingAllocator::registry_;
+
+void reclaim_thread_caches(Allocator* allocator) {
+  std::lock_guard<std::mutex> guard(ThreadCachingAllocator::registry_lock_);
+  for (auto& kv : ThreadCachingAllocator::registry_) {
+    ThreadCachingAllocator* caching = kv.second;
+    if (caching->allocator_ != allocator) {
+      continue;
+    }
+    std::lock_guard<std::mutex> caches_guard(caching->lock_);
+    for (auto& cache : caching->caches_) {
+      std::lock_guard<std::mutex> cache_guard(cache->lock);
+      caching->flush(cache.get());
+    }
+  }
+}
+
+Allocator* make_pool_allocator(DeviceHandle device, SystemAllocator* allocator,
+                               size_t pool_size,
+                               const MemoryPoolConfig::Pool& config) {
+  switch (config.allocator()) {
+    case MemoryPoolConfig::FREE_LIST:
+      return new FreeListPoolAllocator(device, allocator, pool_size);
+    case MemoryPoolConfig::LINEAR:
+    default:
+      return new PoolAllocator(device, allocator, pool_size);
+  }
+}
+
+// When a recycle budget is given, blocks allocated with recycle set (frame
+// blocks, which come in a handful of shapes) are not returned to the
+// underlying allocator when their last reference is dropped. They are kept on
+// a free list keyed by size, shared by all threads, so decode can reuse the
+// frames that save or evaluate just released.
 class BlockAllocator {
  public:
-  BlockAllocator(Allocator* allocator) : allocator_(allocator) {}
+  BlockAllocator(Allocator* allocator, size_t recycle_budget = 0)
+    : allocator_(allocator), recycle_budget_(recycle_budget) {}
 
   ~BlockAllocator() {
     std::lock_guard<std::mutex> guard(lock_);
     for (Allocation& alloc : allocations_) {
       assert(alloc.refs > 0);
-      allocator_->free(alloc.buffer);
+      release_locked(alloc);
     }
     allocations_.clear();
+    flush_recycled_locked();
   }
 
-  u8* allocate(size_t size, i32 refs) {
-    u8* buffer = allocator_->allocate(size);
+  u8* allocate(size_t size, i32 refs, bool recycle = false) {
+    recycle = recycle && recycle_budget_ > 0;
+    u8* buffer = nullptr;
+    bool has_recycled = false;
+    if (recycle) {
+      std::lock_guard<std::mutex> guard(lock_);
+      auto it = recycled_.find(size);
+      if (it != recycled_.end() && !it->second.empty()) {
+        buffer = it->second.back();
+        it->second.pop_back();
+        recycled_bytes_ -= size;
+      }
+      has_recycled = recycled_bytes_ > 0;
+    }
+    if (buffer == nullptr && has_recycled) {
+      // Recycled blocks of other sizes may be what is keeping the underlying
+      // allocator full, so release them before giving up
+      buffer = allocator_->try_allocate(size);
+      if (buffer == nullptr) {
+        std::lock_guard<std::mutex> guard(lock_);
+        flush_recycled_locked();
+      }
+    }
+    if (buffer == nullptr) {
+      buffer = allocator_->allocate(size);
+    }
 
     Allocation alloc;
     alloc.buffer = buffer;
     alloc.size = size;
     alloc.refs = refs;
+    alloc.recycle = recycle;
+    alloc.map_base = nullptr;
+    alloc.map_size = 0;
+
+    std::lock_guard<std::mutex> guard(lock_);
+    allocations_.push_back(alloc);
+
+    return buffer;
+  }
+
+  // Tracks size bytes at buffer, inside the mapping [map_base, map_base +
+  // map_size), as a block. The mapping is unmapped with the block.
+  u8* add_mapped(u8* map_base, size_t map_size, u8* buffer, size_t size,
+                 i32 refs) {
+    Allocation alloc;
+    alloc.buffer = buffer;
+    alloc.size = size;
+    alloc.refs = refs;
+    alloc.recycle = false;
+    alloc.map_base = map_base;
+    alloc.map_size = map_size;
 
     std::lock_guard<std::mutex> guard(lock_);
     allocations_.push_back(alloc);
@@ -289,7 +1072,12 @@ class BlockAllocator {
     alloc.refs -= 1;
 
     if (alloc.refs == 0) {
-      allocator_->free(alloc.buffer);
+      if (alloc.recycle && recycled_bytes_ + alloc.size <= recycle_budget_) {
+        recycled_[alloc.size].push_back(alloc.buffer);
+        recycled_bytes_ += alloc.size;
+      } else {
+        release_locked(alloc);
+      }
       allocations_.erase(allocations_.begin() + index);
     }
   }
@@ -321,6 +1109,18 @@ class BlockAllocator {
     return find_buffer(buffer, index);
   }
 
+  bool buffer_is_unshared(u8* buffer) {
+    std::lock_guard<std::mutex> guard(lock_);
+    i32 index;
+    return !find_buffer(buffer, index) || allocations_[index].refs == 1;
+  }
+
+  void add_stats(MemoryPoolStats& stats) {
+    std::lock_guard<std::mutex> guard(lock_);
+    stats.live_blocks += allocations_.size();
+    stats.recycled_bytes += recycled_bytes_;
+  }
+
   bool find_buffer(u8* buffer, i32& index) {
     i32 num_alloc = allocations_.size();
     for (i32 i = 0; i < num_alloc; ++i) {
@@ -333,16 +1133,41 @@ class BlockAllocator {
     return false;
   }
  private:
+  void flush_recycled_locked() {
+    for (auto& entry : recycled_) {
+      for (u8* buffer : entry.second) {
+        allocator_->free_sized(buffer, entry.first);
+      }
+    }
+    recycled_.clear();
+    recycled_bytes_ = 0;
+  }
 
   typedef struct {
     u8* buffer;
     size_t size;
     i32 refs;
+    bool recycle;
+    // Set for blocks that are views of a mapped file
+    u8* map_base;
+    size_t map_size;
   } Allocation;
 
+  void release_locked(const Allocation& alloc) {
+    if (alloc.map_base != nullptr) {
+      munmap(alloc.map_base, alloc.map_size);
+    } else {
+      allocator_->free_sized(alloc.buffer, alloc.size);
+    }
+  }
+
   std::mutex lock_;
   std::vector<Allocation> allocations_;
   Allocator* allocator_;
+  size_t recycle_budget_;
+  // Released recyclable blocks: size -> buffers
+  std::unordered_map<size_t, std::vector<u8*>> recycled_;
+  size_t recycled_bytes_ = 0;
 };
 
 class LinkedAllocator {
@@ -355,7 +1180,7 @@ class LinkedAllocator {
     for (Allocation& alloc : allocations_) {
       for (auto kv : alloc.buffers) {
         auto& allocator = allocators_.at(kv.first);
-        allocator->free(kv.second);
+        allocator->free_sized(kv.second, alloc.size);
       }
     }
     allocations_.clear();
@@ -434,7 +1259,7 @@ class LinkedAllocator {
     alloc.refs[device] -= 1;
 
     if (alloc.refs[device] == 0) {
-      allocator->free(alloc.buffers[device]);
+      allocator->free_sized(alloc.buffers[device], alloc.size);
       alloc.buffers.erase(device);
       alloc.refs.erase(device);
       if (alloc.refs.size() == 0) {
@@ -470,6 +1295,17 @@ class LinkedAllocator {
     return find_buffer(device, buffer, index);
   }
 
+  bool buffer_is_unshared(DeviceHandle device, u8* buffer) {
+    std::lock_guard<std::mutex> guard(lock_);
+    i32 index;
+    if (!find_buffer(device, buffer, index)) {
+      return true;
+    }
+    // Copies on other devices may be read from or copied to later
+    Allocation& alloc = allocations_[index];
+    return alloc.refs.size() == 1 && alloc.refs[device] == 1;
+  }
+
  private:
   bool find_buffer(DeviceHandle device, u8* buffer, i32& index) {
     auto& allocations = allocations_;
@@ -502,9 +1338,22 @@ class LinkedAllocator {
 
 static std::unique_ptr<SystemAllocator> cpu_system_allocator;
 static std::map<i32, SystemAllocator*> gpu_system_allocators;
-static PoolAllocator* cpu_pool_allocator = nullptr;
-static std::unique_ptr<BlockAllocator> cpu_block_allocator;
-static std::map<i32, PoolAllocator*> gpu_pool_allocators;
+// CPU allocators are indexed by NUMA node. Without NUMA awareness there is a
+// single entry shared by every thread.
+static std::vector<std::unique_ptr<SystemAllocator>> cpu_numa_system_allocators;
+// Allocate the CPU pools when they are backed by huge pages or pinned
+static std::vector<std::unique_ptr<SystemAllocator>> cpu_arena_allocators;
+static std::vector<std::unique_ptr<Allocator>> cpu_pool_allocators;
+static std::vector<std::unique_ptr<ThreadCachingAllocator>>
+    cpu_caching_allocators;
+static std::vector<std::unique_ptr<BlockAllocator>> cpu_block_allocators;
+static std::vector<std::unique_ptr<BackpressureAllocator>>
+    cpu_backpressure_allocators;
+static std::atomic<i64> cpu_pool_exhausted_count(0);
+static std::map<i32, Allocator*> gpu_pool_allocators;
+static std::map<i32, BackpressureAllocator*> gpu_backpressure_allocators;
+static std::map<i32, std::atomic<i64>> gpu_pool_exhausted_counts;
+static std::map<i32, ThreadCachingAllocator*> gpu_caching_allocators;
 static std::map<i32, BlockAllocator*> gpu_block_allocators;
 static std::unique_ptr<LinkedAllocator> linked_allocator;
 
@@ -517,25 +1366,70 @@ static std::map<i32, std::mutex> pinned_cpu_locks;
 void init_memory_allocators(MemoryPoolConfig config,
                             std::vector<i32> gpu_device_ids) {
   cpu_system_allocator.reset(new SystemAllocator(CPU_DEVICE));
-  Allocator* cpu_block_allocator_base = cpu_system_allocator.get();
-  if (config.cpu().use_pool()) {
-    struct sysinfo info;
-    i32 err = sysinfo(&info);
-    LOG_IF(FATAL, err < 0) << "sysinfo failed: " << strerror(errno);
-    size_t total_mem = info.totalram;
-    LOG_IF(FATAL, config.cpu().free_space() > total_mem)
-        << "Requested CPU free space (" << config.cpu().free_space() << ") "
-        << "larger than total CPU memory size ( " << total_mem << ")";
-    cpu_pool_allocator =
-        new PoolAllocator(CPU_DEVICE, cpu_system_allocator.get(),
-                          total_mem - config.cpu().free_space());
-    cpu_block_allocator_base = cpu_pool_allocator;
+  // With NUMA awareness the CPU pool is split evenly across nodes and every
+  // node gets its own block allocator
+  i32 num_cpu_nodes = config.numa_aware() ? num_numa_nodes() : 1;
+  size_t huge_page_size = config.cpu_huge_page_size();
+  LOG_IF(FATAL, (huge_page_size & (huge_page_size - 1)) != 0)
+      << "CPU huge page size (" << huge_page_size << ") is not a power of two";
+  bool pinned_cpu = config.pinned_cpu();
+#ifndef HAVE_CUDA
+  LOG_IF(WARNING, pinned_cpu)
+      << "Pinned CPU pool requested without CUDA, using pageable memory";
+  pinned_cpu = false;
+#endif
+  std::vector<Allocator*> cpu_block_allocator_bases;
+  for (i32 node = 0; node < num_cpu_nodes; ++node) {
+    Allocator* cpu_block_allocator_base = cpu_system_allocator.get();
+    if (config.cpu().use_pool()) {
+      struct sysinfo info;
+      i32 err = sysinfo(&info);
+      LOG_IF(FATAL, err < 0) << "sysinfo failed: " << strerror(errno);
+      size_t total_mem = info.totalram;
+      LOG_IF(FATAL, config.cpu().free_space() > total_mem)
+          << "Requested CPU free space (" << config.cpu().free_space() << ") "
+          << "larger than total CPU memory size ( " << total_mem << ")";
+      SystemAllocator* pool_system_allocator = cpu_system_allocator.get();
+      if (config.numa_aware()) {
+        cpu_numa_system_allocators.emplace_back(
+            new SystemAllocator(CPU_DEVICE, node));
+        pool_system_allocator = cpu_numa_system_allocators.back().get();
+      }
+      // Spilled allocations still come from the plain system allocator
+      SystemAllocator* arena_allocator = pool_system_allocator;
+      if (huge_page_size > 0 || pinned_cpu) {
+        cpu_arena_allocators.emplace_back(new SystemAllocator(
+            CPU_DEVICE, config.numa_aware() ? node : -1, huge_page_size,
+            pinned_cpu));
+        arena_allocator = cpu_arena_allocators.back().get();
+      }
+      cpu_pool_allocators.emplace_back(make_pool_allocator(
+          CPU_DEVICE, arena_allocator,
+          (total_mem - config.cpu().free_space()) / num_cpu_nodes,
+          config.cpu()));
+      cpu_block_allocator_base = cpu_pool_allocators.back().get();
+      if (config.cpu().exhaustion() != MemoryPoolConfig::FAIL) {
+        cpu_backpressure_allocators.emplace_back(new BackpressureAllocator(
+            cpu_block_allocator_base, pool_system_allocator,
+            config.cpu().exhaustion(), &cpu_pool_exhausted_count));
+        cpu_block_allocator_base = cpu_backpressure_allocators.back().get();
+      }
+    }
+    if (config.cpu().thread_cache_size() > 0) {
+      cpu_caching_allocators.emplace_back(new ThreadCachingAllocator(
+          cpu_block_allocator_base, config.cpu().thread_cache_size()));
+      cpu_block_allocator_base = cpu_caching_allocators.back().get();
+    }
+    cpu_block_allocator_bases.push_back(cpu_block_allocator_base);
   }
 #ifdef USE_LINKED_ALLOCATOR
   std::map<DeviceHandle, Allocator*> allocators;
-  allocators[CPU_DEVICE] = cpu_block_allocator_base;
+  allocators[CPU_DEVICE] = cpu_block_allocator_bases[0];
 #else
-  cpu_block_allocator.reset(new BlockAllocator(cpu_block_allocator_base));
+  for (Allocator* base : cpu_block_allocator_bases) {
+    cpu_block_allocators.emplace_back(new BlockAllocator(
+        base, config.cpu().frame_cache_size() / num_cpu_nodes));
+  }
 #endif
 
 #ifdef HAVE_CUDA
@@ -553,15 +1447,27 @@ void init_memory_allocators(MemoryPoolConfig config,
           << "Requested GPU free space (" << config.gpu().free_space() << ") "
           << "larger than total GPU memory size ( " << total_mem << ") "
           << "on device " << device_id;
-      gpu_pool_allocators[device.id] = new PoolAllocator(
-          device, gpu_system_allocator, total_mem - config.gpu().free_space());
+      gpu_pool_allocators[device.id] = make_pool_allocator(
+          device, gpu_system_allocator, total_mem - config.gpu().free_space(),
+          config.gpu());
       gpu_block_allocator_base = gpu_pool_allocators[device.id];
+      if (config.gpu().exhaustion() != MemoryPoolConfig::FAIL) {
+        gpu_backpressure_allocators[device.id] = new BackpressureAllocator(
+            gpu_block_allocator_base, gpu_system_allocator,
+            config.gpu().exhaustion(), &gpu_pool_exhausted_counts[device.id]);
+        gpu_block_allocator_base = gpu_backpressure_allocators[device.id];
+      }
+    }
+    if (config.gpu().thread_cache_size() > 0) {
+      gpu_caching_allocators[device.id] = new ThreadCachingAllocator(
+          gpu_block_allocator_base, config.gpu().thread_cache_size());
+      gpu_block_allocator_base = gpu_caching_allocators[device.id];
     }
 #ifdef USE_LINKED_ALLOCATOR
     allocators[device] = gpu_block_allocator_base;
 #else
-    gpu_block_allocators[device.id] =
-        new BlockAllocator(gpu_block_allocator_base);
+    gpu_block_allocators[device.id] = new BlockAllocator(
+        gpu_block_allocator_base, config.gpu().frame_cache_size());
 #endif
     CU_CHECK(cudaMallocHost((void**)&pinned_cpu_buffers[device.id],
                             PINNED_BUFFER_SIZE));
@@ -572,19 +1478,30 @@ void init_memory_allocators(MemoryPoolConfig config,
 #endif
 }
 
+bool memory_allocators_initialized() {
+  return cpu_system_allocator != nullptr;
+}
+
 void destroy_memory_allocators() {
   linked_allocator.reset(nullptr);
-  cpu_block_allocator.reset(nullptr);
-  if (cpu_pool_allocator) {
-    delete cpu_pool_allocator;
-    cpu_pool_allocator = nullptr;
-  }
+  cpu_block_allocators.clear();
+  cpu_caching_allocators.clear();
+  cpu_backpressure_allocators.clear();
+  cpu_pool_allocators.clear();
+  cpu_arena_allocators.clear();
+  cpu_numa_system_allocators.clear();
   cpu_system_allocator.reset(nullptr);
 
 #ifdef HAVE_CUDA
   for (auto entry : gpu_block_allocators) {
     delete entry.second;
   }
+  for (auto entry : gpu_caching_allocators) {
+    delete entry.second;
+  }
+  for (auto entry : gpu_backpressure_allocators) {
+    delete entry.second;
+  }
   for (auto entry : gpu_pool_allocators) {
     delete entry.second;
   }
@@ -595,12 +1512,74 @@ void destroy_memory_allocators() {
     cudaFreeHost(entry.second);
   }
   gpu_block_allocators.clear();
+  gpu_caching_allocators.clear();
+  gpu_backpressure_allocators.clear();
   gpu_pool_allocators.clear();
   gpu_system_allocators.clear();
   pinned_cpu_buffers.clear();
 #endif
 }
 
+i64 pool_exhausted_count(DeviceHandle device) {
+  if (device.type == DeviceType::CPU) {
+    return cpu_pool_exhausted_count.load();
+  } else if (device.type == DeviceType::GPU) {
+    auto it = gpu_pool_exhausted_counts.find(device.id);
+    return it == gpu_pool_exhausted_counts.end() ? 0 : it->second.load();
+  } else {
+    LOG(FATAL) << "Tried to get pool exhaustion count for unsupported device";
+  }
+}
+
+MemoryPoolStats memory_pool_stats(DeviceHandle device) {
+  MemoryPoolStats stats;
+  if (device.type == DeviceType::CPU) {
+    if (cpu_system_allocator) {
+      cpu_system_allocator->add_stats(stats);
+    }
+    for (auto& allocator : cpu_numa_system_allocators) {
+      allocator->add_stats(stats);
+    }
+    for (auto& allocator : cpu_pool_allocators) {
+      allocator->add_stats(stats);
+    }
+    for (auto& allocator : cpu_block_allocators) {
+      allocator->add_stats(stats);
+    }
+  } else if (device.type == DeviceType::GPU) {
+    if (gpu_system_allocators.count(device.id) > 0) {
+      gpu_system_allocators.at(device.id)->add_stats(stats);
+    }
+    if (gpu_pool_allocators.count(device.id) > 0) {
+      gpu_pool_allocators.at(device.id)->add_stats(stats);
+    }
+    if (gpu_block_allocators.count(device.id) > 0) {
+      gpu_block_allocators.at(device.id)->add_stats(stats);
+    }
+  } else {
+    LOG(FATAL) << "Tried to get memory stats for unsupported device";
+  }
+  return stats;
+}
+
+void reset_memory_pool_peaks() {
+  if (cpu_system_allocator) {
+    cpu_system_allocator->reset_peak();
+  }
+  for (auto& allocator : cpu_numa_system_allocators) {
+    allocator->reset_peak();
+  }
+  for (auto& allocator : cpu_pool_allocators) {
+    allocator->reset_peak();
+  }
+  for (auto entry : gpu_system_allocators) {
+    entry.second->reset_peak();
+  }
+  for (auto entry : gpu_pool_allocators) {
+    entry.second->reset_peak();
+  }
+}
+
 SystemAllocator* system_allocator_for_device(DeviceHandle device) {
   if (device.type == DeviceType::CPU) {
     return cpu_system_allocator.get();
@@ -612,9 +1591,25 @@ SystemAllocator* system_allocator_for_device(DeviceHandle device) {
   }
 }
 
-BlockAllocator* block_allocator_for_device(DeviceHandle device) {
+// For CPU buffers on a NUMA aware configuration, pass the buffer being
+// operated on to find the node it was allocated from. Without a buffer the
+// calling thread's node is used.
+BlockAllocator* block_allocator_for_device(DeviceHandle device,
+                                           u8* buffer = nullptr) {
   if (device.type == DeviceType::CPU) {
-    return cpu_block_allocator.get();
+    if (cpu_block_allocators.size() > 1) {
+      if (buffer != nullptr) {
+        for (auto& allocator : cpu_block_allocators) {
+          if (allocator->buffer_in_block(buffer)) {
+            return allocator.get();
+          }
+        }
+      } else {
+        i32 node = thread_numa_node() % cpu_block_allocators.size();
+        return cpu_block_allocators[node].get();
+      }
+    }
+    return cpu_block_allocators[0].get();
   } else if (device.type == DeviceType::GPU) {
     CUDA_PROTECT({/* dummy to trigger cuda check */});
     return gpu_block_allocators.at(device.id);
@@ -637,6 +1632,52 @@ u8* new_block_buffer(DeviceHandle device, size_t size, i32 refs) {
 #endif
 }
 
+u8* new_recycled_block_buffer(DeviceHandle device, size_t size, i32 refs) {
+  assert(size > 0);
+#ifdef USE_LINKED_ALLOCATOR
+  return linked_allocator->allocate(device, size, refs);
+#else
+  BlockAllocator* allocator = block_allocator_for_device(device);
+  return allocator->allocate(size, refs, true);
+#endif
+}
+
+u8* new_mapped_block_buffer(const std::string& path, u64 offset, size_t size,
+                            i32 refs) {
+  assert(size > 0);
+#ifdef USE_LINKED_ALLOCATOR
+  return nullptr;
+#else
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd == -1) {
+    return nullptr;
+  }
+  // Touching a mapped page past the end of the file faults, so a file that
+  // is shorter than its metadata says is left to a read, which fails cleanly
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (u64)st.st_size < offset + size) {
+    close(fd);
+    return nullptr;
+  }
+  // Mappings must start on a page boundary
+  u64 page_size = sysconf(_SC_PAGESIZE);
+  u64 map_offset = offset - offset % page_size;
+  size_t map_size = size + (offset - map_offset);
+  // Private and writable so kernels may modify their inputs in place, as they
+  // can with buffers from the allocators
+  void* map_base = mmap(nullptr, map_size, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE, fd, map_offset);
+  close(fd);
+  if (map_base == MAP_FAILED) {
+    return nullptr;
+  }
+  u8* buffer = static_cast<u8*>(map_base) + (offset - map_offset);
+  BlockAllocator* allocator = block_allocator_for_device(CPU_DEVICE);
+  return allocator->add_mapped(static_cast<u8*>(map_base), map_size, buffer,
+                               size, refs);
+#endif
+}
+
 void add_buffer_ref(DeviceHandle device, u8* buffer) {
   add_buffer_refs(device, buffer, 1);
 }
@@ -646,17 +1687,27 @@ void add_buffer_refs(DeviceHandle device, u8* buffer, i32 refs) {
 #ifdef USE_LINKED_ALLOCATOR
   return linked_allocator->add_refs(device, buffer, refs);
 #else
-  BlockAllocator* block_allocator = block_allocator_for_device(device);
+  BlockAllocator* block_allocator = block_allocator_for_device(device, buffer);
   block_allocator->add_refs(buffer, refs);
 #endif
 }
 
+bool buffer_is_unshared(DeviceHandle device, u8* buffer) {
+  assert(buffer != nullptr);
+#ifdef USE_LINKED_ALLOCATOR
+  return linked_allocator->buffer_is_unshared(device, buffer);
+#else
+  BlockAllocator* block_allocator = block_allocator_for_device(device, buffer);
+  return block_allocator->buffer_is_unshared(buffer);
+#endif
+}
+
 void delete_buffer(DeviceHandle device, u8* buffer) {
   assert(buffer != nullptr);
 #ifdef USE_LINKED_ALLOCATOR
   linked_allocator->free(device, buffer);
 #else
-  BlockAllocator* block_allocator = block_allocator_for_device(device);
+  BlockAllocator* block_allocator = block_allocator_for_device(device, buffer);
   if (block_allocator->buffer_in_block(buffer)) {
     block_allocator->free(buffer);
   } else {
@@ -666,6 +1717,76 @@ void delete_buffer(DeviceHandle device, u8* buffer) {
 #endif
 }
 
+namespace {
+
+enum TransferKind { H2D = 0, D2H = 1, D2D = 2 };
+
+TransferKind transfer_kind(DeviceHandle dest_device, DeviceHandle src_device) {
+  if (src_device.type == DeviceType::CPU) {
+    return H2D;
+  } else if (dest_device.type == DeviceType::CPU) {
+    return D2H;
+  }
+  return D2D;
+}
+
+void add_transfer(TransferStats& stats, i32 kind, i64 bytes, i64 ns) {
+  if (kind == H2D) {
+    stats.h2d_bytes += bytes;
+    stats.h2d_ns += ns;
+  } else if (kind == D2H) {
+    stats.d2h_bytes += bytes;
+    stats.d2h_ns += ns;
+  } else {
+    stats.d2d_bytes += bytes;
+    stats.d2d_ns += ns;
+  }
+}
+
+std::mutex transfer_stats_mutex;
+std::map<i32, TransferStats> device_transfers;
+thread_local TransferStats thread_transfers;
+
+void record_transfer(i32 device_id, i32 kind, i64 bytes, i64 ns) {
+  add_transfer(thread_transfers, kind, bytes, ns);
+  std::unique_lock<std::mutex> lock(transfer_stats_mutex);
+  add_transfer(device_transfers[device_id], kind, bytes, ns);
+}
+
+#ifdef HAVE_CUDA
+i64 elapsed_ns(cudaEvent_t start, cudaEvent_t end) {
+  f32 ms;
+  CU_CHECK(cudaEventElapsedTime(&ms, start, end));
+  return static_cast<i64>(ms * 1000000.0);
+}
+
+// A synchronous copy on the legacy default stream, timed with events
+void timed_memcpy(i32 device_id, i32 kind, void* dest, const void* src,
+                  size_t size) {
+  cudaEvent_t start, end;
+  CU_CHECK(cudaEventCreate(&start));
+  CU_CHECK(cudaEventCreate(&end));
+  CU_CHECK(cudaEventRecord(start, 0));
+  CU_CHECK(cudaMemcpy(dest, src, size, cudaMemcpyDefault));
+  CU_CHECK(cudaEventRecord(end, 0));
+  CU_CHECK(cudaEventSynchronize(end));
+  record_transfer(device_id, kind, size, elapsed_ns(start, end));
+  CU_CHECK(cudaEventDestroy(start));
+  CU_CHECK(cudaEventDestroy(end));
+}
+#endif
+}
+
+TransferStats device_transfer_stats(DeviceHandle device) {
+  std::unique_lock<std::mutex> lock(transfer_stats_mutex);
+  auto it = device_transfers.find(device.id);
+  return device.type == DeviceType::GPU && it != device_transfers.end()
+             ? it->second
+             : TransferStats();
+}
+
+TransferStats thread_transfer_stats() { return thread_transfers; }
+
 // FIXME(wcrichto): case if transferring between two different GPUs
 void memcpy_buffer(u8* dest_buffer, DeviceHandle dest_device,
                    const u8* src_buffer, DeviceHandle src_device, size_t size) {
@@ -678,39 +1799,201 @@ void memcpy_buffer(u8* dest_buffer, DeviceHandle dest_device,
              dest_device.id != src_device.id));
     CUDA_PROTECT({
       CU_CHECK(cudaSetDevice(src_device.id));
-      if (size <= PINNED_BUFFER_SIZE) {
+      i32 kind = transfer_kind(dest_device, src_device);
+      i32 gpu_id =
+          src_device.type == DeviceType::GPU ? src_device.id : dest_device.id;
+      // Buffers from a pinned CPU pool are already DMA-ready
+      bool registered =
+          (dest_device.type == DeviceType::CPU &&
+           in_registered_cpu_range(dest_buffer, size)) ||
+          (src_device.type == DeviceType::CPU &&
+           in_registered_cpu_range(src_buffer, size));
+      if (size <= PINNED_BUFFER_SIZE && !registered) {
         if (dest_device.type == DeviceType::CPU) {
-          CU_CHECK(cudaMemcpy(pinned_cpu_buffers[src_device.id], src_buffer,
-                              size, cudaMemcpyDefault));
+          timed_memcpy(gpu_id, kind, pinned_cpu_buffers[src_device.id],
+                       src_buffer, size);
           memcpy(dest_buffer, pinned_cpu_buffers[src_device.id], size);
         } else if (src_device.type == DeviceType::CPU) {
           memcpy(pinned_cpu_buffers[dest_device.id], src_buffer, size);
-          CU_CHECK(cudaMemcpy(dest_buffer, pinned_cpu_buffers[dest_device.id], size,
-                              cudaMemcpyDefault));
+          timed_memcpy(gpu_id, kind, dest_buffer,
+                       pinned_cpu_buffers[dest_device.id], size);
         } else {
-          CU_CHECK(cudaMemcpy(dest_buffer, src_buffer, size, cudaMemcpyDefault));
+          timed_memcpy(gpu_id, kind, dest_buffer, src_buffer, size);
         }
       } else {
-        CU_CHECK(cudaMemcpy(dest_buffer, src_buffer, size, cudaMemcpyDefault));
+        timed_memcpy(gpu_id, kind, dest_buffer, src_buffer, size);
       }
     });
   }
 }
 
-#define NUM_CUDA_STREAMS 32
+MemcpyHandle::MemcpyHandle()
+  : device_id_(-1),
+    event_(nullptr),
+    start_event_(nullptr),
+    kind_(0),
+    bytes_(0) {}
+
+MemcpyHandle::MemcpyHandle(MemcpyHandle&& other)
+  : device_id_(other.device_id_),
+    event_(other.event_),
+    start_event_(other.start_event_),
+    kind_(other.kind_),
+    bytes_(other.bytes_),
+    deferred_deletes_(std::move(other.deferred_deletes_)) {
+  other.event_ = nullptr;
+  other.start_event_ = nullptr;
+  other.deferred_deletes_.clear();
+}
+
+MemcpyHandle& MemcpyHandle::operator=(MemcpyHandle&& other) {
+  if (this != &other) {
+    wait();
+    device_id_ = other.device_id_;
+    event_ = other.event_;
+    start_event_ = other.start_event_;
+    kind_ = other.kind_;
+    bytes_ = other.bytes_;
+    deferred_deletes_ = std::move(other.deferred_deletes_);
+    other.event_ = nullptr;
+    other.start_event_ = nullptr;
+    other.deferred_deletes_.clear();
+  }
+  return *this;
+}
+
+MemcpyHandle::~MemcpyHandle() { wait(); }
+
+void MemcpyHandle::wait() {
+#ifdef HAVE_CUDA
+  if (event_ != nullptr) {
+    CU_CHECK(cudaSetDevice(device_id_));
+    CU_CHECK(cudaEventSynchronize((cudaEvent_t)event_));
+    finish();
+  }
+#endif
+  release();
+}
+
+void MemcpyHandle::finish() {
+#ifdef HAVE_CUDA
+  cudaEvent_t start = (cudaEvent_t)start_event_;
+  cudaEvent_t end = (cudaEvent_t)event_;
+  record_transfer(device_id_, kind_, bytes_, elapsed_ns(start, end));
+  CU_CHECK(cudaEventDestroy(start));
+  CU_CHECK(cudaEventDestroy(end));
+  start_event_ = nullptr;
+  event_ = nullptr;
+#endif
+}
+
+bool MemcpyHandle::done() {
+#ifdef HAVE_CUDA
+  if (event_ != nullptr) {
+    CU_CHECK(cudaSetDevice(device_id_));
+    cudaError_t status = cudaEventQuery((cudaEvent_t)event_);
+    if (status == cudaErrorNotReady) {
+      return false;
+    }
+    CU_CHECK(status);
+    finish();
+  }
+#endif
+  return true;
+}
+
+void MemcpyHandle::defer_delete(DeviceHandle device, u8* buffer) {
+  deferred_deletes_.emplace_back(device, buffer);
+}
+
+void MemcpyHandle::release() {
+  for (auto& entry : deferred_deletes_) {
+    delete_buffer(entry.first, entry.second);
+  }
+  deferred_deletes_.clear();
+}
+
+// Elements up to this size are gathered into a staging block before crossing
+// between host and device, instead of being transferred one by one
+#define COALESCE_MAX_ELEMENT_SIZE (1 << 20)
+
+static bool buffers_contiguous(const std::vector<u8*>& buffers,
+                               const std::vector<size_t>& sizes) {
+  for (size_t i = 1; i < buffers.size(); ++i) {
+    if (buffers[i] != buffers[i - 1] + sizes[i - 1]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+#ifdef HAVE_CUDA
+// Each thread issues its copies on its own pooled stream per device so that
+// transfers from different pipeline stages overlap with each other and with
+// kernels running on other streams. The streams go back to the pool when the
+// thread exits, so threads of later bulk jobs reuse them.
+class CopyStreams {
+ public:
+  ~CopyStreams() {
+    // Not checked, since the CUDA runtime may already be unloading at exit
+    for (auto& kv : streams_) {
+      cudaSetDevice(kv.first);
+      cudaEventDestroy(kv.second.second);
+      CUDAStreamPool::instance().release(kv.first, kv.second.first);
+    }
+  }
+
+  // The stream is non-blocking, so it is made to wait for the work queued so
+  // far on the legacy default stream, where kernels without a stream of
+  // their own write the buffers being copied. Kernels with their own stream
+  // are waited for by the evaluate worker before their outputs are read.
+  cudaStream_t stream_for(i32 device_id) {
+    auto it = streams_.find(device_id);
+    if (it == streams_.end()) {
+      void* stream = CUDAStreamPool::instance().acquire(device_id);
+      cudaEvent_t event;
+      CU_CHECK(cudaEventCreateWithFlags(&event, cudaEventDisableTiming));
+      it = streams_.insert({device_id, {stream, event}}).first;
+    }
+    cudaStream_t stream = (cudaStream_t)it->second.first;
+    CU_CHECK(cudaEventRecord(it->second.second, 0));
+    CU_CHECK(cudaStreamWaitEvent(stream, it->second.second, 0));
+    return stream;
+  }
+
+ private:
+  std::map<i32, std::pair<void*, cudaEvent_t>> streams_;
+};
+
+static cudaStream_t copy_stream_for_device(i32 device_id) {
+  static thread_local CopyStreams streams;
+  return streams.stream_for(device_id);
+}
+#endif
 
 // TODO(wcrichto): implement CPU-CPU transfer
 void memcpy_vec(std::vector<u8*>& dest_buffers, DeviceHandle dest_device,
                 const std::vector<u8*>& src_buffers, DeviceHandle src_device,
                 const std::vector<size_t>& sizes) {
+  memcpy_vec_async(dest_buffers, dest_device, src_buffers, src_device, sizes)
+      .wait();
+}
+
+MemcpyHandle memcpy_vec_async(std::vector<u8*>& dest_buffers,
+                              DeviceHandle dest_device,
+                              const std::vector<u8*>& src_buffers,
+                              DeviceHandle src_device,
+                              const std::vector<size_t>& sizes) {
   assert(src_device.can_copy_to(dest_device));
   assert(dest_buffers.size() > 0);
   assert(src_buffers.size() > 0);
   assert(dest_buffers.size() == src_buffers.size());
 
 #ifndef USE_LINKED_ALLOCATOR
-  BlockAllocator* dest_allocator = block_allocator_for_device(dest_device);
-  BlockAllocator* src_allocator = block_allocator_for_device(src_device);
+  BlockAllocator* dest_allocator =
+      block_allocator_for_device(dest_device, dest_buffers[0]);
+  BlockAllocator* src_allocator =
+      block_allocator_for_device(src_device, src_buffers[0]);
 #endif
 
   size_t total_size = 0;
@@ -730,28 +2013,59 @@ void memcpy_vec(std::vector<u8*>& dest_buffers, DeviceHandle dest_device,
                     src_allocator->buffers_in_same_block(src_buffers);
 #endif
 
+  MemcpyHandle handle;
   if (dest_device.type == DeviceType::GPU ||
       src_device.type == DeviceType::GPU) {
 #ifdef HAVE_CUDA
-    static thread_local std::vector<cudaStream_t> streams;
-    if (streams.size() == 0) {
-      streams.resize(NUM_CUDA_STREAMS);
-      for (i32 i = 0; i < NUM_CUDA_STREAMS; ++i) {
-        CU_CHECK(cudaStreamCreateWithFlags(&streams[i], cudaStreamNonBlocking));
-      }
-    }
-
+    i32 device_id =
+        src_device.type == DeviceType::GPU ? src_device.id : dest_device.id;
+    CU_CHECK(cudaSetDevice(device_id));
+    cudaStream_t stream = copy_stream_for_device(device_id);
+
+    cudaEvent_t start_event;
+    CU_CHECK(cudaEventCreate(&start_event));
+    CU_CHECK(cudaEventRecord(start_event, stream));
+    i32 n = dest_buffers.size();
     if (from_same_block) {
-      memcpy_buffer(dest_buffers[0], dest_device, src_buffers[0], src_device,
-                    total_size);
+      CU_CHECK(cudaMemcpyAsync(dest_buffers[0], src_buffers[0], total_size,
+                               cudaMemcpyDefault, stream));
+    } else if (n > 1 && dest_device.type != src_device.type &&
+               total_size / n <= COALESCE_MAX_ELEMENT_SIZE &&
+               buffers_contiguous(dest_buffers, sizes)) {
+      // Gather the scattered sources into one staging block on the source
+      // side so that the bus sees a single transfer into the contiguous
+      // destination. Host sources are gathered with memcpy; device sources
+      // with device-local copies queued ahead of the transfer.
+      u8* staging = new_buffer(src_device, total_size);
+      u8* dest = staging;
+      for (i32 i = 0; i < n; ++i) {
+        if (src_device.type == DeviceType::CPU) {
+          memcpy(dest, src_buffers[i], sizes[i]);
+        } else {
+          CU_CHECK(cudaMemcpyAsync(dest, src_buffers[i], sizes[i],
+                                   cudaMemcpyDeviceToDevice, stream));
+        }
+        dest += sizes[i];
+      }
+      CU_CHECK(cudaMemcpyAsync(dest_buffers[0], staging, total_size,
+                               cudaMemcpyDefault, stream));
+      handle.defer_delete(src_device, staging);
     } else {
-      i32 n = dest_buffers.size();
 
       for (i32 i = 0; i < n; ++i) {
-        memcpy_buffer(dest_buffers[i], dest_device, src_buffers[i], src_device,
-                      sizes[i]);
+        CU_CHECK(cudaMemcpyAsync(dest_buffers[i], src_buffers[i], sizes[i],
+                                 cudaMemcpyDefault, stream));
       }
     }
+
+    cudaEvent_t event;
+    CU_CHECK(cudaEventCreate(&event));
+    CU_CHECK(cudaEventRecord(event, stream));
+    handle.device_id_ = device_id;
+    handle.event_ = (void*)event;
+    handle.start_event_ = (void*)start_event;
+    handle.kind_ = transfer_kind(dest_device, src_device);
+    handle.bytes_ = total_size;
 #else
     LOG(FATAL) << "Cuda not installed";
 #endif
@@ -764,6 +2078,7 @@ void memcpy_vec(std::vector<u8*>& dest_buffers, DeviceHandle dest_device,
       }
     }
   }
+  return handle;
 }
 
 void copy_or_ref_buffers(std::vector<u8*>& dest_buffers,
@@ -798,4 +2113,35 @@ void copy_or_ref_buffers(std::vector<u8*>& dest_buffers,
 #endif
 }
 
+MemcpyHandle copy_or_ref_buffers_async(std::vector<u8*>& dest_buffers,
+                                       DeviceHandle dest_device,
+                                       const std::vector<u8*>& src_buffers,
+                                       DeviceHandle src_device,
+                                       const std::vector<size_t>& sizes) {
+  assert(src_device.can_copy_to(dest_device));
+  assert(src_buffers.size() > 0);
+
+#ifdef USE_LINKED_ALLOCATOR
+  // The linked allocator copies one buffer at a time and may add references
+  // instead, so it completes synchronously
+  copy_or_ref_buffers(dest_buffers, dest_device, src_buffers, src_device,
+                      sizes);
+  return MemcpyHandle();
+#else
+  size_t total_size = 0;
+  for (auto size : sizes) {
+    total_size += size;
+  }
+
+  BlockAllocator* dest_allocator = block_allocator_for_device(dest_device);
+  u8* dest_buff = dest_allocator->allocate(total_size, sizes.size());
+  for (size_t size : sizes) {
+    dest_buffers.push_back(dest_buff);
+    dest_buff += size;
+  }
+  return memcpy_vec_async(dest_buffers, dest_device, src_buffers, src_device,
+                          sizes);
+#endif
+}
+
 }
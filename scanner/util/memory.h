@@ -18,6 +18,8 @@
 #include "scanner/util/common.h"
 
 #include <cstddef>
+#include <string>
+#include <vector>
 
 namespace scanner {
 
@@ -28,16 +30,136 @@ void init_memory_allocators(MemoryPoolConfig config,
 
 void destroy_memory_allocators();
 
+//! True between init_memory_allocators and destroy_memory_allocators
+bool memory_allocators_initialized();
+
+//! Usage of one device's allocators. CPU values are summed over NUMA nodes.
+struct MemoryPoolStats {
+  //! Total pool capacity, 0 if the device has no pool
+  i64 pool_size = 0;
+  //! Bytes currently handed out by the pool
+  i64 pool_bytes_in_use = 0;
+  //! High-water mark of pool_bytes_in_use since the last reset
+  i64 pool_peak_bytes = 0;
+  //! Largest allocation the pool could currently satisfy
+  i64 largest_free_extent = 0;
+  //! Bytes currently allocated from the system, including the pool itself
+  i64 system_bytes_in_use = 0;
+  //! High-water mark of system_bytes_in_use since the last reset
+  i64 system_peak_bytes = 0;
+  //! Buffers currently allocated from the system
+  i64 system_live_buffers = 0;
+  //! Reference counted blocks currently alive
+  i64 live_blocks = 0;
+  //! Bytes of released frame blocks held for reuse
+  i64 recycled_bytes = 0;
+};
+
+MemoryPoolStats memory_pool_stats(DeviceHandle device);
+
+//! Restarts the high-water marks of every allocator from current usage
+void reset_memory_pool_peaks();
+
+//! Number of allocations that found the device's memory pool exhausted and
+//! had to wait or spill to the system allocator.
+i64 pool_exhausted_count(DeviceHandle device);
+
+//! Bytes copied to, from and within GPUs and the device time the copies
+//! took, measured with CUDA events recorded around them on their stream
+struct TransferStats {
+  i64 h2d_bytes = 0;
+  i64 h2d_ns = 0;
+  i64 d2h_bytes = 0;
+  i64 d2h_ns = 0;
+  i64 d2d_bytes = 0;
+  i64 d2d_ns = 0;
+
+  i64 device_ns() const { return h2d_ns + d2h_ns + d2d_ns; }
+};
+
+//! Copies involving one GPU since the process started
+TransferStats device_transfer_stats(DeviceHandle device);
+
+//! Copies that completed on the calling thread, i.e. synchronous ones and
+//! asynchronous ones it waited on or found done. The difference of two
+//! calls gives the transfers of the section between them.
+TransferStats thread_transfer_stats();
+
 u8* new_buffer(DeviceHandle device, size_t size);
 
 u8* new_block_buffer(DeviceHandle device, size_t size, i32 refs);
 
+//! Like new_block_buffer, but once every reference is dropped the block is
+//! kept for reuse by a later request of the same size, within the pool's
+//! frame_cache_size budget. Meant for frames, whose sizes rarely vary.
+u8* new_recycled_block_buffer(DeviceHandle device, size_t size, i32 refs);
+
+//! Maps size bytes of a local file starting at offset into a CPU block with
+//! refs references, without reading or copying them. As with other blocks,
+//! buffers pointing anywhere inside it share its references, and the file is
+//! unmapped once the last of them is deleted. Writes to the block stay
+//! private to the process. Returns nullptr if the file can not be mapped or
+//! is too short. The file must not be truncated or rewritten in place while
+//! the block lives, since touching a page it no longer backs faults.
+u8* new_mapped_block_buffer(const std::string& path, u64 offset, size_t size,
+                            i32 refs);
+
 void add_buffer_ref(DeviceHandle device, u8* buffer);
 
 void add_buffer_refs(DeviceHandle device, u8* buffer, i32 refs);
 
+//! True if deleting buffer would release it, i.e. it is not a block or its
+//! block has a single reference. Blocks of several frames only qualify once
+//! all but one of their frames are deleted.
+bool buffer_is_unshared(DeviceHandle device, u8* buffer);
+
 void delete_buffer(DeviceHandle device, u8* buffer);
 
+//! Completion handle for an asynchronous copy issued on a CUDA stream. Copies
+//! between CPU buffers complete before the handle is returned. Destroying a
+//! pending handle waits for the copy.
+class MemcpyHandle {
+ public:
+  MemcpyHandle();
+  MemcpyHandle(MemcpyHandle&& other);
+  MemcpyHandle& operator=(MemcpyHandle&& other);
+  MemcpyHandle(const MemcpyHandle&) = delete;
+  MemcpyHandle& operator=(const MemcpyHandle&) = delete;
+  ~MemcpyHandle();
+
+  //! Blocks until the copy has finished and releases deferred buffers
+  void wait();
+
+  //! Returns true if the copy has finished, without blocking
+  bool done();
+
+  //! Deletes buffer once the copy has finished, e.g. the copy's source
+  void defer_delete(DeviceHandle device, u8* buffer);
+
+ private:
+  friend MemcpyHandle memcpy_vec_async(std::vector<u8*>& dest_buffers,
+                                       DeviceHandle dest_device,
+                                       const std::vector<u8*>& src_buffers,
+                                       DeviceHandle src_device,
+                                       const std::vector<size_t>& sizes);
+
+  void release();
+
+  // Adds the device time of the completed copy to the transfer stats and
+  // destroys its events
+  void finish();
+
+  i32 device_id_;
+  // cudaEvent_t recorded after the copy, nullptr if already complete
+  void* event_;
+  // cudaEvent_t recorded before the copy
+  void* start_event_;
+  // Copy direction, as indexed in TransferStats, and size
+  i32 kind_;
+  i64 bytes_;
+  std::vector<std::pair<DeviceHandle, u8*>> deferred_deletes_;
+};
+
 void memcpy_buffer(u8* dest_buffer, DeviceHandle dest_device,
                    const u8* src_buffer, DeviceHandle src_device, size_t size);
 
@@ -45,9 +167,24 @@ void memcpy_vec(std::vector<u8*>& dest_buffers, DeviceHandle dest_device,
                 const std::vector<u8*>& src_buffers, DeviceHandle src_device,
                 const std::vector<size_t>& sizes);
 
+//! Issues the copies of memcpy_vec on the calling thread's stream for the GPU
+//! involved and returns without waiting for them. Neither side's buffers may
+//! be used or freed until the returned handle has been waited on.
+MemcpyHandle memcpy_vec_async(std::vector<u8*>& dest_buffers,
+                              DeviceHandle dest_device,
+                              const std::vector<u8*>& src_buffers,
+                              DeviceHandle src_device,
+                              const std::vector<size_t>& sizes);
+
 void copy_or_ref_buffers(std::vector<u8*>& dest_buffers,
                          DeviceHandle dest_device,
                          const std::vector<u8*>& src_buffers,
                          DeviceHandle src_device,
                          const std::vector<size_t>& sizes);
+
+MemcpyHandle copy_or_ref_buffers_async(std::vector<u8*>& dest_buffers,
+                                       DeviceHandle dest_device,
+                                       const std::vector<u8*>& src_buffers,
+                                       DeviceHandle src_device,
+                                       const std::vector<size_t>& sizes);
 }
@@ -0,0 +1,257 @@
+/* Copyright 2017 Carnegie Mellon University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+
+// Allocation and block refcounting microbenchmarks. Measures new_buffer and
+// delete_buffer throughput and latency for the system allocator and for each
+// pool allocator, with and without thread caches, as the number of threads
+// allocating at once grows, followed by refcount updates on block buffers,
+// either on one block shared by every thread or on a block per thread:
+//
+//   MemoryBench [--threads=1,2,4,8] [--sizes=4096,65536,1048576]
+//               [--live=64] [--iterations=2000] [--repeat=1]
+//
+// Each allocation thread keeps up to live buffers of a size picked among
+// sizes and frees them in a shuffled order, so the pool allocators see
+// fragmentation like the pipeline's. Latencies are of single calls, sampled
+// every SAMPLE_PERIOD calls so timing does not dominate the measurement.
+
+#include "scanner/util/memory.h"
+#include "scanner/util/util.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <sstream>
+#include <thread>
+
+namespace scanner {
+namespace {
+
+const i32 SAMPLE_PERIOD = 16;
+
+struct AllocatorConfig {
+  const char* name;
+  bool use_pool;
+  MemoryPoolConfig::PoolAllocatorType allocator;
+  i64 thread_cache_size;
+};
+
+const AllocatorConfig ALLOCATORS[] = {
+    {"system", false, MemoryPoolConfig::LINEAR, 0},
+    {"linear", true, MemoryPoolConfig::LINEAR, 0},
+    {"free_list", true, MemoryPoolConfig::FREE_LIST, 0},
+    {"free_list+tc", true, MemoryPoolConfig::FREE_LIST, 64 * 1024 * 1024},
+};
+
+struct Latencies {
+  std::vector<double> samples;
+
+  void merge(const Latencies& other) {
+    samples.insert(samples.end(), other.samples.begin(), other.samples.end());
+  }
+
+  double percentile(double p) {
+    if (samples.empty()) {
+      return 0;
+    }
+    std::sort(samples.begin(), samples.end());
+    size_t rank = std::min(samples.size() - 1,
+                           static_cast<size_t>(p * samples.size()));
+    return samples[rank];
+  }
+};
+
+std::vector<i64> parse_list(const std::string& s) {
+  std::vector<i64> values;
+  std::stringstream ss(s);
+  std::string item;
+  while (std::getline(ss, item, ',')) {
+    values.push_back(std::atoll(item.c_str()));
+  }
+  return values;
+}
+
+// Allocates and frees iterations rounds of live buffers
+void allocation_thread(i32 seed, const std::vector<i64>& sizes, i32 live,
+                       i32 iterations, Latencies& allocs, Latencies& frees) {
+  std::mt19937 rng(seed);
+  std::uniform_int_distribution<size_t> pick(0, sizes.size() - 1);
+  std::vector<u8*> buffers;
+  i64 calls = 0;
+  for (i32 i = 0; i < iterations; ++i) {
+    for (i32 b = 0; b < live; ++b) {
+      size_t size = sizes[pick(rng)];
+      if (++calls % SAMPLE_PERIOD == 0) {
+        auto start = now();
+        buffers.push_back(new_buffer(CPU_DEVICE, size));
+        allocs.samples.push_back(nano_since(start));
+      } else {
+        buffers.push_back(new_buffer(CPU_DEVICE, size));
+      }
+      // Touch the buffer like a kernel writing its output would
+      buffers.back()[0] = 1;
+    }
+    std::shuffle(buffers.begin(), buffers.end(), rng);
+    for (u8* buffer : buffers) {
+      if (++calls % SAMPLE_PERIOD == 0) {
+        auto start = now();
+        delete_buffer(CPU_DEVICE, buffer);
+        frees.samples.push_back(nano_since(start));
+      } else {
+        delete_buffer(CPU_DEVICE, buffer);
+      }
+    }
+    buffers.clear();
+  }
+}
+
+// Adds and drops a reference to block iterations times
+void refcount_thread(u8* block, i32 iterations, Latencies& latencies) {
+  for (i32 i = 0; i < iterations; ++i) {
+    if (i % SAMPLE_PERIOD == 0) {
+      auto start = now();
+      add_buffer_refs(CPU_DEVICE, block, 1);
+      delete_buffer(CPU_DEVICE, block);
+      latencies.samples.push_back(nano_since(start));
+    } else {
+      add_buffer_refs(CPU_DEVICE, block, 1);
+      delete_buffer(CPU_DEVICE, block);
+    }
+  }
+}
+
+void bench_allocators(const std::vector<i64>& threads,
+                      const std::vector<i64>& sizes, i32 live, i32 iterations,
+                      i32 repeat) {
+  printf("%-13s %7s %12s %9s %9s %9s %9s\n", "allocator", "threads",
+         "ops/s", "alloc_p50", "alloc_p99", "free_p50", "free_p99");
+  for (const AllocatorConfig& allocator : ALLOCATORS) {
+    MemoryPoolConfig config;
+    config.mutable_cpu()->set_use_pool(allocator.use_pool);
+    config.mutable_cpu()->set_free_space(DEFAULT_POOL_SIZE);
+    config.mutable_cpu()->set_allocator(allocator.allocator);
+    config.mutable_cpu()->set_thread_cache_size(allocator.thread_cache_size);
+    init_memory_allocators(config, {});
+    for (i64 num_threads : threads) {
+      for (i32 r = 0; r < repeat; ++r) {
+        std::vector<Latencies> allocs(num_threads);
+        std::vector<Latencies> frees(num_threads);
+        auto start = now();
+        std::vector<std::thread> workers;
+        for (i32 t = 0; t < num_threads; ++t) {
+          workers.emplace_back(allocation_thread, t, std::cref(sizes), live,
+                               iterations, std::ref(allocs[t]),
+                               std::ref(frees[t]));
+        }
+        for (std::thread& t : workers) {
+          t.join();
+        }
+        double seconds = nano_since(start) / 1e9;
+        for (i32 t = 1; t < num_threads; ++t) {
+          allocs[0].merge(allocs[t]);
+          frees[0].merge(frees[t]);
+        }
+        double ops = 2.0 * num_threads * iterations * live;
+        printf("%-13s %7ld %12.0f %9.0f %9.0f %9.0f %9.0f\n", allocator.name,
+               num_threads, ops / seconds, allocs[0].percentile(0.5),
+               allocs[0].percentile(0.99), frees[0].percentile(0.5),
+               frees[0].percentile(0.99));
+      }
+    }
+    destroy_memory_allocators();
+  }
+}
+
+void bench_refcounts(const std::vector<i64>& threads, i32 iterations,
+                     i32 repeat) {
+  MemoryPoolConfig config;
+  init_memory_allocators(config, {});
+  printf("\n%-13s %7s %12s %9s %9s\n", "refcount", "threads", "ops/s",
+         "p50", "p99");
+  for (bool shared : {true, false}) {
+    for (i64 num_threads : threads) {
+      for (i32 r = 0; r < repeat; ++r) {
+        std::vector<u8*> blocks(shared ? 1 : num_threads);
+        for (u8*& block : blocks) {
+          block = new_block_buffer(CPU_DEVICE, 4096, 1);
+        }
+        std::vector<Latencies> latencies(num_threads);
+        auto start = now();
+        std::vector<std::thread> workers;
+        for (i32 t = 0; t < num_threads; ++t) {
+          workers.emplace_back(refcount_thread, blocks[shared ? 0 : t],
+                               iterations, std::ref(latencies[t]));
+        }
+        for (std::thread& t : workers) {
+          t.join();
+        }
+        double seconds = nano_since(start) / 1e9;
+        for (u8* block : blocks) {
+          delete_buffer(CPU_DEVICE, block);
+        }
+        for (i32 t = 1; t < num_threads; ++t) {
+          latencies[0].merge(latencies[t]);
+        }
+        // An add and a drop of a reference per iteration
+        double ops = 2.0 * num_threads * iterations;
+        printf("%-13s %7ld %12.0f %9.0f %9.0f\n",
+               shared ? "shared" : "per_thread", num_threads, ops / seconds,
+               latencies[0].percentile(0.5), latencies[0].percentile(0.99));
+      }
+    }
+  }
+  destroy_memory_allocators();
+}
+
+}  // namespace
+
+int bench_main(int argc, char** argv) {
+  std::vector<i64> threads = {1, 2, 4, 8};
+  std::vector<i64> sizes = {4096, 65536, 1048576};
+  i32 live = 64;
+  i32 iterations = 2000;
+  i32 repeat = 1;
+  for (int i = 1; i < argc; ++i) {
+    std::string arg(argv[i]);
+    std::string key = arg.substr(0, arg.find('='));
+    std::string value =
+        arg.find('=') == std::string::npos ? "" : arg.substr(arg.find('=') + 1);
+    if (key == "--threads") {
+      threads = parse_list(value);
+    } else if (key == "--sizes") {
+      sizes = parse_list(value);
+    } else if (key == "--live") {
+      live = std::atoi(value.c_str());
+    } else if (key == "--iterations") {
+      iterations = std::atoi(value.c_str());
+    } else if (key == "--repeat") {
+      repeat = std::atoi(value.c_str());
+    } else {
+      fprintf(stderr, "Unknown argument %s\n", arg.c_str());
+      return 1;
+    }
+  }
+
+  bench_allocators(threads, sizes, live, iterations, repeat);
+  // Refcount updates are much cheaper than allocations
+  bench_refcounts(threads, iterations * live, repeat);
+  return 0;
+}
+}
+
+int main(int argc, char** argv) { return scanner::bench_main(argc, argv); }
@@ -0,0 +1,216 @@
+/* Copyright 2017 Carnegie Mellon University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "scanner/util/memory.h"
+
+#include <gtest/gtest.h>
+
+#include <sys/sysinfo.h>
+#include <cstring>
+#include <future>
+#include <thread>
+
+namespace scanner {
+namespace {
+const i64 POOL_SIZE = 1 << 20;
+const i64 CHUNK = POOL_SIZE / 8;
+
+// Sets up a CPU pool of exactly POOL_SIZE bytes managed by the free list
+// allocator. The pool is sized as the memory left over after free_space.
+void init_free_list_pool() {
+  struct sysinfo info;
+  ASSERT_EQ(sysinfo(&info), 0);
+  MemoryPoolConfig config;
+  MemoryPoolConfig::Pool* cpu = config.mutable_cpu();
+  cpu->set_use_pool(true);
+  cpu->set_allocator(MemoryPoolConfig::FREE_LIST);
+  cpu->set_exhaustion(MemoryPoolConfig::SPILL);
+  cpu->set_free_space(info.totalram - POOL_SIZE);
+  init_memory_allocators(config, {});
+  ASSERT_EQ(memory_pool_stats(CPU_DEVICE).pool_size, POOL_SIZE);
+}
+
+i64 bytes_in_use() {
+  return memory_pool_stats(CPU_DEVICE).pool_bytes_in_use;
+}
+
+i64 largest_free_extent() {
+  return memory_pool_stats(CPU_DEVICE).largest_free_extent;
+}
+
+std::vector<u8*> fill_pool() {
+  std::vector<u8*> buffers;
+  for (i64 i = 0; i < POOL_SIZE / CHUNK; ++i) {
+    buffers.push_back(new_buffer(CPU_DEVICE, CHUNK));
+  }
+  return buffers;
+}
+}
+
+TEST(FreeListPoolAllocator, CoalescesNeighbouringFrees) {
+  init_free_list_pool();
+  std::vector<u8*> buffers = fill_pool();
+  EXPECT_EQ(bytes_in_use(), POOL_SIZE);
+  EXPECT_EQ(largest_free_extent(), 0);
+
+  // Extents freed out of order merge with the free ones on either side
+  delete_buffer(CPU_DEVICE, buffers[2]);
+  EXPECT_EQ(largest_free_extent(), CHUNK);
+  delete_buffer(CPU_DEVICE, buffers[4]);
+  EXPECT_EQ(largest_free_extent(), CHUNK);
+  delete_buffer(CPU_DEVICE, buffers[3]);
+  EXPECT_EQ(largest_free_extent(), 3 * CHUNK);
+  delete_buffer(CPU_DEVICE, buffers[1]);
+  EXPECT_EQ(largest_free_extent(), 4 * CHUNK);
+  delete_buffer(CPU_DEVICE, buffers[0]);
+  EXPECT_EQ(largest_free_extent(), 5 * CHUNK);
+  delete_buffer(CPU_DEVICE, buffers[6]);
+  delete_buffer(CPU_DEVICE, buffers[7]);
+  EXPECT_EQ(largest_free_extent(), 5 * CHUNK);
+  delete_buffer(CPU_DEVICE, buffers[5]);
+  EXPECT_EQ(largest_free_extent(), POOL_SIZE);
+  EXPECT_EQ(bytes_in_use(), 0);
+
+  destroy_memory_allocators();
+}
+
+TEST(FreeListPoolAllocator, BestFitKeepsLargeExtents) {
+  init_free_list_pool();
+  std::vector<u8*> buffers = fill_pool();
+  delete_buffer(CPU_DEVICE, buffers[0]);
+  delete_buffer(CPU_DEVICE, buffers[1]);
+  delete_buffer(CPU_DEVICE, buffers[2]);
+  delete_buffer(CPU_DEVICE, buffers[5]);
+
+  // A chunk fits both holes but goes in the smallest one
+  u8* small = new_buffer(CPU_DEVICE, CHUNK);
+  EXPECT_EQ(small, buffers[5]);
+  EXPECT_EQ(largest_free_extent(), 3 * CHUNK);
+  u8* large = new_buffer(CPU_DEVICE, 2 * CHUNK);
+  EXPECT_EQ(large, buffers[0]);
+  EXPECT_EQ(largest_free_extent(), CHUNK);
+
+  delete_buffer(CPU_DEVICE, small);
+  delete_buffer(CPU_DEVICE, large);
+  for (size_t i : {3, 4, 6, 7}) {
+    delete_buffer(CPU_DEVICE, buffers[i]);
+  }
+  EXPECT_EQ(largest_free_extent(), POOL_SIZE);
+
+  destroy_memory_allocators();
+}
+
+TEST(FreeListPoolAllocator, FragmentedPoolSpills) {
+  init_free_list_pool();
+  std::vector<u8*> buffers = fill_pool();
+  for (size_t i = 1; i < buffers.size(); i += 2) {
+    delete_buffer(CPU_DEVICE, buffers[i]);
+  }
+  // Half the pool is free, but no extent holds two chunks
+  EXPECT_EQ(bytes_in_use(), POOL_SIZE / 2);
+  EXPECT_EQ(largest_free_extent(), CHUNK);
+  i64 exhausted = pool_exhausted_count(CPU_DEVICE);
+  u8* spilled = new_buffer(CPU_DEVICE, 2 * CHUNK);
+  EXPECT_EQ(pool_exhausted_count(CPU_DEVICE), exhausted + 1);
+  EXPECT_EQ(bytes_in_use(), POOL_SIZE / 2);
+  std::memset(spilled, 0, 2 * CHUNK);
+  delete_buffer(CPU_DEVICE, spilled);
+
+  // Freeing the chunk between two holes makes room again
+  delete_buffer(CPU_DEVICE, buffers[2]);
+  EXPECT_EQ(largest_free_extent(), 3 * CHUNK);
+  u8* buffer = new_buffer(CPU_DEVICE, 2 * CHUNK);
+  EXPECT_EQ(buffer, buffers[1]);
+  EXPECT_EQ(pool_exhausted_count(CPU_DEVICE), exhausted + 1);
+
+  delete_buffer(CPU_DEVICE, buffer);
+  for (size_t i : {0, 4, 6}) {
+    delete_buffer(CPU_DEVICE, buffers[i]);
+  }
+  EXPECT_EQ(bytes_in_use(), 0);
+
+  destroy_memory_allocators();
+}
+
+TEST(FreeListPoolAllocator, SpillsWhenExhausted) {
+  init_free_list_pool();
+  u8* whole = new_buffer(CPU_DEVICE, POOL_SIZE);
+  EXPECT_EQ(largest_free_extent(), 0);
+  i64 exhausted = pool_exhausted_count(CPU_DEVICE);
+  u8* spilled = new_buffer(CPU_DEVICE, CHUNK);
+  EXPECT_EQ(pool_exhausted_count(CPU_DEVICE), exhausted + 1);
+  EXPECT_FALSE(spilled >= whole && spilled < whole + POOL_SIZE);
+  std::memset(spilled, 0, CHUNK);
+  delete_buffer(CPU_DEVICE, spilled);
+  EXPECT_EQ(bytes_in_use(), POOL_SIZE);
+  delete_buffer(CPU_DEVICE, whole);
+  EXPECT_EQ(bytes_in_use(), 0);
+  EXPECT_EQ(largest_free_extent(), POOL_SIZE);
+
+  destroy_memory_allocators();
+}
+
+// Buffers parked in another thread's cache must satisfy an allocation that
+// found the pool empty instead of leaving it to wait for a free
+TEST(ThreadCachingAllocator, ReclaimsOtherThreadsCaches) {
+  struct sysinfo info;
+  ASSERT_EQ(sysinfo(&info), 0);
+  MemoryPoolConfig config;
+  MemoryPoolConfig::Pool* cpu = config.mutable_cpu();
+  cpu->set_use_pool(true);
+  cpu->set_allocator(MemoryPoolConfig::FREE_LIST);
+  cpu->set_exhaustion(MemoryPoolConfig::WAIT);
+  cpu->set_thread_cache_size(POOL_SIZE);
+  cpu->set_free_space(info.totalram - POOL_SIZE);
+  init_memory_allocators(config, {});
+
+  std::promise<void> cached;
+  std::promise<void> done;
+  std::thread holder([&] {
+    delete_buffer(CPU_DEVICE, new_buffer(CPU_DEVICE, CHUNK));
+    cached.set_value();
+    done.get_future().wait();
+  });
+  cached.get_future().wait();
+  EXPECT_GT(bytes_in_use(), 0);
+
+  i64 exhausted = pool_exhausted_count(CPU_DEVICE);
+  std::vector<u8*> buffers = fill_pool();
+  EXPECT_EQ(bytes_in_use(), POOL_SIZE);
+  EXPECT_EQ(pool_exhausted_count(CPU_DEVICE), exhausted);
+  for (u8* buffer : buffers) {
+    delete_buffer(CPU_DEVICE, buffer);
+  }
+  done.set_value();
+  holder.join();
+
+  destroy_memory_allocators();
+}
+
+TEST(FreeListPoolAllocator, RoundsUpToAlignment) {
+  init_free_list_pool();
+  u8* a = new_buffer(CPU_DEVICE, 1);
+  u8* b = new_buffer(CPU_DEVICE, 17);
+  EXPECT_EQ(bytes_in_use(), 16 + 32);
+  EXPECT_EQ((size_t)a % 16, 0);
+  EXPECT_EQ((size_t)b % 16, 0);
+  delete_buffer(CPU_DEVICE, a);
+  delete_buffer(CPU_DEVICE, b);
+  EXPECT_EQ(largest_free_extent(), POOL_SIZE);
+
+  destroy_memory_allocators();
+}
+}
@@ -0,0 +1,171 @@
+/* Copyright 2017 Carnegie Mellon University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "scanner/util/metrics_server.h"
+
+#include <arpa/inet.h>
+#include <glog/logging.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <cstring>
+
+namespace scanner {
+namespace {
+
+const i32 ACCEPT_POLL_MS = 200;
+const size_t MAX_REQUEST_BYTES = 8192;
+
+std::string escape_label(const std::string& value) {
+  std::string escaped;
+  for (char c : value) {
+    if (c == '\\' || c == '"') {
+      escaped += '\\';
+      escaped += c;
+    } else if (c == '\n') {
+      escaped += "\\n";
+    } else {
+      escaped += c;
+    }
+  }
+  return escaped;
+}
+
+void write_all(int fd, const std::string& data) {
+  size_t written = 0;
+  while (written < data.size()) {
+    ssize_t n = ::write(fd, data.data() + written, data.size() - written);
+    if (n <= 0) {
+      return;
+    }
+    written += n;
+  }
+}
+}
+
+void MetricsWriter::family(const std::string& name, const std::string& type,
+                           const std::string& help) {
+  out_ << "# HELP " << name << " " << help << "\n";
+  out_ << "# TYPE " << name << " " << type << "\n";
+}
+
+void MetricsWriter::sample(const std::string& name, f64 value,
+                           const MetricLabels& labels) {
+  out_ << name;
+  if (!labels.empty()) {
+    out_ << "{";
+    for (size_t i = 0; i < labels.size(); ++i) {
+      out_ << (i > 0 ? "," : "") << labels[i].first << "=\""
+           << escape_label(labels[i].second) << "\"";
+    }
+    out_ << "}";
+  }
+  // Counts are printed in full rather than in scientific notation
+  if (value == (f64)(i64)value) {
+    out_ << " " << (i64)value << "\n";
+  } else {
+    out_ << " " << value << "\n";
+  }
+}
+
+MetricsServer::MetricsServer(i32 port, Collector collector)
+  : collector_(collector) {
+  socket_ = socket(AF_INET, SOCK_STREAM, 0);
+  if (socket_ < 0) {
+    LOG(WARNING) << "Could not create metrics socket: " << strerror(errno);
+    return;
+  }
+  int reuse = 1;
+  setsockopt(socket_, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+  sockaddr_in address;
+  memset(&address, 0, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_ANY);
+  address.sin_port = htons(port);
+  if (bind(socket_, (sockaddr*)&address, sizeof(address)) < 0 ||
+      listen(socket_, 16) < 0) {
+    LOG(WARNING) << "Could not serve metrics on port " << port << ": "
+                 << strerror(errno);
+    close(socket_);
+    socket_ = -1;
+    return;
+  }
+  VLOG(1) << "Serving metrics on port " << port;
+  thread_ = std::thread([this]() { serve(); });
+}
+
+MetricsServer::~MetricsServer() {
+  stop_ = true;
+  if (thread_.joinable()) {
+    thread_.join();
+  }
+  if (socket_ >= 0) {
+    close(socket_);
+  }
+}
+
+void MetricsServer::serve() {
+  while (!stop_) {
+    pollfd fd{socket_, POLLIN, 0};
+    if (poll(&fd, 1, ACCEPT_POLL_MS) <= 0) {
+      continue;
+    }
+    int connection = accept(socket_, nullptr, nullptr);
+    if (connection < 0) {
+      continue;
+    }
+    respond(connection);
+    close(connection);
+  }
+}
+
+void MetricsServer::respond(int connection) {
+  // Only the request line matters, so stop reading at the end of the headers
+  std::string request;
+  char buffer[1024];
+  while (request.size() < MAX_REQUEST_BYTES &&
+         request.find("\r\n\r\n") == std::string::npos) {
+    pollfd fd{connection, POLLIN, 0};
+    if (poll(&fd, 1, ACCEPT_POLL_MS) <= 0) {
+      return;
+    }
+    ssize_t n = ::read(connection, buffer, sizeof(buffer));
+    if (n <= 0) {
+      break;
+    }
+    request.append(buffer, n);
+  }
+  std::string status = "200 OK";
+  std::string body;
+  if (request.compare(0, 13, "GET /metrics ") == 0 ||
+      request.compare(0, 14, "GET /metrics?") == 0) {
+    MetricsWriter writer;
+    collector_(writer);
+    body = writer.str();
+  } else {
+    status = "404 Not Found";
+    body = "Metrics are served on /metrics\n";
+  }
+  std::ostringstream response;
+  response << "HTTP/1.0 " << status << "\r\n"
+           << "Content-Type: text/plain; version=0.0.4\r\n"
+           << "Content-Length: " << body.size() << "\r\n"
+           << "Connection: close\r\n\r\n"
+           << body;
+  write_all(connection, response.str());
+}
+}
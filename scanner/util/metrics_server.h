@@ -0,0 +1,74 @@
+/* Copyright 2017 Carnegie Mellon University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include "scanner/util/common.h"
+
+#include <atomic>
+#include <functional>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace scanner {
+
+using MetricLabels = std::vector<std::pair<std::string, std::string>>;
+
+//! Builds a page of metrics in the Prometheus text exposition format
+class MetricsWriter {
+ public:
+  //! Starts a metric family. type is "counter" or "gauge".
+  void family(const std::string& name, const std::string& type,
+              const std::string& help);
+
+  //! Adds a sample to the last family started
+  void sample(const std::string& name, f64 value,
+              const MetricLabels& labels = {});
+
+  std::string str() const { return out_.str(); }
+
+ private:
+  std::ostringstream out_;
+};
+
+//! Serves the metrics a collector writes over HTTP on GET /metrics, from a
+//! thread of its own. Failing to listen on the port only logs a warning.
+class MetricsServer {
+ public:
+  using Collector = std::function<void(MetricsWriter&)>;
+
+  MetricsServer(i32 port, Collector collector);
+
+  ~MetricsServer();
+
+  MetricsServer(const MetricsServer&) = delete;
+  MetricsServer& operator=(const MetricsServer&) = delete;
+
+  bool listening() const { return socket_ >= 0; }
+
+ private:
+  void serve();
+
+  void respond(int connection);
+
+  Collector collector_;
+  int socket_ = -1;
+  std::atomic<bool> stop_{false};
+  std::thread thread_;
+};
+}
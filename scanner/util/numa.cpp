@@ -0,0 +1,161 @@
+/* Copyright 2017 Carnegie Mellon University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "scanner/util/numa.h"
+#include "scanner/util/util.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <fstream>
+#include <mutex>
+#include <thread>
+
+namespace scanner {
+
+namespace {
+
+const std::string NUMA_NODE_PATH = "/sys/devices/system/node/node";
+const std::string NUMA_ONLINE_PATH = "/sys/devices/system/node/online";
+
+// Parses a sysfs cpulist such as "0-7,16-23", or a node list in the same
+// format
+std::vector<i32> parse_cpu_list(const std::string& list) {
+  std::vector<i32> cpus;
+  for (const std::string& range : split(list, ',')) {
+    std::vector<std::string> bounds = split(range, '-');
+    if (bounds.empty()) {
+      continue;
+    }
+    i32 start = std::stoi(bounds[0]);
+    i32 end = bounds.size() > 1 ? std::stoi(bounds[1]) : start;
+    for (i32 c = start; c <= end; ++c) {
+      cpus.push_back(c);
+    }
+  }
+  return cpus;
+}
+
+std::once_flag topology_flag;
+std::vector<std::vector<i32>> topology;
+
+const std::vector<std::vector<i32>>& numa_topology() {
+  std::call_once(topology_flag, []() {
+    // Node ids can have gaps, e.g. with offlined nodes, so they come from
+    // the online list rather than counting up until one is missing
+    std::ifstream online(NUMA_ONLINE_PATH);
+    std::string nodes;
+    if (online.good()) {
+      std::getline(online, nodes);
+    }
+    for (i32 node : parse_cpu_list(nodes)) {
+      std::ifstream file(NUMA_NODE_PATH + std::to_string(node) + "/cpulist");
+      if (!file.good()) {
+        continue;
+      }
+      std::string list;
+      std::getline(file, list);
+      std::vector<i32> cpus = parse_cpu_list(list);
+      // Memory only nodes have no CPUs to bind threads to or first-touch
+      // their pages from
+      if (!cpus.empty()) {
+        topology.push_back(cpus);
+      }
+    }
+    if (topology.empty()) {
+      std::vector<i32> cpus;
+      for (i32 c = 0; c < (i32)std::thread::hardware_concurrency(); ++c) {
+        cpus.push_back(c);
+      }
+      topology.push_back(cpus);
+    }
+  });
+  return topology;
+}
+
+thread_local i32 current_numa_node = 0;
+}
+
+i32 num_numa_nodes() { return numa_topology().size(); }
+
+std::vector<i32> numa_node_cpus(i32 node) {
+  const auto& nodes = numa_topology();
+  return nodes.at(node % nodes.size());
+}
+
+void bind_thread_to_numa_node(i32 node) {
+  bind_thread_to_cpus(numa_node_cpus(node));
+  set_thread_numa_node(node % num_numa_nodes());
+}
+
+void bind_thread_to_cpus(const std::vector<i32>& cpus) {
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (i32 c : cpus) {
+    CPU_SET(c, &set);
+  }
+  i32 err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+  LOG_IF(WARNING, err != 0) << "Failed to set thread affinity: "
+                            << strerror(err);
+}
+
+std::vector<i32> process_cpus() {
+  std::vector<i32> cpus;
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+    for (i32 c = 0; c < CPU_SETSIZE; ++c) {
+      if (CPU_ISSET(c, &set)) {
+        cpus.push_back(c);
+      }
+    }
+  }
+  if (cpus.empty()) {
+    for (i32 c = 0; c < (i32)std::thread::hardware_concurrency(); ++c) {
+      cpus.push_back(c);
+    }
+  }
+  return cpus;
+}
+
+std::vector<i32> split_cpus(const std::vector<i32>& cpus, i32 parts,
+                            i32 part) {
+  if (cpus.empty() || parts <= 0) {
+    return {};
+  }
+  i32 total = cpus.size();
+  if (parts >= total) {
+    return {cpus[part % total]};
+  }
+  i32 start = (i64)total * part / parts;
+  i32 end = (i64)total * (part + 1) / parts;
+  return std::vector<i32>(cpus.begin() + start, cpus.begin() + end);
+}
+
+i32 thread_numa_node() { return current_numa_node; }
+
+void set_thread_numa_node(i32 node) { current_numa_node = node; }
+
+void first_touch_on_numa_node(u8* buffer, size_t size, i32 node) {
+  std::thread toucher([buffer, size, node]() {
+    bind_thread_to_numa_node(node);
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    for (size_t offset = 0; offset < size; offset += page_size) {
+      buffer[offset] = 0;
+    }
+  });
+  toucher.join();
+}
+}
@@ -0,0 +1,62 @@
+/* Copyright 2017 Carnegie Mellon University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include "scanner/util/common.h"
+
+#include <cstddef>
+#include <vector>
+
+namespace scanner {
+
+///////////////////////////////////////////////////////////////////////////////
+/// NUMA topology utils
+//
+// Topology is read from /sys/devices/system/node so no libnuma dependency is
+// required. Machines without that directory are reported as a single node
+// containing every CPU. The online nodes that have CPUs are numbered from 0
+// in order of their ids, so gaps in the ids are skipped.
+
+//! Number of NUMA nodes on this machine (at least 1).
+i32 num_numa_nodes();
+
+//! CPU ids that belong to the given NUMA node.
+std::vector<i32> numa_node_cpus(i32 node);
+
+//! Restricts the calling thread to the CPUs of the given NUMA node and makes
+//! it the thread's preferred node for CPU buffer allocations.
+void bind_thread_to_numa_node(i32 node);
+
+//! Restricts the calling thread to the given set of CPUs.
+void bind_thread_to_cpus(const std::vector<i32>& cpus);
+
+//! CPU ids this process may run on, in ascending order.
+std::vector<i32> process_cpus();
+
+//! The part-th of parts contiguous, near-equal slices of cpus. When there are
+//! more parts than CPUs, parts share CPUs round-robin.
+std::vector<i32> split_cpus(const std::vector<i32>& cpus, i32 parts, i32 part);
+
+//! NUMA node the calling thread allocates CPU buffers from (0 by default).
+i32 thread_numa_node();
+
+void set_thread_numa_node(i32 node);
+
+//! Writes to every page of buffer from a thread bound to the given node so
+//! that, under the kernel's first-touch policy, the pages are backed by that
+//! node's memory.
+void first_touch_on_numa_node(u8* buffer, size_t size, i32 node);
+}
@@ -2,6 +2,7 @@
 
 #include "scanner/api/kernel.h"
 #include "scanner/engine/metadata.h"
+#include "scanner/util/cuda.h"
 #include "scanner/util/image.h"
 
 #ifdef HAVE_CUDA
@@ -25,6 +26,16 @@ int frame_to_cv_type(FrameType type, int channels) {
       cv_type = CV_64F;
       break;
     }
+    case FrameType::F16: {
+#ifdef CV_16F
+      cv_type = CV_16F;
+#else
+      // OpenCV 3 has no half type, but stores the results of convertFp16
+      // as 16 bit integers
+      cv_type = CV_16S;
+#endif
+      break;
+    }
   }
   return CV_MAKETYPE(cv_type, channels);
 }
@@ -44,6 +55,12 @@ FrameType cv_to_frame_type(int t) {
       type = FrameType::F64;
       break;
     }
+#ifdef CV_16F
+    case CV_16F: {
+      type = FrameType::F16;
+      break;
+    }
+#endif
     default: { LOG(FATAL) << "Unsupported OpenCV type: " << t; }
   }
   return type;
@@ -58,15 +75,51 @@ cv::Mat frame_to_mat(const Frame* frame) { return frame_to_mat((Frame*)frame); }
 
 cv::Mat frame_to_mat(Frame* frame) {
   return cv::Mat(frame->height(), frame->width(),
-                 frame_to_cv_type(frame->type, frame->channels()), frame->data);
+                 frame_to_cv_type(frame->type, frame->channels()), frame->data,
+                 frame->row_stride);
 }
 
 cv::Mat bytesToImage(u8* buf, const FrameInfo& metadata) {
   return cv::Mat(metadata.height(), metadata.width(), CV_8UC3, buf);
 }
 
+void f32_to_f16(DeviceHandle device, const f32* src, u16* dst, size_t count) {
+  if (device.type == DeviceType::GPU) {
+    CUDA_PROTECT({
+      CU_CHECK(cudaSetDevice(device.id));
+      CU_CHECK(convertF32toF16(src, dst, count, 0));
+      CU_CHECK(cudaStreamSynchronize(0));
+    });
+  } else {
+    cv::Mat in(1, count, CV_32F, const_cast<f32*>(src));
+    cv::Mat out(1, count, CV_16S, dst);
+    cv::convertFp16(in, out);
+  }
+}
+
+void f16_to_f32(DeviceHandle device, const u16* src, f32* dst, size_t count) {
+  if (device.type == DeviceType::GPU) {
+    CUDA_PROTECT({
+      CU_CHECK(cudaSetDevice(device.id));
+      CU_CHECK(convertF16toF32(src, dst, count, 0));
+      CU_CHECK(cudaStreamSynchronize(0));
+    });
+  } else {
+    cv::Mat in(1, count, CV_16S, const_cast<u16*>(src));
+    cv::Mat out(1, count, CV_32F, dst);
+    cv::convertFp16(in, out);
+  }
+}
+
 #ifdef HAVE_CUDA
 
+cv::cuda::Stream wrap_stream(void* stream) {
+  if (stream == nullptr) {
+    return cvc::Stream::Null();
+  }
+  return cvc::StreamAccessor::wrapStream((cudaStream_t)stream);
+}
+
 cvc::GpuMat frame_to_gpu_mat(const Frame* frame) {
   return frame_to_gpu_mat((Frame*)frame);
 }
@@ -74,7 +127,7 @@ cvc::GpuMat frame_to_gpu_mat(const Frame* frame) {
 cvc::GpuMat frame_to_gpu_mat(Frame* frame) {
   return cvc::GpuMat(frame->height(), frame->width(),
                      frame_to_cv_type(frame->type, frame->channels()),
-                     frame->data);
+                     frame->data, frame->row_stride);
 }
 
 cvc::GpuMat bytesToImage_gpu(u8* buf, const FrameInfo& metadata) {
@@ -33,6 +33,11 @@ cv::Mat frame_to_mat(const Frame* frame);
 cv::Mat frame_to_mat(Frame* frame);
 
 cv::Mat bytesToImage(u8* buf, const proto::FrameInfo& metadata);
+
+//! Converts count floats in device memory to half precision and back
+void f32_to_f16(DeviceHandle device, const f32* src, u16* dst, size_t count);
+
+void f16_to_f32(DeviceHandle device, const u16* src, f32* dst, size_t count);
 }
 
 #ifdef HAVE_CUDA
@@ -53,6 +58,11 @@ cvc::GpuMat bytesToImage_gpu(u8* buf, const proto::FrameInfo& metadata);
 
 FrameInfo gpu_mat_to_frame_info(const cv::cuda::GpuMat& mat);
 
+//! Wraps a CUDA stream (a cudaStream_t) such as a kernel's stream_ or one
+//! from the CUDAStreamPool for OpenCV calls, without taking ownership of it.
+//! A null stream gives the default stream.
+cv::cuda::Stream wrap_stream(void* stream);
+
 cudaError_t convertNV12toRGBA(
     const cv::cuda::GpuMat& in, cv::cuda::GpuMat& outFrame, int width,
     int height, cv::cuda::Stream& stream = cv::cuda::Stream::Null());
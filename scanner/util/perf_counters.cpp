@@ -0,0 +1,111 @@
+/* Copyright 2017 Carnegie Mellon University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "scanner/util/perf_counters.h"
+
+#include <glog/logging.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <cstring>
+
+namespace scanner {
+namespace {
+
+int open_counter(uint64_t config, int group_fd) {
+  perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = PERF_TYPE_HARDWARE;
+  attr.config = config;
+  attr.read_format = PERF_FORMAT_GROUP;
+  // Counted in user space only, which needs the least permission
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  attr.disabled = group_fd < 0 ? 1 : 0;
+  return static_cast<int>(
+      syscall(__NR_perf_event_open, &attr, 0, -1, group_fd, 0));
+}
+}
+
+PerfCounters::PerfCounters() {
+  group_fd_ = open_counter(PERF_COUNT_HW_CPU_CYCLES, -1);
+  if (group_fd_ < 0) {
+    VLOG(1) << "Hardware performance counters are not available: "
+            << strerror(errno);
+    return;
+  }
+  instructions_fd_ = open_counter(PERF_COUNT_HW_INSTRUCTIONS, group_fd_);
+  llc_misses_fd_ = open_counter(PERF_COUNT_HW_CACHE_MISSES, group_fd_);
+  if (instructions_fd_ < 0 || llc_misses_fd_ < 0) {
+    VLOG(1) << "Hardware performance counters are not available: "
+            << strerror(errno);
+    if (instructions_fd_ >= 0) {
+      close(instructions_fd_);
+    }
+    if (llc_misses_fd_ >= 0) {
+      close(llc_misses_fd_);
+    }
+    close(group_fd_);
+    group_fd_ = instructions_fd_ = llc_misses_fd_ = -1;
+    return;
+  }
+  ioctl(group_fd_, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+  ioctl(group_fd_, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+}
+
+PerfCounters::~PerfCounters() {
+  if (group_fd_ >= 0) {
+    close(llc_misses_fd_);
+    close(instructions_fd_);
+    close(group_fd_);
+  }
+}
+
+PerfCounters::Sample PerfCounters::read() const {
+  Sample sample;
+  sample.time = now();
+  if (group_fd_ < 0) {
+    return sample;
+  }
+  // Number of counters followed by their values, in the order opened
+  uint64_t values[4];
+  if (::read(group_fd_, values, sizeof(values)) != sizeof(values) ||
+      values[0] != 3) {
+    return sample;
+  }
+  sample.cycles = static_cast<int64_t>(values[1]);
+  sample.instructions = static_cast<int64_t>(values[2]);
+  sample.llc_misses = static_cast<int64_t>(values[3]);
+  return sample;
+}
+
+void PerfCounters::record(Profiler& profiler, const std::string& prefix,
+                          const std::string& key, const Sample& start) const {
+  if (group_fd_ < 0) {
+    return;
+  }
+  Sample end = read();
+  profiler.increment(prefix + "cycles:" + key, end.cycles - start.cycles);
+  profiler.increment(prefix + "instructions:" + key,
+                     end.instructions - start.instructions);
+  profiler.increment(prefix + "llc_misses:" + key,
+                     end.llc_misses - start.llc_misses);
+  profiler.increment(prefix + "counted_ns:" + key,
+                     (int64_t)nano_since(start.time));
+}
+}
@@ -0,0 +1,64 @@
+/* Copyright 2017 Carnegie Mellon University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include "scanner/util/profiler.h"
+
+#include <cstdint>
+#include <string>
+
+namespace scanner {
+
+// Hardware counters of the calling thread, read through perf_event: cycles,
+// retired instructions and last level cache misses, each of which fetched a
+// cache line from memory. Opening them fails where perf_event is not
+// permitted (see perf_event_paranoid), and nothing is counted then.
+class PerfCounters {
+ public:
+  struct Sample {
+    int64_t cycles = 0;
+    int64_t instructions = 0;
+    int64_t llc_misses = 0;
+    timepoint_t time;
+  };
+
+  //! Counts the thread constructing it
+  PerfCounters();
+
+  ~PerfCounters();
+
+  PerfCounters(const PerfCounters&) = delete;
+  PerfCounters& operator=(const PerfCounters&) = delete;
+
+  bool available() const { return group_fd_ >= 0; }
+
+  Sample read() const;
+
+  //! Adds the counts since start to the profiler counters
+  //! <prefix>cycles:<key>, <prefix>instructions:<key>,
+  //! <prefix>llc_misses:<key> and the time they were counted over,
+  //! <prefix>counted_ns:<key>
+  void record(Profiler& profiler, const std::string& prefix,
+              const std::string& key, const Sample& start) const;
+
+  static const int64_t CACHE_LINE_BYTES = 64;
+
+ private:
+  int group_fd_ = -1;
+  int instructions_fd_ = -1;
+  int llc_misses_fd_ = -1;
+};
+}
@@ -17,23 +17,268 @@
 #include "scanner/util/storehouse.h"
 #include "storehouse/storage_backend.h"
 
+#include <algorithm>
 #include <cmath>
+#include <cstdio>
+#include <deque>
+#include <limits>
 #include <map>
+#include <mutex>
 #include <string>
+#include <unordered_map>
+#include <unordered_set>
 
 namespace scanner {
+namespace {
 
-Profiler::Profiler(timepoint_t base_time) : base_time_(base_time), lock_(0) {}
+struct KeyRegistry {
+  std::mutex mutex;
+  std::unordered_map<std::string, ProfilerKey> keys;
+  std::deque<std::string> names;
+};
+
+KeyRegistry& key_registry() {
+  static KeyRegistry registry;
+  return registry;
+}
+
+std::atomic<uint64_t> next_profiler_id(0);
+
+// Ids of the profilers that have not been destroyed, so that threads can drop
+// the buffers they hold for the others
+struct LiveProfilers {
+  std::mutex mutex;
+  std::unordered_set<uint64_t> ids;
+};
+
+LiveProfilers& live_profilers() {
+  static LiveProfilers live;
+  return live;
+}
+
+uint64_t add_live_profiler() {
+  uint64_t id = next_profiler_id++;
+  LiveProfilers& live = live_profilers();
+  std::unique_lock<std::mutex> lock(live.mutex);
+  live.ids.insert(id);
+  return id;
+}
+
+// A thread's buffers are looked up again only once it has recorded to this
+// many profilers since the last sweep
+const size_t THREAD_BUFFER_SWEEP_SIZE = 64;
+}
+
+Profiler::Histogram::Histogram() : count(0), total_ns(0) {
+  for (int i = 0; i < HISTOGRAM_BUCKETS; ++i) {
+    buckets[i].store(0, std::memory_order_relaxed);
+  }
+}
+
+Profiler::ThreadBuffer::ThreadBuffer()
+  : ring(new Slot[RING_SIZE]),
+    head(0),
+    tail(0),
+    counters(new std::atomic<int64_t>[MAX_THREAD_COUNTERS]),
+    counters_used(new std::atomic<bool>[MAX_THREAD_COUNTERS]),
+    intervals_seen(0),
+    histograms(new std::atomic<Histogram*>[MAX_THREAD_COUNTERS]) {
+  for (ProfilerKey i = 0; i < MAX_THREAD_COUNTERS; ++i) {
+    counters[i].store(0, std::memory_order_relaxed);
+    counters_used[i].store(false, std::memory_order_relaxed);
+    histograms[i].store(nullptr, std::memory_order_relaxed);
+  }
+}
+
+Profiler::ThreadBuffer::~ThreadBuffer() {
+  for (ProfilerKey i = 0; i < MAX_THREAD_COUNTERS; ++i) {
+    delete histograms[i].load(std::memory_order_relaxed);
+  }
+}
+
+Profiler::Profiler(timepoint_t base_time, int64_t sample_period)
+  : id_(add_live_profiler()),
+    base_time_(base_time),
+    sample_period_(sample_period),
+    lock_(0) {}
 
 Profiler::Profiler(const Profiler& other)
-  : base_time_(other.base_time_), records_(other.records_), lock_(0) {}
+  : id_(add_live_profiler()),
+    base_time_(other.base_time_),
+    sample_period_(other.sample_period_),
+    lock_(0) {
+  other.spin_lock();
+  other.drain();
+  records_ = other.records_;
+  aggregates_ = other.aggregates_;
+  other.unlock();
+}
+
+Profiler::~Profiler() {
+  LiveProfilers& live = live_profilers();
+  std::unique_lock<std::mutex> lock(live.mutex);
+  live.ids.erase(id_);
+}
+
+int64_t Profiler::IntervalAggregate::percentile(double p) const {
+  const int64_t max_ns = std::numeric_limits<int64_t>::max();
+  int64_t rank = static_cast<int64_t>(std::ceil(p * count));
+  int64_t seen = 0;
+  for (size_t b = 0; b < buckets.size(); ++b) {
+    seen += buckets[b];
+    if (seen >= rank && buckets[b] > 0) {
+      // The last bucket ends at the largest duration
+      return (int)b < histogram_bucket(max_ns)
+                 ? histogram_bucket_start(b + 1) - 1
+                 : max_ns;
+    }
+  }
+  return 0;
+}
+
+ProfilerKey Profiler::intern(const std::string& name) {
+  KeyRegistry& registry = key_registry();
+  std::unique_lock<std::mutex> lock(registry.mutex);
+  auto it = registry.keys.find(name);
+  if (it != registry.keys.end()) {
+    return it->second;
+  }
+  ProfilerKey key = static_cast<ProfilerKey>(registry.names.size());
+  registry.names.push_back(name);
+  registry.keys.insert({name, key});
+  return key;
+}
+
+std::string Profiler::key_name(ProfilerKey key) {
+  KeyRegistry& registry = key_registry();
+  std::unique_lock<std::mutex> lock(registry.mutex);
+  return registry.names.at(key);
+}
+
+void Profiler::add_interval(const std::string& key, timepoint_t start,
+                            timepoint_t end) {
+  thread_local std::unordered_map<std::string, ProfilerKey> keys;
+  auto it = keys.find(key);
+  if (it == keys.end()) {
+    it = keys.insert({key, intern(key)}).first;
+  }
+  add_interval(it->second, start, end);
+}
+
+void Profiler::increment(const std::string& key, int64_t value) {
+  thread_local std::unordered_map<std::string, ProfilerKey> keys;
+  auto it = keys.find(key);
+  if (it == keys.end()) {
+    it = keys.insert({key, intern(key)}).first;
+  }
+  increment(it->second, value);
+}
 
-const std::vector<Profiler::TaskRecord>& Profiler::get_records() const {
-  return records_;
+Profiler::ThreadBuffer* Profiler::register_thread_buffer() {
+  // Every buffer the thread holds, kept until the profiler is destroyed so
+  // that a thread alternating between profilers keeps one buffer in each
+  thread_local std::unordered_map<uint64_t, ThreadBuffer*> buffers;
+  thread_local size_t sweep_size = THREAD_BUFFER_SWEEP_SIZE;
+  auto it = buffers.find(id_);
+  if (it != buffers.end()) {
+    return it->second;
+  }
+  if (buffers.size() >= sweep_size) {
+    // The buffers of destroyed profilers are gone along with them
+    LiveProfilers& live = live_profilers();
+    std::unique_lock<std::mutex> lock(live.mutex);
+    for (auto b = buffers.begin(); b != buffers.end();) {
+      b = live.ids.count(b->first) > 0 ? std::next(b) : buffers.erase(b);
+    }
+    sweep_size = std::max(THREAD_BUFFER_SWEEP_SIZE, 2 * buffers.size());
+  }
+  ThreadBuffer* buffer = new ThreadBuffer;
+  spin_lock();
+  buffers_.emplace_back(buffer);
+  unlock();
+  buffers[id_] = buffer;
+  return buffer;
+}
+
+void Profiler::drain() const {
+  // Only keys interned since the last drain are copied from the registry
+  auto load_names = [&]() {
+    KeyRegistry& registry = key_registry();
+    std::unique_lock<std::mutex> lock(registry.mutex);
+    names_.insert(names_.end(), registry.names.begin() + names_.size(),
+                  registry.names.end());
+  };
+  load_names();
+  const std::vector<std::string>& names = names_;
+  for (auto& buffer : buffers_) {
+    uint64_t tail = buffer->tail.load(std::memory_order_relaxed);
+    uint64_t head = buffer->head.load(std::memory_order_acquire);
+    for (uint64_t i = tail; i < head; ++i) {
+      const Slot& slot = buffer->ring[i % RING_SIZE];
+      if (slot.key >= static_cast<ProfilerKey>(names.size())) {
+        // Interned since the names were loaded
+        load_names();
+      }
+      records_.push_back(TaskRecord{names[slot.key], slot.start, slot.end});
+    }
+    buffer->tail.store(head, std::memory_order_release);
+
+    ProfilerKey num_counters = std::min(
+        static_cast<ProfilerKey>(names.size()), MAX_THREAD_COUNTERS);
+    for (ProfilerKey key = 0; key < num_counters; ++key) {
+      if (buffer->counters_used[key].load(std::memory_order_acquire)) {
+        counters_[names[key]] += buffer->counters[key].exchange(0);
+      }
+      Histogram* histogram =
+          buffer->histograms[key].load(std::memory_order_acquire);
+      if (histogram != nullptr) {
+        IntervalAggregate& aggregate = aggregates_[names[key]];
+        aggregate.buckets.resize(HISTOGRAM_BUCKETS);
+        aggregate.count += histogram->count.exchange(0);
+        aggregate.total_ns += histogram->total_ns.exchange(0);
+        for (int b = 0; b < HISTOGRAM_BUCKETS; ++b) {
+          aggregate.buckets[b] += histogram->buckets[b].exchange(0);
+        }
+      }
+    }
+  }
 }
 
-const std::map<std::string, int64_t>& Profiler::get_counters() const {
-  return counters_;
+std::vector<Profiler::TaskRecord> Profiler::get_records() const {
+  spin_lock();
+  drain();
+  std::vector<TaskRecord> records = records_;
+  unlock();
+  return records;
+}
+
+size_t Profiler::copy_records(size_t start,
+                              std::vector<TaskRecord>& records) const {
+  spin_lock();
+  drain();
+  if (start < records_.size()) {
+    records.insert(records.end(), records_.begin() + start, records_.end());
+  }
+  size_t end = records_.size();
+  unlock();
+  return end;
+}
+
+std::map<std::string, int64_t> Profiler::get_counters() const {
+  spin_lock();
+  drain();
+  std::map<std::string, int64_t> counters = counters_;
+  unlock();
+  return counters;
+}
+
+std::map<std::string, Profiler::IntervalAggregate> Profiler::get_aggregates()
+    const {
+  spin_lock();
+  drain();
+  std::map<std::string, IntervalAggregate> aggregates = aggregates_;
+  unlock();
+  return aggregates;
 }
 
 void write_profiler_to_file(storehouse::WriteFile* file, int64_t node,
@@ -49,8 +294,7 @@ void write_profiler_to_file(storehouse::WriteFile* file, int64_t node,
   // Worker number
   s_write(file, worker_num);
   // Intervals
-  const std::vector<scanner::Profiler::TaskRecord>& records =
-      profiler.get_records();
+  std::vector<scanner::Profiler::TaskRecord> records = profiler.get_records();
   // Perform dictionary compression on interval key names
   uint8_t record_key_id = 0;
   std::map<std::string, uint8_t> key_names;
@@ -89,7 +333,7 @@ void write_profiler_to_file(storehouse::WriteFile* file, int64_t node,
     s_write(file, end);
   }
   // S_Write out counters
-  const std::map<std::string, int64_t>& counters = profiler.get_counters();
+  std::map<std::string, int64_t> counters = profiler.get_counters();
   int64_t num_counters = static_cast<int64_t>(counters.size());
   s_write(file, num_counters);
   for (auto& kv : counters) {
@@ -97,4 +341,107 @@ void write_profiler_to_file(storehouse::WriteFile* file, int64_t node,
     s_write(file, kv.second);
   }
 }
+
+void write_profiler_aggregates_to_file(storehouse::WriteFile* file,
+                                       const Profiler& profiler) {
+  std::map<std::string, Profiler::IntervalAggregate> aggregates =
+      profiler.get_aggregates();
+  int64_t num_aggregates = static_cast<int64_t>(aggregates.size());
+  s_write(file, num_aggregates);
+  for (auto& kv : aggregates) {
+    const Profiler::IntervalAggregate& aggregate = kv.second;
+    s_write(file, kv.first);
+    s_write(file, aggregate.count);
+    s_write(file, aggregate.total_ns);
+    int64_t num_buckets = 0;
+    for (int64_t bucket_count : aggregate.buckets) {
+      num_buckets += bucket_count > 0 ? 1 : 0;
+    }
+    s_write(file, num_buckets);
+    for (size_t b = 0; b < aggregate.buckets.size(); ++b) {
+      if (aggregate.buckets[b] > 0) {
+        uint8_t bucket = static_cast<uint8_t>(b);
+        s_write(file, bucket);
+        s_write(file, aggregate.buckets[b]);
+      }
+    }
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/// TraceWriter
+namespace {
+
+std::string json_string(const std::string& s) {
+  std::string out = "\"";
+  for (char c : s) {
+    if (c == '"' || c == '\\') {
+      out += '\\';
+      out += c;
+    } else if (static_cast<unsigned char>(c) < 0x20) {
+      char escaped[8];
+      snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+      out += escaped;
+    } else {
+      out += c;
+    }
+  }
+  out += '"';
+  return out;
+}
+}
+
+TraceWriter::TraceWriter(int64_t node) : node_(node) {}
+
+void TraceWriter::add_thread(const std::string& name,
+                             const Profiler* profiler) {
+  threads_.push_back(Thread{name, profiler, 0});
+}
+
+std::string TraceWriter::events(bool since_last) {
+  std::string out = "[";
+  bool first = true;
+  auto add_event = [&](const std::string& event) {
+    if (!first) {
+      out += ",\n";
+    }
+    first = false;
+    out += event;
+  };
+  std::string pid = std::to_string(node_);
+  bool name_threads = !named_threads_ || !since_last;
+  if (name_threads) {
+    add_event("{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":" + pid +
+              ",\"args\":{\"name\":\"node_" + pid + "\"}}");
+    named_threads_ = true;
+  }
+  std::vector<Profiler::TaskRecord> records;
+  for (size_t t = 0; t < threads_.size(); ++t) {
+    Thread& thread = threads_[t];
+    std::string tid = std::to_string(t);
+    if (name_threads) {
+      add_event("{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":" + pid +
+                ",\"tid\":" + tid + ",\"args\":{\"name\":" +
+                json_string(thread.name) + "}}");
+    }
+    int64_t base_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                          thread.profiler->base_time().time_since_epoch())
+                          .count();
+    records.clear();
+    thread.next_record = thread.profiler->copy_records(
+        since_last ? thread.next_record : 0, records);
+    for (const Profiler::TaskRecord& record : records) {
+      // Microseconds, as the format expects
+      char times[64];
+      snprintf(times, sizeof(times), "\"ts\":%.3f,\"dur\":%.3f",
+               (base_ns + record.start) / 1000.0,
+               (record.end - record.start) / 1000.0);
+      add_event("{\"name\":" + json_string(record.key) +
+                ",\"ph\":\"X\",\"pid\":" + pid + ",\"tid\":" + tid + "," +
+                times + "}");
+    }
+  }
+  out += "]\n";
+  return out;
+}
 }
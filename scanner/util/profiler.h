@@ -20,6 +20,7 @@
 #include <atomic>
 #include <fstream>
 #include <map>
+#include <memory>
 #include <string>
 #include <vector>
 
@@ -29,14 +30,41 @@ class WriteFile;
 
 namespace scanner {
 
+// Key of intervals and counters, interned once so that recording neither
+// copies nor compares strings
+using ProfilerKey = int32_t;
+
+// Every thread recording to a profiler gets its own preallocated ring of
+// intervals and array of counters, which only it writes to, so recording
+// takes no lock. Records are moved out of the rings into the profiler's
+// lists whenever they are read, or by the recording thread itself once its
+// ring fills up.
+//
+// A nonzero sample period also keeps the count, total and a histogram of the
+// durations of every interval by key, with fixed memory per key. Each thread
+// then records one in sample_period of its intervals, or none if the period
+// is negative.
 class Profiler {
  public:
-  Profiler(timepoint_t base_time);
+  Profiler(timepoint_t base_time, int64_t sample_period = 0);
 
   Profiler(const Profiler& other);
 
+  ~Profiler();
+
+  //! Returns the key of the name, the same one for every call with it
+  static ProfilerKey intern(const std::string& name);
+
+  static std::string key_name(ProfilerKey key);
+
+  void add_interval(ProfilerKey key, timepoint_t start, timepoint_t end);
+
+  //! Looks the key up in a per-thread table, so prefer interning the keys
+  //! of hot paths once
   void add_interval(const std::string& key, timepoint_t start, timepoint_t end);
 
+  void increment(ProfilerKey key, int64_t value);
+
   void increment(const std::string& key, int64_t value);
 
   struct TaskRecord {
@@ -45,24 +73,149 @@ class Profiler {
     int64_t end;
   };
 
-  const std::vector<TaskRecord>& get_records() const;
+  //! Copies of the records, taken under the lock since other threads may
+  //! still be recording
+  std::vector<TaskRecord> get_records() const;
+
+  //! Copies the records from index start on, which is safe while other
+  //! threads are still recording, and returns the index past the last one
+  size_t copy_records(size_t start, std::vector<TaskRecord>& records) const;
+
+  timepoint_t base_time() const { return base_time_; }
+
+  std::map<std::string, int64_t> get_counters() const;
+
+  int64_t sample_period() const { return sample_period_; }
+
+  // Intervals are bucketed log-linearly, four buckets per power of two
+  static const int HISTOGRAM_BUCKETS = 256;
+
+  static int histogram_bucket(int64_t ns);
+
+  //! Shortest duration that falls in the bucket
+  static int64_t histogram_bucket_start(int bucket);
+
+  struct IntervalAggregate {
+    int64_t count = 0;
+    int64_t total_ns = 0;
+    //! Intervals in each histogram bucket
+    std::vector<int64_t> buckets;
+
+    //! Duration that a fraction p of the intervals do not exceed, to within
+    //! the width of its bucket
+    int64_t percentile(double p) const;
+  };
+
+  //! Aggregates of every interval by key, empty without sampling
+  std::map<std::string, IntervalAggregate> get_aggregates() const;
+
+  //! Counts every interval of the key even when sampling. Safe to call
+  //! while other threads are still recording.
+  void sum_intervals(const std::string& key, int64_t& count,
+                     int64_t& total_ns);
+
+  int64_t counter(const std::string& key);
 
-  const std::map<std::string, int64_t>& get_counters() const;
+  static const uint64_t RING_SIZE = 4096;
+  // Counters of keys past this are kept under the lock
+  static const ProfilerKey MAX_THREAD_COUNTERS = 1024;
 
  protected:
-  void spin_lock();
-  void unlock();
+  struct Slot {
+    ProfilerKey key;
+    int64_t start;
+    int64_t end;
+  };
+
+  // Written only by its thread, through head and the counters. Whoever
+  // holds the lock moves records from tail up to head out of the ring.
+  struct Histogram {
+    Histogram();
+
+    std::atomic<int64_t> count;
+    std::atomic<int64_t> total_ns;
+    std::atomic<int64_t> buckets[HISTOGRAM_BUCKETS];
+  };
+
+  struct ThreadBuffer {
+    ThreadBuffer();
+    ~ThreadBuffer();
+
+    std::unique_ptr<Slot[]> ring;
+    std::atomic<uint64_t> head;
+    std::atomic<uint64_t> tail;
+    std::unique_ptr<std::atomic<int64_t>[]> counters;
+    // Counters incremented at least once, which show up even if by 0
+    std::unique_ptr<std::atomic<bool>[]> counters_used;
+    // Intervals the thread has seen, to pick the sampled ones
+    uint64_t intervals_seen;
+    // Aggregates by key when sampling, allocated on a key's first interval
+    std::unique_ptr<std::atomic<Histogram*>[]> histograms;
+  };
+
+  void aggregate_interval(ThreadBuffer* buffer, ProfilerKey key, int64_t ns);
+
+  //! The calling thread's buffer, registered on its first record
+  ThreadBuffer* thread_buffer();
+
+  ThreadBuffer* register_thread_buffer();
+
+  //! Moves recorded intervals and counters out of the thread buffers. The
+  //! lock must be held.
+  void drain() const;
 
+  void spin_lock() const;
+  void unlock() const;
+
+  // Never reused, so threads can cache their buffer by it
+  const uint64_t id_;
   timepoint_t base_time_;
-  std::atomic_flag lock_;
-  std::vector<TaskRecord> records_;
-  std::map<std::string, int64_t> counters_;
+  int64_t sample_period_;
+  mutable std::atomic_flag lock_;
+  std::vector<std::unique_ptr<ThreadBuffer>> buffers_;
+  mutable std::vector<TaskRecord> records_;
+  // Names of the interned keys, extended whenever drain meets a new key
+  mutable std::vector<std::string> names_;
+  mutable std::map<std::string, int64_t> counters_;
+  mutable std::map<std::string, IntervalAggregate> aggregates_;
 };
 
 void write_profiler_to_file(storehouse::WriteFile* file, int64_t node,
                             std::string type_name, std::string tag,
                             int64_t worker_num, const Profiler& profiler);
 
+//! Writes the interval aggregates of the profiler: their count, then the key,
+//! count, total and nonzero histogram buckets of each
+void write_profiler_aggregates_to_file(storehouse::WriteFile* file,
+                                       const Profiler& profiler);
+
+// Writes the intervals of profilers as Chrome trace events (the JSON array
+// format, which Perfetto also loads), one trace thread per profiler and one
+// trace process per node. Events are timed from the epoch so the traces of
+// several nodes line up.
+class TraceWriter {
+ public:
+  TraceWriter(int64_t node);
+
+  //! Profilers must outlive the writer
+  void add_thread(const std::string& name, const Profiler* profiler);
+
+  //! JSON array of the events recorded since the last call, or of every
+  //! event when since_last is false. The first call also names the threads.
+  std::string events(bool since_last = true);
+
+ private:
+  struct Thread {
+    std::string name;
+    const Profiler* profiler;
+    size_t next_record;
+  };
+
+  int64_t node_;
+  std::vector<Thread> threads_;
+  bool named_threads_ = false;
+};
+
 }  // namespace scanner
 
 #include "scanner/util/profiler.inl"
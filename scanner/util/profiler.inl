@@ -19,32 +19,140 @@ namespace scanner {
 
 ///////////////////////////////////////////////////////////////////////////////
 /// Profiler
-inline void Profiler::add_interval(
-  const std::string& key,
-  timepoint_t start,
-  timepoint_t end)
-{
+inline void Profiler::add_interval(ProfilerKey key, timepoint_t start,
+                                   timepoint_t end) {
+  ThreadBuffer* buffer = thread_buffer();
+  if (sample_period_ != 0) {
+    aggregate_interval(
+        buffer, key,
+        std::chrono::duration_cast<std::chrono::nanoseconds>(end - start)
+            .count());
+    if (sample_period_ < 0 ||
+        buffer->intervals_seen++ % sample_period_ != 0) {
+      return;
+    }
+  }
+  uint64_t head = buffer->head.load(std::memory_order_relaxed);
+  if (head - buffer->tail.load(std::memory_order_acquire) == RING_SIZE) {
+    // Only happens once per ring of records
+    spin_lock();
+    drain();
+    unlock();
+  }
+  Slot& slot = buffer->ring[head % RING_SIZE];
+  slot.key = key;
+  slot.start =
+      std::chrono::duration_cast<std::chrono::nanoseconds>(start - base_time_)
+          .count();
+  slot.end =
+      std::chrono::duration_cast<std::chrono::nanoseconds>(end - base_time_)
+          .count();
+  buffer->head.store(head + 1, std::memory_order_release);
+}
+
+inline void Profiler::increment(ProfilerKey key, int64_t value) {
+  if (key < MAX_THREAD_COUNTERS) {
+    ThreadBuffer* buffer = thread_buffer();
+    buffer->counters[key].fetch_add(value, std::memory_order_relaxed);
+    if (!buffer->counters_used[key].load(std::memory_order_relaxed)) {
+      buffer->counters_used[key].store(true, std::memory_order_release);
+    }
+    return;
+  }
+  std::string name = key_name(key);
+  spin_lock();
+  counters_[name] += value;
+  unlock();
+}
+
+inline int Profiler::histogram_bucket(int64_t ns) {
+  if (ns < 4) {
+    return ns < 0 ? 0 : static_cast<int>(ns);
+  }
+  int msb = 63 - __builtin_clzll(static_cast<uint64_t>(ns));
+  return 4 * (msb - 1) + static_cast<int>((ns >> (msb - 2)) & 3);
+}
+
+inline int64_t Profiler::histogram_bucket_start(int bucket) {
+  if (bucket < 4) {
+    return bucket;
+  }
+  int msb = bucket / 4 + 1;
+  return static_cast<int64_t>(4 + bucket % 4) << (msb - 2);
+}
+
+inline void Profiler::aggregate_interval(ThreadBuffer* buffer, ProfilerKey key,
+                                         int64_t ns) {
+  if (key >= MAX_THREAD_COUNTERS) {
+    std::string name = key_name(key);
+    spin_lock();
+    IntervalAggregate& aggregate = aggregates_[name];
+    aggregate.buckets.resize(HISTOGRAM_BUCKETS);
+    aggregate.count++;
+    aggregate.total_ns += ns;
+    aggregate.buckets[histogram_bucket(ns)]++;
+    unlock();
+    return;
+  }
+  Histogram* histogram = buffer->histograms[key].load(std::memory_order_relaxed);
+  if (histogram == nullptr) {
+    histogram = new Histogram;
+    buffer->histograms[key].store(histogram, std::memory_order_release);
+  }
+  histogram->count.fetch_add(1, std::memory_order_relaxed);
+  histogram->total_ns.fetch_add(ns, std::memory_order_relaxed);
+  histogram->buckets[histogram_bucket(ns)].fetch_add(1,
+                                                     std::memory_order_relaxed);
+}
+
+inline void Profiler::sum_intervals(const std::string& key, int64_t& count,
+                                    int64_t& total_ns) {
   spin_lock();
-  records_.emplace_back(TaskRecord{
-    key,
-    std::chrono::duration_cast<std::chrono::nanoseconds>(
-      start - base_time_).count(),
-    std::chrono::duration_cast<std::chrono::nanoseconds>(
-      end - base_time_).count()});
+  drain();
+  if (sample_period_ != 0) {
+    auto it = aggregates_.find(key);
+    if (it != aggregates_.end()) {
+      count += it->second.count;
+      total_ns += it->second.total_ns;
+    }
+    unlock();
+    return;
+  }
+  for (const TaskRecord& record : records_) {
+    if (record.key == key) {
+      count++;
+      total_ns += record.end - record.start;
+    }
+  }
   unlock();
 }
 
-inline void Profiler::increment(const std::string& key, int64_t value) {
+inline int64_t Profiler::counter(const std::string& key) {
   spin_lock();
-  counters_[key] += value;
+  drain();
+  auto it = counters_.find(key);
+  int64_t value = it == counters_.end() ? 0 : it->second;
   unlock();
+  return value;
+}
+
+inline Profiler::ThreadBuffer* Profiler::thread_buffer() {
+  // Threads mostly record to one profiler at a time
+  thread_local uint64_t last_id = 0;
+  thread_local ThreadBuffer* last_buffer = nullptr;
+  if (last_buffer != nullptr && last_id == id_) {
+    return last_buffer;
+  }
+  last_buffer = register_thread_buffer();
+  last_id = id_;
+  return last_buffer;
 }
 
-inline void Profiler::spin_lock() {
+inline void Profiler::spin_lock() const {
   while (lock_.test_and_set(std::memory_order_acquire));
 }
 
-inline void Profiler::unlock() {
+inline void Profiler::unlock() const {
   lock_.clear(std::memory_order_release);
 }
 
@@ -15,17 +15,31 @@
 
 #pragma once
 
+#include "scanner/util/common.h"
+#include "scanner/util/lockfree_queue.h"
+
 #include <atomic>
 #include <condition_variable>
 #include <deque>
+#include <memory>
 #include <mutex>
+#include <vector>
 
 namespace scanner {
 
+enum class QueueType {
+  // Deque guarded by a mutex and condition variables
+  Locked,
+  // Bounded ring buffer, see LockFreeQueue
+  LockFree,
+};
+
 template <typename T>
 class Queue {
  public:
-  Queue(int max_size = 4);
+  using const_iterator = typename std::deque<T>::const_iterator;
+
+  Queue(int max_size = 4, QueueType type = QueueType::Locked);
   Queue(Queue<T>&& o);
 
   int size();
@@ -35,10 +49,31 @@ class Queue {
 
   void push(T item);
 
+  //! Pushes every item, taking the lock once per run of items that fit in
+  //! the queue instead of once per item
+  void push_n(std::vector<T>& items);
+
+  //! Like push_n, but calls pushed() after every run of items that made it
+  //! into the queue, before blocking for more space. For consumers that
+  //! sleep on a signal of their own rather than on the queue.
+  template <typename Pushed>
+  void push_n(std::vector<T>& items, Pushed pushed);
+
   bool try_pop(T& item);
 
   void pop(T& item);
 
+  //! Blocks until at least one item is available, then appends up to n items
+  //! to items under a single lock. Returns the number of items popped.
+  int pop_up_to(std::vector<T>& items, int n);
+
+  //! Without blocking, calls count(begin, end) on the queued items and pops
+  //! the number of items from the front that it returns. Returns false if
+  //! nothing was popped. Not supported by QueueType::LockFree queues, which
+  //! cannot be inspected, so they always return false.
+  template <typename Count>
+  bool try_pop_front(std::vector<T>& items, Count count);
+
   void peek(T& item);
 
   void clear();
@@ -54,6 +89,9 @@ class Queue {
   std::deque<T> data_;
   std::atomic<int> pop_waiters_{0};
   std::atomic<int> push_waiters_{0};
+  // Set when constructed as QueueType::LockFree, in which case every call is
+  // forwarded to it
+  std::unique_ptr<LockFreeQueue<T>> lock_free_;
 };
 }
 
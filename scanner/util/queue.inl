@@ -18,15 +18,24 @@
 namespace scanner {
 
 template <typename T>
-Queue<T>::Queue(i32 max_size)
-    : max_size_(max_size) {}
+Queue<T>::Queue(i32 max_size, QueueType type)
+    : max_size_(max_size) {
+  if (type == QueueType::LockFree) {
+    lock_free_.reset(new LockFreeQueue<T>(max_size));
+  }
+}
 
 template <typename T>
 Queue<T>::Queue(Queue<T> &&o)
-    : max_size_(o.max_size_), data_(std::move(o.data_)) {}
+    : max_size_(o.max_size_),
+      data_(std::move(o.data_)),
+      lock_free_(std::move(o.lock_free_)) {}
 
 template <typename T>
 int Queue<T>::size() {
+  if (lock_free_) {
+    return lock_free_->size();
+  }
   std::unique_lock<std::mutex> lock(mutex_);
   return data_.size() - pop_waiters_ + push_waiters_;
 }
@@ -34,6 +43,10 @@ int Queue<T>::size() {
 template <typename T>
 template <typename... Args>
 void Queue<T>::emplace(Args&&... args) {
+  if (lock_free_) {
+    lock_free_->push(T(std::forward<Args>(args)...));
+    return;
+  }
   std::unique_lock<std::mutex> lock(mutex_);
   push_waiters_++;
   not_full_.wait(lock, [this]{ return data_.size() < max_size_; });
@@ -46,6 +59,10 @@ void Queue<T>::emplace(Args&&... args) {
 
 template <typename T>
 void Queue<T>::push(T item) {
+  if (lock_free_) {
+    lock_free_->push(std::move(item));
+    return;
+  }
   std::unique_lock<std::mutex> lock(mutex_);
   push_waiters_++;
   not_full_.wait(lock, [this]{ return data_.size() < max_size_; });
@@ -59,8 +76,39 @@ void Queue<T>::push(T item) {
   not_empty_.notify_one();
 }
 
+template <typename T>
+void Queue<T>::push_n(std::vector<T>& items) {
+  push_n(items, [] {});
+}
+
+template <typename T>
+template <typename Pushed>
+void Queue<T>::push_n(std::vector<T>& items, Pushed pushed_run) {
+  if (lock_free_) {
+    lock_free_->push_n(items, pushed_run);
+    return;
+  }
+  size_t pushed = 0;
+  while (pushed < items.size()) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    push_waiters_++;
+    not_full_.wait(lock, [this]{ return data_.size() < max_size_; });
+    push_waiters_--;
+
+    while (pushed < items.size() && data_.size() < max_size_) {
+      data_.push_back(std::move(items[pushed++]));
+    }
+    lock.unlock();
+    not_empty_.notify_all();
+    pushed_run();
+  }
+}
+
 template <typename T>
 bool Queue<T>::try_pop(T& item) {
+  if (lock_free_) {
+    return lock_free_->try_pop(item);
+  }
   std::unique_lock<std::mutex> lock(mutex_);
   if (data_.empty()) {
     return false;
@@ -78,6 +126,10 @@ bool Queue<T>::try_pop(T& item) {
 
 template <typename T>
 void Queue<T>::pop(T& item) {
+  if (lock_free_) {
+    lock_free_->pop(item);
+    return;
+  }
   std::unique_lock<std::mutex> lock(mutex_);
   pop_waiters_++;
   not_empty_.wait(lock, [this]{ return data_.size() > 0; });
@@ -93,8 +145,61 @@ void Queue<T>::pop(T& item) {
   not_full_.notify_one();
 }
 
+template <typename T>
+int Queue<T>::pop_up_to(std::vector<T>& items, int n) {
+  if (lock_free_) {
+    return lock_free_->pop_up_to(items, n);
+  }
+  std::unique_lock<std::mutex> lock(mutex_);
+  pop_waiters_++;
+  not_empty_.wait(lock, [this]{ return data_.size() > 0; });
+  pop_waiters_--;
+
+  int popped = 0;
+  while (popped < n && !data_.empty()) {
+    items.push_back(std::move(data_.front()));
+    data_.pop_front();
+    popped++;
+  }
+
+  lock.unlock();
+  if (size() <= 0) {
+    empty_.notify_all();
+  }
+  not_full_.notify_all();
+  return popped;
+}
+
+template <typename T>
+template <typename Count>
+bool Queue<T>::try_pop_front(std::vector<T>& items, Count count) {
+  if (lock_free_) {
+    return false;
+  }
+  std::unique_lock<std::mutex> lock(mutex_);
+  int n = count(data_.cbegin(), data_.cend());
+  if (n <= 0) {
+    return false;
+  }
+  for (int i = 0; i < n; ++i) {
+    items.push_back(std::move(data_.front()));
+    data_.pop_front();
+  }
+
+  lock.unlock();
+  if (size() <= 0) {
+    empty_.notify_all();
+  }
+  not_full_.notify_all();
+  return true;
+}
+
 template <typename T>
 void Queue<T>::peek(T& item) {
+  if (lock_free_) {
+    lock_free_->peek(item);
+    return;
+  }
   std::unique_lock<std::mutex> lock(mutex_);
   pop_waiters_++;
   not_empty_.wait(lock, [this]{ return data_.size() > 0; });
@@ -107,6 +212,10 @@ void Queue<T>::peek(T& item) {
 
 template <typename T>
 void Queue<T>::clear() {
+  if (lock_free_) {
+    lock_free_->clear();
+    return;
+  }
   std::unique_lock<std::mutex> lock(mutex_);
   data_.clear();
 
@@ -116,6 +225,10 @@ void Queue<T>::clear() {
 
 template <typename T>
 void Queue<T>::wait_until_empty() {
+  if (lock_free_) {
+    lock_free_->wait_until_empty();
+    return;
+  }
   std::unique_lock<std::mutex> lock(mutex_);
   empty_.wait(lock, [this]{ return data_.size() <= 0; });
 }
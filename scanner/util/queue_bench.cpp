@@ -0,0 +1,182 @@
+/* Copyright 2017 Carnegie Mellon University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+
+// Queue<T> microbenchmark. Producers push items that consumers pop, over
+// both queue types, a range of producer and consumer counts and queue
+// capacities, and prints the item throughput and the latency of single
+// pushes and pops:
+//
+//   QueueBench [--threads=1,2,4,8] [--capacities=4,64] [--items=1000000]
+//              [--repeat=1]
+//
+// Every thread count is used for both the producers and the consumers, so
+// --threads=1,4 runs 1x1, 1x4, 4x1 and 4x4. Latencies include time blocked
+// on a full or empty queue and are sampled every SAMPLE_PERIOD calls.
+
+#include "scanner/util/queue.h"
+#include "scanner/util/util.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <sstream>
+#include <thread>
+
+namespace scanner {
+namespace {
+
+const i32 SAMPLE_PERIOD = 16;
+
+struct Latencies {
+  std::vector<double> samples;
+
+  void merge(const Latencies& other) {
+    samples.insert(samples.end(), other.samples.begin(), other.samples.end());
+  }
+
+  double percentile(double p) {
+    if (samples.empty()) {
+      return 0;
+    }
+    std::sort(samples.begin(), samples.end());
+    size_t rank = std::min(samples.size() - 1,
+                           static_cast<size_t>(p * samples.size()));
+    return samples[rank];
+  }
+};
+
+std::vector<i64> parse_list(const std::string& s) {
+  std::vector<i64> values;
+  std::stringstream ss(s);
+  std::string item;
+  while (std::getline(ss, item, ',')) {
+    values.push_back(std::atoll(item.c_str()));
+  }
+  return values;
+}
+
+void producer(Queue<i64>& queue, i64 items, Latencies& latencies) {
+  for (i64 i = 0; i < items; ++i) {
+    if (i % SAMPLE_PERIOD == 0) {
+      auto start = now();
+      queue.push(i);
+      latencies.samples.push_back(nano_since(start));
+    } else {
+      queue.push(i);
+    }
+  }
+}
+
+// Pops until it sees a negative item
+void consumer(Queue<i64>& queue, Latencies& latencies) {
+  for (i64 i = 0;; ++i) {
+    i64 item;
+    if (i % SAMPLE_PERIOD == 0) {
+      auto start = now();
+      queue.pop(item);
+      latencies.samples.push_back(nano_since(start));
+    } else {
+      queue.pop(item);
+    }
+    if (item < 0) {
+      break;
+    }
+  }
+}
+
+}  // namespace
+
+int bench_main(int argc, char** argv) {
+  std::vector<i64> threads = {1, 2, 4, 8};
+  std::vector<i64> capacities = {4, 64};
+  i64 items = 1000000;
+  i32 repeat = 1;
+  for (int i = 1; i < argc; ++i) {
+    std::string arg(argv[i]);
+    std::string key = arg.substr(0, arg.find('='));
+    std::string value =
+        arg.find('=') == std::string::npos ? "" : arg.substr(arg.find('=') + 1);
+    if (key == "--threads") {
+      threads = parse_list(value);
+    } else if (key == "--capacities") {
+      capacities = parse_list(value);
+    } else if (key == "--items") {
+      items = std::atoll(value.c_str());
+    } else if (key == "--repeat") {
+      repeat = std::atoi(value.c_str());
+    } else {
+      fprintf(stderr, "Unknown argument %s\n", arg.c_str());
+      return 1;
+    }
+  }
+
+  printf("%-9s %8s %9s %9s %12s %9s %9s %9s %9s\n", "queue", "capacity",
+         "producers", "consumers", "items/s", "push_p50", "push_p99",
+         "pop_p50", "pop_p99");
+  for (QueueType type : {QueueType::Locked, QueueType::LockFree}) {
+    for (i64 capacity : capacities) {
+      for (i64 producers : threads) {
+        for (i64 consumers : threads) {
+          for (i32 r = 0; r < repeat; ++r) {
+            Queue<i64> queue(capacity, type);
+            std::vector<Latencies> pushes(producers);
+            std::vector<Latencies> pops(consumers);
+            i64 per_producer = items / producers;
+            auto start = now();
+            std::vector<std::thread> consumer_threads;
+            for (i32 c = 0; c < consumers; ++c) {
+              consumer_threads.emplace_back(consumer, std::ref(queue),
+                                            std::ref(pops[c]));
+            }
+            std::vector<std::thread> producer_threads;
+            for (i32 p = 0; p < producers; ++p) {
+              producer_threads.emplace_back(producer, std::ref(queue),
+                                            per_producer,
+                                            std::ref(pushes[p]));
+            }
+            for (std::thread& t : producer_threads) {
+              t.join();
+            }
+            for (i32 c = 0; c < consumers; ++c) {
+              queue.push(-1);
+            }
+            for (std::thread& t : consumer_threads) {
+              t.join();
+            }
+            double seconds = nano_since(start) / 1e9;
+            for (i32 p = 1; p < producers; ++p) {
+              pushes[0].merge(pushes[p]);
+            }
+            for (i32 c = 1; c < consumers; ++c) {
+              pops[0].merge(pops[c]);
+            }
+            printf("%-9s %8ld %9ld %9ld %12.0f %9.0f %9.0f %9.0f %9.0f\n",
+                   type == QueueType::Locked ? "locked" : "lock_free",
+                   capacity, producers, consumers,
+                   per_producer * producers / seconds,
+                   pushes[0].percentile(0.5), pushes[0].percentile(0.99),
+                   pops[0].percentile(0.5), pops[0].percentile(0.99));
+          }
+        }
+      }
+    }
+  }
+  return 0;
+}
+}
+
+int main(int argc, char** argv) { return scanner::bench_main(argc, argv); }
@@ -0,0 +1,66 @@
+/* Copyright 2017 Carnegie Mellon University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+namespace scanner {
+
+// Double-ended window over a single contiguous array. Elements are pushed at
+// the back and retired from the front without moving the others, and
+// indexing is one add and mask. The capacity is a power of two chosen up
+// front; it only grows, by doubling, if more elements are held at once.
+template <typename T>
+class RingBuffer {
+ public:
+  RingBuffer(size_t capacity = 16);
+
+  size_t size() const { return size_; }
+
+  bool empty() const { return size_ == 0; }
+
+  size_t capacity() const { return slots_.size(); }
+
+  //! Grows the buffer so it can hold at least capacity elements
+  void reserve(size_t capacity);
+
+  void push_back(const T& item);
+
+  void pop_front();
+
+  void pop_back();
+
+  T& front() { return (*this)[0]; }
+
+  T& back() { return (*this)[size_ - 1]; }
+
+  //! i counts from the front
+  T& operator[](size_t i) { return slots_[(head_ + i) & mask_]; }
+
+  const T& operator[](size_t i) const { return slots_[(head_ + i) & mask_]; }
+
+  void clear();
+
+ private:
+  std::vector<T> slots_;
+  size_t mask_;
+  size_t head_;
+  size_t size_;
+};
+}
+
+#include "ring_buffer.inl"
@@ -0,0 +1,83 @@
+/* Copyright 2017 Carnegie Mellon University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "ring_buffer.h"
+
+#include <cassert>
+#include <utility>
+
+namespace scanner {
+
+template <typename T>
+RingBuffer<T>::RingBuffer(size_t capacity) : mask_(0), head_(0), size_(0) {
+  size_t slots = 1;
+  while (slots < capacity) {
+    slots <<= 1;
+  }
+  slots_.resize(slots);
+  mask_ = slots - 1;
+}
+
+template <typename T>
+void RingBuffer<T>::reserve(size_t capacity) {
+  if (capacity <= slots_.size()) {
+    return;
+  }
+  size_t slots = slots_.size();
+  while (slots < capacity) {
+    slots <<= 1;
+  }
+  // Unwrap the live elements to the start of the new array
+  std::vector<T> new_slots(slots);
+  for (size_t i = 0; i < size_; ++i) {
+    new_slots[i] = std::move((*this)[i]);
+  }
+  slots_.swap(new_slots);
+  mask_ = slots - 1;
+  head_ = 0;
+}
+
+template <typename T>
+void RingBuffer<T>::push_back(const T& item) {
+  if (size_ == slots_.size()) {
+    reserve(size_ * 2);
+  }
+  slots_[(head_ + size_) & mask_] = item;
+  size_++;
+}
+
+template <typename T>
+void RingBuffer<T>::pop_front() {
+  assert(size_ > 0);
+  slots_[head_] = T();
+  head_ = (head_ + 1) & mask_;
+  size_--;
+}
+
+template <typename T>
+void RingBuffer<T>::pop_back() {
+  assert(size_ > 0);
+  size_--;
+  slots_[(head_ + size_) & mask_] = T();
+}
+
+template <typename T>
+void RingBuffer<T>::clear() {
+  while (size_ > 0) {
+    pop_back();
+  }
+  head_ = 0;
+}
+}
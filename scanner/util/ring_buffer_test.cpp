@@ -0,0 +1,104 @@
+/* Copyright 2017 Carnegie Mellon University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "scanner/util/ring_buffer.h"
+
+#include <gtest/gtest.h>
+
+#include <deque>
+#include <random>
+
+namespace scanner {
+
+TEST(RingBuffer, RoundsCapacityToPowerOfTwo) {
+  EXPECT_EQ(RingBuffer<int>(0).capacity(), 1);
+  EXPECT_EQ(RingBuffer<int>(5).capacity(), 8);
+  EXPECT_EQ(RingBuffer<int>(16).capacity(), 16);
+  RingBuffer<int> buffer(4);
+  buffer.reserve(3);
+  EXPECT_EQ(buffer.capacity(), 4);
+  buffer.reserve(9);
+  EXPECT_EQ(buffer.capacity(), 16);
+}
+
+TEST(RingBuffer, GrowsWhileWrapped) {
+  RingBuffer<int> buffer(4);
+  // Move the head to the middle so the live elements wrap around the end
+  for (int i = 0; i < 3; ++i) {
+    buffer.push_back(-1);
+    buffer.pop_front();
+  }
+  for (int i = 0; i < 4; ++i) {
+    buffer.push_back(i);
+  }
+  EXPECT_EQ(buffer.capacity(), 4);
+  // Doubles, unwrapping the elements in order
+  buffer.push_back(4);
+  EXPECT_EQ(buffer.capacity(), 8);
+  ASSERT_EQ(buffer.size(), 5);
+  for (int i = 0; i < 5; ++i) {
+    EXPECT_EQ(buffer[i], i);
+  }
+  EXPECT_EQ(buffer.front(), 0);
+  EXPECT_EQ(buffer.back(), 4);
+}
+
+TEST(RingBuffer, MatchesDeque) {
+  std::mt19937 rng(7);
+  std::uniform_int_distribution<int> op(0, 9);
+  RingBuffer<int> buffer(2);
+  std::deque<int> expected;
+  for (int i = 0; i < 20000; ++i) {
+    int o = op(rng);
+    if (o < 5 || expected.empty()) {
+      buffer.push_back(i);
+      expected.push_back(i);
+    } else if (o < 8) {
+      buffer.pop_front();
+      expected.pop_front();
+    } else if (o < 9) {
+      buffer.pop_back();
+      expected.pop_back();
+    } else {
+      buffer[expected.size() / 2] = -i;
+      expected[expected.size() / 2] = -i;
+    }
+    ASSERT_EQ(buffer.size(), expected.size());
+    ASSERT_EQ(buffer.empty(), expected.empty());
+    if (!expected.empty()) {
+      ASSERT_EQ(buffer.front(), expected.front());
+      ASSERT_EQ(buffer.back(), expected.back());
+    }
+  }
+  for (size_t i = 0; i < expected.size(); ++i) {
+    EXPECT_EQ(buffer[i], expected[i]);
+  }
+}
+
+TEST(RingBuffer, ClearKeepsCapacity) {
+  RingBuffer<std::vector<int>> buffer(2);
+  for (int i = 0; i < 10; ++i) {
+    buffer.push_back(std::vector<int>(3, i));
+  }
+  size_t capacity = buffer.capacity();
+  buffer.clear();
+  EXPECT_TRUE(buffer.empty());
+  EXPECT_EQ(buffer.capacity(), capacity);
+  buffer.push_back({1, 2});
+  EXPECT_EQ(buffer.size(), 1);
+  EXPECT_EQ(buffer.front(), std::vector<int>({1, 2}));
+}
+}
@@ -0,0 +1,106 @@
+/* Copyright 2017 Carnegie Mellon University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "scanner/util/row_set.h"
+
+#include <algorithm>
+
+namespace scanner {
+
+RowSet::RowSet(const std::vector<i64>& unsorted_rows) {
+  if (unsorted_rows.empty()) {
+    return;
+  }
+  // Task streams are sorted already except for some sampler outputs, so
+  // only copy when needed
+  std::vector<i64> sorted_rows;
+  if (!std::is_sorted(unsorted_rows.begin(), unsorted_rows.end())) {
+    sorted_rows = unsorted_rows;
+    std::sort(sorted_rows.begin(), sorted_rows.end());
+  }
+  const std::vector<i64>& rows =
+      sorted_rows.empty() ? unsorted_rows : sorted_rows;
+  // Count the ranges first so the cheaper representation can be picked
+  // without building both
+  size_t num_ranges = 1;
+  for (size_t i = 1; i < rows.size(); ++i) {
+    if (rows[i] > rows[i - 1] + 1) {
+      num_ranges++;
+    }
+  }
+  first_row_ = rows.front();
+  u64 span = rows.back() - first_row_ + 1;
+  size_t bitmap_words = (span + 63) / 64;
+  use_bitmap_ = bitmap_words * sizeof(u64) <
+                num_ranges * sizeof(std::tuple<i64, i64>);
+
+  if (use_bitmap_) {
+    bitmap_.assign(bitmap_words, 0);
+    for (i64 row : rows) {
+      u64 bit = row - first_row_;
+      u64 mask = (u64)1 << (bit % 64);
+      if ((bitmap_[bit / 64] & mask) == 0) {
+        bitmap_[bit / 64] |= mask;
+        size_++;
+      }
+    }
+  } else {
+    ranges_.reserve(num_ranges);
+    i64 start = rows.front();
+    i64 end = start + 1;
+    for (size_t i = 1; i < rows.size(); ++i) {
+      if (rows[i] < end) {
+        continue;
+      }
+      if (rows[i] > end) {
+        ranges_.emplace_back(start, end);
+        size_ += end - start;
+        start = rows[i];
+      }
+      end = rows[i] + 1;
+    }
+    ranges_.emplace_back(start, end);
+    size_ += end - start;
+  }
+}
+
+bool RowSet::contains(i64 row) const {
+  if (use_bitmap_) {
+    if (row < first_row_ || row - first_row_ >= (i64)bitmap_.size() * 64) {
+      return false;
+    }
+    u64 bit = row - first_row_;
+    return (bitmap_[bit / 64] >> (bit % 64)) & 1;
+  }
+  // First range that ends after row
+  auto it = std::upper_bound(
+      ranges_.begin(), ranges_.end(), row,
+      [](i64 r, const std::tuple<i64, i64>& range) {
+        return r < std::get<1>(range);
+      });
+  return it != ranges_.end() && std::get<0>(*it) <= row;
+}
+
+bool RowSet::Cursor::contains(i64 row) {
+  if (set_->use_bitmap_) {
+    return set_->contains(row);
+  }
+  const auto& ranges = set_->ranges_;
+  while (range_ < ranges.size() && std::get<1>(ranges[range_]) <= row) {
+    range_++;
+  }
+  return range_ < ranges.size() && std::get<0>(ranges[range_]) <= row;
+}
+}
@@ -0,0 +1,67 @@
+/* Copyright 2017 Carnegie Mellon University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include "scanner/util/common.h"
+
+#include <tuple>
+#include <vector>
+
+namespace scanner {
+
+// Immutable set of row ids built from a row list. Contiguous rows are
+// stored as [start, end) ranges; when the rows are too scattered for that to
+// be smaller, they are stored as a bitmap over [first row, last row] instead.
+// Either way the set is a couple of flat arrays, so building one does not
+// allocate per row and lookups do not chase pointers.
+class RowSet {
+ public:
+  RowSet() = default;
+
+  //! Duplicates are ignored
+  explicit RowSet(const std::vector<i64>& rows);
+
+  bool contains(i64 row) const;
+
+  i64 size() const { return size_; }
+
+  bool empty() const { return size_ == 0; }
+
+  // Membership checks for rows visited in increasing order. Each check only
+  // moves forward through the ranges, so walking n sorted rows costs
+  // O(n + ranges) instead of a binary search per row.
+  class Cursor {
+   public:
+    explicit Cursor(const RowSet& set) : set_(&set), range_(0) {}
+
+    //! row must not be less than the row passed to the previous call
+    bool contains(i64 row);
+
+   private:
+    const RowSet* set_;
+    size_t range_;
+  };
+
+ private:
+  i64 size_ = 0;
+  // Used when the rows collapse into few enough ranges
+  std::vector<std::tuple<i64, i64>> ranges_;
+  // Otherwise, one bit per row starting at first_row_
+  bool use_bitmap_ = false;
+  i64 first_row_ = 0;
+  std::vector<u64> bitmap_;
+};
+}
@@ -0,0 +1,138 @@
+/* Copyright 2017 Carnegie Mellon University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "scanner/util/row_set.h"
+
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <random>
+#include <set>
+
+namespace scanner {
+namespace {
+// Checks set against the rows it was built from over [lo, hi), both with
+// lookups and with a cursor walking the rows in order
+void expect_same_rows(const std::vector<i64>& rows, i64 lo, i64 hi) {
+  RowSet set(rows);
+  std::set<i64> expected(rows.begin(), rows.end());
+  EXPECT_EQ(set.size(), (i64)expected.size());
+  EXPECT_EQ(set.empty(), expected.empty());
+  RowSet::Cursor cursor(set);
+  for (i64 r = lo; r < hi; ++r) {
+    bool in = expected.count(r) > 0;
+    ASSERT_EQ(set.contains(r), in) << "row " << r;
+    ASSERT_EQ(cursor.contains(r), in) << "row " << r;
+  }
+}
+}
+
+TEST(RowSet, Empty) {
+  RowSet set(std::vector<i64>{});
+  EXPECT_TRUE(set.empty());
+  EXPECT_EQ(set.size(), 0);
+  EXPECT_FALSE(set.contains(0));
+  RowSet::Cursor cursor(set);
+  EXPECT_FALSE(cursor.contains(0));
+  EXPECT_TRUE(RowSet().empty());
+}
+
+TEST(RowSet, ContiguousRanges) {
+  std::vector<i64> rows;
+  for (i64 r = 100; r < 200; ++r) {
+    rows.push_back(r);
+  }
+  for (i64 r = 1000; r < 1010; ++r) {
+    rows.push_back(r);
+  }
+  expect_same_rows(rows, 0, 1100);
+}
+
+TEST(RowSet, ScatteredRows) {
+  // Every other row gives a range per row, so the set switches to a bitmap
+  std::vector<i64> rows;
+  for (i64 r = 5; r < 1000; r += 2) {
+    rows.push_back(r);
+  }
+  expect_same_rows(rows, 0, 1100);
+}
+
+TEST(RowSet, DuplicatesAreCountedOnce) {
+  expect_same_rows({3, 3, 4, 4, 4, 5, 9, 9}, 0, 20);
+  std::vector<i64> scattered;
+  for (i64 r = 0; r < 200; r += 3) {
+    scattered.push_back(r);
+    scattered.push_back(r);
+  }
+  expect_same_rows(scattered, 0, 210);
+}
+
+TEST(RowSet, UnsortedRows) {
+  expect_same_rows({50, 10, 11, 49, 12, 48, 10}, 0, 60);
+  std::vector<i64> rows;
+  for (i64 r = 0; r < 500; r += 2) {
+    rows.push_back(498 - r);
+  }
+  expect_same_rows(rows, 0, 510);
+}
+
+TEST(RowSet, NegativeRows) {
+  expect_same_rows({-10, -9, -8, -1, 0}, -20, 5);
+  std::vector<i64> rows;
+  for (i64 r = -300; r < 300; r += 4) {
+    rows.push_back(r);
+  }
+  expect_same_rows(rows, -310, 310);
+}
+
+TEST(RowSet, RandomDensities) {
+  // Densities on both sides of where ranges and bitmaps cost the same
+  std::mt19937 rng(42);
+  for (double density : {0.01, 0.1, 0.3, 0.5, 0.7, 0.95, 1.0}) {
+    std::bernoulli_distribution keep(density);
+    std::vector<i64> rows;
+    for (i64 r = 0; r < 4000; ++r) {
+      if (keep(rng)) {
+        rows.push_back(r);
+      }
+    }
+    std::shuffle(rows.begin(), rows.end(), rng);
+    SCOPED_TRACE(density);
+    expect_same_rows(rows, -10, 4010);
+  }
+}
+
+TEST(RowSet, CursorSkipsAndRepeats) {
+  std::vector<i64> rows;
+  for (i64 r = 0; r < 1000; ++r) {
+    if (r % 100 < 10) {
+      rows.push_back(r);
+    }
+  }
+  RowSet set(rows);
+  // Steps over whole ranges at once, and may check the same row again
+  RowSet::Cursor cursor(set);
+  EXPECT_TRUE(cursor.contains(5));
+  EXPECT_TRUE(cursor.contains(5));
+  EXPECT_FALSE(cursor.contains(50));
+  EXPECT_TRUE(cursor.contains(301));
+  EXPECT_FALSE(cursor.contains(310));
+  EXPECT_TRUE(cursor.contains(909));
+  EXPECT_FALSE(cursor.contains(910));
+  EXPECT_FALSE(cursor.contains(5000));
+  EXPECT_FALSE(cursor.contains(5000));
+}
+}
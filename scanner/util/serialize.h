@@ -18,7 +18,9 @@
 #include "scanner/types.pb.h"
 #include "scanner/util/memory.h"
 
+#include <cassert>
 #include <cstddef>
+#include <cstring>
 #include <vector>
 
 namespace scanner {
@@ -35,10 +37,9 @@ inline T deser(const u8*& buffer, size_t& size_left) {
 
 template <typename T>
 void serialize_proto(const T& element, u8*& buffer, size_t& size) {
-  size_t element_size = element.ByteSizeLong();
+  size = element.ByteSizeLong();
   buffer = new_buffer(CPU_DEVICE, size);
-  size = element_size;
-  element.SerializeToArray(buffer, element_size);
+  element.SerializeToArray(buffer, size);
 }
 
 template <typename T>
@@ -117,16 +118,174 @@ std::vector<T> deserialize_proto_vector(const u8* buffer, size_t size) {
   return elements;
 }
 
+// Fixed layout box lists and feature vectors. Elements start with a
+// FlatHeader followed by fixed size records, so consumers read them in place
+// instead of parsing and allocating a protobuf per box. The magic numbers
+// tell them apart from the length prefixed protobuf lists written before,
+// whose leading element count can not plausibly match them.
+constexpr u32 FLAT_BBOX_MAGIC = 0x31584253;      // "SBX1"
+constexpr u32 FLAT_FEATURES_MAGIC = 0x31564653;  // "SFV1"
+
+struct FlatHeader {
+  u32 magic;
+  u32 count;
+};
+
+// Same fields as the BoundingBox protobuf
+struct FlatBoundingBox {
+  f32 x1;
+  f32 y1;
+  f32 x2;
+  f32 y2;
+  f32 score;
+  i32 track_id;
+  f64 track_score;
+  i32 label;
+  i32 padding;
+};
+static_assert(sizeof(FlatHeader) == 8, "FlatHeader must be packed");
+static_assert(sizeof(FlatBoundingBox) == 40,
+              "FlatBoundingBox layout is part of the column format");
+
+inline FlatBoundingBox to_flat_bbox(const BoundingBox& bbox) {
+  FlatBoundingBox flat = {};
+  flat.x1 = bbox.x1();
+  flat.y1 = bbox.y1();
+  flat.x2 = bbox.x2();
+  flat.y2 = bbox.y2();
+  flat.score = bbox.score();
+  flat.track_id = bbox.track_id();
+  flat.track_score = bbox.track_score();
+  flat.label = bbox.label();
+  return flat;
+}
+
+inline BoundingBox from_flat_bbox(const FlatBoundingBox& flat) {
+  BoundingBox bbox;
+  bbox.set_x1(flat.x1);
+  bbox.set_y1(flat.y1);
+  bbox.set_x2(flat.x2);
+  bbox.set_y2(flat.y2);
+  bbox.set_score(flat.score);
+  bbox.set_track_id(flat.track_id);
+  bbox.set_track_score(flat.track_score);
+  bbox.set_label(flat.label);
+  return bbox;
+}
+
+inline bool is_flat_element(const u8* buffer, size_t size, u32 magic) {
+  return size >= sizeof(FlatHeader) &&
+         reinterpret_cast<const FlatHeader*>(buffer)->magic == magic;
+}
+
+inline void serialize_flat_bboxes(const FlatBoundingBox* bboxes, size_t count,
+                                  u8*& buffer, size_t& size) {
+  size = sizeof(FlatHeader) + count * sizeof(FlatBoundingBox);
+  buffer = new_buffer(CPU_DEVICE, size);
+  FlatHeader* header = reinterpret_cast<FlatHeader*>(buffer);
+  header->magic = FLAT_BBOX_MAGIC;
+  header->count = count;
+  std::memcpy(buffer + sizeof(FlatHeader), bboxes,
+              count * sizeof(FlatBoundingBox));
+}
+
 inline void serialize_bbox_vector(const std::vector<BoundingBox>& bboxes,
                                   u8*& buffer, size_t& size) {
-  serialize_proto_vector(bboxes, buffer, size);
+  std::vector<FlatBoundingBox> flat(bboxes.size());
+  for (size_t i = 0; i < bboxes.size(); ++i) {
+    flat[i] = to_flat_bbox(bboxes[i]);
+  }
+  serialize_flat_bboxes(flat.data(), flat.size(), buffer, size);
 }
 
+// Box list element read without copying. Only elements written before the
+// flat format existed are parsed, into boxes owned by the list.
+class FlatBoxList {
+ public:
+  FlatBoxList(const u8* buffer, size_t size) {
+    if (is_flat_element(buffer, size, FLAT_BBOX_MAGIC)) {
+      count_ = reinterpret_cast<const FlatHeader*>(buffer)->count;
+      assert(size >= sizeof(FlatHeader) + count_ * sizeof(FlatBoundingBox));
+      boxes_ = reinterpret_cast<const FlatBoundingBox*>(
+          buffer + sizeof(FlatHeader));
+    } else {
+      for (auto& bbox : deserialize_proto_vector<BoundingBox>(buffer, size)) {
+        parsed_.push_back(to_flat_bbox(bbox));
+      }
+      count_ = parsed_.size();
+      boxes_ = parsed_.data();
+    }
+  }
+
+  size_t size() const { return count_; }
+
+  const FlatBoundingBox& operator[](size_t i) const { return boxes_[i]; }
+
+  const FlatBoundingBox* begin() const { return boxes_; }
+
+  const FlatBoundingBox* end() const { return boxes_ + count_; }
+
+ private:
+  const FlatBoundingBox* boxes_ = nullptr;
+  size_t count_ = 0;
+  std::vector<FlatBoundingBox> parsed_;
+};
+
 inline std::vector<BoundingBox> deserialize_bbox_vector(const u8* buffer,
                                                          size_t size) {
-  return deserialize_proto_vector<BoundingBox>(buffer, size);
+  std::vector<BoundingBox> bboxes;
+  for (const FlatBoundingBox& flat : FlatBoxList(buffer, size)) {
+    bboxes.push_back(from_flat_bbox(flat));
+  }
+  return bboxes;
+}
+
+//! Writes count row-major f32 vectors of dims values each
+inline void serialize_feature_vectors(const f32* features, u32 count,
+                                      u32 dims, u8*& buffer, size_t& size) {
+  size = sizeof(FlatHeader) + sizeof(u32) * 2 +
+         sizeof(f32) * (size_t)count * dims;
+  buffer = new_buffer(CPU_DEVICE, size);
+  FlatHeader* header = reinterpret_cast<FlatHeader*>(buffer);
+  header->magic = FLAT_FEATURES_MAGIC;
+  header->count = count;
+  u32* shape = reinterpret_cast<u32*>(buffer + sizeof(FlatHeader));
+  shape[0] = dims;
+  shape[1] = 0;
+  std::memcpy(buffer + sizeof(FlatHeader) + sizeof(u32) * 2, features,
+              sizeof(f32) * (size_t)count * dims);
 }
 
+// Feature vector element read in place. Elements without a header are taken
+// as a single vector of raw f32 values.
+class FlatFeatures {
+ public:
+  FlatFeatures(const u8* buffer, size_t size) {
+    if (is_flat_element(buffer, size, FLAT_FEATURES_MAGIC)) {
+      count_ = reinterpret_cast<const FlatHeader*>(buffer)->count;
+      dims_ = reinterpret_cast<const u32*>(buffer + sizeof(FlatHeader))[0];
+      data_ = reinterpret_cast<const f32*>(buffer + sizeof(FlatHeader) +
+                                           sizeof(u32) * 2);
+    } else {
+      count_ = 1;
+      dims_ = size / sizeof(f32);
+      data_ = reinterpret_cast<const f32*>(buffer);
+    }
+  }
+
+  u32 count() const { return count_; }
+
+  u32 dims() const { return dims_; }
+
+  //! The dims values of vector i
+  const f32* operator[](u32 i) const { return data_ + (size_t)i * dims_; }
+
+ private:
+  const f32* data_;
+  u32 count_;
+  u32 dims_;
+};
+
 // inline void serialize_decode_args(const DecodeArgs& args, u8*& buffer,
 //                                   size_t& size) {
 //   size = args.ByteSize();
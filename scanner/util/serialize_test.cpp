@@ -0,0 +1,138 @@
+/* Copyright 2017 Carnegie Mellon University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "scanner/util/serialize.h"
+
+#include <gtest/gtest.h>
+
+namespace scanner {
+namespace {
+class SerializeTest : public ::testing::Test {
+ protected:
+  void SetUp() override { init_memory_allocators(MemoryPoolConfig(), {}); }
+
+  void TearDown() override { destroy_memory_allocators(); }
+};
+
+std::vector<BoundingBox> make_bboxes(i32 count) {
+  std::vector<BoundingBox> bboxes;
+  for (i32 i = 0; i < count; ++i) {
+    BoundingBox bbox;
+    bbox.set_x1(i + 0.5f);
+    bbox.set_y1(i * 2.0f);
+    bbox.set_x2(i + 10.25f);
+    bbox.set_y2(i * 2.0f + 20);
+    bbox.set_score(1.0f / (i + 1));
+    bbox.set_track_id(i - 1);
+    bbox.set_track_score(0.125 * i);
+    bbox.set_label(100 + i);
+    bboxes.push_back(bbox);
+  }
+  return bboxes;
+}
+
+void expect_same_bbox(const BoundingBox& expected,
+                      const FlatBoundingBox& flat) {
+  EXPECT_EQ(flat.x1, expected.x1());
+  EXPECT_EQ(flat.y1, expected.y1());
+  EXPECT_EQ(flat.x2, expected.x2());
+  EXPECT_EQ(flat.y2, expected.y2());
+  EXPECT_EQ(flat.score, expected.score());
+  EXPECT_EQ(flat.track_id, expected.track_id());
+  EXPECT_EQ(flat.track_score, expected.track_score());
+  EXPECT_EQ(flat.label, expected.label());
+}
+
+void expect_same_bboxes(const std::vector<BoundingBox>& expected,
+                        const u8* buffer, size_t size) {
+  FlatBoxList list(buffer, size);
+  ASSERT_EQ(list.size(), expected.size());
+  for (size_t i = 0; i < expected.size(); ++i) {
+    expect_same_bbox(expected[i], list[i]);
+  }
+  std::vector<BoundingBox> parsed = deserialize_bbox_vector(buffer, size);
+  ASSERT_EQ(parsed.size(), expected.size());
+  for (size_t i = 0; i < expected.size(); ++i) {
+    EXPECT_EQ(parsed[i].SerializeAsString(), expected[i].SerializeAsString());
+  }
+}
+}
+
+TEST_F(SerializeTest, FlatBoxes) {
+  for (i32 count : {0, 1, 7}) {
+    std::vector<BoundingBox> bboxes = make_bboxes(count);
+    u8* buffer;
+    size_t size;
+    serialize_bbox_vector(bboxes, buffer, size);
+    ASSERT_EQ(size, sizeof(FlatHeader) + count * sizeof(FlatBoundingBox));
+    EXPECT_TRUE(is_flat_element(buffer, size, FLAT_BBOX_MAGIC));
+    expect_same_bboxes(bboxes, buffer, size);
+    // Viewed in place rather than copied
+    if (count > 0) {
+      EXPECT_EQ(reinterpret_cast<const u8*>(FlatBoxList(buffer, size).begin()),
+                buffer + sizeof(FlatHeader));
+    }
+    delete_buffer(CPU_DEVICE, buffer);
+  }
+}
+
+TEST_F(SerializeTest, LengthPrefixedBoxes) {
+  for (i32 count : {0, 1, 7}) {
+    std::vector<BoundingBox> bboxes = make_bboxes(count);
+    u8* buffer;
+    size_t size;
+    serialize_proto_vector(bboxes, buffer, size);
+    EXPECT_FALSE(is_flat_element(buffer, size, FLAT_BBOX_MAGIC));
+    expect_same_bboxes(bboxes, buffer, size);
+    delete_buffer(CPU_DEVICE, buffer);
+  }
+}
+
+TEST_F(SerializeTest, FlatFeatures) {
+  const u32 count = 3;
+  const u32 dims = 5;
+  std::vector<f32> features(count * dims);
+  for (size_t i = 0; i < features.size(); ++i) {
+    features[i] = i * 0.5f - 2;
+  }
+  u8* buffer;
+  size_t size;
+  serialize_feature_vectors(features.data(), count, dims, buffer, size);
+  EXPECT_TRUE(is_flat_element(buffer, size, FLAT_FEATURES_MAGIC));
+  FlatFeatures flat(buffer, size);
+  ASSERT_EQ(flat.count(), count);
+  ASSERT_EQ(flat.dims(), dims);
+  for (u32 i = 0; i < count; ++i) {
+    for (u32 j = 0; j < dims; ++j) {
+      EXPECT_EQ(flat[i][j], features[i * dims + j]);
+    }
+  }
+  delete_buffer(CPU_DEVICE, buffer);
+}
+
+TEST_F(SerializeTest, RawFeatures) {
+  std::vector<f32> features = {1.5f, -2.0f, 0.0f, 42.0f};
+  const u8* buffer = reinterpret_cast<const u8*>(features.data());
+  size_t size = features.size() * sizeof(f32);
+  EXPECT_FALSE(is_flat_element(buffer, size, FLAT_FEATURES_MAGIC));
+  FlatFeatures flat(buffer, size);
+  ASSERT_EQ(flat.count(), 1);
+  ASSERT_EQ(flat.dims(), features.size());
+  for (size_t j = 0; j < features.size(); ++j) {
+    EXPECT_EQ(flat[0][j], features[j]);
+  }
+}
+}
@@ -18,8 +18,12 @@
 #include "scanner/util/common.h"
 #include "storehouse/storage_backend.h"
 
+#include <sys/stat.h>
 #include <cassert>
+#include <cstdio>
+#include <memory>
 #include <string>
+#include <vector>
 
 namespace scanner {
 
@@ -40,6 +44,54 @@ inline void s_write(storehouse::WriteFile* file, const std::string& s) {
   s_write(file, reinterpret_cast<const u8*>(s.c_str()), s.size() + 1);
 }
 
+// Combines small appends to a file into few large ones. Appends are staged
+// in memory and written out once flush_threshold bytes are staged; appends
+// at least that large go straight to the file. Anything staged is written
+// by flush, which must be called before the file is used directly or saved.
+class BufferedWriteFile {
+ public:
+  BufferedWriteFile(storehouse::WriteFile* file, size_t flush_threshold)
+    : file_(file), flush_threshold_(flush_threshold) {
+    staging_.reserve(flush_threshold);
+  }
+
+  ~BufferedWriteFile() { flush(); }
+
+  void append(const u8* buffer, size_t size) {
+    if (size >= flush_threshold_) {
+      flush();
+      s_write(file_, buffer, size);
+      return;
+    }
+    staging_.insert(staging_.end(), buffer, buffer + size);
+    if (staging_.size() >= flush_threshold_) {
+      flush();
+    }
+  }
+
+  template <typename T>
+  void append(const T& value) {
+    append(reinterpret_cast<const u8*>(&value), sizeof(T));
+  }
+
+  void flush() {
+    if (!staging_.empty()) {
+      s_write(file_, staging_.data(), staging_.size());
+      staging_.clear();
+    }
+  }
+
+  //! Drops the bytes not yet written, so nothing reaches the file
+  void discard() { staging_.clear(); }
+
+  storehouse::WriteFile* file() { return file_; }
+
+ private:
+  storehouse::WriteFile* file_;
+  size_t flush_threshold_;
+  std::vector<u8> staging_;
+};
+
 inline void s_read(storehouse::RandomReadFile* file, u8* buffer, size_t size,
                    u64& pos) {
   VLOG(1) << "Reading " << file->path() << " (size " << size << ", pos " << pos
@@ -91,4 +143,26 @@ inline std::string s_read(storehouse::RandomReadFile* file, u64& pos) {
   pos += var.size() + 1;
   return var;
 }
+
+//! Moves a saved file to another path. Storehouse has no rename, so files
+//! on the local file system are renamed and others are copied and deleted.
+inline void move_file(storehouse::StorageBackend* storage,
+                      const std::string& from, const std::string& to) {
+  struct stat from_stat;
+  if (!from.empty() && from[0] == '/' &&
+      stat(from.c_str(), &from_stat) == 0) {
+    PLOG_IF(FATAL, std::rename(from.c_str(), to.c_str()) != 0)
+        << "Could not move " << from << " to " << to;
+    return;
+  }
+  std::unique_ptr<storehouse::RandomReadFile> input;
+  BACKOFF_FAIL(make_unique_random_read_file(storage, from, input));
+  u64 pos = 0;
+  std::vector<u8> data = storehouse::read_entire_file(input.get(), pos);
+  std::unique_ptr<storehouse::WriteFile> output;
+  BACKOFF_FAIL(make_unique_write_file(storage, to, output));
+  s_write(output.get(), data.data(), data.size());
+  BACKOFF_FAIL(output->save());
+  BACKOFF_FAIL(storage->delete_file(from));
+}
 }
@@ -0,0 +1,171 @@
+/* Copyright 2017 Carnegie Mellon University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#pragma once
+
+#include "scanner/metadata.pb.h"
+#include "scanner/util/common.h"
+#include "scanner/util/memory.h"
+
+#include <cstring>
+#include <vector>
+
+namespace scanner {
+namespace internal {
+
+// Decode arguments of one keyframe interval as they are handed from the load
+// worker to the decoder: this header followed by the keyframes, keyframe byte
+// offsets, valid frames and skip frames as i64 arrays, all in one buffer.
+// Unlike proto::DecodeArgs, writing one is a single allocation and reading
+// one is done in place with DecodeArgsView.
+struct DecodeArgsHeader {
+  i32 width;
+  i32 height;
+  // Size to scale frames to while decoding, zero if unscaled
+  i32 output_width;
+  i32 output_height;
+  i32 output_format;
+  i32 chroma_format;
+  i32 codec_type;
+  // Column the frames come from, for sharing decoded frames between jobs
+  i32 table_id;
+  i32 column_id;
+  i32 padding;
+  i64 start_keyframe;
+  i64 end_keyframe;
+  // Address and size of the encoded bitstream of the interval
+  i64 encoded_video;
+  i64 encoded_video_size;
+  i64 num_keyframes;
+  i64 num_keyframe_byte_offsets;
+  i64 num_valid_frames;
+  // Frames in this range which do not need to be fed to the decoder
+  i64 num_skip_frames;
+};
+
+inline u8* new_decode_args(const DecodeArgsHeader& header,
+                           const i64* keyframes,
+                           const i64* keyframe_byte_offsets,
+                           const i64* valid_frames, const i64* skip_frames,
+                           size_t& size) {
+  i64 values = header.num_keyframes + header.num_keyframe_byte_offsets +
+               header.num_valid_frames + header.num_skip_frames;
+  size = sizeof(DecodeArgsHeader) + sizeof(i64) * values;
+  u8* buffer = new_buffer(CPU_DEVICE, size);
+  std::memcpy(buffer, &header, sizeof(DecodeArgsHeader));
+  i64* out = reinterpret_cast<i64*>(buffer + sizeof(DecodeArgsHeader));
+  auto append = [&out](const i64* data, i64 count) {
+    if (count > 0) {
+      std::memcpy(out, data, sizeof(i64) * count);
+      out += count;
+    }
+  };
+  append(keyframes, header.num_keyframes);
+  append(keyframe_byte_offsets, header.num_keyframe_byte_offsets);
+  append(valid_frames, header.num_valid_frames);
+  append(skip_frames, header.num_skip_frames);
+  return buffer;
+}
+
+inline u8* new_decode_args(const proto::DecodeArgs& args, size_t& size) {
+  DecodeArgsHeader header = {};
+  header.width = args.width();
+  header.height = args.height();
+  header.output_width = args.output_width();
+  header.output_height = args.output_height();
+  header.output_format = args.output_format();
+  header.chroma_format = args.chroma_format();
+  header.codec_type = args.codec_type();
+  header.start_keyframe = args.start_keyframe();
+  header.end_keyframe = args.end_keyframe();
+  header.encoded_video = args.encoded_video();
+  header.encoded_video_size = args.encoded_video_size();
+  header.num_keyframes = args.keyframes_size();
+  header.num_keyframe_byte_offsets = args.keyframe_byte_offsets_size();
+  header.num_valid_frames = args.valid_frames_size();
+  header.num_skip_frames = args.skip_frames_size();
+  // Protobuf's int64 is not necessarily the same type as i64
+  auto data = [](const google::protobuf::RepeatedField<
+                 google::protobuf::int64>& field) {
+    return reinterpret_cast<const i64*>(field.data());
+  };
+  return new_decode_args(header, data(args.keyframes()),
+                         data(args.keyframe_byte_offsets()),
+                         data(args.valid_frames()), data(args.skip_frames()),
+                         size);
+}
+
+// Reads a buffer written by new_decode_args in place. The accessors mirror
+// those of proto::DecodeArgs.
+class DecodeArgsView {
+ public:
+  explicit DecodeArgsView(const u8* buffer)
+    : buffer_(buffer),
+      header_(reinterpret_cast<const DecodeArgsHeader*>(buffer)),
+      keyframes_(
+          reinterpret_cast<const i64*>(buffer + sizeof(DecodeArgsHeader))),
+      keyframe_byte_offsets_(keyframes_ + header_->num_keyframes),
+      valid_frames_(keyframe_byte_offsets_ +
+                    header_->num_keyframe_byte_offsets),
+      skip_frames_(valid_frames_ + header_->num_valid_frames) {}
+
+  const u8* buffer() const { return buffer_; }
+
+  i32 width() const { return header_->width; }
+  i32 height() const { return header_->height; }
+  i32 output_width() const { return header_->output_width; }
+  i32 output_height() const { return header_->output_height; }
+  i32 table_id() const { return header_->table_id; }
+  i32 column_id() const { return header_->column_id; }
+  proto::PixelFormat output_format() const {
+    return static_cast<proto::PixelFormat>(header_->output_format);
+  }
+  proto::VideoDescriptor::VideoChromaFormat chroma_format() const {
+    return static_cast<proto::VideoDescriptor::VideoChromaFormat>(
+        header_->chroma_format);
+  }
+  proto::VideoDescriptor::VideoCodecType codec_type() const {
+    return static_cast<proto::VideoDescriptor::VideoCodecType>(
+        header_->codec_type);
+  }
+  i64 start_keyframe() const { return header_->start_keyframe; }
+  i64 end_keyframe() const { return header_->end_keyframe; }
+  i64 encoded_video() const { return header_->encoded_video; }
+  i64 encoded_video_size() const { return header_->encoded_video_size; }
+
+  i64 keyframes_size() const { return header_->num_keyframes; }
+  i64 keyframes(i64 i) const { return keyframes_[i]; }
+  i64 keyframe_byte_offsets_size() const {
+    return header_->num_keyframe_byte_offsets;
+  }
+  i64 keyframe_byte_offsets(i64 i) const {
+    return keyframe_byte_offsets_[i];
+  }
+  i64 valid_frames_size() const { return header_->num_valid_frames; }
+  i64 valid_frames(i64 i) const { return valid_frames_[i]; }
+  i64 skip_frames_size() const { return header_->num_skip_frames; }
+  i64 skip_frames(i64 i) const { return skip_frames_[i]; }
+
+ private:
+  const u8* buffer_;
+  const DecodeArgsHeader* header_;
+  const i64* keyframes_;
+  const i64* keyframe_byte_offsets_;
+  const i64* valid_frames_;
+  const i64* skip_frames_;
+};
+}
+}
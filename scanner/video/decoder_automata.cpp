@@ -23,6 +23,13 @@
 
 namespace scanner {
 namespace internal {
+namespace {
+
+// Recorded for every batch of decoded frames, so interned up front
+const ProfilerKey ITER_KEY = Profiler::intern("iter");
+const ProfilerKey GET_FRAMES_WAIT_KEY = Profiler::intern("get_frames_wait");
+const ProfilerKey GET_FRAMES_KEY = Profiler::intern("get_frames");
+}
 
 DecoderAutomata::DecoderAutomata(DeviceHandle device_handle, i32 num_devices,
                                  VideoDecoderType decoder_type)
@@ -35,11 +42,20 @@ DecoderAutomata::DecoderAutomata(DeviceHandle device_handle, i32 num_devices,
     not_done_(true),
     frames_retrieved_(0),
     skip_frames_(false) {
+  decoder_->set_frames_available_callback([this]() {
+    {
+      // Taking the lock orders this with the retriever's predicate check so
+      // a notification can not be lost between checking and sleeping
+      std::unique_lock<std::mutex> lk(frames_mutex_);
+    }
+    frames_available_.notify_one();
+  });
   feeder_thread_ = std::thread(&DecoderAutomata::feeder, this);
 }
 
 DecoderAutomata::~DecoderAutomata() {
   {
+    decoder_->set_frames_available_callback(nullptr);
     frames_to_get_ = 0;
     frames_retrieved_ = 0;
     while (decoder_->discard_frame()) {
@@ -60,11 +76,22 @@ DecoderAutomata::~DecoderAutomata() {
 
   for (auto& args : encoded_data_) {
     delete_buffer(CPU_DEVICE, (u8*)args.encoded_video());
+    delete_buffer(CPU_DEVICE, (u8*)args.buffer());
   }
 }
 
 void DecoderAutomata::initialize(
     const std::vector<proto::DecodeArgs>& encoded_data) {
+  std::vector<DecodeArgsView> views;
+  for (auto& args : encoded_data) {
+    size_t size;
+    views.emplace_back(new_decode_args(args, size));
+  }
+  initialize(views);
+}
+
+void DecoderAutomata::initialize(
+    const std::vector<DecodeArgsView>& encoded_data) {
   assert(!encoded_data.empty());
   while (decoder_->discard_frame()) {
   }
@@ -74,20 +101,34 @@ void DecoderAutomata::initialize(
 
   for (auto& args : encoded_data_) {
     delete_buffer(CPU_DEVICE, (u8*)args.encoded_video());
+    delete_buffer(CPU_DEVICE, (u8*)args.buffer());
   }
 
   encoded_data_ = encoded_data;
-  frame_size_ = encoded_data[0].width() * encoded_data[0].height() * 3;
+  i32 output_width = encoded_data[0].width();
+  i32 output_height = encoded_data[0].height();
+  if (encoded_data[0].output_width() > 0) {
+    output_width = encoded_data[0].output_width();
+    output_height = encoded_data[0].output_height();
+  }
+  PixelFormat output_format = encoded_data[0].output_format();
+  frame_size_ =
+      frame_info_for_format(output_height, output_width, output_format).size();
   current_frame_ = encoded_data[0].start_keyframe();
   next_frame_.store(encoded_data[0].valid_frames(0), std::memory_order_release);
   retriever_data_idx_.store(0, std::memory_order_release);
   retriever_valid_idx_ = 0;
+  retriever_skip_idx_ = 0;
 
   FrameInfo info(encoded_data[0].height(), encoded_data[0].width(), 3,
                  FrameType::U8);
+  FrameInfo output_info(output_height, output_width, 3, FrameType::U8);
 
-  if (info_ != info) {
-    decoder_->configure(info);
+  proto::VideoDescriptor::VideoCodecType codec_type =
+      encoded_data[0].codec_type();
+  if (info_ != info || output_info_ != output_info ||
+      output_format_ != output_format || codec_type_ != codec_type) {
+    decoder_->configure(info, output_info, output_format, codec_type);
   }
   if (frames_retrieved_ > 0) {
     decoder_->feed(nullptr, 0, true);
@@ -95,6 +136,9 @@ void DecoderAutomata::initialize(
 
   set_feeder_idx(0);
   info_ = info;
+  output_info_ = output_info;
+  output_format_ = output_format;
+  codec_type_ = codec_type;
   std::atomic_thread_fence(std::memory_order_release);
   seeking_ = false;
 }
@@ -102,6 +146,8 @@ void DecoderAutomata::initialize(
 void DecoderAutomata::get_frames(u8* buffer, i32 num_frames) {
   i64 total_frames_decoded = 0;
   i64 total_frames_used = 0;
+  i64 total_wait_us = 0;
+  i64 total_waits = 0;
 
   auto start = now();
 
@@ -130,7 +176,7 @@ void DecoderAutomata::get_frames(u8* buffer, i32 num_frames) {
   wake_feeder_.notify_one();
 
   if (profiler_) {
-    profiler_->add_interval("get_frames_wait", start, now());
+    profiler_->add_interval(GET_FRAMES_WAIT_KEY, start, now());
   }
 
   while (frames_retrieved_ < frames_to_get_) {
@@ -139,18 +185,23 @@ void DecoderAutomata::get_frames(u8* buffer, i32 num_frames) {
       // New frames
       bool more_frames = true;
       while (more_frames && frames_retrieved_ < frames_to_get_) {
-        const auto& valid_frames =
-            encoded_data_[retriever_data_idx_].valid_frames();
-        assert(valid_frames.size() > retriever_valid_idx_.load());
-        assert(current_frame_ <= valid_frames.Get(retriever_valid_idx_));
-        if (current_frame_ == valid_frames.Get(retriever_valid_idx_)) {
+        // The feeder did not decode these, so there is no output for them
+        while (is_skip_frame(retriever_data_idx_, current_frame_,
+                             retriever_skip_idx_)) {
+          current_frame_++;
+        }
+        const DecodeArgsView& args = encoded_data_[retriever_data_idx_];
+        assert(args.valid_frames_size() > retriever_valid_idx_.load());
+        assert(current_frame_ <= args.valid_frames(retriever_valid_idx_));
+        if (current_frame_ == args.valid_frames(retriever_valid_idx_)) {
           u8* decoded_buffer = buffer + frames_retrieved_ * frame_size_;
           more_frames = decoder_->get_frame(decoded_buffer, frame_size_);
           retriever_valid_idx_++;
-          if (retriever_valid_idx_ == valid_frames.size()) {
+          if (retriever_valid_idx_ == args.valid_frames_size()) {
             // Move to next decode args
             retriever_data_idx_ += 1;
             retriever_valid_idx_ = 0;
+            retriever_skip_idx_ = 0;
 
             // Trigger feeder to start again and set ourselves to the
             // start of that keyframe
@@ -202,16 +253,30 @@ void DecoderAutomata::get_frames(u8* buffer, i32 num_frames) {
         //        total_frames_decoded);
       }
       if (profiler_) {
-        profiler_->add_interval("iter", iter, now());
+        profiler_->add_interval(ITER_KEY, iter, now());
+      }
+    } else {
+      // Sleep until the decoder reports new frames instead of spinning
+      auto wait_start = now();
+      {
+        std::unique_lock<std::mutex> lk(frames_mutex_);
+        frames_available_.wait_for(lk, FRAMES_WAIT_TIMEOUT, [this] {
+          return decoder_->decoded_frames_buffered() > 0;
+        });
       }
+      total_wait_us += std::chrono::duration_cast<std::chrono::microseconds>(
+                           now() - wait_start)
+                           .count();
+      total_waits++;
     }
-    std::this_thread::yield();
   }
   decoder_->wait_until_frames_copied();
   if (profiler_) {
-    profiler_->add_interval("get_frames", start, now());
+    profiler_->add_interval(GET_FRAMES_KEY, start, now());
     profiler_->increment("frames_used", total_frames_used);
     profiler_->increment("frames_decoded", total_frames_decoded);
+    profiler_->increment("decoder_wait_us", total_wait_us);
+    profiler_->increment("decoder_waits", total_waits);
   }
 }
 
@@ -224,6 +289,7 @@ void DecoderAutomata::feeder() {
   // printf("feeder start\n");
   i64 total_frames_fed = 0;
   i32 frames_fed = 0;
+  i32 frames_skipped = 0;
   seeking_ = false;
   while (not_done_) {
     {
@@ -246,11 +312,13 @@ void DecoderAutomata::feeder() {
 
     if (profiler_) {
       profiler_->increment("frames_fed", frames_fed);
+      profiler_->increment("frames_skipped", frames_skipped);
     }
     frames_fed = 0;
+    frames_skipped = 0;
     bool seen_metadata = false;
     while (frames_retrieved_ < frames_to_get_) {
-      i32 frames_to_wait = 8;
+      i32 frames_to_wait = decoder_->frames_to_buffer();
       while (frames_retrieved_ < frames_to_get_ &&
              decoder_->decoded_frames_buffered() > frames_to_wait) {
         wake_feeder_.notify_one();
@@ -262,7 +330,6 @@ void DecoderAutomata::feeder() {
         set_feeder_idx(feeder_data_idx_ + 1);
         break;
       }
-      frames_fed++;
 
       i32 fdi = feeder_data_idx_.load(std::memory_order_acquire);
       const u8* encoded_buffer = (const u8*)encoded_data_[fdi].encoded_video();
@@ -302,7 +369,16 @@ void DecoderAutomata::feeder() {
         }
       }
 
-      decoder_->feed(encoded_packet, encoded_packet_size, false);
+      // Nothing references this frame and it was not requested, so
+      // decoding it would only produce a frame to discard
+      bool skip = encoded_packet_size > 0 &&
+                  is_skip_frame(fdi, feeder_current_frame_, feeder_skip_idx_);
+      if (skip) {
+        frames_skipped++;
+      } else {
+        decoder_->feed(encoded_packet, encoded_packet_size, false);
+        frames_fed++;
+      }
 
       if (feeder_current_frame_ == feeder_next_frame_) {
         feeder_valid_idx_++;
@@ -338,6 +414,7 @@ void DecoderAutomata::feeder() {
 void DecoderAutomata::set_feeder_idx(i32 data_idx) {
   feeder_data_idx_ = data_idx;
   feeder_valid_idx_ = 0;
+  feeder_skip_idx_ = 0;
   feeder_buffer_offset_ = 0;
   if (feeder_data_idx_ < encoded_data_.size()) {
     feeder_current_frame_ = encoded_data_[feeder_data_idx_].keyframes(0);
@@ -345,5 +422,18 @@ void DecoderAutomata::set_feeder_idx(i32 data_idx) {
     feeder_next_keyframe_ = encoded_data_[feeder_data_idx_].keyframes(1);
   }
 }
+
+bool DecoderAutomata::is_skip_frame(i32 data_idx, i64 frame, i32& skip_idx) {
+  if (data_idx >= encoded_data_.size()) {
+    return false;
+  }
+  const DecodeArgsView& args = encoded_data_[data_idx];
+  while (skip_idx < args.skip_frames_size() &&
+         args.skip_frames(skip_idx) < frame) {
+    skip_idx++;
+  }
+  return skip_idx < args.skip_frames_size() &&
+         args.skip_frames(skip_idx) == frame;
+}
 }
 }
@@ -15,8 +15,10 @@
 
 #pragma once
 
+#include "scanner/video/decode_args.h"
 #include "scanner/video/video_decoder.h"
 
+#include <chrono>
 #include <condition_variable>
 #include <memory>
 #include <mutex>
@@ -35,6 +37,11 @@ class DecoderAutomata {
                   VideoDecoderType decoder_type);
   ~DecoderAutomata();
 
+  //! Takes ownership of the args buffers and of the encoded video they
+  //  point to, which are freed once the next args are initialized
+  void initialize(const std::vector<DecodeArgsView>& encoded_data);
+
+  //! Copies the args into buffers owned by the automata
   void initialize(const std::vector<proto::DecodeArgs>& encoded_data);
 
   void get_frames(u8* buffer, i32 num_frames);
@@ -46,7 +53,14 @@ class DecoderAutomata {
 
   void set_feeder_idx(i32 data_idx);
 
+  //! Whether the frame is one of the current args' skip_frames. Frames must
+  //  be asked about in increasing order per args, using the same cursor.
+  bool is_skip_frame(i32 data_idx, i64 frame, i32& skip_idx);
+
   const i32 MAX_BUFFERED_FRAMES = 8;
+  // Upper bound on a single sleep of the retriever, in case a decoder
+  // buffers frames without signaling (e.g. while flushing)
+  const std::chrono::milliseconds FRAMES_WAIT_TIMEOUT{5};
 
   Profiler* profiler_ = nullptr;
 
@@ -59,10 +73,14 @@ class DecoderAutomata {
   std::atomic<bool> not_done_;
 
   FrameInfo info_{};
+  FrameInfo output_info_{};
+  PixelFormat output_format_ = PixelFormat::RGB24;
+  proto::VideoDescriptor::VideoCodecType codec_type_ =
+      proto::VideoDescriptor::H264;
   size_t frame_size_;
   i32 current_frame_;
   std::atomic<i32> reset_current_frame_;
-  std::vector<proto::DecodeArgs> encoded_data_;
+  std::vector<DecodeArgsView> encoded_data_;
 
   std::atomic<i64> next_frame_;
   std::atomic<i64> frames_retrieved_;
@@ -70,6 +88,7 @@ class DecoderAutomata {
 
   std::atomic<i32> retriever_data_idx_;
   std::atomic<i32> retriever_valid_idx_;
+  i32 retriever_skip_idx_;
 
   std::atomic<bool> skip_frames_;
   std::atomic<bool> seeking_;
@@ -78,10 +97,15 @@ class DecoderAutomata {
   std::atomic<i64> feeder_current_frame_;
   std::atomic<i64> feeder_next_frame_;
 
+  i32 feeder_skip_idx_;
   std::atomic<size_t> feeder_buffer_offset_;
   std::atomic<i64> feeder_next_keyframe_;
   std::mutex feeder_mutex_;
   std::condition_variable wake_feeder_;
+
+  // Signaled by the decoder when it has new frames for the retriever
+  std::mutex frames_mutex_;
+  std::condition_variable frames_available_;
 };
 }
 }
@@ -0,0 +1,248 @@
+/* Copyright 2017 Carnegie Mellon University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+// Decode throughput benchmark for DecoderAutomata. Sweeps every supported
+// decoder type over output resolution, sampling stride and the number of
+// decoders running concurrently, and prints one row per configuration:
+//
+//   DecoderAutomataBench [--video=short|long] [--strides=1,2,8,32]
+//                        [--scales=1,2,4] [--decoders=1,2,4] [--repeat=1]
+//
+// "used" is the number of frames returned to the caller and "decoded" is the
+// number the decoder actually produced, so used/decoded shows how much work
+// sparse sampling throws away. cpu% is process CPU time over wall time
+// (100% per fully busy core). GPU utilization is not measured here; run
+// `nvidia-smi dmon` alongside the NVIDIA rows to capture it.
+
+#include "scanner/util/profiler.h"
+#include "scanner/video/decoder_automata.h"
+#include "tests/videos.h"
+
+#include <sys/resource.h>
+#include <cstdio>
+#include <cstdlib>
+#include <sstream>
+#include <thread>
+
+extern "C" {
+#include "libavcodec/avcodec.h"
+}
+
+namespace scanner {
+namespace internal {
+namespace {
+
+struct BenchConfig {
+  VideoDecoderType type;
+  i32 stride;
+  i32 scale;
+  i32 decoders;
+};
+
+struct BenchResult {
+  double seconds;
+  double cpu_seconds;
+  i64 frames_used;
+  i64 frames_decoded;
+};
+
+std::vector<i32> parse_list(const std::string& s) {
+  std::vector<i32> values;
+  std::stringstream ss(s);
+  std::string item;
+  while (std::getline(ss, item, ',')) {
+    values.push_back(std::atoi(item.c_str()));
+  }
+  return values;
+}
+
+const char* decoder_type_name(VideoDecoderType type) {
+  switch (type) {
+    case VideoDecoderType::NVIDIA:
+      return "nvidia";
+    case VideoDecoderType::INTEL:
+      return "intel";
+    case VideoDecoderType::SOFTWARE:
+      return "software";
+  }
+  return "unknown";
+}
+
+double process_cpu_seconds() {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+         (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+// Decodes every stride-th frame of the video once on a fresh automata
+void run_decoder(const BenchConfig& config, const VideoMetadata& video_meta,
+                 u8* video_buffer, size_t video_size, Profiler& profiler) {
+  DeviceHandle device = config.type == VideoDecoderType::NVIDIA
+                            ? DeviceHandle{DeviceType::GPU, 0}
+                            : CPU_DEVICE;
+  DecoderAutomata decoder(device, 1, config.type);
+  decoder.set_profiler(&profiler);
+
+  // Both dimensions stay even so the decoders can scale to them directly
+  i32 output_width = (video_meta.width() / config.scale) & ~1;
+  i32 output_height = (video_meta.height() / config.scale) & ~1;
+
+  std::vector<proto::DecodeArgs> args;
+  args.emplace_back();
+  proto::DecodeArgs& decode_args = args.back();
+  decode_args.set_width(video_meta.width());
+  decode_args.set_height(video_meta.height());
+  decode_args.set_codec_type(video_meta.codec_type());
+  if (config.scale > 1) {
+    decode_args.set_output_width(output_width);
+    decode_args.set_output_height(output_height);
+  }
+  decode_args.set_start_keyframe(0);
+  decode_args.set_end_keyframe(video_meta.frames());
+  i64 num_frames = 0;
+  for (i64 r = 0; r < video_meta.frames(); r += config.stride) {
+    decode_args.add_valid_frames(r);
+    num_frames++;
+  }
+  for (i64 k : video_meta.keyframe_positions()) {
+    decode_args.add_keyframes(k);
+  }
+  for (i64 k : video_meta.keyframe_byte_offsets()) {
+    decode_args.add_keyframe_byte_offsets(k);
+  }
+  decode_args.set_encoded_video((i64)video_buffer);
+  decode_args.set_encoded_video_size(video_size);
+
+  decoder.initialize(args);
+
+  size_t frame_size = output_width * output_height * 3;
+  u8* frame_buffer = new_buffer(device, frame_size);
+  for (i64 i = 0; i < num_frames; ++i) {
+    decoder.get_frames(frame_buffer, 1);
+  }
+  delete_buffer(device, frame_buffer);
+}
+
+BenchResult run_config(const BenchConfig& config,
+                       const VideoMetadata& video_meta, u8* video_buffer,
+                       size_t video_size) {
+  timepoint_t base_time = now();
+  std::vector<Profiler> profilers(config.decoders, Profiler(base_time));
+
+  double cpu_start = process_cpu_seconds();
+  auto start = now();
+  std::vector<std::thread> threads;
+  for (i32 d = 0; d < config.decoders; ++d) {
+    threads.emplace_back(run_decoder, std::cref(config), std::cref(video_meta),
+                         video_buffer, video_size, std::ref(profilers[d]));
+  }
+  for (std::thread& t : threads) {
+    t.join();
+  }
+
+  BenchResult result;
+  result.seconds = nano_since(start) / 1e9;
+  result.cpu_seconds = process_cpu_seconds() - cpu_start;
+  result.frames_used = 0;
+  result.frames_decoded = 0;
+  for (Profiler& profiler : profilers) {
+    result.frames_used += profiler.counter("frames_used");
+    result.frames_decoded += profiler.counter("frames_decoded");
+  }
+  return result;
+}
+
+}  // namespace
+
+int bench_main(int argc, char** argv) {
+  std::string video = "short";
+  std::vector<i32> strides = {1, 2, 8, 32};
+  std::vector<i32> scales = {1, 2, 4};
+  std::vector<i32> decoders = {1, 2, 4};
+  i32 repeat = 1;
+  for (int i = 1; i < argc; ++i) {
+    std::string arg(argv[i]);
+    std::string key = arg.substr(0, arg.find('='));
+    std::string value =
+        arg.find('=') == std::string::npos ? "" : arg.substr(arg.find('=') + 1);
+    if (key == "--video") {
+      video = value;
+    } else if (key == "--strides") {
+      strides = parse_list(value);
+    } else if (key == "--scales") {
+      scales = parse_list(value);
+    } else if (key == "--decoders") {
+      decoders = parse_list(value);
+    } else if (key == "--repeat") {
+      repeat = std::atoi(value.c_str());
+    } else {
+      fprintf(stderr, "Unknown argument %s\n", arg.c_str());
+      return 1;
+    }
+  }
+
+  avcodec_register_all();
+
+  MemoryPoolConfig config;
+  init_memory_allocators(config, {});
+  std::unique_ptr<storehouse::StorageConfig> sc(
+      storehouse::StorageConfig::make_posix_config());
+  auto storage = storehouse::StorageBackend::make_from_config(sc.get());
+
+  const TestVideoInfo& info = video == "long" ? long_video : short_video;
+  VideoMetadata video_meta =
+      read_video_metadata(storage, download_video_meta(info));
+  std::vector<u8> video_bytes = read_entire_file(download_video(info));
+  u8* video_buffer = new_buffer(CPU_DEVICE, video_bytes.size());
+  memcpy_buffer(video_buffer, CPU_DEVICE, video_bytes.data(), CPU_DEVICE,
+                video_bytes.size());
+
+  printf("%-9s %10s %6s %8s %10s %10s %10s %8s\n", "decoder", "resolution",
+         "stride", "decoders", "used", "decoded", "fps", "cpu%");
+  for (VideoDecoderType type : VideoDecoder::get_supported_decoder_types()) {
+    for (i32 scale : scales) {
+      for (i32 stride : strides) {
+        for (i32 num_decoders : decoders) {
+          BenchConfig bench{type, stride, scale, num_decoders};
+          for (i32 r = 0; r < repeat; ++r) {
+            BenchResult result = run_config(bench, video_meta, video_buffer,
+                                             video_bytes.size());
+            std::string resolution =
+                std::to_string((video_meta.width() / scale) & ~1) + "x" +
+                std::to_string((video_meta.height() / scale) & ~1);
+            printf("%-9s %10s %6d %8d %10ld %10ld %10.1f %8.1f\n",
+                   decoder_type_name(type), resolution.c_str(), stride,
+                   num_decoders, result.frames_used, result.frames_decoded,
+                   result.frames_used / result.seconds,
+                   100.0 * result.cpu_seconds / result.seconds);
+          }
+        }
+      }
+    }
+  }
+
+  delete_buffer(CPU_DEVICE, video_buffer);
+  delete storage;
+  destroy_memory_allocators();
+  return 0;
+}
+}
+}
+
+int main(int argc, char** argv) {
+  return scanner::internal::bench_main(argc, argv);
+}
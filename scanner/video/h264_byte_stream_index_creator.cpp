@@ -47,7 +47,7 @@ namespace scanner {
 namespace internal {
 
 H264ByteStreamIndexCreator::H264ByteStreamIndexCreator(WriteFile* b)
-  : demuxed_bytestream_(b) {}
+  : ByteStreamIndexCreator(b) {}
 
 bool H264ByteStreamIndexCreator::feed_packet(u8* data, size_t size) {
   u8* orig_data = data;
@@ -172,7 +172,15 @@ bool H264ByteStreamIndexCreator::feed_packet(u8* data, size_t size) {
       }
       // printf("ref_idx_l0 %d, ref_idx_l1 %d\n",
       // sh.num_ref_idx_l0_active, sh.num_ref_idx_l1_active);
+      // B slices can be displayed before the frames they follow in the
+      // stream unless the picture order count is tied to decode order
+      if (sh.slice_type % 5 == 1 && sps_map_.at(last_sps_).poc_type != 2) {
+        may_reorder_ = true;
+      }
       if (frame_ == 0 || is_new_access_unit(sps_map_, pps_map_, prev_sh_, sh)) {
+        if (nal_ref_idc == 0) {
+          non_ref_frames_.push_back(frame_);
+        }
         frame_++;
         size_t bytestream_offset;
         if (nal_unit_type == 5) {
@@ -198,23 +206,27 @@ bool H264ByteStreamIndexCreator::feed_packet(u8* data, size_t size) {
             size += static_cast<i32>(pps_nal.size());
           }
 
-          s_write(demuxed_bytestream_, size);
-          for (auto& kv : sps_nal_bytes_) {
-            auto& sps_nal = kv.second;
-            s_write(demuxed_bytestream_, sps_nal.data(), sps_nal.size());
+          if (demuxed_bytestream_) {
+            s_write(demuxed_bytestream_, size);
+            for (auto& kv : sps_nal_bytes_) {
+              auto& sps_nal = kv.second;
+              s_write(demuxed_bytestream_, sps_nal.data(), sps_nal.size());
+            }
+            for (auto& kv : pps_nal_bytes_) {
+              auto& pps_nal = kv.second;
+              s_write(demuxed_bytestream_, pps_nal.data(), pps_nal.size());
+            }
+            // Append the packet to the stream
+            s_write(demuxed_bytestream_, orig_data, orig_size);
           }
-          for (auto& kv : pps_nal_bytes_) {
-            auto& pps_nal = kv.second;
-            s_write(demuxed_bytestream_, pps_nal.data(), pps_nal.size());
-          }
-          // Append the packet to the stream
-          s_write(demuxed_bytestream_, orig_data, orig_size);
 
           bytestream_pos_ += sizeof(size) + size;
         } else {
-          s_write(demuxed_bytestream_, orig_size);
-          // Append the packet to the stream
-          s_write(demuxed_bytestream_, orig_data, orig_size);
+          if (demuxed_bytestream_) {
+            s_write(demuxed_bytestream_, orig_size);
+            // Append the packet to the stream
+            s_write(demuxed_bytestream_, orig_data, orig_size);
+          }
 
           bytestream_pos_ += sizeof(orig_size) + orig_size;
         }
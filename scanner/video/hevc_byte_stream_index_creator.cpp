@@ -0,0 +1,155 @@
+/* Copyright 2017 Carnegie Mellon University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "scanner/video/hevc_byte_stream_index_creator.h"
+#include "scanner/util/storehouse.h"
+
+#include <glog/logging.h>
+
+using storehouse::WriteFile;
+
+namespace scanner {
+namespace internal {
+
+namespace {
+// Parameter sets and slice headers are parsed from this many leading bytes
+const i32 MAX_HEADER_BYTES = 256;
+
+void store_nal(std::map<u32, std::vector<u8>>& nals, u32 id,
+               const u8* nal_start, i32 nal_size) {
+  const u8 start_code[] = {0, 0, 0, 1};
+  std::vector<u8>& bytes = nals[id];
+  bytes.assign(start_code, start_code + 4);
+  bytes.insert(bytes.end(), nal_start, nal_start + nal_size);
+}
+}
+
+HEVCByteStreamIndexCreator::HEVCByteStreamIndexCreator(WriteFile* b)
+  : ByteStreamIndexCreator(b) {}
+
+bool HEVCByteStreamIndexCreator::feed_packet(u8* data, size_t size) {
+  i64 packet_bytestream_offset = bytestream_pos_;
+  bool has_vcl_nal = false;
+  bool is_keyframe = false;
+
+  const u8* nal_parse = data;
+  i32 size_left = size;
+  while (size_left > 3) {
+    const u8* nal_start = nullptr;
+    i32 nal_size = 0;
+    next_nal(nal_parse, size_left, nal_start, nal_size);
+    if (size_left < 0 || nal_size < 2) {
+      continue;
+    }
+
+    i32 nal_unit_type = get_hevc_nal_unit_type(nal_start);
+    i32 temporal_id = get_hevc_temporal_id(nal_start);
+    VLOG(2) << "frame " << frame_ << ", nal size " << nal_size
+            << ", nal unit " << nal_unit_type << ", temporal id "
+            << temporal_id;
+
+    hevc_nal_to_rbsp(nal_start, nal_size, MAX_HEADER_BYTES, rbsp_buffer_);
+    GetBitsState gb;
+    gb.buffer = rbsp_buffer_.data();
+    gb.offset = 0;
+    gb.size = rbsp_buffer_.size();
+
+    if (nal_unit_type == HEVC_NAL_VPS) {
+      store_nal(vps_nal_bytes_, parse_hevc_vps_id(gb), nal_start, nal_size);
+    } else if (nal_unit_type == HEVC_NAL_SPS) {
+      HEVCSPS sps;
+      if (!parse_hevc_sps(gb, sps)) {
+        error_message_ = "Failed to parse sps";
+        return false;
+      }
+      sps_map_[sps.sps_id] = sps;
+      store_nal(sps_nal_bytes_, sps.sps_id, nal_start, nal_size);
+    } else if (nal_unit_type == HEVC_NAL_PPS) {
+      HEVCPPS pps;
+      if (!parse_hevc_pps(gb, pps)) {
+        error_message_ = "Failed to parse pps";
+        return false;
+      }
+      pps_map_[pps.pps_id] = pps;
+      store_nal(pps_nal_bytes_, pps.pps_id, nal_start, nal_size);
+    } else if (is_hevc_vcl_nal(nal_unit_type)) {
+      has_vcl_nal = true;
+      HEVCSliceHeader sh;
+      if (!parse_hevc_slice_header(gb, nal_unit_type, pps_map_, sh)) {
+        error_message_ = "Failed to parse slice header";
+        return false;
+      }
+      if (sh.slice_type == HEVC_SLICE_B) {
+        may_reorder_ = true;
+      }
+      if (sh.first_slice_segment_in_pic_flag) {
+        const HEVCPPS& pps = pps_map_.at(sh.pps_id);
+        auto sps = sps_map_.find(pps.sps_id);
+        if (sps == sps_map_.end()) {
+          error_message_ = "Slice refers to an unknown sps";
+          return false;
+        }
+        // Pictures of the highest sub-layer that its own pictures do not
+        // reference are not referenced at all
+        if (is_hevc_sub_layer_non_ref_nal(nal_unit_type) &&
+            temporal_id == (i32)sps->second.max_sub_layers_minus1) {
+          num_non_ref_frames_ += 1;
+          non_ref_frames_.push_back(frame_);
+        }
+        if (is_hevc_idr_nal(nal_unit_type)) {
+          is_keyframe = true;
+          keyframe_byte_offsets_.push_back(packet_bytestream_offset);
+          keyframe_positions_.push_back(frame_);
+          // TODO(apoms): Add timestamp info back in
+          keyframe_timestamps_.push_back(frame_);
+          VLOG(2) << "keyframe " << frame_ << ", byte offset "
+                  << packet_bytestream_offset;
+        }
+        frame_++;
+      }
+    }
+    nals_parsed_++;
+  }
+
+  // Packets with only parameter sets or SEI are dropped since the parameter
+  // sets are repeated before every keyframe
+  if (!has_vcl_nal) {
+    return true;
+  }
+  i32 record_size = size;
+  if (is_keyframe) {
+    for (auto* nals : {&vps_nal_bytes_, &sps_nal_bytes_, &pps_nal_bytes_}) {
+      for (auto& kv : *nals) {
+        record_size += static_cast<i32>(kv.second.size());
+      }
+    }
+  }
+  if (demuxed_bytestream_) {
+    s_write(demuxed_bytestream_, record_size);
+    if (is_keyframe) {
+      for (auto* nals : {&vps_nal_bytes_, &sps_nal_bytes_, &pps_nal_bytes_}) {
+        for (auto& kv : *nals) {
+          s_write(demuxed_bytestream_, kv.second.data(), kv.second.size());
+        }
+      }
+    }
+    s_write(demuxed_bytestream_, data, size);
+  }
+  bytestream_pos_ += sizeof(record_size) + record_size;
+  return true;
+}
+}
+}
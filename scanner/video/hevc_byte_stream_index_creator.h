@@ -0,0 +1,52 @@
+/* Copyright 2017 Carnegie Mellon University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#pragma once
+
+#include "scanner/util/common.h"
+#include "scanner/util/hevc.h"
+#include "scanner/video/byte_stream_index_creator.h"
+
+#include "storehouse/storage_backend.h"
+
+#include <map>
+#include <string>
+
+namespace scanner {
+namespace internal {
+
+//! Indexes an H.265 Annex B stream. Only IDR pictures are keyframes: the
+//  leading pictures of a CRA can not be decoded when starting from it, so
+//  open GOP streams are split at their IDRs alone.
+class HEVCByteStreamIndexCreator : public ByteStreamIndexCreator {
+ public:
+  //! When demuxed_bytestream is null the stream is only indexed
+  HEVCByteStreamIndexCreator(storehouse::WriteFile* demuxed_bytestream);
+
+  bool feed_packet(u8* data, size_t size) override;
+
+ private:
+  // Parameter set NAL units with start codes by id, inserted before every
+  // keyframe
+  std::map<u32, std::vector<u8>> vps_nal_bytes_;
+  std::map<u32, std::vector<u8>> sps_nal_bytes_;
+  std::map<u32, std::vector<u8>> pps_nal_bytes_;
+  std::map<u32, HEVCSPS> sps_map_;
+  std::map<u32, HEVCPPS> pps_map_;
+  std::vector<u8> rbsp_buffer_;
+};
+}
+}
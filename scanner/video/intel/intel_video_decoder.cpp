@@ -30,222 +30,352 @@ extern "C" {
 #include "scanner/util/cuda.h"
 #endif
 
+#include <algorithm>
 #include <cassert>
 
 namespace scanner {
+namespace internal {
 
 ///////////////////////////////////////////////////////////////////////////////
 /// IntelVideoDecoder
-IntelVideoDecoder::IntelVideoDecoder(int device_id, DeviceType output_type)
+IntelVideoDecoder::IntelVideoDecoder(int device_id, DeviceType output_type,
+                                     i32 async_depth)
   : device_id_(device_id),
     output_type_(output_type),
+    async_depth_(std::max(1, async_depth)),
     codec_(nullptr),
     cc_(nullptr),
+    codec_type_(proto::VideoDescriptor::H264),
     reset_context_(true),
-    sws_context_(nullptr) {
+    sws_context_(nullptr),
+    staging_size_(0),
+    next_staging_(0),
+    copy_stream_(nullptr),
+    frame_pool_(1024),
+    decoded_frame_queue_(1024) {
   if (output_type != DeviceType::CPU && output_type != DeviceType::GPU) {
     LOG(FATAL) << "Unsupported output type for intel decoder";
   }
   av_init_packet(&packet_);
+  open_codec(codec_type_);
 
-  codec_ = avcodec_find_decoder_by_name("h264_qsv");
-  if (!codec_) {
-    fprintf(stderr, "could not find h264_qsv decoder\n");
-    exit(EXIT_FAILURE);
-  }
-
-  cc_ = avcodec_alloc_context3(codec_);
-  if (!cc_) {
-    fprintf(stderr, "could not alloc codec context");
-    exit(EXIT_FAILURE);
-  }
-
-  if (avcodec_open2(cc_, codec_, NULL) < 0) {
-    fprintf(stderr, "could not open codec\n");
-    assert(false);
+  if (output_type_ == DeviceType::GPU) {
+#ifdef HAVE_CUDA
+    CU_CHECK(cudaSetDevice(device_id_));
+    cudaStream_t stream;
+    CU_CHECK(cudaStreamCreateWithFlags(&stream, cudaStreamNonBlocking));
+    copy_stream_ = stream;
+#else
+    LOG(FATAL) << "Unsupported output type for intel decoder";
+#endif
   }
 }
 
 IntelVideoDecoder::~IntelVideoDecoder() {
-#if LIBAVCODEC_VERSION_INT >= AV_VERSION_INT(55, 53, 0)
-  avcodec_free_context(&cc_);
-#else
-  avcodec_close(cc_);
-  av_freep(&cc_);
-#endif
-  for (AVFrame* frame : frame_pool_) {
+  close_codec();
+  while (frame_pool_.size() > 0) {
+    AVFrame* frame;
+    frame_pool_.pop(frame);
     av_frame_free(&frame);
   }
-  for (AVFrame* frame : decoded_frame_queue_) {
+  while (decoded_frame_queue_.size() > 0) {
+    AVFrame* frame;
+    decoded_frame_queue_.pop(frame);
     av_frame_free(&frame);
   }
+  sws_freeContext(sws_context_);
+
+#ifdef HAVE_CUDA
+  if (copy_stream_ != nullptr) {
+    CU_CHECK(cudaSetDevice(device_id_));
+    CU_CHECK(cudaStreamSynchronize((cudaStream_t)copy_stream_));
+    CU_CHECK(cudaStreamDestroy((cudaStream_t)copy_stream_));
+  }
+  for (u8* buffer : staging_buffers_) {
+    CU_CHECK(cudaFreeHost(buffer));
+  }
+#endif
 }
 
-void IntelVideoDecoder::configure(const InputFormat& metadata) {
+void IntelVideoDecoder::configure(
+    const FrameInfo& metadata, const FrameInfo& output_metadata,
+    PixelFormat output_format,
+    proto::VideoDescriptor::VideoCodecType codec_type) {
+  if (codec_type != codec_type_) {
+    close_codec();
+    open_codec(codec_type);
+  }
   metadata_ = metadata;
+  frame_width_ = metadata_.width();
+  frame_height_ = metadata_.height();
+  output_width_ = output_metadata.width();
+  output_height_ = output_metadata.height();
+  output_format_ = output_format;
+  output_pixel_format_ = output_format_ == PixelFormat::NV12
+                             ? AV_PIX_FMT_NV12
+                             : AV_PIX_FMT_RGB24;
   reset_context_ = true;
 
   int required_size = av_image_get_buffer_size(
-      AV_PIX_FMT_RGB24, metadata_.width(), metadata_.height(), 1);
+      output_pixel_format_, output_width_, output_height_, 1);
 
   conversion_buffer_.resize(required_size);
-}
 
-bool IntelVideoDecoder::feed(const u8* encoded_buffer, size_t encoded_size,
-                             bool discontinuity) {
-// Debug read packets
-#if 0
-  i32 es = (i32)encoded_size;
-  const u8* b = encoded_buffer;
-  while (es > 0) {
-    const u8* nal_start;
-    i32 nal_size;
-    next_nal(b, es, nal_start, nal_size);
-    i32 nal_unit_type = get_nal_unit_type(nal_start);
-    printf("nal unit type %d\n", nal_unit_type);
-
-    if (nal_unit_type == 7) {
-      i32 offset = 32;
-      i32 sps_id = parse_exp_golomb(nal_start, nal_size, offset);
-      printf("SPS NAL (%d)\n", sps_id);
+  if (output_type_ == DeviceType::GPU && staging_size_ < required_size) {
+#ifdef HAVE_CUDA
+    CU_CHECK(cudaSetDevice(device_id_));
+    CU_CHECK(cudaStreamSynchronize((cudaStream_t)copy_stream_));
+    for (u8* buffer : staging_buffers_) {
+      CU_CHECK(cudaFreeHost(buffer));
     }
-    if (nal_unit_type == 8) {
-      i32 offset = 8;
-      i32 pps_id = parse_exp_golomb(nal_start, nal_size, offset);
-      i32 sps_id = parse_exp_golomb(nal_start, nal_size, offset);
-      printf("PPS id: %d, SPS id: %d\n", pps_id, sps_id);
+    staging_buffers_.resize(async_depth_);
+    for (u8*& buffer : staging_buffers_) {
+      CU_CHECK(cudaMallocHost((void**)&buffer, required_size));
     }
+    staging_size_ = required_size;
+    next_staging_ = 0;
+#endif
+  }
+}
+
+void IntelVideoDecoder::open_codec(
+    proto::VideoDescriptor::VideoCodecType codec_type) {
+  const char* name =
+      codec_type == proto::VideoDescriptor::HEVC ? "hevc_qsv" : "h264_qsv";
+  codec_ = avcodec_find_decoder_by_name(name);
+  if (!codec_) {
+    LOG(FATAL) << "Could not find " << name << " decoder";
+  }
+
+  cc_ = avcodec_alloc_context3(codec_);
+  if (!cc_) {
+    LOG(FATAL) << "Could not alloc codec context";
+  }
+
+  // The decoder allocates a surface for every decode the hardware may run at
+  // once, so the depth is also the size of the surface pool
+  AVDictionary* options = nullptr;
+  av_dict_set_int(&options, "async_depth", async_depth_, 0);
+  if (avcodec_open2(cc_, codec_, &options) < 0) {
+    LOG(FATAL) << "Could not open " << name << " decoder";
   }
+  av_dict_free(&options);
+  codec_type_ = codec_type;
+}
+
+void IntelVideoDecoder::close_codec() {
+#if LIBAVCODEC_VERSION_INT >= AV_VERSION_INT(55, 53, 0)
+  avcodec_free_context(&cc_);
+#else
+  avcodec_close(cc_);
+  av_freep(&cc_);
 #endif
+}
+
+bool IntelVideoDecoder::feed(const u8* encoded_buffer, size_t encoded_size,
+                             bool discontinuity) {
   if (discontinuity) {
+    while (decoded_frame_queue_.size() > 0) {
+      AVFrame* frame;
+      decoded_frame_queue_.pop(frame);
+      av_frame_unref(frame);
+      frame_pool_.push(frame);
+    }
+    // Drain the surfaces still in flight so the next segment starts clean
+    packet_.data = NULL;
+    packet_.size = 0;
+    avcodec_send_packet(cc_, &packet_);
+    receive_frames(true);
     avcodec_flush_buffers(cc_);
+    return false;
   }
-  if (av_new_packet(&packet_, encoded_size) < 0) {
-    fprintf(stderr, "could not allocate packet for feeding into decoder\n");
-    assert(false);
+  if (encoded_size > 0) {
+    if (av_new_packet(&packet_, encoded_size) < 0) {
+      LOG(FATAL) << "Could not allocate packet for feeding into decoder";
+    }
+    memcpy(packet_.data, encoded_buffer, encoded_size);
+  } else {
+    packet_.data = NULL;
+    packet_.size = 0;
   }
-  memcpy(packet_.data, encoded_buffer, encoded_size);
 
-  uint8_t* orig_data = packet_.data;
-  int orig_size = packet_.size;
-  int got_picture = 0;
-  do {
-    // Get frame from pool of allocated frames to decode video into
-    if (frame_pool_.empty()) {
-      // Create a new frame if our pool is empty
-      frame_pool_.push_back(av_frame_alloc());
+  auto send_start = now();
+  int error;
+  while ((error = avcodec_send_packet(cc_, &packet_)) == AVERROR(EAGAIN)) {
+    // Every surface holds a frame that has not been received yet
+    receive_frames(false);
+  }
+  if (error < 0 && error != AVERROR_EOF) {
+    char err_msg[256];
+    av_strerror(error, err_msg, 256);
+    LOG(FATAL) << "Error while sending packet (" << error << "): " << err_msg;
+  }
+  auto send_end = now();
+  // Only take the frames that are already done, leaving the rest of the
+  // surfaces decoding while the caller feeds more packets
+  receive_frames(false);
+  if (profiler_) {
+    profiler_->add_interval("qsv:send_packet", send_start, send_end);
+    profiler_->add_interval("qsv:receive_frame", send_end, now());
+  }
+  av_packet_unref(&packet_);
+
+  if (encoded_size == 0) {
+    // End of the segment, so the decoder was drained
+    avcodec_flush_buffers(cc_);
+  }
+
+  return decoded_frame_queue_.size() > 0;
+}
+
+void IntelVideoDecoder::receive_frames(bool flush) {
+  while (true) {
+    AVFrame* frame;
+    if (frame_pool_.size() <= 0) {
+      frame_pool_.push(av_frame_alloc());
     }
-    AVFrame* frame = frame_pool_.back();
-    frame_pool_.pop_back();
+    frame_pool_.pop(frame);
 
-    int consumed_length =
-        avcodec_decode_video2(cc_, frame, &got_picture, &packet_);
-    if (consumed_length < 0) {
+    int error = avcodec_receive_frame(cc_, frame);
+    if (error == AVERROR_EOF || error == AVERROR(EAGAIN)) {
+      frame_pool_.push(frame);
+      break;
+    }
+    if (error < 0) {
       char err_msg[256];
-      av_strerror(consumed_length, err_msg, 256);
-      fprintf(stderr, "Error while decoding frame (%d): %s\n", consumed_length,
-              err_msg);
-      assert(false);
+      av_strerror(error, err_msg, 256);
+      LOG(FATAL) << "Error while receiving frame (" << error
+                 << "): " << err_msg;
     }
-    if (got_picture) {
-      if (frame->buf[0] == NULL) {
-        // Must copy packet as data is stored statically
-        AVFrame* cloned_frame = av_frame_clone(frame);
-        if (cloned_frame == NULL) {
-          fprintf(stderr, "could not clone frame\n");
-          assert(false);
-        }
-        decoded_frame_queue_.push_back(cloned_frame);
-        av_frame_free(&frame);
-      } else {
-        // Frame is reference counted so we can just take it directly
-        decoded_frame_queue_.push_back(frame);
-      }
+    if (flush) {
+      av_frame_unref(frame);
+      frame_pool_.push(frame);
     } else {
-      frame_pool_.push_back(frame);
+      decoded_frame_queue_.push(frame);
+      notify_frames_available();
     }
-    packet_.data += consumed_length;
-    packet_.size -= consumed_length;
-  } while (packet_.size > 0 || (orig_size == 0 && got_picture));
-  packet_.data = orig_data;
-  packet_.size = orig_size;
-  av_packet_unref(&packet_);
-
-  return decoded_frame_queue_.size() > 0;
+  }
 }
 
 bool IntelVideoDecoder::discard_frame() {
-  AVFrame* frame = decoded_frame_queue_.front();
-  decoded_frame_queue_.pop_front();
-  av_frame_unref(frame);
-  frame_pool_.push_back(frame);
+  if (decoded_frame_queue_.size() > 0) {
+    AVFrame* frame;
+    decoded_frame_queue_.pop(frame);
+    av_frame_unref(frame);
+    frame_pool_.push(frame);
+  }
 
   return decoded_frame_queue_.size() > 0;
 }
 
 bool IntelVideoDecoder::get_frame(u8* decoded_buffer, size_t decoded_size) {
-  int64_t size_left = decoded_size;
-
-  AVFrame* frame = decoded_frame_queue_.front();
-  decoded_frame_queue_.pop_front();
-
-  if (reset_context_) {
-    AVPixelFormat decoder_pixel_format = cc_->pix_fmt;
-    sws_context_ = sws_getCachedContext(
-        sws_context_, metadata_.width(), metadata_.height(),
-        decoder_pixel_format, metadata_.width(), metadata_.height(),
-        AV_PIX_FMT_RGB24, SWS_BICUBIC, NULL, NULL, NULL);
-  }
-
-  if (sws_context_ == NULL) {
-    fprintf(stderr, "Could not get sws_context for rgb conversion\n");
-    exit(EXIT_FAILURE);
+  AVFrame* frame;
+  if (decoded_frame_queue_.size() > 0) {
+    decoded_frame_queue_.pop(frame);
+  } else {
+    return false;
   }
 
-  u8* scale_buffer = nullptr;
+  u8* scale_buffer = decoded_buffer;
   if (output_type_ == DeviceType::GPU) {
-    scale_buffer = conversion_buffer_.data();
-  } else if (output_type_ == DeviceType::CPU) {
-    scale_buffer = decoded_buffer;
+    scale_buffer = staging_buffers_[next_staging_];
   }
 
-  uint8_t* out_slices[4];
-  int out_linesizes[4];
-  int required_size = av_image_fill_arrays(
-      out_slices, out_linesizes, scale_buffer, AV_PIX_FMT_RGB24,
-      metadata_.width(), metadata_.height(), 1);
-  if (required_size < 0) {
-    fprintf(stderr, "Error in av_image_fill_arrays\n");
-    exit(EXIT_FAILURE);
-  }
+  int required_size = av_image_get_buffer_size(
+      output_pixel_format_, output_width_, output_height_, 1);
   if (required_size > decoded_size) {
-    fprintf(stderr, "Decode buffer not large enough for image\n");
-    exit(EXIT_FAILURE);
+    LOG(FATAL) << "Decode buffer not large enough for image";
   }
-  if (sws_scale(sws_context_, frame->data, frame->linesize, 0, frame->height,
-                out_slices, out_linesizes) < 0) {
-    fprintf(stderr, "sws_scale failed\n");
-    exit(EXIT_FAILURE);
+
+  auto scale_start = now();
+  if ((AVPixelFormat)frame->format == output_pixel_format_ &&
+      frame->width == output_width_ && frame->height == output_height_) {
+    // Quick Sync decodes to NV12, so NV12 output at the stream's size only
+    // needs its planes packed
+    if (av_image_copy_to_buffer(scale_buffer, required_size, frame->data,
+                                frame->linesize, output_pixel_format_,
+                                output_width_, output_height_, 1) < 0) {
+      LOG(FATAL) << "Error in av_image_copy_to_buffer";
+    }
+  } else {
+    if (reset_context_) {
+      sws_freeContext(sws_context_);
+      // Scaling happens as part of the color conversion
+      sws_context_ = sws_getContext(
+          frame->width, frame->height, (AVPixelFormat)frame->format,
+          output_width_, output_height_, output_pixel_format_, SWS_BICUBIC,
+          NULL, NULL, NULL);
+      reset_context_ = false;
+    }
+    if (sws_context_ == NULL) {
+      LOG(FATAL) << "Could not get sws_context for rgb conversion";
+    }
+
+    uint8_t* out_slices[4];
+    int out_linesizes[4];
+    if (av_image_fill_arrays(out_slices, out_linesizes, scale_buffer,
+                             output_pixel_format_, output_width_,
+                             output_height_, 1) < 0) {
+      LOG(FATAL) << "Error in av_image_fill_arrays";
+    }
+    if (sws_scale(sws_context_, frame->data, frame->linesize, 0,
+                  frame->height, out_slices, out_linesizes) < 0) {
+      LOG(FATAL) << "sws_scale failed";
+    }
   }
+  auto scale_end = now();
 
   if (output_type_ == DeviceType::GPU) {
-#ifdef HAVE_CUDA
-    cudaMemcpy(decoded_buffer, scale_buffer, required_size,
-               cudaMemcpyHostToDevice);
-#else
-    LOG(FATAL) << "Unsupported output type for software decoder";
-#endif
+    copy_to_device(decoded_buffer, scale_buffer, required_size);
   }
 
   av_frame_unref(frame);
-  frame_pool_.push_back(frame);
+  frame_pool_.push(frame);
+
+  if (profiler_) {
+    profiler_->add_interval("qsv:scale_frame", scale_start, scale_end);
+  }
 
   return decoded_frame_queue_.size() > 0;
 }
 
+void IntelVideoDecoder::copy_to_device(u8* decoded_buffer,
+                                       const u8* host_buffer, size_t size) {
+#ifdef HAVE_CUDA
+  CU_CHECK(cudaSetDevice(device_id_));
+  CU_CHECK(cudaMemcpyAsync(decoded_buffer, host_buffer, size,
+                           cudaMemcpyHostToDevice,
+                           (cudaStream_t)copy_stream_));
+  next_staging_++;
+  if (next_staging_ == (i32)staging_buffers_.size()) {
+    // Every staging buffer has a copy in flight, so wait for them before
+    // converting over the first one again
+    CU_CHECK(cudaStreamSynchronize((cudaStream_t)copy_stream_));
+    next_staging_ = 0;
+  }
+#else
+  LOG(FATAL) << "Unsupported output type for intel decoder";
+#endif
+}
+
 int IntelVideoDecoder::decoded_frames_buffered() {
   return decoded_frame_queue_.size();
 }
 
-void IntelVideoDecoder::wait_until_frames_copied() {}
+void IntelVideoDecoder::wait_until_frames_copied() {
+#ifdef HAVE_CUDA
+  if (copy_stream_ != nullptr) {
+    CU_CHECK(cudaSetDevice(device_id_));
+    CU_CHECK(cudaStreamSynchronize((cudaStream_t)copy_stream_));
+    next_staging_ = 0;
+  }
+#endif
+}
+
+i32 IntelVideoDecoder::frames_to_buffer() {
+  // Enough decoded frames for every surface to be refilled while they are
+  // retrieved
+  return std::max(VideoDecoder::frames_to_buffer(), 2 * async_depth_);
+}
+}
 }
@@ -15,7 +15,8 @@
 
 #pragma once
 
-#include "scanner/eval/evaluator.h"
+#include "scanner/api/kernel.h"
+#include "scanner/util/queue.h"
 #include "scanner/video/video_decoder.h"
 
 extern "C" {
@@ -33,16 +34,23 @@ extern "C" {
 #include <vector>
 
 namespace scanner {
+namespace internal {
 
 ///////////////////////////////////////////////////////////////////////////////
 /// IntelVideoDecoder
+//! Decodes on the Quick Sync engine of an Intel GPU through FFmpeg's qsv
+//  decoders. The hardware runs up to async_depth decodes at once from a
+//  pool of surfaces of that depth, so packets are sent without waiting for
+//  their frames, and frames are only received once the hardware has them.
 class IntelVideoDecoder : public VideoDecoder {
  public:
-  IntelVideoDecoder(int device_id, DeviceType output_type);
+  IntelVideoDecoder(int device_id, DeviceType output_type, i32 async_depth);
 
   ~IntelVideoDecoder();
 
-  void configure(const InputFormat& metadata) override;
+  void configure(const FrameInfo& metadata, const FrameInfo& output_metadata,
+                 PixelFormat output_format,
+                 proto::VideoDescriptor::VideoCodecType codec_type) override;
 
   bool feed(const u8* encoded_buffer, size_t encoded_size,
             bool discontinuity = false) override;
@@ -55,19 +63,48 @@ class IntelVideoDecoder : public VideoDecoder {
 
   void wait_until_frames_copied() override;
 
+  i32 frames_to_buffer() override;
+
  private:
+  void open_codec(proto::VideoDescriptor::VideoCodecType codec_type);
+
+  void close_codec();
+
+  // Moves every frame the hardware has finished into decoded_frame_queue_
+  void receive_frames(bool flush);
+
+  // Copies a host frame to the device on copy_stream_, in one of the
+  // staging buffers so that the copies of a batch overlap
+  void copy_to_device(u8* decoded_buffer, const u8* host_buffer, size_t size);
+
   int device_id_;
   DeviceType output_type_;
+  i32 async_depth_;
   AVPacket packet_;
   AVCodec* codec_;
   AVCodecContext* cc_;
-
-  InputFormat metadata_;
+  proto::VideoDescriptor::VideoCodecType codec_type_;
+
+  FrameInfo metadata_;
+  i32 frame_width_;
+  i32 frame_height_;
+  i32 output_width_;
+  i32 output_height_;
+  PixelFormat output_format_;
+  AVPixelFormat output_pixel_format_;
   std::vector<u8> conversion_buffer_;
   bool reset_context_;
   SwsContext* sws_context_;
 
-  std::vector<AVFrame*> frame_pool_;
-  std::deque<AVFrame*> decoded_frame_queue_;
+  // Pinned host buffers the frames of a batch are converted into before
+  // their copies to the device, used round robin
+  std::vector<u8*> staging_buffers_;
+  size_t staging_size_;
+  i32 next_staging_;
+  void* copy_stream_;
+
+  Queue<AVFrame*> frame_pool_;
+  Queue<AVFrame*> decoded_frame_queue_;
 };
 }
+}
@@ -20,7 +20,10 @@
 
 #include "storehouse/storage_backend.h"
 
+#include <atomic>
 #include <cassert>
+#include <condition_variable>
+#include <map>
 #include <thread>
 
 #include <cuda.h>
@@ -28,6 +31,87 @@
 
 namespace scanner {
 namespace internal {
+namespace {
+
+// NVDEC sessions of a GPU, shared by the decoders of every pipeline instance
+// on it. The decoders also share one context lock, rather than each taking
+// the context on their own.
+struct SessionPool {
+  std::mutex mutex;
+  std::condition_variable released;
+  i32 in_use = 0;
+  i32 waiting = 0;
+  CUvideoctxlock context_lock = nullptr;
+};
+
+std::mutex session_pools_mutex;
+std::map<i32, SessionPool> session_pools;
+std::atomic<i32> session_limit{0};
+
+SessionPool& session_pool(i32 device_id, CUcontext context) {
+  std::unique_lock<std::mutex> lock(session_pools_mutex);
+  SessionPool& pool = session_pools[device_id];
+  if (pool.context_lock == nullptr) {
+    CUD_CHECK(cuvidCtxLockCreate(&pool.context_lock, context));
+  }
+  return pool;
+}
+}
+
+void NVIDIAVideoDecoder::set_session_limit(i32 sessions_per_gpu) {
+  session_limit = sessions_per_gpu;
+  std::unique_lock<std::mutex> lock(session_pools_mutex);
+  for (auto& kv : session_pools) {
+    kv.second.released.notify_all();
+  }
+}
+
+void NVIDIAVideoDecoder::acquire_session() {
+  SessionPool& pool = session_pool(device_id_, cuda_context_);
+  {
+    std::unique_lock<std::mutex> lock(pool.mutex);
+    pool.waiting++;
+    pool.released.wait(lock, [&] {
+      i32 limit = session_limit;
+      return limit <= 0 || pool.in_use < limit;
+    });
+    pool.waiting--;
+    pool.in_use++;
+  }
+  decoder_info_.vidLock = pool.context_lock;
+  CUD_CHECK(cuvidCreateDecoder(&decoder_, &decoder_info_));
+}
+
+void NVIDIAVideoDecoder::release_session() {
+  for (int i = 0; i < max_mapped_frames_; ++i) {
+    if (mapped_frames_[i] != 0) {
+      CUD_CHECK(cuvidUnmapVideoFrame(decoder_, mapped_frames_[i]));
+      mapped_frames_[i] = 0;
+    }
+  }
+  CUD_CHECK(cuvidDestroyDecoder(decoder_));
+  decoder_ = nullptr;
+  release_session_ = false;
+
+  SessionPool& pool = session_pool(device_id_, cuda_context_);
+  {
+    std::unique_lock<std::mutex> lock(pool.mutex);
+    pool.in_use--;
+  }
+  pool.released.notify_one();
+}
+
+void NVIDIAVideoDecoder::maybe_release_session() {
+  if (!release_session_ || decoder_ == nullptr || frame_queue_elements_ > 0) {
+    return;
+  }
+  for (i32 i = 0; i < max_output_frames_; ++i) {
+    if (undisplayed_frames_[i] || frame_in_use_[i]) {
+      return;
+    }
+  }
+  release_session();
+}
 
 NVIDIAVideoDecoder::NVIDIAVideoDecoder(int device_id, DeviceType output_type,
                                        CUcontext cuda_context)
@@ -37,6 +121,8 @@ NVIDIAVideoDecoder::NVIDIAVideoDecoder(int device_id, DeviceType output_type,
     streams_(max_mapped_frames_),
     parser_(nullptr),
     decoder_(nullptr),
+    decoder_info_({}),
+    release_session_(false),
     frame_queue_read_pos_(0),
     frame_queue_elements_(0),
     last_displayed_frame_(-1) {
@@ -74,7 +160,7 @@ NVIDIAVideoDecoder::~NVIDIAVideoDecoder() {
   }
 
   if (decoder_) {
-    CUD_CHECK(cuvidDestroyDecoder(decoder_));
+    release_session();
   }
 
   for (int i = 0; i < max_mapped_frames_; ++i) {
@@ -90,9 +176,18 @@ NVIDIAVideoDecoder::~NVIDIAVideoDecoder() {
   CUD_CHECK(cuDevicePrimaryCtxRelease(device_id_));
 }
 
-void NVIDIAVideoDecoder::configure(const FrameInfo& metadata) {
+void NVIDIAVideoDecoder::configure(
+    const FrameInfo& metadata, const FrameInfo& output_metadata,
+    PixelFormat output_format,
+    proto::VideoDescriptor::VideoCodecType codec_type) {
+  cudaVideoCodec codec = codec_type == proto::VideoDescriptor::HEVC
+                             ? cudaVideoCodec_HEVC
+                             : cudaVideoCodec_H264;
   frame_width_ = metadata.width();
   frame_height_ = metadata.height();
+  output_width_ = output_metadata.width();
+  output_height_ = output_metadata.height();
+  output_format_ = output_format;
 
   CUcontext dummy;
   CUD_CHECK(cuCtxPushCurrent(cuda_context_));
@@ -109,7 +204,7 @@ void NVIDIAVideoDecoder::configure(const FrameInfo& metadata) {
   }
 
   if (decoder_) {
-    CUD_CHECK(cuvidDestroyDecoder(decoder_));
+    release_session();
   }
 
   for (int i = 0; i < max_mapped_frames_; ++i) {
@@ -124,8 +219,7 @@ void NVIDIAVideoDecoder::configure(const FrameInfo& metadata) {
   frame_queue_elements_ = 0;
 
   CUVIDPARSERPARAMS cuparseinfo = {};
-  // cuparseinfo.CodecType = metadata.codec_type;
-  cuparseinfo.CodecType = cudaVideoCodec_H264;
+  cuparseinfo.CodecType = codec;
   cuparseinfo.ulMaxNumDecodeSurfaces = max_output_frames_;
   cuparseinfo.ulMaxDisplayDelay = 1;
   cuparseinfo.pUserData = this;
@@ -139,21 +233,21 @@ void NVIDIAVideoDecoder::configure(const FrameInfo& metadata) {
   CUD_CHECK(cuvidCreateVideoParser(&parser_, &cuparseinfo));
 
   CUVIDDECODECREATEINFO cuinfo = {};
-  // cuinfo.CodecType = metadata.codec_type;
-  cuinfo.CodecType = cudaVideoCodec_H264;
+  cuinfo.CodecType = codec;
   // cuinfo.ChromaFormat = metadata.chroma_format;
   cuinfo.ChromaFormat = cudaVideoChromaFormat_420;
   cuinfo.OutputFormat = cudaVideoSurfaceFormat_NV12;
 
   cuinfo.ulWidth = frame_width_;
   cuinfo.ulHeight = frame_height_;
-  cuinfo.ulTargetWidth = cuinfo.ulWidth;
-  cuinfo.ulTargetHeight = cuinfo.ulHeight;
+  // NVDEC scales decoded surfaces to the target size for free
+  cuinfo.ulTargetWidth = output_width_;
+  cuinfo.ulTargetHeight = output_height_;
 
   cuinfo.target_rect.left = 0;
   cuinfo.target_rect.top = 0;
-  cuinfo.target_rect.right = cuinfo.ulWidth;
-  cuinfo.target_rect.bottom = cuinfo.ulHeight;
+  cuinfo.target_rect.right = cuinfo.ulTargetWidth;
+  cuinfo.target_rect.bottom = cuinfo.ulTargetHeight;
 
   cuinfo.ulNumDecodeSurfaces = max_output_frames_;
   cuinfo.ulNumOutputSurfaces = max_mapped_frames_;
@@ -161,7 +255,8 @@ void NVIDIAVideoDecoder::configure(const FrameInfo& metadata) {
 
   cuinfo.DeinterlaceMode = cudaVideoDeinterlaceMode_Weave;
 
-  CUD_CHECK(cuvidCreateDecoder(&decoder_, &cuinfo));
+  decoder_info_ = cuinfo;
+  acquire_session();
 
   CUD_CHECK(cuCtxPopCurrent(&dummy));
 
@@ -211,6 +306,7 @@ bool NVIDIAVideoDecoder::feed(const u8* encoded_buffer, size_t encoded_size,
       frame_queue_read_pos_ = (frame_queue_read_pos_ + 1) % max_output_frames_;
       frame_queue_elements_--;
     }
+    maybe_release_session();
 
     CUcontext dummy;
     CUD_CHECK(cuCtxPopCurrent(&dummy));
@@ -225,6 +321,22 @@ bool NVIDIAVideoDecoder::feed(const u8* encoded_buffer, size_t encoded_size,
 
   CUD_CHECK(cuvidParseVideoData(parser_, &cupkt));
 
+  if (encoded_size == 0) {
+    // Between segments is the cheapest time to hand the session to another
+    // stream, so give it up once this segment's frames are retrieved
+    SessionPool& pool = session_pool(device_id_, cuda_context_);
+    bool wanted;
+    {
+      std::unique_lock<std::mutex> lock(pool.mutex);
+      wanted = pool.waiting > 0;
+    }
+    std::unique_lock<std::mutex> lock(frame_queue_mutex_);
+    if (wanted) {
+      release_session_ = true;
+      maybe_release_session();
+    }
+  }
+
   // Feed metadata packets after EOS to reinit decoder
   if (encoded_size == 0) {
     size_t pos = 0;
@@ -255,6 +367,7 @@ bool NVIDIAVideoDecoder::discard_frame() {
     frame_in_use_[dispinfo.picture_index] = false;
     frame_queue_read_pos_ = (frame_queue_read_pos_ + 1) % max_output_frames_;
     frame_queue_elements_--;
+    maybe_release_session();
   }
 
   CUcontext dummy;
@@ -292,9 +405,17 @@ bool NVIDIAVideoDecoder::get_frame(u8* decoded_buffer, size_t decoded_size) {
       profiler_->add_interval("map_frame", start_map, now());
     }
     CUdeviceptr mapped_frame = mapped_frames_[mapped_frame_index];
-    CU_CHECK(convertNV12toRGBA((const u8*)mapped_frame, pitch, decoded_buffer,
-                               frame_width_ * 3, frame_width_, frame_height_,
-                               0));
+    if (output_format_ == PixelFormat::NV12) {
+      // The surface is already NV12 with the chroma plane right after the
+      // luma plane, so only the pitch has to be removed
+      CU_CHECK(cudaMemcpy2D(decoded_buffer, output_width_,
+                            (const u8*)mapped_frame, pitch, output_width_,
+                            output_height_ * 3 / 2, cudaMemcpyDeviceToDevice));
+    } else {
+      CU_CHECK(convertNV12toRGBA((const u8*)mapped_frame, pitch,
+                                 decoded_buffer, output_width_ * 3,
+                                 output_width_, output_height_, 0));
+    }
     CU_CHECK(cudaDeviceSynchronize());
 
     CUD_CHECK(
@@ -303,6 +424,7 @@ bool NVIDIAVideoDecoder::get_frame(u8* decoded_buffer, size_t decoded_size) {
 
     std::unique_lock<std::mutex> lock(frame_queue_mutex_);
     frame_in_use_[dispinfo.picture_index] = false;
+    maybe_release_session();
   }
 
   CUcontext dummy;
@@ -335,6 +457,14 @@ int NVIDIAVideoDecoder::cuvid_handle_picture_decode(void* opaque,
   while (decoder.frame_in_use_[picparams->CurrPicIdx]) {
     usleep(500);
   };
+  {
+    // A new segment keeps, or takes back, a session
+    std::unique_lock<std::mutex> lock(decoder.frame_queue_mutex_);
+    decoder.release_session_ = false;
+  }
+  if (decoder.decoder_ == nullptr) {
+    decoder.acquire_session();
+  }
   std::unique_lock<std::mutex> lock(decoder.frame_queue_mutex_);
   decoder.undisplayed_frames_[picparams->CurrPicIdx] = true;
 
@@ -365,6 +495,7 @@ int NVIDIAVideoDecoder::cuvid_handle_picture_display(
       }
       usleep(1000);
     }
+    decoder.notify_frames_available();
   } else {
     std::unique_lock<std::mutex> lock(decoder.frame_queue_mutex_);
     decoder.invalid_frames_[dispinfo->picture_index] = false;
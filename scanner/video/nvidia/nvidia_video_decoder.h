@@ -36,7 +36,9 @@ class NVIDIAVideoDecoder : public VideoDecoder {
 
   ~NVIDIAVideoDecoder();
 
-  void configure(const FrameInfo& metadata) override;
+  void configure(const FrameInfo& metadata, const FrameInfo& output_metadata,
+                 PixelFormat output_format,
+                 proto::VideoDescriptor::VideoCodecType codec_type) override;
 
   bool feed(const u8* encoded_buffer, size_t encoded_size,
             bool discontinuity = false) override;
@@ -49,7 +51,21 @@ class NVIDIAVideoDecoder : public VideoDecoder {
 
   void wait_until_frames_copied() override;
 
+  //! See VideoDecoder::set_hardware_session_limit
+  static void set_session_limit(i32 sessions_per_gpu);
+
  private:
+  // Waits for one of the GPU's sessions and creates decoder_ from
+  // decoder_info_. Expects cuda_context_ to be current.
+  void acquire_session();
+
+  // Destroys decoder_ and hands its session to a waiting decoder
+  void release_session();
+
+  // Releases the session once a segment's frames are all retrieved, if
+  // another decoder asked for it. Expects frame_queue_mutex_ to be held.
+  void maybe_release_session();
+
   static int cuvid_handle_video_sequence(void* opaque, CUVIDEOFORMAT* format);
 
   static int cuvid_handle_picture_decode(void* opaque,
@@ -67,9 +83,15 @@ class NVIDIAVideoDecoder : public VideoDecoder {
 
   i32 frame_width_;
   i32 frame_height_;
+  i32 output_width_;
+  i32 output_height_;
+  PixelFormat output_format_;
   std::vector<char> metadata_packets_;
   CUvideoparser parser_;
   CUvideodecoder decoder_;
+  CUVIDDECODECREATEINFO decoder_info_;
+  // Set at the end of a segment when other decoders wait for a session
+  bool release_session_;
 
   i32 last_displayed_frame_;
   volatile i32 frame_in_use_[max_output_frames_];
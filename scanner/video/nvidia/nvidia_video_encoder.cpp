@@ -0,0 +1,302 @@
+/* Copyright 2017 Carnegie Mellon University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "scanner/video/nvidia/nvidia_video_encoder.h"
+#include "scanner/util/cuda.h"
+#include "scanner/util/image.h"
+
+#include <cassert>
+#include <cstring>
+
+#define NVENC_CHECK(ans) \
+  { nvencAssert((ans), __FILE__, __LINE__); }
+
+namespace scanner {
+namespace internal {
+
+namespace {
+
+inline void nvencAssert(NVENCSTATUS code, const char* file, int line) {
+  if (code != NV_ENC_SUCCESS) {
+    LOG(FATAL) << "NVENC error " << code << " " << file << " " << line;
+  }
+}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/// NVIDIAVideoEncoder
+NVIDIAVideoEncoder::NVIDIAVideoEncoder(int device_id, DeviceType output_type,
+                                       CUcontext cuda_context)
+  : device_id_(device_id),
+    output_type_(output_type),
+    cuda_context_(cuda_context),
+    encoder_(nullptr),
+    frame_id_(0),
+    input_buffer_(nullptr),
+    registered_input_(nullptr),
+    output_bitstream_(nullptr) {
+  CUcontext dummy;
+  CUD_CHECK(cuCtxPushCurrent(cuda_context_));
+  cudaSetDevice(device_id_);
+
+  CU_CHECK(cudaStreamCreate(&stream_));
+
+  memset(&nvenc_, 0, sizeof(nvenc_));
+  nvenc_.version = NV_ENCODE_API_FUNCTION_LIST_VER;
+  NVENC_CHECK(NvEncodeAPICreateInstance(&nvenc_));
+
+  CUD_CHECK(cuCtxPopCurrent(&dummy));
+}
+
+NVIDIAVideoEncoder::~NVIDIAVideoEncoder() {
+  CUcontext dummy;
+  CUD_CHECK(cuCtxPushCurrent(cuda_context_));
+  cudaSetDevice(device_id_);
+
+  release_session();
+  CU_CHECK(cudaStreamDestroy(stream_));
+
+  CUD_CHECK(cuCtxPopCurrent(&dummy));
+  // HACK(apoms): We are only using the primary context right now instead of
+  //   allowing the user to specify their own CUcontext. Thus we need to release
+  //   the primary context we retained when using the factory function to create
+  //   this object (see VideoEncoder::make_from_config).
+  CUD_CHECK(cuDevicePrimaryCtxRelease(device_id_));
+}
+
+void NVIDIAVideoEncoder::configure(const FrameInfo& metadata,
+                                   const EncodeOptions& opts) {
+  CUcontext dummy;
+  CUD_CHECK(cuCtxPushCurrent(cuda_context_));
+  cudaSetDevice(device_id_);
+
+  // A fresh session per configure makes every task start on an IDR frame,
+  // just like the software encoder's new codec context does
+  release_session();
+  ready_packets_.clear();
+
+  frame_width_ = metadata.width();
+  frame_height_ = metadata.height();
+  frame_id_ = 0;
+
+  NV_ENC_OPEN_ENCODE_SESSION_EX_PARAMS session_params;
+  memset(&session_params, 0, sizeof(session_params));
+  session_params.version = NV_ENC_OPEN_ENCODE_SESSION_EX_PARAMS_VER;
+  session_params.deviceType = NV_ENC_DEVICE_TYPE_CUDA;
+  session_params.device = cuda_context_;
+  session_params.apiVersion = NVENCAPI_VERSION;
+  NVENC_CHECK(nvenc_.nvEncOpenEncodeSessionEx(&session_params, &encoder_));
+
+  NV_ENC_PRESET_CONFIG preset_config;
+  memset(&preset_config, 0, sizeof(preset_config));
+  preset_config.version = NV_ENC_PRESET_CONFIG_VER;
+  preset_config.presetCfg.version = NV_ENC_CONFIG_VER;
+  NVENC_CHECK(nvenc_.nvEncGetEncodePresetConfig(
+      encoder_, NV_ENC_CODEC_H264_GUID, NV_ENC_PRESET_HQ_GUID,
+      &preset_config));
+
+  NV_ENC_CONFIG config = preset_config.presetCfg;
+  config.version = NV_ENC_CONFIG_VER;
+  config.gopLength = 120;
+  if (opts.keyframe_distance != -1) {
+    config.gopLength = opts.keyframe_distance;
+  }
+  // No B-frames: every fed frame produces a packet right away and the decode
+  // order of the saved video matches its display order
+  config.frameIntervalP = 1;
+  config.encodeCodecConfig.h264Config.idrPeriod = config.gopLength;
+  // Keyframes must carry their own SPS/PPS since tasks are saved and later
+  // decoded independently
+  config.encodeCodecConfig.h264Config.repeatSPSPPS = 1;
+  if (opts.quality != -1) {
+    config.rcParams.rateControlMode = NV_ENC_PARAMS_RC_CONSTQP;
+    config.rcParams.constQP.qpIntra = opts.quality;
+    config.rcParams.constQP.qpInterP = opts.quality;
+    config.rcParams.constQP.qpInterB = opts.quality;
+  } else if (opts.bitrate != -1) {
+    config.rcParams.rateControlMode = NV_ENC_PARAMS_RC_VBR;
+    config.rcParams.averageBitRate = opts.bitrate;
+  }
+
+  NV_ENC_INITIALIZE_PARAMS init_params;
+  memset(&init_params, 0, sizeof(init_params));
+  init_params.version = NV_ENC_INITIALIZE_PARAMS_VER;
+  init_params.encodeGUID = NV_ENC_CODEC_H264_GUID;
+  init_params.presetGUID = NV_ENC_PRESET_HQ_GUID;
+  init_params.encodeWidth = frame_width_;
+  init_params.encodeHeight = frame_height_;
+  init_params.darWidth = frame_width_;
+  init_params.darHeight = frame_height_;
+  // TODO(apoms): figure out this fps from the input video automatically
+  init_params.frameRateNum = 24;
+  init_params.frameRateDen = 1;
+  init_params.enablePTD = 1;
+  init_params.encodeConfig = &config;
+  NVENC_CHECK(nvenc_.nvEncInitializeEncoder(encoder_, &init_params));
+
+  NV_ENC_CREATE_BITSTREAM_BUFFER bitstream_params;
+  memset(&bitstream_params, 0, sizeof(bitstream_params));
+  bitstream_params.version = NV_ENC_CREATE_BITSTREAM_BUFFER_VER;
+  NVENC_CHECK(nvenc_.nvEncCreateBitstreamBuffer(encoder_, &bitstream_params));
+  output_bitstream_ = bitstream_params.bitstreamBuffer;
+
+  CU_CHECK(cudaMallocPitch((void**)&input_buffer_, &input_pitch_,
+                           frame_width_ * 4, frame_height_));
+
+  NV_ENC_REGISTER_RESOURCE register_params;
+  memset(&register_params, 0, sizeof(register_params));
+  register_params.version = NV_ENC_REGISTER_RESOURCE_VER;
+  register_params.resourceType = NV_ENC_INPUT_RESOURCE_TYPE_CUDADEVICEPTR;
+  register_params.width = frame_width_;
+  register_params.height = frame_height_;
+  register_params.pitch = input_pitch_;
+  register_params.resourceToRegister = input_buffer_;
+  register_params.bufferFormat = NV_ENC_BUFFER_FORMAT_ABGR;
+  NVENC_CHECK(nvenc_.nvEncRegisterResource(encoder_, &register_params));
+  registered_input_ = register_params.registeredResource;
+
+  CUD_CHECK(cuCtxPopCurrent(&dummy));
+}
+
+bool NVIDIAVideoEncoder::feed(const u8* frame_buffer, size_t frame_size) {
+  assert(frame_size > 0);
+  assert(frame_size >= frame_width_ * frame_height_ * 3);
+  CUcontext dummy;
+  CUD_CHECK(cuCtxPushCurrent(cuda_context_));
+  cudaSetDevice(device_id_);
+
+  // Expand the packed RGB frame into the registered RGBA input
+  auto convert_start = now();
+  CU_CHECK(convertRGBtoRGBA(frame_buffer, frame_width_ * 3, input_buffer_,
+                            input_pitch_, frame_width_, frame_height_,
+                            stream_));
+  CU_CHECK(cudaStreamSynchronize(stream_));
+  if (profiler_) {
+    profiler_->add_interval("nvenc:convert_frame", convert_start, now());
+  }
+
+  encode_frame(false);
+
+  CUD_CHECK(cuCtxPopCurrent(&dummy));
+  return ready_packets_.size() > 0;
+}
+
+bool NVIDIAVideoEncoder::flush() {
+  CUcontext dummy;
+  CUD_CHECK(cuCtxPushCurrent(cuda_context_));
+  encode_frame(true);
+  CUD_CHECK(cuCtxPopCurrent(&dummy));
+  return ready_packets_.size() > 0;
+}
+
+bool NVIDIAVideoEncoder::get_packet(u8* packet_buffer, size_t packet_size,
+                                    size_t& actual_packet_size) {
+  actual_packet_size = 0;
+  if (ready_packets_.empty()) {
+    return false;
+  }
+
+  // Make sure we have space for this packet, otherwise return
+  std::vector<u8>& packet = ready_packets_.front();
+  actual_packet_size = packet.size();
+  if (actual_packet_size > packet_size) {
+    return true;
+  }
+
+  memcpy(packet_buffer, packet.data(), packet.size());
+  ready_packets_.pop_front();
+
+  return ready_packets_.size() > 0;
+}
+
+int NVIDIAVideoEncoder::decoded_packets_buffered() {
+  return ready_packets_.size();
+}
+
+void NVIDIAVideoEncoder::wait_until_packets_copied() {}
+
+void NVIDIAVideoEncoder::release_session() {
+  if (encoder_ == nullptr) {
+    return;
+  }
+  if (registered_input_) {
+    NVENC_CHECK(nvenc_.nvEncUnregisterResource(encoder_, registered_input_));
+    registered_input_ = nullptr;
+  }
+  if (output_bitstream_) {
+    NVENC_CHECK(
+        nvenc_.nvEncDestroyBitstreamBuffer(encoder_, output_bitstream_));
+    output_bitstream_ = nullptr;
+  }
+  NVENC_CHECK(nvenc_.nvEncDestroyEncoder(encoder_));
+  encoder_ = nullptr;
+  if (input_buffer_) {
+    CU_CHECK(cudaFree(input_buffer_));
+    input_buffer_ = nullptr;
+  }
+}
+
+void NVIDIAVideoEncoder::encode_frame(bool flush) {
+  auto encode_start = now();
+  NV_ENC_PIC_PARAMS pic_params;
+  memset(&pic_params, 0, sizeof(pic_params));
+  pic_params.version = NV_ENC_PIC_PARAMS_VER;
+
+  NV_ENC_MAP_INPUT_RESOURCE map_params;
+  memset(&map_params, 0, sizeof(map_params));
+  map_params.version = NV_ENC_MAP_INPUT_RESOURCE_VER;
+  if (flush) {
+    pic_params.encodePicFlags = NV_ENC_PIC_FLAG_EOS;
+  } else {
+    map_params.registeredResource = registered_input_;
+    NVENC_CHECK(nvenc_.nvEncMapInputResource(encoder_, &map_params));
+
+    pic_params.inputBuffer = map_params.mappedResource;
+    pic_params.bufferFmt = map_params.mappedBufferFmt;
+    pic_params.inputWidth = frame_width_;
+    pic_params.inputHeight = frame_height_;
+    pic_params.inputPitch = input_pitch_;
+    pic_params.outputBitstream = output_bitstream_;
+    pic_params.pictureStruct = NV_ENC_PIC_STRUCT_FRAME;
+    pic_params.inputTimeStamp = frame_id_++;
+  }
+
+  NVENCSTATUS status = nvenc_.nvEncEncodePicture(encoder_, &pic_params);
+  if (status != NV_ENC_ERR_NEED_MORE_INPUT) {
+    NVENC_CHECK(status);
+  }
+
+  if (!flush) {
+    if (status == NV_ENC_SUCCESS) {
+      NV_ENC_LOCK_BITSTREAM lock_params;
+      memset(&lock_params, 0, sizeof(lock_params));
+      lock_params.version = NV_ENC_LOCK_BITSTREAM_VER;
+      lock_params.outputBitstream = output_bitstream_;
+      NVENC_CHECK(nvenc_.nvEncLockBitstream(encoder_, &lock_params));
+      u8* data = (u8*)lock_params.bitstreamBufferPtr;
+      ready_packets_.emplace_back(data,
+                                  data + lock_params.bitstreamSizeInBytes);
+      NVENC_CHECK(nvenc_.nvEncUnlockBitstream(encoder_, output_bitstream_));
+    }
+    NVENC_CHECK(
+        nvenc_.nvEncUnmapInputResource(encoder_, map_params.mappedResource));
+  }
+  if (profiler_) {
+    profiler_->add_interval("nvenc:encode_frame", encode_start, now());
+  }
+}
+}
+}
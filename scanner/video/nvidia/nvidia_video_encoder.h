@@ -0,0 +1,84 @@
+/* Copyright 2017 Carnegie Mellon University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#pragma once
+
+#include "scanner/api/kernel.h"
+#include "scanner/util/common.h"
+#include "scanner/video/video_encoder.h"
+
+#include <cuda.h>
+#include <cuda_runtime.h>
+#include <nvEncodeAPI.h>
+
+#include <deque>
+#include <vector>
+
+namespace scanner {
+namespace internal {
+
+///////////////////////////////////////////////////////////////////////////////
+/// NVIDIAVideoEncoder
+class NVIDIAVideoEncoder : public VideoEncoder {
+ public:
+  NVIDIAVideoEncoder(int device_id, DeviceType output_type,
+                     CUcontext cuda_context);
+
+  ~NVIDIAVideoEncoder();
+
+  void configure(const FrameInfo& metadata, const EncodeOptions& opts) override;
+
+  bool feed(const u8* frame_buffer, size_t frame_size) override;
+
+  bool flush() override;
+
+  bool get_packet(u8* packet_buffer, size_t packet_size,
+                  size_t& actual_packet_size) override;
+
+  int decoded_packets_buffered() override;
+
+  void wait_until_packets_copied() override;
+
+ private:
+  void release_session();
+
+  // Encodes the frame in the registered input buffer, or signals end of
+  // stream when flush is set, and queues the resulting bitstream
+  void encode_frame(bool flush);
+
+  int device_id_;
+  DeviceType output_type_;
+  CUcontext cuda_context_;
+  cudaStream_t stream_;
+
+  NV_ENCODE_API_FUNCTION_LIST nvenc_;
+  void* encoder_;
+
+  i32 frame_width_;
+  i32 frame_height_;
+  i32 frame_id_;
+
+  // RGBA copy of the frame being encoded. NVENC does not accept packed RGB,
+  // so frames are expanded on the GPU before being handed to the encoder.
+  u8* input_buffer_;
+  size_t input_pitch_;
+  NV_ENC_REGISTERED_PTR registered_input_;
+  NV_ENC_OUTPUT_PTR output_bitstream_;
+
+  std::deque<std::vector<u8>> ready_packets_;
+};
+}
+}
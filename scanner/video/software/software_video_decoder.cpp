@@ -44,31 +44,13 @@ SoftwareVideoDecoder::SoftwareVideoDecoder(i32 device_id,
     output_type_(output_type),
     codec_(nullptr),
     cc_(nullptr),
+    thread_count_(thread_count),
     reset_context_(true),
     sws_context_(nullptr),
     frame_pool_(1024),
     decoded_frame_queue_(1024) {
   av_init_packet(&packet_);
-
-  codec_ = avcodec_find_decoder(AV_CODEC_ID_H264);
-  if (!codec_) {
-    fprintf(stderr, "could not find h264 decoder\n");
-    exit(EXIT_FAILURE);
-  }
-
-  cc_ = avcodec_alloc_context3(codec_);
-  if (!cc_) {
-    fprintf(stderr, "could not alloc codec context");
-    exit(EXIT_FAILURE);
-  }
-
-  // cc_->thread_count = thread_count;
-  cc_->thread_count = 4;
-
-  if (avcodec_open2(cc_, codec_, NULL) < 0) {
-    fprintf(stderr, "could not open codec\n");
-    assert(false);
-  }
+  open_codec(AV_CODEC_ID_H264);
 }
 
 SoftwareVideoDecoder::~SoftwareVideoDecoder() {
@@ -92,18 +74,63 @@ SoftwareVideoDecoder::~SoftwareVideoDecoder() {
   sws_freeContext(sws_context_);
 }
 
-void SoftwareVideoDecoder::configure(const FrameInfo& metadata) {
+void SoftwareVideoDecoder::configure(
+    const FrameInfo& metadata, const FrameInfo& output_metadata,
+    PixelFormat output_format,
+    proto::VideoDescriptor::VideoCodecType codec_type) {
+  AVCodecID codec_id = codec_type == proto::VideoDescriptor::HEVC
+                           ? AV_CODEC_ID_HEVC
+                           : AV_CODEC_ID_H264;
+  if (codec_->id != codec_id) {
+#if LIBAVCODEC_VERSION_INT >= AV_VERSION_INT(55, 53, 0)
+    avcodec_free_context(&cc_);
+#else
+    avcodec_close(cc_);
+    av_freep(&cc_);
+#endif
+    open_codec(codec_id);
+  }
   metadata_ = metadata;
   frame_width_ = metadata_.width();
   frame_height_ = metadata_.height();
+  output_width_ = output_metadata.width();
+  output_height_ = output_metadata.height();
+  output_format_ = output_format;
+  output_pixel_format_ = output_format_ == PixelFormat::NV12
+                             ? AV_PIX_FMT_NV12
+                             : AV_PIX_FMT_RGB24;
   reset_context_ = true;
 
-  int required_size = av_image_get_buffer_size(AV_PIX_FMT_RGB24, frame_width_,
-                                               frame_height_, 1);
+  int required_size = av_image_get_buffer_size(
+      output_pixel_format_, output_width_, output_height_, 1);
 
   conversion_buffer_.resize(required_size);
 }
 
+void SoftwareVideoDecoder::open_codec(AVCodecID codec_id) {
+  codec_ = avcodec_find_decoder(codec_id);
+  if (!codec_) {
+    fprintf(stderr, "could not find %s decoder\n", avcodec_get_name(codec_id));
+    exit(EXIT_FAILURE);
+  }
+
+  cc_ = avcodec_alloc_context3(codec_);
+  if (!cc_) {
+    fprintf(stderr, "could not alloc codec context");
+    exit(EXIT_FAILURE);
+  }
+
+  // Frame threading decodes several frames at once, slice threading splits
+  // each frame; FFmpeg uses whichever the stream supports
+  cc_->thread_count = thread_count_;
+  cc_->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+
+  if (avcodec_open2(cc_, codec_, NULL) < 0) {
+    fprintf(stderr, "could not open codec\n");
+    assert(false);
+  }
+}
+
 bool SoftwareVideoDecoder::feed(const u8* encoded_buffer, size_t encoded_size,
                                 bool discontinuity) {
 // Debug read packets
@@ -189,9 +216,10 @@ bool SoftwareVideoDecoder::get_frame(u8* decoded_buffer, size_t decoded_size) {
     auto get_context_start = now();
     AVPixelFormat decoder_pixel_format = cc_->pix_fmt;
     sws_freeContext(sws_context_);
+    // Scaling happens as part of the color conversion
     sws_context_ = sws_getContext(
-        frame_width_, frame_height_, decoder_pixel_format, frame_width_,
-        frame_height_, AV_PIX_FMT_RGB24, SWS_BICUBIC, NULL, NULL, NULL);
+        frame_width_, frame_height_, decoder_pixel_format, output_width_,
+        output_height_, output_pixel_format_, SWS_BICUBIC, NULL, NULL, NULL);
     reset_context_ = false;
     auto get_context_end = now();
     if (profiler_) {
@@ -210,7 +238,8 @@ bool SoftwareVideoDecoder::get_frame(u8* decoded_buffer, size_t decoded_size) {
   int out_linesizes[4];
   int required_size =
       av_image_fill_arrays(out_slices, out_linesizes, scale_buffer,
-                           AV_PIX_FMT_RGB24, frame_width_, frame_height_, 1);
+                           output_pixel_format_, output_width_, output_height_,
+                           1);
   if (required_size < 0) {
     LOG(FATAL) << "Error in av_image_fill_arrays";
   }
@@ -274,6 +303,7 @@ void SoftwareVideoDecoder::feed_packet(bool flush) {
     if (error == 0) {
       if (!flush) {
         decoded_frame_queue_.push(frame);
+        notify_frames_available();
       } else {
         av_frame_unref(frame);
         frame_pool_.push(frame);
@@ -45,7 +45,9 @@ class SoftwareVideoDecoder : public VideoDecoder {
 
   ~SoftwareVideoDecoder();
 
-  void configure(const FrameInfo& metadata) override;
+  void configure(const FrameInfo& metadata, const FrameInfo& output_metadata,
+                 PixelFormat output_format,
+                 proto::VideoDescriptor::VideoCodecType codec_type) override;
 
   bool feed(const u8* encoded_buffer, size_t encoded_size,
             bool discontinuity = false) override;
@@ -61,15 +63,22 @@ class SoftwareVideoDecoder : public VideoDecoder {
  private:
   void feed_packet(bool flush);
 
+  void open_codec(AVCodecID codec_id);
+
   int device_id_;
   DeviceType output_type_;
   AVPacket packet_;
   AVCodec* codec_;
   AVCodecContext* cc_;
+  i32 thread_count_;
 
   FrameInfo metadata_;
   i32 frame_width_;
   i32 frame_height_;
+  i32 output_width_;
+  i32 output_height_;
+  PixelFormat output_format_;
+  AVPixelFormat output_pixel_format_;
   std::vector<u8> conversion_buffer_;
   bool reset_context_;
   SwsContext* sws_context_;
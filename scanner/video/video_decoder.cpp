@@ -85,7 +85,9 @@ VideoDecoder* VideoDecoder::make_from_config(DeviceHandle device_handle,
     }
     case VideoDecoderType::INTEL: {
 #ifdef HAVE_INTEL_VIDEO_HARDWARE
-      decoder = new IntelVideoDecoder(device_handle.id, device_handle.type);
+      // num_devices is the depth of the hardware decode queue
+      decoder = new IntelVideoDecoder(device_handle.id, device_handle.type,
+                                      num_devices);
 #else
 #endif
       break;
@@ -101,6 +103,23 @@ VideoDecoder* VideoDecoder::make_from_config(DeviceHandle device_handle,
   return decoder;
 }
 
+void VideoDecoder::set_hardware_session_limit(i32 sessions_per_device) {
+#ifdef HAVE_NVIDIA_VIDEO_HARDWARE
+  NVIDIAVideoDecoder::set_session_limit(sessions_per_device);
+#endif
+}
+
 void VideoDecoder::set_profiler(Profiler* profiler) { profiler_ = profiler; }
+
+void VideoDecoder::set_frames_available_callback(
+    std::function<void()> callback) {
+  frames_available_callback_ = callback;
+}
+
+void VideoDecoder::notify_frames_available() {
+  if (frames_available_callback_) {
+    frames_available_callback_();
+  }
+}
 }
 }
@@ -20,6 +20,7 @@
 #include "scanner/util/common.h"
 #include "scanner/util/profiler.h"
 
+#include <functional>
 #include <vector>
 
 namespace scanner {
@@ -44,9 +45,22 @@ class VideoDecoder {
   static VideoDecoder* make_from_config(DeviceHandle device_handle,
                                         i32 num_devices, VideoDecoderType type);
 
+  //! Caps the hardware decode sessions open at once on each device, shared
+  //  by every decoder of the process. Decoders past the cap wait for a
+  //  session, and decoders give theirs up between segments while others
+  //  are waiting. 0 leaves sessions unbounded.
+  static void set_hardware_session_limit(i32 sessions_per_device);
+
   virtual ~VideoDecoder(){};
 
-  virtual void configure(const FrameInfo& metadata) = 0;
+  //! output_metadata is the size frames are returned at. Decoders scale
+  //  while converting, so it may differ from the stream's size. Frames are
+  //  laid out as output_format, see frame_info_for_format. codec_type is the
+  //  compression of the fed stream, H264 or HEVC.
+  virtual void configure(const FrameInfo& metadata,
+                         const FrameInfo& output_metadata,
+                         PixelFormat output_format,
+                         proto::VideoDescriptor::VideoCodecType codec_type) = 0;
 
   virtual bool feed(const u8* encoded_buffer, size_t encoded_size,
                     bool discontinuity = false) = 0;
@@ -59,10 +73,23 @@ class VideoDecoder {
 
   virtual void wait_until_frames_copied() = 0;
 
+  //! Decoded frames the feeder lets accumulate before it stops feeding
+  //  until some are retrieved. Decoders that keep many frames in flight
+  //  raise it so that their queue stays full.
+  virtual i32 frames_to_buffer() { return 8; }
+
   void set_profiler(Profiler* profiler);
 
+  //! Called whenever newly decoded frames become available, possibly from a
+  //  decoder owned thread. Must be cheap and must not call back into the
+  //  decoder.
+  void set_frames_available_callback(std::function<void()> callback);
+
  protected:
+  void notify_frames_available();
+
   Profiler* profiler_ = nullptr;
+  std::function<void()> frames_available_callback_;
 };
 }
 }
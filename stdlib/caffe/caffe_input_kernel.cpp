@@ -168,14 +168,27 @@ void CaffeInputKernel::execute(const BatchedColumns& input_columns,
 
   set_device();
 
-  FrameInfo info(3, net_input_height_, net_input_width_, FrameType::F32);
+  bool half = args_.half_precision();
+  FrameInfo info(3, net_input_height_, net_input_width_,
+                 half ? FrameType::F16 : FrameType::F32);
   std::vector<Frame*> frames = new_frames(device_, info, input_count);
+  // The transformer writes floats, which are narrowed into the frames
+  u8* float_buffer = half ? new_buffer(device_, net_input_size) : nullptr;
   for (i32 frame = 0; frame < input_count; frame++) {
     const u8* input_buffer = frame_col[frame].as_const_frame()->data;
-    transform_halide(input_buffer, frames[frame]->data);
+    if (half) {
+      transform_halide(input_buffer, float_buffer);
+      f32_to_f16(device_, (const f32*)float_buffer, (u16*)frames[frame]->data,
+                 net_input_size / sizeof(f32));
+    } else {
+      transform_halide(input_buffer, frames[frame]->data);
+    }
 
     insert_frame(output_columns[0], frames[frame]);
   }
+  if (half) {
+    delete_buffer(device_, float_buffer);
+  }
 
   extra_inputs(input_columns, output_columns);
 
@@ -7,5 +7,6 @@ REGISTER_OP(CaffeInput).frame_input("frame").frame_output("caffe_frame");
 REGISTER_KERNEL(CaffeInput, CaffeInputKernel)
     .device(DeviceType::CPU)
     .batch()
-    .num_devices(1);
+    .num_devices(1)
+    .fusable();
 }
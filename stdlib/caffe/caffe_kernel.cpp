@@ -1,5 +1,6 @@
 #include "stdlib/caffe/caffe_kernel.h"
 #include "scanner/engine/metadata.h"
+#include "scanner/util/opencv.h"
 
 #include "caffe/blob.hpp"
 #include "caffe/common.hpp"
@@ -329,6 +330,7 @@ void CaffeKernel::new_frame_info() {
 
   input_blob->Reshape(
       {input_blob->shape(0), input_blob->shape(1), height, width});
+  reshape_net_ = true;
 
   net_config();
 }
@@ -344,6 +346,11 @@ void CaffeKernel::execute(const BatchedColumns& input_columns,
     input_blobs.emplace_back(net_->blob_by_name(name));
   }
   assert(input_blobs.size() > 0);
+  if (input_bound_.size() != input_blobs.size()) {
+    input_storage_.resize(input_blobs.size());
+    input_bound_.resize(input_blobs.size(), false);
+    input_tensors_.resize(input_blobs.size());
+  }
 
   PyGILState_STATE gstate;
   if (descriptor.uses_python()) {
@@ -355,26 +362,101 @@ void CaffeKernel::execute(const BatchedColumns& input_columns,
   i32 batch_size = args_.batch_size();
   for (i32 frame = 0; frame < input_count; frame += batch_size) {
     i32 batch_count = std::min(input_count - frame, batch_size);
-    if (input_blobs[0]->shape(0) != batch_count) {
+    // Padded batches leave the rows past batch_count holding whatever the
+    // last batch put there, and their outputs are dropped
+    if (!args_.pad_batches() && input_blobs[0]->shape(0) != batch_count) {
       input_blobs[0]->Reshape({batch_count, input_blobs[0]->shape(1),
                                input_blobs[0]->shape(2),
                                input_blobs[0]->shape(3)});
     }
 
     for (i32 i = 0; i < input_blobs.size(); ++i) {
+      caffe::Blob<float>* blob = input_blobs[i].get();
+      const Frame* first = input_columns[i][frame].as_const_frame();
+      // Input kernels write their batch as one packed tensor, which the
+      // blob can read in place
+      if (first->type == FrameType::F32 && blob->shape(0) == batch_count &&
+          first->size() == blob->count(1) * sizeof(f32) &&
+          is_tensor_batch(input_columns[i], frame, batch_count)) {
+        if (!input_bound_[i]) {
+          if (!input_storage_[i]) {
+            input_storage_[i].reset(new caffe::Blob<float>());
+          }
+          input_storage_[i]->ReshapeLike(*blob);
+          input_storage_[i]->ShareData(*blob);
+          input_bound_[i] = true;
+        }
+        if (!input_tensors_[i]) {
+          input_tensors_[i].reset(new caffe::Blob<float>());
+        }
+        caffe::Blob<float>* tensor = input_tensors_[i].get();
+        tensor->ReshapeLike(*blob);
+        if (device_.type == DeviceType::GPU) {
+          tensor->set_gpu_data((f32*)first->data);
+        } else {
+          tensor->set_cpu_data((f32*)first->data);
+        }
+        blob->ShareData(*tensor);
+        continue;
+      }
+      if (input_bound_[i]) {
+        // Back to the net's own storage so the copy below does not write
+        // into frames of an earlier batch
+        input_storage_[i]->ReshapeLike(*blob);
+        blob->ShareData(*input_storage_[i]);
+        input_bound_[i] = false;
+      }
+
       f32* net_input_buffer = nullptr;
       if (device_.type == DeviceType::GPU) {
-        net_input_buffer = input_blobs[i]->mutable_gpu_data();
+        net_input_buffer = blob->mutable_gpu_data();
       } else {
-        net_input_buffer = input_blobs[i]->mutable_cpu_data();
+        net_input_buffer = blob->mutable_cpu_data();
       }
 
+      // All float frames are copied in with one batched copy
+      std::vector<u8*> dest_buffers;
+      std::vector<u8*> src_buffers;
+      std::vector<size_t> sizes;
       size_t offset = 0;
       for (i32 j = 0; j < batch_count; ++j) {
         const Frame* fr = input_columns[i][frame + j].as_const_frame();
-        memcpy_buffer((u8*)net_input_buffer + offset, device_, fr->data,
-                      device_, fr->size());
-        offset += fr->size();
+        if (fr->type == FrameType::F16) {
+          size_t count = fr->size() / sizeof(u16);
+          f16_to_f32(device_, (const u16*)fr->data,
+                     (f32*)((u8*)net_input_buffer + offset), count);
+          offset += count * sizeof(f32);
+        } else {
+          dest_buffers.push_back((u8*)net_input_buffer + offset);
+          src_buffers.push_back(fr->data);
+          sizes.push_back(fr->size());
+          offset += fr->size();
+        }
+      }
+      if (!dest_buffers.empty()) {
+        memcpy_vec(dest_buffers, device_, src_buffers, device_, sizes);
+      }
+    }
+
+    // With the net's shape fixed, each output blob is pointed at a block
+    // that becomes the output rows
+    std::vector<u8*> bound_outputs(num_outputs, nullptr);
+    if (args_.pad_batches()) {
+      if (reshape_net_) {
+        net_->Reshape();
+        reshape_net_ = false;
+      }
+      for (size_t i = 0; i < num_outputs; ++i) {
+        const boost::shared_ptr<caffe::Blob<float>> output_blob{
+            net_->blob_by_name(descriptor.output_layer_names(i))};
+        u8* block = new_block_buffer(
+            device_, output_blob->count() * sizeof(f32), batch_count);
+        if (device_.type == DeviceType::GPU) {
+          output_blob->set_gpu_data((f32*)block);
+        } else {
+          output_blob->set_cpu_data((f32*)block);
+        }
+        bound_outputs[i] = block;
       }
     }
 
@@ -418,14 +500,20 @@ void CaffeKernel::execute(const BatchedColumns& input_columns,
       // } else {
       //   assert(batch_size == output_blob->shape(0));
       // }
-      u8* output_block = new_block_buffer(
-          device_, info.size() * batch_count, batch_count);
-
       u8* src_buffer =
           (u8*)(device_.type == DeviceType::CPU ? output_blob->cpu_data()
                                                 : output_blob->gpu_data());
-      memcpy_buffer(output_block, device_, src_buffer, device_,
-                    info.size() * batch_count);
+      u8* output_block = bound_outputs[i];
+      if (output_block == nullptr) {
+        output_block = new_block_buffer(device_, info.size() * batch_count,
+                                        batch_count);
+      }
+      // A layer that grew its top blob in forward no longer writes into the
+      // bound block
+      if (src_buffer != output_block) {
+        memcpy_buffer(output_block, device_, src_buffer, device_,
+                      info.size() * batch_count);
+      }
       for (i32 b = 0; b < batch_count; b++) {
         insert_frame(output_columns[i],
                      new Frame(info, output_block + info.size() * b));
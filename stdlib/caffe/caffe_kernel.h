@@ -35,6 +35,15 @@ class CaffeKernel : public BatchedKernel, public VideoKernel {
   proto::CaffeArgs args_;
   std::unique_ptr<caffe::Net<float>> net_;
   CustomNetConfiguration net_config_;
+  // Net's own storage for each input blob, kept while the blob is bound to
+  // a batch of input frames instead
+  std::vector<std::unique_ptr<caffe::Blob<float>>> input_storage_;
+  std::vector<bool> input_bound_;
+  // Wraps the input frames an input blob is bound to
+  std::vector<std::unique_ptr<caffe::Blob<float>>> input_tensors_;
+  // Set when input shapes changed and output shapes have to be recomputed
+  // before outputs can be bound
+  bool reshape_net_ = true;
 };
 
 proto::NetDescriptor descriptor_from_net_file(const std::string& path);
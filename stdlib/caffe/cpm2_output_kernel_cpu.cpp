@@ -119,8 +119,6 @@ class CPM2OutputKernel : public BatchedKernel, public VideoKernel {
     args.ParseFromArray(config.args.data(), config.args.size());
     scale_ = args.scale();
     modeldesc.reset(new COCOModelDescriptor());
-
-    joints_.resize(max_people_ * 3 * max_num_parts_);
   }
 
   void new_frame_info() override {
@@ -151,6 +149,16 @@ class CPM2OutputKernel : public BatchedKernel, public VideoKernel {
 
     i32 input_count = (i32)num_rows(input_columns[0]);
 
+    // Each frame decodes into its own slice of the joints buffer, so the
+    // frames of a batch are connected in parallel and inserted in order after
+    const size_t joints_size = max_people_ * 3 * max_num_parts_;
+    if (joints_.size() < joints_size * input_count) {
+      joints_.resize(joints_size * input_count);
+    }
+    std::vector<u8*> buffers(input_count);
+    std::vector<size_t> sizes(input_count);
+
+#pragma omp parallel for schedule(dynamic)
     for (i32 b = 0; b < input_count; ++b) {
       const Frame* heatmap_frame =
           input_columns[heatmap_idx][b].as_const_frame();
@@ -161,22 +169,23 @@ class CPM2OutputKernel : public BatchedKernel, public VideoKernel {
 
       const float* heatmap = reinterpret_cast<float*>(heatmap_frame->data);
       const float* peaks = reinterpret_cast<float*>(joints_frame->data);
+      float* joints = joints_.data() + joints_size * b;
 
       std::vector<std::vector<double>> subset;
       std::vector<std::vector<std::vector<double>>> connection;
       // int count =
-      //     connect_limbs(subset, connection, heatmap, peaks, joints_.data());
-      int count = connect_limbs_coco(subset, connection, heatmap, peaks,
-                                     joints_.data());
+      //     connect_limbs(subset, connection, heatmap, peaks, joints);
+      int count =
+          connect_limbs_coco(subset, connection, heatmap, peaks, joints);
 
       std::vector<std::vector<scanner::Point>> bodies(count);
       for (int p = 0; p < count; ++p) {
         std::vector<scanner::Point>& body_joints = bodies[p];
         for (i32 j = 0; j < num_joints_; ++j) {
           int offset = p * num_joints_ * 3 + j * 3;
-          float score = joints_[offset + 2];
-          float y = joints_[offset + 1];
-          float x = joints_[offset + 0];
+          float score = joints[offset + 2];
+          float y = joints[offset + 1];
+          float x = joints[offset + 0];
 
           scanner::Point joint;
           joint.set_x(x);
@@ -185,10 +194,11 @@ class CPM2OutputKernel : public BatchedKernel, public VideoKernel {
           body_joints.push_back(joint);
         }
       }
-      size_t size;
-      u8* buffer;
-      serialize_proto_vector_of_vectors(bodies, buffer, size);
-      insert_element(output_columns.at(heatmap_idx), buffer, size);
+      serialize_proto_vector_of_vectors(bodies, buffers[b], sizes[b]);
+    }
+
+    for (i32 b = 0; b < input_count; ++b) {
+      insert_element(output_columns.at(heatmap_idx), buffers[b], sizes[b]);
     }
   }
 
@@ -789,6 +799,7 @@ class CPM2OutputKernel : public BatchedKernel, public VideoKernel {
   float connect_min_subset_score_ = 0.4;
   float connect_inter_threshold_ = 0.050;
   int connect_inter_min_above_threshold_ = 9;
+  // One slice of max_people_ * 3 * max_num_parts_ floats per batch element
   std::vector<float> joints_;
 };
 
@@ -800,5 +811,6 @@ REGISTER_OP(CPM2Output)
 
 REGISTER_KERNEL(CPM2Output, CPM2OutputKernel)
     .device(DeviceType::CPU)
+    .batch()
     .num_devices(1);
 }
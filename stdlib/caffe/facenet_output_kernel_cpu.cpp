@@ -68,8 +68,13 @@ class FacenetOutputKernel : public BatchedKernel, public VideoKernel {
     if (scale_ > 1.0) {
       valid_templates = big_valid_templates_;
     }
+    const i32 grid_size = grid_width_ * grid_height_;
+    std::vector<u8*> buffers(input_count);
+    std::vector<size_t> sizes(input_count);
+
     // Get bounding box data from output feature vector and turn it
     // into canonical center x, center y, width, height
+#pragma omp parallel for schedule(dynamic)
     for (i32 b = 0; b < input_count; ++b) {
       const Frame* frame = frame_col[b].as_const_frame();
 
@@ -77,90 +82,70 @@ class FacenetOutputKernel : public BatchedKernel, public VideoKernel {
       assert(frame->size() ==
              (feature_vector_sizes_[0] + feature_vector_sizes_[1]));
 
-      std::vector<BoundingBox> bboxes;
-      // Track confidence per pixel for each category so we can calculate
-      // uncertainty across the frame
-      f32* template_confidences = reinterpret_cast<f32*>(frame->data);
-      f32* template_adjustments =
+      BoxArrays bboxes;
+      std::vector<f32> confidences(grid_size);
+      const f32* template_confidences = reinterpret_cast<f32*>(frame->data);
+      const f32* template_adjustments =
           template_confidences + feature_vector_lengths_[0];
 
       for (i32 t : valid_templates) {
-        for (i32 xi = 0; xi < grid_width_; ++xi) {
-          for (i32 yi = 0; yi < grid_height_; ++yi) {
-            i32 vec_offset = xi * grid_height_ + yi;
-
-            f32 confidence =
-                template_confidences[t * grid_width_ * grid_height_ +
-                                     vec_offset];
-            // Apply sigmoid to confidence
-            confidence = 1.0 / (1.0 + std::exp(-confidence));
-
-            if (confidence < threshold_) continue;
-
-            f32 x = xi * cell_width_ - 1;
-            f32 y = yi * cell_height_ - 1;
-
-            f32 width = templates_[t][2] - templates_[t][0] + 1;
-            f32 height = templates_[t][3] - templates_[t][1] + 1;
-
-            f32 dcx = template_adjustments[(num_templates_ * 0 + t) *
-                                               grid_width_ * grid_height_ +
-                                           vec_offset];
-            x += width * dcx;
-
-            f32 dcy = template_adjustments[(num_templates_ * 1 + t) *
-                                               grid_width_ * grid_height_ +
-                                           vec_offset];
-            y += height * dcy;
-
-            f32 dcw = template_adjustments[(num_templates_ * 2 + t) *
-                                               grid_width_ * grid_height_ +
-                                           vec_offset];
-            width *= std::exp(dcw);
-
-            f32 dch = template_adjustments[(num_templates_ * 3 + t) *
-                                               grid_width_ * grid_height_ +
-                                           vec_offset];
-            height *= std::exp(dch);
-
-            x = (x / net_input_width_) * frame_info_.width();
-            y = (y / net_input_height_) * frame_info_.height();
-
-            width = (width / net_input_width_) * frame_info_.width();
-            height = (height / net_input_height_) * frame_info_.height();
-
-            if (width < 0 || height < 0 || std::isnan(width) ||
-                std::isnan(height) || std::isnan(x) || std::isnan(y))
-              continue;
-
-            // Clamp values to border
-
-            BoundingBox bbox;
-            bbox.set_x1(x - width / 2);
-            bbox.set_y1(y - height / 2);
-            bbox.set_x2(x + width / 2);
-            bbox.set_y2(y + height / 2);
-            bbox.set_score(confidence);
-
-            // if (bbox.x1() < 0 || bbox.y1() < 0 || bbox.x2() >
-            // frame_info_.width()
-            // ||
-            //     bbox.y2() > frame_info_.height())
-            //   continue;
-
-            bboxes.push_back(bbox);
-          }
+        const f32* confidence_grid = template_confidences + t * grid_size;
+        const f32* dcx_grid =
+            template_adjustments + (num_templates_ * 0 + t) * grid_size;
+        const f32* dcy_grid =
+            template_adjustments + (num_templates_ * 1 + t) * grid_size;
+        const f32* dcw_grid =
+            template_adjustments + (num_templates_ * 2 + t) * grid_size;
+        const f32* dch_grid =
+            template_adjustments + (num_templates_ * 3 + t) * grid_size;
+        const f32 template_width = templates_[t][2] - templates_[t][0] + 1;
+        const f32 template_height = templates_[t][3] - templates_[t][1] + 1;
+
+        // Apply sigmoid to the confidences of the whole grid in one pass
+        for (i32 k = 0; k < grid_size; ++k) {
+          confidences[k] = 1.0 / (1.0 + std::exp(-confidence_grid[k]));
+        }
+
+        // The grid is stored column major
+        for (i32 k = 0; k < grid_size; ++k) {
+          f32 confidence = confidences[k];
+          if (confidence < threshold_) continue;
+
+          i32 xi = k / grid_height_;
+          i32 yi = k % grid_height_;
+
+          f32 x = xi * cell_width_ - 1;
+          f32 y = yi * cell_height_ - 1;
+
+          f32 width = template_width;
+          f32 height = template_height;
+
+          x += width * dcx_grid[k];
+          y += height * dcy_grid[k];
+          width *= std::exp(dcw_grid[k]);
+          height *= std::exp(dch_grid[k]);
+
+          x = (x / net_input_width_) * frame_info_.width();
+          y = (y / net_input_height_) * frame_info_.height();
+
+          width = (width / net_input_width_) * frame_info_.width();
+          height = (height / net_input_height_) * frame_info_.height();
+
+          if (width < 0 || height < 0 || std::isnan(width) ||
+              std::isnan(height) || std::isnan(x) || std::isnan(y))
+            continue;
+
+          bboxes.push_back(x - width / 2, y - height / 2, x + width / 2,
+                           y + height / 2, confidence);
         }
       }
 
-      std::vector<BoundingBox> best_bboxes;
-      best_bboxes = best_nms(bboxes, 0.1);
+      std::vector<BoundingBox> best_bboxes = best_nms(bboxes, 0.1);
+      serialize_bbox_vector(best_bboxes, buffers[b], sizes[b]);
+    }
 
-      // Assume size of a bounding box is the same size as all bounding boxes
-      size_t size;
-      u8* buffer;
-      serialize_bbox_vector(best_bboxes, buffer, size);
-      output_columns[0].push_back(Element{buffer, size});
+    for (i32 b = 0; b < input_count; ++b) {
+      insert_element(output_columns[0], buffers[b], sizes[b]);
     }
   }
 
@@ -191,5 +176,6 @@ REGISTER_OP(FacenetOutput)
 
 REGISTER_KERNEL(FacenetOutput, FacenetOutputKernel)
     .device(DeviceType::CPU)
+    .batch()
     .num_devices(1);
 }
@@ -44,6 +44,10 @@ class YoloOutputKernel : public BatchedKernel, public VideoKernel {
   void execute(const BatchedColumns& input_columns,
                BatchedColumns& output_columns) override {
     i32 input_count = (i32)num_rows(input_columns[0]);
+    std::vector<u8*> buffers(input_count);
+    std::vector<size_t> sizes(input_count);
+
+#pragma omp parallel for schedule(dynamic)
     for (i32 i = 0; i < input_count; ++i) {
       assert(input_columns[0][i].as_const_frame()->size() ==
              (feature_vector_sizes_[0] + feature_vector_sizes_[1] +
@@ -54,100 +58,44 @@ class YoloOutputKernel : public BatchedKernel, public VideoKernel {
           category_confidences_vector + feature_vector_lengths_[0];
       f32* bbox_vector = objectness_vector += feature_vector_lengths_[1];
 
-      std::vector<f32> pixel_confidences(
-          input_height_ * input_width_ * num_categories_, 0.0f);
-
       // Get bounding box data from output feature vector and turn it
       // into canonical center x, center y, width, height
-      std::vector<BoundingBox> bboxes;
+      BoxArrays bboxes;
       for (i32 yi = 0; yi < grid_height_; ++yi) {
         for (i32 xi = 0; xi < grid_width_; ++xi) {
           for (i32 bi = 0; bi < num_bboxes_; ++bi) {
             i32 vec_offset = yi * grid_width_ + xi;
-
-            f32 x = ((xi + bbox_vector[(vec_offset)*num_bboxes_ + bi * 4 + 0]) /
-                     grid_width_) *
-                    input_width_;
-            f32 y = ((yi + bbox_vector[(vec_offset)*num_bboxes_ + bi * 4 + 1]) /
-                     grid_height_) *
-                    input_height_;
-
-            f32 width =
-                std::pow(bbox_vector[(vec_offset)*num_bboxes_ + bi * 4 + 3],
-                         2) *
-                input_width_;
-            f32 height =
-                std::pow(bbox_vector[(vec_offset)*num_bboxes_ + bi * 4 + 4],
-                         2) *
-                input_height_;
-
-            std::vector<f32> category_probabilities(num_categories_);
+            const f32* attributes =
+                bbox_vector + vec_offset * num_bboxes_ + bi * 4;
+
+            f32 x = ((xi + attributes[0]) / grid_width_) * input_width_;
+            f32 y = ((yi + attributes[1]) / grid_height_) * input_height_;
+            f32 width = std::pow(attributes[3], 2) * input_width_;
+            f32 height = std::pow(attributes[4], 2) * input_height_;
+            if (width < 0 || height < 0) continue;
+
+            const f32 objectness =
+                objectness_vector[vec_offset * num_bboxes_ + bi];
+            const f32* confidences = category_confidences_vector + vec_offset;
             for (i32 c = 0; c < num_categories_; ++c) {
-              f64 prob = objectness_vector[vec_offset * num_bboxes_ + bi] *
-                         category_confidences_vector[vec_offset + c];
-              category_probabilities[c] = prob;
-
+              f64 prob = objectness * confidences[c];
               if (prob < threshold_) continue;
-
-              for (i32 bbox_y = std::max(y - height / 2, 0.0f);
-                   bbox_y < std::min(y + height / 2, (f32)input_height_);
-                   ++bbox_y) {
-                for (i32 bbox_x = std::max(x - width / 2, 0.0f);
-                     bbox_x < std::min(x + width / 2, (f32)input_width_);
-                     ++bbox_x) {
-                  f32& max_confidence =
-                      pixel_confidences[bbox_y * input_width_ +
-                                        bbox_x * num_categories_ + c];
-                  if (prob > max_confidence) {
-                    max_confidence = prob;
-                  }
-                }
-              }
-
-              if (width < 0 || height < 0) continue;
-
-              BoundingBox bbox;
-              bbox.set_x1(x);
-              bbox.set_y1(y);
-              bbox.set_x2(x + width);
-              bbox.set_y2(y + height);
-              bbox.set_score(prob);
-              bbox.set_label(c);
-              bboxes.push_back(bbox);
+              bboxes.push_back(x, y, x + width, y + height, prob, c);
             }
           }
         }
       }
 
-      i32 non_thresholded_pixels = 1;
-      f64 certainty = 0.0f;
-      for (i32 yi = 0; yi < input_height_; ++yi) {
-        for (i32 xi = 0; xi < input_width_; ++xi) {
-          // For each pixel, compute difference between two most
-          // confident classes
-          f32 max1 = std::numeric_limits<f32>::lowest();
-          f32 max2 = std::numeric_limits<f32>::lowest();
-          for (i32 c = 0; c < num_categories_; ++c) {
-            const f32& confidence =
-                pixel_confidences[yi * input_width_ + xi * num_categories_ + c];
-            if (confidence > max1) {
-              max2 = max1;
-              max1 = confidence;
-            } else if (confidence > max2) {
-              max2 = confidence;
-            }
-          }
-          certainty += (max1 - max2);
-          if (max1 > threshold_ || max2 > threshold_) {
-            non_thresholded_pixels++;
-          }
-        }
+      std::vector<BoundingBox> boxes;
+      boxes.reserve(bboxes.size());
+      for (size_t b = 0; b < bboxes.size(); ++b) {
+        boxes.push_back(bboxes.box(b));
       }
+      serialize_bbox_vector(boxes, buffers[i], sizes[i]);
+    }
 
-      size_t size;
-      u8* buffer;
-      serialize_bbox_vector(bboxes, buffer, size);
-      insert_element(output_columns[0], buffer, size);
+    for (i32 i = 0; i < input_count; ++i) {
+      insert_element(output_columns[0], buffers[i], sizes[i]);
     }
   }
 
@@ -171,5 +119,6 @@ REGISTER_OP(YoloOutput).frame_input("caffe_output").output("bboxes");
 
 REGISTER_KERNEL(YoloOutput, YoloOutputKernel)
     .device(DeviceType::CPU)
+    .batch()
     .num_devices(1);
 }
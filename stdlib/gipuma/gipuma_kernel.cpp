@@ -1,3 +1,4 @@
+#include <opencv2/core/cuda_stream_accessor.hpp>
 #include <opencv2/imgproc.hpp>
 #include "scanner/api/kernel.h"
 #include "scanner/api/op.h"
@@ -11,11 +12,18 @@
 
 namespace scanner {
 
-class GipumaKernel : public VideoKernel {
+// Solves depth for one multi-camera frame set at a time. Grayscale
+// conversion happens on the GPU into texture arrays that persist across
+// frames, and the arrays are double buffered so that the next frame set is
+// converted and uploaded on upload_stream_ while gipuma solves the current
+// one.
+class GipumaKernel : public BatchedKernel, public VideoKernel {
  public:
   GipumaKernel(const KernelConfig& config)
-    : VideoKernel(config), device_(config.devices[0]), was_reset_(true) {
+    : BatchedKernel(config), device_(config.devices[0]), was_reset_(true) {
     set_device();
+    CU_CHECK(cudaStreamCreateWithFlags(&upload_stream_, cudaStreamNonBlocking));
+    cv_stream_ = cv::cuda::StreamAccessor::wrapStream(upload_stream_);
 
     state_.reset(new GlobalState);
     algo_params_ = new AlgorithmParameters;
@@ -43,7 +51,12 @@ class GipumaKernel : public VideoKernel {
     algo_params_->normTol = 0.1f;
   }
 
-  ~GipumaKernel() { delete algo_params_; }
+  ~GipumaKernel() {
+    set_device();
+    free_textures();
+    cudaStreamDestroy(upload_stream_);
+    delete algo_params_;
+  }
 
   void validate(proto::Result* result) {
     result->set_msg(valid_.msg());
@@ -67,11 +80,11 @@ class GipumaKernel : public VideoKernel {
       auto& calibration_col = input_columns[col_idx];
       // Read camera parameters from camera calibration column
 
-      u8* buffer = new_buffer(CPU_DEVICE, calibration_col.rows[0].size);
-      memcpy_buffer((u8*)buffer, CPU_DEVICE, calibration_col.rows[0].buffer,
-                    device_, calibration_col.rows[0].size);
+      u8* buffer = new_buffer(CPU_DEVICE, calibration_col[0].size);
+      memcpy_buffer((u8*)buffer, CPU_DEVICE, calibration_col[0].buffer,
+                    device_, calibration_col[0].size);
       proto::Camera cam;
-      cam.ParseFromArray(buffer, calibration_col.rows[0].size);
+      cam.ParseFromArray(buffer, calibration_col[0].size);
       delete_buffer(CPU_DEVICE, buffer);
 
       camera_params_.cameras.emplace_back();
@@ -123,6 +136,8 @@ class GipumaKernel : public VideoKernel {
     state_->lines->resize(frame_height * frame_width);
     state_->lines->s = frame_width;
     state_->lines->l = frame_width;
+
+    allocate_textures(frame_width, frame_height);
   }
 
   void execute(const BatchedColumns& input_columns,
@@ -130,10 +145,11 @@ class GipumaKernel : public VideoKernel {
     set_device();
 
     auto& frame_info = input_columns[1];
-    check_frame_info(device_, frame_info);
+    check_frame_info(device_, frame_info[0]);
 
     if (was_reset_) {
       setup_gipuma(input_columns);
+      was_reset_ = false;
     }
 
     i32 width = frame_info_.width();
@@ -141,48 +157,41 @@ class GipumaKernel : public VideoKernel {
     i32 points_output_size = width * height * sizeof(float4);
     i32 cost_output_size = width * height * sizeof(float);
 
-    i32 input_count = (i32)input_columns[0].rows.size();
-    std::vector<cvc::GpuMat> grayscale_images_gpu(num_cameras_);
-    std::vector<cv::Mat> grayscale_images(num_cameras_);
+    i32 input_count = (i32)num_rows(input_columns[0]);
     u8* points_output_buffer = new_block_buffer(
         device_, points_output_size * input_count, input_count);
     u8* cost_output_buffer =
         new_block_buffer(device_, cost_output_size * input_count, input_count);
+
+    upload_frames(input_columns, 0, 0);
     for (i32 i = 0; i < input_count; ++i) {
+      // Frame set i is in slot i % 2 once the upload stream catches up
+      CU_CHECK(cudaStreamSynchronize(upload_stream_));
+      if (i + 1 < input_count) {
+        upload_frames(input_columns, i + 1, (i + 1) % 2);
+      }
       for (i32 c = 0; c < num_cameras_; ++c) {
-        auto& frame_column = input_columns[c * 3];
-        cvc::GpuMat frame_input(frame_info_.height(), frame_info_.width(),
-                                CV_8UC3, frame_column.rows[i].buffer);
-        assert(frame_column.rows[i].size == width * height * 3);
-
-        grayscale_images[c] =
-            cv::Mat(frame_info_.height(), frame_info_.width(), CV_8UC3);
-        frame_input.download(grayscale_images[c]);
-        cv::cvtColor(grayscale_images[c], grayscale_images[c], CV_BGR2GRAY, 0);
-        grayscale_images[c].convertTo(grayscale_images[c], CV_32FC1);
+        state_->imgs[c] = textures_[i % 2][c];
+        state_->cuArray[c] = arrays_[i % 2][c];
       }
 
-      addImageToTextureFloatGray(grayscale_images, state_->imgs,
-                                 state_->cuArray);
-
       runcuda(*state_.get());
 
       // Copy estiamted points to output buffer
-      cudaMemcpy(points_output_buffer + points_output_size * i,
-                 state_->lines->norm4, points_output_size, cudaMemcpyDefault);
+      CU_CHECK(cudaMemcpy(points_output_buffer + points_output_size * i,
+                          state_->lines->norm4, points_output_size,
+                          cudaMemcpyDefault));
       insert_element(output_columns[0],
                      points_output_buffer + points_output_size * i,
                      points_output_size);
 
       // Copy costs to output buffer
-      cudaMemcpy(cost_output_buffer + cost_output_size * i, state_->lines->c,
-                 cost_output_size, cudaMemcpyDefault);
+      CU_CHECK(cudaMemcpy(cost_output_buffer + cost_output_size * i,
+                          state_->lines->c, cost_output_size,
+                          cudaMemcpyDefault));
       insert_element(output_columns[1],
                      cost_output_buffer + cost_output_size * i,
                      cost_output_size);
-
-      delTexture(algo_params_->num_img_processed, state_->imgs,
-                 state_->cuArray);
     }
   }
 
@@ -192,6 +201,74 @@ class GipumaKernel : public VideoKernel {
   }
 
  private:
+  // Converts the frames of every camera of a row to float grayscale and
+  // copies them into the texture arrays of a slot, all on upload_stream_
+  void upload_frames(const BatchedColumns& input_columns, i32 row, i32 slot) {
+    i32 width = frame_info_.width();
+    i32 height = frame_info_.height();
+    for (i32 c = 0; c < num_cameras_; ++c) {
+      const Element& element = input_columns[c * 3][row];
+      cvc::GpuMat frame_input;
+      if (element.is_frame) {
+        const Frame* frame = element.as_const_frame();
+        frame_input = cvc::GpuMat(height, width, CV_8UC3, frame->data,
+                                  frame->row_stride);
+      } else {
+        assert(element.size == width * height * 3);
+        frame_input = cvc::GpuMat(height, width, CV_8UC3, element.buffer);
+      }
+      cvc::cvtColor(frame_input, grayscale_u8_[c], CV_BGR2GRAY, 0,
+                    cv_stream_);
+      grayscale_u8_[c].convertTo(grayscale_f32_[c], CV_32FC1, cv_stream_);
+      CU_CHECK(cudaMemcpy2DToArrayAsync(
+          arrays_[slot][c], 0, 0, grayscale_f32_[c].data,
+          grayscale_f32_[c].step, width * sizeof(f32), height,
+          cudaMemcpyDeviceToDevice, upload_stream_));
+    }
+  }
+
+  // Two slots of per camera float arrays with the same texture setup as
+  // gipuma's addImageToTextureFloatGray, created once per video instead of
+  // once per frame
+  void allocate_textures(i32 width, i32 height) {
+    free_textures();
+    grayscale_u8_.resize(num_cameras_);
+    grayscale_f32_.resize(num_cameras_);
+    cudaChannelFormatDesc channel_desc =
+        cudaCreateChannelDesc(32, 0, 0, 0, cudaChannelFormatKindFloat);
+    for (i32 slot = 0; slot < 2; ++slot) {
+      arrays_[slot].resize(num_cameras_);
+      textures_[slot].resize(num_cameras_);
+      for (i32 c = 0; c < num_cameras_; ++c) {
+        CU_CHECK(cudaMallocArray(&arrays_[slot][c], &channel_desc, width,
+                                 height));
+        cudaResourceDesc res_desc = {};
+        res_desc.resType = cudaResourceTypeArray;
+        res_desc.res.array.array = arrays_[slot][c];
+
+        cudaTextureDesc tex_desc = {};
+        tex_desc.addressMode[0] = cudaAddressModeWrap;
+        tex_desc.addressMode[1] = cudaAddressModeWrap;
+        tex_desc.filterMode = cudaFilterModeLinear;
+        tex_desc.readMode = cudaReadModeElementType;
+        tex_desc.normalizedCoords = 0;
+        CU_CHECK(cudaCreateTextureObject(&textures_[slot][c], &res_desc,
+                                         &tex_desc, nullptr));
+      }
+    }
+  }
+
+  void free_textures() {
+    for (i32 slot = 0; slot < 2; ++slot) {
+      for (size_t c = 0; c < arrays_[slot].size(); ++c) {
+        cudaDestroyTextureObject(textures_[slot][c]);
+        cudaFreeArray(arrays_[slot][c]);
+      }
+      arrays_[slot].clear();
+      textures_[slot].clear();
+    }
+  }
+
   DeviceHandle device_;
   proto::Result valid_;
   proto::GipumaArgs args_;
@@ -200,11 +277,21 @@ class GipumaKernel : public VideoKernel {
   std::unique_ptr<GlobalState> state_;
   i32 num_cameras_;
   bool was_reset_;
+
+  cudaStream_t upload_stream_;
+  cv::cuda::Stream cv_stream_;
+  std::vector<cvc::GpuMat> grayscale_u8_;
+  std::vector<cvc::GpuMat> grayscale_f32_;
+  std::vector<cudaArray*> arrays_[2];
+  std::vector<cudaTextureObject_t> textures_[2];
 };
 
 REGISTER_OP(Gipuma).variadic_inputs().outputs({"points", "cost"});
 
-REGISTER_KERNEL(Gipuma, GipumaKernel).device(DeviceType::GPU).num_devices(1);
+REGISTER_KERNEL(Gipuma, GipumaKernel)
+    .device(DeviceType::GPU)
+    .batch()
+    .num_devices(1);
 }
 
 // {
@@ -18,9 +18,16 @@
 #include "scanner/util/memory.h"
 #include "stdlib/stdlib.pb.h"
 
+#include <algorithm>
 #include <cmath>
+#include <cstring>
 
 namespace scanner {
+namespace {
+// Largest kernel whose row sums of U8 values fit in 16 bits
+const i32 MAX_U16_KERNEL_SIZE = 257;
+const i32 COLUMN_CHUNK = 256;
+}
 
 class BlurKernel : public Kernel, public VideoKernel {
  public:
@@ -53,30 +60,98 @@ class BlurKernel : public Kernel, public VideoKernel {
     auto& frame_col = input_columns[0];
     check_frame(CPU_DEVICE, frame_col);
 
+    const Frame* input = frame_col.as_const_frame();
+    Frame* output;
+    if (frame_col.writable) {
+      output = reinterpret_cast<Frame*>(frame_col.buffer);
+    } else {
+      // Pixels closer to the border than the filter reaches keep their input
+      // values
+      output = new_frame(CPU_DEVICE, input->as_frame_info());
+      for (i32 y = 0; y < frame_height_; ++y) {
+        std::memcpy(output->data + y * output->row_stride,
+                    input->data + y * input->row_stride, input->row_size());
+      }
+    }
+    if (filter_left_ + filter_right_ + 1 <= MAX_U16_KERNEL_SIZE) {
+      box_blur<u16>(input->data, input->row_stride, output->data,
+                    output->row_stride);
+    } else {
+      box_blur<u32>(input->data, input->row_stride, output->data,
+                    output->row_stride);
+    }
+    insert_frame(output_columns[0], output);
+  }
+
+  // Box filter from running sums, first along each row and then down each
+  // column, so the cost per pixel does not depend on the kernel size. All row
+  // sums are taken before any output is written, so input and output may be
+  // the same buffer. T holds the sum of kernel_size values.
+  template <typename T>
+  void box_blur(const u8* input, size_t input_stride, u8* output,
+                size_t output_stride) {
     i32 width = frame_width_;
     i32 height = frame_height_;
-    size_t frame_size = width * height * 3 * sizeof(u8);
-    FrameInfo info = frame_col.as_const_frame()->as_frame_info();
-    Frame* output_frame = new_frame(CPU_DEVICE, info);
-
-    const u8* frame_buffer = frame_col.as_const_frame()->data;
-    u8* blurred_buffer = output_frame->data;
-    for (i32 y = filter_left_; y < height - filter_right_; ++y) {
-      for (i32 x = filter_left_; x < width - filter_right_; ++x) {
+    i32 size = filter_left_ + filter_right_ + 1;
+    if (width < size || height < size) {
+      return;
+    }
+    i32 row_elements = width * 3;
+    std::vector<T> sums((size_t)height * row_elements);
+
+#pragma omp parallel for
+    for (i32 y = 0; y < height; ++y) {
+      const u8* in = input + y * input_stride;
+      T* row_sums = sums.data() + (size_t)y * row_elements;
+      T acc[3] = {0, 0, 0};
+      for (i32 x = 0; x < size; ++x) {
         for (i32 c = 0; c < 3; ++c) {
-          u32 value = 0;
-          for (i32 ry = -filter_left_; ry < filter_right_ + 1; ++ry) {
-            for (i32 rx = -filter_left_; rx < filter_right_ + 1; ++rx) {
-              value += frame_buffer[(y + ry) * width * 3 + (x + rx) * 3 + c];
-            }
+          acc[c] += in[x * 3 + c];
+        }
+      }
+      for (i32 c = 0; c < 3; ++c) {
+        row_sums[filter_left_ * 3 + c] = acc[c];
+      }
+      for (i32 x = filter_left_ + 1; x < width - filter_right_; ++x) {
+        for (i32 c = 0; c < 3; ++c) {
+          acc[c] = acc[c] + in[(x + filter_right_) * 3 + c] -
+                   in[(x - filter_left_ - 1) * 3 + c];
+          row_sums[x * 3 + c] = acc[c];
+        }
+      }
+    }
+
+    // Columns are split into chunks that fit in cache. Adding 0.5 before
+    // scaling keeps the truncating division of the integer sums exact.
+    f32 inv_area = 1.0f / (size * size);
+    i32 begin = filter_left_ * 3;
+    i32 end = (width - filter_right_) * 3;
+#pragma omp parallel for
+    for (i32 j0 = begin; j0 < end; j0 += COLUMN_CHUNK) {
+      i32 count = std::min(COLUMN_CHUNK, end - j0);
+      u32 col[COLUMN_CHUNK] = {};
+      for (i32 r = 0; r < size; ++r) {
+        const T* row_sums = sums.data() + (size_t)r * row_elements + j0;
+        for (i32 j = 0; j < count; ++j) {
+          col[j] += row_sums[j];
+        }
+      }
+      for (i32 y = filter_left_; y < height - filter_right_; ++y) {
+        u8* out = output + y * output_stride + j0;
+        for (i32 j = 0; j < count; ++j) {
+          out[j] = (u8)((col[j] + 0.5f) * inv_area);
+        }
+        if (y + filter_right_ + 1 < height) {
+          const T* add = sums.data() +
+                         (size_t)(y + filter_right_ + 1) * row_elements + j0;
+          const T* sub =
+              sums.data() + (size_t)(y - filter_left_) * row_elements + j0;
+          for (i32 j = 0; j < count; ++j) {
+            col[j] = col[j] + add[j] - sub[j];
           }
-          blurred_buffer[y * width * 3 + x * 3 + c] =
-              value / ((filter_right_ + filter_left_ + 1) *
-                       (filter_right_ + filter_left_ + 1));
         }
       }
     }
-    insert_frame(output_columns[0], output_frame);
   }
 
  private:
@@ -92,5 +167,8 @@ class BlurKernel : public Kernel, public VideoKernel {
 
 REGISTER_OP(Blur).frame_input("frame").frame_output("frame");
 
-REGISTER_KERNEL(Blur, BlurKernel).device(DeviceType::CPU).num_devices(1);
+REGISTER_KERNEL(Blur, BlurKernel)
+    .device(DeviceType::CPU)
+    .num_devices(1)
+    .in_place();
 }
@@ -0,0 +1,93 @@
+#include "scanner/api/kernel.h"
+#include "scanner/api/op.h"
+#include "scanner/util/cuda.h"
+#include "scanner/util/image.h"
+#include "scanner/util/memory.h"
+#include "stdlib/stdlib.pb.h"
+
+#include <cmath>
+
+namespace scanner {
+
+class BlurKernelGPU : public Kernel, public VideoKernel {
+ public:
+  BlurKernelGPU(const KernelConfig& config)
+    : Kernel(config), device_(config.devices[0]) {
+    scanner::proto::BlurArgs args;
+    bool parsed = args.ParseFromArray(config.args.data(), config.args.size());
+    if (!parsed || config.args.size() == 0) {
+      RESULT_ERROR(&valid_, "Could not parse BlurArgs");
+      return;
+    }
+
+    filter_left_ = std::ceil(args.kernel_size() / 2.0) - 1;
+    filter_right_ = args.kernel_size() / 2;
+
+    set_device();
+    CU_CHECK(cudaStreamCreateWithFlags(&stream_, cudaStreamNonBlocking));
+
+    valid_.set_success(true);
+  }
+
+  ~BlurKernelGPU() {
+    set_device();
+    if (sums_ != nullptr) {
+      delete_buffer(device_, sums_);
+    }
+    cudaStreamDestroy(stream_);
+  }
+
+  void validate(Result* result) override { result->CopyFrom(valid_); }
+
+  void new_frame_info() override {
+    set_device();
+    if (sums_ != nullptr) {
+      delete_buffer(device_, sums_);
+    }
+    sums_ = new_buffer(
+        device_, frame_info_.width() * frame_info_.height() * 3 * sizeof(u32));
+  }
+
+  void execute(const Columns& input_columns,
+               Columns& output_columns) override {
+    auto& frame_col = input_columns[0];
+    set_device();
+    check_frame(device_, frame_col);
+
+    const Frame* input = frame_col.as_const_frame();
+    Frame* output;
+    if (frame_col.writable) {
+      output = reinterpret_cast<Frame*>(frame_col.buffer);
+    } else {
+      // Pixels closer to the border than the filter reaches keep their input
+      // values
+      output = new_frame(device_, input->as_frame_info());
+      CU_CHECK(cudaMemcpy2DAsync(output->data, output->row_stride, input->data,
+                                 input->row_stride, input->row_size(),
+                                 input->height(), cudaMemcpyDeviceToDevice,
+                                 stream_));
+    }
+    CU_CHECK(boxBlur(input->data, input->row_stride, output->data,
+                     output->row_stride, (u32*)sums_, input->width(),
+                     input->height(), filter_left_, filter_right_, stream_));
+    CU_CHECK(cudaStreamSynchronize(stream_));
+    insert_frame(output_columns[0], output);
+  }
+
+  void set_device() { CU_CHECK(cudaSetDevice(device_.id)); }
+
+ private:
+  DeviceHandle device_;
+  i32 filter_left_;
+  i32 filter_right_;
+  cudaStream_t stream_;
+  // Row sums of the current frame size
+  u8* sums_ = nullptr;
+  Result valid_;
+};
+
+REGISTER_KERNEL(Blur, BlurKernelGPU)
+    .device(DeviceType::GPU)
+    .num_devices(1)
+    .in_place();
+}
@@ -0,0 +1,85 @@
+#include "scanner/api/kernel.h"
+#include "scanner/api/op.h"
+#include "scanner/util/cuda.h"
+#include "scanner/util/image.h"
+#include "scanner/util/memory.h"
+#include "scanner/util/opencv.h"
+
+namespace scanner {
+
+// Converts NV12 frames, as produced by decoders asked for that format, to
+// RGB. Frames that are already RGB are passed through.
+class ConvertNV12Kernel : public BatchedKernel {
+ public:
+  ConvertNV12Kernel(const KernelConfig& config)
+    : BatchedKernel(config), device_(config.devices[0]) {}
+
+  void execute(const BatchedColumns& input_columns,
+               BatchedColumns& output_columns) override {
+    auto& frame_col = input_columns[0];
+    set_device();
+
+    const Frame* frame = frame_col[0].as_const_frame();
+    i32 input_count = num_rows(frame_col);
+    if (frame->channels() == 3) {
+      for (i32 i = 0; i < input_count; ++i) {
+        output_columns[0].push_back(add_element_ref(device_, frame_col[i]));
+      }
+      return;
+    }
+
+    i32 width = frame->width();
+    i32 height = frame->height() * 2 / 3;
+    FrameInfo info(height, width, 3, FrameType::U8);
+    std::vector<Frame*> output_frames = new_frames(device_, info, input_count);
+
+    for (i32 i = 0; i < input_count; ++i) {
+      const Frame* input = frame_col[i].as_const_frame();
+      if (device_.type == DeviceType::CPU) {
+        cv::Mat img = frame_to_mat(input);
+        cv::Mat out_mat = frame_to_mat(output_frames[i]);
+        cv::cvtColor(img, out_mat, cv::COLOR_YUV2RGB_NV12);
+      } else {
+#ifdef HAVE_CUDA
+        CU_CHECK(convertNV12toRGBA(input->data, width, output_frames[i]->data,
+                                   width * 3, width, height, 0));
+#else
+        LOG(FATAL) << "Not built with CUDA support.";
+#endif
+      }
+      insert_frame(output_columns[0], output_frames[i]);
+    }
+#ifdef HAVE_CUDA
+    if (device_.type == DeviceType::GPU) {
+      CU_CHECK(cudaDeviceSynchronize());
+    }
+#endif
+  }
+
+  void set_device() {
+#ifdef HAVE_CUDA
+    if (device_.type == DeviceType::GPU) {
+      CU_CHECK(cudaSetDevice(device_.id));
+    }
+#endif
+  }
+
+ private:
+  DeviceHandle device_;
+};
+
+REGISTER_OP(ConvertNV12)
+    .frame_input("frame", {proto::NV12})
+    .frame_output("frame");
+
+REGISTER_KERNEL(ConvertNV12, ConvertNV12Kernel)
+    .device(DeviceType::CPU)
+    .num_devices(1)
+    .fusable();
+
+#ifdef HAVE_CUDA
+REGISTER_KERNEL(ConvertNV12, ConvertNV12Kernel)
+    .device(DeviceType::GPU)
+    .num_devices(1);
+#endif
+}
@@ -0,0 +1,50 @@
+#include "scanner/api/kernel.h"
+#include "scanner/api/op.h"
+#include "scanner/util/memory.h"
+#include "stdlib/stdlib.pb.h"
+
+#include <algorithm>
+
+namespace scanner {
+
+// Outputs views into the input frames instead of copies, so cropping costs
+// the same no matter how large the region is
+class CropKernel : public BatchedKernel {
+ public:
+  CropKernel(const KernelConfig& config)
+    : BatchedKernel(config), device_(config.devices[0]) {
+    args_.ParseFromArray(config.args.data(), config.args.size());
+  }
+
+  void execute(const BatchedColumns& input_columns,
+               BatchedColumns& output_columns) override {
+    auto& frame_col = input_columns[0];
+    for (i32 i = 0; i < num_rows(frame_col); ++i) {
+      const Frame* frame = frame_col[i].as_const_frame();
+      // Regions reaching past the frame are cut at its border
+      i32 x = std::min(std::max(args_.x(), 0), frame->width());
+      i32 y = std::min(std::max(args_.y(), 0), frame->height());
+      i32 width = std::min(args_.width(), frame->width() - x);
+      i32 height = std::min(args_.height(), frame->height() - y);
+      insert_frame(output_columns[0],
+                   new_frame_view(device_, frame, y, x, std::max(height, 0),
+                                  std::max(width, 0)));
+    }
+  }
+
+ private:
+  DeviceHandle device_;
+  proto::CropArgs args_;
+};
+
+REGISTER_OP(Crop).frame_input("frame").frame_output("frame");
+
+REGISTER_KERNEL(Crop, CropKernel)
+    .device(DeviceType::CPU)
+    .num_devices(1)
+    .fusable();
+
+#ifdef HAVE_CUDA
+REGISTER_KERNEL(Crop, CropKernel).device(DeviceType::GPU).num_devices(1);
+#endif
+}
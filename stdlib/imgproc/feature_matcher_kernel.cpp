@@ -1,6 +1,7 @@
 #include "scanner/api/kernel.h"
 #include "scanner/api/op.h"
 #include "scanner/util/cuda.h"
+#include "scanner/util/image.h"
 #include "scanner/util/memory.h"
 #include "scanner/util/opencv.h"
 #include "scanner/util/serialize.h"
@@ -8,6 +9,7 @@
 #include "stdlib/stdlib.pb.h"
 
 #include <opencv2/xfeatures2d.hpp>
+#include <unordered_map>
 
 namespace scanner {
 
@@ -30,99 +32,168 @@ class Constants {
   }
 };
 
-class FeatureMatcherKernel : public StenciledKernel, public VideoKernel {
+// Matches the first frame of each stencil window against the rest of the
+// window. All pairs of a batch are matched with one brute force launch, and
+// frames shared by overlapping windows are parsed and referenced only once.
+class FeatureMatcherKernel : public StenciledBatchedKernel,
+                             public VideoKernel {
  public:
   FeatureMatcherKernel(const KernelConfig& config)
-    : StenciledKernel(config), device_(config.devices[0]), C_(0, 0, 0) {
+    : StenciledBatchedKernel(config), device_(config.devices[0]), C_(0, 0, 0) {
     set_device();
+    CU_CHECK(cudaStreamCreateWithFlags(&stream_, cudaStreamNonBlocking));
+  }
 
-    matcher_ = cvc::DescriptorMatcher::createBFMatcher();
-    features_suffix_.resize(C_.w);
-    kps_suffix_.resize(C_.w);
+  ~FeatureMatcherKernel() {
+    set_device();
+    cudaStreamDestroy(stream_);
   }
 
   void new_frame_info() override {
     set_device();
 
     C_ = Constants(frame_info_.width(), frame_info_.height(), 0);
-    features_suffix_.clear();
-    kps_suffix_.clear();
-    features_suffix_.resize(C_.w);
-    kps_suffix_.resize(C_.w);
   }
 
   void set_device() {
-    CUDA_PROTECT({ CU_CHECK(cudaSetDevice(device_.id)); });
+    CU_CHECK(cudaSetDevice(device_.id));
     cvc::setDevice(device_.id);
   }
 
 protected:
-  void execute(const StenciledColumns& input_columns,
-               Columns& output_columns) override {
+  void execute(const StenciledBatchedColumns& input_columns,
+               BatchedColumns& output_columns) override {
     set_device();
 
     auto& features_col = input_columns[0];
     auto& keypoints_col = input_columns[1];
     auto& frame_info_col = input_columns[2];
-    check_frame_info(device_, frame_info_col[0]);
+    check_frame_info(device_, frame_info_col[0][0]);
 
-    i32 window_size = features_col.size();
+    i32 input_count = (i32)features_col.size();
+    i32 window_size = (i32)features_col[0].size();
 
-    std::vector<cvc::GpuMat> features;
+    // Overlapping windows reference the same elements, so each distinct
+    // frame of the batch is parsed once
+    std::unordered_map<const u8*, i32> frame_ids;
     std::vector<std::vector<proto::Keypoint>> kps;
-
-    for (i32 i = 0; i < window_size; ++i) {
-      size_t size = keypoints_col[i].size;
-      u8* buf = new_buffer(CPU_DEVICE, size);
-      memcpy_buffer(buf, CPU_DEVICE, keypoints_col[i].buffer, device_,
-                    size);
-      std::vector<proto::Keypoint> kp =
-        deserialize_proto_vector<proto::Keypoint>(buf, size);
-      kps.push_back(kp);
-
-      size = features_col[i].size;
-      if (kp.size() == 0) {
-        features.push_back(cvc::GpuMat());
-      } else {
-        i32 step = size / kp.size();
-        i32 cols;
-        if (kp.size() == 1) {
-          cols = step / sizeof(f32);
-        } else {
-          cols = step / (sizeof(f32) * 2);
+    std::vector<DescriptorPair> descriptors;
+    std::vector<std::vector<i32>> window_ids(input_count,
+                                             std::vector<i32>(window_size));
+    for (i32 r = 0; r < input_count; ++r) {
+      for (i32 i = 0; i < window_size; ++i) {
+        const Element& kp_element = keypoints_col[r][i];
+        auto it = frame_ids.find(kp_element.buffer);
+        if (it != frame_ids.end()) {
+          window_ids[r][i] = it->second;
+          continue;
         }
-        LOG_IF(FATAL, cols != 64) << "Not 64 cols: " << cols;
-        features.push_back(cvc::GpuMat(kp.size(), cols, CV_32F,
-                                       features_col[i].buffer, step));
+        i32 id = (i32)kps.size();
+        frame_ids[kp_element.buffer] = id;
+        window_ids[r][i] = id;
+
+        size_t size = kp_element.size;
+        u8* buf = new_buffer(CPU_DEVICE, size);
+        memcpy_buffer(buf, CPU_DEVICE, kp_element.buffer, device_, size);
+        kps.push_back(deserialize_proto_vector<proto::Keypoint>(buf, size));
+        delete_buffer(CPU_DEVICE, buf);
+        const std::vector<proto::Keypoint>& kp = kps.back();
+
+        DescriptorPair d = {};
+        if (kp.size() > 0) {
+          size = features_col[r][i].size;
+          i32 step = size / kp.size();
+          i32 cols;
+          if (kp.size() == 1) {
+            cols = step / sizeof(f32);
+          } else {
+            cols = step / (sizeof(f32) * 2);
+          }
+          LOG_IF(FATAL, cols != 64) << "Not 64 cols: " << cols;
+          d.query = (const f32*)features_col[r][i].buffer;
+          d.query_step = step / sizeof(f32);
+          d.query_count = kp.size();
+        }
+        descriptors.push_back(d);
       }
     }
 
-    size_t size = window_size * sizeof(f32);
-    f32* cost_buf = (f32*)new_buffer(CPU_DEVICE, size);
-
-    std::vector<std::vector<cv::DMatch>> matches;
-    matches.resize(window_size);
-    for (i32 j = 1; j < window_size; j++) {
-      if (kps[0].size() == 0 || kps[j].size() == 0) {
-        continue;
+    // Pair the first frame of every window with each of its other frames
+    std::vector<DescriptorPair> pairs;
+    std::vector<std::vector<i32>> pair_idx(input_count,
+                                           std::vector<i32>(window_size, -1));
+    i32 total_matches = 0;
+    i32 max_query_count = 0;
+    for (i32 r = 0; r < input_count; ++r) {
+      const DescriptorPair& query = descriptors[window_ids[r][0]];
+      for (i32 j = 1; j < window_size; j++) {
+        const DescriptorPair& train = descriptors[window_ids[r][j]];
+        if (query.query_count == 0 || train.query_count == 0) {
+          continue;
+        }
+        DescriptorPair pair = query;
+        pair.train = train.query;
+        pair.train_step = train.query_step;
+        pair.train_count = train.query_count;
+        pair.out_offset = total_matches;
+        pair_idx[r][j] = pairs.size();
+        pairs.push_back(pair);
+        total_matches += pair.query_count;
+        max_query_count = std::max(max_query_count, pair.query_count);
       }
-      matcher_->match(features[0], features[j], matches[j]);
     }
 
-#pragma omp parallel for
-    for (i32 j = 1; j < window_size; j++) {
-      f32 cost = match_cost(kps[0], kps[j], matches[j]);
-      cost_buf[j] = cost;
+    std::vector<i32> train_idx(total_matches);
+    std::vector<f32> distances(total_matches);
+    if (!pairs.empty()) {
+      size_t pairs_bytes = sizeof(DescriptorPair) * pairs.size();
+      size_t idx_bytes = sizeof(i32) * total_matches;
+      size_t dist_bytes = sizeof(f32) * total_matches;
+      u8* table = new_buffer(device_, pairs_bytes + idx_bytes + dist_bytes);
+      i32* dev_idx = (i32*)(table + pairs_bytes);
+      f32* dev_dist = (f32*)(table + pairs_bytes + idx_bytes);
+      CU_CHECK(cudaMemcpyAsync(table, pairs.data(), pairs_bytes,
+                               cudaMemcpyHostToDevice, stream_));
+      CU_CHECK(matchDescriptorsBatch((const DescriptorPair*)table,
+                                     pairs.size(), max_query_count, dev_idx,
+                                     dev_dist, stream_));
+      CU_CHECK(cudaMemcpyAsync(train_idx.data(), dev_idx, idx_bytes,
+                               cudaMemcpyDeviceToHost, stream_));
+      CU_CHECK(cudaMemcpyAsync(distances.data(), dev_dist, dist_bytes,
+                               cudaMemcpyDeviceToHost, stream_));
+      CU_CHECK(cudaStreamSynchronize(stream_));
+      delete_buffer(device_, table);
     }
 
-    if (device_.type == DeviceType::GPU) {
-      u8* gpu_buf = new_buffer(device_, size);
-      memcpy_buffer(gpu_buf, device_, (u8*) cost_buf, CPU_DEVICE, size);
-      delete_buffer(CPU_DEVICE, (u8*) cost_buf);
-      cost_buf = (f32*) gpu_buf;
+    std::vector<f32> costs(input_count * window_size);
+
+#pragma omp parallel for collapse(2) schedule(dynamic)
+    for (i32 r = 0; r < input_count; ++r) {
+      for (i32 j = 1; j < window_size; j++) {
+        std::vector<cv::DMatch> matches;
+        i32 p = pair_idx[r][j];
+        if (p >= 0) {
+          const DescriptorPair& pair = pairs[p];
+          matches.reserve(pair.query_count);
+          for (i32 q = 0; q < pair.query_count; ++q) {
+            matches.emplace_back(q, train_idx[pair.out_offset + q],
+                                 distances[pair.out_offset + q]);
+          }
+        }
+        costs[r * window_size + j] = match_cost(
+            kps[window_ids[r][0]], kps[window_ids[r][j]], matches);
+      }
     }
 
-    insert_element(output_columns[0], (u8*) cost_buf, size);
+    size_t size = window_size * sizeof(f32);
+    u8* output_block =
+        new_block_buffer(device_, size * input_count, input_count);
+    memcpy_buffer(output_block, device_, (u8*)costs.data(), CPU_DEVICE,
+                  size * input_count);
+
+    for (i32 r = 0; r < input_count; ++r) {
+      insert_element(output_columns[0], output_block + r * size, size);
+    }
   }
 
  private:
@@ -146,9 +217,9 @@ protected:
     return mean(sq)[0];
   }
 
-  float match_cost(std::vector<proto::Keypoint>& kp1,
-                   std::vector<proto::Keypoint>& kp2,
-                   std::vector<cv::DMatch>& matches) {
+  float match_cost(const std::vector<proto::Keypoint>& kp1,
+                   const std::vector<proto::Keypoint>& kp2,
+                   const std::vector<cv::DMatch>& matches) {
     if (matches.size() == 0) {
       return C_.gamma;
     }
@@ -201,9 +272,7 @@ protected:
 
   DeviceHandle device_;
   Constants C_;
-  cv::Ptr<cvc::DescriptorMatcher> matcher_;
-  std::vector<cvc::GpuMat> features_suffix_;
-  std::vector<std::vector<proto::Keypoint>> kps_suffix_;
+  cudaStream_t stream_;
 };
 
 REGISTER_OP(FeatureMatcher)
@@ -215,5 +284,6 @@ REGISTER_OP(FeatureMatcher)
 
 REGISTER_KERNEL(FeatureMatcher, FeatureMatcherKernel)
     .device(DeviceType::GPU)
+    .batch()
     .num_devices(1);
 }
@@ -15,67 +15,126 @@
 
 #include "scanner/api/kernel.h"
 #include "scanner/api/op.h"
+#include "scanner/util/cpu_isa.h"
 #include "scanner/util/memory.h"
 #include "stdlib/stdlib.pb.h"
 
-#include <cmath>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef SCANNER_ISA_DISPATCH
+#include <immintrin.h>
+#endif
 
 namespace scanner {
+namespace {
+// |a - b| of each byte, which can not overflow a byte
+void abs_diff_row(const u8* a, const u8* b, u8* out, i32 bytes) {
+  i32 i = 0;
+#ifdef __SSE2__
+  for (; i + 16 <= bytes; i += 16) {
+    __m128i va = _mm_loadu_si128((const __m128i*)(a + i));
+    __m128i vb = _mm_loadu_si128((const __m128i*)(b + i));
+    __m128i diff =
+        _mm_or_si128(_mm_subs_epu8(va, vb), _mm_subs_epu8(vb, va));
+    _mm_storeu_si128((__m128i*)(out + i), diff);
+  }
+#endif
+  for (; i < bytes; ++i) {
+    out[i] = a[i] > b[i] ? a[i] - b[i] : b[i] - a[i];
+  }
+}
 
-class FrameDifferenceKernel : public StenciledKernel {
- public:
-  BlurKernel(const KernelConfig& config) : StenciledKernel(config) {
-    valid_.set_success(true);
+using AbsDiffRowFn = void (*)(const u8*, const u8*, u8*, i32);
+
+#ifdef SCANNER_ISA_DISPATCH
+SCANNER_TARGET_AVX2
+void abs_diff_row_avx2(const u8* a, const u8* b, u8* out, i32 bytes) {
+  i32 i = 0;
+  for (; i + 32 <= bytes; i += 32) {
+    __m256i va = _mm256_loadu_si256((const __m256i*)(a + i));
+    __m256i vb = _mm256_loadu_si256((const __m256i*)(b + i));
+    __m256i diff =
+        _mm256_or_si256(_mm256_subs_epu8(va, vb), _mm256_subs_epu8(vb, va));
+    _mm256_storeu_si256((__m256i*)(out + i), diff);
   }
+  abs_diff_row(a + i, b + i, out + i, bytes - i);
+}
 
-  void validate(Result* result) override {
-    result->CopyFrom(valid_);
+SCANNER_TARGET_AVX512
+void abs_diff_row_avx512(const u8* a, const u8* b, u8* out, i32 bytes) {
+  i32 i = 0;
+  for (; i + 64 <= bytes; i += 64) {
+    __m512i va = _mm512_loadu_si512((const void*)(a + i));
+    __m512i vb = _mm512_loadu_si512((const void*)(b + i));
+    __m512i diff =
+        _mm512_or_si512(_mm512_subs_epu8(va, vb), _mm512_subs_epu8(vb, va));
+    _mm512_storeu_si512((void*)(out + i), diff);
   }
+  abs_diff_row(a + i, b + i, out + i, bytes - i);
+}
+#endif
 
-  void new_frame_info() {
-    frame_width_ = frame_info_.width();
-    frame_height_ = frame_info_.height();
+AbsDiffRowFn select_abs_diff_row() {
+#ifdef SCANNER_ISA_DISPATCH
+  switch (cpu_isa()) {
+    case CPUISA::AVX512:
+      return abs_diff_row_avx512;
+    case CPUISA::AVX2:
+      return abs_diff_row_avx2;
+    default:
+      break;
   }
+#endif
+  return abs_diff_row;
+}
+}
 
-  void execute(const StenciledColumns& input_columns,
-               Columns& output_columns) override {
-    auto& frame_col = input_columns[0];
-    check_frame(CPU_DEVICE, frame_col);
+// Absolute difference between each frame and the one before it
+class FrameDifferenceKernel : public StenciledBatchedKernel {
+ public:
+  FrameDifferenceKernel(const KernelConfig& config)
+    : StenciledBatchedKernel(config), abs_diff_row_(select_abs_diff_row()) {}
 
-    FrameInfo info = frame_col.as_const_frame()->as_frame_info();
-    i32 width = info.width();
-    i32 height = info.height();
-    i32 channels = info.channels();
-    size_t frame_size = width * height * channels * sizeof(u8);
+  void execute(const StenciledBatchedColumns& input_columns,
+               BatchedColumns& output_columns) override {
+    auto& frame_col = input_columns[0];
+    i32 input_count = (i32)frame_col.size();
 
-    const u8* secondary_frame_buffer = frame_col[0].as_const_frame()->data;
-    const u8* primary_frame_buffer = frame_col[1].as_const_frame()->data;
+    FrameInfo info = frame_col[0][1].as_const_frame()->as_frame_info();
+    std::vector<Frame*> output_frames =
+        new_frames(CPU_DEVICE, info, input_count);
 
-    Frame* output_frame = new_frame(CPU_DEVICE, info);
-    u8* output_buffer = output_frame->data;
-    for (i32 y = 0; y < height; ++y) {
-      for (i32 x = 0; x < width; ++x) {
-        for (i32 c = 0; c < channels; ++c) {
-          i64 offset = y * width * channels + width * channels + c;
-          output_buffer[offset] =
-              primary_frame_buffer[offset] - secondary_frame_buffer[offset]
-        }
+#pragma omp parallel for
+    for (i32 i = 0; i < input_count; ++i) {
+      const Frame* previous = frame_col[i][0].as_const_frame();
+      const Frame* current = frame_col[i][1].as_const_frame();
+      Frame* output = output_frames[i];
+      i32 row_bytes = output->row_size();
+      for (i32 y = 0; y < output->height(); ++y) {
+        abs_diff_row_(current->data + y * current->row_stride,
+                      previous->data + y * previous->row_stride,
+                      output->data + y * output->row_stride, row_bytes);
       }
     }
-    insert_frame(output_columns[0], output_frame);
+
+    for (Frame* output : output_frames) {
+      insert_frame(output_columns[0], output);
+    }
   }
 
  private:
-  i32 frame_width_;
-  i32 frame_height_;
-  Result valid_;
+  // Widest variant the node's CPU runs
+  AbsDiffRowFn abs_diff_row_;
 };
 
-REGISTER_OP(FrameDifference).frame_input("frame").frame_output("frame");
+REGISTER_OP(FrameDifference)
+    .frame_input("frame")
+    .frame_output("frame")
+    .stencil({-1, 0});
 
 REGISTER_KERNEL(FrameDifference, FrameDifferenceKernel)
-.device(DeviceType::CPU)
-.batch();
-.stencil({-1, 0});
-.num_devices(1);
+    .device(DeviceType::CPU)
+    .batch()
+    .num_devices(1);
 }
@@ -0,0 +1,74 @@
+#include "scanner/api/kernel.h"
+#include "scanner/api/op.h"
+#include "scanner/util/cuda.h"
+#include "scanner/util/image.h"
+#include "scanner/util/memory.h"
+
+namespace scanner {
+
+// Differences a whole batch of stencils with one kernel launch
+class FrameDifferenceKernelGPU : public StenciledBatchedKernel {
+ public:
+  FrameDifferenceKernelGPU(const KernelConfig& config)
+    : StenciledBatchedKernel(config), device_(config.devices[0]) {
+    set_device();
+    CU_CHECK(cudaStreamCreateWithFlags(&stream_, cudaStreamNonBlocking));
+  }
+
+  ~FrameDifferenceKernelGPU() {
+    set_device();
+    cudaStreamDestroy(stream_);
+  }
+
+  void execute(const StenciledBatchedColumns& input_columns,
+               BatchedColumns& output_columns) override {
+    set_device();
+    auto& frame_col = input_columns[0];
+    i32 input_count = (i32)frame_col.size();
+
+    FrameInfo info = frame_col[0][1].as_const_frame()->as_frame_info();
+    std::vector<Frame*> output_frames = new_frames(device_, info, input_count);
+
+    // Current and previous frame of each row, one after the other
+    std::vector<const u8*> frames(input_count * 2);
+    std::vector<size_t> pitches(input_count * 2);
+    for (i32 i = 0; i < input_count; ++i) {
+      const Frame* current = frame_col[i][1].as_const_frame();
+      const Frame* previous = frame_col[i][0].as_const_frame();
+      frames[i * 2] = current->data;
+      pitches[i * 2] = current->row_stride;
+      frames[i * 2 + 1] = previous->data;
+      pitches[i * 2 + 1] = previous->row_stride;
+    }
+
+    size_t frames_bytes = sizeof(u8*) * frames.size();
+    size_t pitches_bytes = sizeof(size_t) * pitches.size();
+    u8* table = new_buffer(device_, frames_bytes + pitches_bytes);
+    CU_CHECK(cudaMemcpyAsync(table, frames.data(), frames_bytes,
+                             cudaMemcpyHostToDevice, stream_));
+    CU_CHECK(cudaMemcpyAsync(table + frames_bytes, pitches.data(),
+                             pitches_bytes, cudaMemcpyHostToDevice, stream_));
+    CU_CHECK(absDiffBatch((const u8* const*)table,
+                          (const size_t*)(table + frames_bytes),
+                          output_frames[0]->row_size(), info.height(),
+                          input_count, output_frames[0]->data, stream_));
+    CU_CHECK(cudaStreamSynchronize(stream_));
+    delete_buffer(device_, table);
+
+    for (Frame* output : output_frames) {
+      insert_frame(output_columns[0], output);
+    }
+  }
+
+  void set_device() { CU_CHECK(cudaSetDevice(device_.id)); }
+
+ private:
+  DeviceHandle device_;
+  cudaStream_t stream_;
+};
+
+REGISTER_KERNEL(FrameDifference, FrameDifferenceKernelGPU)
+    .device(DeviceType::GPU)
+    .batch()
+    .num_devices(1);
+}
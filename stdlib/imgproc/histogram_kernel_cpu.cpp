@@ -1,52 +1,197 @@
 #include "scanner/api/kernel.h"
 #include "scanner/api/op.h"
+#include "scanner/util/cpu_isa.h"
 #include "scanner/util/memory.h"
 #include "scanner/util/opencv.h"
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef SCANNER_ISA_DISPATCH
+#include <immintrin.h>
+#endif
+
 namespace scanner {
 namespace {
 const i32 BINS = 16;
+const i32 CHANNELS = 3;
+// Bins of every channel counted together, indexed by channel * BINS + bin
+const i32 TOTAL_BINS = CHANNELS * BINS;
+// Consecutive bytes land in different copies of the histogram, so runs of
+// pixels with the same color do not wait on one counter
+const i32 SUB_HISTOGRAMS = 4;
+
+// 16 uniform bins over [0, 256) are the top four bits of each value
+inline u8 bin_of(u8 value) { return value >> 4; }
+
+// Counts one row of interleaved 3 channel U8 pixels
+void count_row(const u8* row, i32 bytes,
+               u32 hists[SUB_HISTOGRAMS][TOTAL_BINS]) {
+  i32 b = 0;
+#ifdef __SSE2__
+  // 48 bytes hold 16 whole pixels, so the channel of each byte follows the
+  // same pattern in every chunk. Offsets move each byte's bin into its
+  // channel's range.
+  alignas(16) u8 offsets[48];
+  for (i32 i = 0; i < 48; ++i) {
+    offsets[i] = (i % CHANNELS) * BINS;
+  }
+  const __m128i low_bits = _mm_set1_epi8(0x0F);
+  const __m128i offset_vecs[3] = {
+      _mm_load_si128((const __m128i*)(offsets)),
+      _mm_load_si128((const __m128i*)(offsets + 16)),
+      _mm_load_si128((const __m128i*)(offsets + 32))};
+  alignas(16) u8 idx[48];
+  for (; b + 48 <= bytes; b += 48) {
+    for (i32 v = 0; v < 3; ++v) {
+      __m128i px = _mm_loadu_si128((const __m128i*)(row + b + v * 16));
+      __m128i bins = _mm_and_si128(_mm_srli_epi16(px, 4), low_bits);
+      _mm_store_si128((__m128i*)(idx + v * 16),
+                      _mm_add_epi8(bins, offset_vecs[v]));
+    }
+    for (i32 i = 0; i < 48; i += SUB_HISTOGRAMS) {
+      hists[0][idx[i]]++;
+      hists[1][idx[i + 1]]++;
+      hists[2][idx[i + 2]]++;
+      hists[3][idx[i + 3]]++;
+    }
+  }
+#endif
+  for (; b < bytes; ++b) {
+    hists[b % SUB_HISTOGRAMS][(b % CHANNELS) * BINS + bin_of(row[b])]++;
+  }
 }
 
+using CountRowFn = void (*)(const u8*, i32, u32[SUB_HISTOGRAMS][TOTAL_BINS]);
+
+#ifdef SCANNER_ISA_DISPATCH
+// Wider variants take chunks of a multiple of 48 bytes, so chunks still
+// start on the first channel and sub-histogram, and leave the rest of the
+// row to count_row
+SCANNER_TARGET_AVX2
+void count_row_avx2(const u8* row, i32 bytes,
+                    u32 hists[SUB_HISTOGRAMS][TOTAL_BINS]) {
+  alignas(32) u8 offsets[96];
+  for (i32 i = 0; i < 96; ++i) {
+    offsets[i] = (i % CHANNELS) * BINS;
+  }
+  const __m256i low_bits = _mm256_set1_epi8(0x0F);
+  alignas(32) u8 idx[96];
+  i32 b = 0;
+  for (; b + 96 <= bytes; b += 96) {
+    for (i32 v = 0; v < 3; ++v) {
+      __m256i px = _mm256_loadu_si256((const __m256i*)(row + b + v * 32));
+      __m256i bins = _mm256_and_si256(_mm256_srli_epi16(px, 4), low_bits);
+      __m256i offset = _mm256_load_si256((const __m256i*)(offsets + v * 32));
+      _mm256_store_si256((__m256i*)(idx + v * 32),
+                         _mm256_add_epi8(bins, offset));
+    }
+    for (i32 i = 0; i < 96; i += SUB_HISTOGRAMS) {
+      hists[0][idx[i]]++;
+      hists[1][idx[i + 1]]++;
+      hists[2][idx[i + 2]]++;
+      hists[3][idx[i + 3]]++;
+    }
+  }
+  count_row(row + b, bytes - b, hists);
+}
+
+SCANNER_TARGET_AVX512
+void count_row_avx512(const u8* row, i32 bytes,
+                      u32 hists[SUB_HISTOGRAMS][TOTAL_BINS]) {
+  alignas(64) u8 offsets[192];
+  for (i32 i = 0; i < 192; ++i) {
+    offsets[i] = (i % CHANNELS) * BINS;
+  }
+  const __m512i low_bits = _mm512_set1_epi8(0x0F);
+  alignas(64) u8 idx[192];
+  i32 b = 0;
+  for (; b + 192 <= bytes; b += 192) {
+    for (i32 v = 0; v < 3; ++v) {
+      __m512i px = _mm512_loadu_si512((const void*)(row + b + v * 64));
+      __m512i bins = _mm512_and_si512(_mm512_srli_epi16(px, 4), low_bits);
+      __m512i offset = _mm512_load_si512((const void*)(offsets + v * 64));
+      _mm512_store_si512((void*)(idx + v * 64),
+                         _mm512_add_epi8(bins, offset));
+    }
+    for (i32 i = 0; i < 192; i += SUB_HISTOGRAMS) {
+      hists[0][idx[i]]++;
+      hists[1][idx[i + 1]]++;
+      hists[2][idx[i + 2]]++;
+      hists[3][idx[i + 3]]++;
+    }
+  }
+  count_row(row + b, bytes - b, hists);
+}
+#endif
+
+CountRowFn select_count_row() {
+#ifdef SCANNER_ISA_DISPATCH
+  switch (cpu_isa()) {
+    case CPUISA::AVX512:
+      return count_row_avx512;
+    case CPUISA::AVX2:
+      return count_row_avx2;
+    default:
+      break;
+  }
+#endif
+  return count_row;
+}
+}
+
+// Counts all three channels in a single pass over each frame, instead of
+// one cv::calcHist per channel, and spreads the frames of a batch over the
+// worker's threads
 class HistogramKernelCPU : public BatchedKernel {
  public:
   HistogramKernelCPU(const KernelConfig& config)
-    : BatchedKernel(config), device_(config.devices[0]) {}
+    : BatchedKernel(config),
+      device_(config.devices[0]),
+      count_row_(select_count_row()) {}
 
   void execute(const BatchedColumns& input_columns,
                BatchedColumns& output_columns) override {
     auto& frame_col = input_columns[0];
 
-    size_t hist_size = BINS * 3 * sizeof(int);
+    size_t hist_size = BINS * CHANNELS * sizeof(int);
     i32 input_count = num_rows(frame_col);
     u8* output_block =
         new_block_buffer(device_, hist_size * input_count, input_count);
 
+#pragma omp parallel for
     for (i32 i = 0; i < input_count; ++i) {
-      cv::Mat img = frame_to_mat(frame_col[i].as_const_frame());
-
-      float range[] = {0, 256};
-      const float* histRange = {range};
-
-      u8* output_buf = output_block + i * hist_size;
-
-      for (i32 j = 0; j < 3; ++j) {
-        int channels[] = {j};
-        cv::Mat hist;
-        cv::calcHist(&img, 1, channels, cv::Mat(),
-                     hist,
-                     1, &BINS,
-                     &histRange);
-        cv::Mat out(BINS, 1, CV_32SC1, output_buf + j * BINS * sizeof(int));
-        hist.convertTo(out, CV_32SC1);
+      const Frame* frame = frame_col[i].as_const_frame();
+      LOG_IF(FATAL, frame->type != FrameType::U8 ||
+                        frame->channels() != CHANNELS)
+          << "Histogram expects 3 channel U8 frames";
+
+      u32 hists[SUB_HISTOGRAMS][TOTAL_BINS] = {};
+      i32 row_bytes = frame->width() * CHANNELS;
+      for (i32 y = 0; y < frame->height(); ++y) {
+        count_row_(frame->data + y * frame->row_stride, row_bytes, hists);
       }
 
-      insert_element(output_columns[0], output_buf, hist_size);
+      int* out = (int*)(output_block + i * hist_size);
+      for (i32 j = 0; j < TOTAL_BINS; ++j) {
+        u32 count = 0;
+        for (i32 s = 0; s < SUB_HISTOGRAMS; ++s) {
+          count += hists[s][j];
+        }
+        out[j] = count;
+      }
+    }
+
+    for (i32 i = 0; i < input_count; ++i) {
+      insert_element(output_columns[0], output_block + i * hist_size,
+                     hist_size);
     }
   }
 
  private:
   DeviceHandle device_;
+  // Widest variant the node's CPU runs
+  CountRowFn count_row_;
 };
 
 REGISTER_OP(Histogram).frame_input("frame").output("histogram");
@@ -54,6 +199,6 @@ REGISTER_OP(Histogram).frame_input("frame").output("histogram");
 REGISTER_KERNEL(Histogram, HistogramKernelCPU)
     .device(DeviceType::CPU)
     .batch()
-    .num_devices(1);
+    .num_devices(1)
+    .fusable();
 }
-
@@ -1,79 +1,71 @@
 #include "scanner/api/kernel.h"
 #include "scanner/api/op.h"
 #include "scanner/util/cuda.h"
+#include "scanner/util/image.h"
 #include "scanner/util/memory.h"
-#include "scanner/util/opencv.h"
 
 namespace scanner {
 namespace {
 const i32 BINS = 16;
 }
 
-class HistogramKernelGPU : public BatchedKernel, public VideoKernel {
+// Counts the histograms of a whole batch with a single kernel launch
+class HistogramKernelGPU : public BatchedKernel {
  public:
   HistogramKernelGPU(const KernelConfig& config)
-    : BatchedKernel(config),
-      device_(config.devices[0]),
-      num_cuda_streams_(32),
-      streams_(num_cuda_streams_) {}
-
-  void new_frame_info() override {
-    set_device();
-    streams_.resize(0);
-    streams_.resize(num_cuda_streams_);
-    planes_.clear();
-    for (i32 i = 0; i < 3; ++i) {
-      planes_.push_back(
-          cvc::GpuMat(frame_info_.width(), frame_info_.height(), CV_8UC1));
-    }
-  }
+    : BatchedKernel(config), device_(config.devices[0]) {}
 
   void execute(const BatchedColumns& input_columns,
                BatchedColumns& output_columns) override {
     auto& frame_col = input_columns[0];
 
     set_device();
-    check_frame(device_, frame_col[0]);
+    // The runtime's stream for this kernel
+    cudaStream_t stream = (cudaStream_t)stream_;
 
-    size_t hist_size = BINS * 3 * sizeof(float);
+    size_t hist_size = BINS * 3 * sizeof(i32);
     i32 input_count = num_rows(frame_col);
     u8* output_block =
         new_block_buffer(device_, hist_size * input_count, input_count);
 
+    const Frame* first = frame_col[0].as_const_frame();
+    std::vector<const u8*> frames(input_count);
+    std::vector<size_t> pitches(input_count);
     for (i32 i = 0; i < input_count; ++i) {
-      i32 sid = i % num_cuda_streams_;
-      cv::cuda::Stream& s = streams_[sid];
-
-      // TODO(wcrichto): implement correctly w/ streams
-      cvc::GpuMat img = frame_to_gpu_mat(frame_col[i].as_const_frame());
-      cvc::split(img, planes_);
-
-      u8* output_buf = output_block + i * hist_size;
-      cvc::GpuMat out_mat(1, BINS * 3, CV_32S, output_buf);
-
-      for (i32 j = 0; j < 3; ++j) {
-        cvc::histEven(planes_[j], out_mat(cv::Rect(j * BINS, 0, BINS, 1)), BINS,
-                      0, 256);
-      }
-
-      insert_element(output_columns[0], output_buf, hist_size);
+      const Frame* frame = frame_col[i].as_const_frame();
+      LOG_IF(FATAL, frame->width() != first->width() ||
+                        frame->height() != first->height() ||
+                        frame->channels() != 3 || frame->type != FrameType::U8)
+          << "Histogram expects a batch of same sized 3 channel U8 frames";
+      frames[i] = frame->data;
+      pitches[i] = frame->row_stride;
     }
 
-    for (cv::cuda::Stream& s : streams_) {
-      s.waitForCompletion();
+    // The frame table lives on the device for the length of the launch
+    size_t frames_bytes = sizeof(u8*) * input_count;
+    size_t pitches_bytes = sizeof(size_t) * input_count;
+    u8* table = new_buffer(device_, frames_bytes + pitches_bytes);
+    CU_CHECK(cudaMemcpyAsync(table, frames.data(), frames_bytes,
+                             cudaMemcpyHostToDevice, stream));
+    CU_CHECK(cudaMemcpyAsync(table + frames_bytes, pitches.data(),
+                             pitches_bytes, cudaMemcpyHostToDevice, stream));
+    CU_CHECK(histogramBatch((const u8* const*)table,
+                            (const size_t*)(table + frames_bytes),
+                            first->width(), first->height(), input_count,
+                            (i32*)output_block, stream));
+    CU_CHECK(cudaStreamSynchronize(stream));
+    delete_buffer(device_, table);
+
+    for (i32 i = 0; i < input_count; ++i) {
+      insert_element(output_columns[0], output_block + i * hist_size,
+                     hist_size);
     }
   }
 
-  void set_device() {
-    CUDA_PROTECT({ CU_CHECK(cudaSetDevice(device_.id)); });
-    cvc::setDevice(device_.id);
-  }
+  void set_device() { CU_CHECK(cudaSetDevice(device_.id)); }
 
  private:
   DeviceHandle device_;
-  i32 num_cuda_streams_;
-  std::vector<cv::cuda::Stream> streams_;
-  std::vector<cvc::GpuMat> planes_;
 };
 
 REGISTER_KERNEL(Histogram, HistogramKernelGPU)
@@ -15,9 +15,9 @@ class ImageDecoderKernelCPU : public BatchedKernel {
     i32 input_count = num_rows(input_columns[0]);
 
     for (i32 i = 0; i < input_count; ++i) {
-      std::vector<u8> input_buf(
-        input_columns[0][i].buffer,
-        input_columns[0][i].buffer + input_columns[0][i].size);
+      // Decode straight from the element instead of copying it first
+      const Element& element = input_columns[0][i];
+      cv::Mat input_buf(1, element.size, CV_8UC1, element.buffer);
       cv::Mat img = cv::imdecode(input_buf, CV_LOAD_IMAGE_COLOR);
       LOG_IF(FATAL, img.empty() || !img.data) << "Failed to decode image";
       size_t size = img.total() * img.elemSize();
@@ -32,5 +32,6 @@ REGISTER_OP(ImageDecoder).input("img").frame_output("frame");
 
 REGISTER_KERNEL(ImageDecoder, ImageDecoderKernelCPU)
     .device(DeviceType::CPU)
+    .batch()
     .num_devices(1);
 }
@@ -1,105 +1,118 @@
 #include "scanner/api/kernel.h"
 #include "scanner/api/op.h"
-#include "scanner/util/memory.h"
-#include "scanner/util/opencv.h"
 #include "scanner/util/cuda.h"
+#include "scanner/util/memory.h"
 #include "stdlib/stdlib.pb.h"
 
-namespace scanner {
-
-namespace codec = cv::cudacodec;
-
-class ImageSource : public codec::RawVideoSource {
-public:
-  ImageSource(const BatchedColumns& input_columns, const cv::Mat& img)
-    : input_columns_(input_columns), img_(img) {}
-
-  bool getNextPacket(unsigned char** data, int* size, bool* endOfFile) override {
-    const Element& element = input_columns_[0][i_];
-    *data = element.buffer;
-    *size = element.size;
-    *endOfFile = false;
-    // Theoretically we should be able to set endOfFile to true at the last
-    // frame, but the OpenCV VideoReader appears to return false on a valid
-    // nextFrame request if I do this, so instead I just keep feeding packets
-    // until the loader thread dies.
-    i_ = (i_ + 1) % input_columns_[0].size();
-    return true;
-  }
+#include <nvjpeg.h>
+#include <thread>
 
-  codec::FormatInfo format() const override {
-    codec::FormatInfo format_info;
-    format_info.codec = codec::Codec::JPEG;
-    format_info.chromaFormat = codec::ChromaFormat::YUV420;
-    format_info.width = img_.cols;
-    format_info.height = img_.rows;
-    return format_info;
+#define NVJPEG_CHECK(expr)                                                \
+  {                                                                       \
+    nvjpegStatus_t status = (expr);                                       \
+    LOG_IF(FATAL, status != NVJPEG_STATUS_SUCCESS)                        \
+        << "nvJPEG error " << status << " in " << #expr;                  \
   }
 
-private:
-  int i_ = 0;
-  const cv::Mat& img_;
-  const BatchedColumns& input_columns_;
-};
+namespace scanner {
 
-class ImageDecoderKernelGPU : public Kernel {
+// Decodes every JPEG of a batch with a single nvJPEG batched decode, so the
+// Huffman decoding of the batch is spread over host threads while the IDCT
+// and color conversion of all its images run together on the GPU
+class ImageDecoderKernelGPU : public BatchedKernel {
  public:
-  ImageDecoderKernelGPU(const Kernel::Config& config)
-    : Kernel(config), device_(config.devices[0]) {
+  ImageDecoderKernelGPU(const KernelConfig& config)
+    : BatchedKernel(config), device_(config.devices[0]) {
     if (!args_.ParseFromArray(config.args.data(), config.args.size())) {
       LOG(FATAL) << "Failed to parse args";
     }
+    LOG_IF(FATAL, args_.image_type() != proto::ImageDecoderArgs_ImageType_JPEG)
+        << "GPU image decoding only supports JPEG images";
+
+    set_device();
+    CU_CHECK(cudaStreamCreateWithFlags(&stream_, cudaStreamNonBlocking));
+    NVJPEG_CHECK(nvjpegCreateSimple(&handle_));
+    NVJPEG_CHECK(nvjpegJpegStateCreate(handle_, &state_));
+  }
+
+  ~ImageDecoderKernelGPU() {
+    set_device();
+    nvjpegJpegStateDestroy(state_);
+    nvjpegDestroy(handle_);
+    cudaStreamDestroy(stream_);
   }
 
   void execute(const BatchedColumns& input_columns,
                BatchedColumns& output_columns) override {
-    i32 input_count = num_rows(input_columns[0]);
+    const ElementList& img_col = input_columns[0];
+    i32 input_count = num_rows(img_col);
 
     set_device();
 
-    // Assumes all images are the same size
-    size_t sz = input_columns[0][0].size;
-    u8* cpu_buf = new_buffer(CPU_DEVICE, sz);
-    memcpy_buffer(cpu_buf, CPU_DEVICE, input_columns[0][0].buffer,
-                  device_, sz);
-    std::vector<u8> input_buf(cpu_buf, cpu_buf + sz);
-    cv::Mat img = cv::imdecode(input_buf, CV_LOAD_IMAGE_COLOR);
-    FrameInfo frame_info(img.rows, img.cols, 3, FrameType::U8);
-    delete_buffer(CPU_DEVICE, cpu_buf);
-
-    proto::ImageDecoderArgs_ImageType image_type = args_.image_type();
-    std::vector<Frame*> frames = new_frames(device_, frame_info, input_count);
-
-    cv::Ptr<codec::RawVideoSource> src =
-      cv::Ptr<codec::RawVideoSource>(new ImageSource(input_columns, img));
-    cv::Ptr<codec::VideoReader> d_reader = codec::createVideoReader(src);
+    // nvJPEG parses the bitstreams on the host
+    std::vector<u8*> src_buffers(input_count);
+    std::vector<u8*> host_buffers(input_count);
+    std::vector<size_t> sizes(input_count);
+    size_t total_size = 0;
+    for (i32 i = 0; i < input_count; ++i) {
+      src_buffers[i] = img_col[i].buffer;
+      sizes[i] = img_col[i].size;
+      total_size += sizes[i];
+    }
+    u8* host_block = new_buffer(CPU_DEVICE, total_size);
+    size_t offset = 0;
+    for (i32 i = 0; i < input_count; ++i) {
+      host_buffers[i] = host_block + offset;
+      offset += sizes[i];
+    }
+    memcpy_vec(host_buffers, CPU_DEVICE, src_buffers, device_, sizes);
 
+    std::vector<nvjpegImage_t> destinations(input_count);
     for (i32 i = 0; i < input_count; ++i) {
-      if (image_type == proto::ImageDecoderArgs_ImageType_JPEG) {
-        cvc::GpuMat gpu_mat = frame_to_gpu_mat(frames[i]);
-        if (!d_reader->nextFrame(gpu_mat)) {
-          LOG(FATAL) << "Failed to decode image";
-        }
-        insert_frame(output_columns[0], frames[i]);
-      } else if (image_type == proto::ImageDecoderArgs_ImageType_ANY) {
-        LOG(FATAL) << "Not yet supported";
-      } else {
-        LOG(FATAL) << "Invalid image type";
-      }
+      i32 components;
+      nvjpegChromaSubsampling_t subsampling;
+      i32 widths[NVJPEG_MAX_COMPONENT];
+      i32 heights[NVJPEG_MAX_COMPONENT];
+      NVJPEG_CHECK(nvjpegGetImageInfo(handle_, host_buffers[i], sizes[i],
+                                      &components, &subsampling, widths,
+                                      heights));
+      // Interleaved BGR, like the CPU kernel's output
+      Frame* frame = new_frame(
+          device_, FrameInfo(heights[0], widths[0], 3, FrameType::U8));
+      destinations[i] = nvjpegImage_t{};
+      destinations[i].channel[0] = frame->data;
+      destinations[i].pitch[0] = widths[0] * 3;
+      insert_frame(output_columns[0], frame);
     }
-  }
 
-  void set_device() {
-    CU_CHECK(cudaSetDevice(device_.id));
-    cvc::setDevice(device_.id);
+    if (input_count != batch_size_) {
+      NVJPEG_CHECK(nvjpegDecodeBatchedInitialize(
+          handle_, state_, input_count, std::thread::hardware_concurrency(),
+          NVJPEG_OUTPUT_BGRI));
+      batch_size_ = input_count;
+    }
+    NVJPEG_CHECK(nvjpegDecodeBatched(handle_, state_, host_buffers.data(),
+                                     sizes.data(), destinations.data(),
+                                     stream_));
+    CU_CHECK(cudaStreamSynchronize(stream_));
+
+    delete_buffer(CPU_DEVICE, host_block);
   }
 
-private:
+  void set_device() { CU_CHECK(cudaSetDevice(device_.id)); }
+
+ private:
   proto::ImageDecoderArgs args_;
   DeviceHandle device_;
+  cudaStream_t stream_;
+  nvjpegHandle_t handle_;
+  nvjpegJpegState_t state_;
+  // Batch size the decode state was initialized for
+  i32 batch_size_ = 0;
 };
 
 REGISTER_KERNEL(ImageDecoder, ImageDecoderKernelGPU)
     .device(DeviceType::GPU)
+    .batch()
     .num_devices(1);
 }
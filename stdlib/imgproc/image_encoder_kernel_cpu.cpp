@@ -5,37 +5,59 @@
 
 namespace scanner {
 
+// Encodes the frames of a batch in parallel. The per frame encode and color
+// conversion buffers are kept across batches, and the encoded images of a
+// batch are packed into one pool allocation.
 class ImageEncoderKernel : public BatchedKernel, public VideoKernel {
  public:
-  ImageEncoderKernel(const KernelConfig& config) : BatchedKernel(config) {}
+  ImageEncoderKernel(const KernelConfig& config) : BatchedKernel(config) {
+    encode_params_.push_back(CV_IMWRITE_JPEG_QUALITY);
+    encode_params_.push_back(100);
+  }
 
   void execute(const BatchedColumns& input_columns,
                BatchedColumns& output_columns) override {
     auto& frame_col = input_columns[0];
     check_frame(CPU_DEVICE, frame_col[0]);
 
-    std::vector<i32> encode_params;
-    encode_params.push_back(CV_IMWRITE_JPEG_QUALITY);
-    encode_params.push_back(100);
-
     i32 input_count = num_rows(frame_col);
+    if ((i32)encoded_.size() < input_count) {
+      encoded_.resize(input_count);
+      recolored_.resize(input_count);
+    }
+
+#pragma omp parallel for schedule(dynamic)
     for (i32 i = 0; i < input_count; ++i) {
       cv::Mat img = frame_to_mat(frame_col[i].as_const_frame());
-      std::vector<u8> buf;
-      cv::Mat recolored;
-      cv::cvtColor(img, recolored, CV_RGB2BGR);
-      bool success = cv::imencode(".jpg", recolored, buf, encode_params);
+      cv::cvtColor(img, recolored_[i], CV_RGB2BGR);
+      bool success =
+          cv::imencode(".jpg", recolored_[i], encoded_[i], encode_params_);
       LOG_IF(FATAL, !success) << "Failed to encode image";
-      u8* output_buf = new_buffer(CPU_DEVICE, buf.size());
-      std::memcpy(output_buf, buf.data(), buf.size());
-      insert_element(output_columns[0], output_buf, buf.size());
+    }
+
+    size_t total_size = 0;
+    for (i32 i = 0; i < input_count; ++i) {
+      total_size += encoded_[i].size();
+    }
+    u8* block = new_block_buffer(CPU_DEVICE, total_size, input_count);
+    size_t offset = 0;
+    for (i32 i = 0; i < input_count; ++i) {
+      std::memcpy(block + offset, encoded_[i].data(), encoded_[i].size());
+      insert_element(output_columns[0], block + offset, encoded_[i].size());
+      offset += encoded_[i].size();
     }
   }
+
+ private:
+  std::vector<i32> encode_params_;
+  std::vector<std::vector<u8>> encoded_;
+  std::vector<cv::Mat> recolored_;
 };
 
 REGISTER_OP(ImageEncoder).frame_input("frame").output("img");
 
 REGISTER_KERNEL(ImageEncoder, ImageEncoderKernel)
     .device(DeviceType::CPU)
+    .batch()
     .num_devices(1);
 }
@@ -0,0 +1,133 @@
+#include "scanner/api/kernel.h"
+#include "scanner/api/op.h"
+#include "scanner/util/cuda.h"
+#include "scanner/util/memory.h"
+
+#include <nvjpeg.h>
+#include <algorithm>
+
+#define NVJPEG_CHECK(expr)                                                \
+  {                                                                       \
+    nvjpegStatus_t status = (expr);                                       \
+    LOG_IF(FATAL, status != NVJPEG_STATUS_SUCCESS)                        \
+        << "nvJPEG error " << status << " in " << #expr;                  \
+  }
+
+namespace scanner {
+
+// Encodes a batch on the GPU with nvJPEG. Images are encoded num_streams_ at
+// a time, each with its own encoder state and stream, and the bitstreams of
+// the batch are packed into one pool allocation on the device.
+class ImageEncoderKernelGPU : public BatchedKernel {
+ public:
+  ImageEncoderKernelGPU(const KernelConfig& config)
+    : BatchedKernel(config), device_(config.devices[0]), num_streams_(4) {
+    set_device();
+    NVJPEG_CHECK(nvjpegCreateSimple(&handle_));
+    streams_.resize(num_streams_);
+    states_.resize(num_streams_);
+    params_.resize(num_streams_);
+    for (i32 s = 0; s < num_streams_; ++s) {
+      CU_CHECK(cudaStreamCreateWithFlags(&streams_[s], cudaStreamNonBlocking));
+      NVJPEG_CHECK(
+          nvjpegEncoderStateCreate(handle_, &states_[s], streams_[s]));
+      NVJPEG_CHECK(
+          nvjpegEncoderParamsCreate(handle_, &params_[s], streams_[s]));
+      // Same quality and subsampling as the CPU kernel's OpenCV encode
+      NVJPEG_CHECK(
+          nvjpegEncoderParamsSetQuality(params_[s], 100, streams_[s]));
+      NVJPEG_CHECK(nvjpegEncoderParamsSetSamplingFactors(
+          params_[s], NVJPEG_CSS_420, streams_[s]));
+    }
+  }
+
+  ~ImageEncoderKernelGPU() {
+    set_device();
+    for (i32 s = 0; s < num_streams_; ++s) {
+      nvjpegEncoderParamsDestroy(params_[s]);
+      nvjpegEncoderStateDestroy(states_[s]);
+      cudaStreamDestroy(streams_[s]);
+    }
+    nvjpegDestroy(handle_);
+  }
+
+  void execute(const BatchedColumns& input_columns,
+               BatchedColumns& output_columns) override {
+    auto& frame_col = input_columns[0];
+    i32 input_count = num_rows(frame_col);
+
+    set_device();
+
+    if ((i32)encoded_.size() < input_count) {
+      encoded_.resize(input_count);
+    }
+    for (i32 start = 0; start < input_count; start += num_streams_) {
+      i32 end = std::min(start + num_streams_, input_count);
+      for (i32 i = start; i < end; ++i) {
+        i32 s = i - start;
+        const Frame* frame = frame_col[i].as_const_frame();
+        LOG_IF(FATAL, frame->channels() != 3 || frame->type != FrameType::U8)
+            << "ImageEncoder expects 3 channel U8 frames";
+        nvjpegImage_t image = {};
+        image.channel[0] = frame->data;
+        image.pitch[0] = frame->row_stride;
+        NVJPEG_CHECK(nvjpegEncodeImage(handle_, states_[s], params_[s],
+                                       &image, NVJPEG_INPUT_RGBI,
+                                       frame->width(), frame->height(),
+                                       streams_[s]));
+      }
+      for (i32 i = start; i < end; ++i) {
+        i32 s = i - start;
+        size_t length;
+        NVJPEG_CHECK(nvjpegEncodeRetrieveBitstream(handle_, states_[s],
+                                                   nullptr, &length,
+                                                   streams_[s]));
+        encoded_[i].resize(length);
+        NVJPEG_CHECK(nvjpegEncodeRetrieveBitstream(handle_, states_[s],
+                                                   encoded_[i].data(),
+                                                   &length, streams_[s]));
+        CU_CHECK(cudaStreamSynchronize(streams_[s]));
+      }
+    }
+
+    size_t total_size = 0;
+    for (i32 i = 0; i < input_count; ++i) {
+      total_size += encoded_[i].size();
+    }
+    staging_.resize(total_size);
+    size_t offset = 0;
+    for (i32 i = 0; i < input_count; ++i) {
+      std::memcpy(staging_.data() + offset, encoded_[i].data(),
+                  encoded_[i].size());
+      offset += encoded_[i].size();
+    }
+
+    // Outputs live on the kernel's device like its inputs
+    u8* block = new_block_buffer(device_, total_size, input_count);
+    memcpy_buffer(block, device_, staging_.data(), CPU_DEVICE, total_size);
+    offset = 0;
+    for (i32 i = 0; i < input_count; ++i) {
+      insert_element(output_columns[0], block + offset, encoded_[i].size());
+      offset += encoded_[i].size();
+    }
+  }
+
+  void set_device() { CU_CHECK(cudaSetDevice(device_.id)); }
+
+ private:
+  DeviceHandle device_;
+  i32 num_streams_;
+  nvjpegHandle_t handle_;
+  std::vector<cudaStream_t> streams_;
+  std::vector<nvjpegEncoderState_t> states_;
+  std::vector<nvjpegEncoderParams_t> params_;
+  // Host bitstreams of the current batch, kept across batches
+  std::vector<std::vector<u8>> encoded_;
+  std::vector<u8> staging_;
+};
+
+REGISTER_KERNEL(ImageEncoder, ImageEncoderKernelGPU)
+    .device(DeviceType::GPU)
+    .batch()
+    .num_devices(1);
+}
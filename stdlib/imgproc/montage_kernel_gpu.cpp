@@ -1,12 +1,14 @@
 #include "scanner/api/kernel.h"
 #include "scanner/api/op.h"
 #include "scanner/util/cuda.h"
+#include "scanner/util/image.h"
 #include "scanner/util/memory.h"
-#include "scanner/util/opencv.h"
 #include "stdlib/stdlib.pb.h"
 
 namespace scanner {
 
+// Resizes every frame of a batch into its tile of the montage with a single
+// launch that writes straight into the montage's output buffer
 class MontageKernelGPU : public BatchedKernel, public VideoKernel {
  public:
   MontageKernelGPU(const KernelConfig& config)
@@ -27,6 +29,7 @@ class MontageKernelGPU : public BatchedKernel, public VideoKernel {
   }
 
   ~MontageKernelGPU() {
+    set_device();
     if (montage_buffer_ != nullptr) {
       delete_buffer(device_, montage_buffer_);
     }
@@ -38,12 +41,7 @@ class MontageKernelGPU : public BatchedKernel, public VideoKernel {
       if (montage_buffer_ != nullptr) {
         delete_buffer(device_, montage_buffer_);
       }
-      montage_buffer_ =
-          new_buffer(device_, montage_width_ * montage_height_ * 3);
-      montage_image_ = cvc::GpuMat(montage_height_, montage_width_, CV_8UC3,
-                                   montage_buffer_);
-      montage_image_.setTo(0);
-      frames_seen_ = 0;
+      start_montage();
     }
   }
 
@@ -66,38 +64,83 @@ class MontageKernelGPU : public BatchedKernel, public VideoKernel {
     check_frame(device_, frame_col[0]);
 
     set_device();
+    // The runtime's stream for this kernel
+    cudaStream_t stream = (cudaStream_t)stream_;
 
     assert(montage_buffer_ != nullptr);
     i32 input_count = num_rows(frame_col);
+    const size_t montage_pitch = montage_width_ * 3;
+
+    std::vector<const u8*> frames(input_count);
+    std::vector<size_t> pitches(input_count);
+    std::vector<u8*> tiles(input_count);
+    // Montages completed by each row, emitted once the launch is done
+    std::vector<u8*> completed(input_count, nullptr);
     for (i32 i = 0; i < input_count; ++i) {
-      cvc::GpuMat img = frame_to_gpu_mat(frame_col[i].as_const_frame());
+      const Frame* frame = frame_col[i].as_const_frame();
+      LOG_IF(FATAL, frame->width() != frame_width_ ||
+                        frame->height() != frame_height_ ||
+                        frame->channels() != 3 || frame->type != FrameType::U8)
+          << "Montage expects a batch of same sized 3 channel U8 frames";
+      frames[i] = frame->data;
+      pitches[i] = frame->row_stride;
+
       i64 x = frames_seen_ % frames_per_row_;
       i64 y = frames_seen_ / frames_per_row_;
-      cvc::GpuMat montage_subimg =
-          montage_image_(cv::Rect(target_width_ * x, target_height_ * y,
-                                  target_width_, target_height_));
-      cvc::resize(img, montage_subimg, cv::Size(target_width_, target_height_));
+      tiles[i] = montage_buffer_ + target_height_ * y * montage_pitch +
+                 target_width_ * x * 3;
 
       frames_seen_++;
       if (frames_seen_ == num_frames_) {
-        assert(montage_buffer_ != nullptr);
-        FrameInfo info(montage_height_, montage_width_, 3, FrameType::U8);
-        insert_frame(output_columns[0], new Frame(info, montage_buffer_));
-        montage_image_ = cvc::GpuMat();
-        montage_buffer_ = nullptr;
+        completed[i] = montage_buffer_;
+        // Later frames of the batch go into a fresh montage
+        start_montage();
+      }
+    }
+
+    // The frame table lives on the device for the length of the launch
+    size_t frames_bytes = sizeof(u8*) * input_count;
+    size_t pitches_bytes = sizeof(size_t) * input_count;
+    u8* table = new_buffer(device_, 2 * frames_bytes + pitches_bytes);
+    CU_CHECK(cudaMemcpyAsync(table, frames.data(), frames_bytes,
+                             cudaMemcpyHostToDevice, stream));
+    CU_CHECK(cudaMemcpyAsync(table + frames_bytes, pitches.data(),
+                             pitches_bytes, cudaMemcpyHostToDevice, stream));
+    CU_CHECK(cudaMemcpyAsync(table + frames_bytes + pitches_bytes,
+                             tiles.data(), frames_bytes,
+                             cudaMemcpyHostToDevice, stream));
+    CU_CHECK(montageBatch((const u8* const*)table,
+                          (const size_t*)(table + frames_bytes), frame_width_,
+                          frame_height_, input_count,
+                          (u8* const*)(table + frames_bytes + pitches_bytes),
+                          montage_pitch, target_width_, target_height_,
+                          stream));
+    CU_CHECK(cudaStreamSynchronize(stream));
+    delete_buffer(device_, table);
+
+    FrameInfo info(montage_height_, montage_width_, 3, FrameType::U8);
+    for (i32 i = 0; i < input_count; ++i) {
+      if (completed[i] != nullptr) {
+        insert_frame(output_columns[0], new Frame(info, completed[i]));
       } else {
-        FrameInfo info(montage_height_, montage_width_, 3, FrameType::U8);
         insert_frame(output_columns[0], new_frame(device_, info));
       }
     }
   }
 
-  void set_device() {
-    CUDA_PROTECT({ CU_CHECK(cudaSetDevice(device_.id)); });
-    cvc::setDevice(device_.id);
-  }
+  void set_device() { CU_CHECK(cudaSetDevice(device_.id)); }
 
  private:
+  // Allocates a cleared montage. The clear is queued on stream_ ahead of the
+  // launches that fill it.
+  void start_montage() {
+    size_t size = montage_width_ * montage_height_ * 3;
+    montage_buffer_ = new_buffer(device_, size);
+    CU_CHECK(cudaMemsetAsync(montage_buffer_, 0, size,
+                             (cudaStream_t)stream_));
+    frames_seen_ = 0;
+  }
+
   proto::Result valid_;
   DeviceHandle device_;
   proto::MontageArgs args_;
@@ -112,7 +155,6 @@ class MontageKernelGPU : public BatchedKernel, public VideoKernel {
   i64 montage_height_;
 
   u8* montage_buffer_;
-  cvc::GpuMat montage_image_;
   i64 frames_seen_;
 };
 
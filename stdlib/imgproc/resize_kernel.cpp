@@ -5,6 +5,10 @@
 #include "scanner/util/opencv.h"
 #include "stdlib/stdlib.pb.h"
 
+#ifdef HAVE_CUDA
+#include "scanner/util/image.h"
+#endif
+
 namespace scanner {
 
 class ResizeKernel : public BatchedKernel {
@@ -12,6 +16,10 @@ class ResizeKernel : public BatchedKernel {
   ResizeKernel(const KernelConfig& config)
     : BatchedKernel(config), device_(config.devices[0]) {
     args_.ParseFromArray(config.args.data(), config.args.size());
+    for (i32 c = 0; c < 3; ++c) {
+      mean_[c] = c < args_.mean_colors_size() ? args_.mean_colors(c) : 0;
+    }
+    scale_ = args_.normalize() ? 1.0f / 255.0f : 1.0f;
   }
 
   void execute(const BatchedColumns& input_columns,
@@ -19,66 +27,160 @@ class ResizeKernel : public BatchedKernel {
     auto& frame_col = input_columns[0];
     set_device();
 
-    const Frame* frame = frame_col[0].as_const_frame();
+    i32 input_count = num_rows(frame_col);
+    const Frame* first = frame_col[0].as_const_frame();
+    bool same_shape = true;
+    for (i32 i = 1; i < input_count; ++i) {
+      const Frame* frame = frame_col[i].as_const_frame();
+      same_shape &= (frame->width() == first->width() &&
+                     frame->height() == first->height());
+    }
 
-    i32 target_width = args_.width();
-    i32 target_height = args_.height();
+    if (!same_shape) {
+      // Frames of different sizes each get their own target size
+      for (i32 i = 0; i < input_count; ++i) {
+        resize_frames(frame_col, i, 1, output_columns[0]);
+      }
+    } else {
+      resize_frames(frame_col, 0, input_count, output_columns[0]);
+    }
+  }
+
+  void set_device() {
+    if (device_.type == DeviceType::GPU) {
+      CUDA_PROTECT({
+        CU_CHECK(cudaSetDevice(device_.id));
+        cvc::setDevice(device_.id);
+      });
+    }
+  }
+
+ private:
+  void target_size(const Frame* frame, i32& target_width,
+                   i32& target_height) {
+    target_width = args_.width();
+    target_height = args_.height();
     if (args_.preserve_aspect()) {
       if (target_width == 0) {
-        target_width =
-            frame->width() * target_height / frame->height();
+        target_width = frame->width() * target_height / frame->height();
       } else {
-        target_height =
-            frame->height() * target_width / frame->width();
+        target_height = frame->height() * target_width / frame->width();
       }
     }
     if (args_.min()) {
-      if (frame->width() <= target_width &&
-          frame->height() <= target_height) {
+      if (frame->width() <= target_width && frame->height() <= target_height) {
         target_width = frame->width();
         target_height = frame->height();
       }
     }
+  }
 
-    i32 input_count = num_rows(frame_col);
-    FrameInfo info(target_height, target_width, 3, FrameType::U8);
-    std::vector<Frame*> output_frames = new_frames(device_, info, input_count);
-
-    for (i32 i = 0; i < input_count; ++i) {
-      if (device_.type == DeviceType::CPU) {
-        cv::Mat img = frame_to_mat(frame_col[i].as_const_frame());
-        cv::Mat out_mat = frame_to_mat(output_frames[i]);
-        cv::resize(img, out_mat, cv::Size(target_width, target_height));
-      } else {
-        CUDA_PROTECT({
-          cvc::GpuMat img = frame_to_gpu_mat(frame_col[i].as_const_frame());
-          cvc::GpuMat out_mat = frame_to_gpu_mat(output_frames[i]);
-          cvc::resize(img, out_mat, cv::Size(target_width, target_height));
-        });
+  // Resizes count frames of one shape starting at row start
+  void resize_frames(const ElementList& frame_col, i32 start, i32 count,
+                     ElementList& output_col) {
+    const Frame* frame = frame_col[start].as_const_frame();
+    i32 target_width;
+    i32 target_height;
+    target_size(frame, target_width, target_height);
+
+    bool planar = args_.planar_float();
+    // Frames decoded straight to the target size only need to be passed on
+    if (!planar && frame->width() == target_width &&
+        frame->height() == target_height) {
+      for (i32 i = start; i < start + count; ++i) {
+        output_col.push_back(add_element_ref(device_, frame_col[i]));
       }
-      insert_frame(output_columns[0], output_frames[i]);
+      return;
     }
-  }
 
-  void set_device() {
+    FrameInfo info = planar ? FrameInfo(3, target_height, target_width,
+                                        FrameType::F32)
+                            : FrameInfo(target_height, target_width, 3,
+                                        FrameType::U8);
+    std::vector<Frame*> output_frames = new_frames(device_, info, count);
+
     if (device_.type == DeviceType::GPU) {
-      CUDA_PROTECT({
-        CU_CHECK(cudaSetDevice(device_.id));
-        cvc::setDevice(device_.id);
-      });
+      resize_batch_gpu(frame_col, start, count, output_frames[0]->data,
+                       target_width, target_height);
+    } else {
+      for (i32 i = 0; i < count; ++i) {
+        cv::Mat img = frame_to_mat(frame_col[start + i].as_const_frame());
+        if (!planar) {
+          cv::Mat out_mat = frame_to_mat(output_frames[i]);
+          cv::resize(img, out_mat, cv::Size(target_width, target_height));
+          continue;
+        }
+        cv::Mat resized;
+        cv::resize(img, resized, cv::Size(target_width, target_height));
+        std::vector<cv::Mat> channels;
+        cv::split(resized, channels);
+        f32* out = (f32*)output_frames[i]->data;
+        size_t plane = (size_t)target_width * target_height;
+        for (i32 c = 0; c < 3; ++c) {
+          cv::Mat out_plane(target_height, target_width, CV_32F,
+                            out + c * plane);
+          const cv::Mat& in_plane = channels[args_.swap_channels() ? 2 - c : c];
+          in_plane.convertTo(out_plane, CV_32F, scale_, -mean_[c] * scale_);
+        }
+      }
+    }
+
+    for (Frame* output_frame : output_frames) {
+      insert_frame(output_col, output_frame);
     }
   }
 
- private:
+  // One launch resizes, and for planar outputs converts, the whole batch
+  void resize_batch_gpu(const ElementList& frame_col, i32 start, i32 count,
+                        u8* output, i32 target_width, i32 target_height) {
+#ifdef HAVE_CUDA
+    // The runtime's stream for this kernel
+    cudaStream_t stream = (cudaStream_t)stream_;
+    const Frame* first = frame_col[start].as_const_frame();
+    std::vector<const u8*> frames(count);
+    std::vector<size_t> pitches(count);
+    for (i32 i = 0; i < count; ++i) {
+      const Frame* frame = frame_col[start + i].as_const_frame();
+      frames[i] = frame->data;
+      pitches[i] = frame->row_stride;
+    }
+
+    size_t frames_bytes = sizeof(u8*) * count;
+    size_t pitches_bytes = sizeof(size_t) * count;
+    u8* table = new_buffer(device_, frames_bytes + pitches_bytes);
+    CU_CHECK(cudaMemcpyAsync(table, frames.data(), frames_bytes,
+                             cudaMemcpyHostToDevice, stream));
+    CU_CHECK(cudaMemcpyAsync(table + frames_bytes, pitches.data(),
+                             pitches_bytes, cudaMemcpyHostToDevice, stream));
+    CU_CHECK(resizeBatch((const u8* const*)table,
+                         (const size_t*)(table + frames_bytes), first->width(),
+                         first->height(), count, output, target_width,
+                         target_height, args_.planar_float(),
+                         args_.swap_channels(), mean_, scale_, stream));
+    CU_CHECK(cudaStreamSynchronize(stream));
+    delete_buffer(device_, table);
+#else
+    LOG(FATAL) << "Cuda not enabled.";
+#endif
+  }
+
   DeviceHandle device_;
   proto::ResizeArgs args_;
+  f32 mean_[3];
+  f32 scale_;
 };
 
 REGISTER_OP(Resize).frame_input("frame").frame_output("frame");
 
-REGISTER_KERNEL(Resize, ResizeKernel).device(DeviceType::CPU).num_devices(1);
+REGISTER_KERNEL(Resize, ResizeKernel)
+    .device(DeviceType::CPU)
+    .num_devices(1)
+    .fusable();
 
 #ifdef HAVE_CUDA
-REGISTER_KERNEL(Resize, ResizeKernel).device(DeviceType::GPU).num_devices(1);
+REGISTER_KERNEL(Resize, ResizeKernel)
+    .device(DeviceType::GPU)
+    .batch()
+    .num_devices(1);
 #endif
 }
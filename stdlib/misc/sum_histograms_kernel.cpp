@@ -0,0 +1,84 @@
+#include "scanner/api/kernel.h"
+#include "scanner/api/op.h"
+#include "scanner/util/memory.h"
+
+#include <cstring>
+
+namespace scanner {
+
+// Adds up the histograms of all rows of a job, e.g. those of Histogram, into
+// a single histogram of 64 bit counts. Each task sums its own rows and the
+// master adds up the sums of the tasks.
+class SumHistogramsKernel : public BatchedKernel {
+ public:
+  SumHistogramsKernel(const KernelConfig& config)
+    : BatchedKernel(config), device_(config.devices[0]) {}
+
+  void reset() override { sums_.clear(); }
+
+  void execute(const BatchedColumns& input_columns,
+               BatchedColumns& output_columns) override {
+    auto& hist_col = input_columns[0];
+    i32 input_count = num_rows(hist_col);
+    for (i32 i = 0; i < input_count; ++i) {
+      add(hist_col[i].buffer, hist_col[i].size);
+    }
+
+    // Rows only get placeholders, the sum is the result of the job
+    insert_element(output_columns[0], new_buffer(device_, 1), 1);
+    add_element_refs(device_, output_columns[0][0], input_count - 1,
+                     output_columns[0]);
+  }
+
+  void serialize_state(std::vector<u8>& state) override {
+    state.resize(sums_.size() * sizeof(i64));
+    std::memcpy(state.data(), sums_.data(), state.size());
+  }
+
+  void deserialize_state(const std::vector<u8>& state) override {
+    sums_.resize(state.size() / sizeof(i64));
+    std::memcpy(sums_.data(), state.data(), state.size());
+  }
+
+  void combine_state(const std::vector<u8>& partial) override {
+    if (partial.empty()) {
+      return;
+    }
+    std::vector<i64> other(partial.size() / sizeof(i64));
+    std::memcpy(other.data(), partial.data(), partial.size());
+    if (sums_.empty()) {
+      sums_.resize(other.size());
+    }
+    LOG_IF(FATAL, other.size() != sums_.size())
+        << "SumHistograms expects histograms of the same size";
+    for (size_t b = 0; b < sums_.size(); ++b) {
+      sums_[b] += other[b];
+    }
+  }
+
+ private:
+  void add(const u8* buffer, size_t size) {
+    size_t bins = size / sizeof(int);
+    if (sums_.empty()) {
+      sums_.resize(bins);
+    }
+    LOG_IF(FATAL, bins != sums_.size())
+        << "SumHistograms expects histograms of the same size";
+    const int* hist = (const int*)buffer;
+    for (size_t b = 0; b < bins; ++b) {
+      sums_[b] += hist[b];
+    }
+  }
+
+  DeviceHandle device_;
+  std::vector<i64> sums_;
+};
+
+REGISTER_OP(SumHistograms).input("histogram").output("histogram");
+
+REGISTER_KERNEL(SumHistograms, SumHistogramsKernel)
+    .device(DeviceType::CPU)
+    .batch()
+    .num_devices(1)
+    .reduce();
+}
@@ -1,6 +1,7 @@
 #include "scanner/api/kernel.h"
 #include "scanner/api/op.h"
 #include "scanner/util/cuda.h"
+#include "scanner/util/cuda_stream_pool.h"
 #include "scanner/util/cycle_timer.h"
 #include "scanner/util/memory.h"
 #include "scanner/util/opencv.h"
@@ -9,6 +10,10 @@
 
 namespace scanner {
 
+// Computes the flow of every stencil pair of a batch at once: pair i runs on
+// stream i % num_cuda_streams_ with that stream's own Farneback instance, so
+// pairs overlap on the GPU instead of running one after another on the
+// default stream. The streams come from the process's stream pool.
 class OpticalFlowKernelGPU : public StenciledBatchedKernel, public VideoKernel {
  public:
   OpticalFlowKernelGPU(const KernelConfig& config)
@@ -17,9 +22,12 @@ class OpticalFlowKernelGPU : public StenciledBatchedKernel, public VideoKernel {
       num_cuda_streams_(8) {
     set_device();
     cv::cuda::setBufferPoolUsage(true);
-    cv::cuda::setBufferPoolConfig(device_.id, 50 * 1024 * 1024, 5);
-    streams_.resize(num_cuda_streams_);
+    // One buffer pool stack per stream
+    cv::cuda::setBufferPoolConfig(device_.id, 50 * 1024 * 1024,
+                                  num_cuda_streams_);
     for (i32 i = 0; i < num_cuda_streams_; ++i) {
+      pool_streams_.push_back(CUDAStreamPool::instance().acquire(device_.id));
+      streams_.push_back(wrap_stream(pool_streams_.back()));
       flow_finders_.push_back(
           cvc::FarnebackOpticalFlow::create(3, 0.5, false, 15, 3, 5, 1.2, 0));
     }
@@ -28,13 +36,23 @@ class OpticalFlowKernelGPU : public StenciledBatchedKernel, public VideoKernel {
   ~OpticalFlowKernelGPU() {
     set_device();
     flow_finders_.clear();
+    grayscale_.clear();
+    grayscale_ready_.clear();
     streams_.clear();
+    for (void* stream : pool_streams_) {
+      CUDAStreamPool::instance().release(device_.id, stream);
+    }
     cv::cuda::setBufferPoolConfig(device_.id, 0, 0);
     cv::cuda::setBufferPoolUsage(false);
   }
 
   void new_frame_info() override {
     set_device();
+    // Grayscale inputs are kept across calls and only reallocated when the
+    // video's resolution changes
+    for (auto& g : grayscale_) {
+      g.create(frame_info_.height(), frame_info_.width(), CV_8UC1);
+    }
   }
 
   void reset() override {
@@ -56,7 +74,11 @@ class OpticalFlowKernelGPU : public StenciledBatchedKernel, public VideoKernel {
     }
     input_frames.push_back(frame_col.back()[1].as_const_frame());
 
-    grayscale_.resize(input_count + 1);
+    while ((i32)grayscale_.size() < input_count + 1) {
+      grayscale_.emplace_back(frame_info_.height(), frame_info_.width(),
+                              CV_8UC1);
+      grayscale_ready_.emplace_back(cv::cuda::Event::DISABLE_TIMING);
+    }
 
     FrameInfo out_frame_info(frame_info_.height(), frame_info_.width(), 2,
                              FrameType::F32);
@@ -65,12 +87,9 @@ class OpticalFlowKernelGPU : public StenciledBatchedKernel, public VideoKernel {
 
     for (i32 i = 0; i < input_count + 1; ++i) {
       i32 sidx = i % num_cuda_streams_;
-      streams_[sidx].waitForCompletion();
       cvc::GpuMat input = frame_to_gpu_mat(input_frames[i]);
       cvc::cvtColor(input, grayscale_[i], CV_BGR2GRAY, 0, streams_[sidx]);
-    }
-    for (auto& s : streams_) {
-      s.waitForCompletion();
+      grayscale_ready_[i].record(streams_[sidx]);
     }
 
     for (i32 i = 1; i < input_count + 1; ++i) {
@@ -82,9 +101,11 @@ class OpticalFlowKernelGPU : public StenciledBatchedKernel, public VideoKernel {
       cvc::GpuMat& input0 = grayscale_[curr_idx];
       cvc::GpuMat& input1 = grayscale_[prev_idx];
 
-      //streams_[sidx].waitForCompletion();
+      // The current frame was converted on this stream, the previous one on
+      // the stream before it
+      streams_[sidx].waitEvent(grayscale_ready_[prev_idx]);
       cvc::GpuMat output_mat = frame_to_gpu_mat(output_frames[i - 1]);
-      flow_finders_[0]->calc(input0, input1, output_mat);
+      flow_finders_[sidx]->calc(input0, input1, output_mat, streams_[sidx]);
       insert_frame(output_columns[0], output_frames[i - 1]);
     }
     for (auto& s : streams_) {
@@ -102,12 +123,18 @@ class OpticalFlowKernelGPU : public StenciledBatchedKernel, public VideoKernel {
   std::vector<cv::Ptr<cvc::DenseOpticalFlow>> flow_finders_;
   cvc::GpuMat initial_frame_;
   std::vector<cvc::GpuMat> grayscale_;
+  // Recorded once grayscale_[i] has been converted
+  std::vector<cv::cuda::Event> grayscale_ready_;
   i32 num_cuda_streams_;
+  std::vector<void*> pool_streams_;
+  // OpenCV wrappers of pool_streams_
   std::vector<cv::cuda::Stream> streams_;
 };
 
+// The buffer pool stack of every stream, plus a grayscale 1080p frame per row
 REGISTER_KERNEL(OpticalFlow, OpticalFlowKernelGPU)
     .device(DeviceType::GPU)
     .batch()
-    .num_devices(1);
+    .num_devices(1)
+    .device_memory(8 * 50 * 1024 * 1024, 1920 * 1080);
 }
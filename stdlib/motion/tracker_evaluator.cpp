@@ -27,7 +27,6 @@
 #endif
 
 #include <cmath>
-#include <thread>
 
 namespace scanner {
 
@@ -42,6 +41,9 @@ TrackerEvaluator::TrackerEvaluator(const EvaluatorConfig& config,
   if (device_type_ == DeviceType::GPU) {
     LOG(FATAL) << "GPU tracker support not implemented yet";
   }
+  // Eviction keeps the live tracks within max_tracks_ unless one frame brings
+  // more new detections than that, so births rarely reallocate the store
+  tracks_.reserve(max_tracks_);
 }
 
 void TrackerEvaluator::configure(const BatchConfig& config) {
@@ -67,7 +69,7 @@ void TrackerEvaluator::evaluate(const BatchedColumns& input_columns,
 
   printf("num tracks %d\n", tracks_.size());
   for (i32 b = 0; b < input_count; ++b) {
-    std::vector<BoundingBox> all_boxes = deserialize_proto_vector<BoundingBox>(
+    std::vector<BoundingBox> all_boxes = deserialize_bbox_vector(
         input_columns[box_idx].rows[b].buffer,
         input_columns[box_idx].rows[b].size);
 
@@ -107,44 +109,43 @@ void TrackerEvaluator::evaluate(const BatchedColumns& input_columns,
       cv::Mat frame(metadata_.height(), metadata_.width(), CV_8UC3, buffer);
       std::vector<f64> scores(tracks_.size());
       std::vector<struck::FloatRect> tracked_bboxes(tracks_.size());
-      std::vector<std::thread> tracker_threads(tracks_.size());
-      auto track_fn = [](struck::Tracker* tracker, const cv::Mat& frame,
-                         f64& score, struck::FloatRect& tracked_bbox) {
-        tracker->Track(frame);
-        score = tracker->GetScore();
-        tracked_bbox = tracker->GetBB();
-      };
 
+      // Tracks are independent, so they update in parallel on the OpenMP
+      // pool instead of on a thread spawned per track and frame
+#pragma omp parallel for schedule(dynamic)
       for (i32 i = 0; i < (i32)tracks_.size(); ++i) {
-        auto& track = tracks_[i];
-        auto& tracker = track.tracker;
-        tracker_threads[i] =
-            std::thread(track_fn, tracker.get(), std::ref(frame),
-                        std::ref(scores[i]), std::ref(tracked_bboxes[i]));
+        struck::Tracker* tracker = tracks_[i].tracker.get();
+        tracker->Track(frame);
+        scores[i] = tracker->GetScore();
+        tracked_bboxes[i] = tracker->GetBB();
       }
-      for (i32 i = 0, jid = 0; i < (i32)tracks_.size(); ++i, ++jid) {
+
+      // Drop lost tracks by compacting the survivors in place, in order
+      size_t live = 0;
+      for (size_t i = 0; i < tracks_.size(); ++i) {
         auto& track = tracks_[i];
-        auto& tracker = track.tracker;
-        tracker_threads[jid].join();
-        f64 score = scores[jid];
-        struck::FloatRect tracked_bbox = tracked_bboxes[jid];
+        f64 score = scores[i];
+        struck::FloatRect tracked_bbox = tracked_bboxes[i];
         if (score < TRACK_SCORE_THRESHOLD) {
-          tracks_.erase(tracks_.begin() + i);
-          i--;
-        } else {
-          BoundingBox box;
-          box.set_x1(tracked_bbox.XMin());
-          box.set_y1(tracked_bbox.YMin());
-          box.set_x2(tracked_bbox.XMax());
-          box.set_y2(tracked_bbox.YMax());
-          box.set_score(track.box.score());
-          box.set_track_id(track.id);
-          box.set_track_score(score);
-          generated_bboxes.push_back(box);
-
-          track.frames_since_last_detection++;
+          continue;
+        }
+        BoundingBox box;
+        box.set_x1(tracked_bbox.XMin());
+        box.set_y1(tracked_bbox.YMin());
+        box.set_x2(tracked_bbox.XMax());
+        box.set_y2(tracked_bbox.YMax());
+        box.set_score(track.box.score());
+        box.set_track_id(track.id);
+        box.set_track_score(score);
+        generated_bboxes.push_back(box);
+
+        track.frames_since_last_detection++;
+        if (live != i) {
+          tracks_[live] = std::move(track);
         }
+        live++;
       }
+      tracks_.erase(tracks_.begin() + live, tracks_.end());
     }
 
     // Add new detected bounding boxes to the fold
@@ -161,17 +162,27 @@ void TrackerEvaluator::evaluate(const BatchedColumns& input_columns,
       i32 num_tracks_to_remove =
           std::min(tracks_.size(),
                    tracks_.size() + new_detected_bboxes.size() - max_tracks_);
-      std::vector<i32> idx_to_remove;
+      std::vector<bool> remove(tracks_.size(), false);
       for (i32 i = 0; i < num_tracks_to_remove; ++i) {
-        idx_to_remove.push_back(std::get<1>(track_thresholds[i]));
+        remove[std::get<1>(track_thresholds[i])] = true;
       }
-      std::sort(idx_to_remove.begin(), idx_to_remove.end());
-      for (i32 i = 0; i < num_tracks_to_remove; ++i) {
-        i32 idx = idx_to_remove[num_tracks_to_remove - 1 - i];
-        tracks_.erase(tracks_.begin() + idx);
+      size_t live = 0;
+      for (size_t i = 0; i < tracks_.size(); ++i) {
+        if (remove[i]) continue;
+        if (live != i) {
+          tracks_[live] = std::move(tracks_[i]);
+        }
+        live++;
       }
+      tracks_.erase(tracks_.begin() + live, tracks_.end());
     }
     assert(tracks_.size() <= max_tracks_);
+    u8* frame_buffer = input_columns[frame_idx].rows[b].buffer;
+    assert(input_columns[frame_idx].rows[b].size ==
+           metadata_.height() * metadata_.width() * 3);
+    cv::Mat frame(metadata_.height(), metadata_.width(), CV_8UC3,
+                  frame_buffer);
+    size_t first_new = tracks_.size();
     for (BoundingBox& box : new_detected_bboxes) {
       tracks_.resize(tracks_.size() + 1);
       Track& track = tracks_.back();
@@ -188,22 +199,22 @@ void TrackerEvaluator::evaluate(const BatchedColumns& input_columns,
       config.features.push_back(fkp);
       track.tracker.reset(new struck::Tracker(config));
 
-      u8* buffer = input_columns[frame_idx].rows[b].buffer;
-      assert(input_columns[frame_idx].rows[b].size ==
-             metadata_.height() * metadata_.width() * 3);
-      cv::Mat frame(metadata_.height(), metadata_.width(), CV_8UC3, buffer);
+      box.set_track_id(track.id);
+      box.set_track_score(0.0f);
+      track.frames_since_last_detection = 0;
+    }
 
+    // New trackers train on their first frame independently as well
+#pragma omp parallel for schedule(dynamic)
+    for (i32 i = 0; i < (i32)new_detected_bboxes.size(); ++i) {
+      const BoundingBox& box = new_detected_bboxes[i];
       // Clamp values
       float x1 = std::max(box.x1(), 0.0f);
       float y1 = std::max(box.y1(), 0.0f);
       float x2 = std::min(box.x2(), (f32)metadata_.width());
       float y2 = std::min(box.y2(), (f32)metadata_.height());
       struck::FloatRect r(x1, y1, x2 - x1, y2 - y1);
-      track.tracker->Initialise(frame, r);
-
-      box.set_track_id(track.id);
-      box.set_track_score(0.0f);
-      track.frames_since_last_detection = 0;
+      tracks_[first_new + i].tracker->Initialise(frame, r);
     }
 
     {
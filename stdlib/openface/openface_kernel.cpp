@@ -9,21 +9,36 @@
 #include "OpenFace/LandmarkCoreIncludes.h"
 
 #include <boost/filesystem.hpp>
+#include <omp.h>
 #include <opencv2/imgproc.hpp>
+#include <mutex>
 
 namespace scanner {
 
+// Analyses the faces of a whole batch in parallel. Landmark models and face
+// analysers hold per face state, so each OpenMP thread owns one of each.
 class OpenFaceKernel : public BatchedKernel, public VideoKernel {
  public:
-  OpenFaceKernel(const KernelConfig& config)
-    : BatchedKernel(config), clnf_model(det_parameters.model_location) {
+  OpenFaceKernel(const KernelConfig& config) : BatchedKernel(config) {
     boost::filesystem::path au_loc_path =
         boost::filesystem::path("AU_predictors/AU_all_static.txt");
     boost::filesystem::path tri_loc_path =
         boost::filesystem::path("model/tris_68_full.txt");
-    face_analyser_ =
-        FaceAnalysis::FaceAnalyser(vector<cv::Vec3d>(), 0.7, 112, 112,
-                                   au_loc_path.string(), tri_loc_path.string());
+
+    // The landmark model is loaded from disk once and copied to the rest
+    // of the pool
+    i32 pool_size = omp_get_max_threads();
+    clnf_models_.emplace_back(
+        new LandmarkDetector::CLNF(det_parameters.model_location));
+    for (i32 i = 0; i < pool_size; ++i) {
+      if (i > 0) {
+        clnf_models_.emplace_back(
+            new LandmarkDetector::CLNF(*clnf_models_[0]));
+      }
+      face_analysers_.emplace_back(new FaceAnalysis::FaceAnalyser(
+          vector<cv::Vec3d>(), 0.7, 112, 112, au_loc_path.string(),
+          tri_loc_path.string()));
+    }
   }
 
   void execute(const BatchedColumns& input_columns,
@@ -42,73 +57,105 @@ class OpenFaceKernel : public BatchedKernel, public VideoKernel {
     fy = fx;
 
     i32 input_count = num_rows(frame_col);
+    std::vector<Frame*> output_frames =
+        new_frames(CPU_DEVICE, frame_info_, input_count);
+    std::vector<cv::Mat> images(input_count);
+    // Grayscale buffers are kept across batches
+    if ((i32)grey_.size() < input_count) {
+      grey_.resize(input_count);
+    }
+    std::vector<std::vector<BoundingBox>> all_bboxes(input_count);
+#pragma omp parallel for
     for (i32 b = 0; b < input_count; ++b) {
-      Frame* output_frame = new_frame(CPU_DEVICE, frame_info_);
-      memcpy(output_frame->data, frame_col[b].as_const_frame()->data,
-             output_frame->size());
-      cv::Mat img = frame_to_mat(output_frame);
-      cv::Mat grey;
-      cv::cvtColor(img, grey, CV_BGR2GRAY);
-      std::vector<BoundingBox> all_bboxes =
-          deserialize_proto_vector<BoundingBox>(bbox_col[b].buffer,
-                                                bbox_col[b].size);
-
-      for (auto& bbox : all_bboxes) {
-        f64 x1 = bbox.x1(), y1 = bbox.y1(), x2 = bbox.x2(), y2 = bbox.y2();
-        f64 w = x2 - x1, h = y2 - y1;
-        f64 nw = w, nh = h, dw = nw - w, dh = nh - h;
-        x1 = std::max(x1 - dw / 2, 0.0);
-        y1 = std::max(y1 - dh / 2, 0.0);
-        x2 = std::min(x2 + dw / 2, (f64)(frame_info_.width() - 1));
-        y2 = std::min(y2 + dh / 2, (f64)(frame_info_.height() - 1));
-        cv::Rect_<double> cv_bbox(x1, y1, x2 - x1, y2 - y1);
-        cv::rectangle(img, cv_bbox, cv::Scalar(0, 255, 0));
+      images[b] = frame_to_mat(output_frames[b]);
+      frame_to_mat(frame_col[b].as_const_frame()).copyTo(images[b]);
+      cv::cvtColor(images[b], grey_[b], CV_BGR2GRAY);
+      all_bboxes[b] =
+          deserialize_bbox_vector(bbox_col[b].buffer, bbox_col[b].size);
+    }
 
-        bool success = LandmarkDetector::DetectLandmarksInImage(
-            grey, cv_bbox, clnf_model, det_parameters);
-        if (success) {
-          std::vector<cv::Point2d> landmarks =
-              LandmarkDetector::CalculateLandmarks(clnf_model);
-
-          cv::Point3f gazeDirection0(0, 0, -1);
-          cv::Point3f gazeDirection1(0, 0, -1);
-          FaceAnalysis::EstimateGaze(clnf_model, gazeDirection0, fx, fy, cx, cy,
-                                     true);
-          FaceAnalysis::EstimateGaze(clnf_model, gazeDirection1, fx, fy, cx, cy,
-                                     false);
-
-          auto ActionUnits =
-              face_analyser_.PredictStaticAUs(grey, clnf_model, false);
-
-          cv::Vec6d headPose = LandmarkDetector::GetCorrectedPoseWorld(
-              clnf_model, fx, fy, cx, cy);
-
-          LandmarkDetector::DrawBox(img, headPose, cv::Scalar(255.0, 0, 0), 3,
-                                    fx, fy, cx, cy);
-          FaceAnalysis::DrawGaze(img, clnf_model, gazeDirection0,
-                                 gazeDirection1, fx, fy, cx, cy);
-          LandmarkDetector::Draw(img, clnf_model);
-        }
+    std::vector<std::pair<i32, i32>> faces;
+    for (i32 b = 0; b < input_count; ++b) {
+      for (i32 f = 0; f < (i32)all_bboxes[b].size(); ++f) {
+        faces.emplace_back(b, f);
       }
+    }
+
+    // Faces are analysed in parallel, drawing on a frame is serialized
+    std::vector<std::mutex> frame_locks(input_count);
+#pragma omp parallel for schedule(dynamic)
+    for (i32 i = 0; i < (i32)faces.size(); ++i) {
+      i32 b = faces[i].first;
+      const BoundingBox& bbox = all_bboxes[b][faces[i].second];
+      LandmarkDetector::CLNF& clnf_model = *clnf_models_[omp_get_thread_num()];
+      FaceAnalysis::FaceAnalyser& face_analyser =
+          *face_analysers_[omp_get_thread_num()];
+      cv::Mat& img = images[b];
+      const cv::Mat& grey = grey_[b];
+
+      f64 x1 = bbox.x1(), y1 = bbox.y1(), x2 = bbox.x2(), y2 = bbox.y2();
+      f64 w = x2 - x1, h = y2 - y1;
+      f64 nw = w, nh = h, dw = nw - w, dh = nh - h;
+      x1 = std::max(x1 - dw / 2, 0.0);
+      y1 = std::max(y1 - dh / 2, 0.0);
+      x2 = std::min(x2 + dw / 2, (f64)(frame_info_.width() - 1));
+      y2 = std::min(y2 + dh / 2, (f64)(frame_info_.height() - 1));
+      cv::Rect_<double> cv_bbox(x1, y1, x2 - x1, y2 - y1);
+
+      bool success = LandmarkDetector::DetectLandmarksInImage(
+          grey, cv_bbox, clnf_model, det_parameters);
+      if (!success) {
+        std::lock_guard<std::mutex> lock(frame_locks[b]);
+        cv::rectangle(img, cv_bbox, cv::Scalar(0, 255, 0));
+        continue;
+      }
+      std::vector<cv::Point2d> landmarks =
+          LandmarkDetector::CalculateLandmarks(clnf_model);
+
+      cv::Point3f gazeDirection0(0, 0, -1);
+      cv::Point3f gazeDirection1(0, 0, -1);
+      FaceAnalysis::EstimateGaze(clnf_model, gazeDirection0, fx, fy, cx, cy,
+                                 true);
+      FaceAnalysis::EstimateGaze(clnf_model, gazeDirection1, fx, fy, cx, cy,
+                                 false);
+
+      auto ActionUnits =
+          face_analyser.PredictStaticAUs(grey, clnf_model, false);
+
+      cv::Vec6d headPose = LandmarkDetector::GetCorrectedPoseWorld(
+          clnf_model, fx, fy, cx, cy);
+
+      std::lock_guard<std::mutex> lock(frame_locks[b]);
+      cv::rectangle(img, cv_bbox, cv::Scalar(0, 255, 0));
+      LandmarkDetector::DrawBox(img, headPose, cv::Scalar(255.0, 0, 0), 3,
+                                fx, fy, cx, cy);
+      FaceAnalysis::DrawGaze(img, clnf_model, gazeDirection0, gazeDirection1,
+                             fx, fy, cx, cy);
+      LandmarkDetector::Draw(img, clnf_model);
+    }
 
-      insert_frame(output_columns[0], output_frame);
+    for (i32 b = 0; b < input_count; ++b) {
+      insert_frame(output_columns[0], output_frames[b]);
     }
   }
 
  private:
   LandmarkDetector::FaceModelParameters det_parameters;
-  LandmarkDetector::CLNF clnf_model;
+  // One landmark model and analyser per OpenMP thread
+  std::vector<std::unique_ptr<LandmarkDetector::CLNF>> clnf_models_;
+  std::vector<std::unique_ptr<FaceAnalysis::FaceAnalyser>> face_analysers_;
+  std::vector<cv::Mat> grey_;
   std::vector<std::string> files, depth_files, output_images,
       output_landmark_locations, output_pose_locations;
   std::vector<cv::Rect_<double>> bounding_boxes;
   int device;
   float fx, fy, cx, cy;
-  FaceAnalysis::FaceAnalyser face_analyser_;
 };
 
 REGISTER_OP(OpenFace).frame_input("frame").input("faces").output("features");
 
 REGISTER_KERNEL(OpenFace, OpenFaceKernel)
     .device(DeviceType::CPU)
+    .batch()
     .num_devices(1);
 }
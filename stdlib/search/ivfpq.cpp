@@ -0,0 +1,109 @@
+#include "stdlib/search/ivfpq.h"
+
+#include <algorithm>
+#include <limits>
+#include <numeric>
+
+namespace scanner {
+
+namespace {
+
+f32 squared_distance(const f32* a, const f32* b, i32 n) {
+  f32 dist = 0;
+  for (i32 i = 0; i < n; ++i) {
+    f32 d = a[i] - b[i];
+    dist += d * d;
+  }
+  return dist;
+}
+}
+
+IVFPQ::IVFPQ(const proto::IVFPQArgs& args)
+  : dimensions_(args.dimensions()),
+    num_subquantizers_(args.num_subquantizers()),
+    centroids_(args.centroids().begin(), args.centroids().end()),
+    codebooks_(args.codebooks().begin(), args.codebooks().end()) {
+  LOG_IF(FATAL, dimensions_ <= 0) << "IVFPQ index needs dimensions";
+  LOG_IF(FATAL, num_subquantizers_ <= 0 ||
+                    dimensions_ % num_subquantizers_ != 0)
+      << "IVFPQ num_subquantizers must divide dimensions";
+  LOG_IF(FATAL, centroids_.empty() || centroids_.size() % dimensions_ != 0)
+      << "IVFPQ centroids must be num_lists x dimensions floats";
+  LOG_IF(FATAL, codebooks_.size() != (size_t)dimensions_ * IVFPQ_CODEWORDS)
+      << "IVFPQ codebooks must be num_subquantizers x " << IVFPQ_CODEWORDS
+      << " x (dimensions / num_subquantizers) floats";
+  num_lists_ = centroids_.size() / dimensions_;
+  subvector_size_ = dimensions_ / num_subquantizers_;
+}
+
+i32 IVFPQ::encode(const f32* v, u8* code) const {
+  i32 list = probe(v, 1)[0];
+  std::vector<f32> residual(dimensions_);
+  const f32* centroid = centroids_.data() + (size_t)list * dimensions_;
+  for (i32 i = 0; i < dimensions_; ++i) {
+    residual[i] = v[i] - centroid[i];
+  }
+  for (i32 s = 0; s < num_subquantizers_; ++s) {
+    const f32* sub = residual.data() + s * subvector_size_;
+    const f32* words =
+        codebooks_.data() + (size_t)s * IVFPQ_CODEWORDS * subvector_size_;
+    f32 best = std::numeric_limits<f32>::max();
+    i32 best_word = 0;
+    for (i32 w = 0; w < IVFPQ_CODEWORDS; ++w) {
+      f32 dist =
+          squared_distance(sub, words + w * subvector_size_, subvector_size_);
+      if (dist < best) {
+        best = dist;
+        best_word = w;
+      }
+    }
+    code[s] = (u8)best_word;
+  }
+  return list;
+}
+
+std::vector<i32> IVFPQ::probe(const f32* query, i32 nprobe) const {
+  std::vector<f32> dists(num_lists_);
+  for (i32 l = 0; l < num_lists_; ++l) {
+    dists[l] = squared_distance(
+        query, centroids_.data() + (size_t)l * dimensions_, dimensions_);
+  }
+  nprobe = std::max(1, std::min(nprobe, num_lists_));
+  std::vector<i32> lists(num_lists_);
+  std::iota(lists.begin(), lists.end(), 0);
+  std::partial_sort(lists.begin(), lists.begin() + nprobe, lists.end(),
+                    [&](i32 a, i32 b) { return dists[a] < dists[b]; });
+  lists.resize(nprobe);
+  return lists;
+}
+
+void IVFPQ::distance_table(const f32* query, i32 list, f32* table) const {
+  std::vector<f32> residual(dimensions_);
+  const f32* centroid = centroids_.data() + (size_t)list * dimensions_;
+  for (i32 i = 0; i < dimensions_; ++i) {
+    residual[i] = query[i] - centroid[i];
+  }
+  for (i32 s = 0; s < num_subquantizers_; ++s) {
+    const f32* sub = residual.data() + s * subvector_size_;
+    const f32* words =
+        codebooks_.data() + (size_t)s * IVFPQ_CODEWORDS * subvector_size_;
+    for (i32 w = 0; w < IVFPQ_CODEWORDS; ++w) {
+      table[s * IVFPQ_CODEWORDS + w] =
+          squared_distance(sub, words + w * subvector_size_, subvector_size_);
+    }
+  }
+}
+
+IVFPQCodes parse_ivfpq_codes(const u8* buffer, size_t size, i32 code_size) {
+  IVFPQCodes codes;
+  LOG_IF(FATAL, size < sizeof(u64)) << "Malformed IVFPQ codes";
+  codes.count = *(const u64*)buffer;
+  LOG_IF(FATAL, size != sizeof(u64) +
+                            codes.count * (2 * sizeof(i32) + code_size))
+      << "IVFPQ codes do not match the index's code size";
+  codes.lists = (const i32*)(buffer + sizeof(u64));
+  codes.indices = codes.lists + codes.count;
+  codes.codes = (const u8*)(codes.indices + codes.count);
+  return codes;
+}
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include "scanner/util/common.h"
+#include "stdlib/stdlib.pb.h"
+
+namespace scanner {
+
+// Number of codewords per subquantizer, so that a code entry is one byte
+const i32 IVFPQ_CODEWORDS = 256;
+
+// Inverted file index with product quantized residuals. A vector is assigned
+// to its nearest coarse centroid (its list) and the residual from that
+// centroid is stored as one codeword index per subvector. Distances to a
+// query are then sums of precomputed table entries.
+class IVFPQ {
+ public:
+  IVFPQ(const proto::IVFPQArgs& args);
+
+  i32 dimensions() const { return dimensions_; }
+
+  i32 num_lists() const { return num_lists_; }
+
+  // Bytes per encoded vector
+  i32 code_size() const { return num_subquantizers_; }
+
+  // Writes the code of v's residual to code and returns v's list
+  i32 encode(const f32* v, u8* code) const;
+
+  // The nprobe lists whose centroids are nearest to query, nearest first
+  std::vector<i32> probe(const f32* query, i32 nprobe) const;
+
+  // Fills table with code_size() * IVFPQ_CODEWORDS squared distances between
+  // the subvectors of query's residual to list and every codeword
+  void distance_table(const f32* query, i32 list, f32* table) const;
+
+  // Squared distance to the query a table was computed for
+  f32 distance(const f32* table, const u8* code) const {
+    f32 dist = 0;
+    for (i32 s = 0; s < num_subquantizers_; ++s) {
+      dist += table[s * IVFPQ_CODEWORDS + code[s]];
+    }
+    return dist;
+  }
+
+ private:
+  i32 dimensions_;
+  i32 num_lists_;
+  i32 num_subquantizers_;
+  i32 subvector_size_;
+  std::vector<f32> centroids_;
+  std::vector<f32> codebooks_;
+};
+
+// An encoded row, as written by IVFPQEncode: a u64 count, then count i32
+// lists in ascending order, the count i32 indices of the vectors within the
+// row and count codes of code_size bytes, all in the same order
+struct IVFPQCodes {
+  u64 count;
+  const i32* lists;
+  const i32* indices;
+  const u8* codes;
+};
+
+IVFPQCodes parse_ivfpq_codes(const u8* buffer, size_t size, i32 code_size);
+}
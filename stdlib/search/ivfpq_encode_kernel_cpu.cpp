@@ -0,0 +1,88 @@
+#include "scanner/api/kernel.h"
+#include "scanner/api/op.h"
+#include "scanner/util/memory.h"
+#include "stdlib/search/ivfpq.h"
+#include "stdlib/stdlib.pb.h"
+
+#include <algorithm>
+#include <numeric>
+
+namespace scanner {
+
+// Encodes every feature vector of a row for an IVFPQ index. A row may hold
+// any number of vectors back to back, like the FasterRCNNOutput features,
+// and a row of a single byte holds none. The encoded rows of a table form
+// the index, sharded by row like any other column.
+class IVFPQEncodeKernel : public BatchedKernel {
+ public:
+  IVFPQEncodeKernel(const KernelConfig& config) : BatchedKernel(config) {
+    proto::IVFPQArgs args;
+    if (!args.ParseFromArray(config.args.data(), config.args.size())) {
+      LOG(FATAL) << "Failed to parse args";
+    }
+    index_.reset(new IVFPQ(args));
+  }
+
+  void execute(const BatchedColumns& input_columns,
+               BatchedColumns& output_columns) override {
+    auto& features_col = input_columns[0];
+    i32 input_count = num_rows(features_col);
+    const size_t vector_size = index_->dimensions() * sizeof(f32);
+    const i32 code_size = index_->code_size();
+
+    std::vector<u8*> buffers(input_count);
+    std::vector<size_t> sizes(input_count);
+#pragma omp parallel for schedule(dynamic)
+    for (i32 r = 0; r < input_count; ++r) {
+      const Element& element = features_col[r];
+      u64 count = element.size == 1 ? 0 : element.size / vector_size;
+      LOG_IF(FATAL, element.size != 1 && count * vector_size != element.size)
+          << "IVFPQEncode row of " << element.size
+          << " bytes is not a whole number of vectors";
+      const f32* vectors = (const f32*)element.buffer;
+
+      std::vector<i32> lists(count);
+      std::vector<u8> codes(count * code_size);
+      for (u64 i = 0; i < count; ++i) {
+        lists[i] = index_->encode(vectors + i * index_->dimensions(),
+                                  codes.data() + i * code_size);
+      }
+
+      // Group the row's vectors by list so a search can find a probed list
+      // with a binary search
+      std::vector<i32> order(count);
+      std::iota(order.begin(), order.end(), 0);
+      std::stable_sort(order.begin(), order.end(),
+                       [&](i32 a, i32 b) { return lists[a] < lists[b]; });
+
+      sizes[r] = sizeof(u64) + count * (2 * sizeof(i32) + code_size);
+      buffers[r] = new_buffer(CPU_DEVICE, sizes[r]);
+      *(u64*)buffers[r] = count;
+      i32* out_lists = (i32*)(buffers[r] + sizeof(u64));
+      i32* out_indices = out_lists + count;
+      u8* out_codes = (u8*)(out_indices + count);
+      for (u64 i = 0; i < count; ++i) {
+        out_lists[i] = lists[order[i]];
+        out_indices[i] = order[i];
+        std::copy(codes.data() + order[i] * code_size,
+                  codes.data() + (order[i] + 1) * code_size,
+                  out_codes + i * code_size);
+      }
+    }
+
+    for (i32 r = 0; r < input_count; ++r) {
+      insert_element(output_columns[0], buffers[r], sizes[r]);
+    }
+  }
+
+ private:
+  std::unique_ptr<IVFPQ> index_;
+};
+
+REGISTER_OP(IVFPQEncode).input("features").output("codes");
+
+REGISTER_KERNEL(IVFPQEncode, IVFPQEncodeKernel)
+    .device(DeviceType::CPU)
+    .batch()
+    .num_devices(1);
+}
@@ -0,0 +1,120 @@
+#include "scanner/api/kernel.h"
+#include "scanner/api/op.h"
+#include "scanner/util/memory.h"
+#include "stdlib/search/ivfpq.h"
+#include "stdlib/stdlib.pb.h"
+
+#include <algorithm>
+#include <limits>
+#include <queue>
+
+namespace scanner {
+
+// Searches the rows of an IVFPQEncode column for the nearest neighbors of a
+// fixed set of queries. Only the vectors of each query's nprobe nearest
+// lists are scored, from distance tables computed once per kernel. Each row
+// yields an i32 query count and k, then for every query k (f32 squared
+// distance, i32 index within the row) pairs, nearest first and padded with
+// index -1. The per row results are merged by scannerpy.stdlib.ivfpq.
+class IVFPQSearchKernel : public BatchedKernel {
+ public:
+  IVFPQSearchKernel(const KernelConfig& config) : BatchedKernel(config) {
+    if (!args_.ParseFromArray(config.args.data(), config.args.size())) {
+      LOG(FATAL) << "Failed to parse args";
+    }
+    index_.reset(new IVFPQ(args_.index()));
+    i32 dims = index_->dimensions();
+    LOG_IF(FATAL, args_.queries_size() % dims != 0)
+        << "IVFPQSearch queries must be num_queries x dimensions floats";
+    LOG_IF(FATAL, args_.k() <= 0) << "IVFPQSearch needs k > 0";
+    num_queries_ = args_.queries_size() / dims;
+
+    const i32 table_size = index_->code_size() * IVFPQ_CODEWORDS;
+    probes_.resize(num_queries_);
+    tables_.resize(num_queries_);
+    for (i32 q = 0; q < num_queries_; ++q) {
+      const f32* query = args_.queries().data() + q * dims;
+      probes_[q] = index_->probe(query, args_.nprobe());
+      tables_[q].resize(probes_[q].size() * table_size);
+      for (size_t p = 0; p < probes_[q].size(); ++p) {
+        index_->distance_table(query, probes_[q][p],
+                               tables_[q].data() + p * table_size);
+      }
+    }
+  }
+
+  void execute(const BatchedColumns& input_columns,
+               BatchedColumns& output_columns) override {
+    auto& codes_col = input_columns[0];
+    i32 input_count = num_rows(codes_col);
+    const i32 k = args_.k();
+    const i32 code_size = index_->code_size();
+    const i32 table_size = code_size * IVFPQ_CODEWORDS;
+    const size_t size = 2 * sizeof(i32) + num_queries_ * k * 2 * sizeof(i32);
+
+    u8* output_block =
+        new_block_buffer(CPU_DEVICE, size * input_count, input_count);
+#pragma omp parallel for schedule(dynamic)
+    for (i32 r = 0; r < input_count; ++r) {
+      IVFPQCodes codes = parse_ivfpq_codes(codes_col[r].buffer,
+                                           codes_col[r].size, code_size);
+      u8* out = output_block + r * size;
+      ((i32*)out)[0] = num_queries_;
+      ((i32*)out)[1] = k;
+      u8* results = out + 2 * sizeof(i32);
+
+      for (i32 q = 0; q < num_queries_; ++q) {
+        // Max heap of the k best (distance, index) so far
+        std::priority_queue<std::pair<f32, i32>> best;
+        for (size_t p = 0; p < probes_[q].size(); ++p) {
+          const f32* table = tables_[q].data() + p * table_size;
+          auto range = std::equal_range(codes.lists, codes.lists + codes.count,
+                                        probes_[q][p]);
+          for (const i32* it = range.first; it != range.second; ++it) {
+            u64 i = it - codes.lists;
+            f32 dist = index_->distance(table, codes.codes + i * code_size);
+            if ((i32)best.size() < k) {
+              best.emplace(dist, codes.indices[i]);
+            } else if (dist < best.top().first) {
+              best.pop();
+              best.emplace(dist, codes.indices[i]);
+            }
+          }
+        }
+
+        u8* query_results = results + q * k * 2 * sizeof(i32);
+        for (i32 j = k - 1; j >= 0; --j) {
+          f32 dist = std::numeric_limits<f32>::infinity();
+          i32 index = -1;
+          if (!best.empty()) {
+            dist = best.top().first;
+            index = best.top().second;
+            best.pop();
+          }
+          ((f32*)query_results)[j * 2] = dist;
+          ((i32*)query_results)[j * 2 + 1] = index;
+        }
+      }
+    }
+
+    for (i32 r = 0; r < input_count; ++r) {
+      insert_element(output_columns[0], output_block + r * size, size);
+    }
+  }
+
+ private:
+  proto::IVFPQSearchArgs args_;
+  std::unique_ptr<IVFPQ> index_;
+  i32 num_queries_;
+  // Nearest lists of each query and a distance table per probed list
+  std::vector<std::vector<i32>> probes_;
+  std::vector<std::vector<f32>> tables_;
+};
+
+REGISTER_OP(IVFPQSearch).input("codes").output("neighbors");
+
+REGISTER_KERNEL(IVFPQSearch, IVFPQSearchKernel)
+    .device(DeviceType::CPU)
+    .batch()
+    .num_devices(1);
+}
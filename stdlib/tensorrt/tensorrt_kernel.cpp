@@ -0,0 +1,343 @@
+#include "scanner/api/kernel.h"
+#include "scanner/api/op.h"
+#include "scanner/util/cuda.h"
+#include "scanner/util/fs.h"
+#include "scanner/util/memory.h"
+#include "scanner/util/opencv.h"
+#include "stdlib/stdlib.pb.h"
+
+#include <NvCaffeParser.h>
+#include <NvInfer.h>
+
+#include <unistd.h>
+#include <cstdio>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+
+namespace scanner {
+namespace {
+
+class Logger : public nvinfer1::ILogger {
+  void log(Severity severity, const char* msg) override {
+    if (severity <= Severity::kERROR) {
+      LOG(ERROR) << "TensorRT: " << msg;
+    } else if (severity == Severity::kWARNING) {
+      LOG(WARNING) << "TensorRT: " << msg;
+    } else {
+      VLOG(1) << "TensorRT: " << msg;
+    }
+  }
+};
+
+Logger& logger() {
+  static Logger logger;
+  return logger;
+}
+
+struct Destroy {
+  template <typename T>
+  void operator()(T* t) const {
+    if (t != nullptr) {
+      t->destroy();
+    }
+  }
+};
+
+template <typename T>
+using TRTPtr = std::unique_ptr<T, Destroy>;
+
+// Engines are shared by every kernel instance on a GPU. Building one can
+// take minutes, so it happens once per (net, batch size, precision, GPU).
+std::mutex engines_mutex;
+std::map<std::string, std::shared_ptr<nvinfer1::ICudaEngine>> engines;
+
+std::string engine_key(const proto::TensorRTArgs& args,
+                       const cudaDeviceProp& props) {
+  const proto::NetDescriptor& descriptor = args.net_descriptor();
+  std::stringstream key;
+  key << descriptor.model_path() << ";" << descriptor.model_weights_path()
+      << ";" << args.batch_size() << ";"
+      << proto::TensorRTArgs::Precision_Name(args.precision()) << ";"
+      << props.name << ";" << props.major << "." << props.minor << ";"
+      << getInferLibVersion();
+  for (const std::string& name : descriptor.output_layer_names()) {
+    key << ";" << name;
+  }
+  return key.str();
+}
+
+std::shared_ptr<nvinfer1::ICudaEngine> build_engine(
+    const proto::TensorRTArgs& args) {
+  const proto::NetDescriptor& descriptor = args.net_descriptor();
+  TRTPtr<nvinfer1::IBuilder> builder(nvinfer1::createInferBuilder(logger()));
+  TRTPtr<nvinfer1::INetworkDefinition> network(builder->createNetwork());
+  TRTPtr<nvcaffeparser1::ICaffeParser> parser(
+      nvcaffeparser1::createCaffeParser());
+
+  bool half = args.precision() == proto::TensorRTArgs::FP16 &&
+              builder->platformHasFastFp16();
+  const nvcaffeparser1::IBlobNameToTensor* blobs = parser->parse(
+      descriptor.model_path().c_str(), descriptor.model_weights_path().c_str(),
+      *network, half ? nvinfer1::DataType::kHALF : nvinfer1::DataType::kFLOAT);
+  if (blobs == nullptr) {
+    return nullptr;
+  }
+  for (const std::string& name : descriptor.output_layer_names()) {
+    nvinfer1::ITensor* tensor = blobs->find(name.c_str());
+    if (tensor == nullptr) {
+      LOG(ERROR) << "TensorRT: net has no blob " << name;
+      return nullptr;
+    }
+    network->markOutput(*tensor);
+  }
+
+  builder->setMaxBatchSize(args.batch_size());
+  builder->setMaxWorkspaceSize(1 << 30);
+  builder->setFp16Mode(half);
+  return std::shared_ptr<nvinfer1::ICudaEngine>(
+      builder->buildCudaEngine(*network), Destroy());
+}
+
+std::shared_ptr<nvinfer1::ICudaEngine> load_engine(const std::string& path) {
+  std::ifstream file(path, std::ios::binary);
+  if (!file) {
+    return nullptr;
+  }
+  std::string data((std::istreambuf_iterator<char>(file)),
+                   std::istreambuf_iterator<char>());
+  TRTPtr<nvinfer1::IRuntime> runtime(nvinfer1::createInferRuntime(logger()));
+  return std::shared_ptr<nvinfer1::ICudaEngine>(
+      runtime->deserializeCudaEngine(data.data(), data.size(), nullptr),
+      Destroy());
+}
+
+void save_engine(nvinfer1::ICudaEngine* engine, const std::string& dir,
+                 const std::string& path) {
+  mkdir_p(dir.c_str(), S_IRWXU);
+  TRTPtr<nvinfer1::IHostMemory> serialized(engine->serialize());
+  // Written aside and renamed so concurrent workers never read half a file
+  std::string tmp_path = path + ".tmp" + std::to_string(getpid());
+  {
+    std::ofstream file(tmp_path, std::ios::binary);
+    file.write((const char*)serialized->data(), serialized->size());
+  }
+  std::rename(tmp_path.c_str(), path.c_str());
+}
+
+std::shared_ptr<nvinfer1::ICudaEngine> get_engine(
+    const proto::TensorRTArgs& args, i32 device_id) {
+  cudaDeviceProp props;
+  CU_CHECK(cudaGetDeviceProperties(&props, device_id));
+  std::string key = engine_key(args, props);
+
+  std::unique_lock<std::mutex> lock(engines_mutex);
+  std::string memory_key = key + ";" + std::to_string(device_id);
+  auto it = engines.find(memory_key);
+  if (it != engines.end()) {
+    return it->second;
+  }
+
+  std::shared_ptr<nvinfer1::ICudaEngine> engine;
+  std::string path;
+  if (!args.engine_cache_dir().empty()) {
+    std::stringstream name;
+    name << std::hex << std::hash<std::string>()(key) << ".engine";
+    path = args.engine_cache_dir() + "/" + name.str();
+    engine = load_engine(path);
+  }
+  if (!engine) {
+    engine = build_engine(args);
+    if (engine && !path.empty()) {
+      save_engine(engine.get(), args.engine_cache_dir(), path);
+    }
+  }
+  if (engine) {
+    engines[memory_key] = engine;
+  }
+  return engine;
+}
+
+size_t volume(const nvinfer1::Dims& dims) {
+  size_t v = 1;
+  for (i32 i = 0; i < dims.nbDims; ++i) {
+    v *= dims.d[i];
+  }
+  return v;
+}
+}
+
+// Runs Caffe nets through an optimized TensorRT engine. Takes the same
+// arguments and has the same column contract as Caffe: one (C, H, W) float
+// frame per row for each input layer, and one per output layer out.
+class TensorRTKernel : public BatchedKernel {
+ public:
+  TensorRTKernel(const KernelConfig& config)
+    : BatchedKernel(config), device_(config.devices[0]) {
+    if (!args_.ParseFromArray(config.args.data(), config.args.size())) {
+      RESULT_ERROR(&valid_, "Could not parse TensorRTArgs");
+      return;
+    }
+    const proto::NetDescriptor& descriptor = args_.net_descriptor();
+    if (descriptor.uses_python()) {
+      RESULT_ERROR(&valid_, "TensorRT can not run nets with Python layers");
+      return;
+    }
+    if (descriptor.output_layer_names_size() !=
+        (i32)config.output_columns.size()) {
+      RESULT_ERROR(&valid_,
+                   "# output columns in net descriptor (%d) does not match "
+                   "number of output columns registered for op (%lu)",
+                   descriptor.output_layer_names_size(),
+                   config.output_columns.size());
+      return;
+    }
+    if (args_.batch_size() <= 0) {
+      args_.set_batch_size(1);
+    }
+
+    set_device();
+    CU_CHECK(cudaStreamCreateWithFlags(&stream_, cudaStreamNonBlocking));
+    engine_ = get_engine(args_, device_.id);
+    if (!engine_) {
+      RESULT_ERROR(&valid_, "Failed to build a TensorRT engine for %s",
+                   descriptor.model_path().c_str());
+      return;
+    }
+    context_.reset(engine_->createExecutionContext());
+
+    bindings_.resize(engine_->getNbBindings());
+    for (const std::string& name : descriptor.input_layer_names()) {
+      i32 index = engine_->getBindingIndex(name.c_str());
+      LOG_IF(FATAL, index < 0) << "TensorRT engine has no input " << name;
+      input_bindings_.push_back(index);
+      size_t size = volume(engine_->getBindingDimensions(index)) * sizeof(f32);
+      input_sizes_.push_back(size);
+      staging_.push_back(new_buffer(device_, size * args_.batch_size()));
+    }
+    for (const std::string& name : descriptor.output_layer_names()) {
+      i32 index = engine_->getBindingIndex(name.c_str());
+      LOG_IF(FATAL, index < 0) << "TensorRT engine has no output " << name;
+      output_bindings_.push_back(index);
+    }
+    valid_.set_success(true);
+  }
+
+  ~TensorRTKernel() {
+    set_device();
+    for (u8* buffer : staging_) {
+      delete_buffer(device_, buffer);
+    }
+    context_.reset();
+    engine_.reset();
+    if (stream_ != nullptr) {
+      cudaStreamDestroy(stream_);
+    }
+  }
+
+  void validate(proto::Result* result) override { result->CopyFrom(valid_); }
+
+  void execute(const BatchedColumns& input_columns,
+               BatchedColumns& output_columns) override {
+    set_device();
+    i32 input_count = num_rows(input_columns[0]);
+    i32 batch_size = args_.batch_size();
+    // The engine runs any batch up to its maximum, so a short last batch
+    // needs no rebuild
+    for (i32 start = 0; start < input_count; start += batch_size) {
+      i32 batch_count = std::min(input_count - start, batch_size);
+
+      for (size_t i = 0; i < input_bindings_.size(); ++i) {
+        bindings_[input_bindings_[i]] =
+            bind_input(input_columns[i], i, start, batch_count);
+      }
+
+      std::vector<u8*> output_blocks;
+      std::vector<FrameInfo> output_infos;
+      for (size_t i = 0; i < output_bindings_.size(); ++i) {
+        nvinfer1::Dims dims = engine_->getBindingDimensions(output_bindings_[i]);
+        FrameInfo info(dims.d[0], dims.nbDims >= 2 ? dims.d[1] : 1,
+                       dims.nbDims >= 3 ? dims.d[2] : 1, FrameType::F32);
+        // The engine writes straight into the output rows
+        u8* block =
+            new_block_buffer(device_, info.size() * batch_count, batch_count);
+        bindings_[output_bindings_[i]] = block;
+        output_blocks.push_back(block);
+        output_infos.push_back(info);
+      }
+
+      auto net_start = now();
+      LOG_IF(FATAL, !context_->enqueue(batch_count, bindings_.data(), stream_,
+                                       nullptr))
+          << "TensorRT inference failed";
+      CU_CHECK(cudaStreamSynchronize(stream_));
+      if (profiler_) {
+        profiler_->add_interval("tensorrt:net", net_start, now());
+      }
+
+      for (size_t i = 0; i < output_blocks.size(); ++i) {
+        for (i32 b = 0; b < batch_count; ++b) {
+          insert_frame(output_columns[i],
+                       new Frame(output_infos[i],
+                                 output_blocks[i] + output_infos[i].size() * b));
+        }
+      }
+    }
+  }
+
+  void set_device() { CU_CHECK(cudaSetDevice(device_.id)); }
+
+ private:
+  // Packed batches of float frames are bound as they are, anything else is
+  // gathered into the staging buffer of the binding
+  void* bind_input(const ElementList& column, size_t input, i32 start,
+                   i32 count) {
+    const Frame* first = column[start].as_const_frame();
+    size_t size = input_sizes_[input];
+    if (first->type == FrameType::F32 && first->size() == size &&
+        is_tensor_batch(column, start, count)) {
+      return first->data;
+    }
+    u8* staging = staging_[input];
+    for (i32 b = 0; b < count; ++b) {
+      const Frame* frame = column[start + b].as_const_frame();
+      if (frame->type == FrameType::F16) {
+        LOG_IF(FATAL, frame->size() * 2 != size)
+            << "Input frame does not match the net input size";
+        f16_to_f32(device_, (const u16*)frame->data,
+                   (f32*)(staging + size * b), size / sizeof(f32));
+      } else {
+        LOG_IF(FATAL, frame->size() != size)
+            << "Input frame does not match the net input size";
+        memcpy_buffer(staging + size * b, device_, frame->data, device_,
+                      size);
+      }
+    }
+    return staging;
+  }
+
+  DeviceHandle device_;
+  proto::TensorRTArgs args_;
+  proto::Result valid_;
+  cudaStream_t stream_ = nullptr;
+  std::shared_ptr<nvinfer1::ICudaEngine> engine_;
+  TRTPtr<nvinfer1::IExecutionContext> context_;
+  std::vector<void*> bindings_;
+  std::vector<i32> input_bindings_;
+  std::vector<size_t> input_sizes_;
+  std::vector<u8*> staging_;
+  std::vector<i32> output_bindings_;
+};
+
+REGISTER_OP(TensorRT)
+    .frame_input("caffe_frame")
+    .frame_output("caffe_output");
+
+REGISTER_KERNEL(TensorRT, TensorRTKernel)
+    .device(DeviceType::GPU)
+    .batch()
+    .num_devices(1);
+}
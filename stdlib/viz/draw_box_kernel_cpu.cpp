@@ -18,25 +18,38 @@ class DrawBoxKernelCPU : public BatchedKernel {
 
     i32 input_count = num_rows(frame_col);
     FrameInfo info = frame_col[0].as_const_frame()->as_frame_info();
-    std::vector<Frame*> output_frames = new_frames(device_, info, input_count);
-
+    // Writable frames are drawn on where they are, the rest on copies
+    i32 copies = 0;
     for (i32 i = 0; i < input_count; ++i) {
-      cv::Mat img = frame_to_mat(frame_col[i].as_const_frame());
-      cv::Mat out_img = frame_to_mat(output_frames[i]);
-      img.copyTo(out_img);
+      copies += frame_col[i].writable ? 0 : 1;
+    }
+    std::vector<Frame*> copy_frames;
+    if (copies > 0) {
+      copy_frames = new_frames(device_, info, copies);
+    }
 
-      // Deserialize bboxes
-      std::vector<BoundingBox> bboxes =
-          deserialize_bbox_vector(bbox_col[i].buffer, bbox_col[i].size);
+    i32 next_copy = 0;
+    for (i32 i = 0; i < input_count; ++i) {
+      Frame* output_frame;
+      cv::Mat out_img;
+      if (frame_col[i].writable) {
+        output_frame = reinterpret_cast<Frame*>(frame_col[i].buffer);
+        out_img = frame_to_mat(output_frame);
+      } else {
+        output_frame = copy_frames[next_copy++];
+        out_img = frame_to_mat(output_frame);
+        frame_to_mat(frame_col[i].as_const_frame()).copyTo(out_img);
+      }
 
       // Draw all bboxes
+      FlatBoxList bboxes(bbox_col[i].buffer, bbox_col[i].size);
       for (auto& bbox : bboxes) {
-        i32 width = bbox.x2() - bbox.x1();
-        i32 height = bbox.y2() - bbox.y1();
-        cv::rectangle(out_img, cv::Rect(bbox.x1(), bbox.y1(), width, height),
+        i32 width = bbox.x2 - bbox.x1;
+        i32 height = bbox.y2 - bbox.y1;
+        cv::rectangle(out_img, cv::Rect(bbox.x1, bbox.y1, width, height),
                       cv::Scalar(255, 0, 0), 2);
       }
-      insert_frame(output_columns[0], output_frames[i]);
+      insert_frame(output_columns[0], output_frame);
     }
   }
 
@@ -48,5 +61,6 @@ REGISTER_OP(DrawBox).frame_input("frame").input("bboxes").frame_output("frame");
 
 REGISTER_KERNEL(DrawBox, DrawBoxKernelCPU)
     .device(DeviceType::CPU)
-    .num_devices(1);
+    .num_devices(1)
+    .in_place();
 }
@@ -0,0 +1,144 @@
+#include "scanner/api/kernel.h"
+#include "scanner/api/op.h"
+#include "scanner/util/cuda.h"
+#include "scanner/util/image.h"
+#include "scanner/util/memory.h"
+#include "scanner/util/serialize.h"
+
+namespace scanner {
+
+// Draws every box of a batch with one launch on device resident frames, so
+// GPU pipelines do not round trip frames through the host to draw on them.
+// Only the serialized boxes are copied to the host to be parsed.
+class DrawBoxKernelGPU : public BatchedKernel {
+ public:
+  DrawBoxKernelGPU(const KernelConfig& config)
+    : BatchedKernel(config), device_(config.devices[0]) {
+    set_device();
+    CU_CHECK(cudaStreamCreateWithFlags(&stream_, cudaStreamNonBlocking));
+  }
+
+  ~DrawBoxKernelGPU() {
+    set_device();
+    cudaStreamDestroy(stream_);
+  }
+
+  void execute(const BatchedColumns& input_columns,
+               BatchedColumns& output_columns) override {
+    auto& frame_col = input_columns[0];
+    auto& bbox_col = input_columns[1];
+
+    set_device();
+
+    i32 input_count = num_rows(frame_col);
+    FrameInfo info = frame_col[0].as_const_frame()->as_frame_info();
+    LOG_IF(FATAL, info.channels() != 3 || info.type != FrameType::U8)
+        << "DrawBox expects 3 channel U8 frames";
+
+    // Writable frames are drawn on where they are, the rest on copies
+    i32 copies = 0;
+    for (i32 i = 0; i < input_count; ++i) {
+      copies += frame_col[i].writable ? 0 : 1;
+    }
+    std::vector<Frame*> copy_frames;
+    if (copies > 0) {
+      copy_frames = new_frames(device_, info, copies);
+    }
+
+    std::vector<Frame*> output_frames(input_count);
+    std::vector<u8*> frames(input_count);
+    std::vector<size_t> pitches(input_count);
+    i32 next_copy = 0;
+    for (i32 i = 0; i < input_count; ++i) {
+      const Frame* input = frame_col[i].as_const_frame();
+      LOG_IF(FATAL, input->width() != info.width() ||
+                        input->height() != info.height())
+          << "DrawBox expects a batch of same sized frames";
+      if (frame_col[i].writable) {
+        output_frames[i] = reinterpret_cast<Frame*>(frame_col[i].buffer);
+      } else {
+        output_frames[i] = copy_frames[next_copy++];
+        CU_CHECK(cudaMemcpy2DAsync(
+            output_frames[i]->data, output_frames[i]->row_stride, input->data,
+            input->row_stride, input->row_size(), input->height(),
+            cudaMemcpyDeviceToDevice, stream_));
+      }
+      frames[i] = output_frames[i]->data;
+      pitches[i] = output_frames[i]->row_stride;
+    }
+
+    // Deserialize bboxes
+    std::vector<u8*> src_buffers(input_count);
+    std::vector<u8*> host_buffers(input_count);
+    std::vector<size_t> sizes(input_count);
+    size_t total_size = 0;
+    for (i32 i = 0; i < input_count; ++i) {
+      src_buffers[i] = bbox_col[i].buffer;
+      sizes[i] = bbox_col[i].size;
+      total_size += sizes[i];
+    }
+    u8* host_block = new_buffer(CPU_DEVICE, total_size);
+    size_t offset = 0;
+    for (i32 i = 0; i < input_count; ++i) {
+      host_buffers[i] = host_block + offset;
+      offset += sizes[i];
+    }
+    memcpy_vec(host_buffers, CPU_DEVICE, src_buffers, device_, sizes);
+
+    std::vector<DrawBoxRect> boxes;
+    for (i32 i = 0; i < input_count; ++i) {
+      FlatBoxList bboxes(host_buffers[i], sizes[i]);
+      for (auto& bbox : bboxes) {
+        // Same corners as the CPU kernel's cv::rectangle
+        i32 x1 = bbox.x1;
+        i32 y1 = bbox.y1;
+        i32 width = bbox.x2 - bbox.x1;
+        i32 height = bbox.y2 - bbox.y1;
+        boxes.push_back(
+            DrawBoxRect{i, x1, y1, x1 + width - 1, y1 + height - 1});
+      }
+    }
+    delete_buffer(CPU_DEVICE, host_block);
+
+    // The frame and box tables live on the device for the length of the
+    // launch
+    size_t frames_bytes = sizeof(u8*) * input_count;
+    size_t pitches_bytes = sizeof(size_t) * input_count;
+    size_t boxes_bytes = sizeof(DrawBoxRect) * boxes.size();
+    u8* table = new_buffer(device_, frames_bytes + pitches_bytes + boxes_bytes);
+    CU_CHECK(cudaMemcpyAsync(table, frames.data(), frames_bytes,
+                             cudaMemcpyHostToDevice, stream_));
+    CU_CHECK(cudaMemcpyAsync(table + frames_bytes, pitches.data(),
+                             pitches_bytes, cudaMemcpyHostToDevice, stream_));
+    if (!boxes.empty()) {
+      CU_CHECK(cudaMemcpyAsync(table + frames_bytes + pitches_bytes,
+                               boxes.data(), boxes_bytes,
+                               cudaMemcpyHostToDevice, stream_));
+    }
+    const u8 color[3] = {255, 0, 0};
+    CU_CHECK(drawBoxesBatch(
+        (u8* const*)table, (const size_t*)(table + frames_bytes),
+        info.width(), info.height(),
+        (const DrawBoxRect*)(table + frames_bytes + pitches_bytes),
+        boxes.size(), 2, color, stream_));
+    CU_CHECK(cudaStreamSynchronize(stream_));
+    delete_buffer(device_, table);
+
+    for (i32 i = 0; i < input_count; ++i) {
+      insert_frame(output_columns[0], output_frames[i]);
+    }
+  }
+
+  void set_device() { CU_CHECK(cudaSetDevice(device_.id)); }
+
+ private:
+  DeviceHandle device_;
+  cudaStream_t stream_;
+};
+
+REGISTER_KERNEL(DrawBox, DrawBoxKernelGPU)
+    .device(DeviceType::GPU)
+    .batch()
+    .num_devices(1)
+    .in_place();
+}
@@ -0,0 +1,265 @@
+"""
+End-to-end benchmarks of standard Scanner workloads.
+
+Each workload runs over a synthetic video generated with ffmpeg and over
+the reference test videos, and reports rows per second, the time spent in
+each pipeline stage from the job profile, and peak memory. Results are
+printed and, with --output, written as JSON so runs of different releases
+on the same hardware can be compared. Run through the scanner_bench build
+target or directly:
+
+    python tests/bench.py --workloads histogram,sparse_gather --gpu
+
+With --baseline, the results are compared with those of an earlier run and
+the script exits with an error if any workload regressed past --threshold,
+so it can gate CI.
+"""
+
+from scannerpy import Database, Config, DeviceType, BulkJob, Job
+from scannerpy.profiler import compare_profiles
+from scannerpy.stdlib import NetDescriptor
+from subprocess import check_call as run
+from timeit import default_timer as now
+import argparse
+import json
+import os.path
+import requests
+import resource
+import sys
+import tempfile
+import toml
+
+cwd = os.path.dirname(os.path.abspath(__file__))
+
+REFERENCE_VIDEOS = {
+    'short': 'https://storage.googleapis.com/scanner-data/test/'
+             'short_video.mp4',
+    'long': 'https://storage.googleapis.com/scanner-data/test/'
+            'long_video.mp4',
+}
+
+SYNTHETIC_VIDEO_SECONDS = 120
+SPARSE_GATHER_STRIDE = 97
+
+
+def download(url, path):
+    resp = requests.get(url, stream=True)
+    assert resp.ok
+    with open(path, 'wb') as f:
+        for block in resp.iter_content(1024 * 1024):
+            f.write(block)
+
+
+def make_synthetic_video(path):
+    # 720p test pattern, encoded like typical ingested video
+    run(['ffmpeg', '-y', '-f', 'lavfi', '-i',
+         'testsrc=duration={}:size=1280x720:rate=30'.format(
+             SYNTHETIC_VIDEO_SECONDS),
+         '-c:v', 'libx264', '-g', '30', '-pix_fmt', 'yuv420p', path])
+
+
+def decode(db, frame, table, device):
+    return db.ops.DiscardFrame(ignore=frame, device=device), {}, {}
+
+
+def histogram(db, frame, table, device):
+    return db.ops.Histogram(frame=frame, device=device), {}, {}
+
+
+def resize_caffe(db, frame, table, device):
+    descriptor = NetDescriptor.from_file(
+        db, os.path.join(cwd, '..', 'nets', 'resnet.toml'))
+    batch_size = 48
+    resized = db.ops.Resize(frame=frame, width=224, height=224, device=device)
+    caffe_input = db.ops.CaffeInput(
+        frame=resized, net_descriptor=descriptor.as_proto(),
+        batch_size=batch_size, device=device)
+    caffe_output = db.ops.Caffe(
+        caffe_frame=caffe_input, net_descriptor=descriptor.as_proto(),
+        batch_size=batch_size, batch=batch_size, device=device)
+    return caffe_output, {}, {}
+
+
+def sparse_gather(db, frame, table, device):
+    sampled = frame.sample()
+    hist = db.ops.Histogram(frame=sampled, device=device)
+    rows = range(0, table.num_rows(), SPARSE_GATHER_STRIDE)
+    return hist, {sampled: db.sampler.gather(rows)}, {}
+
+
+def optical_flow(db, frame, table, device):
+    flow = db.ops.OpticalFlow(frame=frame, stencil=[-1, 0], device=device)
+    # Flow fields are large, so only their shape is saved
+    return db.ops.InfoFromFrame(frame=flow), {}, {}
+
+
+def save_heavy(db, frame, table, device):
+    # A small element per row in small io packets, so the job is dominated
+    # by writing many small item files
+    info = db.ops.InfoFromFrame(frame=frame)
+    return info, {}, {'io_packet_size': 64, 'work_packet_size': 64}
+
+
+WORKLOADS = [
+    ('decode', decode),
+    ('histogram', histogram),
+    ('resize_caffe', resize_caffe),
+    ('sparse_gather', sparse_gather),
+    ('optical_flow', optical_flow),
+    ('save_heavy', save_heavy),
+]
+
+
+def stage_breakdown(profiler):
+    # Seconds spent in each interval of the load, eval and save stages
+    stats = profiler.statistics()
+    stages = {}
+    for kind in ['load', 'eval', 'save']:
+        stages[kind] = dict(
+            (key, value) for (key, value) in stats.get(kind, {}).iteritems()
+            if isinstance(value, float))
+    return stages
+
+
+def peak_memory(profiler):
+    # Largest system allocation of any device of any node during the job
+    peak = 0
+    for devices in profiler.memory_statistics().values():
+        for counters in devices.values():
+            peak = max(peak, counters.get('system_peak_bytes', 0))
+    return peak
+
+
+def run_workload(db, name, workload, table, device, repeat):
+    frame = db.ops.FrameInput()
+    column, op_args, run_kwargs = workload(db, frame, table, device)
+    output = db.ops.Output(columns=[column])
+    op_args[frame] = table.column('frame')
+    op_args[output] = '_bench_{}_{}'.format(name, table.name())
+    bulk_job = BulkJob(output=output, jobs=[Job(op_args=op_args)])
+
+    times = []
+    for _ in range(repeat):
+        start = now()
+        [output_table] = db.run(bulk_job, force=True, show_progress=False,
+                                **run_kwargs)
+        times.append(now() - start)
+    best = min(times)
+    profiler = output_table.profiler()
+    result = {
+        'workload': name,
+        'video': table.name(),
+        'rows': output_table.num_rows(),
+        'seconds': best,
+        'rows_per_sec': output_table.num_rows() / best,
+        'stages': stage_breakdown(profiler),
+        'peak_memory_bytes': peak_memory(profiler),
+        'profile': profiler.summary(),
+        # Workers run in this process, see Database(debug=True)
+        'peak_rss_bytes':
+            resource.getrusage(resource.RUSAGE_SELF).ru_maxrss * 1024,
+    }
+    db.delete_table(output_table.name())
+    return result
+
+
+def check_regressions(baseline, results, threshold):
+    # Descriptions of the workloads that got slower than their baseline
+    baseline = dict(((r['workload'], r['video']), r) for r in baseline)
+    regressions = []
+    for result in results:
+        b = baseline.get((result['workload'], result['video']))
+        if b is None:
+            continue
+        name = '{} on {}'.format(result['workload'], result['video'])
+        change = result['rows_per_sec'] / b['rows_per_sec'] - 1
+        if change < -threshold:
+            regressions.append('{}: rows/s went from {:.1f} to {:.1f}'.format(
+                name, b['rows_per_sec'], result['rows_per_sec']))
+        comparison = compare_profiles(b['profile'], result['profile'],
+                                      threshold)
+        for regression in comparison['regressions']:
+            regressions.append('{}: {}'.format(name, regression))
+    return regressions
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split('\n\n')[0])
+    parser.add_argument('--workloads',
+                        default=','.join(n for (n, _) in WORKLOADS),
+                        help='Comma separated workloads to run')
+    parser.add_argument('--videos', default='synthetic,short,long',
+                        help='Comma separated videos: synthetic, ' +
+                        ', '.join(REFERENCE_VIDEOS.keys()))
+    parser.add_argument('--gpu', action='store_true',
+                        help='Run ops on the GPU where they support it')
+    parser.add_argument('--repeat', type=int, default=3,
+                        help='Runs of each workload, the fastest is kept')
+    parser.add_argument('--output', help='Path to write results as JSON')
+    parser.add_argument('--baseline',
+                        help='Results of an earlier run to compare with')
+    parser.add_argument('--threshold', type=float, default=0.1,
+                        help='Relative slowdown that fails the comparison')
+    args = parser.parse_args()
+
+    workloads = dict(WORKLOADS)
+    names = args.workloads.split(',')
+    for name in names:
+        if name not in workloads:
+            parser.error('Unknown workload {}'.format(name))
+    device = DeviceType.GPU if args.gpu else DeviceType.CPU
+
+    work_dir = tempfile.mkdtemp()
+    cfg = Config.default_config()
+    cfg['storage']['db_path'] = os.path.join(work_dir, 'db')
+    cfg_path = os.path.join(work_dir, 'config.toml')
+    with open(cfg_path, 'w') as f:
+        f.write(toml.dumps(cfg))
+
+    results = []
+    try:
+        videos = []
+        for video in args.videos.split(','):
+            path = os.path.join(work_dir, video + '.mp4')
+            if video == 'synthetic':
+                make_synthetic_video(path)
+            else:
+                download(REFERENCE_VIDEOS[video], path)
+            videos.append(('bench_' + video, path))
+
+        with Database(config_path=cfg_path, debug=True) as db:
+            db.ingest_videos(videos, force=True)
+            for name in names:
+                for (table_name, _) in videos:
+                    try:
+                        result = run_workload(db, name, workloads[name],
+                                              db.table(table_name), device,
+                                              args.repeat)
+                    except Exception as e:
+                        # e.g. stdlib built without Caffe
+                        print('{} on {} failed: {}'.format(
+                            name, table_name, e))
+                        continue
+                    results.append(result)
+                    print('{:>14} {:>16} {:>12.1f} rows/s {:>8.1f} MB'.format(
+                        name, table_name, result['rows_per_sec'],
+                        result['peak_memory_bytes'] / 1024.0 / 1024.0))
+    finally:
+        run(['rm', '-rf', work_dir])
+
+    if args.output is not None:
+        with open(args.output, 'w') as f:
+            json.dump(results, f, indent=2, sort_keys=True)
+
+    if args.baseline is not None:
+        with open(args.baseline) as f:
+            regressions = check_regressions(json.load(f), results,
+                                            args.threshold)
+        for regression in regressions:
+            print('REGRESSION {}'.format(regression))
+        if len(regressions) > 0:
+            sys.exit(1)
+
+
+if __name__ == '__main__':
+    main()
@@ -1,6 +1,7 @@
 from scannerpy import (
-    Database, Config, DeviceType, ColumnType, BulkJob, Job, ProtobufGenerator)
-from scannerpy.stdlib import parsers
+    Database, Config, DeviceType, ColumnType, BulkJob, Job, ProtobufGenerator,
+    ScannerException)
+from scannerpy.stdlib import parsers, writers
 import tempfile
 import toml
 import pytest
@@ -321,6 +322,369 @@ def test_unbounded_state(db):
         num_rows += 1
     assert num_rows == db.table('test1').num_rows()
 
+def test_work_stealing_long_tasks(db):
+    # Unbounded state keeps each 50 row group in one task, so with 5 row io
+    # packets a task has more packets than fit in a pipeline instance's
+    # input queue
+    frame = db.ops.FrameInput()
+    slice_frame = frame.slice()
+    increment = db.ops.TestIncrementUnbounded(ignore=slice_frame)
+    unsliced_increment = increment.unslice()
+    output_op = db.ops.Output(columns=[unsliced_increment])
+    job = Job(
+        op_args={
+            frame: db.table('test1').column('frame'),
+            slice_frame: db.partitioner.all(50),
+            output_op: 'test_work_stealing_long_tasks',
+        }
+    )
+    bulk_job = BulkJob(output=output_op, jobs=[job])
+    tables = db.run(bulk_job, force=True, show_progress=False,
+                    io_packet_size=5, work_packet_size=5,
+                    pipeline_instances_per_node=2, work_stealing=True)
+
+    num_rows = 0
+    for (frame_index, buf) in tables[0].column('integer').load():
+        (val,) = struct.unpack('=q', buf)
+        assert val == frame_index % 50
+        num_rows += 1
+    assert num_rows == db.table('test1').num_rows()
+
+def test_gather_partitioner(db):
+    # Rows of each group mix runs and scattered rows, so they are sent as
+    # several ranges per group
+    groups = [list(range(0, 20)) + [40, 42, 44],
+              [100, 101, 150] + list(range(200, 230)),
+              [301, 302, 377]]
+    rows = [r for group in groups for r in group]
+
+    # Unbounded state restarts with every task, so it counts the rows of
+    # each group from zero
+    frame = db.ops.FrameInput()
+    slice_frame = frame.slice()
+    increment = db.ops.TestIncrementUnbounded(ignore=slice_frame)
+    unsliced_increment = increment.unslice()
+    output_op = db.ops.Output(columns=[unsliced_increment])
+    job = Job(
+        op_args={
+            frame: db.table('test1').column('frame'),
+            slice_frame: db.partitioner.gather(groups),
+            output_op: 'test_gather_partitioner',
+        }
+    )
+    bulk_job = BulkJob(output=output_op, jobs=[job])
+    tables = db.run(bulk_job, force=True, show_progress=False)
+    values = [struct.unpack('=q', buf)[0]
+              for _, buf in tables[0].column('integer').load()]
+    assert values == [i for group in groups for i in range(len(group))]
+
+    # Each task read the rows of its own group: their histograms match
+    # those of the same rows gathered by a sampler
+    def histograms(sampled, partition):
+        frame = db.ops.FrameInput()
+        sliced = frame.slice() if partition else frame.sample()
+        hist = db.ops.Histogram(frame=sliced)
+        output = hist.unslice() if partition else hist
+        output_op = db.ops.Output(columns=[output])
+        job = Job(
+            op_args={
+                frame: db.table('test1').column('frame'),
+                sliced: sampled,
+                output_op: 'test_gather_partitioner_hist',
+            }
+        )
+        bulk_job = BulkJob(output=output_op, jobs=[job])
+        tables = db.run(bulk_job, force=True, show_progress=False)
+        return [buf for _, buf in tables[0].column('histogram').load()]
+
+    partitioned = histograms(db.partitioner.gather(groups), True)
+    assert len(partitioned) == len(rows)
+    assert partitioned == histograms(db.sampler.gather(rows), False)
+
+
+def test_parquet_round_trip(db):
+    pa = pytest.importorskip('pyarrow')
+    pq = pytest.importorskip('pyarrow.parquet')
+
+    frame = db.ops.FrameInput()
+    hist = db.ops.Histogram(frame=frame)
+    output_op = db.ops.Output(columns=[hist])
+    job = Job(
+        op_args={
+            frame: db.table('test1').column('frame'),
+            output_op: 'test_parquet_round_trip',
+        }
+    )
+    bulk_job = BulkJob(output=output_op, jobs=[job])
+    [table] = db.run(bulk_job, force=True, show_progress=False,
+                     io_packet_size=100, work_packet_size=25)
+    num_rows = db.table('test1').num_rows()
+    num_items = (num_rows + 99) // 100
+    assert num_items > 1
+
+    arrow = table.to_arrow()
+    assert arrow.num_rows == num_rows
+    assert len(arrow.to_batches()) == num_items
+
+    f = tempfile.NamedTemporaryFile(delete=False, suffix='.parquet')
+    f.close()
+    table.to_parquet(f.name)
+    parquet = pq.ParquetFile(f.name)
+    assert parquet.metadata.num_rows == num_rows
+    assert parquet.num_row_groups == num_items
+    read = parquet.read()
+    assert read.column_names == table.column_names()
+    for name in table.column_names():
+        assert read.schema.field(name).type == arrow.schema.field(name).type
+        assert len(read.column(name)) == num_rows
+    assert read.column('histogram').to_pylist() == [
+        buf for _, buf in table.column('histogram').load()]
+    run(['rm', '-f', f.name])
+
+
+def test_bbox_parsers(db):
+    def box_fields(b):
+        return (b.x1, b.y1, b.x2, b.y2, b.score, b.track_id, b.track_score,
+                b.label)
+
+    boxes = []
+    for i in range(5):
+        box = db.protobufs.BoundingBox()
+        (box.x1, box.y1, box.x2, box.y2) = (i + 0.5, i * 2.0, i + 10.25, 20.0)
+        box.score = 1.0 / (i + 1)
+        box.track_id = i - 1
+        box.track_score = 0.125 * i
+        box.label = 100 + i
+        boxes.append(box)
+
+    # Length prefixed protobuf list, as written before the flat format
+    legacy = struct.pack('=Q', len(boxes))
+    for box in boxes:
+        data = box.SerializeToString()
+        legacy += struct.pack('=Q', len(data)) + data
+    [flat] = writers.bboxes([boxes], db.protobufs)
+    assert len(flat) == 8 + 40 * len(boxes)
+
+    expected = [box_fields(b) for b in parsers.bboxes(legacy, db.protobufs)]
+    assert len(expected) == len(boxes)
+    # Floats are stored as float32 in both formats
+    for got, box in zip(expected, boxes):
+        assert np.allclose(got, box_fields(box))
+    assert [box_fields(b)
+            for b in parsers.bboxes(flat, db.protobufs)] == expected
+    assert (parsers.bbox_array(flat, db.protobufs) ==
+            parsers.bbox_array(legacy, db.protobufs)).all()
+    assert parsers.bboxes(struct.pack('=Q', 0), db.protobufs) == []
+    assert len(parsers.bbox_array(
+        writers.bboxes([[]], db.protobufs)[0], db.protobufs)) == 0
+
+    vectors = np.arange(12, dtype=np.float32).reshape(3, 4)
+    [flat] = writers.features([vectors], db.protobufs)
+    assert (parsers.features(flat, db.protobufs) == vectors).all()
+    raw = vectors[1].tobytes()
+    assert (parsers.features(raw, db.protobufs) == vectors[1:2]).all()
+
+
+def test_keep_kernels_warm(db):
+    def run_histogram():
+        frame = db.ops.FrameInput()
+        hist = db.ops.Histogram(frame=frame)
+        output_op = db.ops.Output(columns=[hist])
+        job = Job(
+            op_args={
+                frame: db.table('test1').column('frame'),
+                output_op: 'test_keep_kernels_warm',
+            }
+        )
+        bulk_job = BulkJob(output=output_op, jobs=[job])
+        [table] = db.run(bulk_job, force=True, show_progress=False,
+                         keep_kernels_warm=True)
+        eval_stats = table.profiler().statistics().get('eval', {})
+        return ([buf for _, buf in table.column('histogram').load()],
+                eval_stats.get('kernels_reused', 0))
+
+    # The second bulk job takes over the kernels the first one left warm
+    first, _ = run_histogram()
+    second, reused = run_histogram()
+    assert reused > 0
+    assert second == first
+
+
+def test_task_scheduling(db):
+    def histograms(**kwargs):
+        frame = db.ops.FrameInput()
+        hist = db.ops.Histogram(frame=frame)
+        output_op = db.ops.Output(columns=[hist])
+        jobs = [
+            Job(
+                op_args={
+                    frame: db.table(name).column('frame'),
+                    output_op: 'test_task_scheduling_{}'.format(name),
+                }
+            ) for name in ['test1', 'test2']
+        ]
+        bulk_job = BulkJob(output=output_op, jobs=jobs)
+        tables = db.run(bulk_job, force=True, show_progress=False,
+                        io_packet_size=50, work_packet_size=25,
+                        pipeline_instances_per_node=2, **kwargs)
+        return [[buf for _, buf in table.column('histogram').load()]
+                for table in tables]
+
+    # Whatever order tasks are granted in, every row of every job is
+    # computed once and lands where it belongs
+    expected = histograms(task_scheduling='in_order')
+    assert ([len(rows) for rows in expected] ==
+            [db.table(name).num_rows() for name in ['test1', 'test2']])
+    for scheduling in ['locality', 'longest_first']:
+        assert histograms(task_scheduling=scheduling) == expected
+    assert histograms(weighted_scheduling=True) == expected
+
+
+def test_resume(db):
+    def run_histogram(**kwargs):
+        frame = db.ops.FrameInput()
+        hist = db.ops.Histogram(frame=frame)
+        output_op = db.ops.Output(columns=[hist])
+        job = Job(
+            op_args={
+                frame: db.table('test1').column('frame'),
+                output_op: 'test_resume',
+            }
+        )
+        bulk_job = BulkJob(output=output_op, jobs=[job])
+        return db.run(bulk_job, show_progress=False, io_packet_size=100,
+                      work_packet_size=25, **kwargs)[0]
+
+    table = run_histogram(force=True)
+    expected = [buf for _, buf in table.column('histogram').load()]
+
+    # Leave the bulk job as if it had stopped after its first task
+    table._need_descriptor()
+    path = 'jobs/{}/descriptor.bin'.format(table._descriptor.job_id)
+    descriptor = db._load_descriptor(db.protobufs.BulkJobDescriptor, path)
+    descriptor.interrupted = True
+    task = descriptor.completed_tasks.add()
+    task.job_id = 0
+    task.task_id = 0
+    db._save_descriptor(descriptor, path)
+    assert db._interrupted_bulk_job('test_resume')
+
+    with pytest.raises(ScannerException):
+        run_histogram(resume=False)
+    table = run_histogram(resume=True)
+    assert not db._interrupted_bulk_job('test_resume')
+    assert [buf for _, buf in table.column('histogram').load()] == expected
+
+
+def test_common_subexpressions(db):
+    def run_blur(shared):
+        frame = db.ops.FrameInput()
+        range_frame = frame.sample()
+        blurred_frame = db.ops.Blur(frame=range_frame, kernel_size=3,
+                                    sigma=0.1)
+        hist = db.ops.Histogram(frame=blurred_frame)
+        if not shared:
+            # Same op and args as blurred_frame, so it is merged into it
+            blurred_frame = db.ops.Blur(frame=range_frame, kernel_size=3,
+                                        sigma=0.1)
+        output_op = db.ops.Output(columns=[hist, blurred_frame.lossless()])
+        job = Job(
+            op_args={
+                frame: db.table('test1').column('frame'),
+                range_frame: db.sampler.range(0, 30),
+                output_op: 'test_common_subexpressions',
+            }
+        )
+        bulk_job = BulkJob(output=output_op, jobs=[job])
+        [table] = db.run(bulk_job, force=True, show_progress=False)
+        return ([buf for _, buf in table.column('histogram').load()],
+                [frames[0] for _, frames in table.load(['frame'])])
+
+    hists, frames = run_blur(shared=True)
+    merged_hists, merged_frames = run_blur(shared=False)
+    assert len(merged_hists) == 30
+    assert merged_hists == hists
+    assert len(merged_frames) == len(frames)
+    for (merged, frame) in zip(merged_frames, frames):
+        assert np.array_equal(merged, frame)
+
+
+def test_batch_deadline(db):
+    def histograms(**kwargs):
+        frame = db.ops.FrameInput()
+        hist = db.ops.Histogram(frame=frame, batch=8)
+        output_op = db.ops.Output(columns=[hist])
+        job = Job(
+            op_args={
+                frame: db.table('test1').column('frame'),
+                output_op: 'test_batch_deadline',
+            }
+        )
+        bulk_job = BulkJob(output=output_op, jobs=[job])
+        [table] = db.run(bulk_job, force=True, show_progress=False,
+                         io_packet_size=30, work_packet_size=30, **kwargs)
+        return [buf for _, buf in table.column('histogram').load()]
+
+    # Tasks of 30 rows end in a partial batch of 6, which waits for the
+    # first rows of the next task
+    expected = histograms()
+    assert len(expected) == db.table('test1').num_rows()
+    assert histograms(batch_deadline_ms=1000) == expected
+
+
+def test_cache_results(db):
+    def run_histogram(name):
+        frame = db.ops.FrameInput()
+        hist = db.ops.Histogram(frame=frame)
+        output_op = db.ops.Output(columns=[hist])
+        job = Job(
+            op_args={
+                frame: db.table('test1').column('frame'),
+                output_op: name,
+            }
+        )
+        bulk_job = BulkJob(output=output_op, jobs=[job])
+        [table] = db.run(bulk_job, force=True, show_progress=False,
+                         cache_results=True)
+        return table
+
+    table = run_histogram('test_cache_results')
+    expected = [buf for _, buf in table.column('histogram').load()]
+
+    # The whole output is cached, so the job is skipped and the table the
+    # first run wrote is returned
+    cached = run_histogram('test_cache_results_2')
+    assert cached.name() == 'test_cache_results'
+    assert not db.has_table('test_cache_results_2')
+    assert [buf for _, buf in cached.column('histogram').load()] == expected
+
+
+def test_reduce(db):
+    def histograms(reduce):
+        frame = db.ops.FrameInput()
+        hist = db.ops.Histogram(frame=frame)
+        if reduce:
+            hist = db.ops.SumHistograms(histogram=hist)
+        output_op = db.ops.Output(columns=[hist])
+        job = Job(
+            op_args={
+                frame: db.table('test1').column('frame'),
+                output_op: 'test_reduce',
+            }
+        )
+        bulk_job = BulkJob(output=output_op, jobs=[job])
+        [table] = db.run(bulk_job, force=True, show_progress=False,
+                         io_packet_size=100, work_packet_size=25)
+        return [buf for _, buf in table.column('histogram').load()]
+
+    # Each task sums its own rows, and the master adds up the tasks' sums
+    rows = histograms(reduce=False)
+    assert len(rows) > 100
+    [total] = histograms(reduce=True)
+    expected = np.sum([np.frombuffer(buf, dtype=np.int32) for buf in rows],
+                      axis=0)
+    assert np.array_equal(np.frombuffer(total, dtype=np.int64), expected)
+
 
 def builder(cls):
     inst = cls()